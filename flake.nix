@@ -168,6 +168,10 @@
           "--enable-internal-api-docs"
         ];
 
+        benchmarksConfigureFlags = [
+          "--enable-benchmarks"
+        ];
+
         nativeBuildDeps =
           [
             buildPackages.bison
@@ -191,9 +195,11 @@
             bzip2 xz brotli editline
             openssl sqlite
             libarchive
+            libgit2
             boost
             lowdown-nix
             libsodium
+            libblake3
           ]
           ++ lib.optionals stdenv.isLinux [libseccomp]
           ++ lib.optional stdenv.hostPlatform.isx86_64 libcpuid;
@@ -207,6 +213,10 @@
           buildPackages.doxygen
         ];
 
+        benchmarksDeps = [
+          gbenchmark
+        ];
+
         awsDeps = lib.optional (stdenv.isLinux || stdenv.isDarwin)
           (aws-sdk-cpp.override {
             apis = ["s3" "transfer"];
@@ -717,10 +727,10 @@
               ;
 
             buildInputs = buildDeps ++ propagatedDeps
-              ++ awsDeps ++ checkDeps ++ internalApiDocsDeps;
+              ++ awsDeps ++ checkDeps ++ internalApiDocsDeps ++ benchmarksDeps;
 
             configureFlags = configureFlags
-              ++ testConfigureFlags ++ internalApiDocsConfigureFlags
+              ++ testConfigureFlags ++ internalApiDocsConfigureFlags ++ benchmarksConfigureFlags
               ++ lib.optional (!canRunInstalled) "--disable-doc-gen";
 
             enableParallelBuilding = true;
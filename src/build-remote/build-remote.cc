@@ -5,6 +5,7 @@
 #include <memory>
 #include <tuple>
 #include <iomanip>
+#include <chrono>
 #if __APPLE__
 #include <sys/time.h>
 #endif
@@ -20,6 +21,8 @@
 #include "local-store.hh"
 #include "legacy.hh"
 #include "experimental-features.hh"
+#include "build-duration-cache.hh"
+#include "remote-builder-cache.hh"
 
 using namespace nix;
 using std::cin;
@@ -40,6 +43,36 @@ static AutoCloseFD openSlotLock(const Machine & m, uint64_t slot)
     return openLockFile(fmt("%s/%s-%d", currentLoad, escapeUri(m.storeUri), slot), true);
 }
 
+/* The upload throughput assumed for machines that nothing has been
+   uploaded to yet, in bytes per second. */
+static const uint64_t defaultUploadThroughput = 10 * 1024 * 1024;
+
+/* Only uploads of at least this many bytes are used to estimate the
+   throughput, since small ones are dominated by latency. */
+static const uint64_t minThroughputSample = 1024 * 1024;
+
+/* The build duration in seconds assumed for derivations that haven't
+   been built before. */
+static const uint64_t defaultBuildDuration = 60;
+
+/* A hook that has taken a slot on a machine writes the number of bytes
+   it still has to upload to the slot's lock file, so that other hooks
+   can see how much is queued for the machine. */
+static uint64_t readQueuedUpload(int fd)
+{
+    char buf[32];
+    auto n = pread(fd, buf, sizeof(buf) - 1, 0);
+    if (n <= 0) return 0;
+    return string2Int<uint64_t>(trim(std::string_view(buf, n))).value_or(0);
+}
+
+static void writeQueuedUpload(int fd, uint64_t bytes)
+{
+    auto s = std::to_string(bytes);
+    if (ftruncate(fd, 0) == -1 || pwrite(fd, s.data(), s.size(), 0) != (ssize_t) s.size())
+        debug("cannot record queued upload: %s", strerror(errno));
+}
+
 static bool allSupportedLocally(Store & store, const std::set<std::string>& requiredFeatures) {
     for (auto & feature : requiredFeatures)
         if (!store.systemFeatures.get().count(feature)) return false;
@@ -65,6 +98,11 @@ static int main_build_remote(int argc, char * * argv)
 
         FdSource source(STDIN_FILENO);
 
+        /* Only stay around for further builds if the parent asks for
+           it, since older versions of Nix expect the hook to exit
+           after a build. */
+        settings.persistentBuildHook = false;
+
         /* Read the parent's settings. */
         while (readInt(source)) {
             auto name = readString(source);
@@ -90,6 +128,13 @@ static int main_build_remote(int argc, char * * argv)
         std::shared_ptr<Store> sshStore;
         AutoCloseFD bestSlotLock;
 
+        std::shared_ptr<RemoteBuilderCache> builderCache;
+        try {
+            builderCache = getRemoteBuilderCache();
+        } catch (Error & e) {
+            debug("cannot open the remote builder cache: %s", e.what());
+        }
+
         auto machines = getMachines();
         debug("got %d remote builders", machines.size());
 
@@ -101,6 +146,12 @@ static int main_build_remote(int argc, char * * argv)
         std::optional<StorePath> drvPath;
         std::string storeUri;
 
+        /* The stores of the machines we have connected to, which keep
+           their connections open for further builds if we're
+           persistent. */
+        std::map<std::string, std::shared_ptr<Store>> stores;
+
+nextBuild:
         while (true) {
 
             try {
@@ -122,6 +173,34 @@ static int main_build_remote(int argc, char * * argv)
             /* It's possible to build this locally right now: */
             bool canBuildLocally = amWilling && couldBuildLocally;
 
+            /* The input closure of the derivation and the size of each
+               path in it, to estimate how much would have to be
+               uploaded to each machine. */
+            StorePathSet inputClosure;
+            std::map<StorePath, uint64_t> inputSizes;
+            uint64_t buildDuration = defaultBuildDuration;
+            if (machines.size() > 1 && builderCache) {
+                try {
+                    auto drv = store->readDerivation(*drvPath);
+                    StorePathSet inputPaths = drv.inputSrcs;
+                    for (auto & [inputDrv, inputNode] : drv.inputDrvs.map) {
+                        auto outputs = store->queryPartialDerivationOutputMap(inputDrv);
+                        for (auto & outputName : inputNode.value)
+                            if (auto i = outputs.find(outputName); i != outputs.end() && i->second)
+                                inputPaths.insert(*i->second);
+                    }
+                    store->computeFSClosure(inputPaths, inputClosure);
+                    for (auto & path : inputClosure)
+                        inputSizes.emplace(path, store->queryPathInfo(path)->narSize);
+                    if (auto stats = getBuildDurationCache()->lookup(drv.name, neededSystem))
+                        buildDuration = stats->duration;
+                } catch (Error & e) {
+                    debug("cannot determine the inputs of '%s': %s", store->printStorePath(*drvPath), e.what());
+                    inputClosure.clear();
+                    inputSizes.clear();
+                }
+            }
+
             /* Error ignored here, will be caught later */
             mkdir(currentLoad.c_str(), 0777);
 
@@ -133,7 +212,8 @@ static int main_build_remote(int argc, char * * argv)
                 bool rightType = false;
 
                 Machine * bestMachine = nullptr;
-                uint64_t bestLoad = 0;
+                uint64_t bestLoad = 0, bestMissing = 0;
+                double bestCost = 0;
                 for (auto & m : machines) {
                     debug("considering building on remote machine '%s'", m.storeUri);
 
@@ -147,7 +227,7 @@ static int main_build_remote(int argc, char * * argv)
                     {
                         rightType = true;
                         AutoCloseFD free;
-                        uint64_t load = 0;
+                        uint64_t load = 0, queuedUpload = 0;
                         for (uint64_t slot = 0; slot < m.maxJobs; ++slot) {
                             auto slotLock = openSlotLock(m, slot);
                             if (lockFile(slotLock.get(), ltWrite, false)) {
@@ -156,27 +236,57 @@ static int main_build_remote(int argc, char * * argv)
                                 }
                             } else {
                                 ++load;
+                                queuedUpload += readQueuedUpload(slotLock.get());
                             }
                         }
                         if (!free) {
                             continue;
                         }
+
+                        /* Estimate when the build would finish on this
+                           machine: after uploading the inputs it
+                           doesn't have, behind the uploads already
+                           queued for it, and building, which is slower
+                           if the machine is busy. */
+                        uint64_t missing = 0;
+                        uint64_t throughput = defaultUploadThroughput;
+                        if (builderCache) {
+                            if (!inputClosure.empty()) {
+                                auto valid = builderCache->queryValidPaths(m.storeUri, inputClosure);
+                                for (auto & [path, size] : inputSizes)
+                                    if (!valid.count(path)) missing += size;
+                            }
+                            throughput = std::max<uint64_t>(1,
+                                builderCache->uploadThroughput(m.storeUri).value_or(defaultUploadThroughput));
+                        }
+                        double cost =
+                            (double) (queuedUpload + missing) / throughput
+                            + buildDuration * (1.0 + (double) load / m.maxJobs) / std::max(1u, m.speedFactor);
+                        debug("estimated %.1f seconds to build on '%s' (%d bytes to upload, %d queued)",
+                            cost, m.storeUri, missing, queuedUpload);
+
                         bool best = false;
                         if (!bestSlotLock) {
                             best = true;
-                        } else if (load / m.speedFactor < bestLoad / bestMachine->speedFactor) {
+                        } else if (cost < bestCost) {
                             best = true;
-                        } else if (load / m.speedFactor == bestLoad / bestMachine->speedFactor) {
-                            if (m.speedFactor > bestMachine->speedFactor) {
+                        } else if (cost == bestCost) {
+                            if (load / m.speedFactor < bestLoad / bestMachine->speedFactor) {
                                 best = true;
-                            } else if (m.speedFactor == bestMachine->speedFactor) {
-                                if (load < bestLoad) {
+                            } else if (load / m.speedFactor == bestLoad / bestMachine->speedFactor) {
+                                if (m.speedFactor > bestMachine->speedFactor) {
                                     best = true;
+                                } else if (m.speedFactor == bestMachine->speedFactor) {
+                                    if (load < bestLoad) {
+                                        best = true;
+                                    }
                                 }
                             }
                         }
                         if (best) {
                             bestLoad = load;
+                            bestMissing = missing;
+                            bestCost = cost;
                             bestSlotLock = std::move(free);
                             bestMachine = &m;
                         }
@@ -232,14 +342,21 @@ static int main_build_remote(int argc, char * * argv)
                 futimens(bestSlotLock.get(), NULL);
 #endif
 
+                writeQueuedUpload(bestSlotLock.get(), bestMissing);
+
                 lock = -1;
 
                 try {
 
-                    Activity act(*logger, lvlTalkative, actUnknown, fmt("connecting to '%s'", bestMachine->storeUri));
+                    if (auto i = stores.find(bestMachine->storeUri); i != stores.end())
+                        sshStore = i->second;
+                    else {
+                        Activity act(*logger, lvlTalkative, actUnknown, fmt("connecting to '%s'", bestMachine->storeUri));
 
-                    sshStore = bestMachine->openStore();
-                    sshStore->connect();
+                        sshStore = bestMachine->openStore();
+                        sshStore->connect();
+                        stores.emplace(bestMachine->storeUri, sshStore);
+                    }
                     storeUri = bestMachine->storeUri;
 
                 } catch (std::exception & e) {
@@ -256,7 +373,10 @@ static int main_build_remote(int argc, char * * argv)
         }
 
 connected:
-        close(5);
+        /* A persistent hook may need fd 5 to report errors when
+           connecting for a later build. */
+        if (!settings.persistentBuildHook)
+            close(5);
 
         assert(sshStore);
 
@@ -282,10 +402,30 @@ connected:
 
         {
             Activity act(*logger, lvlTalkative, actUnknown, fmt("copying dependencies to '%s'", storeUri));
-            copyPaths(*store, *sshStore, store->parseStorePathSet(inputs), NoRepair, NoCheckSigs, substitute);
+
+            auto inputPaths = store->parseStorePathSet(inputs);
+            auto valid = sshStore->queryValidPaths(inputPaths, substitute);
+            StorePathSet missing;
+            uint64_t missingSize = 0;
+            for (auto & path : inputPaths)
+                if (!valid.count(path)) {
+                    missing.insert(path);
+                    missingSize += store->queryPathInfo(path)->narSize;
+                }
+
+            auto before = std::chrono::steady_clock::now();
+            copyPaths(*store, *sshStore, missing, NoRepair, NoCheckSigs, substitute);
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - before;
+
+            if (builderCache) {
+                builderCache->addValidPaths(storeUri, inputPaths);
+                if (missingSize >= minThroughputSample)
+                    builderCache->recordUpload(storeUri, missingSize, elapsed.count());
+            }
         }
 
         uploadLock = -1;
+        writeQueuedUpload(bestSlotLock.get(), 0);
 
         auto drv = store->readDerivation(*drvPath);
 
@@ -333,6 +473,12 @@ connected:
             optResult = std::move(res[0]);
         }
 
+        if (builderCache && optResult->success()) {
+            StorePathSet outputs;
+            for (auto & [_, realisation] : optResult->builtOutputs)
+                outputs.insert(realisation.outPath);
+            builderCache->addValidPaths(storeUri, outputs);
+        }
 
         auto outputHashes = staticOutputHashes(*store, drv);
         std::set<Realisation> missingRealisations;
@@ -376,7 +522,15 @@ connected:
             store->registerDrvOutput(realisation);
         }
 
-        return 0;
+        if (!settings.persistentBuildHook)
+            return 0;
+
+        /* Tell the parent that the build is done, and wait for the
+           next one. If anything went wrong, we've exited instead. */
+        bestSlotLock = -1;
+        sshStore.reset();
+        std::cerr << "# done\n";
+        goto nextBuild;
     }
 }
 
@@ -5,6 +5,7 @@
 #include "nixexpr.hh"
 #include "profiles.hh"
 #include "repl.hh"
+#include "startup-profile.hh"
 
 #include <nlohmann/json.hpp>
 
@@ -111,6 +112,7 @@ ref<Store> EvalCommand::getEvalStore()
 ref<EvalState> EvalCommand::getEvalState()
 {
     if (!evalState) {
+        StartupPhase phase("create evaluator");
         evalState =
             #if HAVE_BOEHMGC
             std::allocate_shared<EvalState>(traceable_allocator<EvalState>(),
@@ -5,6 +5,7 @@
 #include "installable-flake.hh"
 #include "outputs-spec.hh"
 #include "util.hh"
+#include "finally.hh"
 #include "command.hh"
 #include "attr-path.hh"
 #include "common-eval-args.hh"
@@ -565,10 +566,48 @@ std::vector<std::pair<ref<Installable>, BuiltPathWithResult>> Installable::build
     std::vector<DerivedPath> pathsToBuild;
     std::map<DerivedPath, std::vector<Aux>> backmap;
 
-    for (auto & i : installables) {
-        for (auto b : i->toDerivedPaths()) {
+    /* When there are several installables, don't let each
+       import-from-derivation block evaluation. Instead, evaluate the
+       installables that don't need one, build the outputs needed by
+       the others in one go, and then retry those. */
+    std::vector<std::optional<DerivedPathsWithInfo>> derivedPaths(installables.size());
+    std::vector<size_t> todo;
+    for (size_t n = 0; n < installables.size(); ++n)
+        todo.push_back(n);
+
+    while (!todo.empty()) {
+        std::vector<size_t> deferred;
+        std::set<ref<EvalState>> states;
+
+        for (auto n : todo) {
+            auto value = installables.size() > 1
+                ? installables[n].dynamic_pointer_cast<InstallableValue>()
+                : nullptr;
+            if (!value) {
+                derivedPaths[n] = installables[n]->toDerivedPaths();
+                continue;
+            }
+            auto & state = value->state;
+            state->deferImportsFromDerivation = true;
+            Finally resetDefer([&]() { state->deferImportsFromDerivation = false; });
+            try {
+                derivedPaths[n] = installables[n]->toDerivedPaths();
+            } catch (ImportFromDerivationPending &) {
+                deferred.push_back(n);
+                states.insert(state);
+            }
+        }
+
+        for (auto & state : states)
+            state->buildPendingImports();
+
+        todo = std::move(deferred);
+    }
+
+    for (size_t n = 0; n < installables.size(); ++n) {
+        for (auto & b : *derivedPaths[n]) {
             pathsToBuild.push_back(b.path);
-            backmap[b.path].push_back({.info = b.info, .installable = i});
+            backmap[b.path].push_back({.info = b.info, .installable = installables[n]});
         }
     }
 
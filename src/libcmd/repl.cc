@@ -113,6 +113,9 @@ NixRepl::NixRepl(const SearchPath & searchPath, nix::ref<Store> store, ref<EvalS
     , staticEnv(new StaticEnv(false, state->staticBaseEnv.get()))
     , historyFile(getDataDir() + "/nix/repl-history")
 {
+    /* So that `:reload` only needs to parse the files that have
+       changed. */
+    state->trackFileChanges = true;
 }
 
 
@@ -580,7 +583,7 @@ bool NixRepl::processLine(std::string line)
     }
 
     else if (command == ":l" || command == ":load") {
-        state->resetFileCache();
+        state->resetChangedFiles();
         loadFile(arg);
     }
 
@@ -589,7 +592,7 @@ bool NixRepl::processLine(std::string line)
     }
 
     else if (command == ":r" || command == ":reload") {
-        state->resetFileCache();
+        state->resetChangedFiles();
         reloadFiles();
     }
 
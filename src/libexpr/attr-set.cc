@@ -7,6 +7,10 @@
 namespace nix {
 
 
+unsigned long Bindings::nrSearchedLookups = 0;
+unsigned long Bindings::nrHashedLookups = 0;
+unsigned long Bindings::nrHashIndexes = 0;
+
 
 /* Allocate a new array of attributes for an attribute set with a specific
    capacity. The space is implicitly reserved after the Bindings
@@ -19,7 +23,12 @@ Bindings * EvalState::allocBindings(size_t capacity)
         throw Error("attribute set of size %d is too big", capacity);
     nrAttrsets++;
     nrAttrsInAttrsets += capacity;
-    return new (allocBytes(sizeof(Bindings) + sizeof(Attr) * capacity)) Bindings((Bindings::size_t) capacity);
+    if (currentAllocCounts) {
+        currentAllocCounts->attrsets++;
+        currentAllocCounts->bytes += sizeof(Bindings) + sizeof(Attr) * capacity;
+    }
+    return new (allocBytes(sizeof(Bindings) + sizeof(Attr) * capacity + Bindings::hashIndexBytes(capacity)))
+        Bindings((Bindings::size_t) capacity);
 }
 
 
@@ -57,6 +66,23 @@ Value & BindingsBuilder::alloc(std::string_view name, PosIdx pos)
 void Bindings::sort()
 {
     if (size_) std::sort(begin(), end());
+    invalidateHashIndex();
+}
+
+
+void Bindings::buildHashIndex()
+{
+    nrHashIndexes++;
+    auto index = hashIndex();
+    auto slots = hashIndexSlots(capacity_);
+    auto mask = slots - 1;
+    std::fill(index + 1, index + 1 + slots, 0);
+    for (size_t n = 0; n < size_; ++n) {
+        auto h = hashSymbol(attrs[n].name) & mask;
+        while (index[h + 1]) h = (h + 1) & mask;
+        index[h + 1] = n + 1;
+    }
+    index[0] = 1;
 }
 
 
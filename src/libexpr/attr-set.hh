@@ -5,6 +5,7 @@
 #include "symbol-table.hh"
 
 #include <algorithm>
+#include <bit>
 #include <optional>
 
 namespace nix {
@@ -44,13 +45,26 @@ static_assert(sizeof(Attr) == 2 * sizeof(uint32_t) + sizeof(Value *),
  * by its size and its capacity, the capacity being the number of Attr
  * elements allocated after this structure, while the size corresponds to
  * the number of elements already inserted in this structure.
+ *
+ * Sets with a capacity of at least `hashIndexThreshold` additionally
+ * reserve room for a hash index after the Attr elements. The index is
+ * built on the first lookup and dropped whenever the set is modified,
+ * so that lookups in huge sets (like the nixpkgs top level) don't need
+ * a binary search over the whole array.
  */
 class Bindings
 {
 public:
     typedef uint32_t size_t;
+    typedef Attr * iterator;
     PosIdx pos;
 
+    static constexpr size_t hashIndexThreshold = 256;
+
+    static unsigned long nrSearchedLookups;
+    static unsigned long nrHashedLookups;
+    static unsigned long nrHashIndexes;
+
 private:
     size_t size_, capacity_;
     Attr attrs[0];
@@ -58,21 +72,80 @@ private:
     Bindings(size_t capacity) : size_(0), capacity_(capacity) { }
     Bindings(const Bindings & bindings) = delete;
 
+    /**
+     * The hash index is an open-addressing table of 1-based positions
+     * in `attrs`, preceded by a word that is non-zero iff the table is
+     * up to date. Only valid if `capacity_ >= hashIndexThreshold`.
+     */
+    uint32_t * hashIndex()
+    {
+        return reinterpret_cast<uint32_t *>(&attrs[capacity_]);
+    }
+
+    static uint32_t hashSymbol(Symbol name)
+    {
+        uint32_t h = name.id * 0x9e3779b1;
+        return h ^ (h >> 16);
+    }
+
+    void invalidateHashIndex()
+    {
+        if (capacity_ >= hashIndexThreshold)
+            hashIndex()[0] = 0;
+    }
+
+    void buildHashIndex();
+
+    iterator findHashed(Symbol name)
+    {
+        auto index = hashIndex();
+        if (!index[0]) buildHashIndex();
+        nrHashedLookups++;
+        auto mask = hashIndexSlots(capacity_) - 1;
+        for (auto h = hashSymbol(name) & mask; index[h + 1]; h = (h + 1) & mask) {
+            auto i = &attrs[index[h + 1] - 1];
+            if (i->name == name) return i;
+        }
+        return end();
+    }
+
 public:
     size_t size() const { return size_; }
 
     bool empty() const { return !size_; }
 
-    typedef Attr * iterator;
+    /**
+     * Number of slots in the hash index of a set with the given
+     * capacity.
+     */
+    static uint64_t hashIndexSlots(size_t capacity)
+    {
+        return std::bit_ceil(uint64_t(capacity) * 2);
+    }
+
+    /**
+     * Number of bytes to reserve after the Attr elements of a set
+     * with the given capacity.
+     */
+    static uint64_t hashIndexBytes(size_t capacity)
+    {
+        return capacity >= hashIndexThreshold
+            ? (hashIndexSlots(capacity) + 1) * sizeof(uint32_t)
+            : 0;
+    }
 
     void push_back(const Attr & attr)
     {
         assert(size_ < capacity_);
         attrs[size_++] = attr;
+        invalidateHashIndex();
     }
 
     iterator find(Symbol name)
     {
+        if (size_ >= hashIndexThreshold)
+            return findHashed(name);
+        nrSearchedLookups++;
         Attr key(name, 0);
         iterator i = std::lower_bound(begin(), end(), key);
         if (i != end() && i->name == name) return i;
@@ -81,10 +154,8 @@ public:
 
     Attr * get(Symbol name)
     {
-        Attr key(name, 0);
-        iterator i = std::lower_bound(begin(), end(), key);
-        if (i != end() && i->name == name) return &*i;
-        return nullptr;
+        iterator i = find(name);
+        return i != end() ? &*i : nullptr;
     }
 
     iterator begin() { return &attrs[0]; }
@@ -0,0 +1,109 @@
+#include "eval.hh"
+#include "eval-inline.hh"
+#include "store-api.hh"
+
+#include <benchmark/benchmark.h>
+
+namespace nix {
+
+    static void symbolTableCreate(benchmark::State & state)
+    {
+        SymbolTable symbols;
+        std::vector<std::string> names;
+        for (int64_t n = 0; n < state.range(0); ++n)
+            names.push_back(fmt("symbol-%d", n));
+        for (auto & name : names)
+            symbols.create(name);
+
+        /* Nearly all calls are for symbols that already exist. */
+        for (auto _ : state)
+            for (auto & name : names)
+                benchmark::DoNotOptimize(symbols.create(name));
+        state.SetItemsProcessed(state.iterations() * names.size());
+    }
+
+    BENCHMARK(symbolTableCreate)->Range(1 << 4, 1 << 16);
+
+    static void bindingsLookup(benchmark::State & state)
+    {
+        EvalState evalState({}, openStore("dummy://"));
+
+        std::vector<Symbol> names;
+        auto attrs = evalState.buildBindings(state.range(0));
+        for (int64_t n = 0; n < state.range(0); ++n) {
+            auto name = evalState.symbols.create(fmt("attr-%d", n));
+            names.push_back(name);
+            attrs.alloc(name).mkInt(n);
+        }
+        auto bindings = attrs.finish();
+
+        for (auto _ : state)
+            for (auto & name : names)
+                benchmark::DoNotOptimize(bindings->get(name));
+        state.SetItemsProcessed(state.iterations() * names.size());
+    }
+
+    BENCHMARK(bindingsLookup)->Range(1, 1 << 12);
+
+    static void parse(benchmark::State & state, std::string expr)
+    {
+        EvalState evalState({}, openStore("dummy://"));
+        for (auto _ : state)
+            benchmark::DoNotOptimize(evalState.parseExprFromString(expr, evalState.rootPath(CanonPath::root)));
+    }
+
+    /* Evaluate `expr` deeply; it's parsed only once. */
+    static void eval(benchmark::State & state, std::string expr)
+    {
+        EvalState evalState({}, openStore("dummy://"));
+        auto e = evalState.parseExprFromString(expr, evalState.rootPath(CanonPath::root));
+        for (auto _ : state) {
+            Value v;
+            evalState.eval(e, v);
+            evalState.forceValueDeep(v);
+        }
+    }
+
+    static const std::string fib =
+        "let fib = n: if n < 2 then n else fib (n - 1) + fib (n - 2); in fib 20";
+
+    static const std::string listToAttrs =
+        "builtins.listToAttrs (map (n: { name = toString n; value = n; }) (builtins.genList (x: x) 10000))";
+
+    static const std::string foldl =
+        "builtins.foldl' (x: y: x + y) 0 (builtins.genList (x: x) 100000)";
+
+    static const std::string strings =
+        "builtins.concatStringsSep \",\" (map (n: \"item-${toString n}\") (builtins.genList (x: x) 10000))";
+
+    static const std::string attrUpdates =
+        "builtins.foldl' (acc: n: acc // { \"a${toString (n - n / 100 * 100)}\" = n; }) {} (builtins.genList (x: x) 10000)";
+
+    /* Instantiate derivations, i.e. write them to an in-memory store. */
+    static void instantiate(benchmark::State & state)
+    {
+        EvalState evalState({}, openStore("memory://"));
+        auto e = evalState.parseExprFromString(
+            fmt("map (n: (derivation { name = \"pkg-${toString n}\"; builder = \"/bin/sh\"; system = \"x86_64-linux\"; }).drvPath) (builtins.genList (x: x) %d)",
+                state.range(0)),
+            evalState.rootPath(CanonPath::root));
+        for (auto _ : state) {
+            Value v;
+            evalState.eval(e, v);
+            evalState.forceValueDeep(v);
+        }
+        state.SetItemsProcessed(state.iterations() * state.range(0));
+    }
+
+    BENCHMARK(instantiate)->Arg(1000);
+
+    BENCHMARK_CAPTURE(parse, fib, fib);
+    BENCHMARK_CAPTURE(parse, listToAttrs, listToAttrs);
+
+    BENCHMARK_CAPTURE(eval, fib, fib);
+    BENCHMARK_CAPTURE(eval, listToAttrs, listToAttrs);
+    BENCHMARK_CAPTURE(eval, foldl, foldl);
+    BENCHMARK_CAPTURE(eval, strings, strings);
+    BENCHMARK_CAPTURE(eval, attrUpdates, attrUpdates);
+
+}
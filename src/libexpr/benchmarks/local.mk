@@ -0,0 +1,17 @@
+bench: libexpr-benchmarks_RUN
+
+programs += libexpr-benchmarks
+
+libexpr-benchmarks_NAME = libnixexpr-benchmarks
+
+libexpr-benchmarks_DIR := $(d)
+
+libexpr-benchmarks_INSTALL_DIR :=
+
+libexpr-benchmarks_SOURCES := $(wildcard $(d)/*.cc)
+
+libexpr-benchmarks_CXXFLAGS += -I src/libexpr -I src/libutil -I src/libstore -I src/libfetchers $(GBENCHMARK_CFLAGS)
+
+libexpr-benchmarks_LIBS = libexpr libutil libstore libfetchers
+
+libexpr-benchmarks_LDFLAGS := $(GBENCHMARK_LIBS)
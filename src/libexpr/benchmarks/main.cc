@@ -0,0 +1,16 @@
+#include "eval.hh"
+#include "store-api.hh"
+
+#include <benchmark/benchmark.h>
+
+int main(int argc, char * * argv)
+{
+    nix::initLibStore();
+    nix::initGC();
+
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) return 1;
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
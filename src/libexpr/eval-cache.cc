@@ -4,6 +4,8 @@
 #include "eval-inline.hh"
 #include "store-api.hh"
 
+#include <thread>
+
 namespace nix::eval_cache {
 
 static const char * schema = R"sql(
@@ -15,8 +17,30 @@ create table if not exists Attributes (
     context     text,
     primary key (parent, name)
 );
+
+create table if not exists SearchRoots (
+    root        text primary key not null
+);
+
+create table if not exists SearchIndex (
+    root        text not null,
+    attrPath    text not null,
+    pname       text not null,
+    version     text not null,
+    description text not null,
+    primary key (root, attrPath)
+);
 )sql";
 
+/**
+ * The SQLite database backing an evaluation cache.
+ *
+ * Writes don't go to SQLite directly. They are queued and inserted in
+ * batches by a writer thread, so that evaluation doesn't block on
+ * SQLite. Since callers need the row ID of an attribute to refer to
+ * its children, row IDs are allocated here rather than by SQLite.
+ * Queued rows stay visible to `getAttr()` until they've been written.
+ */
 struct AttrDb
 {
     std::atomic_bool failed{false};
@@ -27,9 +51,13 @@ struct AttrDb
     {
         SQLite db;
         SQLiteStmt insertAttribute;
-        SQLiteStmt insertAttributeWithContext;
         SQLiteStmt queryAttribute;
         SQLiteStmt queryAttributes;
+        SQLiteStmt querySubtree;
+        SQLiteStmt querySearchRoot;
+        SQLiteStmt querySearchIndex;
+        SQLiteStmt insertSearchRoot;
+        SQLiteStmt insertSearchEntry;
         std::unique_ptr<SQLiteTxn> txn;
     };
 
@@ -37,6 +65,52 @@ struct AttrDb
 
     SymbolTable & symbols;
 
+    /**
+     * A row waiting to be inserted by the writer thread.
+     */
+    struct PendingRow
+    {
+        uint64_t seq;
+        AttrKey key;
+        AttrId rowId;
+        std::string name;
+        AttrType type;
+        std::variant<std::monostate, std::string, int64_t> value;
+        std::optional<std::string> context;
+    };
+
+    struct Pending
+    {
+        std::vector<PendingRow> queue;
+
+        /**
+         * The value of every attribute in `queue` or being written by
+         * the writer thread, tagged with the sequence number of the
+         * corresponding row.
+         */
+        std::map<AttrKey, std::pair<uint64_t, std::pair<AttrId, AttrValue>>> attrs;
+
+        uint64_t nextSeq = 0;
+
+        bool quit = false;
+    };
+
+    Sync<Pending> _pending;
+
+    std::condition_variable wakeup;
+
+    /**
+     * Number of queued rows that wakes up the writer thread.
+     */
+    static constexpr size_t batchSize = 1024;
+
+    /**
+     * Only accessed by the evaluating thread.
+     */
+    AttrId nextRowId = 0;
+
+    std::thread writerThread;
+
     AttrDb(
         const Store & cfg,
         const Hash & fingerprint,
@@ -57,10 +131,7 @@ struct AttrDb
         state->db.exec(schema);
 
         state->insertAttribute.create(state->db,
-            "insert or replace into Attributes(parent, name, type, value) values (?, ?, ?, ?)");
-
-        state->insertAttributeWithContext.create(state->db,
-            "insert or replace into Attributes(parent, name, type, value, context) values (?, ?, ?, ?, ?)");
+            "insert or replace into Attributes(rowid, parent, name, type, value, context) values (?, ?, ?, ?, ?, ?)");
 
         state->queryAttribute.create(state->db,
             "select rowid, type, value, context from Attributes where parent = ? and name = ?");
@@ -68,12 +139,47 @@ struct AttrDb
         state->queryAttributes.create(state->db,
             "select name from Attributes where parent = ?");
 
+        state->querySubtree.create(state->db,
+            R"sql(
+              with recursive Subtree(parent, name, depth, rowid, type, value, context) as (
+                select parent, name, 1, rowid, type, value, context from Attributes where parent = ?1
+                union all
+                select a.parent, a.name, s.depth + 1, a.rowid, a.type, a.value, a.context
+                from Attributes a join Subtree s on a.parent = s.rowid
+                where s.depth < ?2 and s.type = 1 -- FullAttrs
+              )
+              select parent, name, depth, rowid, type, value, context from Subtree
+            )sql");
+
+        state->querySearchRoot.create(state->db,
+            "select 1 from SearchRoots where root = ?");
+
+        state->querySearchIndex.create(state->db,
+            "select attrPath, pname, version, description from SearchIndex where root = ? order by rowid");
+
+        state->insertSearchRoot.create(state->db,
+            "insert or replace into SearchRoots(root) values (?)");
+
+        state->insertSearchEntry.create(state->db,
+            "insert or replace into SearchIndex(root, attrPath, pname, version, description) values (?, ?, ?, ?, ?)");
+
         state->txn = std::make_unique<SQLiteTxn>(state->db);
+
+        SQLiteStmt queryMaxRowId(state->db, "select coalesce(max(rowid), 0) from Attributes");
+        auto queryMaxRowId_(queryMaxRowId.use());
+        if (!queryMaxRowId_.next()) abort();
+        nextRowId = queryMaxRowId_.getInt(0) + 1;
+
+        writerThread = std::thread([this]() { writer(); });
     }
 
     ~AttrDb()
     {
         try {
+            _pending.lock()->quit = true;
+            wakeup.notify_one();
+            writerThread.join();
+
             auto state(_state->lock());
             if (!failed)
                 state->txn->commit();
@@ -96,32 +202,118 @@ struct AttrDb
         }
     }
 
+    void writer()
+    {
+        while (true) {
+            std::vector<PendingRow> batch;
+
+            {
+                auto pending(_pending.lock());
+                while (!pending->quit && pending->queue.size() < batchSize)
+                    pending.wait(wakeup);
+                if (pending->queue.empty()) return;
+                std::swap(batch, pending->queue);
+            }
+
+            /* Errors can't be propagated from this thread, so just
+               disable the cache, like doSQLite() does. */
+            if (!failed) {
+                try {
+                    auto state(_state->lock());
+
+                    for (auto & row : batch) {
+                        auto insertAttribute(state->insertAttribute.use());
+                        insertAttribute
+                            (row.rowId)
+                            (row.key.first)
+                            (row.name)
+                            (row.type);
+                        std::visit(overloaded {
+                            [&](std::monostate) { insertAttribute(0, false); },
+                            [&](const std::string & s) { insertAttribute(s); },
+                            [&](int64_t n) { insertAttribute(n); },
+                        }, row.value);
+                        insertAttribute(row.context ? *row.context : "", row.context.has_value());
+                        insertAttribute.exec();
+                    }
+                } catch (...) {
+                    ignoreException();
+                    failed = true;
+                }
+            }
+
+            auto pending(_pending.lock());
+            for (auto & row : batch) {
+                auto i = pending->attrs.find(row.key);
+                if (i != pending->attrs.end() && i->second.first == row.seq)
+                    pending->attrs.erase(i);
+            }
+        }
+    }
+
+    /**
+     * Queue a row for insertion. The caller must hold the lock on
+     * `_pending`.
+     */
+    AttrId queueRow(
+        Pending & pending,
+        AttrKey key,
+        AttrType type,
+        AttrValue && value,
+        std::variant<std::monostate, std::string, int64_t> && column = {},
+        std::optional<std::string> && context = {})
+    {
+        auto rowId = nextRowId++;
+        auto seq = pending.nextSeq++;
+        pending.queue.push_back(PendingRow {
+            .seq = seq,
+            .key = key,
+            .rowId = rowId,
+            .name = std::string(symbols[key.second]),
+            .type = type,
+            .value = std::move(column),
+            .context = std::move(context),
+        });
+        pending.attrs.insert_or_assign(key, std::make_pair(seq, std::make_pair(rowId, std::move(value))));
+        prefetched.erase(key);
+        return rowId;
+    }
+
+    AttrId setAttr(
+        AttrKey key,
+        AttrType type,
+        AttrValue && value,
+        std::variant<std::monostate, std::string, int64_t> && column = {},
+        std::optional<std::string> && context = {})
+    {
+        if (failed) return 0;
+
+        auto pending(_pending.lock());
+        auto rowId = queueRow(*pending, key, type, std::move(value), std::move(column), std::move(context));
+        if (pending->queue.size() >= batchSize)
+            wakeup.notify_one();
+        return rowId;
+    }
+
     AttrId setAttrs(
         AttrKey key,
         const std::vector<Symbol> & attrs)
     {
-        return doSQLite([&]()
-        {
-            auto state(_state->lock());
+        if (failed) return 0;
 
-            state->insertAttribute.use()
-                (key.first)
-                (symbols[key.second])
-                (AttrType::FullAttrs)
-                (0, false).exec();
+        /* Queue the children together with the parent, so that the
+           writer thread never writes the parent without them. */
+        auto pending(_pending.lock());
 
-            AttrId rowId = state->db.getLastInsertedRowId();
-            assert(rowId);
+        auto rowId = queueRow(*pending, key, AttrType::FullAttrs, attrs);
 
-            for (auto & attr : attrs)
-                state->insertAttribute.use()
-                    (rowId)
-                    (symbols[attr])
-                    (AttrType::Placeholder)
-                    (0, false).exec();
+        for (auto & attr : attrs)
+            queueRow(*pending, {rowId, attr}, AttrType::Placeholder, placeholder_t());
 
-            return rowId;
-        });
+        if (pending->queue.size() >= batchSize)
+            wakeup.notify_one();
+
+        return rowId;
     }
 
     AttrId setString(
@@ -129,196 +321,264 @@ struct AttrDb
         std::string_view s,
         const char * * context = nullptr)
     {
-        return doSQLite([&]()
-        {
-            auto state(_state->lock());
-
-            if (context) {
-                std::string ctx;
-                for (const char * * p = context; *p; ++p) {
-                    if (p != context) ctx.push_back(' ');
-                    ctx.append(*p);
-                }
-                state->insertAttributeWithContext.use()
-                    (key.first)
-                    (symbols[key.second])
-                    (AttrType::String)
-                    (s)
-                    (ctx).exec();
-            } else {
-                state->insertAttribute.use()
-                    (key.first)
-                    (symbols[key.second])
-                    (AttrType::String)
-                (s).exec();
+        if (context) {
+            std::string ctx;
+            NixStringContext context2;
+            for (const char * * p = context; *p; ++p) {
+                if (p != context) ctx.push_back(' ');
+                ctx.append(*p);
+                context2.insert(NixStringContextElem::parse(*p));
             }
-
-            return state->db.getLastInsertedRowId();
-        });
+            return setAttr(key, AttrType::String, string_t{std::string(s), std::move(context2)}, std::string(s), std::move(ctx));
+        } else
+            return setAttr(key, AttrType::String, string_t{std::string(s), {}}, std::string(s));
     }
 
     AttrId setBool(
         AttrKey key,
         bool b)
     {
-        return doSQLite([&]()
-        {
-            auto state(_state->lock());
-
-            state->insertAttribute.use()
-                (key.first)
-                (symbols[key.second])
-                (AttrType::Bool)
-                (b ? 1 : 0).exec();
-
-            return state->db.getLastInsertedRowId();
-        });
+        return setAttr(key, AttrType::Bool, b, (int64_t) (b ? 1 : 0));
     }
 
     AttrId setInt(
         AttrKey key,
         int n)
     {
-        return doSQLite([&]()
-        {
-            auto state(_state->lock());
-
-            state->insertAttribute.use()
-                (key.first)
-                (symbols[key.second])
-                (AttrType::Int)
-                (n).exec();
-
-            return state->db.getLastInsertedRowId();
-        });
+        return setAttr(key, AttrType::Int, int_t{n}, (int64_t) n);
     }
 
     AttrId setListOfStrings(
         AttrKey key,
         const std::vector<std::string> & l)
     {
-        return doSQLite([&]()
-        {
-            auto state(_state->lock());
-
-            state->insertAttribute.use()
-                (key.first)
-                (symbols[key.second])
-                (AttrType::ListOfStrings)
-                (concatStringsSep("\t", l)).exec();
-
-            return state->db.getLastInsertedRowId();
-        });
+        return setAttr(key, AttrType::ListOfStrings, std::vector<std::string>(l), concatStringsSep("\t", l));
     }
 
     AttrId setPlaceholder(AttrKey key)
     {
-        return doSQLite([&]()
-        {
-            auto state(_state->lock());
-
-            state->insertAttribute.use()
-                (key.first)
-                (symbols[key.second])
-                (AttrType::Placeholder)
-                (0, false).exec();
-
-            return state->db.getLastInsertedRowId();
-        });
+        return setAttr(key, AttrType::Placeholder, placeholder_t());
     }
 
     AttrId setMissing(AttrKey key)
     {
-        return doSQLite([&]()
-        {
-            auto state(_state->lock());
-
-            state->insertAttribute.use()
-                (key.first)
-                (symbols[key.second])
-                (AttrType::Missing)
-                (0, false).exec();
-
-            return state->db.getLastInsertedRowId();
-        });
+        return setAttr(key, AttrType::Missing, missing_t());
     }
 
     AttrId setMisc(AttrKey key)
     {
-        return doSQLite([&]()
-        {
-            auto state(_state->lock());
-
-            state->insertAttribute.use()
-                (key.first)
-                (symbols[key.second])
-                (AttrType::Misc)
-                (0, false).exec();
-
-            return state->db.getLastInsertedRowId();
-        });
+        return setAttr(key, AttrType::Misc, misc_t());
     }
 
     AttrId setFailed(AttrKey key)
     {
-        return doSQLite([&]()
-        {
-            auto state(_state->lock());
-
-            state->insertAttribute.use()
-                (key.first)
-                (symbols[key.second])
-                (AttrType::Failed)
-                (0, false).exec();
-
-            return state->db.getLastInsertedRowId();
-        });
+        return setAttr(key, AttrType::Failed, failed_t());
     }
 
-    std::optional<std::pair<AttrId, AttrValue>> getAttr(AttrKey key)
+    /**
+     * The columns of a row of the Attributes table that are needed to
+     * reconstruct its value.
+     */
+    struct Row
     {
-        auto state(_state->lock());
-
-        auto queryAttribute(state->queryAttribute.use()(key.first)(symbols[key.second]));
-        if (!queryAttribute.next()) return {};
+        AttrId rowId;
+        AttrType type;
+        std::string s;
+        int64_t n = 0;
+        std::optional<std::string> context;
+    };
 
-        auto rowId = (AttrId) queryAttribute.getInt(0);
-        auto type = (AttrType) queryAttribute.getInt(1);
+    /**
+     * Read the columns `rowid, type, value, context`, starting at
+     * column `col`.
+     */
+    static Row readRow(SQLiteStmt::Use & query, int col)
+    {
+        Row row {
+            .rowId = (AttrId) query.getInt(col),
+            .type = (AttrType) query.getInt(col + 1),
+        };
+        switch (row.type) {
+            case AttrType::String:
+            case AttrType::ListOfStrings:
+                row.s = query.getStr(col + 2);
+                break;
+            case AttrType::Bool:
+            case AttrType::Int:
+                row.n = query.getInt(col + 2);
+                break;
+            default:
+                break;
+        }
+        if (!query.isNull(col + 3))
+            row.context = query.getStr(col + 3);
+        return row;
+    }
 
-        switch (type) {
+    static AttrValue decodeRow(const Row & row, std::vector<Symbol> && children)
+    {
+        switch (row.type) {
             case AttrType::Placeholder:
-                return {{rowId, placeholder_t()}};
-            case AttrType::FullAttrs: {
-                // FIXME: expensive, should separate this out.
-                std::vector<Symbol> attrs;
-                auto queryAttributes(state->queryAttributes.use()(rowId));
-                while (queryAttributes.next())
-                    attrs.emplace_back(symbols.create(queryAttributes.getStr(0)));
-                return {{rowId, attrs}};
-            }
+                return placeholder_t();
+            case AttrType::FullAttrs:
+                return std::move(children);
             case AttrType::String: {
                 NixStringContext context;
-                if (!queryAttribute.isNull(3))
-                    for (auto & s : tokenizeString<std::vector<std::string>>(queryAttribute.getStr(3), ";"))
+                if (row.context)
+                    for (auto & s : tokenizeString<std::vector<std::string>>(*row.context, " "))
                         context.insert(NixStringContextElem::parse(s));
-                return {{rowId, string_t{queryAttribute.getStr(2), context}}};
+                return string_t{row.s, context};
             }
             case AttrType::Bool:
-                return {{rowId, queryAttribute.getInt(2) != 0}};
+                return row.n != 0;
             case AttrType::Int:
-                return {{rowId, int_t{queryAttribute.getInt(2)}}};
+                return int_t{row.n};
             case AttrType::ListOfStrings:
-                return {{rowId, tokenizeString<std::vector<std::string>>(queryAttribute.getStr(2), "\t")}};
+                return tokenizeString<std::vector<std::string>>(row.s, "\t");
             case AttrType::Missing:
-                return {{rowId, missing_t()}};
+                return missing_t();
             case AttrType::Misc:
-                return {{rowId, misc_t()}};
+                return misc_t();
             case AttrType::Failed:
-                return {{rowId, failed_t()}};
+                return failed_t();
             default:
                 throw Error("unexpected type in evaluation cache");
         }
     }
+
+    /**
+     * Attributes loaded by `prefetch()`. Only accessed by the
+     * evaluating thread.
+     */
+    std::map<AttrKey, std::pair<AttrId, AttrValue>> prefetched;
+
+    /**
+     * Load the cached descendants of the attribute set `rowId`, up
+     * to `depth` levels deep, with a single query.
+     */
+    void prefetch(AttrId rowId, unsigned int depth)
+    {
+        if (failed || depth == 0) return;
+
+        struct Child
+        {
+            AttrId parent;
+            Symbol name;
+            unsigned int depth;
+            Row row;
+        };
+
+        std::vector<Child> rows;
+        std::map<AttrId, std::vector<Symbol>> children;
+
+        try {
+            auto state(_state->lock());
+
+            auto querySubtree(state->querySubtree.use()(rowId)(depth));
+            while (querySubtree.next()) {
+                auto & child = rows.emplace_back(Child {
+                    .parent = (AttrId) querySubtree.getInt(0),
+                    .name = symbols.create(querySubtree.getStr(1)),
+                    .depth = (unsigned int) querySubtree.getInt(2),
+                    .row = readRow(querySubtree, 3),
+                });
+                children[child.parent].push_back(child.name);
+            }
+        } catch (SQLiteError &) {
+            ignoreException();
+            return;
+        }
+
+        for (auto & child : rows) {
+            /* The children of attribute sets at the deepest level
+               haven't been loaded. */
+            if (child.row.type == AttrType::FullAttrs && child.depth >= depth)
+                continue;
+            auto i = children.find(child.row.rowId);
+            prefetched.insert_or_assign({child.parent, child.name},
+                std::make_pair(child.row.rowId,
+                    decodeRow(child.row, i == children.end() ? std::vector<Symbol>() : std::move(i->second))));
+        }
+
+        debug("prefetched %d cached attributes", rows.size());
+    }
+
+    std::optional<std::pair<AttrId, AttrValue>> getAttr(AttrKey key)
+    {
+        {
+            auto pending(_pending.lock());
+            auto i = pending->attrs.find(key);
+            if (i != pending->attrs.end())
+                return i->second.second;
+        }
+
+        if (auto i = get(prefetched, key))
+            return *i;
+
+        auto state(_state->lock());
+
+        auto queryAttribute(state->queryAttribute.use()(key.first)(symbols[key.second]));
+        if (!queryAttribute.next()) return {};
+
+        auto row = readRow(queryAttribute, 0);
+
+        std::vector<Symbol> attrs;
+        if (row.type == AttrType::FullAttrs) {
+            // FIXME: expensive, should separate this out.
+            auto queryAttributes(state->queryAttributes.use()(row.rowId));
+            while (queryAttributes.next())
+                attrs.emplace_back(symbols.create(queryAttributes.getStr(0)));
+        }
+
+        return {{row.rowId, decodeRow(row, std::move(attrs))}};
+    }
+
+    std::optional<std::vector<SearchEntry>> getSearchIndex(const std::string & root)
+    {
+        if (failed) return std::nullopt;
+
+        try {
+            auto state(_state->lock());
+
+            if (!state->querySearchRoot.use()(root).next())
+                return std::nullopt;
+
+            std::vector<SearchEntry> entries;
+            auto querySearchIndex(state->querySearchIndex.use()(root));
+            while (querySearchIndex.next())
+                entries.push_back(SearchEntry {
+                    .attrPath = querySearchIndex.getStr(0),
+                    .pname = querySearchIndex.getStr(1),
+                    .version = querySearchIndex.getStr(2),
+                    .description = querySearchIndex.getStr(3),
+                });
+            return entries;
+        } catch (SQLiteError &) {
+            ignoreException();
+            failed = true;
+            return std::nullopt;
+        }
+    }
+
+    void setSearchIndex(const std::string & root, const std::vector<SearchEntry> & entries)
+    {
+        doSQLite([&]() {
+            auto state(_state->lock());
+
+            for (auto & entry : entries)
+                state->insertSearchEntry.use()
+                    (root)
+                    (entry.attrPath)
+                    (entry.pname)
+                    (entry.version)
+                    (entry.description)
+                    .exec();
+
+            state->insertSearchRoot.use()(root).exec();
+
+            return 0;
+        });
+    }
 };
 
 static std::shared_ptr<AttrDb> makeAttrDb(
@@ -396,6 +656,29 @@ Value & AttrCursor::getValue()
     return **_value;
 }
 
+void AttrCursor::prefetch(unsigned int depth)
+{
+    if (!root->db) return;
+
+    if (!cachedValue)
+        cachedValue = root->db->getAttr(getKey());
+
+    if (cachedValue && std::get_if<std::vector<Symbol>>(&cachedValue->second))
+        root->db->prefetch(cachedValue->first, depth);
+}
+
+std::optional<std::vector<SearchEntry>> AttrCursor::getSearchIndex()
+{
+    if (!root->db) return std::nullopt;
+    return root->db->getSearchIndex(getAttrPathStr());
+}
+
+void AttrCursor::setSearchIndex(const std::vector<SearchEntry> & entries)
+{
+    if (root->db)
+        root->db->setSearchIndex(getAttrPathStr(), entries);
+}
+
 std::vector<Symbol> AttrCursor::getAttrPath() const
 {
     if (parent) {
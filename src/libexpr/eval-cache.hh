@@ -70,6 +70,17 @@ typedef std::variant<
     std::vector<std::string>
     > AttrValue;
 
+/**
+ * A package found by `nix search`.
+ */
+struct SearchEntry
+{
+    std::string attrPath;
+    std::string pname;
+    std::string version;
+    std::string description;
+};
+
 class AttrCursor : public std::enable_shared_from_this<AttrCursor>
 {
     friend class EvalCache;
@@ -92,6 +103,26 @@ public:
         Value * value = nullptr,
         std::optional<std::pair<AttrId, AttrValue>> && cachedValue = {});
 
+    /**
+     * Load the cached attributes below this one, up to `depth`
+     * levels deep, using a single database query. This makes walking
+     * a large cached attribute tree much cheaper than looking up each
+     * attribute separately. Does nothing if this attribute isn't a
+     * cached attribute set.
+     */
+    void prefetch(unsigned int depth);
+
+    /**
+     * @return The packages that `nix search` found below this
+     * attribute in an earlier run, if they have been recorded with
+     * setSearchIndex(). Since the evaluation cache is specific to a
+     * locked flake, this list can be used instead of walking the
+     * attribute tree again.
+     */
+    std::optional<std::vector<SearchEntry>> getSearchIndex();
+
+    void setSearchIndex(const std::vector<SearchEntry> & entries);
+
     std::vector<Symbol> getAttrPath() const;
 
     std::vector<Symbol> getAttrPath(Symbol name) const;
@@ -45,6 +45,10 @@ Value * EvalState::allocValue()
 #endif
 
     nrValues++;
+    if (currentAllocCounts) {
+        currentAllocCounts->values++;
+        currentAllocCounts->bytes += sizeof(Value);
+    }
     return (Value *) p;
 }
 
@@ -54,6 +58,10 @@ Env & EvalState::allocEnv(size_t size)
 {
     nrEnvs++;
     nrValuesInEnvs += size;
+    if (currentAllocCounts) {
+        currentAllocCounts->envs++;
+        currentAllocCounts->bytes += sizeof(Env) + size * sizeof(Value *);
+    }
 
     Env * env;
 
@@ -91,6 +99,11 @@ void EvalState::forceValue(Value & v, const PosIdx pos)
 template<typename Callable>
 void EvalState::forceValue(Value & v, Callable getPos)
 {
+    if (stackLimit && (v.isThunk() || v.isApp()) && (char *) __builtin_frame_address(0) < stackLimit) [[unlikely]] {
+        runOnNewStack([&]() { forceValue(v, noPos); });
+        return;
+    }
+
     if (v.isThunk()) {
         Env * env = v.thunk.env;
         Expr * expr = v.thunk.expr;
@@ -0,0 +1,75 @@
+#include "eval-profiler.hh"
+#include "eval.hh"
+
+namespace nix {
+
+EvalProfiler::EvalProfiler(const EvalState & state, Path outFile, unsigned int frequency)
+    : state(state)
+    , outFile(std::move(outFile))
+{
+    auto interval = std::chrono::microseconds(1000000 / std::max(frequency, 1u));
+
+    timer = std::thread([this, interval]() {
+        auto quit_(quit.lock());
+        while (!*quit_) {
+            quit_.wait_for(wakeup, interval);
+            pendingTicks++;
+        }
+    });
+}
+
+
+EvalProfiler::~EvalProfiler()
+{
+    *quit.lock() = true;
+    wakeup.notify_all();
+    timer.join();
+
+    try {
+        /* Attribute the remaining time to the outermost frame. */
+        takeSample();
+
+        std::map<Frame, std::string> names;
+        std::ostringstream out;
+
+        for (auto & [stack, count] : samples) {
+            if (stack.empty())
+                out << "«top-level»";
+            for (auto [n, frame] : enumerate(stack)) {
+                auto i = names.find(frame);
+                if (i == names.end())
+                    i = names.emplace(frame, showFrame(frame)).first;
+                if (n) out << ';';
+                out << i->second;
+            }
+            out << ' ' << count << '\n';
+        }
+
+        writeFile(outFile, out.str());
+    } catch (...) {
+        ignoreException();
+    }
+}
+
+
+void EvalProfiler::takeSample()
+{
+    auto ticks = pendingTicks.exchange(0);
+    if (ticks) samples[stack] += ticks;
+}
+
+
+std::string EvalProfiler::showFrame(const Frame & frame) const
+{
+    if (frame.primOp)
+        return "builtins." + frame.primOp->name;
+
+    auto name = frame.lambda->name
+        ? std::string(state.symbols[frame.lambda->name])
+        : "«lambda»";
+
+    /* Semicolons separate frames in the collapsed stack format. */
+    return replaceStrings(fmt("%s at %s", name, state.positions[frame.lambda->pos]), ";", ":");
+}
+
+}
@@ -0,0 +1,98 @@
+#pragma once
+///@file
+
+#include "nixexpr.hh"
+#include "sync.hh"
+
+#include <atomic>
+#include <condition_variable>
+#include <thread>
+
+namespace nix {
+
+struct PrimOp;
+
+/**
+ * A low-overhead sampling profiler for the evaluator.
+ *
+ * The evaluator reports every lambda and primop call to the profiler,
+ * which maintains a stack of the active frames. A timer thread counts
+ * ticks at a fixed frequency; whenever a frame is entered or left, the
+ * ticks that elapsed since the last check are attributed to the current
+ * stack. When the profiler is destroyed, the samples are written in the
+ * "collapsed stack" format understood by `flamegraph.pl`.
+ */
+struct EvalProfiler
+{
+public:
+
+    struct Frame
+    {
+        const ExprLambda * lambda = nullptr;
+        const PrimOp * primOp = nullptr;
+
+        bool operator < (const Frame & other) const
+        {
+            return std::tie(lambda, primOp) < std::tie(other.lambda, other.primOp);
+        }
+    };
+
+    /**
+     * Pushes a frame for its lifetime, if a profiler is given.
+     */
+    struct FrameGuard
+    {
+        EvalProfiler * profiler;
+
+        FrameGuard(EvalProfiler * profiler, Frame frame)
+            : profiler(profiler)
+        {
+            if (profiler) profiler->enter(frame);
+        }
+
+        ~FrameGuard()
+        {
+            if (profiler) profiler->leave();
+        }
+    };
+
+private:
+
+    const EvalState & state;
+
+    const Path outFile;
+
+    std::vector<Frame> stack;
+
+    std::map<std::vector<Frame>, uint64_t> samples;
+
+    std::atomic<uint64_t> pendingTicks{0};
+
+    Sync<bool> quit{false};
+    std::condition_variable wakeup;
+    std::thread timer;
+
+    void takeSample();
+
+    std::string showFrame(const Frame & frame) const;
+
+public:
+
+    EvalProfiler(const EvalState & state, Path outFile, unsigned int frequency);
+
+    ~EvalProfiler();
+
+    void enter(Frame frame)
+    {
+        if (pendingTicks.load(std::memory_order_relaxed)) takeSample();
+        stack.push_back(frame);
+    }
+
+    void leave()
+    {
+        if (pendingTicks.load(std::memory_order_relaxed)) takeSample();
+        stack.pop_back();
+    }
+};
+
+}
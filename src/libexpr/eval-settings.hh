@@ -86,9 +86,36 @@ struct EvalSettings : Config
           `flamegraph.pl`.
         )"};
 
+    Setting<Path> evalProfileFile{this, "", "eval-profile-file",
+        R"(
+          If set to a path, the Nix evaluator will periodically sample the
+          stack of functions and builtins it is executing, and on exit
+          write the samples to that file in the "collapsed stack" format
+          used by `flamegraph.pl` from
+          [FlameGraph](https://github.com/brendangregg/FlameGraph). Each
+          line contains a semicolon-separated stack followed by the
+          number of samples taken in it.
+        )"};
+
+    Setting<unsigned int> evalProfilerFrequency{this, 99, "eval-profiler-frequency",
+        R"(
+          The number of samples per second taken by the evaluation
+          profiler enabled by
+          [`eval-profile-file`](#conf-eval-profile-file).
+        )"};
+
     Setting<bool> useEvalCache{this, true, "eval-cache",
         "Whether to use the flake evaluation cache."};
 
+    Setting<bool> useParseCache{this, false, "parse-cache",
+        R"(
+          If set to `true`, the Nix evaluator will store the parse trees of
+          the Nix files it reads in `~/.cache/nix/parse-cache-v1` and
+          reuse them on subsequent evaluations, instead of parsing files
+          that haven't changed again. Entries are keyed by the contents
+          and location of each file and by the Nix version.
+        )"};
+
     Setting<bool> ignoreExceptionsDuringTry{this, false, "ignore-try",
         R"(
           If set to true, ignore exceptions inside 'tryEval' calls when evaluating nix expressions in
@@ -97,6 +124,84 @@ struct EvalSettings : Config
 
     Setting<bool> traceVerbose{this, false, "trace-verbose",
         "Whether `builtins.traceVerbose` should trace its first argument when evaluated."};
+
+    Setting<bool> segmentedStack{this, false, "eval-segmented-stack",
+        R"(
+          If set to `true`, the evaluator continues on a newly allocated
+          stack segment whenever the current stack is nearly
+          exhausted. This allows deeply recursive Nix expressions to be
+          evaluated without raising the stack size limit (`ulimit -s`),
+          at the cost of some memory per segment.
+        )"};
+
+    Setting<bool> internStrings{this, false, "intern-strings",
+        R"(
+          If set to `true`, the evaluator shares a single copy between
+          short strings without string context that have the same
+          contents, such as output names or system types. This reduces
+          memory usage for evaluations that create many identical
+          strings, at the cost of a hash table lookup whenever a short
+          string is created. The number of interned and shared strings
+          is reported by [`NIX_SHOW_STATS`](@docroot@/command-ref/env-common.md#env-NIX_SHOW_STATS).
+        )"};
+
+    Setting<unsigned int> gcMarkers{this, 0, "gc-markers",
+        R"(
+          The number of threads used by the garbage collector to mark
+          reachable memory. `0` lets the garbage collector choose
+          (usually one thread per CPU), while `1` disables parallel
+          marking. The `GC_MARKERS` environment variable takes
+          precedence over this setting.
+
+          Like the other `gc-*` settings, this only takes effect when
+          set in the configuration file or through `NIX_CONFIG`, since
+          the garbage collector is initialised before command line
+          flags are processed.
+        )"};
+
+    Setting<bool> gcIncremental{this, false, "gc-incremental",
+        R"(
+          If set to `true`, the garbage collector runs in incremental,
+          generational mode, which does marking in small steps
+          interleaved with evaluation and mostly scans recently
+          modified memory. This shortens pauses on large heaps, but
+          adds overhead to writes to the heap and may be slower
+          overall.
+        )"};
+
+    Setting<bool> backgroundFetch{this, true, "background-fetch",
+        R"(
+          If set to `true`, `builtins.fetchurl` and
+          `builtins.fetchTarball` calls that specify a `sha256` return
+          the resulting store path right away and download it in the
+          background. Evaluation only waits for the download when it
+          needs the contents of the path, for instance to import it or
+          to instantiate a derivation that uses it. This lets pinned
+          sources be downloaded in parallel.
+        )"};
+
+    Setting<uint64_t> gcInitialHeapSize{this, 0, "gc-initial-heap-size",
+        R"(
+          The initial size in bytes of the heap of the garbage
+          collector. A larger heap avoids collections early in
+          evaluation. If set to `0`, Nix uses 25% of physical memory up
+          to a maximum of 384 MiB. The `GC_INITIAL_HEAP_SIZE`
+          environment variable takes precedence over this setting.
+        )"};
+
+    Setting<unsigned int> queryWorkers{this, 1, "query-workers",
+        R"(
+          The number of processes that `nix-env --query --available`
+          uses to evaluate the requested columns (such as `--out-path`,
+          `--drv-path` or `--description`) of the packages it lists.
+          The workers are forked after the package set has been
+          loaded, so they share the parsed expressions. `1` evaluates
+          everything in the `nix-env` process itself.
+
+          The workers don't have their own store connection, so this
+          is only safe for expressions that don't access the store or
+          the network while computing these columns, such as Nixpkgs.
+        )"};
 };
 
 extern EvalSettings evalSettings;
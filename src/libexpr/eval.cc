@@ -10,16 +10,19 @@
 #include "eval-inline.hh"
 #include "filetransfer.hh"
 #include "function-trace.hh"
+#include "eval-profiler.hh"
 #include "profiles.hh"
 #include "print.hh"
 #include "fs-input-accessor.hh"
 #include "memory-input-accessor.hh"
+#include "tracing.hh"
 
 #include <algorithm>
 #include <chrono>
 #include <iostream>
 #include <cstring>
 #include <optional>
+#include <unordered_set>
 #include <unistd.h>
 #include <sys/time.h>
 #include <sys/resource.h>
@@ -43,6 +46,9 @@
 
 #endif
 
+#include <boost/context/continuation.hpp>
+#include <boost/context/protected_fixedsize_stack.hpp>
+
 using json = nlohmann::json;
 
 namespace nix {
@@ -73,6 +79,49 @@ static char * dupString(const char * s)
 }
 
 
+/* Short strings without context, such as output names or system
+   types, are often created many times with the same contents. If
+   `intern-strings` is enabled, such strings share a single buffer.
+   The table is flushed when it gets too big; this is safe since
+   existing values keep their strings alive. */
+static constexpr size_t maxInternedStringSize = 64;
+static unsigned long nrStringsInterned = 0;
+static unsigned long nrStringsShared = 0;
+
+static const char * internString(std::string_view s)
+{
+    static constexpr size_t maxInternedStrings = 1 << 18;
+
+#if HAVE_BOEHMGC
+    typedef std::unordered_set<std::string_view, std::hash<std::string_view>, std::equal_to<std::string_view>,
+        traceable_allocator<std::string_view>> StringTable;
+#else
+    typedef std::unordered_set<std::string_view> StringTable;
+#endif
+    static Sync<StringTable> stringTable_;
+
+    auto stringTable(stringTable_.lock());
+
+    auto i = stringTable->find(s);
+    if (i != stringTable->end()) {
+        nrStringsShared++;
+        return i->data();
+    }
+
+    if (stringTable->size() >= maxInternedStrings)
+        stringTable->clear();
+
+    auto t = allocString(s.size() + 1);
+    memcpy(t, s.data(), s.size());
+    t[s.size()] = '\0';
+
+    stringTable->emplace(t, s.size());
+    nrStringsInterned++;
+
+    return t;
+}
+
+
 // When there's no need to write to the string, we can optimize away empty
 // string allocations.
 // This function handles makeImmutableString(std::string_view()) by returning
@@ -82,6 +131,8 @@ static const char * makeImmutableString(std::string_view s)
     const size_t size = s.size();
     if (size == 0)
         return "";
+    if (size <= maxInternedStringSize && evalSettings.internStrings)
+        return internString(s);
     auto t = allocString(size + 1);
     memcpy(t, s.data(), size);
     t[size] = '\0';
@@ -333,6 +384,119 @@ static BoehmGCStackAllocator boehmGCStackAllocator;
 #endif
 
 
+/* Stack segments used by the evaluator if `eval-segmented-stack` is
+   enabled. When the stack is nearly exhausted (i.e. less than
+   `evalStackMargin` bytes are left), evaluation continues on a new
+   segment. Freed segments are kept for reuse, since deep recursion
+   tends to cross the same segment boundary many times. */
+static constexpr size_t evalStackSegmentSize = 8 * 1024 * 1024;
+static constexpr size_t evalStackMargin = 512 * 1024;
+
+struct EvalStackAllocator
+{
+    boost::context::protected_fixedsize_stack stack{evalStackSegmentSize};
+
+    std::vector<boost::context::stack_context> freeSegments;
+
+    static char * bottom(const boost::context::stack_context & sctx)
+    {
+        /* The guard page is included in sctx.size. */
+        return static_cast<char *>(sctx.sp) - sctx.size + boost::context::stack_traits::page_size();
+    }
+
+    boost::context::stack_context allocate()
+    {
+        boost::context::stack_context sctx;
+        if (freeSegments.empty())
+            sctx = stack.allocate();
+        else {
+            sctx = freeSegments.back();
+            freeSegments.pop_back();
+        }
+#if HAVE_BOEHMGC
+        GC_add_roots(bottom(sctx), sctx.sp);
+#endif
+        return sctx;
+    }
+
+    void deallocate(boost::context::stack_context sctx)
+    {
+#if HAVE_BOEHMGC
+        GC_remove_roots(bottom(sctx), sctx.sp);
+#endif
+        if (freeSegments.size() < 4)
+            freeSegments.push_back(sctx);
+        else
+            stack.deallocate(sctx);
+    }
+};
+
+/* Wraps the (non-copyable) allocator for boost::context::callcc(). */
+struct EvalStackAllocatorRef
+{
+    EvalStackAllocator & allocator;
+    boost::context::stack_context & sctx;
+
+    boost::context::stack_context allocate()
+    {
+        return sctx = allocator.allocate();
+    }
+
+    void deallocate(boost::context::stack_context & sctx)
+    {
+        allocator.deallocate(sctx);
+    }
+};
+
+/* Return the stack limit of the current thread, i.e. the address
+   below which we switch to a new segment. */
+static char * getStackLimit()
+{
+    char * bottom = nullptr;
+    size_t size = 0;
+#if __linux__
+    pthread_attr_t attr;
+    if (pthread_getattr_np(pthread_self(), &attr)) return nullptr;
+    void * addr;
+    if (!pthread_attr_getstack(&attr, &addr, &size))
+        bottom = (char *) addr;
+    pthread_attr_destroy(&attr);
+#elif __APPLE__
+    size = pthread_get_stacksize_np(pthread_self());
+    bottom = (char *) pthread_get_stackaddr_np(pthread_self()) - size;
+#endif
+    if (!bottom || size < 2 * evalStackMargin) return nullptr;
+    return bottom + evalStackMargin;
+}
+
+void EvalState::runOnNewStack(std::function<void()> fn)
+{
+    static EvalStackAllocator allocator;
+
+    auto prevLimit = stackLimit;
+    std::exception_ptr ex;
+    boost::context::stack_context sctx;
+
+    boost::context::callcc(std::allocator_arg, EvalStackAllocatorRef{allocator, sctx},
+        [&](boost::context::continuation && c) {
+            /* Without the Boehm patch, the collector can't find the
+               main stack from a coroutine, so disable it. */
+            auto gcHook = create_coro_gc_hook();
+            stackLimit = EvalStackAllocator::bottom(sctx) + evalStackMargin;
+            try {
+                fn();
+            } catch (...) {
+                ex = std::current_exception();
+            }
+            return std::move(c);
+        });
+
+    stackLimit = prevLimit;
+
+    if (ex) std::rethrow_exception(ex);
+}
+
+
 static Symbol getName(const AttrName & name, EvalState & state, Env & env)
 {
     if (name.symbol) {
@@ -364,6 +528,18 @@ public:
 
 static bool gcInitialised = false;
 
+#if HAVE_BOEHMGC
+static uint64_t gcInitialHeapSize = 0;
+static uint64_t gcHeapResizes = 0;
+
+/* Called with the allocation lock held, so no synchronisation is
+   needed. */
+static void GC_CALLBACK onHeapResize(GC_word newSize)
+{
+    gcHeapResizes++;
+}
+#endif
+
 void initGC()
 {
     if (gcInitialised) return;
@@ -379,10 +555,34 @@ void initGC()
        there. */
     GC_set_no_dls(1);
 
+    /* The number of marker threads has to be set before the collector
+       is initialised. */
+#if GC_VERSION_MAJOR > 8 || (GC_VERSION_MAJOR == 8 && GC_VERSION_MINOR >= 2)
+    if (evalSettings.gcMarkers && !getEnv("GC_MARKERS"))
+        GC_set_markers_count(evalSettings.gcMarkers);
+#endif
+
+    /* Let the collector keep working in forked children, such as
+       the workers of `nix-env --query`. */
+#if GC_VERSION_MAJOR >= 8
+    GC_set_handle_fork(1);
+#endif
+
     GC_INIT();
 
     GC_set_oom_fn(oomHandler);
 
+#if GC_VERSION_MAJOR >= 8
+    GC_start_performance_measurement();
+#endif
+
+    GC_set_on_heap_resize(onHeapResize);
+
+    if (evalSettings.gcIncremental) {
+        debug("enabling incremental garbage collection");
+        GC_enable_incremental();
+    }
+
     StackAllocator::defaultAllocator = &boehmGCStackAllocator;
 
 
@@ -398,25 +598,31 @@ void initGC()
        physical RAM, up to a maximum of 384 MiB) so that in most cases
        we don't need to garbage collect at all.  (Collection has a
        fairly significant overhead.)  The heap size can be overridden
-       through libgc's GC_INITIAL_HEAP_SIZE environment variable.  We
-       should probably also provide a nix.conf setting for this.  Note
-       that GC_expand_hp() causes a lot of virtual, but not physical
+       through the gc-initial-heap-size setting or libgc's
+       GC_INITIAL_HEAP_SIZE environment variable.  Note that
+       GC_expand_hp() causes a lot of virtual, but not physical
        (resident) memory to be allocated.  This might be a problem on
        systems that don't overcommit. */
     if (!getEnv("GC_INITIAL_HEAP_SIZE")) {
-        size_t size = 32 * 1024 * 1024;
+        size_t size = evalSettings.gcInitialHeapSize;
+        if (!size) {
+            size = 32 * 1024 * 1024;
 #if HAVE_SYSCONF && defined(_SC_PAGESIZE) && defined(_SC_PHYS_PAGES)
-        size_t maxSize = 384 * 1024 * 1024;
-        long pageSize = sysconf(_SC_PAGESIZE);
-        long pages = sysconf(_SC_PHYS_PAGES);
-        if (pageSize != -1)
-            size = (pageSize * pages) / 4; // 25% of RAM
-        if (size > maxSize) size = maxSize;
+            size_t maxSize = 384 * 1024 * 1024;
+            long pageSize = sysconf(_SC_PAGESIZE);
+            long pages = sysconf(_SC_PHYS_PAGES);
+            if (pageSize != -1)
+                size = (pageSize * pages) / 4; // 25% of RAM
+            if (size > maxSize) size = maxSize;
 #endif
+        }
         debug("setting initial heap size to %1% bytes", size);
         GC_expand_hp(size);
     }
 
+    gcInitialHeapSize = GC_get_heap_size();
+    gcHeapResizes = 0;
+
 #endif
 
     gcInitialised = true;
@@ -523,6 +729,7 @@ EvalState::EvalState(
     , debugQuit(false)
     , trylevel(0)
     , regexCache(makeRegexCache())
+    , replaceStringsCache(makeReplaceStringsCache())
 #if HAVE_BOEHMGC
     , valueAllocCache(std::allocate_shared<void *>(traceable_allocator<void *>(), nullptr))
     , env1AllocCache(std::allocate_shared<void *>(traceable_allocator<void *>(), nullptr))
@@ -532,10 +739,25 @@ EvalState::EvalState(
 {
     countCalls = getEnv("NIX_COUNT_CALLS").value_or("0") != "0";
 
+    if (getEnv("NIX_COUNT_ALLOCS").value_or("0") != "0")
+        currentAllocCounts = &allocCounts[{nullptr, nullptr}];
+
+    timeCalls = getEnv("NIX_TIME_CALLS").value_or("0") != "0";
+
+    if (evalSettings.segmentedStack)
+        stackLimit = getStackLimit();
+
+    if (evalSettings.evalProfileFile.get() != "")
+        profiler = std::make_unique<EvalProfiler>(*this, evalSettings.evalProfileFile, evalSettings.evalProfilerFrequency);
+
     assert(gcInitialised);
 
     static_assert(sizeof(Env) <= 16, "environment must be <= 16 bytes");
 
+    /* Evaluations tend to call `builtins.readDir` on the same
+       directories many times, so keep their listings around. */
+    rootFS->cacheDirectories();
+
     /* Initialise the Nix expression search path. */
     if (!evalSettings.pureEval) {
         for (auto & i : _searchPath.elements)
@@ -578,6 +800,100 @@ EvalState::EvalState(
 
 EvalState::~EvalState()
 {
+    for (auto & [storePath, fetch] : pendingFetches) {
+        try {
+            fetch.get();
+        } catch (...) {
+            ignoreException();
+        }
+    }
+}
+
+
+struct EvalState::CallSiteGuard
+{
+    EvalState & state;
+    AllocCounts * prev;
+
+    CallSiteGuard(EvalState & state, const ExprLambda * lambda, const PrimOp * primOp)
+        : state(state), prev(state.currentAllocCounts)
+    {
+        if (prev) state.currentAllocCounts = &state.allocCounts[{lambda, primOp}];
+        if (state.timeCalls) {
+            auto & times = state.callTimes[{lambda, primOp}];
+            times.calls++;
+            times.active++;
+            state.callTimers.push_back({&times, std::chrono::steady_clock::now()});
+        }
+    }
+
+    ~CallSiteGuard()
+    {
+        state.currentAllocCounts = prev;
+        if (state.timeCalls) {
+            auto timer = state.callTimers.back();
+            state.callTimers.pop_back();
+            auto elapsed = std::chrono::steady_clock::now() - timer.start;
+            timer.times->self += elapsed - timer.children;
+            if (--timer.times->active == 0)
+                timer.times->total += elapsed;
+            if (!state.callTimers.empty())
+                state.callTimers.back().children += elapsed;
+        }
+    }
+};
+
+
+EvalState::EnvStack::~EnvStack()
+{
+    for (auto p : chunks)
+#if HAVE_BOEHMGC
+        GC_FREE(p);
+#else
+        free(p);
+#endif
+}
+
+
+Env * EvalState::EnvStack::alloc(size_t size)
+{
+    size_t bytes = sizeof(Env) + size * sizeof(Value *);
+    bytes = (bytes + alignof(Env) - 1) & ~(alignof(Env) - 1);
+    if (bytes > chunkSize) return nullptr;
+
+    if (offset + bytes > chunkSize) {
+        chunk++;
+        offset = 0;
+    }
+
+    if (chunk == chunks.size()) {
+        /* Chunks are zeroed when allocated and when environments are
+           released, so there is no need to clear the environment
+           here. */
+#if HAVE_BOEHMGC
+        auto p = (char *) GC_MALLOC_UNCOLLECTABLE(chunkSize);
+#else
+        auto p = (char *) calloc(1, chunkSize);
+#endif
+        if (!p) throw std::bad_alloc();
+        chunks.push_back(p);
+    }
+
+    auto env = (Env *) (chunks[chunk] + offset);
+    offset += bytes;
+    env->type = Env::Plain;
+    return env;
+}
+
+
+EvalState::StackEnv::~StackEnv()
+{
+    if (!env) return;
+    /* Clear the environment so that the garbage collector doesn't
+       keep its values alive. */
+    memset((void *) env, 0, sizeof(Env) + size * sizeof(Value *));
+    stack.chunk = chunk;
+    stack.offset = offset;
 }
 
 
@@ -605,6 +921,14 @@ SourcePath EvalState::checkSourcePath(const SourcePath & path_)
     // Don't check non-rootFS accessors, they're in a different namespace.
     if (path_.accessor != ref<InputAccessor>(rootFS)) return path_;
 
+    if (!pendingFetches.empty()) {
+        std::optional<StorePath> pending;
+        for (auto & [storePath, fetch] : pendingFetches)
+            if (isDirOrInDir(path_.path.abs(), store->printStorePath(storePath)))
+                pending = storePath;
+        if (pending) waitForFetch(*pending);
+    }
+
     if (!allowedPaths) return path_;
 
     auto i = resolvedPaths.find(path_.path.abs());
@@ -648,6 +972,31 @@ SourcePath EvalState::checkSourcePath(const SourcePath & path_)
 }
 
 
+void EvalState::fetchInBackground(const StorePath & storePath, std::function<void()> fetch)
+{
+    if (pendingFetches.count(storePath)) return;
+    pendingFetches.emplace(storePath, std::async(std::launch::async, std::move(fetch)).share());
+}
+
+
+void EvalState::waitForFetch(const StorePath & storePath)
+{
+    auto i = pendingFetches.find(storePath);
+    if (i == pendingFetches.end()) return;
+    /* Keep failed fetches, so that later uses of the path get the
+       same error. */
+    i->second.get();
+    pendingFetches.erase(i);
+}
+
+
+void EvalState::waitForFetches()
+{
+    for (auto & [_, fetch] : pendingFetches)
+        fetch.wait();
+}
+
+
 void EvalState::checkURI(const std::string & uri)
 {
     if (!evalSettings.restrictEval) return;
@@ -941,16 +1290,61 @@ void Value::mkString(std::string_view s)
 }
 
 
-static void copyContextToValue(Value & v, const NixStringContext & context)
+/* String contexts are never modified once they're attached to a
+   value, so strings with the same context can share a single
+   context array. This avoids copying the (often large) contexts of
+   builder scripts and derivation attributes into every string
+   derived from them. The table is flushed when it gets too big; this
+   is safe since existing values keep their arrays alive. */
+static unsigned long nrContextsInterned = 0;
+static unsigned long nrContextsShared = 0;
+
+static const char * * internContext(const NixStringContext & context)
 {
-    if (!context.empty()) {
-        size_t n = 0;
-        v.string.context = (const char * *)
-            allocBytes((context.size() + 1) * sizeof(char *));
-        for (auto & i : context)
-            v.string.context[n++] = dupString(i.to_string().c_str());
-        v.string.context[n] = 0;
+    static constexpr size_t maxInternedContexts = 1 << 16;
+
+#if HAVE_BOEHMGC
+    typedef std::unordered_map<std::string, const char * *, std::hash<std::string>, std::equal_to<std::string>,
+        traceable_allocator<std::pair<const std::string, const char * *>>> ContextTable;
+#else
+    typedef std::unordered_map<std::string, const char * *> ContextTable;
+#endif
+    static Sync<ContextTable> contextTable_;
+
+    /* The encoded elements, separated by NUL characters. */
+    std::string key;
+    for (auto & i : context) {
+        key += i.to_string();
+        key.push_back(0);
+    }
+
+    auto contextTable(contextTable_.lock());
+
+    auto i = contextTable->find(key);
+    if (i != contextTable->end()) {
+        nrContextsShared++;
+        return i->second;
     }
+
+    if (contextTable->size() >= maxInternedContexts)
+        contextTable->clear();
+
+    size_t n = 0;
+    auto res = (const char * *) allocBytes((context.size() + 1) * sizeof(char *));
+    for (const char * p = key.data(); p < key.data() + key.size(); p += strlen(p) + 1)
+        res[n++] = dupString(p);
+    res[n] = 0;
+
+    contextTable->emplace(std::move(key), res);
+    nrContextsInterned++;
+
+    return res;
+}
+
+static void copyContextToValue(Value & v, const NixStringContext & context)
+{
+    if (!context.empty())
+        v.string.context = internContext(context);
 }
 
 void Value::mkString(std::string_view s, const NixStringContext & context)
@@ -986,8 +1380,15 @@ inline Value * EvalState::lookupVar(Env * env, const ExprVar & var, bool noEval)
             env->values[0] = v;
             env->type = Env::HasWithAttrs;
         }
-        Bindings::iterator j = env->values[0]->attrs->find(var.name);
-        if (j != env->values[0]->attrs->end()) {
+        auto attrs = env->values[0]->attrs;
+        /* Attribute names are unique, so if the attribute at the hinted
+           index has the right name, it's the one we're looking for. */
+        Bindings::iterator j =
+            var.withIndexHint < attrs->size() && attrs->begin()[var.withIndexHint].name == var.name
+            ? attrs->begin() + var.withIndexHint
+            : attrs->find(var.name);
+        if (j != attrs->end()) {
+            var.withIndexHint = j - attrs->begin();
             if (countCalls) attrSelects[j->pos]++;
             return j->value;
         }
@@ -1003,6 +1404,10 @@ void EvalState::mkList(Value & v, size_t size)
     if (size > 2)
         v.bigList.elems = (Value * *) allocBytes(size * sizeof(Value *));
     nrListElems += size;
+    if (currentAllocCounts) {
+        currentAllocCounts->listElems += size;
+        if (size > 2) currentAllocCounts->bytes += size * sizeof(Value *);
+    }
 }
 
 
@@ -1174,15 +1579,23 @@ void EvalState::evalFile(const SourcePath & path_, Value & v, bool mustBeTrivial
     }
 
     printTalkative("evaluating file '%1%'", resolvedPath);
+    TraceSpan span("eval", "eval %s", resolvedPath.to_string());
     Expr * e = nullptr;
 
     auto j = fileParseCache.find(resolvedPath);
     if (j != fileParseCache.end())
         e = j->second;
 
-    if (!e)
+    if (!e) {
         e = parseExprFromFile(checkSourcePath(resolvedPath));
 
+        if (trackFileChanges && &*resolvedPath.accessor == &*rootFS) {
+            auto st = lstat(resolvedPath.path.abs());
+            fileStamps.insert_or_assign(resolvedPath.path.abs(),
+                FileStamp { st.st_ino, st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec });
+        }
+    }
+
     fileParseCache[resolvedPath] = e;
 
     try {
@@ -1215,6 +1628,51 @@ void EvalState::resetFileCache()
 {
     fileEvalCache.clear();
     fileParseCache.clear();
+    fileStamps.clear();
+}
+
+
+bool EvalState::resetFileCacheIfChanged()
+{
+    assert(trackFileChanges);
+
+    for (auto & [path, stamp] : fileStamps) {
+        struct stat st;
+        if (::lstat(path.c_str(), &st) == -1
+            || stamp != FileStamp { st.st_ino, st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec })
+        {
+            debug("file '%s' has changed, resetting the file cache", path);
+            resetFileCache();
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+void EvalState::resetChangedFiles()
+{
+    assert(trackFileChanges);
+
+    /* The value of an unchanged file may still depend on a changed
+       one, through an import that is only forced later. So no file
+       values can be kept. Parse trees don't depend on other files,
+       though. */
+    fileEvalCache.clear();
+
+    for (auto i = fileStamps.begin(); i != fileStamps.end(); ) {
+        auto & [path, stamp] = *i;
+        struct stat st;
+        if (::lstat(path.c_str(), &st) == -1
+            || stamp != FileStamp { st.st_ino, st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec })
+        {
+            debug("file '%s' has changed", path);
+            fileParseCache.erase(rootPath(CanonPath(path)));
+            i = fileStamps.erase(i);
+        } else
+            ++i;
+    }
 }
 
 
@@ -1281,8 +1739,31 @@ void ExprPath::eval(EvalState & state, Env & env, Value & v)
 }
 
 
+Value * ExprAttrs::maybeThunk(EvalState & state, Env & env)
+{
+    if (!constant) return Expr::maybeThunk(state, env);
+    if (!constantValue) {
+        /* The attributes don't depend on the environment, so the
+           value can be shared by all evaluations. */
+        auto v = state.allocValue();
+        auto bindings = state.buildBindings(attrs.size());
+        for (auto & i : attrs)
+            bindings.insert(i.first, i.second.e->maybeThunk(state, env), i.second.pos);
+        v->mkAttrs(bindings.alreadySorted());
+        v->attrs->pos = pos;
+        constantValue = allocRootValue(v);
+    }
+    return *constantValue;
+}
+
+
 void ExprAttrs::eval(EvalState & state, Env & env, Value & v)
 {
+    if (constant) {
+        v = *maybeThunk(state, env);
+        return;
+    }
+
     v.mkAttrs(state.buildBindings(attrs.size() + dynamicAttrs.size()).finish());
     auto dynamicEnv = &env;
 
@@ -1383,8 +1864,27 @@ void ExprLet::eval(EvalState & state, Env & env, Value & v)
 }
 
 
+Value * ExprList::maybeThunk(EvalState & state, Env & env)
+{
+    if (!constant) return Expr::maybeThunk(state, env);
+    if (!constantValue) {
+        auto v = state.allocValue();
+        state.mkList(*v, elems.size());
+        for (auto [n, v2] : enumerate(v->listItems()))
+            const_cast<Value * &>(v2) = elems[n]->maybeThunk(state, env);
+        constantValue = allocRootValue(v);
+    }
+    return *constantValue;
+}
+
+
 void ExprList::eval(EvalState & state, Env & env, Value & v)
 {
+    if (constant) {
+        v = *maybeThunk(state, env);
+        return;
+    }
+
     state.mkList(v, elems.size());
     for (auto [n, v2] : enumerate(v.listItems()))
         const_cast<Value * &>(v2) = elems[n]->maybeThunk(state, env);
@@ -1515,6 +2015,11 @@ void ExprLambda::eval(EvalState & state, Env & env, Value & v)
 
 void EvalState::callFunction(Value & fun, size_t nrArgs, Value * * args, Value & vRes, const PosIdx pos)
 {
+    if (stackLimit && (char *) __builtin_frame_address(0) < stackLimit) [[unlikely]] {
+        runOnNewStack([&]() { callFunction(fun, nrArgs, args, vRes, pos); });
+        return;
+    }
+
     auto trace = evalSettings.traceFunctionCalls
         ? std::make_unique<FunctionCallTrace>(positions[pos])
         : nullptr;
@@ -1540,11 +2045,19 @@ void EvalState::callFunction(Value & fun, size_t nrArgs, Value * * args, Value &
         if (vCur.isLambda()) {
 
             ExprLambda & lambda(*vCur.lambda.fun);
+            CallSiteGuard callSite(*this, &lambda, nullptr);
 
             auto size =
                 (!lambda.arg ? 0 : 1) +
                 (lambda.hasFormals() ? lambda.formals->formals.size() : 0);
-            Env & env2(allocEnv(size));
+
+            /* If nothing can refer to the environment once the body has
+               been evaluated, allocate it on the environment stack. The
+               debugger keeps environments around, so don't do this if
+               it's enabled. */
+            StackEnv stackEnv(envStack, size, !lambda.envEscapes && !debugRepl);
+            if (stackEnv.env) nrStackEnvs++;
+            Env & env2(stackEnv.env ? *stackEnv.env : allocEnv(size));
             env2.up = vCur.lambda.env;
 
             Displacement displ = 0;
@@ -1623,6 +2136,8 @@ void EvalState::callFunction(Value & fun, size_t nrArgs, Value * * args, Value &
                         : "anonymous lambda")
                     : nullptr;
 
+                EvalProfiler::FrameGuard frame(profiler.get(), {.lambda = &lambda});
+
                 lambda.body->eval(*this, env2, vCur);
             } catch (Error & e) {
                 if (loggerSettings.showTrace.get()) {
@@ -1659,6 +2174,8 @@ void EvalState::callFunction(Value & fun, size_t nrArgs, Value * * args, Value &
                 if (countCalls) primOpCalls[name]++;
 
                 try {
+                    EvalProfiler::FrameGuard frame(profiler.get(), {.primOp = vCur.primOp});
+                    CallSiteGuard callSite(*this, nullptr, vCur.primOp);
                     vCur.primOp->fun(*this, noPos, args, vCur);
                 } catch (Error & e) {
                     addErrorTrace(e, pos, "while calling the '%1%' builtin", name);
@@ -1707,6 +2224,8 @@ void EvalState::callFunction(Value & fun, size_t nrArgs, Value * * args, Value &
                     // 1. Unify this and above code. Heavily redundant.
                     // 2. Create a fake env (arg1, arg2, etc.) and a fake expr (arg1: arg2: etc: builtins.name arg1 arg2 etc)
                     //    so the debugger allows to inspect the wrong parameters passed to the builtin.
+                    EvalProfiler::FrameGuard frame(profiler.get(), {.primOp = primOp->primOp});
+                    CallSiteGuard callSite(*this, nullptr, primOp->primOp);
                     primOp->primOp->fun(*this, noPos, vArgs, vCur);
                 } catch (Error & e) {
                     addErrorTrace(e, pos, "while calling the '%1%' builtin", name);
@@ -1751,6 +2270,27 @@ void ExprCall::eval(EvalState & state, Env & env, Value & v)
     for (size_t i = 0; i < args.size(); ++i)
         vArgs[i] = args[i]->maybeThunk(state, env);
 
+    /* Fast path for the very common case of a saturated call to a
+       builtin (e.g. `builtins.elem x xs`): call the primop directly
+       instead of going through the generic application loop in
+       callFunction(). */
+    if (vFun.isPrimOp() && vFun.primOp->arity == args.size() && !evalSettings.traceFunctionCalls) {
+        auto primOp = vFun.primOp;
+        state.nrPrimOpCalls++;
+        if (state.countCalls) state.primOpCalls[primOp->name]++;
+        Value vRes;
+        try {
+            EvalProfiler::FrameGuard frame(state.profiler.get(), {.primOp = primOp});
+            EvalState::CallSiteGuard callSite(state, nullptr, primOp);
+            primOp->fun(state, noPos, vArgs, vRes);
+        } catch (Error & e) {
+            state.addErrorTrace(e, pos, "while calling the '%1%' builtin", primOp->name);
+            throw;
+        }
+        v = vRes;
+        return;
+    }
+
     state.callFunction(vFun, args.size(), vArgs, v, pos);
 }
 
@@ -1885,35 +2425,59 @@ void ExprOpImpl::eval(EvalState & state, Env & env, Value & v)
 
 void ExprOpUpdate::eval(EvalState & state, Env & env, Value & v)
 {
-    Value v1, v2;
-    state.evalAttrs(env, e1, v1, pos, "in the left operand of the update (//) operator");
-    state.evalAttrs(env, e2, v2, pos, "in the right operand of the update (//) operator");
+    /* `//` is right-associative, so `a // b // c` is parsed as
+       `a // (b // c)`. Merge the whole chain at once rather than
+       copying the attributes of each intermediate set. */
+    size_t nrSets = 2;
+    for (auto e = dynamic_cast<ExprOpUpdate *>(e2); e; e = dynamic_cast<ExprOpUpdate *>(e->e2))
+        nrSets++;
 
-    state.nrOpUpdates++;
+    Value vs[nrSets];
 
-    if (v1.attrs->size() == 0) { v = v2; return; }
-    if (v2.attrs->size() == 0) { v = v1; return; }
+    ExprOpUpdate * last = this;
+    for (size_t n = 0; n < nrSets - 1; ++n) {
+        if (n) last = static_cast<ExprOpUpdate *>(last->e2);
+        state.evalAttrs(env, last->e1, vs[n], last->pos, "in the left operand of the update (//) operator");
+    }
+    state.evalAttrs(env, last->e2, vs[nrSets - 1], last->pos, "in the right operand of the update (//) operator");
 
-    auto attrs = state.buildBindings(v1.attrs->size() + v2.attrs->size());
+    state.nrOpUpdates += nrSets - 1;
 
-    /* Merge the sets, preferring values from the second set.  Make
-       sure to keep the resulting vector in sorted order. */
-    Bindings::iterator i = v1.attrs->begin();
-    Bindings::iterator j = v2.attrs->begin();
+    Bindings::iterator is[nrSets], ends[nrSets];
+    size_t nrNonEmpty = 0, size = 0;
+    for (size_t n = 0; n < nrSets; ++n) {
+        if (vs[n].attrs->size() == 0) continue;
+        is[nrNonEmpty] = vs[n].attrs->begin();
+        ends[nrNonEmpty] = vs[n].attrs->end();
+        size += vs[n].attrs->size();
+        vs[nrNonEmpty++] = vs[n];
+    }
 
-    while (i != v1.attrs->end() && j != v2.attrs->end()) {
-        if (i->name == j->name) {
-            attrs.insert(*j);
-            ++i; ++j;
-        }
-        else if (i->name < j->name)
-            attrs.insert(*i++);
-        else
-            attrs.insert(*j++);
+    if (nrNonEmpty <= 1) {
+        /* At most one operand is non-empty, so it doesn't need to be
+           copied. */
+        v = nrNonEmpty ? vs[0] : vs[nrSets - 1];
+        state.nrOpUpdateValuesShared += v.attrs->size();
+        return;
     }
 
-    while (i != v1.attrs->end()) attrs.insert(*i++);
-    while (j != v2.attrs->end()) attrs.insert(*j++);
+    auto attrs = state.buildBindings(size);
+
+    /* Merge the sets, preferring values from the rightmost set that
+       has an attribute.  Make sure to keep the resulting vector in
+       sorted order. */
+    while (true) {
+        Attr * next = nullptr;
+        for (size_t n = 0; n < nrNonEmpty; ++n)
+            if (is[n] != ends[n] && (!next || !(next->name < is[n]->name)))
+                next = is[n];
+        if (!next) break;
+        auto name = next->name;
+        attrs.insert(*next);
+        for (size_t n = 0; n < nrNonEmpty; ++n)
+            if (is[n] != ends[n] && is[n]->name == name)
+                ++is[n];
+    }
 
     v.mkAttrs(attrs.alreadySorted());
 
@@ -1923,10 +2487,27 @@ void ExprOpUpdate::eval(EvalState & state, Env & env, Value & v)
 
 void ExprOpConcatLists::eval(EvalState & state, Env & env, Value & v)
 {
-    Value v1; e1->eval(state, env, v1);
-    Value v2; e2->eval(state, env, v2);
-    Value * lists[2] = { &v1, &v2 };
-    state.concatLists(v, 2, lists, pos, "while evaluating one of the elements to concatenate");
+    /* `++` is right-associative, so `a ++ b ++ c` is parsed as
+       `a ++ (b ++ c)`. Concatenate the whole chain at once rather
+       than copying the elements of each intermediate list. */
+    size_t nrLists = 2;
+    for (auto e = dynamic_cast<ExprOpConcatLists *>(e2); e; e = dynamic_cast<ExprOpConcatLists *>(e->e2))
+        nrLists++;
+
+    Value vs[nrLists];
+    Value * lists[nrLists];
+
+    Expr * e = this;
+    for (size_t n = 0; n < nrLists - 1; ++n) {
+        auto concat = static_cast<ExprOpConcatLists *>(e);
+        concat->e1->eval(state, env, vs[n]);
+        lists[n] = &vs[n];
+        e = concat->e2;
+    }
+    e->eval(state, env, vs[nrLists - 1]);
+    lists[nrLists - 1] = &vs[nrLists - 1];
+
+    state.concatLists(v, nrLists, lists, pos, "while evaluating one of the elements to concatenate");
 }
 
 
@@ -1959,8 +2540,24 @@ void EvalState::concatLists(Value & v, size_t nrLists, Value * * lists, const Po
 }
 
 
+Value * ExprConcatStrings::maybeThunk(EvalState & state, Env & env)
+{
+    if (!constant) return Expr::maybeThunk(state, env);
+    if (!constantValue) {
+        Value v;
+        eval(state, env, v);
+    }
+    return *constantValue;
+}
+
+
 void ExprConcatStrings::eval(EvalState & state, Env & env, Value & v)
 {
+    if (constantValue) {
+        v = **constantValue;
+        return;
+    }
+
     NixStringContext context;
     std::vector<BackedStringView> s;
     size_t sSize = 0;
@@ -2045,8 +2642,16 @@ void ExprConcatStrings::eval(EvalState & state, Env & env, Value & v)
         if (!context.empty())
             state.error("a string that refers to a store path cannot be appended to a path").atPos(pos).withFrame(env, *this).debugThrow<EvalError>();
         v.mkPath(state.rootPath(CanonPath(canonPath(str()))));
-    } else
+    } else if (context.empty() && sSize <= maxInternedStringSize && evalSettings.internStrings)
+        v.mkString(str());
+    else
         v.mkStringMove(c_str(), context);
+
+    if (constant) {
+        auto v2 = state.allocValue();
+        *v2 = v;
+        constantValue = allocRootValue(v2);
+    }
 }
 
 
@@ -2566,6 +3171,7 @@ void EvalState::printStatistics()
         {"number", nrEnvs},
         {"elements", nrValuesInEnvs},
         {"bytes", bEnvs},
+        {"stack", nrStackEnvs},
     };
     topObj["nrExprs"] = Expr::nrExprs;
     topObj["list"] = {
@@ -2585,6 +3191,19 @@ void EvalState::printStatistics()
         {"number", nrAttrsets},
         {"bytes", bAttrsets},
         {"elements", nrAttrsInAttrsets},
+        {"hashIndexes", Bindings::nrHashIndexes},
+        {"lookups", {
+            {"searched", Bindings::nrSearchedLookups},
+            {"hashed", Bindings::nrHashedLookups},
+        }},
+    };
+    topObj["strings"] = {
+        {"interned", nrStringsInterned},
+        {"shared", nrStringsShared},
+    };
+    topObj["stringContexts"] = {
+        {"interned", nrContextsInterned},
+        {"shared", nrContextsShared},
     };
     topObj["sizes"] = {
         {"Env", sizeof(Env)},
@@ -2594,6 +3213,7 @@ void EvalState::printStatistics()
     };
     topObj["nrOpUpdates"] = nrOpUpdates;
     topObj["nrOpUpdateValuesCopied"] = nrOpUpdateValuesCopied;
+    topObj["nrOpUpdateValuesShared"] = nrOpUpdateValuesShared;
     topObj["nrThunks"] = nrThunks;
     topObj["nrAvoided"] = nrAvoided;
     topObj["nrLookups"] = nrLookups;
@@ -2602,7 +3222,15 @@ void EvalState::printStatistics()
 #if HAVE_BOEHMGC
     topObj["gc"] = {
         {"heapSize", heapSize},
+        {"initialHeapSize", gcInitialHeapSize},
+        {"heapResizes", gcHeapResizes},
         {"totalBytes", totalBytes},
+        {"cycles", GC_get_gc_no()},
+#if GC_VERSION_MAJOR >= 8
+        {"time", GC_get_full_gc_total_time() / 1000.0},
+#endif
+        {"parallel", GC_get_parallel() != 0},
+        {"incremental", GC_is_incremental_mode() != 0},
     };
 #endif
 
@@ -2644,6 +3272,66 @@ void EvalState::printStatistics()
         }
     }
 
+    auto showCallSite = [&](const CallSite & site) {
+        json obj = json::object();
+        auto & [lambda, primOp] = site;
+        if (lambda) {
+            if (lambda->name)
+                obj["name"] = (std::string_view) symbols[lambda->name];
+            else
+                obj["name"] = nullptr;
+            if (auto pos = positions[lambda->pos]) {
+                if (auto path = std::get_if<SourcePath>(&pos.origin))
+                    obj["file"] = path->to_string();
+                obj["line"] = pos.line;
+                obj["column"] = pos.column;
+            }
+        } else if (primOp)
+            obj["primop"] = primOp->name;
+        return obj;
+    };
+
+    if (!allocCounts.empty()) {
+        /* Report the sites that allocated the most memory. */
+        std::vector<std::pair<CallSite, AllocCounts>> sites(allocCounts.begin(), allocCounts.end());
+        size_t maxSites = std::min(sites.size(), (size_t) 100);
+        std::partial_sort(sites.begin(), sites.begin() + maxSites, sites.end(),
+            [](const auto & a, const auto & b) { return a.second.bytes > b.second.bytes; });
+        sites.resize(maxSites);
+
+        auto & list = topObj["allocations"];
+        list = json::array();
+        for (auto & [site, counts] : sites) {
+            auto obj = showCallSite(site);
+            obj["values"] = counts.values;
+            obj["envs"] = counts.envs;
+            obj["listElems"] = counts.listElems;
+            obj["attrsets"] = counts.attrsets;
+            obj["bytes"] = counts.bytes;
+            list.push_back(obj);
+        }
+    }
+
+    if (timeCalls) {
+        /* Report the sites that took the most time, not counting
+           nested calls. */
+        std::vector<std::pair<CallSite, CallTimes>> sites(callTimes.begin(), callTimes.end());
+        size_t maxSites = std::min(sites.size(), (size_t) 100);
+        std::partial_sort(sites.begin(), sites.begin() + maxSites, sites.end(),
+            [](const auto & a, const auto & b) { return a.second.self > b.second.self; });
+        sites.resize(maxSites);
+
+        auto & list = topObj["callTimes"];
+        list = json::array();
+        for (auto & [site, times] : sites) {
+            auto obj = showCallSite(site);
+            obj["calls"] = times.calls;
+            obj["totalTime"] = std::chrono::duration<double>(times.total).count();
+            obj["selfTime"] = std::chrono::duration<double>(times.self).count();
+            list.push_back(obj);
+        }
+    }
+
     if (getEnv("NIX_SHOW_SYMBOLS").value_or("0") != "0") {
         // XXX: overrides earlier assignment
         topObj["symbols"] = json::array();
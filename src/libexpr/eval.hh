@@ -10,7 +10,10 @@
 #include "experimental-features.hh"
 #include "input-accessor.hh"
 #include "search-path.hh"
+#include "derived-path.hh"
 
+#include <chrono>
+#include <future>
 #include <map>
 #include <optional>
 #include <unordered_map>
@@ -26,6 +29,7 @@ struct SingleDerivedPath;
 enum RepairFlag : bool;
 struct FSInputAccessor;
 struct MemoryInputAccessor;
+struct EvalProfiler;
 
 
 /**
@@ -135,6 +139,10 @@ struct RegexCache;
 
 std::shared_ptr<RegexCache> makeRegexCache();
 
+struct ReplaceStringsCache;
+
+std::shared_ptr<ReplaceStringsCache> makeReplaceStringsCache();
+
 struct DebugTrace {
     std::shared_ptr<AbstractPos> pos;
     const Expr & expr;
@@ -326,6 +334,13 @@ private:
 #endif
     FileEvalCache fileEvalCache;
 
+    /**
+     * The inode, size and modification time of the files in
+     * `fileParseCache`, if `trackFileChanges` is set.
+     */
+    typedef std::tuple<ino_t, off_t, time_t, long> FileStamp;
+    std::map<Path, FileStamp> fileStamps;
+
     SearchPath searchPath;
 
     std::map<std::string, std::optional<std::string>> searchPathResolved;
@@ -335,11 +350,22 @@ private:
      */
     std::unordered_map<Path, SourcePath> resolvedPaths;
 
+    /**
+     * Fetches running in the background, keyed by the store path
+     * they produce. See `fetchInBackground()`.
+     */
+    std::map<StorePath, std::shared_future<void>> pendingFetches;
+
     /**
      * Cache used by prim_match().
      */
     std::shared_ptr<RegexCache> regexCache;
 
+    /**
+     * Cache used by prim_replaceStrings().
+     */
+    std::shared_ptr<ReplaceStringsCache> replaceStringsCache;
+
 #if HAVE_BOEHMGC
     /**
      * Allocation cache for GC'd Value objects.
@@ -352,6 +378,134 @@ private:
     std::shared_ptr<void *> env1AllocCache;
 #endif
 
+    /**
+     * A stack of environments for calls to functions whose body cannot
+     * capture its environment (see `ExprLambda::envEscapes`). Such an
+     * environment is dead once the body has been evaluated, so it is
+     * released right away instead of being left to the garbage
+     * collector. The chunks are scanned by the garbage collector but
+     * never collected, and are kept around for reuse.
+     */
+    struct EnvStack
+    {
+        static constexpr size_t chunkSize = 1024 * 1024;
+
+        std::vector<char *> chunks;
+
+        /**
+         * The top of the stack.
+         */
+        size_t chunk = 0, offset = 0;
+
+        EnvStack() { }
+        EnvStack(const EnvStack &) = delete;
+        ~EnvStack();
+
+        /**
+         * Allocate an environment with room for `size` values, or
+         * return `nullptr` if it doesn't fit in a chunk.
+         */
+        Env * alloc(size_t size);
+    };
+
+    EnvStack envStack;
+
+    /**
+     * If `enable` is set, allocates an environment on `envStack` and
+     * releases it when destroyed. Environments are released in LIFO order, since calls
+     * are strictly nested.
+     */
+    struct StackEnv
+    {
+        EnvStack & stack;
+        size_t chunk, offset;
+        size_t size;
+        Env * env;
+
+        StackEnv(EnvStack & stack, size_t size, bool enable)
+            : stack(stack), chunk(stack.chunk), offset(stack.offset), size(size)
+            , env(enable ? stack.alloc(size) : nullptr)
+        { }
+
+        StackEnv(const StackEnv &) = delete;
+
+        ~StackEnv();
+    };
+
+    /**
+     * Allocations attributed to a function or primop, or to neither
+     * for allocations outside of any call.
+     */
+    struct AllocCounts
+    {
+        uint64_t values = 0, envs = 0, listElems = 0, attrsets = 0, bytes = 0;
+    };
+
+    typedef std::pair<const ExprLambda *, const PrimOp *> CallSite;
+
+    /**
+     * Allocation counts per allocation site, collected if
+     * `NIX_COUNT_ALLOCS` is set.
+     */
+    std::map<CallSite, AllocCounts> allocCounts;
+
+    /**
+     * The counts of the innermost active call, or `nullptr` if
+     * allocations aren't being counted. This is declared before
+     * `baseEnv` so that it is initialised before the first allocation.
+     */
+    AllocCounts * currentAllocCounts = nullptr;
+
+    /**
+     * Time spent in a function or primop, collected if
+     * `NIX_TIME_CALLS` is set. `total` includes the time spent in
+     * nested calls (counted once for recursive calls), `self` doesn't.
+     */
+    struct CallTimes
+    {
+        uint64_t calls = 0;
+        std::chrono::steady_clock::duration total{0}, self{0};
+        /**
+         * The number of active calls, to avoid counting recursive
+         * calls twice in `total`.
+         */
+        uint32_t active = 0;
+    };
+
+    bool timeCalls = false;
+
+    std::map<CallSite, CallTimes> callTimes;
+
+    struct CallTimer
+    {
+        CallTimes * times;
+        std::chrono::steady_clock::time_point start;
+        std::chrono::steady_clock::duration children{0};
+    };
+
+    /**
+     * The timers of the active calls.
+     */
+    std::vector<CallTimer> callTimers;
+
+    /**
+     * Makes a call the current allocation site, and times it, for its
+     * lifetime.
+     */
+    struct CallSiteGuard;
+
+    /**
+     * If `eval-segmented-stack` is enabled, the address below which
+     * evaluation continues on a new stack segment.
+     */
+    char * stackLimit = nullptr;
+
+    /**
+     * Run `fn` on a new stack segment.
+     */
+    [[gnu::noinline]]
+    void runOnNewStack(std::function<void()> fn);
+
 public:
 
     EvalState(
@@ -392,6 +546,26 @@ public:
 
     void checkURI(const std::string & uri);
 
+    /**
+     * Run `fetch`, which must produce `storePath`, in a background
+     * thread. Evaluation can use `storePath` right away; anything
+     * that needs its contents must call `waitForFetch()` first.
+     * `fetch` must not touch the evaluator.
+     */
+    void fetchInBackground(const StorePath & storePath, std::function<void()> fetch);
+
+    /**
+     * Wait for the background fetch of `storePath`, if any, and
+     * rethrow its error if it failed.
+     */
+    void waitForFetch(const StorePath & storePath);
+
+    /**
+     * Wait for all background fetches to finish, e.g. before forking.
+     * Errors are kept for `waitForFetch()`.
+     */
+    void waitForFetches();
+
     /**
      * When using a diverted store and 'path' is in the Nix store, map
      * 'path' to the diverted location (e.g. /nix/store/foo is mapped
@@ -426,6 +600,32 @@ public:
 
     void resetFileCache();
 
+    /**
+     * Whether to remember the status of the files read by
+     * `evalFile()`, so that `resetFileCacheIfChanged()` can tell
+     * whether they have changed.
+     */
+    bool trackFileChanges = false;
+
+    /**
+     * Reset the file cache if any of the files read by `evalFile()`
+     * since the last reset have been modified or deleted. Used by
+     * long-running evaluators such as `nix eval-server`. Requires
+     * `trackFileChanges`.
+     *
+     * @return Whether the cache was reset.
+     */
+    bool resetFileCacheIfChanged();
+
+    /**
+     * Forget the values of all files, and the parse trees of the
+     * files read by `evalFile()` that have been modified or deleted.
+     * The parse trees of unchanged files are kept, so evaluating the
+     * same files again doesn't parse them again. Used by the REPL's
+     * `:reload`. Requires `trackFileChanges`.
+     */
+    void resetChangedFiles();
+
     /**
      * Look up a file in the search path.
      */
@@ -738,12 +938,34 @@ public:
      */
     bool fullGC();
 
+    /**
+     * If set, `realiseContext()` doesn't build the outputs needed by
+     * an import-from-derivation itself. Instead it records them in
+     * `pendingImports` and throws `ImportFromDerivationPending`, so
+     * that a driver evaluating many attributes can move on to the
+     * next one, build the outputs of all of them at once with
+     * `buildPendingImports()`, and then retry the deferred ones.
+     */
+    bool deferImportsFromDerivation = false;
+
+    /**
+     * Derivation outputs needed by deferred imports-from-derivation.
+     */
+    std::set<DerivedPath> pendingImports;
+
     /**
      * Realise the given context, and return a mapping from the placeholders
      * used to construct the associated value to their final store path
      */
     [[nodiscard]] StringMap realiseContext(const NixStringContext & context);
 
+    /**
+     * Build the outputs in `pendingImports` in a single
+     * `buildPaths()` call, so that independent imports-from-derivation
+     * are built in parallel.
+     */
+    void buildPendingImports();
+
 private:
 
     /**
@@ -764,6 +986,7 @@ private:
 
     unsigned long nrEnvs = 0;
     unsigned long nrValuesInEnvs = 0;
+    unsigned long nrStackEnvs = 0;
     unsigned long nrValues = 0;
     unsigned long nrListElems = 0;
     unsigned long nrLookups = 0;
@@ -772,6 +995,7 @@ private:
     unsigned long nrAvoided = 0;
     unsigned long nrOpUpdates = 0;
     unsigned long nrOpUpdateValuesCopied = 0;
+    unsigned long nrOpUpdateValuesShared = 0;
     unsigned long nrListConcats = 0;
     unsigned long nrPrimOpCalls = 0;
     unsigned long nrFunctionCalls = 0;
@@ -781,6 +1005,11 @@ private:
     typedef std::map<std::string, size_t> PrimOpCalls;
     PrimOpCalls primOpCalls;
 
+    /**
+     * The sampling profiler, if enabled by `eval-profile-file`.
+     */
+    std::unique_ptr<EvalProfiler> profiler;
+
     typedef std::map<ExprLambda *, size_t> FunctionCalls;
     FunctionCalls functionCalls;
 
@@ -797,9 +1026,11 @@ private:
     friend struct ExprFloat;
     friend struct ExprPath;
     friend struct ExprSelect;
+    friend struct ExprCall;
     friend void prim_getAttr(EvalState & state, const PosIdx pos, Value * * args, Value & v);
     friend void prim_match(EvalState & state, const PosIdx pos, Value * * args, Value & v);
     friend void prim_split(EvalState & state, const PosIdx pos, Value * * args, Value & v);
+    friend void prim_replaceStrings(EvalState & state, const PosIdx pos, Value * * args, Value & v);
 
     friend struct Value;
 };
@@ -838,6 +1069,14 @@ struct InvalidPathError : EvalError
 #endif
 };
 
+/**
+ * Thrown by `realiseContext()` when `deferImportsFromDerivation` is
+ * set and an import-from-derivation needs outputs that haven't been
+ * built yet. This is deliberately not an `EvalError`, so that it
+ * isn't cached as a failure or caught as one.
+ */
+MakeError(ImportFromDerivationPending, Error);
+
 template<class ErrorType>
 void ErrorBuilder::debugThrow()
 {
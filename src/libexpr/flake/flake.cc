@@ -8,6 +8,8 @@
 #include "fetchers.hh"
 #include "finally.hh"
 #include "fetch-settings.hh"
+#include "filetransfer.hh"
+#include "thread-pool.hh"
 
 namespace nix {
 
@@ -73,6 +75,53 @@ static std::tuple<StorePath, FlakeRef, FlakeRef> fetchOrSubstituteTree(
     return {std::move(storePath), resolvedRef, lockedRef};
 }
 
+/**
+ * Fetch the given flake references concurrently and add them to the
+ * flake cache, so that subsequent calls to `fetchOrSubstituteTree()`
+ * don't have to wait for them one by one. Failures are ignored here;
+ * they'll be reported when the input is fetched for real.
+ */
+static void prefetchTrees(
+    EvalState & state,
+    const std::vector<FlakeRef> & refs,
+    FlakeCache & flakeCache)
+{
+    std::vector<FlakeRef> todo;
+    for (auto & ref : refs)
+        if (ref.input.isDirect()
+            && ref.input.getType() != "path"
+            && !lookupInFlakeCache(flakeCache, ref)
+            && std::find(todo.begin(), todo.end(), ref) == todo.end())
+            todo.push_back(ref);
+
+    if (todo.size() < 2) return;
+
+    debug("prefetching %d flake inputs", todo.size());
+
+    Sync<FlakeCache> fetched_;
+
+    ThreadPool pool(fileTransferSettings.httpConnections);
+
+    for (auto & ref : todo)
+        pool.enqueue([&]() {
+            try {
+                auto fetched = ref.fetchTree(state.store);
+                fetched_.lock()->push_back({ref, std::move(fetched)});
+            } catch (Error & e) {
+                debug("prefetching '%s' failed: %s", ref, e.what());
+            }
+        });
+
+    pool.process();
+
+    /* Keep the order of the flake cache deterministic. */
+    auto fetched(fetched_.lock());
+    for (auto & ref : todo)
+        for (auto & i : *fetched)
+            if (i.first == ref)
+                flakeCache.push_back(i);
+}
+
 static void forceTrivialValue(EvalState & state, Value & value, const PosIdx pos)
 {
     if (value.isThunk() && value.isTrivial())
@@ -410,6 +459,27 @@ LockedFlake lockFlake(
                         printInputPath(inputPathPrefix), follow);
             }
 
+            /* Start fetching the inputs that can't be copied from
+               the old lock file, since they are independent of each
+               other. */
+            std::vector<FlakeRef> newInputs;
+            for (auto & [id, input2] : flakeInputs) {
+                auto inputPath(inputPathPrefix);
+                inputPath.push_back(id);
+                auto i = overrides.find(inputPath);
+                bool hasOverride = i != overrides.end();
+                auto & input = hasOverride ? i->second : input2;
+                if (input.follows || !input.ref) continue;
+                if (!lockFlags.allowUnlocked && !input.ref->input.isLocked()) continue;
+                if (oldNode && !hasOverride && !lockFlags.inputUpdates.count(inputPath))
+                    if (auto oldLock = get(oldNode->inputs, id))
+                        if (auto oldLock2 = std::get_if<0>(&*oldLock))
+                            if ((*oldLock2)->originalRef == *input.ref)
+                                continue;
+                newInputs.push_back(*input.ref);
+            }
+            prefetchTrees(state, newInputs, flakeCache);
+
             /* Go over the flake inputs, resolve/fetch them if
                necessary (i.e. if they're new or the flakeref changed
                from what's in the lock file). */
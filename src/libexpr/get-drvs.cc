@@ -226,6 +226,22 @@ Value * DrvInfo::queryMeta(const std::string & name)
 }
 
 
+std::map<std::string, Value *> DrvInfo::queryMetaAttrs(const StringSet & names)
+{
+    std::map<std::string, Value *> res;
+    if (!getMeta()) return res;
+    if (names.empty()) {
+        for (auto & i : *meta)
+            res.emplace(state->symbols[i.name], checkMeta(*i.value) ? i.value : nullptr);
+    } else {
+        for (auto & name : names)
+            if (auto a = meta->get(state->symbols.create(name)))
+                res.emplace(name, checkMeta(*a->value) ? a->value : nullptr);
+    }
+    return res;
+}
+
+
 std::string DrvInfo::queryMetaString(const std::string & name)
 {
     Value * v = queryMeta(name);
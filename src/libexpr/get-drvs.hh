@@ -61,6 +61,13 @@ public:
 
     StringSet queryMetaNames();
     Value * queryMeta(const std::string & name);
+    /**
+     * Return the values of the `meta` attributes in `names`, or of all
+     * of them if `names` is empty. Only the returned attributes are
+     * evaluated. Attributes that don't exist are omitted; attributes
+     * with an invalid value (see `queryMeta()`) map to `nullptr`.
+     */
+    std::map<std::string, Value *> queryMetaAttrs(const StringSet & names = {});
     std::string queryMetaString(const std::string & name);
     NixInt queryMetaInt(const std::string & name, NixInt def);
     NixFloat queryMetaFloat(const std::string & name, NixFloat def);
@@ -73,8 +80,10 @@ public:
     */
 
     void setName(const std::string & s) { name = s; }
+    void setSystem(const std::string & s) { system = s; }
     void setDrvPath(StorePath path) { drvPath = {{std::move(path)}}; }
     void setOutPath(StorePath path) { outPath = {{std::move(path)}}; }
+    void setOutputs(Outputs outputs) { this->outputs = std::move(outputs); }
 
     void setFailed() { failed = true; };
     bool hasFailed() { return failed; };
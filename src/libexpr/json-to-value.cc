@@ -10,114 +10,93 @@ namespace nix {
 // for more information, refer to
 // https://github.com/nlohmann/json/blob/master/include/nlohmann/detail/input/json_sax.hpp
 class JSONSax : nlohmann::json_sax<json> {
-    class JSONState {
-    protected:
-        std::unique_ptr<JSONState> parent;
-        RootValue v;
-    public:
-        virtual std::unique_ptr<JSONState> resolve(EvalState &)
-        {
-            throw std::logic_error("tried to close toplevel json parser state");
-        }
-        explicit JSONState(std::unique_ptr<JSONState> && p) : parent(std::move(p)) {}
-        explicit JSONState(Value * v) : v(allocRootValue(v)) {}
-        JSONState(JSONState & p) = delete;
-        Value & value(EvalState & state)
-        {
-            if (!v)
-                v = allocRootValue(state.allocValue());
-            return **v;
-        }
-        virtual ~JSONState() {}
-        virtual void add() {}
-    };
+    EvalState & state;
 
-    class JSONObjectState : public JSONState {
-        using JSONState::JSONState;
-        ValueMap attrs;
-        std::unique_ptr<JSONState> resolve(EvalState & state) override
-        {
-            auto attrs2 = state.buildBindings(attrs.size());
-            for (auto & i : attrs)
-                attrs2.insert(i.first, i.second);
-            parent->value(state).mkAttrs(attrs2.alreadySorted());
-            return std::move(parent);
-        }
-        void add() override { v = nullptr; }
-    public:
-        void key(string_t & name, EvalState & state)
-        {
-            attrs.insert_or_assign(state.symbols.create(name), &value(state));
-        }
-    };
+    /**
+     * The value that receives the top-level JSON value.
+     */
+    Value & v;
 
-    class JSONListState : public JSONState {
-        ValueVector values;
-        std::unique_ptr<JSONState> resolve(EvalState & state) override
-        {
-            Value & v = parent->value(state);
-            state.mkList(v, values.size());
-            for (size_t n = 0; n < values.size(); ++n) {
-                v.listElems()[n] = values[n];
-            }
-            return std::move(parent);
-        }
-        void add() override {
-            values.push_back(*v);
-            v = nullptr;
-        }
-    public:
-        JSONListState(std::unique_ptr<JSONState> && p, std::size_t reserve) : JSONState(std::move(p))
-        {
-            values.reserve(reserve);
-        }
+    /**
+     * An object or array that is being parsed. Its elements are in
+     * `attrs` or `elems` starting at index `start`.
+     */
+    struct Frame
+    {
+        bool isObject;
+        size_t start;
+        Value * target;
     };
 
-    EvalState & state;
-    std::unique_ptr<JSONState> rs;
+    std::vector<Frame> frames;
+
+    /* The elements of all the arrays or objects being parsed,
+       innermost last. These are shared by all levels so that parsing
+       doesn't need any allocations per array or object beyond the
+       resulting values. */
+#if HAVE_BOEHMGC
+    std::vector<std::pair<Symbol, Value *>, traceable_allocator<std::pair<Symbol, Value *>>> attrs;
+#else
+    std::vector<std::pair<Symbol, Value *>> attrs;
+#endif
+    ValueVector elems;
+
+    /**
+     * The key of the next attribute of the innermost object.
+     */
+    Symbol nextKey;
+
+    /**
+     * Return the value for the next JSON value, which is added to the
+     * innermost array or object.
+     */
+    Value & next()
+    {
+        if (frames.empty()) return v;
+        auto v2 = state.allocValue();
+        if (frames.back().isObject)
+            attrs.emplace_back(nextKey, v2);
+        else
+            elems.push_back(v2);
+        return *v2;
+    }
 
 public:
-    JSONSax(EvalState & state, Value & v) : state(state), rs(new JSONState(&v)) {};
+    JSONSax(EvalState & state, Value & v) : state(state), v(v) {};
 
     bool null()
     {
-        rs->value(state).mkNull();
-        rs->add();
+        next().mkNull();
         return true;
     }
 
     bool boolean(bool val)
     {
-        rs->value(state).mkBool(val);
-        rs->add();
+        next().mkBool(val);
         return true;
     }
 
     bool number_integer(number_integer_t val)
     {
-        rs->value(state).mkInt(val);
-        rs->add();
+        next().mkInt(val);
         return true;
     }
 
     bool number_unsigned(number_unsigned_t val)
     {
-        rs->value(state).mkInt(val);
-        rs->add();
+        next().mkInt(val);
         return true;
     }
 
     bool number_float(number_float_t val, const string_t & s)
     {
-        rs->value(state).mkFloat(val);
-        rs->add();
+        next().mkFloat(val);
         return true;
     }
 
     bool string(string_t & val)
     {
-        rs->value(state).mkString(val);
-        rs->add();
+        next().mkString(val);
         return true;
     }
 
@@ -132,29 +111,52 @@ public:
 
     bool start_object(std::size_t len)
     {
-        rs = std::make_unique<JSONObjectState>(std::move(rs));
+        auto & target = next();
+        frames.push_back(Frame { .isObject = true, .start = attrs.size(), .target = &target });
         return true;
     }
 
     bool key(string_t & name)
     {
-        dynamic_cast<JSONObjectState*>(rs.get())->key(name, state);
+        nextKey = state.symbols.create(name);
         return true;
     }
 
     bool end_object() {
-        rs = rs->resolve(state);
-        rs->add();
+        auto frame = frames.back();
+        frames.pop_back();
+
+        /* Sort the attributes, keeping duplicates in their original
+           order, so that the last occurrence of a key wins. */
+        auto begin = attrs.begin() + frame.start;
+        std::stable_sort(begin, attrs.end(),
+            [](const auto & a, const auto & b) { return a.first < b.first; });
+
+        auto attrs2 = state.buildBindings(attrs.end() - begin);
+        for (auto i = begin; i != attrs.end(); ++i)
+            if (i + 1 == attrs.end() || (i + 1)->first != i->first)
+                attrs2.insert(i->first, i->second);
+        frame.target->mkAttrs(attrs2.alreadySorted());
+
+        attrs.erase(begin, attrs.end());
         return true;
     }
 
-    bool end_array() {
-        return end_object();
+    bool start_array(size_t len) {
+        auto & target = next();
+        frames.push_back(Frame { .isObject = false, .start = elems.size(), .target = &target });
+        return true;
     }
 
-    bool start_array(size_t len) {
-        rs = std::make_unique<JSONListState>(std::move(rs),
-            len != std::numeric_limits<size_t>::max() ? len : 128);
+    bool end_array() {
+        auto frame = frames.back();
+        frames.pop_back();
+
+        auto size = elems.size() - frame.start;
+        state.mkList(*frame.target, size);
+        std::copy(elems.begin() + frame.start, elems.end(), frame.target->listElems());
+
+        elems.resize(frame.start);
         return true;
     }
 
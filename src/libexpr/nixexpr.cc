@@ -415,6 +415,10 @@ void ExprAttrs::bindVars(EvalState & es, const std::shared_ptr<const StaticEnv>
             i.nameExpr->bindVars(es, env);
             i.valueExpr->bindVars(es, env);
         }
+
+        constant = dynamicAttrs.empty();
+        for (auto & i : attrs)
+            if (i.second.inherited || !i.second.e->isConstant()) constant = false;
     }
 }
 
@@ -425,6 +429,10 @@ void ExprList::bindVars(EvalState & es, const std::shared_ptr<const StaticEnv> &
 
     for (auto & i : elems)
         i->bindVars(es, env);
+
+    constant = true;
+    for (auto & i : elems)
+        if (!i->isConstant()) constant = false;
 }
 
 void ExprLambda::bindVars(EvalState & es, const std::shared_ptr<const StaticEnv> & env)
@@ -452,6 +460,17 @@ void ExprLambda::bindVars(EvalState & es, const std::shared_ptr<const StaticEnv>
     }
 
     body->bindVars(es, newEnv);
+
+    envEscapes = body->mayCaptureEnv(false);
+    /* A default that refers to another formal may be evaluated before
+       that formal has been initialised, in which case it's thunked. */
+    if (hasFormals())
+        for (auto & i : formals->formals)
+            if (i.def) {
+                auto var = dynamic_cast<ExprVar *>(i.def);
+                if (i.def->mayCaptureEnv(true) || (var && var->level == 0))
+                    envEscapes = true;
+            }
 }
 
 void ExprCall::bindVars(EvalState & es, const std::shared_ptr<const StaticEnv> & env)
@@ -542,6 +561,15 @@ void ExprConcatStrings::bindVars(EvalState & es, const std::shared_ptr<const Sta
 
     for (auto & i : *this->es)
         i.second->bindVars(es, env);
+
+    /* Paths are not allowed, since interpolating them copies them to
+       the store. */
+    constant = true;
+    for (auto & i : *this->es)
+        if (!dynamic_cast<ExprString *>(i.second)
+            && !dynamic_cast<ExprInt *>(i.second)
+            && !dynamic_cast<ExprFloat *>(i.second))
+            constant = false;
 }
 
 void ExprPos::bindVars(EvalState & es, const std::shared_ptr<const StaticEnv> & env)
@@ -575,6 +603,115 @@ std::string ExprLambda::showNamePos(const EvalState & state) const
 
 
 
+/* Environment capture analysis. Constants and variables (other than
+   those from a `with`) don't need a thunk, everything else does.
+   Expressions that are evaluated strictly only capture the environment
+   if their subexpressions do. */
+
+bool ExprInt::mayCaptureEnv(bool thunked) const
+{
+    return false;
+}
+
+bool ExprFloat::mayCaptureEnv(bool thunked) const
+{
+    return false;
+}
+
+bool ExprString::mayCaptureEnv(bool thunked) const
+{
+    return false;
+}
+
+bool ExprPath::mayCaptureEnv(bool thunked) const
+{
+    return false;
+}
+
+bool ExprVar::mayCaptureEnv(bool thunked) const
+{
+    return thunked && fromWith;
+}
+
+static bool mayCaptureEnv(const AttrPath & attrPath)
+{
+    for (auto & i : attrPath)
+        if (!i.symbol && i.expr->mayCaptureEnv(false))
+            return true;
+    return false;
+}
+
+bool ExprSelect::mayCaptureEnv(bool thunked) const
+{
+    return thunked
+        || e->mayCaptureEnv(false)
+        || (def && def->mayCaptureEnv(false))
+        || nix::mayCaptureEnv(attrPath);
+}
+
+bool ExprOpHasAttr::mayCaptureEnv(bool thunked) const
+{
+    return thunked || e->mayCaptureEnv(false) || nix::mayCaptureEnv(attrPath);
+}
+
+bool ExprAttrs::mayCaptureEnv(bool thunked) const
+{
+    if (constant) return false;
+    if (thunked || recursive) return true;
+    for (auto & i : attrs)
+        if (i.second.e->mayCaptureEnv(true)) return true;
+    for (auto & i : dynamicAttrs)
+        if (i.nameExpr->mayCaptureEnv(false) || i.valueExpr->mayCaptureEnv(true)) return true;
+    return false;
+}
+
+bool ExprList::mayCaptureEnv(bool thunked) const
+{
+    if (constant) return false;
+    if (thunked) return true;
+    for (auto & i : elems)
+        if (i->mayCaptureEnv(true)) return true;
+    return false;
+}
+
+bool ExprCall::mayCaptureEnv(bool thunked) const
+{
+    if (thunked || fun->mayCaptureEnv(false)) return true;
+    for (auto & i : args)
+        if (i->mayCaptureEnv(true)) return true;
+    return false;
+}
+
+bool ExprIf::mayCaptureEnv(bool thunked) const
+{
+    return thunked || cond->mayCaptureEnv(false) || then->mayCaptureEnv(false) || else_->mayCaptureEnv(false);
+}
+
+bool ExprAssert::mayCaptureEnv(bool thunked) const
+{
+    return thunked || cond->mayCaptureEnv(false) || body->mayCaptureEnv(false);
+}
+
+bool ExprOpNot::mayCaptureEnv(bool thunked) const
+{
+    return thunked || e->mayCaptureEnv(false);
+}
+
+bool ExprConcatStrings::mayCaptureEnv(bool thunked) const
+{
+    if (constant) return false;
+    if (thunked) return true;
+    for (auto & i : *es)
+        if (i.second->mayCaptureEnv(false)) return true;
+    return false;
+}
+
+bool ExprPos::mayCaptureEnv(bool thunked) const
+{
+    return thunked;
+}
+
+
 /* Symbol table. */
 
 size_t SymbolTable::totalSize() const
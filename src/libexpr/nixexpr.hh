@@ -87,8 +87,18 @@ public:
     };
 
 private:
+    /* Positions are rarely looked at, but there is one for nearly
+       every node of every parsed file, so they are packed into 32 bits:
+       `lineBits` bits for the line and the rest for the column. This
+       covers all but the most unusual files; positions that don't fit
+       are marked with `unpacked` and stored in `largeOffsets`. */
+    static constexpr uint32_t lineBits = 20;
+    static constexpr uint32_t columnBits = 32 - lineBits;
+    static constexpr uint32_t unpacked = std::numeric_limits<uint32_t>::max();
+
     std::vector<Origin> origins;
-    ChunkedVector<Offset, 8192> offsets;
+    ChunkedVector<uint32_t, 16384> offsets;
+    std::map<uint32_t, Offset> largeOffsets;
 
 public:
     PosTable(): offsets(1024)
@@ -98,7 +108,10 @@ public:
 
     PosIdx add(const Origin & origin, uint32_t line, uint32_t column)
     {
-        const auto idx = offsets.add({line, column}).second;
+        const bool fits = line < (1u << lineBits) && column < (1u << columnBits) - 1;
+        const auto idx = offsets.add(fits ? line << columnBits | column : unpacked).second;
+        if (!fits)
+            largeOffsets.emplace(idx, Offset{line, column});
         if (origins.empty() || origins.back().idx != origin.idx) {
             origin.idx = idx;
             origins.push_back(origin);
@@ -118,8 +131,12 @@ public:
             origins.begin(), origins.end(), Origin(idx),
             [] (const auto & a, const auto & b) { return a.idx < b.idx; });
         const auto origin = *std::prev(pastOrigin);
-        const auto offset = offsets[idx];
-        return {offset.line, offset.column, origin.origin};
+        const auto packed = offsets[idx];
+        if (packed == unpacked) {
+            const auto & offset = largeOffsets.at(idx);
+            return {offset.line, offset.column, origin.origin};
+        }
+        return {packed >> columnBits, packed & ((1u << columnBits) - 1), origin.origin};
     }
 };
 
@@ -165,6 +182,22 @@ struct Expr
     virtual Value * maybeThunk(EvalState & state, Env & env);
     virtual void setName(Symbol name);
     virtual PosIdx getPos() const { return noPos; }
+
+    /**
+     * Whether evaluating this expression in an environment (or, if
+     * `thunked` is set, calling maybeThunk() on it) may keep a
+     * reference to that environment after it returns, e.g. in a
+     * thunk or a closure. This is conservative.
+     */
+    virtual bool mayCaptureEnv(bool thunked) const { return true; }
+
+    /**
+     * Whether this expression always evaluates to the same value,
+     * which contains no thunks or functions. maybeThunk() on such an
+     * expression returns a value that is shared between evaluations.
+     * Only valid after bindVars().
+     */
+    virtual bool isConstant() const { return false; }
 };
 
 #define COMMON_METHODS \
@@ -177,6 +210,8 @@ struct ExprInt : Expr
     Value v;
     ExprInt(NixInt n) { v.mkInt(n); };
     Value * maybeThunk(EvalState & state, Env & env) override;
+    bool mayCaptureEnv(bool thunked) const override;
+    bool isConstant() const override { return true; }
     COMMON_METHODS
 };
 
@@ -185,6 +220,8 @@ struct ExprFloat : Expr
     Value v;
     ExprFloat(NixFloat nf) { v.mkFloat(nf); };
     Value * maybeThunk(EvalState & state, Env & env) override;
+    bool mayCaptureEnv(bool thunked) const override;
+    bool isConstant() const override { return true; }
     COMMON_METHODS
 };
 
@@ -194,6 +231,8 @@ struct ExprString : Expr
     Value v;
     ExprString(std::string &&s) : s(std::move(s)) { v.mkString(this->s.data()); };
     Value * maybeThunk(EvalState & state, Env & env) override;
+    bool mayCaptureEnv(bool thunked) const override;
+    bool isConstant() const override { return true; }
     COMMON_METHODS
 };
 
@@ -207,6 +246,8 @@ struct ExprPath : Expr
         v.mkPath(&*accessor, this->s.c_str());
     }
     Value * maybeThunk(EvalState & state, Env & env) override;
+    bool mayCaptureEnv(bool thunked) const override;
+    bool isConstant() const override { return true; }
     COMMON_METHODS
 };
 
@@ -231,10 +272,16 @@ struct ExprVar : Expr
     Level level;
     Displacement displ;
 
+    /* For variables from a "with", the index of the attribute in the
+       set where the variable was last found. Since the same sets tend
+       to be used again, this usually allows the lookup to be skipped. */
+    mutable uint32_t withIndexHint = 0;
+
     ExprVar(Symbol name) : name(name) { };
     ExprVar(const PosIdx & pos, Symbol name) : pos(pos), name(name) { };
     Value * maybeThunk(EvalState & state, Env & env) override;
     PosIdx getPos() const override { return pos; }
+    bool mayCaptureEnv(bool thunked) const override;
     COMMON_METHODS
 };
 
@@ -246,6 +293,7 @@ struct ExprSelect : Expr
     ExprSelect(const PosIdx & pos, Expr * e, AttrPath attrPath, Expr * def) : pos(pos), e(e), def(def), attrPath(std::move(attrPath)) { };
     ExprSelect(const PosIdx & pos, Expr * e, Symbol name) : pos(pos), e(e), def(0) { attrPath.push_back(AttrName(name)); };
     PosIdx getPos() const override { return pos; }
+    bool mayCaptureEnv(bool thunked) const override;
     COMMON_METHODS
 };
 
@@ -255,6 +303,7 @@ struct ExprOpHasAttr : Expr
     AttrPath attrPath;
     ExprOpHasAttr(Expr * e, AttrPath attrPath) : e(e), attrPath(std::move(attrPath)) { };
     PosIdx getPos() const override { return e->getPos(); }
+    bool mayCaptureEnv(bool thunked) const override;
     COMMON_METHODS
 };
 
@@ -281,16 +330,30 @@ struct ExprAttrs : Expr
     };
     typedef std::vector<DynamicAttrDef> DynamicAttrDefs;
     DynamicAttrDefs dynamicAttrs;
+    /* Set by bindVars() if the attribute set is not recursive and has
+       only constant attributes. Its value is then built only once. */
+    bool constant = false;
+    RootValue constantValue;
     ExprAttrs(const PosIdx &pos) : recursive(false), pos(pos) { };
     ExprAttrs() : recursive(false) { };
     PosIdx getPos() const override { return pos; }
+    Value * maybeThunk(EvalState & state, Env & env) override;
+    bool mayCaptureEnv(bool thunked) const override;
+    bool isConstant() const override { return constant; }
     COMMON_METHODS
 };
 
 struct ExprList : Expr
 {
     std::vector<Expr *> elems;
+    /* Set by bindVars() if all elements are constant. The list is then
+       built only once. */
+    bool constant = false;
+    RootValue constantValue;
     ExprList() { };
+    Value * maybeThunk(EvalState & state, Env & env) override;
+    bool mayCaptureEnv(bool thunked) const override;
+    bool isConstant() const override { return constant; }
     COMMON_METHODS
 
     PosIdx getPos() const override
@@ -338,6 +401,15 @@ struct ExprLambda : Expr
     Symbol arg;
     Formals * formals;
     Expr * body;
+
+    /**
+     * Whether the environment of a call to this function may be
+     * captured by its body or its default arguments. If not, the
+     * environment can be freed when the call returns. Computed by
+     * bindVars().
+     */
+    bool envEscapes = true;
+
     ExprLambda(PosIdx pos, Symbol arg, Formals * formals, Expr * body)
         : pos(pos), arg(arg), formals(formals), body(body)
     {
@@ -362,6 +434,7 @@ struct ExprCall : Expr
         : fun(fun), args(args), pos(pos)
     { }
     PosIdx getPos() const override { return pos; }
+    bool mayCaptureEnv(bool thunked) const override;
     COMMON_METHODS
 };
 
@@ -389,6 +462,7 @@ struct ExprIf : Expr
     Expr * cond, * then, * else_;
     ExprIf(const PosIdx & pos, Expr * cond, Expr * then, Expr * else_) : pos(pos), cond(cond), then(then), else_(else_) { };
     PosIdx getPos() const override { return pos; }
+    bool mayCaptureEnv(bool thunked) const override;
     COMMON_METHODS
 };
 
@@ -398,6 +472,7 @@ struct ExprAssert : Expr
     Expr * cond, * body;
     ExprAssert(const PosIdx & pos, Expr * cond, Expr * body) : pos(pos), cond(cond), body(body) { };
     PosIdx getPos() const override { return pos; }
+    bool mayCaptureEnv(bool thunked) const override;
     COMMON_METHODS
 };
 
@@ -405,6 +480,7 @@ struct ExprOpNot : Expr
 {
     Expr * e;
     ExprOpNot(Expr * e) : e(e) { };
+    bool mayCaptureEnv(bool thunked) const override;
     COMMON_METHODS
 };
 
@@ -424,6 +500,10 @@ struct ExprOpNot : Expr
             e1->bindVars(es, env); e2->bindVars(es, env);    \
         } \
         void eval(EvalState & state, Env & env, Value & v) override; \
+        bool mayCaptureEnv(bool thunked) const override \
+        { \
+            return thunked || e1->mayCaptureEnv(false) || e2->mayCaptureEnv(false); \
+        } \
         PosIdx getPos() const override { return pos; } \
     };
 
@@ -440,9 +520,16 @@ struct ExprConcatStrings : Expr
     PosIdx pos;
     bool forceString;
     std::vector<std::pair<PosIdx, Expr *>> * es;
+    /* Set by bindVars() if all parts are string or number literals.
+       The result is then computed only once. */
+    bool constant = false;
+    RootValue constantValue;
     ExprConcatStrings(const PosIdx & pos, bool forceString, std::vector<std::pair<PosIdx, Expr *>> * es)
         : pos(pos), forceString(forceString), es(es) { };
     PosIdx getPos() const override { return pos; }
+    Value * maybeThunk(EvalState & state, Env & env) override;
+    bool mayCaptureEnv(bool thunked) const override;
+    bool isConstant() const override { return constant; }
     COMMON_METHODS
 };
 
@@ -451,6 +538,7 @@ struct ExprPos : Expr
     PosIdx pos;
     ExprPos(const PosIdx & pos) : pos(pos) { };
     PosIdx getPos() const override { return pos; }
+    bool mayCaptureEnv(bool thunked) const override;
     COMMON_METHODS
 };
 
@@ -0,0 +1,549 @@
+#include "parse-cache.hh"
+#include "eval.hh"
+#include "serialise.hh"
+#include "fs-input-accessor.hh"
+
+#include <cstring>
+
+namespace nix {
+
+static const std::string parseCacheMagic = "nix-parse-cache-1";
+
+enum struct ExprTag : uint8_t {
+    Null = 0,
+    Ref,
+    Int,
+    Float,
+    String,
+    Path,
+    Var,
+    Select,
+    OpHasAttr,
+    Attrs,
+    List,
+    Lambda,
+    Call,
+    Let,
+    With,
+    If,
+    Assert,
+    OpNot,
+    OpEq,
+    OpNEq,
+    OpAnd,
+    OpOr,
+    OpImpl,
+    OpUpdate,
+    OpConcatLists,
+    ConcatStrings,
+    Pos,
+};
+
+
+struct ExprWriter
+{
+    const EvalState & state;
+    StringSink sink;
+    std::map<const Expr *, uint64_t> ids;
+    std::map<Symbol, uint64_t> symbolIds;
+    std::vector<Symbol> symbols;
+
+    ExprWriter(const EvalState & state) : state(state) { }
+
+    void writeSymbol(Symbol s)
+    {
+        if (!s) {
+            sink << 0;
+            return;
+        }
+        auto [i, inserted] = symbolIds.emplace(s, symbols.size() + 1);
+        if (inserted) symbols.push_back(s);
+        sink << i->second;
+    }
+
+    void writePos(PosIdx p)
+    {
+        auto pos = state.positions[p];
+        sink << pos.line << pos.column;
+    }
+
+    void writeTag(ExprTag tag)
+    {
+        sink << (uint64_t) tag;
+    }
+
+    void writeAttrPath(const AttrPath & attrPath)
+    {
+        sink << attrPath.size();
+        for (auto & i : attrPath) {
+            writeSymbol(i.symbol);
+            if (!i.symbol) writeExpr(i.expr);
+        }
+    }
+
+    template<typename T>
+    bool writeBinOp(Expr * e, ExprTag tag)
+    {
+        auto e2 = dynamic_cast<T *>(e);
+        if (!e2) return false;
+        writeTag(tag);
+        writePos(e2->pos);
+        writeExpr(e2->e1);
+        writeExpr(e2->e2);
+        return true;
+    }
+
+    void writeExpr(Expr * e)
+    {
+        if (!e) {
+            writeTag(ExprTag::Null);
+            return;
+        }
+
+        if (auto i = ids.find(e); i != ids.end()) {
+            writeTag(ExprTag::Ref);
+            sink << i->second;
+            return;
+        }
+        ids.emplace(e, ids.size());
+
+        if (auto e2 = dynamic_cast<ExprInt *>(e)) {
+            writeTag(ExprTag::Int);
+            sink << (uint64_t) e2->v.integer;
+        }
+
+        else if (auto e2 = dynamic_cast<ExprFloat *>(e)) {
+            writeTag(ExprTag::Float);
+            uint64_t bits;
+            static_assert(sizeof(bits) == sizeof(e2->v.fpoint));
+            memcpy(&bits, &e2->v.fpoint, sizeof(bits));
+            sink << bits;
+        }
+
+        else if (auto e2 = dynamic_cast<ExprString *>(e)) {
+            writeTag(ExprTag::String);
+            sink << e2->s;
+        }
+
+        else if (auto e2 = dynamic_cast<ExprPath *>(e)) {
+            writeTag(ExprTag::Path);
+            sink << e2->s;
+        }
+
+        else if (auto e2 = dynamic_cast<ExprVar *>(e)) {
+            writeTag(ExprTag::Var);
+            writePos(e2->pos);
+            writeSymbol(e2->name);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprSelect *>(e)) {
+            writeTag(ExprTag::Select);
+            writePos(e2->pos);
+            writeExpr(e2->e);
+            writeExpr(e2->def);
+            writeAttrPath(e2->attrPath);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprOpHasAttr *>(e)) {
+            writeTag(ExprTag::OpHasAttr);
+            writeExpr(e2->e);
+            writeAttrPath(e2->attrPath);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprAttrs *>(e)) {
+            writeTag(ExprTag::Attrs);
+            sink << e2->recursive;
+            writePos(e2->pos);
+            sink << e2->attrs.size();
+            for (auto & [name, def] : e2->attrs) {
+                writeSymbol(name);
+                sink << def.inherited;
+                writePos(def.pos);
+                writeExpr(def.e);
+            }
+            sink << e2->dynamicAttrs.size();
+            for (auto & def : e2->dynamicAttrs) {
+                writePos(def.pos);
+                writeExpr(def.nameExpr);
+                writeExpr(def.valueExpr);
+            }
+        }
+
+        else if (auto e2 = dynamic_cast<ExprList *>(e)) {
+            writeTag(ExprTag::List);
+            sink << e2->elems.size();
+            for (auto e3 : e2->elems)
+                writeExpr(e3);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprLambda *>(e)) {
+            writeTag(ExprTag::Lambda);
+            writePos(e2->pos);
+            writeSymbol(e2->name);
+            writeSymbol(e2->arg);
+            sink << e2->hasFormals();
+            if (e2->hasFormals()) {
+                sink << e2->formals->ellipsis;
+                sink << e2->formals->formals.size();
+                for (auto & formal : e2->formals->formals) {
+                    writePos(formal.pos);
+                    writeSymbol(formal.name);
+                    writeExpr(formal.def);
+                }
+            }
+            writeExpr(e2->body);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprCall *>(e)) {
+            writeTag(ExprTag::Call);
+            writePos(e2->pos);
+            writeExpr(e2->fun);
+            sink << e2->args.size();
+            for (auto e3 : e2->args)
+                writeExpr(e3);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprLet *>(e)) {
+            writeTag(ExprTag::Let);
+            writeExpr(e2->attrs);
+            writeExpr(e2->body);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprWith *>(e)) {
+            writeTag(ExprTag::With);
+            writePos(e2->pos);
+            writeExpr(e2->attrs);
+            writeExpr(e2->body);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprIf *>(e)) {
+            writeTag(ExprTag::If);
+            writePos(e2->pos);
+            writeExpr(e2->cond);
+            writeExpr(e2->then);
+            writeExpr(e2->else_);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprAssert *>(e)) {
+            writeTag(ExprTag::Assert);
+            writePos(e2->pos);
+            writeExpr(e2->cond);
+            writeExpr(e2->body);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprOpNot *>(e)) {
+            writeTag(ExprTag::OpNot);
+            writeExpr(e2->e);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprConcatStrings *>(e)) {
+            writeTag(ExprTag::ConcatStrings);
+            writePos(e2->pos);
+            sink << e2->forceString;
+            sink << e2->es->size();
+            for (auto & [pos, e3] : *e2->es) {
+                writePos(pos);
+                writeExpr(e3);
+            }
+        }
+
+        else if (auto e2 = dynamic_cast<ExprPos *>(e)) {
+            writeTag(ExprTag::Pos);
+            writePos(e2->pos);
+        }
+
+        else if (writeBinOp<ExprOpEq>(e, ExprTag::OpEq)
+            || writeBinOp<ExprOpNEq>(e, ExprTag::OpNEq)
+            || writeBinOp<ExprOpAnd>(e, ExprTag::OpAnd)
+            || writeBinOp<ExprOpOr>(e, ExprTag::OpOr)
+            || writeBinOp<ExprOpImpl>(e, ExprTag::OpImpl)
+            || writeBinOp<ExprOpUpdate>(e, ExprTag::OpUpdate)
+            || writeBinOp<ExprOpConcatLists>(e, ExprTag::OpConcatLists))
+            ;
+
+        else
+            throw Error("cannot serialise expression of unknown type");
+    }
+};
+
+
+std::string serialiseExpr(const EvalState & state, Expr & e)
+{
+    ExprWriter writer(state);
+    writer.writeExpr(&e);
+
+    StringSink sink;
+    sink << parseCacheMagic;
+    sink << writer.symbols.size();
+    for (auto & s : writer.symbols)
+        sink << (std::string_view) state.symbols[s];
+    sink(writer.sink.s);
+    return std::move(sink.s);
+}
+
+
+struct ExprReader
+{
+    EvalState & state;
+    StringSource source;
+    PosTable::Origin origin;
+    std::vector<Symbol> symbols;
+    std::vector<Expr *> exprs;
+
+    ExprReader(EvalState & state, std::string_view data, const Pos::Origin & origin)
+        : state(state), source(data), origin(origin)
+    { }
+
+    uint64_t readNum()
+    {
+        return nix::readNum<uint64_t>(source);
+    }
+
+    bool readBool()
+    {
+        return readNum() != 0;
+    }
+
+    Symbol readSymbol()
+    {
+        auto n = readNum();
+        if (n == 0) return {};
+        if (n > symbols.size())
+            throw SerialisationError("invalid symbol reference in parse cache entry");
+        return symbols[n - 1];
+    }
+
+    PosIdx readPos()
+    {
+        auto line = nix::readNum<uint32_t>(source);
+        auto column = nix::readNum<uint32_t>(source);
+        if (!line) return noPos;
+        return state.positions.add(origin, line, column);
+    }
+
+    AttrPath readAttrPath()
+    {
+        AttrPath attrPath;
+        auto n = readNum();
+        for (uint64_t i = 0; i < n; ++i) {
+            if (auto s = readSymbol())
+                attrPath.emplace_back(s);
+            else
+                attrPath.emplace_back(readExpr());
+        }
+        return attrPath;
+    }
+
+    template<typename T>
+    Expr * readBinOp()
+    {
+        auto pos = readPos();
+        auto e1 = readExpr();
+        auto e2 = readExpr();
+        return new T(pos, e1, e2);
+    }
+
+    Expr * readExpr()
+    {
+        auto tag = (ExprTag) readNum();
+
+        if (tag == ExprTag::Null) return nullptr;
+
+        if (tag == ExprTag::Ref) {
+            auto id = readNum();
+            if (id >= exprs.size() || !exprs[id])
+                throw SerialisationError("invalid expression reference in parse cache entry");
+            return exprs[id];
+        }
+
+        /* Reserve the id of this expression before reading its
+           children, which is the order in which the writer assigned
+           them. */
+        auto id = exprs.size();
+        exprs.push_back(nullptr);
+
+        auto e = readExprBody(tag);
+        exprs[id] = e;
+        return e;
+    }
+
+    Expr * readExprBody(ExprTag tag)
+    {
+        switch (tag) {
+
+        case ExprTag::Int:
+            return new ExprInt((NixInt) readNum());
+
+        case ExprTag::Float: {
+            auto bits = readNum();
+            NixFloat f;
+            memcpy(&f, &bits, sizeof(f));
+            return new ExprFloat(f);
+        }
+
+        case ExprTag::String:
+            return new ExprString(readString(source));
+
+        case ExprTag::Path:
+            return new ExprPath(ref<InputAccessor>(state.rootFS), readString(source));
+
+        case ExprTag::Var: {
+            auto pos = readPos();
+            auto name = readSymbol();
+            return new ExprVar(pos, name);
+        }
+
+        case ExprTag::Select: {
+            auto pos = readPos();
+            auto e = readExpr();
+            auto def = readExpr();
+            return new ExprSelect(pos, e, readAttrPath(), def);
+        }
+
+        case ExprTag::OpHasAttr: {
+            auto e = readExpr();
+            return new ExprOpHasAttr(e, readAttrPath());
+        }
+
+        case ExprTag::Attrs: {
+            auto recursive = readBool();
+            auto e = new ExprAttrs(readPos());
+            e->recursive = recursive;
+            auto nrAttrs = readNum();
+            for (uint64_t i = 0; i < nrAttrs; ++i) {
+                auto name = readSymbol();
+                auto inherited = readBool();
+                auto pos = readPos();
+                e->attrs.emplace(name, ExprAttrs::AttrDef(readExpr(), pos, inherited));
+            }
+            auto nrDynamicAttrs = readNum();
+            for (uint64_t i = 0; i < nrDynamicAttrs; ++i) {
+                auto pos = readPos();
+                auto nameExpr = readExpr();
+                auto valueExpr = readExpr();
+                e->dynamicAttrs.emplace_back(nameExpr, valueExpr, pos);
+            }
+            return e;
+        }
+
+        case ExprTag::List: {
+            auto e = new ExprList;
+            auto n = readNum();
+            for (uint64_t i = 0; i < n; ++i)
+                e->elems.push_back(readExpr());
+            return e;
+        }
+
+        case ExprTag::Lambda: {
+            auto pos = readPos();
+            auto name = readSymbol();
+            auto arg = readSymbol();
+            Formals * formals = nullptr;
+            if (readBool()) {
+                formals = new Formals;
+                formals->ellipsis = readBool();
+                auto n = readNum();
+                for (uint64_t i = 0; i < n; ++i) {
+                    auto pos = readPos();
+                    auto name = readSymbol();
+                    formals->formals.push_back(Formal { pos, name, readExpr() });
+                }
+                /* Formals are kept sorted by symbol, and symbols may
+                   have been numbered differently when the entry was
+                   written. */
+                std::stable_sort(formals->formals.begin(), formals->formals.end(),
+                    [] (const auto & a, const auto & b) { return a.name < b.name; });
+            }
+            auto e = new ExprLambda(pos, arg, formals, readExpr());
+            e->name = name;
+            return e;
+        }
+
+        case ExprTag::Call: {
+            auto pos = readPos();
+            auto fun = readExpr();
+            std::vector<Expr *> args;
+            auto n = readNum();
+            for (uint64_t i = 0; i < n; ++i)
+                args.push_back(readExpr());
+            return new ExprCall(pos, fun, std::move(args));
+        }
+
+        case ExprTag::Let: {
+            auto attrs = dynamic_cast<ExprAttrs *>(readExpr());
+            if (!attrs)
+                throw SerialisationError("invalid 'let' in parse cache entry");
+            return new ExprLet(attrs, readExpr());
+        }
+
+        case ExprTag::With: {
+            auto pos = readPos();
+            auto attrs = readExpr();
+            return new ExprWith(pos, attrs, readExpr());
+        }
+
+        case ExprTag::If: {
+            auto pos = readPos();
+            auto cond = readExpr();
+            auto then = readExpr();
+            return new ExprIf(pos, cond, then, readExpr());
+        }
+
+        case ExprTag::Assert: {
+            auto pos = readPos();
+            auto cond = readExpr();
+            return new ExprAssert(pos, cond, readExpr());
+        }
+
+        case ExprTag::OpNot:
+            return new ExprOpNot(readExpr());
+
+        case ExprTag::OpEq: return readBinOp<ExprOpEq>();
+        case ExprTag::OpNEq: return readBinOp<ExprOpNEq>();
+        case ExprTag::OpAnd: return readBinOp<ExprOpAnd>();
+        case ExprTag::OpOr: return readBinOp<ExprOpOr>();
+        case ExprTag::OpImpl: return readBinOp<ExprOpImpl>();
+        case ExprTag::OpUpdate: return readBinOp<ExprOpUpdate>();
+        case ExprTag::OpConcatLists: return readBinOp<ExprOpConcatLists>();
+
+        case ExprTag::ConcatStrings: {
+            auto pos = readPos();
+            auto forceString = readBool();
+            auto es = new std::vector<std::pair<PosIdx, Expr *>>;
+            auto n = readNum();
+            for (uint64_t i = 0; i < n; ++i) {
+                auto pos = readPos();
+                es->emplace_back(pos, readExpr());
+            }
+            return new ExprConcatStrings(pos, forceString, es);
+        }
+
+        case ExprTag::Pos:
+            return new ExprPos(readPos());
+
+        default:
+            throw SerialisationError("invalid expression tag %d in parse cache entry", (int) tag);
+        }
+    }
+
+    Expr * read()
+    {
+        if (readString(source) != parseCacheMagic)
+            throw SerialisationError("parse cache entry has an unsupported format");
+        auto n = readNum();
+        for (uint64_t i = 0; i < n; ++i)
+            symbols.push_back(state.symbols.create(readString(source)));
+        auto e = readExpr();
+        if (!e)
+            throw SerialisationError("empty parse cache entry");
+        return e;
+    }
+};
+
+
+Expr * deserialiseExpr(EvalState & state, std::string_view data, const Pos::Origin & origin)
+{
+    return ExprReader(state, data, origin).read();
+}
+
+}
@@ -0,0 +1,28 @@
+#pragma once
+///@file
+
+#include "nixexpr.hh"
+
+namespace nix {
+
+/**
+ * Serialise an expression tree produced by the parser, so that it can
+ * be stored in the on-disk parse cache. Symbols are stored by name and
+ * positions as line/column pairs, so the result doesn't depend on the
+ * state of the symbol and position tables. Subexpressions that are
+ * shared in the tree (e.g. the source of `inherit (e) a b;`) stay
+ * shared.
+ */
+std::string serialiseExpr(const EvalState & state, Expr & e);
+
+/**
+ * Inverse of `serialiseExpr()`. Positions are added to the position
+ * table with the given origin. The result still has to be passed to
+ * `bindVars()`.
+ *
+ * @throws SerialisationError or EndOfFile if `data` is not a valid
+ * serialised expression.
+ */
+Expr * deserialiseExpr(EvalState & state, std::string_view data, const Pos::Origin & origin);
+
+}
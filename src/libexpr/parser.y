@@ -24,6 +24,7 @@
 #include "eval.hh"
 #include "eval-settings.hh"
 #include "globals.hh"
+#include "tracing.hh"
 
 namespace nix {
 
@@ -643,6 +644,7 @@ formal
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/mman.h>
 
 #include "eval.hh"
 #include "filetransfer.hh"
@@ -651,6 +653,7 @@ formal
 #include "flake/flake.hh"
 #include "fs-input-accessor.hh"
 #include "memory-input-accessor.hh"
+#include "parse-cache.hh"
 
 
 namespace nix {
@@ -705,12 +708,135 @@ Expr * EvalState::parseExprFromFile(const SourcePath & path)
 }
 
 
+/**
+ * A private, writable memory mapping of a source file, followed by
+ * at least two zero bytes as required by yy_scan_buffer(). The lexer
+ * writes NUL bytes into the buffer while scanning, so only the pages
+ * it touches are copied. Note that truncating the file while it is
+ * mapped raises SIGBUS, so this is only used for large files where
+ * avoiding the copy into a string is worth it.
+ */
+struct MappedSource
+{
+    char * data = nullptr;
+    size_t size = 0, mappedSize = 0;
+
+    static constexpr size_t minSize = 1 << 20;
+
+    MappedSource(const MappedSource &) = delete;
+
+    /**
+     * Map `path` if it is a regular file of at least `minSize`
+     * bytes. Returns `nullptr` if the file should be read normally.
+     */
+    static std::unique_ptr<MappedSource> open(const Path & path)
+    {
+        AutoCloseFD fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (!fd)
+            throw SysError("opening file '%1%'", path);
+
+        struct stat st;
+        if (fstat(fd.get(), &st) == -1)
+            throw SysError("statting file '%1%'", path);
+
+        if (!S_ISREG(st.st_mode) || (size_t) st.st_size < minSize)
+            return nullptr;
+
+        /* Reserve room for the file plus the terminators, then map
+           the file over the start of it. The remainder of the last
+           file page and any following anonymous pages are zero. */
+        size_t pageSize = sysconf(_SC_PAGESIZE);
+        size_t mappedSize = ((size_t) st.st_size + 2 + pageSize - 1) / pageSize * pageSize;
+
+        auto p = mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) return nullptr;
+
+        if (mmap(p, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd.get(), 0) == MAP_FAILED) {
+            munmap(p, mappedSize);
+            return nullptr;
+        }
+
+        return std::unique_ptr<MappedSource>(new MappedSource((char *) p, st.st_size, mappedSize));
+    }
+
+    ~MappedSource()
+    {
+        munmap(data, mappedSize);
+    }
+
+private:
+    MappedSource(char * data, size_t size, size_t mappedSize)
+        : data(data), size(size), mappedSize(mappedSize)
+    { }
+};
+
+
 Expr * EvalState::parseExprFromFile(const SourcePath & path, std::shared_ptr<StaticEnv> & staticEnv)
 {
-    auto buffer = path.readFile();
-    // readFile hopefully have left some extra space for terminators
-    buffer.append("\0\0", 2);
-    return parse(buffer.data(), buffer.size(), Pos::Origin(path), path.parent(), staticEnv);
+    TraceSpan span("eval", "parse %s", path.to_string());
+
+    /* Parse large files in the root filesystem straight from a
+       memory mapping rather than copying them into a string. */
+    std::unique_ptr<MappedSource> mapped;
+    if (path.accessor == ref<InputAccessor>(rootFS)) {
+        rootFS->checkAllowed(path.path);
+        mapped = MappedSource::open(path.path.abs());
+    }
+
+    std::string buffer;
+    if (!mapped) buffer = path.readFile();
+
+    std::string_view contents = mapped
+        ? std::string_view(mapped->data, mapped->size)
+        : std::string_view(buffer);
+
+    /* Look for a previously parsed copy of this file in the parse
+       cache. Only files in the root filesystem are cached, since path
+       literals are resolved against it. The key covers the Nix
+       version, the file name (which path literals are relative to)
+       and its contents. */
+    std::optional<Path> cachePath;
+    if (evalSettings.useParseCache && path.accessor == ref<InputAccessor>(rootFS)) {
+        HashSink hashSink(htSHA256);
+        hashSink(nixVersion);
+        hashSink(path.path.abs());
+        hashSink(contents);
+        auto key = hashSink.finish().first;
+        cachePath = getCacheDir() + "/nix/parse-cache-v1/" + key.to_string(HashFormat::Base32, false);
+        if (pathExists(*cachePath)) {
+            try {
+                auto e = deserialiseExpr(*this, readFile(*cachePath), Pos::Origin(path));
+                e->bindVars(*this, staticEnv);
+                return e;
+            } catch (SerialisationError & e) {
+                debug("ignoring invalid parse cache entry '%s': %s", *cachePath, e.msg());
+            } catch (EndOfFile & e) {
+                debug("ignoring truncated parse cache entry '%s'", *cachePath);
+            }
+        }
+    }
+
+    Expr * e;
+    if (mapped)
+        e = parse(mapped->data, mapped->size + 2, Pos::Origin(path), path.parent(), staticEnv);
+    else {
+        // readFile hopefully have left some extra space for terminators
+        buffer.append("\0\0", 2);
+        e = parse(buffer.data(), buffer.size(), Pos::Origin(path), path.parent(), staticEnv);
+    }
+
+    if (cachePath) {
+        try {
+            createDirs(dirOf(*cachePath));
+            auto tmpPath = fmt("%s.tmp-%d", *cachePath, getpid());
+            writeFile(tmpPath, serialiseExpr(*this, *e));
+            renameFile(tmpPath, *cachePath);
+        } catch (Error & e) {
+            debug("cannot write parse cache entry '%s': %s", *cachePath, e.msg());
+        }
+    }
+
+    return e;
 }
 
 
@@ -4,11 +4,14 @@
 #include "eval-inline.hh"
 #include "eval.hh"
 #include "eval-settings.hh"
+#include "file-hash-cache.hh"
 #include "globals.hh"
 #include "json-to-value.hh"
 #include "names.hh"
 #include "path-references.hh"
+#include "regex-automaton.hh"
 #include "store-api.hh"
+#include "tracing.hh"
 #include "util.hh"
 #include "value-to-json.hh"
 #include "value-to-xml.hh"
@@ -23,7 +26,9 @@
 
 #include <algorithm>
 #include <cstring>
+#include <numeric>
 #include <regex>
+#include <thread>
 #include <dlfcn.h>
 
 #include <cmath>
@@ -47,6 +52,7 @@ StringMap EvalState::realiseContext(const NixStringContext & context)
 
     for (auto & c : context) {
         auto ensureValid = [&](const StorePath & p) {
+            waitForFetch(p);
             if (!store->isValidPath(p))
                 debugThrowLastTrace(InvalidPathError(store->printStorePath(p)));
         };
@@ -82,7 +88,28 @@ StringMap EvalState::realiseContext(const NixStringContext & context)
     /* Build/substitute the context. */
     std::vector<DerivedPath> buildReqs;
     for (auto & d : drvs) buildReqs.emplace_back(DerivedPath { d });
-    store->buildPaths(buildReqs);
+
+    if (deferImportsFromDerivation) {
+        bool missing = false;
+        for (auto & drv : drvs) {
+            try {
+                for (auto & [_, outputPath] : resolveDerivedPath(*store, drv))
+                    if (!store->isValidPath(outputPath))
+                        missing = true;
+            } catch (Error &) {
+                /* The output paths aren't known yet (e.g. for
+                   content-addressed derivations). */
+                missing = true;
+            }
+        }
+        if (missing) {
+            pendingImports.insert(buildReqs.begin(), buildReqs.end());
+            throw ImportFromDerivationPending(
+                "evaluation needs the outputs of '%s', which have not been built yet",
+                drvs.begin()->to_string(*store));
+        }
+    } else
+        store->buildPaths(buildReqs);
 
     for (auto & drv : drvs) {
         auto outputs = resolveDerivedPath(*store, drv);
@@ -109,6 +136,14 @@ StringMap EvalState::realiseContext(const NixStringContext & context)
     return res;
 }
 
+void EvalState::buildPendingImports()
+{
+    if (pendingImports.empty()) return;
+    std::vector<DerivedPath> buildReqs(pendingImports.begin(), pendingImports.end());
+    pendingImports.clear();
+    store->buildPaths(buildReqs);
+}
+
 struct RealisePathFlags {
     // Whether to check that the path is allowed in pure eval mode
     bool checkForPureEval = true;
@@ -623,6 +658,45 @@ struct CompareValues
 };
 
 
+/**
+ * Hashing and equality of values of a single type among integers,
+ * strings and paths, consistent with `CompareValues`.
+ */
+struct HashKey
+{
+    size_t operator () (Value * v) const
+    {
+        switch (v->type()) {
+            case nInt:
+                return std::hash<NixInt>()(v->integer);
+            case nString:
+                return std::hash<std::string_view>()(v->string_view());
+            case nPath:
+                return std::hash<std::string_view>()(v->_path.path);
+            default:
+                abort();
+        }
+    }
+};
+
+struct EqualKey
+{
+    bool operator () (Value * v1, Value * v2) const
+    {
+        switch (v1->type()) {
+            case nInt:
+                return v1->integer == v2->integer;
+            case nString:
+                return v1->string_view() == v2->string_view();
+            case nPath:
+                return strcmp(v1->_path.path, v2->_path.path) == 0;
+            default:
+                abort();
+        }
+    }
+};
+
+
 #if HAVE_BOEHMGC
 typedef std::list<Value *, gc_allocator<Value *>> ValueList;
 #else
@@ -673,6 +747,30 @@ static void prim_genericClosure(EvalState & state, const PosIdx pos, Value * * a
     // reachable from res.
     auto cmp = CompareValues(state, noPos, "while comparing the `key` attributes of two genericClosure elements");
     std::set<Value *, decltype(cmp)> doneKeys(cmp);
+
+    /* As long as all keys are integers, or all keys are strings, or
+       all keys are paths, keep them in a hash set instead. If a key
+       of another type shows up, move them to `doneKeys` so that it
+       gets compared (or fails to compare) to them as before. */
+    std::unordered_set<Value *, HashKey, EqualKey> doneHashedKeys;
+    std::optional<ValueType> hashedKeyType;
+
+    auto insertKey = [&](Value * key) {
+        auto type = key->type();
+        if (doneKeys.empty()
+            && (type == nInt || type == nString || type == nPath)
+            && (!hashedKeyType || *hashedKeyType == type))
+        {
+            hashedKeyType = type;
+            return doneHashedKeys.insert(key).second;
+        }
+        if (!doneHashedKeys.empty()) {
+            doneKeys.insert(doneHashedKeys.begin(), doneHashedKeys.end());
+            doneHashedKeys.clear();
+        }
+        return doneKeys.insert(key).second;
+    };
+
     while (!workSet.empty()) {
         Value * e = *(workSet.begin());
         workSet.pop_front();
@@ -682,7 +780,7 @@ static void prim_genericClosure(EvalState & state, const PosIdx pos, Value * * a
         Bindings::iterator key = getAttr(state, state.sKey, e->attrs, "in one of the attrsets generated by (or initially passed to) builtins.genericClosure");
         state.forceValue(*key->value, noPos);
 
-        if (!doneKeys.insert(key->value).second) continue;
+        if (!insertKey(key->value)) continue;
         res.push_back(e);
 
         /* Call the `operator' function with `e' as argument. */
@@ -1086,6 +1184,8 @@ static void prim_derivationStrict(EvalState & state, const PosIdx pos, Value * *
 static void derivationStrictInternal(EvalState & state, const std::string &
 drvName, Bindings * attrs, Value & v)
 {
+    TraceSpan span("eval", "instantiate %s", drvName);
+
     /* Check whether attributes should be passed as a JSON file. */
     using nlohmann::json;
     std::optional<json> jsonObject;
@@ -1398,6 +1498,11 @@ drvName, Bindings * attrs, Value & v)
         }
     }
 
+    /* The sources must be in the store before writing the
+       derivation, which refers to them. */
+    for (auto & i : drv.inputSrcs)
+        state.waitForFetch(i);
+
     /* Write the resulting term into the Nix store directory. */
     auto drvPath = writeDerivation(*state.store, drv, state.repair);
     auto drvPathS = state.store->printStorePath(drvPath);
@@ -1765,6 +1870,14 @@ static void prim_hashFile(EvalState & state, const PosIdx pos, Value * * args, V
 
     auto path = realisePath(state, pos, *args[1]);
 
+    /* Local files are hashed through a cache, after checking that
+       they may be accessed at all. */
+    if (auto physicalPath = path.accessor->getPhysicalPath(path.path)) {
+        path.lstat();
+        v.mkString(hashPathCached(physicalPath->abs(), FileIngestionMethod::Flat, *ht).to_string(HashFormat::Base16, false));
+        return;
+    }
+
     v.mkString(hashString(*ht, path.readFile()).to_string(HashFormat::Base16, false));
 }
 
@@ -1816,9 +1929,9 @@ static void prim_readDir(EvalState & state, const PosIdx pos, Value * * args, Va
     auto entries = path.readDirectory();
     auto attrs = state.buildBindings(entries.size());
 
-    // If we hit unknown directory entry types we may need to fallback to
-    // using `getFileType` on some systems.
-    // In order to reduce system calls we make each lookup lazy by using
+    // The accessor already resolves entry types that readdir() doesn't
+    // report, so unknown types are rare (e.g. entries that vanished
+    // meanwhile). For those we fall back to a lazy
     // `builtins.readFileType` application.
     Value * readFileType = nullptr;
 
@@ -1915,7 +2028,8 @@ static void prim_toXML(EvalState & state, const PosIdx pos, Value * * args, Valu
     std::ostringstream out;
     NixStringContext context;
     printValueAsXML(state, true, false, *args[0], out, context, pos);
-    v.mkString(out.str(), context);
+    /* Avoid copying the document before copying it into the value. */
+    v.mkString(out.view(), context);
 }
 
 static RegisterPrimOp primop_toXML({
@@ -2243,7 +2357,7 @@ static void addPath(
             });
 
         if (!expectedHash || !state.store->isValidPath(*expectedStorePath)) {
-            auto dstPath = state.rootPath(CanonPath(path)).fetchToStore(state.store, name, method, &filter, state.repair);
+            auto dstPath = state.rootPath(CanonPath(path)).fetchToStore(state.store, name, method, filterFun ? &filter : nullptr, state.repair);
             if (expectedHash && expectedStorePath != dstPath)
                 state.debugThrowLastTrace(Error("store path mismatch in (possibly filtered) path added from '%s'", path));
             state.allowAndSetStorePathString(dstPath, v);
@@ -3274,6 +3388,169 @@ static RegisterPrimOp primop_genList({
 static void prim_lessThan(EvalState & state, const PosIdx pos, Value * * args, Value & v);
 
 
+/**
+ * Whether `e1` and `e2`, both in the body of a comparator `a: b: ...`,
+ * are the same expression, except that where `e1` refers to the
+ * argument `level1` levels up, `e2` refers to the argument `level2`
+ * levels up. Only variables, attribute selections and function calls
+ * are considered, since those don't introduce new scopes.
+ */
+static bool sameModuloArgument(Expr * e1, Expr * e2, Level level1, Level level2)
+{
+    if (auto v1 = dynamic_cast<ExprVar *>(e1)) {
+        auto v2 = dynamic_cast<ExprVar *>(e2);
+        if (!v2 || v1->fromWith || v2->fromWith) return false;
+        if (v1->level == level1 && v1->displ == 0)
+            return v2->level == level2 && v2->displ == 0;
+        return v1->level > 1 && v1->level == v2->level && v1->displ == v2->displ;
+    }
+
+    if (auto s1 = dynamic_cast<ExprSelect *>(e1)) {
+        auto s2 = dynamic_cast<ExprSelect *>(e2);
+        if (!s2 || s1->def || s2->def || s1->attrPath.size() != s2->attrPath.size())
+            return false;
+        for (size_t i = 0; i < s1->attrPath.size(); ++i) {
+            auto & n1 = s1->attrPath[i], & n2 = s2->attrPath[i];
+            if (!n1.symbol || n1.symbol != n2.symbol) return false;
+        }
+        return sameModuloArgument(s1->e, s2->e, level1, level2);
+    }
+
+    if (auto c1 = dynamic_cast<ExprCall *>(e1)) {
+        auto c2 = dynamic_cast<ExprCall *>(e2);
+        if (!c2 || c1->args.size() != c2->args.size()
+            || !sameModuloArgument(c1->fun, c2->fun, level1, level2))
+            return false;
+        for (size_t i = 0; i < c1->args.size(); ++i)
+            if (!sameModuloArgument(c1->args[i], c2->args[i], level1, level2))
+                return false;
+        return true;
+    }
+
+    return false;
+}
+
+/**
+ * A comparator that `builtins.sort` can apply natively: either
+ * `builtins.lessThan` itself, or a function of the form
+ * `a: b: f a < f b` (or `>`), which compares the keys `f a` and `f b`
+ * with `builtins.lessThan`.
+ */
+struct NativeComparator
+{
+    /**
+     * The key expression `f a`, to be evaluated with `a` bound to the
+     * element, or `nullptr` to compare the elements themselves.
+     */
+    Expr * key = nullptr;
+    Env * env = nullptr;
+    bool descending = false;
+
+    static std::optional<NativeComparator> detect(Value & comparator)
+    {
+        if (comparator.isPrimOp())
+            return comparator.primOp->fun == prim_lessThan
+                ? std::optional(NativeComparator{})
+                : std::nullopt;
+
+        if (!comparator.isLambda()) return std::nullopt;
+
+        auto outer = comparator.lambda.fun;
+        auto inner = dynamic_cast<ExprLambda *>(outer->body);
+        if (!outer->arg || outer->hasFormals() || !inner || !inner->arg || inner->hasFormals())
+            return std::nullopt;
+
+        auto call = dynamic_cast<ExprCall *>(inner->body);
+        if (!call || call->args.size() != 2) return std::nullopt;
+
+        /* Check that the function being called is the real
+           `__lessThan`. Levels 0 and 1 are the environments of the
+           two lambdas. */
+        auto fun = dynamic_cast<ExprVar *>(call->fun);
+        if (!fun || fun->fromWith || fun->level < 2) return std::nullopt;
+        auto env = comparator.lambda.env;
+        for (auto l = fun->level; l > 2; --l) env = env->up;
+        auto vFun = env->values[fun->displ];
+        if (!vFun || !vFun->isPrimOp() || vFun->primOp->fun != prim_lessThan)
+            return std::nullopt;
+
+        /* `a` is one level up from the inner body, `b` is zero. */
+        if (sameModuloArgument(call->args[0], call->args[1], 1, 0))
+            return NativeComparator { .key = call->args[0], .env = comparator.lambda.env };
+        if (sameModuloArgument(call->args[0], call->args[1], 0, 1))
+            return NativeComparator { .key = call->args[1], .env = comparator.lambda.env, .descending = true };
+
+        return std::nullopt;
+    }
+
+    Value * getKey(EvalState & state, Value * elem) const
+    {
+        if (!key) return elem;
+
+        /* Rebuild the environments of the two lambdas, with `a`
+           bound to the element. `key` doesn't refer to `b`. */
+        Env & envA(state.allocEnv(1));
+        envA.up = env;
+        envA.values[0] = elem;
+        Env & envB(state.allocEnv(1));
+        envB.up = &envA;
+        envB.values[0] = elem;
+
+        auto v = state.allocValue();
+        key->eval(state, envB, *v);
+        return v;
+    }
+};
+
+/**
+ * Lists at least this long whose keys are all integers or all
+ * strings are sorted on multiple threads.
+ */
+static constexpr size_t parallelSortThreshold = 1 << 16;
+
+/**
+ * A stable sort that sorts chunks of `xs` on separate threads and
+ * then merges them. `comp` must not call into the evaluator.
+ */
+template<typename T, typename Compare>
+static void parallelStableSort(std::vector<T> & xs, Compare comp)
+{
+    size_t nrChunks = std::clamp<size_t>(std::thread::hardware_concurrency(), 1, 16);
+    if (nrChunks == 1 || xs.size() < parallelSortThreshold) {
+        std::stable_sort(xs.begin(), xs.end(), comp);
+        return;
+    }
+
+    std::vector<size_t> bounds;
+    for (size_t i = 0; i <= nrChunks; ++i)
+        bounds.push_back(xs.size() * i / nrChunks);
+
+    auto inParallel = [&](size_t n, auto && fun) {
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < n; ++i)
+            threads.emplace_back(fun, i);
+        fun(0);
+        for (auto & thread : threads) thread.join();
+    };
+
+    inParallel(nrChunks, [&](size_t i) {
+        std::stable_sort(xs.begin() + bounds[i], xs.begin() + bounds[i + 1], comp);
+    });
+
+    /* Merge adjacent chunks until one is left. */
+    while (bounds.size() > 2) {
+        std::vector<size_t> merged;
+        for (size_t i = 0; i + 1 < bounds.size(); i += 2)
+            merged.push_back(bounds[i]);
+        merged.push_back(bounds.back());
+        inParallel((bounds.size() - 1) / 2, [&](size_t i) {
+            auto begin = xs.begin();
+            std::inplace_merge(begin + bounds[2 * i], begin + bounds[2 * i + 1], begin + bounds[2 * i + 2], comp);
+        });
+        bounds = std::move(merged);
+    }
+}
+
 static void prim_sort(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     state.forceList(*args[1], pos, "while evaluating the second argument passed to builtins.sort");
@@ -3292,14 +3569,54 @@ static void prim_sort(EvalState & state, const PosIdx pos, Value * * args, Value
         v.listElems()[n] = args[1]->listElems()[n];
     }
 
-    auto comparator = [&](Value * a, Value * b) {
-        /* Optimization: if the comparator is lessThan, bypass
-           callFunction. */
-        /* TODO: (layus) this is absurd. An optimisation like this
-           should be outside the lambda creation */
-        if (args[0]->isPrimOp() && args[0]->primOp->fun == prim_lessThan)
-            return CompareValues(state, noPos, "while evaluating the ordering function passed to builtins.sort")(a, b);
+    if (auto native = NativeComparator::detect(*args[0]); native && len > 1) {
+        /* Evaluate the key of each element once, rather than
+           calling the comparator for every comparison. */
+        ValueVector keys;
+        keys.reserve(len);
+        bool allInts = true, allStrings = true;
+        for (unsigned int n = 0; n < len; ++n) {
+            auto elem = v.listElems()[n];
+            Value * key;
+            try {
+                key = native->getKey(state, elem);
+            } catch (Error & e) {
+                e.addTrace(state.positions[pos], "while evaluating the ordering function passed to builtins.sort");
+                throw;
+            }
+            allInts = allInts && key->type() == nInt;
+            allStrings = allStrings && key->type() == nString;
+            keys.push_back(key);
+        }
+
+        std::vector<size_t> order(len);
+        std::iota(order.begin(), order.end(), 0);
+
+        auto sortBy = [&](auto less) {
+            if (native->descending)
+                parallelStableSort(order, [&](size_t a, size_t b) { return less(keys[b], keys[a]); });
+            else
+                parallelStableSort(order, [&](size_t a, size_t b) { return less(keys[a], keys[b]); });
+        };
+
+        if (allInts)
+            sortBy([](Value * a, Value * b) { return a->integer < b->integer; });
+        else if (allStrings)
+            sortBy([](Value * a, Value * b) { return a->string_view() < b->string_view(); });
+        else {
+            CompareValues comp(state, noPos, "while evaluating the ordering function passed to builtins.sort");
+            std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+                return native->descending ? comp(keys[b], keys[a]) : comp(keys[a], keys[b]);
+            });
+        }
+
+        ValueVector elems(v.listElems(), v.listElems() + len);
+        for (unsigned int n = 0; n < len; ++n)
+            v.listElems()[n] = elems[order[n]];
+        return;
+    }
 
+    auto comparator = [&](Value * a, Value * b) {
         Value * vs[] = {a, b};
         Value vBool;
         state.callFunction(*args[0], 2, vs, vBool, noPos);
@@ -3877,17 +4194,30 @@ static RegisterPrimOp primop_convertHash({
 
 struct RegexCache
 {
+    struct Entry
+    {
+        std::regex regex;
+
+        /* Used instead of `regex` where it suffices, if the regex is
+           supported by it. */
+        std::optional<RegexAutomaton> automaton;
+    };
+
     // TODO use C++20 transparent comparison when available
-    std::unordered_map<std::string_view, std::regex> cache;
+    std::unordered_map<std::string_view, Entry> cache;
     std::list<std::string> keys;
 
-    std::regex get(std::string_view re)
+    Entry & get(std::string_view re)
     {
         auto it = cache.find(re);
         if (it != cache.end())
             return it->second;
+        std::regex regex(re.begin(), re.end(), std::regex::extended);
         keys.emplace_back(re);
-        return cache.emplace(keys.back(), std::regex(keys.back(), std::regex::extended)).first->second;
+        return cache.emplace(keys.back(), Entry {
+            .regex = std::move(regex),
+            .automaton = RegexAutomaton::compile(re),
+        }).first->second;
     }
 };
 
@@ -3902,13 +4232,26 @@ void prim_match(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 
     try {
 
-        auto regex = state.regexCache->get(re);
+        auto & regex = state.regexCache->get(re);
 
         NixStringContext context;
         const auto str = state.forceString(*args[1], context, pos, "while evaluating the second argument passed to builtins.match");
 
+        /* Regexes without groups don't need std::regex at all, and
+           failing matches are rejected without backtracking. */
+        if (regex.automaton) {
+            if (!regex.automaton->match(str)) {
+                v.mkNull();
+                return;
+            }
+            if (regex.regex.mark_count() == 0) {
+                state.mkList(v, 0);
+                return;
+            }
+        }
+
         std::cmatch match;
-        if (!std::regex_match(str.begin(), str.end(), match, regex)) {
+        if (!std::regex_match(str.begin(), str.end(), match, regex.regex)) {
             v.mkNull();
             return;
         }
@@ -3982,12 +4325,18 @@ void prim_split(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 
     try {
 
-        auto regex = state.regexCache->get(re);
+        auto & regex = state.regexCache->get(re);
 
         NixStringContext context;
         const auto str = state.forceString(*args[1], context, pos, "while evaluating the second argument passed to builtins.split");
 
-        auto begin = std::cregex_iterator(str.begin(), str.end(), regex);
+        if (regex.automaton && !regex.automaton->search(str)) {
+            state.mkList(v, 1);
+            v.listElems()[0] = args[1];
+            return;
+        }
+
+        auto begin = std::cregex_iterator(str.begin(), str.end(), regex.regex);
         auto end = std::cregex_iterator();
 
         // Any matches results are surrounded by non-matching results.
@@ -4109,7 +4458,126 @@ static RegisterPrimOp primop_concatStringsSep({
     .fun = prim_concatStringsSep,
 });
 
-static void prim_replaceStrings(EvalState & state, const PosIdx pos, Value * * args, Value & v)
+/**
+ * A matcher for a list of patterns that finds, at a given position,
+ * the first pattern in the list that occurs there. The patterns are
+ * stored in a trie, so the cost of a lookup depends on the length of
+ * the patterns rather than on their number.
+ */
+struct StringMatcher
+{
+    static constexpr uint32_t noMatch = std::numeric_limits<uint32_t>::max();
+
+    struct Node
+    {
+        /* Index of the first pattern that ends at this node. */
+        uint32_t match = noMatch;
+        /* Sorted by character. */
+        std::vector<std::pair<unsigned char, uint32_t>> edges;
+    };
+
+    std::vector<Node> nodes;
+
+    /* The children of the root node, by character. Zero means no
+       pattern starts with that character, since the root is never a
+       child. */
+    std::array<uint32_t, 256> rootEdges{};
+
+    /* Index of the first empty pattern, which matches everywhere. */
+    uint32_t empty = noMatch;
+
+    StringMatcher(const std::vector<std::string> & patterns)
+        : nodes(1)
+    {
+        for (auto [n, pattern] : enumerate(patterns)) {
+            if (pattern.empty()) {
+                /* Patterns after an empty one can never match. */
+                empty = n;
+                break;
+            }
+            uint32_t node = 0;
+            for (unsigned char c : pattern) {
+                uint32_t next = node ? find(node, c) : rootEdges[c];
+                if (!next) {
+                    next = nodes.size();
+                    if (node) {
+                        auto & edges = nodes[node].edges;
+                        edges.insert(
+                            std::lower_bound(edges.begin(), edges.end(), std::make_pair(c, 0u)),
+                            {c, next});
+                    } else
+                        rootEdges[c] = next;
+                    nodes.emplace_back();
+                }
+                node = next;
+            }
+            if (nodes[node].match == noMatch)
+                nodes[node].match = n;
+        }
+    }
+
+    uint32_t find(uint32_t node, unsigned char c) const
+    {
+        auto & edges = nodes[node].edges;
+        auto i = std::lower_bound(edges.begin(), edges.end(), std::make_pair(c, 0u));
+        return i != edges.end() && i->first == c ? i->second : 0;
+    }
+
+    /**
+     * Return the index and length of the first pattern that occurs in
+     * `s` at position `p`, or `noMatch` if there is none.
+     */
+    std::pair<uint32_t, size_t> match(std::string_view s, size_t p) const
+    {
+        std::pair<uint32_t, size_t> best{empty, 0};
+        uint32_t node = p < s.size() ? rootEdges[(unsigned char) s[p]] : 0;
+        for (size_t len = 1; node; ++len) {
+            auto m = nodes[node].match;
+            if (m < best.first) best = {m, len};
+            if (++p == s.size()) break;
+            node = find(node, s[p]);
+        }
+        return best;
+    }
+
+    /**
+     * Return the first position at or after `p` where a pattern may
+     * occur.
+     */
+    size_t skip(std::string_view s, size_t p) const
+    {
+        if (empty != noMatch) return p;
+        while (p < s.size() && !rootEdges[(unsigned char) s[p]]) ++p;
+        return p;
+    }
+};
+
+struct ReplaceStringsCache
+{
+    std::unordered_map<std::string, std::shared_ptr<const StringMatcher>> cache;
+
+    std::shared_ptr<const StringMatcher> get(const std::vector<std::string> & patterns)
+    {
+        /* Length-prefix the patterns to get an unambiguous key. */
+        std::string key;
+        for (auto & pattern : patterns) {
+            key += std::to_string(pattern.size());
+            key += ':';
+            key += pattern;
+        }
+        auto i = cache.find(key);
+        if (i != cache.end())
+            return i->second;
+        return cache.emplace(std::move(key), std::make_shared<const StringMatcher>(patterns)).first->second;
+    }
+};
+
+std::shared_ptr<ReplaceStringsCache> makeReplaceStringsCache()
+{
+    return std::make_shared<ReplaceStringsCache>();
+}
+
+void prim_replaceStrings(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     state.forceList(*args[0], pos, "while evaluating the first argument passed to builtins.replaceStrings");
     state.forceList(*args[1], pos, "while evaluating the second argument passed to builtins.replaceStrings");
@@ -4121,6 +4589,8 @@ static void prim_replaceStrings(EvalState & state, const PosIdx pos, Value * * a
     for (auto elem : args[0]->listItems())
         from.emplace_back(state.forceString(*elem, pos, "while evaluating one of the strings to replace passed to builtins.replaceStrings"));
 
+    auto matcher = state.replaceStringsCache->get(from);
+
     std::unordered_map<size_t, std::string> cache;
     auto to = args[1]->listItems();
 
@@ -4130,35 +4600,33 @@ static void prim_replaceStrings(EvalState & state, const PosIdx pos, Value * * a
     std::string res;
     // Loops one past last character to handle the case where 'from' contains an empty string.
     for (size_t p = 0; p <= s.size(); ) {
-        bool found = false;
-        auto i = from.begin();
-        auto j = to.begin();
-        size_t j_index = 0;
-        for (; i != from.end(); ++i, ++j, ++j_index)
-            if (s.compare(p, i->size(), *i) == 0) {
-                found = true;
-                auto v = cache.find(j_index);
-                if (v == cache.end()) {
-                    NixStringContext ctx;
-                    auto ts = state.forceString(**j, ctx, pos, "while evaluating one of the replacement strings passed to builtins.replaceStrings");
-                    v = (cache.emplace(j_index, ts)).first;
-                    for (auto& path : ctx)
-                        context.insert(path);
-                }
-                res += v->second;
-                if (i->empty()) {
-                    if (p < s.size())
-                        res += s[p];
-                    p++;
-                } else {
-                    p += i->size();
-                }
-                break;
-            }
-        if (!found) {
+        auto next = matcher->skip(s, p);
+        res.append(s, p, next - p);
+        p = next;
+
+        auto [j_index, len] = matcher->match(s, p);
+        if (j_index == StringMatcher::noMatch) {
             if (p < s.size())
                 res += s[p];
             p++;
+            continue;
+        }
+
+        auto v = cache.find(j_index);
+        if (v == cache.end()) {
+            NixStringContext ctx;
+            auto ts = state.forceString(*to.begin()[j_index], ctx, pos, "while evaluating one of the replacement strings passed to builtins.replaceStrings");
+            v = (cache.emplace(j_index, ts)).first;
+            for (auto& path : ctx)
+                context.insert(path);
+        }
+        res += v->second;
+        if (len == 0) {
+            if (p < s.size())
+                res += s[p];
+            p++;
+        } else {
+            p += len;
         }
     }
 
@@ -4529,8 +4997,21 @@ void EvalState::createBaseEnv()
        `drvPath' and `outPath' attributes lazily.
 
        Null docs because it is documented separately.
+
+       This is a thunk, so that `derivation.nix' is only parsed and
+       evaluated by processes that actually use it rather than on
+       every startup.
        */
-    auto vDerivation = allocValue();
+    auto vDerivationPrimOp = allocValue();
+    vDerivationPrimOp->mkPrimOp(new PrimOp {
+        .name = "derivation",
+        .arity = 1,
+        .fun = [](EvalState & state, const PosIdx pos, Value * * args, Value & v) {
+            state.evalFile(state.derivationInternal, v);
+        },
+    });
+    Value vDerivation;
+    vDerivation.mkApp(vDerivationPrimOp, vDerivationPrimOp);
     addConstant("derivation", vDerivation, {
         .type = nFunction,
     });
@@ -4540,10 +5021,6 @@ void EvalState::createBaseEnv()
     baseEnv.values[0]->attrs->sort();
 
     staticBaseEnv->sort();
-
-    /* Note: we have to initialize the 'derivation' constant *after*
-       building baseEnv/staticBaseEnv because it uses 'builtins'. */
-    evalFile(derivationInternal, *vDerivation);
 }
 
 
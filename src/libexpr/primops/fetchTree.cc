@@ -225,6 +225,32 @@ static RegisterPrimOp primop_fetchTree({
     .fun = prim_fetchTree,
 });
 
+static StorePath downloadAndCheck(
+    ref<Store> store,
+    const std::string & url,
+    const std::string & name,
+    bool unpack,
+    std::optional<Hash> expectedHash)
+{
+    // TODO: fetching may fail, yet the path may be substitutable.
+    //       https://github.com/NixOS/nix/issues/4313
+    auto storePath =
+        unpack
+        ? fetchers::downloadTarball(store, url, name, (bool) expectedHash).storePath
+        : fetchers::downloadFile(store, url, name, (bool) expectedHash).storePath;
+
+    if (expectedHash) {
+        auto hash = unpack
+            ? store->queryPathInfo(storePath)->narHash
+            : hashFile(htSHA256, store->toRealPath(storePath));
+        if (hash != *expectedHash)
+            throw EvalError((unsigned int) 102, "hash mismatch in file downloaded from '%s':\n  specified: %s\n  got:       %s",
+                url, expectedHash->to_string(HashFormat::Base32, true), hash.to_string(HashFormat::Base32, true));
+    }
+
+    return storePath;
+}
+
 static void fetch(EvalState & state, const PosIdx pos, Value * * args, Value & v,
     const std::string & who, bool unpack, std::string name)
 {
@@ -283,24 +309,22 @@ static void fetch(EvalState & state, const PosIdx pos, Value * * args, Value & v
             state.allowAndSetStorePathString(expectedPath, v);
             return;
         }
-    }
 
-    // TODO: fetching may fail, yet the path may be substitutable.
-    //       https://github.com/NixOS/nix/issues/4313
-    auto storePath =
-        unpack
-        ? fetchers::downloadTarball(state.store, *url, name, (bool) expectedHash).storePath
-        : fetchers::downloadFile(state.store, *url, name, (bool) expectedHash).storePath;
-
-    if (expectedHash) {
-        auto hash = unpack
-            ? state.store->queryPathInfo(storePath)->narHash
-            : hashFile(htSHA256, state.store->toRealPath(storePath));
-        if (hash != *expectedHash)
-            state.debugThrowLastTrace(EvalError((unsigned int) 102, "hash mismatch in file downloaded from '%s':\n  specified: %s\n  got:       %s",
-                *url, expectedHash->to_string(HashFormat::Base32, true), hash.to_string(HashFormat::Base32, true)));
+        /* We know the result already, so there is no need to wait
+           for the download before continuing evaluation. */
+        if (evalSettings.backgroundFetch) {
+            state.fetchInBackground(expectedPath,
+                [store(state.store), url(*url), name, unpack, expectedHash(*expectedHash)]()
+                {
+                    downloadAndCheck(store, url, name, unpack, expectedHash);
+                });
+            state.allowAndSetStorePathString(expectedPath, v);
+            return;
+        }
     }
 
+    auto storePath = downloadAndCheck(state.store, *url, name, unpack, expectedHash);
+
     state.allowAndSetStorePathString(storePath, v);
 }
 
@@ -420,6 +444,8 @@ static RegisterPrimOp primop_fetchGit({
       - `shallow` (default: `false`)
 
         A Boolean parameter that specifies whether fetching a shallow clone is allowed.
+        If enabled, remote repositories are fetched with a depth of 1 into a separate shallow clone, fetching only `rev` if given (or otherwise the tip of `ref`) rather than the entire history.
+        The result has no `revCount`.
 
       - `allRefs`
 
@@ -3,25 +3,490 @@
 
 #include "../../toml11/toml.hpp"
 
+#include <limits>
 #include <sstream>
 
 namespace nix {
 
+/* Limit on the nesting of arrays and inline tables beyond which we
+   leave the document to toml11. */
+static constexpr size_t maxDepth = 1000;
+
+namespace {
+struct Unsupported { };
+}
+
+/**
+ * A parser for the subset of TOML used by files like `Cargo.lock`,
+ * which builds Nix values directly rather than converting a
+ * `toml::value` tree, which records the source location of every
+ * node. It throws `Unsupported` on anything outside that subset,
+ * including anything it can't be sure is valid, so that toml11 can
+ * parse the document instead and report errors.
+ */
+struct FastTOMLParser
+{
+    struct Table;
+
+    typedef std::vector<std::unique_ptr<Table>> ArrayOfTables;
+
+    /**
+     * Scalars, arrays and inline tables can't be extended once
+     * defined, so they are stored as Nix values. Other tables can
+     * still get entries from later lines.
+     */
+    typedef std::variant<Value *, std::unique_ptr<Table>, ArrayOfTables> Entry;
+
+    struct Table
+    {
+        /**
+         * Whether the table was created as the parent of a table
+         * header, by its own table header, or by a dotted key.
+         */
+        enum Kind { Implicit, Explicit, Dotted } kind;
+        std::map<Symbol, Entry> entries;
+    };
+
+    EvalState & state;
+    std::string_view s;
+    size_t p = 0;
+    size_t depth = 0;
+
+    /**
+     * Keeps the values in tables alive until they are converted.
+     */
+    ValueVector values;
+
+    bool atEnd() const { return p >= s.size(); }
+
+    char peek() const { return atEnd() ? 0 : s[p]; }
+
+    static bool isBareKeyChar(char c)
+    {
+        return isalnum((unsigned char) c) || c == '_' || c == '-';
+    }
+
+    /**
+     * Printable ASCII, or a tab if `allowTab`. This rejects all
+     * non-ASCII input, rather than validating UTF-8 here.
+     */
+    static bool isPlain(char c, bool allowTab)
+    {
+        return (c >= 0x20 && c < 0x7f) || (allowTab && c == '\t');
+    }
+
+    void skipWhitespace()
+    {
+        while (peek() == ' ' || peek() == '\t') p++;
+    }
+
+    void skipComment()
+    {
+        if (peek() != '#') return;
+        for (p++; !atEnd() && s[p] != '\n' && s[p] != '\r'; p++)
+            if (!isPlain(s[p], true)) throw Unsupported();
+    }
+
+    bool skipNewline()
+    {
+        if (peek() == '\n') {
+            p++;
+            return true;
+        }
+        if (s.substr(p, 2) == "\r\n") {
+            p += 2;
+            return true;
+        }
+        return false;
+    }
+
+    /**
+     * Skip the rest of a line, which may only contain a comment.
+     */
+    void expectEndOfLine()
+    {
+        skipWhitespace();
+        skipComment();
+        if (!atEnd() && !skipNewline()) throw Unsupported();
+    }
+
+    /**
+     * Skip whitespace, comments and newlines between array elements.
+     */
+    void skipBlank()
+    {
+        while (true) {
+            skipWhitespace();
+            skipComment();
+            if (!skipNewline()) break;
+        }
+    }
+
+    void expect(char c)
+    {
+        if (peek() != c) throw Unsupported();
+        p++;
+    }
+
+    static void appendUTF8(std::string & res, uint32_t c)
+    {
+        if (c < 0x80)
+            res += (char) c;
+        else if (c < 0x800) {
+            res += (char) (0xc0 | (c >> 6));
+            res += (char) (0x80 | (c & 0x3f));
+        } else if (c < 0x10000) {
+            res += (char) (0xe0 | (c >> 12));
+            res += (char) (0x80 | ((c >> 6) & 0x3f));
+            res += (char) (0x80 | (c & 0x3f));
+        } else {
+            res += (char) (0xf0 | (c >> 18));
+            res += (char) (0x80 | ((c >> 12) & 0x3f));
+            res += (char) (0x80 | ((c >> 6) & 0x3f));
+            res += (char) (0x80 | (c & 0x3f));
+        }
+    }
+
+    uint32_t parseHex(size_t digits)
+    {
+        uint32_t c = 0;
+        for (size_t i = 0; i < digits; ++i) {
+            auto d = peek();
+            if (!isxdigit((unsigned char) d)) throw Unsupported();
+            c = c * 16 + (isdigit((unsigned char) d) ? d - '0' : (tolower(d) - 'a' + 10));
+            p++;
+        }
+        /* Surrogates and values beyond Unicode aren't valid scalar
+           values. */
+        if ((c >= 0xd800 && c < 0xe000) || c > 0x10ffff) throw Unsupported();
+        return c;
+    }
+
+    std::string parseBasicString()
+    {
+        /* Multi-line strings aren't supported. */
+        if (s.substr(p, 3) == "\"\"\"") throw Unsupported();
+        expect('"');
+        std::string res;
+        while (true) {
+            if (atEnd()) throw Unsupported();
+            auto c = s[p++];
+            if (c == '"') return res;
+            if (c != '\\') {
+                if (!isPlain(c, false)) throw Unsupported();
+                res += c;
+                continue;
+            }
+            c = peek();
+            p++;
+            switch (c) {
+                case 'b': res += '\b'; break;
+                case 't': res += '\t'; break;
+                case 'n': res += '\n'; break;
+                case 'f': res += '\f'; break;
+                case 'r': res += '\r'; break;
+                case '"': res += '"'; break;
+                case '\\': res += '\\'; break;
+                case 'u': appendUTF8(res, parseHex(4)); break;
+                case 'U': appendUTF8(res, parseHex(8)); break;
+                default: throw Unsupported();
+            }
+        }
+    }
+
+    std::string_view parseLiteralString()
+    {
+        if (s.substr(p, 3) == "'''") throw Unsupported();
+        expect('\'');
+        auto start = p;
+        for (; peek() != '\''; p++)
+            if (!isPlain(peek(), false)) throw Unsupported();
+        return s.substr(start, p++ - start);
+    }
+
+    Symbol parseKeyPart()
+    {
+        if (peek() == '"' || peek() == '\'') {
+            auto key = peek() == '"' ? parseBasicString() : std::string(parseLiteralString());
+            if (key.empty()) throw Unsupported();
+            return state.symbols.create(key);
+        }
+        auto start = p;
+        while (isBareKeyChar(peek())) p++;
+        if (p == start) throw Unsupported();
+        return state.symbols.create(s.substr(start, p - start));
+    }
+
+    /**
+     * Parse a possibly dotted key. Whitespace around the dots isn't
+     * supported.
+     */
+    std::vector<Symbol> parseKey()
+    {
+        std::vector<Symbol> key{parseKeyPart()};
+        while (peek() == '.') {
+            p++;
+            key.push_back(parseKeyPart());
+        }
+        return key;
+    }
+
+    /**
+     * Check that a scalar isn't followed by something that would
+     * make it something else, like a float or a date.
+     */
+    void expectEndOfScalar()
+    {
+        switch (peek()) {
+            case 0: case ' ': case '\t': case '\n': case '\r':
+            case '#': case ',': case ']': case '}':
+                return;
+            default:
+                throw Unsupported();
+        }
+    }
+
+    /**
+     * Parse a decimal integer. Floats, infinity, NaN and integers in
+     * other bases are unsupported.
+     */
+    NixInt parseInteger()
+    {
+        bool negative = peek() == '-';
+        if (peek() == '-' || peek() == '+') p++;
+
+        uint64_t limit = (uint64_t) std::numeric_limits<NixInt>::max() + (negative ? 1 : 0);
+        uint64_t n = 0;
+
+        if (!isdigit((unsigned char) peek())) throw Unsupported();
+
+        if (peek() == '0')
+            p++;
+        else
+            while (true) {
+                n = n * 10 + (s[p++] - '0');
+                if (n > limit) throw Unsupported();
+                if (peek() == '_') p++;
+                if (!isdigit((unsigned char) peek())) {
+                    if (s[p - 1] == '_') throw Unsupported();
+                    break;
+                }
+                if (n > limit / 10) throw Unsupported();
+            }
+
+        expectEndOfScalar();
+        return negative ? (NixInt) (0 - n) : (NixInt) n;
+    }
+
+    Value * parseValue()
+    {
+        auto v = state.allocValue();
+
+        switch (peek()) {
+            case '"':
+                v->mkString(parseBasicString());
+                break;
+            case '\'':
+                v->mkString(parseLiteralString());
+                break;
+            case 't':
+            case 'f': {
+                bool b = peek() == 't';
+                auto word = b ? "true" : "false";
+                if (!s.substr(p).starts_with(word)) throw Unsupported();
+                p += strlen(word);
+                expectEndOfScalar();
+                v->mkBool(b);
+                break;
+            }
+            case '[':
+                parseArray(*v);
+                break;
+            case '{':
+                parseInlineTable(*v);
+                break;
+            default:
+                v->mkInt(parseInteger());
+        }
+
+        return v;
+    }
+
+    void parseArray(Value & v)
+    {
+        if (++depth > maxDepth) throw Unsupported();
+        expect('[');
+        ValueVector elems;
+        while (true) {
+            skipBlank();
+            if (peek() == ']') break;
+            elems.push_back(parseValue());
+            skipBlank();
+            if (peek() != ',') break;
+            p++;
+        }
+        expect(']');
+        state.mkList(v, elems.size());
+        std::copy(elems.begin(), elems.end(), v.listElems());
+        depth--;
+    }
+
+    void parseInlineTable(Value & v)
+    {
+        if (++depth > maxDepth) throw Unsupported();
+        expect('{');
+        Table table{Table::Explicit};
+        skipWhitespace();
+        if (peek() != '}')
+            while (true) {
+                parseKeyValue(table);
+                skipWhitespace();
+                if (peek() != ',') break;
+                p++;
+                skipWhitespace();
+            }
+        expect('}');
+        toValue(table, v);
+        depth--;
+    }
+
+    void parseKeyValue(Table & table)
+    {
+        auto key = parseKey();
+        skipWhitespace();
+        expect('=');
+        skipWhitespace();
+        auto v = parseValue();
+
+        /* Dotted keys can only extend tables created by dotted keys. */
+        auto t = &table;
+        for (size_t i = 0; i + 1 < key.size(); ++i) {
+            auto [j, inserted] = t->entries.try_emplace(key[i]);
+            if (inserted)
+                j->second = std::make_unique<Table>(Table{Table::Dotted});
+            auto sub = std::get_if<std::unique_ptr<Table>>(&j->second);
+            if (!sub || (*sub)->kind != Table::Dotted) throw Unsupported();
+            t = sub->get();
+        }
+
+        if (!t->entries.try_emplace(key.back(), v).second) throw Unsupported();
+        values.push_back(v);
+    }
+
+    /**
+     * Parse a `[table]` or `[[array-of-tables]]` header and return
+     * the table that the following lines define entries of.
+     */
+    Table & parseHeader(Table & root)
+    {
+        expect('[');
+        bool isArray = peek() == '[';
+        if (isArray) p++;
+        auto key = parseKey();
+        expect(']');
+        if (isArray) expect(']');
+        expectEndOfLine();
+
+        auto t = &root;
+        for (size_t i = 0; i + 1 < key.size(); ++i) {
+            auto [j, inserted] = t->entries.try_emplace(key[i]);
+            if (inserted)
+                j->second = std::make_unique<Table>(Table{Table::Implicit});
+            if (auto sub = std::get_if<std::unique_ptr<Table>>(&j->second); sub && (*sub)->kind != Table::Dotted)
+                t = sub->get();
+            else if (auto array = std::get_if<ArrayOfTables>(&j->second))
+                t = array->back().get();
+            else
+                throw Unsupported();
+        }
+
+        auto [j, inserted] = t->entries.try_emplace(key.back());
+
+        if (isArray) {
+            if (inserted) j->second = ArrayOfTables();
+            auto array = std::get_if<ArrayOfTables>(&j->second);
+            if (!array) throw Unsupported();
+            array->push_back(std::make_unique<Table>(Table{Table::Explicit}));
+            return *array->back();
+        }
+
+        if (inserted)
+            j->second = std::make_unique<Table>(Table{Table::Explicit});
+        else {
+            /* A table can only be defined once, but may have been
+               created implicitly as the parent of another one. */
+            auto sub = std::get_if<std::unique_ptr<Table>>(&j->second);
+            if (!sub || (*sub)->kind != Table::Implicit) throw Unsupported();
+            (*sub)->kind = Table::Explicit;
+        }
+        return *std::get<std::unique_ptr<Table>>(j->second);
+    }
+
+    void toValue(Table & table, Value & v)
+    {
+        auto attrs = state.buildBindings(table.entries.size());
+        for (auto & [name, entry] : table.entries)
+            std::visit(overloaded {
+                [&](Value * value) {
+                    attrs.insert(name, value);
+                },
+                [&](std::unique_ptr<Table> & sub) {
+                    toValue(*sub, attrs.alloc(name));
+                },
+                [&](ArrayOfTables & array) {
+                    auto & list = attrs.alloc(name);
+                    state.mkList(list, array.size());
+                    for (size_t i = 0; i < array.size(); ++i)
+                        toValue(*array[i], *(list.listElems()[i] = state.allocValue()));
+                },
+            }, entry);
+        v.mkAttrs(attrs);
+    }
+
+    void parse(Value & v)
+    {
+        Table root{Table::Explicit};
+        auto current = &root;
+
+        while (true) {
+            skipWhitespace();
+            if (atEnd()) break;
+            auto c = peek();
+            if (c == '#' || c == '\n' || c == '\r')
+                expectEndOfLine();
+            else if (c == '[')
+                current = &parseHeader(root);
+            else {
+                parseKeyValue(*current);
+                expectEndOfLine();
+            }
+        }
+
+        toValue(root, v);
+    }
+};
+
 static void prim_fromTOML(EvalState & state, const PosIdx pos, Value * * args, Value & val)
 {
     auto toml = state.forceStringNoCtx(*args[0], pos, "while evaluating the argument passed to builtins.fromTOML");
 
+    try {
+        FastTOMLParser{state, toml}.parse(val);
+        return;
+    } catch (Unsupported &) {
+    }
+
     std::istringstream tomlStream(std::string{toml});
 
-    std::function<void(Value &, toml::value)> visit;
+    std::function<void(Value &, const toml::value &)> visit;
 
-    visit = [&](Value & v, toml::value t) {
+    visit = [&](Value & v, const toml::value & t) {
 
         switch(t.type())
         {
             case toml::value_t::table:
                 {
-                    auto table = toml::get<toml::table>(t);
+                    auto & table = toml::get<toml::table>(t);
 
                     size_t size = 0;
                     for (auto & i : table) { (void) i; size++; }
@@ -36,7 +501,7 @@ static void prim_fromTOML(EvalState & state, const PosIdx pos, Value * * args, V
                 break;;
             case toml::value_t::array:
                 {
-                    auto array = toml::get<std::vector<toml::value>>(t);
+                    auto & array = toml::get<std::vector<toml::value>>(t);
 
                     size_t size = array.size();
                     state.mkList(v, size);
@@ -0,0 +1,453 @@
+#include "regex-automaton.hh"
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <limits>
+
+namespace nix {
+
+/* Limits beyond which we leave the regex to std::regex, or start over
+   with an empty DFA. */
+static constexpr size_t maxProgSize = 10000;
+static constexpr size_t maxRepeat = 255;
+static constexpr size_t maxDepth = 1000;
+static constexpr size_t maxStates = 1000;
+
+namespace {
+struct Unsupported { };
+}
+
+struct RegexAutomaton::Node
+{
+    enum Kind { Class, Begin, End, Cat, Alt, Repeat } kind;
+    uint32_t cls = 0;
+    size_t min = 0, max = 0;
+    std::vector<Node> children;
+
+    static constexpr size_t infinite = std::numeric_limits<size_t>::max();
+};
+
+struct RegexAutomaton::Parser
+{
+    RegexAutomaton & ra;
+    std::string_view s;
+    size_t p = 0;
+    size_t depth = 0;
+
+    bool atEnd() const { return p >= s.size(); }
+
+    char peek() const { return atEnd() ? 0 : s[p]; }
+
+    Node mkClass(const std::bitset<256> & set)
+    {
+        ra.classes.push_back(set);
+        return Node { .kind = Node::Class, .cls = (uint32_t) (ra.classes.size() - 1) };
+    }
+
+    Node parseAlt()
+    {
+        if (++depth > maxDepth) throw Unsupported();
+        Node alt { .kind = Node::Alt };
+        alt.children.push_back(parseCat());
+        while (peek() == '|') {
+            p++;
+            alt.children.push_back(parseCat());
+        }
+        depth--;
+        return alt.children.size() == 1 ? std::move(alt.children[0]) : std::move(alt);
+    }
+
+    Node parseCat()
+    {
+        Node cat { .kind = Node::Cat };
+        while (!atEnd() && peek() != '|' && peek() != ')')
+            cat.children.push_back(parseRepeat());
+        if (cat.children.empty()) throw Unsupported();
+        return cat;
+    }
+
+    size_t parseNumber()
+    {
+        size_t n = 0;
+        if (!isdigit(peek())) throw Unsupported();
+        while (isdigit(peek())) {
+            n = n * 10 + (s[p++] - '0');
+            if (n > maxRepeat) throw Unsupported();
+        }
+        return n;
+    }
+
+    static bool isQuantifier(char c)
+    {
+        return c == '*' || c == '+' || c == '?' || c == '{';
+    }
+
+    Node parseRepeat()
+    {
+        auto atom = parseAtom();
+        if (!isQuantifier(peek())) return atom;
+
+        if (atom.kind == Node::Begin || atom.kind == Node::End)
+            throw Unsupported();
+
+        Node rep { .kind = Node::Repeat };
+        switch (s[p++]) {
+        case '*': rep.min = 0; rep.max = Node::infinite; break;
+        case '+': rep.min = 1; rep.max = Node::infinite; break;
+        case '?': rep.min = 0; rep.max = 1; break;
+        default:
+            rep.min = rep.max = parseNumber();
+            if (peek() == ',') {
+                p++;
+                rep.max = peek() == '}' ? Node::infinite : parseNumber();
+            }
+            if (peek() != '}' || rep.min > rep.max) throw Unsupported();
+            p++;
+        }
+
+        /* Stacked quantifiers are handled inconsistently by regex
+           implementations. */
+        if (isQuantifier(peek())) throw Unsupported();
+
+        rep.children.push_back(std::move(atom));
+        return rep;
+    }
+
+    static bool isSpecial(char c)
+    {
+        return strchr("^$\\.*+?()[]{}|", c) && c;
+    }
+
+    Node parseAtom()
+    {
+        auto c = s[p++];
+        switch (c) {
+        case '(': {
+            if (peek() == ')') throw Unsupported();
+            auto n = parseAlt();
+            if (peek() != ')') throw Unsupported();
+            p++;
+            return n;
+        }
+        case '[':
+            return parseBracket();
+        case '.': {
+            std::bitset<256> set;
+            set.set();
+            set.reset(0);
+            return mkClass(set);
+        }
+        case '^':
+            return Node { .kind = Node::Begin };
+        case '$':
+            return Node { .kind = Node::End };
+        case '\\':
+            if (!isSpecial(peek())) throw Unsupported();
+            c = s[p++];
+            break;
+        default:
+            if (isSpecial(c)) throw Unsupported();
+        }
+        std::bitset<256> set;
+        set.set((unsigned char) c);
+        return mkClass(set);
+    }
+
+    static bool inClass(std::string_view name, unsigned char c)
+    {
+        bool upper = c >= 'A' && c <= 'Z';
+        bool lower = c >= 'a' && c <= 'z';
+        bool digit = c >= '0' && c <= '9';
+        bool graph = c >= 33 && c <= 126;
+        if (name == "alpha") return upper || lower;
+        if (name == "upper") return upper;
+        if (name == "lower") return lower;
+        if (name == "digit") return digit;
+        if (name == "alnum") return upper || lower || digit;
+        if (name == "xdigit") return digit || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+        if (name == "space") return c == ' ' || (c >= '\t' && c <= '\r');
+        if (name == "blank") return c == ' ' || c == '\t';
+        if (name == "cntrl") return c < 32 || c == 127;
+        if (name == "graph") return graph;
+        if (name == "print") return graph || c == ' ';
+        if (name == "punct") return graph && !(upper || lower || digit);
+        throw Unsupported();
+    }
+
+    Node parseBracket()
+    {
+        std::bitset<256> set;
+
+        bool negate = peek() == '^';
+        if (negate) p++;
+
+        /* A leading ']' is a literal, but not all implementations
+           agree on that. */
+        if (peek() == ']') throw Unsupported();
+
+        while (true) {
+            if (atEnd()) throw Unsupported();
+            unsigned char c = s[p];
+
+            if (c == ']') {
+                p++;
+                break;
+            }
+
+            if (c == '[' && p + 1 < s.size() && s[p + 1] == ':') {
+                auto end = s.find(":]", p + 2);
+                if (end == s.npos) throw Unsupported();
+                auto name = s.substr(p + 2, end - p - 2);
+                for (unsigned int i = 0; i < 256; ++i)
+                    if (inClass(name, i)) set.set(i);
+                p = end + 2;
+                if (peek() == '-' && p + 1 < s.size() && s[p + 1] != ']')
+                    throw Unsupported();
+                continue;
+            }
+
+            /* Collating symbols and equivalence classes, as well as
+               escapes, which POSIX and ECMAScript treat differently
+               inside brackets. */
+            if ((c == '[' && p + 1 < s.size() && (s[p + 1] == '.' || s[p + 1] == '='))
+                || c == '\\')
+                throw Unsupported();
+
+            p++;
+            if (peek() == '-' && p + 1 < s.size() && s[p + 1] != ']') {
+                unsigned char hi = s[p + 1];
+                if (c >= 128 || hi >= 128 || hi == '[' || c > hi)
+                    throw Unsupported();
+                for (unsigned int i = c; i <= hi; ++i)
+                    set.set(i);
+                p += 2;
+            } else
+                set.set(c);
+        }
+
+        if (negate) set.flip();
+        set.reset(0);
+
+        return mkClass(set);
+    }
+};
+
+
+std::optional<RegexAutomaton> RegexAutomaton::compile(std::string_view re)
+{
+    RegexAutomaton ra;
+
+    try {
+        Parser parser { .ra = ra, .s = re };
+        auto root = parser.parseAlt();
+        if (!parser.atEnd()) throw Unsupported();
+
+        auto & prog = ra.prog;
+
+        auto emit = [&](Instr instr) {
+            if (prog.size() >= maxProgSize) throw Unsupported();
+            prog.push_back(instr);
+            return (uint32_t) (prog.size() - 1);
+        };
+
+        std::function<void(const Node &)> gen;
+        gen = [&](const Node & node) {
+            switch (node.kind) {
+            case Node::Class:
+                emit({ .op = Op::Class, .x = node.cls });
+                break;
+            case Node::Begin:
+                emit({ .op = Op::AssertBegin });
+                break;
+            case Node::End:
+                emit({ .op = Op::AssertEnd });
+                break;
+            case Node::Cat:
+                for (auto & child : node.children)
+                    gen(child);
+                break;
+            case Node::Alt: {
+                std::vector<uint32_t> jumps;
+                for (size_t i = 0; i < node.children.size(); ++i) {
+                    if (i + 1 < node.children.size()) {
+                        auto split = emit({ .op = Op::Split });
+                        prog[split].x = split + 1;
+                        gen(node.children[i]);
+                        jumps.push_back(emit({ .op = Op::Jmp }));
+                        prog[split].y = prog.size();
+                    } else
+                        gen(node.children[i]);
+                }
+                for (auto jump : jumps)
+                    prog[jump].x = prog.size();
+                break;
+            }
+            case Node::Repeat: {
+                auto & child = node.children[0];
+                for (size_t i = 0; i < node.min; ++i)
+                    gen(child);
+                if (node.max == Node::infinite) {
+                    auto split = emit({ .op = Op::Split });
+                    prog[split].x = split + 1;
+                    gen(child);
+                    emit({ .op = Op::Jmp, .x = split });
+                    prog[split].y = prog.size();
+                } else {
+                    std::vector<uint32_t> splits;
+                    for (size_t i = node.min; i < node.max; ++i) {
+                        auto split = emit({ .op = Op::Split });
+                        prog[split].x = split + 1;
+                        splits.push_back(split);
+                        gen(child);
+                    }
+                    for (auto split : splits)
+                        prog[split].y = prog.size();
+                }
+                break;
+            }
+            }
+        };
+
+        gen(root);
+        emit({ .op = Op::Match });
+    } catch (Unsupported &) {
+        return std::nullopt;
+    }
+
+    return ra;
+}
+
+
+void RegexAutomaton::addThread(std::vector<uint32_t> & pcs, std::vector<bool> & seen,
+    uint32_t pc, bool atStart, bool atEnd) const
+{
+    std::vector<uint32_t> todo{pc};
+
+    while (!todo.empty()) {
+        pc = todo.back();
+        todo.pop_back();
+        if (seen[pc]) continue;
+        seen[pc] = true;
+
+        auto & instr = prog[pc];
+        switch (instr.op) {
+        case Op::Class:
+        case Op::Match:
+            pcs.push_back(pc);
+            break;
+        case Op::Split:
+            todo.push_back(instr.y);
+            todo.push_back(instr.x);
+            break;
+        case Op::Jmp:
+            todo.push_back(instr.x);
+            break;
+        case Op::AssertBegin:
+            if (atStart) todo.push_back(pc + 1);
+            break;
+        case Op::AssertEnd:
+            /* Keep the thread around until we know whether the input
+               ends here. */
+            if (atEnd) todo.push_back(pc + 1);
+            else pcs.push_back(pc);
+            break;
+        }
+    }
+}
+
+
+int32_t RegexAutomaton::intern(Dfa & dfa, std::vector<uint32_t> && pcs)
+{
+    std::sort(pcs.begin(), pcs.end());
+
+    auto i = dfa.index.find(pcs);
+    if (i != dfa.index.end()) return i->second;
+
+    State state;
+    state.next.fill(unknown);
+
+    std::vector<uint32_t> atEnd;
+    std::vector<bool> seen(prog.size());
+    for (auto pc : pcs) {
+        if (prog[pc].op == Op::Match)
+            state.hasMatch = true;
+        else if (prog[pc].op == Op::AssertEnd)
+            addThread(atEnd, seen, pc + 1, false, true);
+    }
+    state.acceptsAtEnd = state.hasMatch
+        || std::any_of(atEnd.begin(), atEnd.end(), [&](uint32_t pc) { return prog[pc].op == Op::Match; });
+
+    state.pcs = std::move(pcs);
+
+    int32_t n = dfa.states.size();
+    dfa.index.emplace(state.pcs, n);
+    dfa.states.push_back(std::move(state));
+    return n;
+}
+
+
+int32_t RegexAutomaton::initialState(Dfa & dfa)
+{
+    if (dfa.initial == unknown) {
+        std::vector<uint32_t> pcs;
+        std::vector<bool> seen(prog.size());
+        addThread(pcs, seen, 0, true, false);
+        dfa.initial = intern(dfa, std::move(pcs));
+    }
+    return dfa.initial;
+}
+
+
+int32_t RegexAutomaton::step(Dfa & dfa, int32_t state, unsigned char c)
+{
+    auto next = dfa.states[state].next[c];
+    if (next != unknown) return next;
+
+    /* Bound the memory used by the DFA by starting over when it gets
+       too big. */
+    if (dfa.states.size() >= maxStates) {
+        auto pcs = std::move(dfa.states[state].pcs);
+        dfa.states.clear();
+        dfa.index.clear();
+        dfa.initial = unknown;
+        state = intern(dfa, std::move(pcs));
+    }
+
+    std::vector<uint32_t> pcs;
+    std::vector<bool> seen(prog.size());
+    for (auto pc : dfa.states[state].pcs) {
+        auto & instr = prog[pc];
+        if (instr.op == Op::Class && classes[instr.x][c])
+            addThread(pcs, seen, pc + 1, false, false);
+    }
+    if (dfa.search)
+        addThread(pcs, seen, 0, false, false);
+
+    next = intern(dfa, std::move(pcs));
+    dfa.states[state].next[c] = next;
+    return next;
+}
+
+
+bool RegexAutomaton::run(Dfa & dfa, std::string_view s)
+{
+    if (s.empty()) {
+        std::vector<uint32_t> pcs;
+        std::vector<bool> seen(prog.size());
+        addThread(pcs, seen, 0, true, true);
+        return std::any_of(pcs.begin(), pcs.end(), [&](uint32_t pc) { return prog[pc].op == Op::Match; });
+    }
+
+    auto state = initialState(dfa);
+
+    for (unsigned char c : s) {
+        if (dfa.search && dfa.states[state].hasMatch) return true;
+        state = step(dfa, state, c);
+        if (dfa.states[state].pcs.empty()) return false;
+    }
+
+    return dfa.states[state].acceptsAtEnd;
+}
+
+}
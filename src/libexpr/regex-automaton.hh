@@ -0,0 +1,104 @@
+#pragma once
+///@file
+
+#include <array>
+#include <bitset>
+#include <map>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+namespace nix {
+
+/**
+ * A linear-time matcher for the common subset of POSIX extended
+ * regular expressions, used by `builtins.match` and `builtins.split`
+ * to decide whether a string matches without running `std::regex`.
+ * Unlike `std::regex`, it does not backtrack, so it neither takes
+ * exponential time nor recurses on long inputs.
+ *
+ * The regex is compiled to an NFA, which is turned into a DFA lazily
+ * while matching. Since only the language of the regex matters to
+ * the automaton, it doesn't compute submatches; callers that need
+ * them still have to use `std::regex` once the automaton has found a
+ * match.
+ */
+class RegexAutomaton
+{
+    enum struct Op : uint8_t { Class, Split, Jmp, AssertBegin, AssertEnd, Match };
+
+    struct Instr
+    {
+        Op op;
+        /* The character class for `Class`, or the targets for `Split`
+           and `Jmp`. */
+        uint32_t x = 0, y = 0;
+    };
+
+    std::vector<Instr> prog;
+    std::vector<std::bitset<256>> classes;
+
+    static constexpr int32_t unknown = -1;
+
+    struct State
+    {
+        std::vector<uint32_t> pcs;
+        /* Whether the regex matches if the input ends here. */
+        bool acceptsAtEnd = false;
+        /* Whether some prefix of the input matches. */
+        bool hasMatch = false;
+        std::array<int32_t, 256> next;
+    };
+
+    /**
+     * A lazily constructed DFA. `search` DFAs restart the regex at
+     * every position, to find a match anywhere in the input.
+     */
+    struct Dfa
+    {
+        bool search;
+        std::vector<State> states;
+        std::map<std::vector<uint32_t>, int32_t> index;
+        int32_t initial = unknown;
+    };
+
+    Dfa matchDfa{false}, searchDfa{true};
+
+    struct Node;
+    struct Parser;
+
+    RegexAutomaton() { }
+
+    void addThread(std::vector<uint32_t> & pcs, std::vector<bool> & seen,
+        uint32_t pc, bool atStart, bool atEnd) const;
+
+    int32_t intern(Dfa & dfa, std::vector<uint32_t> && pcs);
+
+    int32_t step(Dfa & dfa, int32_t state, unsigned char c);
+
+    int32_t initialState(Dfa & dfa);
+
+    bool run(Dfa & dfa, std::string_view s);
+
+public:
+
+    /**
+     * Compile `re`. Returns `std::nullopt` if `re` uses a feature
+     * that the automaton does not support, in which case the caller
+     * must fall back to `std::regex`. `re` must already be known to
+     * be a valid regular expression.
+     */
+    static std::optional<RegexAutomaton> compile(std::string_view re);
+
+    /**
+     * Whether the regex matches all of `s`.
+     */
+    bool match(std::string_view s) { return run(matchDfa, s); }
+
+    /**
+     * Whether the regex matches some substring of `s`.
+     */
+    bool search(std::string_view s) { return run(searchDfa, s); }
+};
+
+}
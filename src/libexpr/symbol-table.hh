@@ -1,12 +1,18 @@
 #pragma once
 ///@file
 
+#include <array>
+#include <atomic>
+#include <bit>
 #include <list>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <unordered_map>
 
 #include "types.hh"
-#include "chunked-vector.hh"
+#include "sync.hh"
+#include "util.hh"
 
 namespace nix {
 
@@ -51,6 +57,7 @@ public:
 class Symbol
 {
     friend class SymbolTable;
+    friend class Bindings;
 
 private:
     uint32_t id;
@@ -70,30 +77,87 @@ public:
 /**
  * Symbol table used by the parser and evaluator to represent and look
  * up identifiers and attributes efficiently.
+ *
+ * The table is thread-safe. The index is split into shards with their
+ * own locks, so concurrent lookups of different symbols rarely
+ * contend. The strings live in append-only storage that never moves,
+ * so resolving a symbol doesn't take any lock.
  */
 class SymbolTable
 {
 private:
-    std::unordered_map<std::string_view, std::pair<const std::string *, uint32_t>> symbols;
-    ChunkedVector<std::string, 8192> store{16};
+    static constexpr size_t nrShards = 64;
+
+    std::array<Sync<std::unordered_map<std::string_view, uint32_t>>, nrShards> shards;
+
+    /**
+     * Chunk `i` holds `firstChunkSize << i` strings, so a fixed
+     * number of chunks covers all 32-bit symbol IDs.
+     */
+    static constexpr uint32_t firstChunkSize = 8192;
+    static constexpr size_t nrChunks = 20;
+
+    std::array<std::atomic<std::string *>, nrChunks> chunks{};
+    std::atomic<uint32_t> size_{0};
+    std::mutex appendLock;
+
+    static std::pair<uint32_t, uint32_t> locate(uint32_t idx)
+    {
+        uint32_t chunk = std::bit_width(idx / firstChunkSize + 1) - 1;
+        return {chunk, idx - firstChunkSize * ((1u << chunk) - 1)};
+    }
+
+    const std::string & get(uint32_t idx) const
+    {
+        auto [chunk, offset] = locate(idx);
+        return chunks[chunk].load(std::memory_order_acquire)[offset];
+    }
+
+    std::pair<const std::string &, uint32_t> add(std::string_view s)
+    {
+        std::lock_guard<std::mutex> lock(appendLock);
+        auto idx = size_.load(std::memory_order_relaxed);
+        if (idx == std::numeric_limits<uint32_t>::max() - 1)
+            abort();
+        auto [chunk, offset] = locate(idx);
+        auto storage = chunks[chunk].load(std::memory_order_relaxed);
+        if (!storage) {
+            storage = std::allocator<std::string>().allocate(firstChunkSize << chunk);
+            chunks[chunk].store(storage, std::memory_order_release);
+        }
+        auto & res = *new (storage + offset) std::string(s);
+        size_.store(idx + 1, std::memory_order_release);
+        return {res, idx};
+    }
 
 public:
 
+    SymbolTable() { }
+
+    SymbolTable(const SymbolTable &) = delete;
+
+    ~SymbolTable()
+    {
+        auto n = size_.load();
+        for (uint32_t idx = 0; idx < n; ++idx)
+            std::destroy_at(&get(idx));
+        for (auto [chunk, storage] : enumerate(chunks))
+            if (auto p = storage.load())
+                std::allocator<std::string>().deallocate(p, firstChunkSize << chunk);
+    }
+
     /**
      * converts a string into a symbol.
      */
     Symbol create(std::string_view s)
     {
-        // Most symbols are looked up more than once, so we trade off insertion performance
-        // for lookup performance.
-        // TODO: could probably be done more efficiently with transparent Hash and Equals
-        // on the original implementation using unordered_set
-        // FIXME: make this thread-safe.
-        auto it = symbols.find(s);
-        if (it != symbols.end()) return Symbol(it->second.second + 1);
-
-        const auto & [rawSym, idx] = store.add(std::string(s));
-        symbols.emplace(rawSym, std::make_pair(&rawSym, idx));
+        auto shard(shards[std::hash<std::string_view>()(s) % nrShards].lock());
+
+        auto it = shard->find(s);
+        if (it != shard->end()) return Symbol(it->second + 1);
+
+        const auto & [rawSym, idx] = add(s);
+        shard->emplace(rawSym, idx);
         return Symbol(idx + 1);
     }
 
@@ -108,14 +172,14 @@ public:
 
     SymbolStr operator[](Symbol s) const
     {
-        if (s.id == 0 || s.id > store.size())
+        if (s.id == 0 || s.id > size_.load(std::memory_order_acquire))
             abort();
-        return SymbolStr(store[s.id - 1]);
+        return SymbolStr(get(s.id - 1));
     }
 
     size_t size() const
     {
-        return store.size();
+        return size_.load();
     }
 
     size_t totalSize() const;
@@ -123,7 +187,9 @@ public:
     template<typename T>
     void dump(T callback) const
     {
-        store.forEach(callback);
+        auto n = size_.load(std::memory_order_acquire);
+        for (uint32_t idx = 0; idx < n; ++idx)
+            callback(get(idx));
     }
 };
 
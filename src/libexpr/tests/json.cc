@@ -65,4 +65,14 @@ namespace nix {
         v.mkPath(state.rootPath(CanonPath("/test")));
         ASSERT_EQ(getJSONValue(v), "\"/nix/store/g1w7hy3qg1w7hy3qg1w7hy3qg1w7hy3q-x\"");
     }
+
+    TEST_F(JSONValueTest, Nested) {
+        auto v = eval(R"({ b = [ 1 2.5 { c = null; } [ ] ]; a = { }; "x\"y" = "z\n"; d.outPath = "out"; })");
+        auto json = getJSONValue(v);
+        ASSERT_EQ(json, R"({"a":{},"b":[1,2.5,{"c":null},[]],"d":"out","x\"y":"z\n"})");
+
+        // Streaming must give the same output as building the JSON tree.
+        NixStringContext ps;
+        ASSERT_EQ(json, printValueAsJSON(state, true, v, noPos, ps).dump());
+    }
 } /* namespace nix */
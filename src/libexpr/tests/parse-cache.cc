@@ -0,0 +1,59 @@
+#include "tests/libexpr.hh"
+#include "parse-cache.hh"
+
+namespace nix {
+    // Testing the serialisation of parse trees for the parse cache
+    class ParseCacheTest : public LibExprTest {
+        protected:
+            Value roundTrip(std::string input) {
+                Expr * e = state.parseExprFromString(input, state.rootPath(CanonPath::root));
+                auto data = serialiseExpr(state, *e);
+                Expr * e2 = deserialiseExpr(state, data, Pos::none_tag());
+                e2->bindVars(state, state.staticBaseEnv);
+                EXPECT_EQ(serialiseExpr(state, *e2), data);
+                Value v;
+                state.eval(e2, v);
+                state.forceValueDeep(v);
+                return v;
+            }
+    };
+
+    TEST_F(ParseCacheTest, scalars) {
+        ASSERT_THAT(roundTrip("123"), IsIntEq(123));
+        ASSERT_THAT(roundTrip("1.5"), IsFloatEq(1.5));
+        ASSERT_THAT(roundTrip("\"foo\""), IsStringEq("foo"));
+        ASSERT_THAT(roundTrip("null"), IsNull());
+    }
+
+    TEST_F(ParseCacheTest, functions) {
+        auto v = roundTrip(R"(
+            let
+              f = { a, b ? 2, ... }@args: a + b + builtins.length (builtins.attrNames args);
+              g = x: y: if x < y then x else y;
+            in f { a = 1; c = 3; } + g 10 20
+        )");
+        ASSERT_THAT(v, IsIntEq(15));
+    }
+
+    TEST_F(ParseCacheTest, attrs) {
+        auto v = roundTrip(R"(
+            let
+              s = rec { a = 1; b = a + 1; n.x = 1; n.y = 2; ${"dyn"} = 3; };
+              inherit (s) a b;
+            in with s; [ a b n.y dyn (s ? n.x) (s.z or 4) ("${toString a}-${"b"}") ]
+        )");
+        ASSERT_THAT(v, IsListOfSize(7));
+        auto elems = v.listElems();
+        ASSERT_THAT(*elems[0], IsIntEq(1));
+        ASSERT_THAT(*elems[1], IsIntEq(2));
+        ASSERT_THAT(*elems[2], IsIntEq(2));
+        ASSERT_THAT(*elems[3], IsIntEq(3));
+        ASSERT_THAT(*elems[4], IsTrue());
+        ASSERT_THAT(*elems[5], IsIntEq(4));
+        ASSERT_THAT(*elems[6], IsStringEq("1-b"));
+    }
+
+    TEST_F(ParseCacheTest, invalidData) {
+        ASSERT_THROW(deserialiseExpr(state, "garbage", Pos::none_tag()), Error);
+    }
+} /* namespace nix */
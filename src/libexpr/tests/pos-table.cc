@@ -0,0 +1,47 @@
+#include "nixexpr.hh"
+
+#include <gtest/gtest.h>
+
+namespace nix {
+
+    TEST(PosTable, roundTrip) {
+        PosTable positions;
+        PosTable::Origin a(Pos::String{make_ref<std::string>("a")});
+        PosTable::Origin b(Pos::String{make_ref<std::string>("b")});
+
+        auto p1 = positions.add(a, 1, 1);
+        auto p2 = positions.add(a, 1000, 4094);
+        auto p3 = positions.add(b, 3, 7);
+
+        ASSERT_EQ(positions[p1].line, 1u);
+        ASSERT_EQ(positions[p1].column, 1u);
+        ASSERT_EQ(positions[p2].line, 1000u);
+        ASSERT_EQ(positions[p2].column, 4094u);
+        ASSERT_EQ(positions[p3].line, 3u);
+        ASSERT_EQ(positions[p3].column, 7u);
+        ASSERT_EQ(*std::get<Pos::String>(positions[p2].origin).source, "a");
+        ASSERT_EQ(*std::get<Pos::String>(positions[p3].origin).source, "b");
+    }
+
+    TEST(PosTable, largePositions) {
+        PosTable positions;
+        PosTable::Origin origin(Pos::String{make_ref<std::string>("")});
+
+        auto p1 = positions.add(origin, 1 << 20, 1);
+        auto p2 = positions.add(origin, 2, 100000);
+        auto p3 = positions.add(origin, 5, 5);
+
+        ASSERT_EQ(positions[p1].line, 1u << 20);
+        ASSERT_EQ(positions[p1].column, 1u);
+        ASSERT_EQ(positions[p2].line, 2u);
+        ASSERT_EQ(positions[p2].column, 100000u);
+        ASSERT_EQ(positions[p3].line, 5u);
+        ASSERT_EQ(positions[p3].column, 5u);
+    }
+
+    TEST(PosTable, noPos) {
+        PosTable positions;
+        ASSERT_FALSE(positions[noPos]);
+    }
+
+} /* namespace nix */
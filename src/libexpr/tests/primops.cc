@@ -714,6 +714,20 @@ namespace nix {
         ASSERT_EQ(v.string_view(), "fabir");
     }
 
+    TEST_F(PrimOpTest, replaceStringsPatternOrder) {
+        // The first matching pattern in 'from' wins, not the longest one.
+        auto v = eval("builtins.replaceStrings [\"a\" \"ab\" \"abc\"] [\"1\" \"2\" \"3\"] \"abcab\"");
+        ASSERT_THAT(v, IsStringEq("1bc1b"));
+
+        v = eval("builtins.replaceStrings [\"abc\" \"ab\" \"b\"] [\"3\" \"2\" \"1\"] \"abcabb\"");
+        ASSERT_THAT(v, IsStringEq("321"));
+    }
+
+    TEST_F(PrimOpTest, replaceStringsEmptyPattern) {
+        auto v = eval("builtins.replaceStrings [\"b\" \"\" \"c\"] [\"B\" \"-\" \"C\"] \"abc\"");
+        ASSERT_THAT(v, IsStringEq("-aB-c-"));
+    }
+
     TEST_F(PrimOpTest, concatStringsSep) {
         // FIXME: add a test that verifies the string context is as expected
         auto v = eval("builtins.concatStringsSep \"%\" [\"foo\" \"bar\" \"baz\"]");
@@ -814,6 +828,20 @@ namespace nix {
         ASSERT_THAT(*v.listElems()[0], IsStringEq("FOO"));
     }
 
+    TEST_F(PrimOpTest, matchLongString) {
+        // Long enough to overflow the stack of a backtracking matcher.
+        std::string s = "(builtins.concatStringsSep \"\" (builtins.genList (x: \"ab\") 100000))";
+        ASSERT_THAT(eval("builtins.match \"(a|b)*c\" " + s), IsNull());
+        ASSERT_THAT(eval("builtins.match \"[ab]*\" " + s), IsListOfSize(0));
+        ASSERT_THAT(eval("builtins.split \"[[:digit:]]+\" " + s), IsListOfSize(1));
+    }
+
+    TEST_F(PrimOpTest, matchAnchors) {
+        ASSERT_THAT(eval("builtins.match \"^a|b$\" \"a\""), IsListOfSize(0));
+        ASSERT_THAT(eval("builtins.match \"a$b\" \"ab\""), IsNull());
+        ASSERT_THAT(eval("builtins.split \"^b\" \"ab\""), IsListOfSize(1));
+    }
+
     TEST_F(PrimOpTest, attrNames) {
         auto v = eval("builtins.attrNames { x = 1; y = 2; z = 3; a = 2; }");
         ASSERT_THAT(v, IsListOfSize(4));
@@ -829,4 +857,54 @@ namespace nix {
         auto v = eval("builtins.genericClosure { startSet = []; }");
         ASSERT_THAT(v, IsListOfSize(0));
     }
+
+    TEST_F(PrimOpTest, genericClosure_stringKeys) {
+        auto v = eval(R"(
+            builtins.genericClosure {
+              startSet = [ { key = "a"; } ];
+              operator = x: [ { key = "a"; } { key = "b"; } { key = "c"; } ];
+            }
+        )");
+        ASSERT_THAT(v, IsListOfSize(3));
+    }
+
+    TEST_F(PrimOpTest, genericClosure_mixedNumberKeys) {
+        // 1 and 1.0 are the same key.
+        auto v = eval(R"(
+            builtins.genericClosure {
+              startSet = [ { key = 1; } { key = 2; } ];
+              operator = x: [ { key = 1.0; } { key = 3.5; } ];
+            }
+        )");
+        ASSERT_THAT(v, IsListOfSize(3));
+    }
+
+    TEST_F(PrimOpTest, genericClosure_incomparableKeys) {
+        ASSERT_THROW(eval(R"(
+            builtins.genericClosure {
+              startSet = [ { key = 1; } { key = "a"; } ];
+              operator = x: [ ];
+            }
+        )"), EvalError);
+    }
+
+    TEST_F(PrimOpTest, fromJSON) {
+        auto v = eval(R"(builtins.fromJSON ''{"b": [1, {"c": null}, []], "a": {}, "b": "last"}'')");
+        ASSERT_THAT(v, IsAttrsOfSize(2));
+        ASSERT_THAT(*v.attrs->get(createSymbol("a"))->value, IsAttrsOfSize(0));
+        // The last occurrence of a duplicate key wins.
+        ASSERT_THAT(*v.attrs->get(createSymbol("b"))->value, IsStringEq("last"));
+    }
+
+    TEST_F(PrimOpTest, fromJSONNested) {
+        auto v = eval(R"(builtins.fromJSON ''[1, [2, [3]], {"x": [true, 1.5]}]'')");
+        ASSERT_THAT(v, IsListOfSize(3));
+        ASSERT_THAT(*v.listElems()[0], IsIntEq(1));
+        ASSERT_THAT(*v.listElems()[1], IsListOfSize(2));
+        ASSERT_THAT(*v.listElems()[1]->listElems()[1], IsListOfSize(1));
+        auto x = v.listElems()[2]->attrs->get(createSymbol("x"));
+        ASSERT_NE(x, nullptr);
+        ASSERT_THAT(*x->value, IsListOfSize(2));
+        ASSERT_THAT(*x->value->listElems()[1], IsFloatEq(1.5));
+    }
 } /* namespace nix */
@@ -0,0 +1,51 @@
+#include "symbol-table.hh"
+
+#include <gtest/gtest.h>
+#include <thread>
+
+namespace nix {
+
+    TEST(SymbolTable, createAndResolve) {
+        SymbolTable symbols;
+        auto a = symbols.create("a");
+        auto b = symbols.create("b");
+        ASSERT_NE(a, b);
+        ASSERT_EQ(symbols.create("a"), a);
+        ASSERT_EQ(std::string_view(symbols[b]), "b");
+        ASSERT_EQ(symbols.size(), 2u);
+    }
+
+    TEST(SymbolTable, spansChunks) {
+        SymbolTable symbols;
+        std::vector<Symbol> created;
+        for (size_t i = 0; i < 100000; ++i)
+            created.push_back(symbols.create(std::to_string(i)));
+        for (size_t i = 0; i < created.size(); ++i)
+            ASSERT_EQ(std::string_view(symbols[created[i]]), std::to_string(i));
+    }
+
+    TEST(SymbolTable, concurrentCreate) {
+        SymbolTable symbols;
+        const size_t nrThreads = 8, nrSymbols = 20000;
+
+        std::vector<std::vector<Symbol>> results(nrThreads);
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < nrThreads; ++t)
+            threads.emplace_back([&, t]() {
+                /* All threads create the same symbols, in different orders. */
+                for (size_t i = 0; i < nrSymbols; ++i) {
+                    auto n = (i * (t + 1)) % nrSymbols;
+                    auto s = symbols.create(std::to_string(n));
+                    if (results[t].size() <= n) results[t].resize(n + 1);
+                    results[t][n] = s;
+                }
+            });
+        for (auto & thread : threads) thread.join();
+
+        ASSERT_EQ(symbols.size(), nrSymbols);
+        for (size_t n = 0; n < nrSymbols; ++n)
+            for (size_t t = 0; t < nrThreads; ++t)
+                if (n < results[t].size() && results[t][n])
+                    ASSERT_EQ(std::string_view(symbols[results[t][n]]), std::to_string(n));
+    }
+} /* namespace nix */
@@ -1,4 +1,5 @@
 #include "tests/libexpr.hh"
+#include "eval-settings.hh"
 
 namespace nix {
     // Testing of trivial expressions
@@ -71,6 +72,44 @@ namespace nix {
         ASSERT_THAT(*b->value, IsIntEq(2));
     }
 
+    TEST_F(TrivialExpressionTest, updateAttrsChain) {
+        auto v = eval("{ a = 1; b = 1; } // { } // { b = 2; c = 2; } // { a = 3; d = 3; }");
+        ASSERT_THAT(v, IsAttrsOfSize(4));
+        auto expected = std::map<std::string, NixInt> { {"a", 3}, {"b", 2}, {"c", 2}, {"d", 3} };
+        for (auto & [name, value] : expected) {
+            auto a = v.attrs->find(createSymbol(name.c_str()));
+            ASSERT_NE(a, nullptr);
+            ASSERT_THAT(*a->value, IsIntEq(value));
+        }
+    }
+
+    TEST_F(TrivialExpressionTest, largeAttrsLookup) {
+        auto v = eval(R"(
+            let
+              s = builtins.listToAttrs (builtins.genList (n: { name = "a${toString n}"; value = n; }) 1000);
+            in [ s.a0 s.a500 s.a999 (s ? a1000) ((s // { a500 = -1; }).a500) ]
+        )");
+        ASSERT_THAT(v, IsListOfSize(5));
+        auto elems = v.listElems();
+        for (size_t n = 0; n < v.listSize(); ++n)
+            state.forceValue(*elems[n], noPos);
+        ASSERT_THAT(*elems[0], IsIntEq(0));
+        ASSERT_THAT(*elems[1], IsIntEq(500));
+        ASSERT_THAT(*elems[2], IsIntEq(999));
+        ASSERT_THAT(*elems[3], IsFalse());
+        ASSERT_THAT(*elems[4], IsIntEq(-1));
+    }
+
+    TEST_F(TrivialExpressionTest, concatListsChain) {
+        auto v = eval("[ 1 ] ++ [ ] ++ [ 2 3 ] ++ (let x = [ 4 ]; in x) ++ [ 5 ]");
+        ASSERT_THAT(v, IsListOfSize(5));
+        auto elems = v.listElems();
+        for (size_t n = 0; n < v.listSize(); ++n) {
+            state.forceValue(*elems[n], noPos);
+            ASSERT_THAT(*elems[n], IsIntEq(n + 1));
+        }
+    }
+
     TEST_F(TrivialExpressionTest, hasAttrOpFalse) {
         auto v = eval("{} ? a");
         ASSERT_THAT(v, IsFalse());
@@ -95,6 +134,23 @@ namespace nix {
         ASSERT_THAT(v, IsIntEq(42));
     }
 
+    TEST_F(TrivialExpressionTest, withDifferentSets) {
+        auto v = eval(R"(
+            let f = s: with s; with { b = 0; }; a;
+            in [ (f { a = 1; }) (f { _a = 0; a = 2; }) (f { a = 3; z = 4; }) (f { _a = 0; a = 4; }) ]
+        )");
+        ASSERT_THAT(v, IsListOfSize(4));
+        auto elems = v.listElems();
+        for (size_t n = 0; n < v.listSize(); ++n) {
+            state.forceValue(*elems[n], noPos);
+            ASSERT_THAT(*elems[n], IsIntEq(n + 1));
+        }
+    }
+
+    TEST_F(TrivialExpressionTest, withNotFoundAfterFound) {
+        ASSERT_THROW(eval("let f = s: with s; a; in (f { a = 1; }) + (f { b = 2; })"), Error);
+    }
+
     TEST_F(TrivialExpressionTest, letOverWith) {
         auto v = eval("let a = 23; in with { a = 1; }; a");
         ASSERT_THAT(v, IsIntEq(23));
@@ -142,7 +198,7 @@ namespace nix {
     TEST_P(AttrSetMergeTrvialExpressionTest, attrsetMergeLazy) {
         // Usually Nix rejects duplicate keys in an attrset but it does allow
         // so if it is an attribute set that contains disjoint sets of keys.
-        // The below is equivalent to `{a.b = 1; a.c = 2; }`.
+        // The below is equivalent to `{a.b = 1; a.c = two; }`.
         // The attribute set `a` will be a Thunk at first as the attribuets
         // have to be merged (or otherwise computed) and that is done in a lazy
         // manner.
@@ -172,11 +228,39 @@ namespace nix {
             attrsetMergeLazy,
             AttrSetMergeTrvialExpressionTest,
             testing::Values(
-                "{ a.b = 1; a.c = 2; }",
-                "{ a = { b = 1; }; a = { c = 2; }; }"
+                "let two = 2; in { a.b = 1; a.c = two; }",
+                "let two = 2; in { a = { b = 1; }; a = { c = two; }; }"
             )
     );
 
+    TEST_F(TrivialExpressionTest, constantAttrsAndLists) {
+        // Attribute sets and lists that contain only constants are built
+        // once and shared, rather than being thunked.
+        auto v = eval("let f = x: { a.b = 1; a.c = [ 2 \"x\" ]; }; in [ (f 1) (f 2) ]");
+        ASSERT_THAT(v, IsListOfSize(2));
+        auto elems = v.listElems();
+        state.forceValue(*elems[0], noPos);
+        state.forceValue(*elems[1], noPos);
+        auto a = elems[0]->attrs->find(createSymbol("a"));
+        ASSERT_NE(a, nullptr);
+        ASSERT_THAT(*a->value, IsAttrsOfSize(2));
+        auto c = a->value->attrs->find(createSymbol("c"));
+        ASSERT_NE(c, nullptr);
+        ASSERT_THAT(*c->value, IsListOfSize(2));
+        ASSERT_EQ(elems[0]->attrs, elems[1]->attrs);
+    }
+
+    TEST_F(TrivialExpressionTest, constantConcat) {
+        auto v = eval("let f = x: [ (\"a\" + \"b\") (1 + 2) \"c${\"d\"}\" ]; in f 1 ++ f 2");
+        ASSERT_THAT(v, IsListOfSize(6));
+        auto elems = v.listElems();
+        for (size_t n = 0; n < v.listSize(); ++n) state.forceValue(*elems[n], noPos);
+        ASSERT_THAT(*elems[0], IsStringEq("ab"));
+        ASSERT_THAT(*elems[1], IsIntEq(3));
+        ASSERT_THAT(*elems[2], IsStringEq("cd"));
+        ASSERT_EQ(elems[0], elems[3]);
+    }
+
     TEST_F(TrivialExpressionTest, functor) {
         auto v = eval("{ __functor = self: arg: self.v + arg; v = 10; } 5");
         ASSERT_THAT(v, IsIntEq(15));
@@ -190,7 +274,46 @@ namespace nix {
         ASSERT_THAT(*b->value, IsIntEq(1));
     }
 
+    TEST_F(TrivialExpressionTest, internStrings) {
+        evalSettings.internStrings = true;
+        auto v = eval(R"(
+            let n = 1; in [ "out${toString n}" "out${toString n}" (builtins.substring 0 4 "out1out1") "out2" ]
+        )");
+        evalSettings.internStrings = false;
+        ASSERT_THAT(v, IsListOfSize(4));
+        auto elems = v.listElems();
+        for (size_t i = 0; i < 4; ++i) state.forceValue(*elems[i], noPos);
+        ASSERT_THAT(*elems[0], IsStringEq("out1"));
+        ASSERT_EQ(elems[0]->c_str(), elems[1]->c_str());
+        ASSERT_EQ(elems[0]->c_str(), elems[2]->c_str());
+        ASSERT_THAT(*elems[3], IsStringEq("out2"));
+    }
+
     TEST_F(TrivialExpressionTest, orCantBeUsed) {
         ASSERT_THROW(eval("let or = 1; in or"), Error);
     }
+
+    TEST_F(TrivialExpressionTest, stackEnvs) {
+        auto v = eval(R"(
+            let
+              add = { a, b ? 2 }: a + b;
+              pair = x: [ x x ];
+              first = list: builtins.head list;
+            in map (n: first (pair (add { a = n; }))) [ 1 2 3 ]
+        )");
+        ASSERT_THAT(v, IsListOfSize(3));
+        state.forceValue(*v.listElems()[2], noPos);
+        ASSERT_THAT(*v.listElems()[2], IsIntEq(5));
+    }
+
+    TEST_F(TrivialExpressionTest, stackEnvsEscaping) {
+        auto v = eval(R"(
+            let
+              const = x: y: x;
+              defaults = { a ? b, b ? 1 }: a;
+              wrap = x: { inherit x; y = x + 1; };
+            in (const 1 2) + defaults {} + (wrap 10).y
+        )");
+        ASSERT_THAT(v, IsIntEq(1 + 1 + 11));
+    }
 } /* namespace nix */
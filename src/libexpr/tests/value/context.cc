@@ -108,6 +108,30 @@ TEST(NixStringContextElemTest, built_built) {
     ASSERT_EQ(elem.to_string(), built);
 }
 
+/**
+ * Strings with equal contexts share a single context array.
+ */
+TEST_F(LibExprTest, interned_context) {
+    NixStringContext context {
+        NixStringContextElem::parse("g1w7hy3qg1w7hy3qg1w7hy3qg1w7hy3q-x"),
+        NixStringContextElem::parse("=g1w7hy3qg1w7hy3qg1w7hy3qg1w7hy3q-y.drv"),
+    };
+    Value v1, v2, v3;
+    v1.mkString("foo", context);
+    v2.mkString("bar", context);
+    ASSERT_EQ(v1.context(), v2.context());
+
+    NixStringContext context2;
+    copyContext(v1, context2);
+    ASSERT_EQ(context2, context);
+
+    context.erase(context.begin());
+    v3.mkString("baz", context);
+    ASSERT_NE(v1.context(), v3.context());
+    ASSERT_EQ(std::string(v3.context()[0]), "=g1w7hy3qg1w7hy3qg1w7hy3qg1w7hy3q-y.drv");
+    ASSERT_EQ(v3.context()[1], nullptr);
+}
+
 /**
  * Without the right experimental features enabled, we cannot parse a
  * complex inductive string context element.
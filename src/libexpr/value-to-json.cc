@@ -110,10 +110,73 @@ json printValueAsJSON(EvalState & state, bool strict,
     return out;
 }
 
+/* Like the function above, but writes the JSON incrementally rather
+   than building it in memory first. Scalars are still serialised by
+   nlohmann::json to get exactly the same output. */
 void printValueAsJSON(EvalState & state, bool strict,
     Value & v, const PosIdx pos, std::ostream & str, NixStringContext & context, bool copyToStore)
 {
-    str << printValueAsJSON(state, strict, v, pos, context, copyToStore);
+    checkInterrupt();
+
+    if (strict) state.forceValue(v, pos);
+
+    switch (v.type()) {
+
+        case nAttrs: {
+            auto maybeString = state.tryAttrsToString(pos, v, context, false, false);
+            if (maybeString) {
+                str << json(*maybeString);
+                break;
+            }
+            auto i = v.attrs->find(state.sOutPath);
+            if (i == v.attrs->end()) {
+                std::vector<std::pair<std::string_view, Attr *>> attrs;
+                attrs.reserve(v.attrs->size());
+                for (auto & j : *v.attrs)
+                    attrs.emplace_back(state.symbols[j.name], &j);
+                std::sort(attrs.begin(), attrs.end(),
+                    [](const auto & a, const auto & b) { return a.first < b.first; });
+                str << '{';
+                bool first = true;
+                for (auto & [name, a] : attrs) {
+                    if (!first) str << ',';
+                    first = false;
+                    str << json(name) << ':';
+                    try {
+                        printValueAsJSON(state, strict, *a->value, a->pos, str, context, copyToStore);
+                    } catch (Error & e) {
+                        e.addTrace(state.positions[a->pos],
+                            hintfmt("while evaluating attribute '%1%'", name));
+                        throw;
+                    }
+                }
+                str << '}';
+            } else
+                printValueAsJSON(state, strict, *i->value, i->pos, str, context, copyToStore);
+            break;
+        }
+
+        case nList: {
+            str << '[';
+            int i = 0;
+            for (auto elem : v.listItems()) {
+                if (i) str << ',';
+                try {
+                    printValueAsJSON(state, strict, *elem, pos, str, context, copyToStore);
+                } catch (Error & e) {
+                    e.addTrace({},
+                        hintfmt("while evaluating list element at index %1%", i));
+                    throw;
+                }
+                i++;
+            }
+            str << ']';
+            break;
+        }
+
+        default:
+            str << printValueAsJSON(state, strict, v, pos, context, copyToStore);
+    }
 }
 
 json ExternalValueBase::printValueAsJSON(EvalState & state, bool strict,
@@ -3,7 +3,9 @@
 #include "eval-inline.hh"
 #include "util.hh"
 
+#include <algorithm>
 #include <cstdlib>
+#include <variant>
 
 
 namespace nix {
@@ -17,11 +19,6 @@ static XMLAttrs singletonAttrs(const std::string & name, const std::string & val
 }
 
 
-static void printValueAsXML(EvalState & state, bool strict, bool location,
-    Value & v, XMLWriter & doc, NixStringContext & context, PathSet & drvsSeen,
-    const PosIdx pos);
-
-
 static void posToXML(EvalState & state, XMLAttrs & xmlAttrs, const Pos & pos)
 {
     if (auto path = std::get_if<SourcePath>(&pos.origin))
@@ -31,31 +28,65 @@ static void posToXML(EvalState & state, XMLAttrs & xmlAttrs, const Pos & pos)
 }
 
 
-static void showAttrs(EvalState & state, bool strict, bool location,
-    Bindings & attrs, XMLWriter & doc, NixStringContext & context, PathSet & drvsSeen)
+namespace {
+
+/* The traversal is driven by an explicit stack of steps rather than
+   by recursion, so that deeply nested values don't overflow the
+   stack. */
+
+struct PrintValue
+{
+    Value * v;
+    PosIdx pos;
+};
+
+struct OpenElement
+{
+    std::string_view name;
+    XMLAttrs attrs;
+};
+
+struct CloseElement
 {
-    StringSet names;
+};
+
+typedef std::variant<PrintValue, OpenElement, CloseElement> Step;
+
+}
 
+
+/* Schedule the attributes in `attrs` in lexicographic order. Since
+   `todo` is a stack, the steps are pushed in reverse. */
+static void showAttrs(EvalState & state, bool location,
+    Bindings & attrs, std::vector<Step> & todo)
+{
+    std::vector<Attr *> sorted;
+    sorted.reserve(attrs.size());
     for (auto & i : attrs)
-        names.emplace(state.symbols[i.name]);
+        sorted.push_back(&i);
 
-    for (auto & i : names) {
-        Attr & a(*attrs.find(state.symbols.create(i)));
+    std::sort(sorted.begin(), sorted.end(), [&](const Attr * a, const Attr * b) {
+        return (const std::string &) state.symbols[a->name] < (const std::string &) state.symbols[b->name];
+    });
+
+    for (auto i = sorted.rbegin(); i != sorted.rend(); ++i) {
+        Attr & a(**i);
 
         XMLAttrs xmlAttrs;
-        xmlAttrs["name"] = i;
+        xmlAttrs["name"] = state.symbols[a.name];
         if (location && a.pos) posToXML(state, xmlAttrs, state.positions[a.pos]);
 
-        XMLOpenElement _(doc, "attr", xmlAttrs);
-        printValueAsXML(state, strict, location,
-            *a.value, doc, context, drvsSeen, a.pos);
+        todo.push_back(CloseElement {});
+        todo.push_back(PrintValue { a.value, a.pos });
+        todo.push_back(OpenElement { "attr", std::move(xmlAttrs) });
     }
 }
 
 
-static void printValueAsXML(EvalState & state, bool strict, bool location,
+/* Print `v`, scheduling the printing of its children in `todo`. */
+static void printValue(EvalState & state, bool strict, bool location,
     Value & v, XMLWriter & doc, NixStringContext & context, PathSet & drvsSeen,
-    const PosIdx pos)
+    const PosIdx pos, std::vector<Step> & todo)
 {
     checkInterrupt();
 
@@ -89,10 +120,8 @@ static void printValueAsXML(EvalState & state, bool strict, bool location,
             if (state.isDerivation(v)) {
                 XMLAttrs xmlAttrs;
 
-                Bindings::iterator a = v.attrs->find(state.symbols.create("derivation"));
-
                 Path drvPath;
-                a = v.attrs->find(state.sDrvPath);
+                auto a = v.attrs->find(state.sDrvPath);
                 if (a != v.attrs->end()) {
                     if (strict) state.forceValue(*a->value, a->pos);
                     if (a->value->type() == nString)
@@ -106,25 +135,29 @@ static void printValueAsXML(EvalState & state, bool strict, bool location,
                         xmlAttrs["outPath"] = a->value->c_str();
                 }
 
-                XMLOpenElement _(doc, "derivation", xmlAttrs);
+                doc.openElement("derivation", xmlAttrs);
+                todo.push_back(CloseElement {});
 
                 if (drvPath != "" && drvsSeen.insert(drvPath).second)
-                    showAttrs(state, strict, location, *v.attrs, doc, context, drvsSeen);
+                    showAttrs(state, location, *v.attrs, todo);
                 else
                     doc.writeEmptyElement("repeated");
             }
 
             else {
-                XMLOpenElement _(doc, "attrs");
-                showAttrs(state, strict, location, *v.attrs, doc, context, drvsSeen);
+                doc.openElement("attrs");
+                todo.push_back(CloseElement {});
+                showAttrs(state, location, *v.attrs, todo);
             }
 
             break;
 
         case nList: {
-            XMLOpenElement _(doc, "list");
-            for (auto v2 : v.listItems())
-                printValueAsXML(state, strict, location, *v2, doc, context, drvsSeen, pos);
+            doc.openElement("list");
+            todo.push_back(CloseElement {});
+            auto items = v.listItems();
+            for (auto i = items.end(); i != items.begin(); )
+                todo.push_back(PrintValue { *--i, pos });
             break;
         }
 
@@ -165,6 +198,31 @@ static void printValueAsXML(EvalState & state, bool strict, bool location,
 }
 
 
+static void printValueAsXML(EvalState & state, bool strict, bool location,
+    Value & v, XMLWriter & doc, NixStringContext & context, PathSet & drvsSeen,
+    const PosIdx pos)
+{
+    std::vector<Step> todo;
+    todo.push_back(PrintValue { &v, pos });
+
+    while (!todo.empty()) {
+        auto step = std::move(todo.back());
+        todo.pop_back();
+        std::visit(overloaded {
+            [&](PrintValue & p) {
+                printValue(state, strict, location, *p.v, doc, context, drvsSeen, p.pos, todo);
+            },
+            [&](OpenElement & e) {
+                doc.openElement(e.name, e.attrs);
+            },
+            [&](CloseElement &) {
+                doc.closeElement();
+            },
+        }, step);
+    }
+}
+
+
 void ExternalValueBase::printValueAsXML(EvalState & state, bool strict,
     bool location, XMLWriter & doc, NixStringContext & context, PathSet & drvsSeen,
     const PosIdx pos) const
@@ -17,14 +17,31 @@ create table if not exists Cache (
     timestamp integer not null,
     primary key (input)
 );
+
+create index if not exists IndexCacheTimestamp on Cache(timestamp);
 )sql";
 
 struct CacheImpl : Cache
 {
+    struct Entry
+    {
+        std::string info;
+        std::string path;
+        bool locked;
+        time_t timestamp;
+    };
+
     struct State
     {
         SQLite db;
-        SQLiteStmt add, lookup;
+        SQLiteStmt add, lookup, prune;
+
+        /**
+         * Entries looked up or added by this process, keyed by the
+         * serialised input attributes, to avoid querying the database
+         * repeatedly for the same input.
+         */
+        std::map<std::string, std::optional<Entry>> memo;
     };
 
     Sync<State> _state;
@@ -38,6 +55,13 @@ struct CacheImpl : Cache
 
         state->db = SQLite(dbPath);
         state->db.isCache();
+
+        /* Many processes may use the cache at the same time, so use
+           WAL mode to prevent readers and writers from blocking each
+           other. */
+        if (settings.useSQLiteWAL)
+            state->db.exec("pragma main.journal_mode = wal");
+
         state->db.exec(schema);
 
         state->add.create(state->db,
@@ -45,6 +69,9 @@ struct CacheImpl : Cache
 
         state->lookup.create(state->db,
             "select info, path, immutable, timestamp from Cache where input = ?");
+
+        state->prune.create(state->db,
+            "delete from Cache where timestamp < ?");
     }
 
     void add(
@@ -54,12 +81,27 @@ struct CacheImpl : Cache
         const StorePath & storePath,
         bool locked) override
     {
-        _state.lock()->add.use()
-            (attrsToJSON(inAttrs).dump())
-            (attrsToJSON(infoAttrs).dump())
-            (store->printStorePath(storePath))
-            (locked)
-            (time(0)).exec();
+        auto inAttrsJSON = attrsToJSON(inAttrs).dump();
+
+        Entry entry {
+            .info = attrsToJSON(infoAttrs).dump(),
+            .path = store->printStorePath(storePath),
+            .locked = locked,
+            .timestamp = time(0),
+        };
+
+        retrySQLite<void>([&]() {
+            auto state(_state.lock());
+
+            state->add.use()
+                (inAttrsJSON)
+                (entry.info)
+                (entry.path)
+                (entry.locked)
+                (entry.timestamp).exec();
+
+            state->memo.insert_or_assign(inAttrsJSON, entry);
+        });
     }
 
     std::optional<std::pair<Attrs, StorePath>> lookup(
@@ -79,20 +121,34 @@ struct CacheImpl : Cache
         ref<Store> store,
         const Attrs & inAttrs) override
     {
-        auto state(_state.lock());
-
         auto inAttrsJSON = attrsToJSON(inAttrs).dump();
 
-        auto stmt(state->lookup.use()(inAttrsJSON));
-        if (!stmt.next()) {
+        auto entry = retrySQLite<std::optional<Entry>>([&]() -> std::optional<Entry> {
+            auto state(_state.lock());
+
+            if (auto i = state->memo.find(inAttrsJSON); i != state->memo.end())
+                return i->second;
+
+            std::optional<Entry> entry;
+            auto stmt(state->lookup.use()(inAttrsJSON));
+            if (stmt.next())
+                entry = Entry {
+                    .info = stmt.getStr(0),
+                    .path = stmt.getStr(1),
+                    .locked = stmt.getInt(2) != 0,
+                    .timestamp = stmt.getInt(3),
+                };
+
+            state->memo.insert_or_assign(inAttrsJSON, entry);
+            return entry;
+        });
+
+        if (!entry) {
             debug("did not find cache entry for '%s'", inAttrsJSON);
             return {};
         }
 
-        auto infoJSON = stmt.getStr(0);
-        auto storePath = store->parseStorePath(stmt.getStr(1));
-        auto locked = stmt.getInt(2) != 0;
-        auto timestamp = stmt.getInt(3);
+        auto storePath = store->parseStorePath(entry->path);
 
         store->addTempRoot(storePath);
         if (!store->isValidPath(storePath)) {
@@ -102,14 +158,24 @@ struct CacheImpl : Cache
         }
 
         debug("using cache entry '%s' -> '%s', '%s'",
-            inAttrsJSON, infoJSON, store->printStorePath(storePath));
+            inAttrsJSON, entry->info, entry->path);
 
         return Result {
-            .expired = !locked && (settings.tarballTtl.get() == 0 || timestamp + settings.tarballTtl < time(0)),
-            .infoAttrs = jsonToAttrs(nlohmann::json::parse(infoJSON)),
+            .expired = !entry->locked && (settings.tarballTtl.get() == 0 || entry->timestamp + settings.tarballTtl < time(0)),
+            .infoAttrs = jsonToAttrs(nlohmann::json::parse(entry->info)),
             .storePath = std::move(storePath)
         };
     }
+
+    uint64_t prune(time_t olderThan) override
+    {
+        return retrySQLite<uint64_t>([&]() {
+            auto state(_state.lock());
+            state->prune.use()((int64_t) olderThan).exec();
+            state->memo.clear();
+            return state->db.getRowsChanged();
+        });
+    }
 };
 
 ref<Cache> getCache()
@@ -31,6 +31,15 @@ struct Cache
     virtual std::optional<Result> lookupExpired(
         ref<Store> store,
         const Attrs & inAttrs) = 0;
+
+    /**
+     * Remove the entries that were added before `olderThan`. The
+     * store paths they refer to are not GC roots, so they can be
+     * garbage-collected afterwards.
+     *
+     * @return The number of entries removed.
+     */
+    virtual uint64_t prune(time_t olderThan) = 0;
 };
 
 ref<Cache> getCache();
@@ -95,6 +95,17 @@ struct FetchSettings : public Config
           empty, the summary is generated based on the action performed.
         )",
         {}, true, Xp::Flakes};
+
+    Setting<bool> cacheSourceCopies{this, true, "cache-source-copies",
+        R"(
+          Whether to remember which store path a local source tree
+          was copied to, across Nix invocations. A tree is copied
+          again only if its fingerprint has changed. The fingerprint
+          covers the file names, sizes, inodes, and modification and
+          status change times of all files in the tree. This avoids
+          reading and hashing large source trees (such as `./.` in a
+          flake or a path in a Nix expression) on every evaluation.
+        )"};
 };
 
 // FIXME: don't use a global variable.
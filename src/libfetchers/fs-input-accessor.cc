@@ -99,6 +99,11 @@ struct FSInputAccessorImpl : FSInputAccessor, PosixSourceAccessor
         return (bool) allowedPaths;
     }
 
+    void cacheDirectories() override
+    {
+        PosixSourceAccessor::cacheDirectories();
+    }
+
     std::optional<CanonPath> getPhysicalPath(const CanonPath & path) override
     {
         return makeAbsPath(path);
@@ -14,6 +14,12 @@ struct FSInputAccessor : InputAccessor
     virtual void allowPath(CanonPath path) = 0;
 
     virtual bool hasAccessControl() = 0;
+
+    /**
+     * Cache directory listings for the lifetime of this accessor,
+     * revalidating them against the directory's mtime.
+     */
+    virtual void cacheDirectories() = 0;
 };
 
 typedef std::function<RestrictedPathError(const CanonPath & path)> MakeNotAllowedError;
@@ -0,0 +1,346 @@
+#include "git-utils.hh"
+#include "util.hh"
+
+#include <git2.h>
+
+#include <mutex>
+
+namespace nix {
+
+template<auto del>
+struct Deleter
+{
+    template <typename T>
+    void operator()(T * p) const { del(p); };
+};
+
+typedef std::unique_ptr<git_repository, Deleter<git_repository_free>> Repository;
+typedef std::unique_ptr<git_object, Deleter<git_object_free>> Object;
+typedef std::unique_ptr<git_commit, Deleter<git_commit_free>> Commit;
+typedef std::unique_ptr<git_tree, Deleter<git_tree_free>> Tree;
+typedef std::unique_ptr<git_tree_entry, Deleter<git_tree_entry_free>> TreeEntry;
+typedef std::unique_ptr<git_blob, Deleter<git_blob_free>> Blob;
+typedef std::unique_ptr<git_revwalk, Deleter<git_revwalk_free>> Revwalk;
+typedef std::unique_ptr<git_odb, Deleter<git_odb_free>> Odb;
+
+/**
+ * Helper for passing the address of a smart pointer to a libgit2
+ * function that returns a new object through it.
+ */
+template<typename T>
+struct Setter
+{
+    T & t;
+    typename T::pointer p = nullptr;
+
+    Setter(T & t) : t(t) { }
+
+    ~Setter() { if (p) t = T(p); }
+
+    operator typename T::pointer * () { return &p; }
+};
+
+static std::string lastError()
+{
+    auto error = git_error_last();
+    return error ? error->message : "unknown error";
+}
+
+static git_oid hashToOID(const Hash & hash)
+{
+    git_oid oid;
+    if (git_oid_fromstr(&oid, hash.gitRev().c_str()))
+        throw Error("cannot convert '%s' to a Git OID", hash.gitRev());
+    return oid;
+}
+
+static Hash toHash(const git_oid & oid)
+{
+    Hash hash(htSHA1);
+    memcpy(hash.hash, oid.id, hash.hashSize);
+    return hash;
+}
+
+static void initLibGit2()
+{
+    static std::once_flag initialized;
+    std::call_once(initialized, []() {
+        if (git_libgit2_init() < 0)
+            throw Error("initialising libgit2: %s", lastError());
+    });
+}
+
+/**
+ * Attributes that make `git archive` produce something other than
+ * the tree itself.
+ */
+static const std::vector<std::string_view> archiveAttributes = {
+    "export-ignore", "export-subst", "filter", "ident", "eol", "working-tree-encoding"
+};
+
+struct GitRepoImpl : GitRepo, std::enable_shared_from_this<GitRepoImpl>
+{
+    Path path;
+    Repository repo;
+
+    GitRepoImpl(const Path & path)
+        : path(path)
+    {
+        initLibGit2();
+
+        if (git_repository_open(Setter(repo), path.c_str()))
+            throw Error("opening Git repository '%s': %s", path, lastError());
+    }
+
+    Object lookupObject(const Hash & oid, git_object_t type)
+    {
+        auto oid2 = hashToOID(oid);
+        Object obj;
+        if (git_object_lookup(Setter(obj), repo.get(), &oid2, GIT_OBJECT_ANY))
+            throw Error("looking up Git object '%s' in '%s': %s", oid.gitRev(), path, lastError());
+        Object peeled;
+        if (git_object_peel(Setter(peeled), obj.get(), type))
+            throw Error("peeling Git object '%s' in '%s': %s", oid.gitRev(), path, lastError());
+        return peeled;
+    }
+
+    Commit lookupCommit(const Hash & rev)
+    {
+        return Commit((git_commit *) lookupObject(rev, GIT_OBJECT_COMMIT).release());
+    }
+
+    Tree lookupTree(const Hash & rev)
+    {
+        return Tree((git_tree *) lookupObject(rev, GIT_OBJECT_TREE).release());
+    }
+
+    uint64_t getRevCount(const Hash & rev) override
+    {
+        auto commit = lookupCommit(rev);
+
+        Revwalk walk;
+        if (git_revwalk_new(Setter(walk), repo.get()))
+            throw Error("creating a Git revision walker: %s", lastError());
+
+        if (git_revwalk_push(walk.get(), git_commit_id(commit.get())))
+            throw Error("walking the history of '%s' in '%s': %s", rev.gitRev(), path, lastError());
+
+        uint64_t count = 0;
+        git_oid oid;
+        int res;
+        while ((res = git_revwalk_next(&oid, walk.get())) == 0) {
+            if (count++ % 1024 == 0) checkInterrupt();
+        }
+
+        if (res != GIT_ITEROVER)
+            throw Error("walking the history of '%s' in '%s': %s", rev.gitRev(), path, lastError());
+
+        return count;
+    }
+
+    uint64_t getLastModified(const Hash & rev) override
+    {
+        return git_commit_time(lookupCommit(rev).get());
+    }
+
+    bool isShallow() override
+    {
+        auto res = git_repository_is_shallow(repo.get());
+        if (res < 0)
+            throw Error("checking whether '%s' is shallow: %s", path, lastError());
+        return res;
+    }
+
+    bool hasObject(const Hash & oid) override
+    {
+        auto oid2 = hashToOID(oid);
+        Odb odb;
+        if (git_repository_odb(Setter(odb), repo.get()))
+            throw Error("opening the object database of '%s': %s", path, lastError());
+        return git_odb_exists(odb.get(), &oid2);
+    }
+
+    Hash resolveRef(std::string ref) override
+    {
+        Object obj;
+        if (git_revparse_single(Setter(obj), repo.get(), ref.c_str()))
+            throw Error("resolving Git reference '%s' in '%s': %s", ref, path, lastError());
+        return toHash(*git_object_id(obj.get()));
+    }
+
+    bool hasArchiveAttributes(const Hash & rev) override
+    {
+        auto tree = lookupTree(rev);
+
+        struct Payload
+        {
+            GitRepoImpl & repo;
+            bool found = false;
+        } payload{*this};
+
+        auto callback = [](const char * root, const git_tree_entry * entry, void * payload_) -> int {
+            auto & payload = *(Payload *) payload_;
+            if (git_tree_entry_type(entry) != GIT_OBJECT_BLOB
+                || std::string_view(git_tree_entry_name(entry)) != ".gitattributes")
+                return 0;
+            Blob blob;
+            if (git_blob_lookup(Setter(blob), payload.repo.repo.get(), git_tree_entry_id(entry)))
+                return -1;
+            std::string_view contents((const char *) git_blob_rawcontent(blob.get()), git_blob_rawsize(blob.get()));
+            for (auto & attr : archiveAttributes)
+                if (contents.find(attr) != contents.npos) {
+                    payload.found = true;
+                    return -1;
+                }
+            return 0;
+        };
+
+        auto res = git_tree_walk(tree.get(), GIT_TREEWALK_PRE, callback, &payload);
+        if (res && !payload.found)
+            throw Error("reading the tree of '%s' in '%s': %s", rev.gitRev(), path, lastError());
+
+        return payload.found;
+    }
+
+    ref<InputAccessor> getAccessor(const Hash & rev) override;
+};
+
+ref<GitRepo> GitRepo::openRepo(const Path & path)
+{
+    return make_ref<GitRepoImpl>(path);
+}
+
+struct GitInputAccessor : InputAccessor
+{
+    ref<GitRepoImpl> repo;
+    Tree root;
+
+    GitInputAccessor(ref<GitRepoImpl> repo_, const Hash & rev)
+        : repo(repo_)
+        , root(repo->lookupTree(rev))
+    {
+    }
+
+    /**
+     * @return The tree entry of `path`, or nothing if it doesn't
+     * exist. Must not be called on the root.
+     */
+    TreeEntry lookup(const CanonPath & path)
+    {
+        assert(!path.isRoot());
+        TreeEntry entry;
+        auto res = git_tree_entry_bypath(Setter(entry), root.get(), std::string(path.rel()).c_str());
+        if (res == GIT_ENOTFOUND) return nullptr;
+        if (res)
+            throw Error("looking up '%s': %s", showPath(path), lastError());
+        return entry;
+    }
+
+    TreeEntry need(const CanonPath & path)
+    {
+        auto entry = lookup(path);
+        if (!entry)
+            throw Error("'%s' does not exist", showPath(path));
+        return entry;
+    }
+
+    static std::optional<Stat> entryStat(const git_tree_entry * entry)
+    {
+        switch (git_tree_entry_filemode(entry)) {
+        case GIT_FILEMODE_TREE:
+        /* Like `git archive`, represent submodules as empty
+           directories. */
+        case GIT_FILEMODE_COMMIT:
+            return Stat { .type = tDirectory };
+        case GIT_FILEMODE_BLOB:
+            return Stat { .type = tRegular };
+        case GIT_FILEMODE_BLOB_EXECUTABLE:
+            return Stat { .type = tRegular, .isExecutable = true };
+        case GIT_FILEMODE_LINK:
+            return Stat { .type = tSymlink };
+        default:
+            return std::nullopt;
+        }
+    }
+
+    bool pathExists(const CanonPath & path) override
+    {
+        return path.isRoot() || lookup(path);
+    }
+
+    Stat lstat(const CanonPath & path) override
+    {
+        if (path.isRoot())
+            return Stat { .type = tDirectory };
+
+        auto entry = need(path);
+        if (auto st = entryStat(entry.get()))
+            return *st;
+        throw Error("'%s' has an unsupported Git file type", showPath(path));
+    }
+
+    Blob readBlob(const CanonPath & path, bool symlink)
+    {
+        TreeEntry entry;
+        if (!path.isRoot()) entry = need(path);
+
+        if (!entry || git_tree_entry_type(entry.get()) != GIT_OBJECT_BLOB
+            || (git_tree_entry_filemode(entry.get()) == GIT_FILEMODE_LINK) != symlink)
+            throw Error(symlink ? "'%s' is not a symlink" : "'%s' is not a regular file", showPath(path));
+
+        Blob blob;
+        if (git_blob_lookup(Setter(blob), repo->repo.get(), git_tree_entry_id(entry.get())))
+            throw Error("reading '%s': %s", showPath(path), lastError());
+        return blob;
+    }
+
+    std::string readFile(const CanonPath & path) override
+    {
+        auto blob = readBlob(path, false);
+        return std::string((const char *) git_blob_rawcontent(blob.get()), git_blob_rawsize(blob.get()));
+    }
+
+    DirEntries readDirectory(const CanonPath & path) override
+    {
+        Tree tree;
+        const git_tree * dir = root.get();
+
+        if (!path.isRoot()) {
+            auto entry = need(path);
+            if (git_tree_entry_filemode(entry.get()) == GIT_FILEMODE_COMMIT)
+                return {};
+            if (git_tree_entry_type(entry.get()) != GIT_OBJECT_TREE)
+                throw Error("'%s' is not a directory", showPath(path));
+            if (git_tree_lookup(Setter(tree), repo->repo.get(), git_tree_entry_id(entry.get())))
+                throw Error("reading directory '%s': %s", showPath(path), lastError());
+            dir = tree.get();
+        }
+
+        DirEntries res;
+        auto count = git_tree_entrycount(dir);
+        for (size_t n = 0; n < count; ++n) {
+            auto entry = git_tree_entry_byindex(dir, n);
+            auto st = entryStat(entry);
+            res.emplace(git_tree_entry_name(entry), st ? std::optional(st->type) : std::nullopt);
+        }
+        return res;
+    }
+
+    std::string readLink(const CanonPath & path) override
+    {
+        auto blob = readBlob(path, true);
+        return std::string((const char *) git_blob_rawcontent(blob.get()), git_blob_rawsize(blob.get()));
+    }
+
+    std::string showPath(const CanonPath & path) override
+    {
+        return fmt("%s:%s", repo->path, path.rel());
+    }
+};
+
+ref<InputAccessor> GitRepoImpl::getAccessor(const Hash & rev)
+{
+    return make_ref<GitInputAccessor>(ref<GitRepoImpl>(shared_from_this()), rev);
+}
+
+}
@@ -0,0 +1,62 @@
+#pragma once
+///@file
+
+#include "input-accessor.hh"
+
+namespace nix {
+
+/**
+ * A Git repository accessed in-process using libgit2, rather than by
+ * running `git`.
+ */
+struct GitRepo
+{
+    virtual ~GitRepo()
+    { }
+
+    /**
+     * Open the Git repository at `path`, which may be a working tree
+     * or a bare repository.
+     */
+    static ref<GitRepo> openRepo(const Path & path);
+
+    /**
+     * @return The number of commits reachable from `rev`, including
+     * `rev` itself.
+     */
+    virtual uint64_t getRevCount(const Hash & rev) = 0;
+
+    /**
+     * @return The commit time of `rev`.
+     */
+    virtual uint64_t getLastModified(const Hash & rev) = 0;
+
+    virtual bool isShallow() = 0;
+
+    /**
+     * @return Whether the repository contains the object `oid`.
+     */
+    virtual bool hasObject(const Hash & oid) = 0;
+
+    /**
+     * Resolve a ref (like `master`, `refs/tags/1.0` or `HEAD`) to the
+     * object it points to, like `git rev-parse`.
+     */
+    virtual Hash resolveRef(std::string ref) = 0;
+
+    /**
+     * @return Whether the tree of `rev` contains `.gitattributes`
+     * files with attributes that change the output of `git archive`
+     * compared to the tree itself, such as `export-ignore` or
+     * `export-subst`.
+     */
+    virtual bool hasArchiveAttributes(const Hash & rev) = 0;
+
+    /**
+     * @return An accessor for the tree of `rev`, which reads objects
+     * directly from the repository.
+     */
+    virtual ref<InputAccessor> getAccessor(const Hash & rev) = 0;
+};
+
+}
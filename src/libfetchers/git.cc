@@ -7,6 +7,7 @@
 #include "pathlocks.hh"
 #include "util.hh"
 #include "git.hh"
+#include "git-utils.hh"
 
 #include "fetch-settings.hh"
 
@@ -43,10 +44,13 @@ bool touchCacheFile(const Path & path, time_t touch_time)
     return lutimes(path.c_str(), times) == 0;
 }
 
-Path getCachePath(std::string_view key)
+// Shallow clones are kept separate from full clones, since
+// fetching into a shallow clone would make a full clone shallow.
+Path getCachePath(std::string_view key, bool shallow)
 {
     return getCacheDir() + "/nix/gitv3/" +
-        hashString(htSHA256, key).to_string(HashFormat::Base32, false);
+        hashString(htSHA256, key).to_string(HashFormat::Base32, false) +
+        (shallow ? "-shallow" : "");
 }
 
 // Returns the name of the HEAD branch.
@@ -83,9 +87,9 @@ std::optional<std::string> readHead(const Path & path)
 }
 
 // Persist the HEAD ref from the remote repo in the local cached repo.
-bool storeCachedHead(const std::string & actualUrl, const std::string & headRef)
+bool storeCachedHead(const std::string & actualUrl, bool shallow, const std::string & headRef)
 {
-    Path cacheDir = getCachePath(actualUrl);
+    Path cacheDir = getCachePath(actualUrl, shallow);
     try {
         runProgram("git", true, { "-C", cacheDir, "--git-dir", ".", "symbolic-ref", "--", "HEAD", headRef });
     } catch (ExecError &e) {
@@ -96,11 +100,11 @@ bool storeCachedHead(const std::string & actualUrl, const std::string & headRef)
     return true;
 }
 
-std::optional<std::string> readHeadCached(const std::string & actualUrl)
+std::optional<std::string> readHeadCached(const std::string & actualUrl, bool shallow)
 {
     // Create a cache path to store the branch of the HEAD ref. Append something
     // in front of the URL to prevent collision with the repository itself.
-    Path cacheDir = getCachePath(actualUrl);
+    Path cacheDir = getCachePath(actualUrl, shallow);
     Path headRefFile = cacheDir + "/HEAD";
 
     time_t now = time(0);
@@ -479,13 +483,13 @@ struct GitInputScheme : InputScheme
 
             if (!input.getRev())
                 input.attrs.insert_or_assign("rev",
-                    Hash::parseAny(chomp(runProgram("git", true, { "-C", actualUrl, "--git-dir", gitDir, "rev-parse", *input.getRef() })), htSHA1).gitRev());
+                    GitRepo::openRepo(actualUrl)->resolveRef(*input.getRef()).gitRev());
 
             repoDir = actualUrl;
         } else {
             const bool useHeadRef = !input.getRef();
             if (useHeadRef) {
-                auto head = readHeadCached(actualUrl);
+                auto head = readHeadCached(actualUrl, shallow);
                 if (!head) {
                     warn("could not read HEAD ref from repo at '%s', using 'master'", actualUrl);
                     head = "master";
@@ -506,7 +510,7 @@ struct GitInputScheme : InputScheme
                 }
             }
 
-            Path cacheDir = getCachePath(actualUrl);
+            Path cacheDir = getCachePath(actualUrl, shallow);
             repoDir = cacheDir;
             gitDir = ".";
 
@@ -528,16 +532,7 @@ struct GitInputScheme : InputScheme
             /* If a rev was specified, we need to fetch if it's not in the
                repo. */
             if (input.getRev()) {
-                try {
-                    runProgram("git", true, { "-C", repoDir, "--git-dir", gitDir, "cat-file", "-e", input.getRev()->gitRev() });
-                    doFetch = false;
-                } catch (ExecError & e) {
-                    if (WIFEXITED(e.status)) {
-                        doFetch = true;
-                    } else {
-                        throw;
-                    }
-                }
+                doFetch = !GitRepo::openRepo(repoDir)->hasObject(*input.getRev());
             } else {
                 if (allRefs) {
                     doFetch = true;
@@ -553,6 +548,8 @@ struct GitInputScheme : InputScheme
             if (doFetch) {
                 Activity act(*logger, lvlTalkative, actUnknown, fmt("fetching Git repository '%s'", actualUrl));
 
+                bool fetchedRef = true;
+
                 // FIXME: git stderr messes up our progress indicator, so
                 // we're using --quiet for now. Should process its stderr.
                 try {
@@ -564,16 +561,44 @@ struct GitInputScheme : InputScheme
                             : ref == "HEAD"
                                 ? *ref
                                 : "refs/heads/" + *ref;
-                    runProgram("git", true, { "-C", repoDir, "--git-dir", gitDir, "fetch", "--quiet", "--force", "--", actualUrl, fmt("%s:%s", fetchRef, fetchRef) }, {}, true);
+
+                    Strings args = { "-C", repoDir, "--git-dir", gitDir, "fetch", "--quiet", "--force" };
+                    if (shallow) args.push_back("--depth=1");
+                    args.push_back("--");
+                    args.push_back(actualUrl);
+
+                    /* In a shallow clone, fetch only the locked revision
+                       rather than the tip of the ref, if the remote
+                       allows fetching commits by hash. */
+                    if (shallow && input.getRev()) {
+                        try {
+                            auto args2 = args;
+                            args2.push_back(input.getRev()->gitRev());
+                            runProgram("git", true, args2, {}, true);
+                            fetchedRef = false;
+                        } catch (ExecError & e) {
+                            debug("cannot fetch revision '%s' from '%s' directly; fetching ref '%s'",
+                                input.getRev()->gitRev(), actualUrl, fetchRef);
+                        }
+                    }
+
+                    if (fetchedRef) {
+                        args.push_back(fmt("%s:%s", fetchRef, fetchRef));
+                        runProgram("git", true, args, {}, true);
+                    }
                 } catch (Error & e) {
                     if (!pathExists(localRefFile)) throw;
                     warn("could not update local clone of Git repository '%s'; continuing with the most recent version", actualUrl);
                 }
 
-                if (!touchCacheFile(localRefFile, now))
-                    warn("could not update mtime for file '%s': %s", localRefFile, strerror(errno));
-                if (useHeadRef && !storeCachedHead(actualUrl, *input.getRef()))
-                    warn("could not update cached head '%s' for '%s'", *input.getRef(), actualUrl);
+                /* Fetching a revision doesn't update the local ref,
+                   so don't mark it as up to date. */
+                if (fetchedRef) {
+                    if (!touchCacheFile(localRefFile, now))
+                        warn("could not update mtime for file '%s': %s", localRefFile, strerror(errno));
+                    if (useHeadRef && !storeCachedHead(actualUrl, shallow, *input.getRef()))
+                        warn("could not update cached head '%s' for '%s'", *input.getRef(), actualUrl);
+                }
             }
 
             if (!input.getRev())
@@ -582,7 +607,9 @@ struct GitInputScheme : InputScheme
             // cache dir lock is removed at scope end; we will only use read-only operations on specific revisions in the remainder
         }
 
-        bool isShallow = chomp(runProgram("git", true, { "-C", repoDir, "--git-dir", gitDir, "rev-parse", "--is-shallow-repository" })) == "true";
+        auto repo = GitRepo::openRepo(repoDir);
+
+        bool isShallow = repo->isShallow();
 
         if (isShallow && !shallow)
             throw Error("'%s' is a shallow Git repository, but shallow repositories are only allowed when `shallow = true;` is specified.", actualUrl);
@@ -596,18 +623,7 @@ struct GitInputScheme : InputScheme
         if (auto res = getCache()->lookup(store, getLockedAttrs()))
             return makeResult(res->first, std::move(res->second));
 
-        Path tmpDir = createTempDir();
-        AutoDelete delTmpDir(tmpDir, true);
-        PathFilter filter = defaultPathFilter;
-
-        auto result = runProgram(RunOptions {
-            .program = "git",
-            .args = { "-C", repoDir, "--git-dir", gitDir, "cat-file", "commit", input.getRev()->gitRev() },
-            .mergeStderrToStdout = true
-        });
-        if (WEXITSTATUS(result.first) == 128
-            && result.second.find("bad file") != std::string::npos)
-        {
+        if (!repo->hasObject(*input.getRev())) {
             throw Error(
                 "Cannot find Git revision '%s' in ref '%s' of repository '%s'! "
                 "Please make sure that the " ANSI_BOLD "rev" ANSI_NORMAL " exists on the "
@@ -619,7 +635,12 @@ struct GitInputScheme : InputScheme
             );
         }
 
+        std::optional<StorePath> storePath;
+
         if (submodules) {
+            Path tmpDir = createTempDir();
+            AutoDelete delTmpDir(tmpDir, true);
+
             Path tmpGitDir = createTempDir();
             AutoDelete delTmpGitDir(tmpGitDir, true);
 
@@ -661,8 +682,14 @@ struct GitInputScheme : InputScheme
                 runProgram("git", true, { "-C", tmpDir, "submodule", "--quiet", "update", "--init", "--recursive" }, {}, true);
             }
 
-            filter = isNotDotGitDirectory;
-        } else {
+            PathFilter filter = isNotDotGitDirectory;
+            storePath = store->addToStore(name, tmpDir, FileIngestionMethod::Recursive, htSHA256, filter);
+        } else if (repo->hasArchiveAttributes(*input.getRev())) {
+            /* The tree has attributes that `git archive` applies, so
+               get the tree as `git archive` produces it. */
+            Path tmpDir = createTempDir();
+            AutoDelete delTmpDir(tmpDir, true);
+
             // FIXME: should pipe this, or find some better way to extract a
             // revision.
             auto source = sinkToSource([&](Sink & sink) {
@@ -674,11 +701,15 @@ struct GitInputScheme : InputScheme
             });
 
             unpackTarfile(*source, tmpDir);
-        }
 
-        auto storePath = store->addToStore(name, tmpDir, FileIngestionMethod::Recursive, htSHA256, filter);
+            storePath = store->addToStore(name, tmpDir, FileIngestionMethod::Recursive, htSHA256);
+        } else {
+            /* Copy the tree straight from the repository, without
+               checking it out. */
+            storePath = repo->getAccessor(*input.getRev())->fetchToStore(store, CanonPath::root, name);
+        }
 
-        auto lastModified = std::stoull(runProgram("git", true, { "-C", repoDir, "--git-dir", gitDir, "log", "-1", "--format=%ct", "--no-show-signature", input.getRev()->gitRev() }));
+        auto lastModified = repo->getLastModified(*input.getRev());
 
         Attrs infoAttrs({
             {"rev", input.getRev()->gitRev()},
@@ -686,25 +717,24 @@ struct GitInputScheme : InputScheme
         });
 
         if (!shallow)
-            infoAttrs.insert_or_assign("revCount",
-                std::stoull(runProgram("git", true, { "-C", repoDir, "--git-dir", gitDir, "rev-list", "--count", input.getRev()->gitRev() })));
+            infoAttrs.insert_or_assign("revCount", repo->getRevCount(*input.getRev()));
 
         if (!_input.getRev())
             getCache()->add(
                 store,
                 unlockedAttrs,
                 infoAttrs,
-                storePath,
+                *storePath,
                 false);
 
         getCache()->add(
             store,
             getLockedAttrs(),
             infoAttrs,
-            storePath,
+            *storePath,
             true);
 
-        return makeResult(infoAttrs, std::move(storePath));
+        return makeResult(infoAttrs, std::move(*storePath));
     }
 };
 
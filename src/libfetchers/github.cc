@@ -3,6 +3,7 @@
 #include "globals.hh"
 #include "store-api.hh"
 #include "types.hh"
+#include "sync.hh"
 #include "url-parts.hh"
 #include "git.hh"
 #include "fetchers.hh"
@@ -177,6 +178,31 @@ struct GitArchiveInputScheme : InputScheme
 
     virtual Hash getRevFromRef(nix::ref<Store> store, const Input & input) const = 0;
 
+    /**
+     * Resolve the ref of `input` using `getRevFromRef()`, at most once
+     * per process for each repository and ref. Answers are also kept
+     * in the fetcher cache across processes and revalidated using
+     * their ETag, but `nix flake update` treats them all as stale, so
+     * without this every input that follows the same repository (such
+     * as `nixpkgs`) would query the API again.
+     */
+    Hash resolveRef(nix::ref<Store> store, const Input & input) const
+    {
+        static Sync<std::map<std::string, Hash>> resolved;
+
+        auto key = input.toURLString();
+
+        {
+            auto resolved_(resolved.lock());
+            if (auto rev = get(*resolved_, key))
+                return *rev;
+        }
+
+        auto rev = getRevFromRef(store, input);
+        resolved.lock()->insert_or_assign(key, rev);
+        return rev;
+    }
+
     virtual DownloadUrl getDownloadUrl(const Input & input) const = 0;
 
     std::pair<StorePath, Input> fetch(ref<Store> store, const Input & _input) override
@@ -186,7 +212,7 @@ struct GitArchiveInputScheme : InputScheme
         if (!maybeGetStrAttr(input.attrs, "ref")) input.attrs.insert_or_assign("ref", "HEAD");
 
         auto rev = input.getRev();
-        if (!rev) rev = getRevFromRef(store, input);
+        if (!rev) rev = resolveRef(store, input);
 
         input.attrs.erase("ref");
         input.attrs.insert_or_assign("rev", rev->gitRev());
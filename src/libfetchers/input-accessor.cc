@@ -1,8 +1,52 @@
 #include "input-accessor.hh"
 #include "store-api.hh"
+#include "cache.hh"
+#include "fetch-settings.hh"
 
 namespace nix {
 
+std::optional<std::string> fingerprintTree(SourceAccessor & accessor, const CanonPath & path)
+{
+    HashSink sink(htSHA256);
+
+    auto now = time(nullptr);
+
+    std::function<bool(const CanonPath &)> recurse;
+    recurse = [&](const CanonPath & path) {
+        auto physicalPath = accessor.getPhysicalPath(path);
+        if (!physicalPath) return false;
+
+        auto st = nix::lstat(physicalPath->abs());
+        if (st.st_mtime >= now - 2 || st.st_ctime >= now - 2) return false;
+
+        sink(fmt("%s%c%o %d %d %d %d%c",
+            path.abs(), 0,
+            st.st_mode, st.st_size, st.st_ino,
+            st.st_mtime, st.st_ctime, 0));
+#if __APPLE__
+        sink(fmt("%d %d%c", st.st_mtimespec.tv_nsec, st.st_ctimespec.tv_nsec, 0));
+#else
+        sink(fmt("%d %d%c", st.st_mtim.tv_nsec, st.st_ctim.tv_nsec, 0));
+#endif
+
+        if (S_ISDIR(st.st_mode))
+            for (auto & [name, type] : accessor.readDirectory(path)) {
+                checkInterrupt();
+                if (!recurse(path + name)) return false;
+            }
+
+        return true;
+    };
+
+    try {
+        if (!recurse(path)) return std::nullopt;
+    } catch (SysError &) {
+        return std::nullopt;
+    }
+
+    return sink.finish().first.to_string(HashFormat::Base32, false);
+}
+
 StorePath InputAccessor::fetchToStore(
     ref<Store> store,
     const CanonPath & path,
@@ -11,6 +55,27 @@ StorePath InputAccessor::fetchToStore(
     PathFilter * filter,
     RepairFlag repair)
 {
+    /* For unfiltered copies of local files, look up the result of a
+       previous copy of the same tree, identified by its fingerprint. */
+    std::optional<fetchers::Attrs> cacheKey;
+    if (!filter && !repair && !settings.readOnlyMode && fetchSettings.cacheSourceCopies) {
+        if (auto physicalPath = getPhysicalPath(path)) {
+            if (auto fingerprint = fingerprintTree(*this, path)) {
+                cacheKey = fetchers::Attrs {
+                    {"type", "sourceCopy"},
+                    {"path", physicalPath->abs()},
+                    {"name", std::string(name)},
+                    {"method", makeFileIngestionPrefix(method)},
+                    {"fingerprint", *fingerprint},
+                };
+                if (auto res = fetchers::getCache()->lookup(store, *cacheKey)) {
+                    debug("using cached copy of '%s'", showPath(path));
+                    return res->second;
+                }
+            }
+        }
+    }
+
     Activity act(*logger, lvlChatty, actUnknown, fmt("copying '%s' to the store", showPath(path)));
 
     auto source = sinkToSource([&](Sink & sink) {
@@ -25,6 +90,9 @@ StorePath InputAccessor::fetchToStore(
         ? store->computeStorePathFromDump(*source, name, method, htSHA256).first
         : store->addToStoreFromDump(*source, name, method, htSHA256, repair);
 
+    if (cacheKey)
+        fetchers::getCache()->add(store, *cacheKey, {}, storePath, true);
+
     return storePath;
 }
 
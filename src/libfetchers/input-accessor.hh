@@ -36,6 +36,15 @@ struct InputAccessor : SourceAccessor, std::enable_shared_from_this<InputAccesso
     SourcePath root();
 };
 
+/**
+ * Compute a fingerprint of the metadata of the physical files
+ * underlying `path`, or return `std::nullopt` if that isn't possible.
+ * Like Git's index, we refuse to fingerprint trees that contain files
+ * modified very recently, since further changes within the timestamp
+ * granularity would go unnoticed.
+ */
+std::optional<std::string> fingerprintTree(SourceAccessor & accessor, const CanonPath & path);
+
 /**
  * An abstraction for accessing source files during
  * evaluation. Currently, it's just a wrapper around `CanonPath` that
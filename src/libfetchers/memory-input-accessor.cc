@@ -1,46 +1,38 @@
 #include "memory-input-accessor.hh"
+#include "memory-source-accessor.hh"
 
 namespace nix {
 
-struct MemoryInputAccessorImpl : MemoryInputAccessor
+struct MemoryInputAccessorImpl : MemoryInputAccessor, MemorySourceAccessor
 {
-    std::map<CanonPath, std::string> files;
-
     std::string readFile(const CanonPath & path) override
     {
-        auto i = files.find(path);
-        if (i == files.end())
-            throw Error("file '%s' does not exist", path);
-        return i->second;
+        return MemorySourceAccessor::readFile(path);
     }
 
     bool pathExists(const CanonPath & path) override
     {
-        auto i = files.find(path);
-        return i != files.end();
+        return MemorySourceAccessor::pathExists(path);
     }
 
     Stat lstat(const CanonPath & path) override
     {
-        auto i = files.find(path);
-        if (i != files.end())
-            return Stat { .type = tRegular, .isExecutable = false };
-        throw Error("file '%s' does not exist", path);
+        return MemorySourceAccessor::lstat(path);
     }
 
     DirEntries readDirectory(const CanonPath & path) override
     {
-        return {};
+        return MemorySourceAccessor::readDirectory(path);
     }
 
     std::string readLink(const CanonPath & path) override
     {
-        throw UnimplementedError("MemoryInputAccessor::readLink");
+        return MemorySourceAccessor::readLink(path);
     }
 
     SourcePath addFile(CanonPath path, std::string && contents) override
     {
-        files.emplace(path, std::move(contents));
+        open(path, File { File::Regular { .contents = std::move(contents) } });
 
         return {ref(shared_from_this()), std::move(path)};
     }
@@ -3,10 +3,15 @@
 namespace nix {
 
 /**
- * An input accessor for an in-memory file system.
+ * An input accessor for an in-memory file system, stored as a tree
+ * of directories (see `MemorySourceAccessor`).
  */
 struct MemoryInputAccessor : InputAccessor
 {
+    /**
+     * Add a regular file, creating its parent directories if
+     * necessary. An existing file at `path` is replaced.
+     */
     virtual SourcePath addFile(CanonPath path, std::string && contents) = 0;
 };
 
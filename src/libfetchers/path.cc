@@ -1,6 +1,10 @@
 #include "fetchers.hh"
 #include "store-api.hh"
 #include "archive.hh"
+#include "cache.hh"
+#include "fetch-settings.hh"
+#include "input-accessor.hh"
+#include "posix-source-accessor.hh"
 
 namespace nix::fetchers {
 
@@ -124,11 +128,37 @@ struct PathInputScheme : InputScheme
 
         time_t mtime = 0;
         if (!storePath || storePath->name() != "source" || !store->isValidPath(*storePath)) {
-            // FIXME: try to substitute storePath.
-            auto src = sinkToSource([&](Sink & sink) {
-                mtime = dumpPathAndGetMtime(absPath, sink, defaultPathFilter);
-            });
-            storePath = store->addToStoreFromDump(*src, "source");
+            /* Reuse the result of a previous copy if no file in the
+               tree has changed since, to avoid reading and hashing
+               the entire tree. */
+            std::optional<Attrs> cacheKey;
+            if (fetchSettings.cacheSourceCopies && !settings.readOnlyMode) {
+                PosixSourceAccessor accessor;
+                if (auto fingerprint = fingerprintTree(accessor, CanonPath(absPath)))
+                    cacheKey = Attrs {
+                        {"type", "pathCopy"},
+                        {"path", absPath},
+                        {"fingerprint", *fingerprint},
+                    };
+            }
+
+            std::optional<std::pair<Attrs, StorePath>> cached;
+            if (cacheKey)
+                cached = getCache()->lookup(store, *cacheKey);
+
+            if (cached) {
+                debug("using cached copy of '%s'", absPath);
+                storePath = std::move(cached->second);
+                mtime = getIntAttr(cached->first, "lastModified");
+            } else {
+                // FIXME: try to substitute storePath.
+                auto src = sinkToSource([&](Sink & sink) {
+                    mtime = dumpPathAndGetMtime(absPath, sink, defaultPathFilter);
+                });
+                storePath = store->addToStoreFromDump(*src, "source");
+                if (cacheKey)
+                    getCache()->add(store, *cacheKey, {{"lastModified", uint64_t(mtime)}}, *storePath, true);
+            }
         }
         input.attrs.insert_or_assign("lastModified", uint64_t(mtime));
 
@@ -6,11 +6,108 @@
 #include "store-api.hh"
 #include "archive.hh"
 #include "tarfile.hh"
+#include "memory-source-accessor.hh"
 #include "types.hh"
 #include "split.hh"
 
+#include <archive_entry.h>
+
 namespace nix::fetchers {
 
+/**
+ * Unpack the tarball `tarFile` into `accessor`, without writing it
+ * to disk. `maxMTime` is set to the latest modification time of any
+ * member.
+ *
+ * @return The modification times of the top-level members that the
+ * tarball has an entry for.
+ */
+static std::map<std::string, time_t> unpackTarfileToMemory(
+    const Path & tarFile,
+    MemorySourceAccessor & accessor,
+    time_t & maxMTime)
+{
+    TarArchive archive(tarFile);
+    MemorySink sink(accessor);
+
+    std::map<std::string, time_t> topLevelMTimes;
+    maxMTime = 0;
+
+    std::vector<char> buf(65536);
+
+    for (;;) {
+        checkInterrupt();
+
+        struct archive_entry * entry;
+        int r = archive_read_next_header(archive.archive, &entry);
+        if (r == ARCHIVE_EOF) break;
+        auto name = archive_entry_pathname(entry);
+        if (!name)
+            throw Error("cannot get archive member name: %s", archive_error_string(archive.archive));
+        if (r == ARCHIVE_WARN)
+            warn(archive_error_string(archive.archive));
+        else
+            archive.check(r);
+
+        for (auto & component : tokenizeString<Strings>(name, "/"))
+            if (component == "..")
+                throw Error("tarball '%s' contains a member with a '..' component: '%s'", tarFile, name);
+
+        CanonPath path(name);
+        if (path.isRoot()) continue;
+
+        auto mtime = archive_entry_mtime(entry);
+        maxMTime = std::max(maxMTime, mtime);
+        if (path.parent()->isRoot())
+            topLevelMTimes.insert_or_assign(std::string(*path.baseName()), mtime);
+
+        if (auto target = archive_entry_hardlink(entry)) {
+            auto * file = accessor.open(CanonPath(target), std::nullopt);
+            auto * regular = file ? std::get_if<MemorySourceAccessor::File::Regular>(&file->raw) : nullptr;
+            if (!regular)
+                throw Error("hard link '%s' in tarball '%s' refers to '%s', which is not a regular file", name, tarFile, target);
+            auto copy = *regular;
+            accessor.open(path, MemorySourceAccessor::File { std::move(copy) });
+            continue;
+        }
+
+        switch (archive_entry_filetype(entry)) {
+
+        case AE_IFDIR:
+            sink.createDirectory(path.abs());
+            break;
+
+        case AE_IFREG: {
+            sink.createRegularFile(path.abs());
+            if (archive_entry_mode(entry) & S_IXUSR)
+                sink.isExecutable();
+            if (archive_entry_size_is_set(entry))
+                sink.preallocateContents(archive_entry_size(entry));
+            while (true) {
+                auto n = archive_read_data(archive.archive, buf.data(), buf.size());
+                if (n < 0)
+                    throw Error("cannot read '%s' from tarball '%s': %s", name, tarFile, archive_error_string(archive.archive));
+                if (n == 0) break;
+                sink.receiveContents({buf.data(), (size_t) n});
+            }
+            sink.closeRegularFile();
+            break;
+        }
+
+        case AE_IFLNK:
+            sink.createSymlink(path.abs(), archive_entry_symlink(entry));
+            break;
+
+        default:
+            throw Error("file '%s' in tarball '%s' has an unsupported file type", name, tarFile);
+        }
+    }
+
+    archive.close();
+
+    return topLevelMTimes;
+}
+
 DownloadFileResult downloadFile(
     ref<Store> store,
     const std::string & url,
@@ -46,8 +143,20 @@ DownloadFileResult downloadFile(
     if (cached)
         request.expectedETag = getStrAttr(cached->infoAttrs, "etag");
     FileTransferResult res;
+    std::optional<StorePath> storePath;
     try {
-        res = getFileTransfer()->download(request);
+        if (cached)
+            res = getFileTransfer()->download(request);
+        else {
+            /* Stream the file into the store rather than holding it
+               in memory. This isn't possible for revalidation, where
+               we only learn whether the file has changed with the
+               response. */
+            auto source = sinkToSource([&](Sink & sink) {
+                res = getFileTransfer()->download(std::move(request), sink);
+            });
+            storePath = store->addToStoreFromDump(*source, name, FileIngestionMethod::Flat, htSHA256);
+        }
     } catch (FileTransferError & e) {
         if (cached) {
             warn("%s; using cached version", e.msg());
@@ -65,12 +174,10 @@ DownloadFileResult downloadFile(
     if (res.immutableUrl)
         infoAttrs.emplace("immutableUrl", *res.immutableUrl);
 
-    std::optional<StorePath> storePath;
-
     if (res.cached) {
         assert(cached);
         storePath = std::move(cached->storePath);
-    } else {
+    } else if (!storePath) {
         StringSink sink;
         dumpString(res.data, sink);
         auto hash = hashString(htSHA256, res.data);
@@ -148,15 +255,22 @@ DownloadTarballResult downloadTarball(
         unpackedStorePath = std::move(cached->storePath);
         lastModified = getIntAttr(cached->infoAttrs, "lastModified");
     } else {
-        Path tmpDir = createTempDir();
-        AutoDelete autoDelete(tmpDir, true);
-        unpackTarfile(store->toRealPath(res.storePath), tmpDir);
-        auto members = readDirectory(tmpDir);
+        /* Unpack the tarball in memory and copy the top-level
+           directory to the store from there, rather than extracting
+           it to a temporary directory first. */
+        MemorySourceAccessor accessor;
+        time_t maxMTime;
+        auto topLevelMTimes = unpackTarfileToMemory(store->toRealPath(res.storePath), accessor, maxMTime);
+        auto & members = std::get<MemorySourceAccessor::File::Directory>(accessor.root.raw).contents;
         if (members.size() != 1)
             throw nix::Error("tarball '%s' contains an unexpected number of top-level files", url);
-        auto topDir = tmpDir + "/" + members.begin()->name;
-        lastModified = lstat(topDir).st_mtime;
-        unpackedStorePath = store->addToStore(name, topDir, FileIngestionMethod::Recursive, htSHA256, defaultPathFilter, NoRepair);
+        auto topName = members.begin()->first;
+        auto i = topLevelMTimes.find(topName);
+        lastModified = i != topLevelMTimes.end() ? i->second : maxMTime;
+        auto source = sinkToSource([&](Sink & sink) {
+            accessor.dumpPath(CanonPath::root + topName, sink);
+        });
+        unpackedStorePath = store->addToStoreFromDump(*source, name, FileIngestionMethod::Recursive, htSHA256, NoRepair);
     }
 
     Attrs infoAttrs({
@@ -2,6 +2,7 @@
 #include "args/root.hh"
 #include "globals.hh"
 #include "loggers.hh"
+#include "tracing.hh"
 
 namespace nix {
 
@@ -62,6 +63,18 @@ MixCommonArgs::MixCommonArgs(const std::string & programName)
         .handler = {[](std::string format) { setLogFormat(format); }},
     });
 
+    addFlag({
+        .longName = "trace-file",
+        .description =
+            "Record the timing of activities, store operations, build goals and evaluation phases, "
+            "and write it to *path* in the Chrome trace event format when Nix exits. "
+            "The result can be loaded into `chrome://tracing` or [Perfetto](https://ui.perfetto.dev).",
+        .category = loggingCategory,
+        .labels = {"path"},
+        .handler = {[](std::string path) { startTracing(path); }},
+        .completer = completePath,
+    });
+
     addFlag({
         .longName = "max-jobs",
         .shortName = 'j',
@@ -33,6 +33,14 @@ static std::string_view storePathToName(std::string_view path)
     return i == std::string::npos ? base.substr(0, 0) : base.substr(i + 1);
 }
 
+static std::string renderDuration(std::chrono::seconds duration)
+{
+    auto s = duration.count();
+    if (s < 60) return fmt("%ds", s);
+    if (s < 3600) return fmt("%dm%02ds", s / 60, s % 60);
+    return fmt("%dh%02dm", s / 3600, s / 60 % 60);
+}
+
 class ProgressBar : public Logger
 {
 private:
@@ -50,6 +58,7 @@ private:
         ActivityId parent;
         std::optional<std::string> name;
         std::chrono::time_point<std::chrono::steady_clock> startTime;
+        std::optional<std::chrono::seconds> expectedDuration;
     };
 
     struct ActivitiesByType
@@ -90,6 +99,7 @@ public:
     ProgressBar(bool isTTY)
         : isTTY(isTTY)
     {
+        state_.setName("progress-bar");
         state_.lock()->active = isTTY;
         updateThread = std::thread([&]() {
             auto state(state_.lock());
@@ -201,6 +211,11 @@ public:
                 throw Error("log message indicated repeating builds, but this is not currently implemented");
             }
             i->name = DrvName(name).name;
+
+            /* How long previous builds of this derivation took, if
+               the daemon is new enough to tell us. */
+            if (fields.size() > 4 && getI(fields, 4))
+                i->expectedDuration = std::chrono::seconds(getI(fields, 4));
         }
 
         if (type == actSubstitute) {
@@ -386,9 +401,18 @@ public:
 
             if (i != state.activities.rend()) {
                 line += i->s;
-                if (!i->phase.empty()) {
+                std::list<std::string> notes;
+                if (!i->phase.empty())
+                    notes.push_back(i->phase);
+                if (i->expectedDuration && now - i->startTime < *i->expectedDuration) {
+                    auto left = std::chrono::duration_cast<std::chrono::seconds>(
+                        *i->expectedDuration - (now - i->startTime));
+                    notes.push_back(fmt("about %s left", renderDuration(left)));
+                    nextWakeup = std::min(nextWakeup, std::chrono::milliseconds(1000));
+                }
+                if (!notes.empty()) {
                     line += " (";
-                    line += i->phase;
+                    line += concatStringsSep(", ", notes);
                     line += ")";
                 }
                 if (!i->lastLine.empty()) {
@@ -406,23 +430,55 @@ public:
         return nextWakeup;
     }
 
+    /**
+     * Render the throughput of the running copies, and the time left
+     * at that rate, based on the bytes copied since the oldest
+     * `actCopyPaths` activity started.
+     */
+    std::string renderCopyRate(State & state, uint64_t done, uint64_t expected)
+    {
+        auto & copies = state.activitiesByType[actCopyPaths];
+        if (copies.its.empty() || !done || expected <= done) return "";
+
+        auto startTime = std::chrono::steady_clock::time_point::max();
+        for (auto & j : copies.its)
+            startTime = std::min(startTime, j.second->startTime);
+
+        auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+        if (elapsed < 2) return "";
+
+        auto rate = done / elapsed;
+        auto left = std::chrono::seconds((uint64_t) ((expected - done) / rate));
+
+        return fmt("%.1f MiB/s, about %s left", rate / (1024.0 * 1024.0), renderDuration(left));
+    }
+
     std::string getStatus(State & state)
     {
         auto MiB = 1024.0 * 1024.0;
 
         std::string res;
 
-        auto renderActivity = [&](ActivityType type, const std::string & itemFmt, const std::string & numberFmt = "%d", double unit = 1) {
+        struct Totals
+        {
+            uint64_t done, expected, running, failed;
+        };
+
+        auto getTotals = [&](ActivityType type) {
             auto & act = state.activitiesByType[type];
-            uint64_t done = act.done, expected = act.done, running = 0, failed = act.failed;
+            Totals t { act.done, act.done, 0, act.failed };
             for (auto & j : act.its) {
-                done += j.second->done;
-                expected += j.second->expected;
-                running += j.second->running;
-                failed += j.second->failed;
+                t.done += j.second->done;
+                t.expected += j.second->expected;
+                t.running += j.second->running;
+                t.failed += j.second->failed;
             }
+            t.expected = std::max(t.expected, act.expected);
+            return t;
+        };
 
-            expected = std::max(expected, act.expected);
+        auto renderActivity = [&](ActivityType type, const std::string & itemFmt, const std::string & numberFmt = "%d", double unit = 1) {
+            auto [done, expected, running, failed] = getTotals(type);
 
             std::string s;
 
@@ -466,7 +522,16 @@ public:
         if (!s1.empty() || !s2.empty()) {
             if (!res.empty()) res += ", ";
             if (s1.empty()) res += "0 copied"; else res += s1;
-            if (!s2.empty()) { res += " ("; res += s2; res += ')'; }
+            if (!s2.empty()) {
+                res += " (";
+                res += s2;
+                auto bytes = getTotals(actCopyPath);
+                if (auto eta = renderCopyRate(state, bytes.done, bytes.expected); !eta.empty()) {
+                    res += ", ";
+                    res += eta;
+                }
+                res += ')';
+            }
         }
 
         showActivity(actFileTransfer, "%s MiB DL", "%.1f", MiB);
@@ -5,6 +5,7 @@
 #include "util.hh"
 #include "loggers.hh"
 #include "progress-bar.hh"
+#include "startup-profile.hh"
 
 #include <algorithm>
 #include <cctype>
@@ -118,6 +119,8 @@ void initNix()
     std::cerr.rdbuf()->pubsetbuf(buf, sizeof(buf));
 #endif
 
+    StartupPhase phase("initialise");
+
     initLibStore();
 
     startSignalHandlerThread();
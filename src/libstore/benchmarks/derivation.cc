@@ -0,0 +1,49 @@
+#include "derivations.hh"
+#include "store-api.hh"
+
+#include <benchmark/benchmark.h>
+
+namespace nix {
+
+    /* A derivation with `inputs` input derivations and environment
+       variables, which is about what a Nixpkgs package looks like
+       for a few dozen inputs. */
+    static Derivation makeDerivation(const Store & store, size_t inputs)
+    {
+        Derivation drv;
+        drv.name = "benchmark";
+        drv.platform = "x86_64-linux";
+        drv.builder = "/bin/sh";
+        drv.args = { "-e", "builder.sh" };
+        for (size_t n = 0; n < inputs; ++n) {
+            auto path = StorePath::random(fmt("input-%d.drv", n));
+            drv.inputDrvs.map.insert_or_assign(path, DerivedPathMap<StringSet>::ChildNode { .value = { "out" } });
+            drv.inputSrcs.insert(StorePath::random(fmt("source-%d", n)));
+            drv.env.insert_or_assign(fmt("input%d", n), store.printStorePath(path));
+        }
+        drv.outputs.insert_or_assign("out", DerivationOutput::Deferred {});
+        return drv;
+    }
+
+    static void parseDerivation(benchmark::State & state)
+    {
+        auto store = openStore("dummy://");
+        auto aterm = makeDerivation(*store, state.range(0)).unparse(*store, false);
+        for (auto _ : state)
+            benchmark::DoNotOptimize(nix::parseDerivation(*store, std::string(aterm), "benchmark"));
+        state.SetBytesProcessed(state.iterations() * aterm.size());
+    }
+
+    BENCHMARK(parseDerivation)->Range(1, 1 << 10);
+
+    static void unparseDerivation(benchmark::State & state)
+    {
+        auto store = openStore("dummy://");
+        auto drv = makeDerivation(*store, state.range(0));
+        for (auto _ : state)
+            benchmark::DoNotOptimize(drv.unparse(*store, false));
+    }
+
+    BENCHMARK(unparseDerivation)->Range(1, 1 << 10);
+
+}
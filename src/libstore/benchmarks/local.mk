@@ -0,0 +1,17 @@
+bench: libstore-benchmarks_RUN
+
+programs += libstore-benchmarks
+
+libstore-benchmarks_NAME = libnixstore-benchmarks
+
+libstore-benchmarks_DIR := $(d)
+
+libstore-benchmarks_INSTALL_DIR :=
+
+libstore-benchmarks_SOURCES := $(wildcard $(d)/*.cc)
+
+libstore-benchmarks_CXXFLAGS += -I src/libstore -I src/libutil $(GBENCHMARK_CFLAGS)
+
+libstore-benchmarks_LIBS = libstore libutil
+
+libstore-benchmarks_LDFLAGS := $(GBENCHMARK_LIBS)
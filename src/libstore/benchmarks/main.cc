@@ -0,0 +1,14 @@
+#include "store-api.hh"
+
+#include <benchmark/benchmark.h>
+
+int main(int argc, char * * argv)
+{
+    nix::initLibStore();
+
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) return 1;
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
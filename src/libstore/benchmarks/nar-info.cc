@@ -0,0 +1,46 @@
+#include "nar-info.hh"
+#include "store-api.hh"
+
+#include <benchmark/benchmark.h>
+
+namespace nix {
+
+    /* A narinfo with `references` references, like those of binary
+       caches such as cache.nixos.org. */
+    static NarInfo makeNarInfo(const Store & store, size_t references)
+    {
+        NarInfo info(StorePath::random("benchmark"), hashString(htSHA256, "nar"));
+        info.url = "nar/" + hashString(htSHA256, "file").to_string(HashFormat::Base32, false) + ".nar.xz";
+        info.compression = "xz";
+        info.fileHash = hashString(htSHA256, "file");
+        info.fileSize = 123456;
+        info.narSize = 654321;
+        for (size_t n = 0; n < references; ++n)
+            info.references.insert(StorePath::random(fmt("reference-%d", n)));
+        info.deriver = StorePath::random("benchmark.drv");
+        info.sigs.insert("cache.nixos.org-1:SdvcEZl6ED+6gGRQ1mO3fIq0XgwxpMP3qRlQ8lH0uSxhvfcHQ6gFhCx8j5ij2Pn/rb3sBHrhKn2zAw1LuAhgAQ==");
+        return info;
+    }
+
+    static void parseNarInfo(benchmark::State & state)
+    {
+        auto store = openStore("dummy://");
+        auto text = makeNarInfo(*store, state.range(0)).to_string(*store);
+        for (auto _ : state)
+            benchmark::DoNotOptimize(NarInfo(*store, text, "benchmark"));
+        state.SetBytesProcessed(state.iterations() * text.size());
+    }
+
+    BENCHMARK(parseNarInfo)->Range(1, 1 << 8);
+
+    static void unparseNarInfo(benchmark::State & state)
+    {
+        auto store = openStore("dummy://");
+        auto info = makeNarInfo(*store, state.range(0));
+        for (auto _ : state)
+            benchmark::DoNotOptimize(info.to_string(*store));
+    }
+
+    BENCHMARK(unparseNarInfo)->Range(1, 1 << 8);
+
+}
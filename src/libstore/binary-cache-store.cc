@@ -1,6 +1,8 @@
 #include "archive.hh"
 #include "binary-cache-store.hh"
+#include "chunking.hh"
 #include "compression.hh"
+#include "delta.hh"
 #include "derivations.hh"
 #include "fs-accessor.hh"
 #include "globals.hh"
@@ -10,13 +12,23 @@
 #include "nar-info-disk-cache.hh"
 #include "nar-accessor.hh"
 #include "thread-pool.hh"
+#include "thread-pipe.hh"
 #include "callback.hh"
+#include "finally.hh"
+#include "pathlocks.hh"
+#include "metrics.hh"
+#include "tracing.hh"
 
 #include <chrono>
+#include <condition_variable>
 #include <future>
+#include <list>
 #include <regex>
+#include <thread>
 #include <fstream>
 
+#include <sys/time.h>
+
 #include <nlohmann/json.hpp>
 
 namespace nix {
@@ -110,17 +122,32 @@ void BinaryCacheStore::writeNarInfo(ref<NarInfo> narInfo)
 
     upsertFile(narInfoFile, narInfo->to_string(*this), "text/x-nix-narinfo");
 
-    {
-        auto state_(state.lock());
-        state_->pathInfoCache.upsert(
-            std::string(narInfo->path.to_string()),
-            PathInfoCacheValue { .value = std::shared_ptr<NarInfo>(narInfo) });
-    }
+    pathInfoCache.upsert(
+        std::string(narInfo->path.to_string()),
+        PathInfoCacheValue { .value = std::shared_ptr<NarInfo>(narInfo) });
 
     if (diskCache)
         diskCache->upsertNarInfo(getUri(), std::string(narInfo->path.hashPart()), std::shared_ptr<NarInfo>(narInfo));
 }
 
+static std::string compressionExtension(const std::string & compression)
+{
+    return
+        compression == "xz" ? ".xz" :
+        compression == "bzip2" ? ".bz2" :
+        compression == "zstd" ? ".zst" :
+        compression == "zstd-seekable" ? ".zst" :
+        compression == "lzip" ? ".lzip" :
+        compression == "lz4" ? ".lz4" :
+        compression == "br" ? ".br" :
+        "";
+}
+
+static std::string chunkKey(const Hash & hash, const std::string & compression)
+{
+    return "chunks/" + hash.to_string(HashFormat::Base32, false) + compressionExtension(compression);
+}
+
 AutoCloseFD openFile(const Path & path)
 {
     auto fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
@@ -129,10 +156,33 @@ AutoCloseFD openFile(const Path & path)
     return fd;
 }
 
+struct BinaryCacheStore::PreparedNar
+{
+    Path tempFile;
+    AutoDelete autoDelete;
+    ref<NarInfo> narInfo;
+    std::shared_ptr<FSAccessor> narAccessor;
+    uint64_t compressionTimeMs;
+    /* The compressed chunks of a chunked NAR (see `NarInfo::chunks`). */
+    std::vector<Path> chunkFiles;
+};
+
 ref<const ValidPathInfo> BinaryCacheStore::addToStoreCommon(
     Source & narSource, RepairFlag repair, CheckSigsFlag checkSigs,
     std::function<ValidPathInfo(HashResult)> mkInfo)
 {
+    auto nar = prepareNar(narSource, mkInfo);
+    checkReferences(*nar->narInfo);
+    uploadNar(*nar, repair);
+    return finishNar(*nar);
+}
+
+std::unique_ptr<BinaryCacheStore::PreparedNar> BinaryCacheStore::prepareNar(
+    Source & narSource,
+    std::function<ValidPathInfo(HashResult)> mkInfo)
+{
+    if (writeNarChunks) return prepareChunkedNar(narSource, mkInfo);
+
     auto [fdTemp, fnTemp] = createTempFile();
 
     AutoDelete autoDelete(fnTemp);
@@ -141,7 +191,12 @@ ref<const ValidPathInfo> BinaryCacheStore::addToStoreCommon(
 
     /* Read the NAR simultaneously into a CompressionSink+FileSink (to
        write the compressed NAR to disk), into a HashSink (to get the
-       NAR hash), and into a NarAccessor (to get the NAR listing). */
+       NAR hash), and into a NarAccessor (to get the NAR listing). All
+       of this happens in a single pass over the NAR, and the NAR
+       itself is never held in memory. Compression is usually the
+       most expensive part, so unless there is nothing to compress it
+       runs on a separate thread, overlapping with the hashing and
+       parsing of the NAR. */
     HashSink fileHashSink { htSHA256 };
     std::shared_ptr<FSAccessor> narAccessor;
     HashSink narHashSink { htSHA256 };
@@ -149,9 +204,13 @@ ref<const ValidPathInfo> BinaryCacheStore::addToStoreCommon(
     FdSink fileSink(fdTemp.get());
     TeeSink teeSinkCompressed { fileSink, fileHashSink };
     auto compressionSink = makeCompressionSink(compression, teeSinkCompressed, parallelCompression, compressionLevel);
-    TeeSink teeSinkUncompressed { *compressionSink, narHashSink };
+    std::optional<AsyncSink> asyncSink;
+    if (compression != "none")
+        asyncSink.emplace(*compressionSink);
+    TeeSink teeSinkUncompressed { asyncSink ? (Sink &) *asyncSink : *compressionSink, narHashSink };
     TeeSource teeSource { narSource, teeSinkUncompressed };
     narAccessor = makeNarAccessor(teeSource);
+    if (asyncSink) asyncSink->finish();
     compressionSink->finish();
     fileSink.flush();
     }
@@ -165,13 +224,7 @@ ref<const ValidPathInfo> BinaryCacheStore::addToStoreCommon(
     narInfo->fileHash = fileHash;
     narInfo->fileSize = fileSize;
     narInfo->url = "nar/" + narInfo->fileHash->to_string(HashFormat::Base32, false) + ".nar"
-        + (compression == "xz" ? ".xz" :
-           compression == "bzip2" ? ".bz2" :
-           compression == "zstd" ? ".zst" :
-           compression == "lzip" ? ".lzip" :
-           compression == "lz4" ? ".lz4" :
-           compression == "br" ? ".br" :
-           "");
+        + compressionExtension(compression);
 
     auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(now2 - now1).count();
     printMsg(lvlTalkative, "copying path '%1%' (%2% bytes, compressed %3$.1f%% in %4% ms) to binary cache",
@@ -179,6 +232,88 @@ ref<const ValidPathInfo> BinaryCacheStore::addToStoreCommon(
         ((1.0 - (double) fileSize / info.narSize) * 100.0),
         duration);
 
+    auto nar = std::unique_ptr<PreparedNar>(new PreparedNar {
+        .tempFile = fnTemp,
+        .narInfo = narInfo,
+        .narAccessor = narAccessor,
+        .compressionTimeMs = (uint64_t) duration,
+    });
+
+    /* The temporary file now belongs to `nar`. */
+    nar->autoDelete.reset(fnTemp, false);
+    autoDelete.cancel();
+
+    return nar;
+}
+
+std::unique_ptr<BinaryCacheStore::PreparedNar> BinaryCacheStore::prepareChunkedNar(
+    Source & narSource,
+    std::function<ValidPathInfo(HashResult)> mkInfo)
+{
+    auto tempDir = createTempDir();
+
+    AutoDelete autoDelete(tempDir, true);
+
+    auto now1 = std::chrono::steady_clock::now();
+
+    /* As in prepareNar(), but split the NAR into chunks, and compress
+       each of them into a separate file. */
+    std::vector<Hash> chunks;
+    std::vector<Path> chunkFiles;
+    uint64_t fileSize = 0;
+
+    ChunkingSink chunkingSink([&](std::string_view chunk) {
+        chunks.push_back(hashString(htSHA256, chunk));
+        auto compressed = compress(compression, chunk, parallelCompression, compressionLevel);
+        fileSize += compressed.size();
+        auto chunkFile = tempDir + "/" + std::to_string(chunkFiles.size());
+        writeFile(chunkFile, compressed);
+        chunkFiles.push_back(chunkFile);
+    });
+
+    std::shared_ptr<FSAccessor> narAccessor;
+    HashSink narHashSink { htSHA256 };
+    {
+    std::optional<AsyncSink> asyncSink;
+    if (compression != "none")
+        asyncSink.emplace(chunkingSink);
+    TeeSink teeSinkUncompressed { asyncSink ? (Sink &) *asyncSink : chunkingSink, narHashSink };
+    TeeSource teeSource { narSource, teeSinkUncompressed };
+    narAccessor = makeNarAccessor(teeSource);
+    if (asyncSink) asyncSink->finish();
+    chunkingSink.finish();
+    }
+
+    auto now2 = std::chrono::steady_clock::now();
+
+    auto info = mkInfo(narHashSink.finish());
+    auto narInfo = make_ref<NarInfo>(info);
+    narInfo->compression = compression;
+    narInfo->fileSize = fileSize;
+    narInfo->chunks = std::move(chunks);
+
+    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(now2 - now1).count();
+    printMsg(lvlTalkative, "copying path '%1%' (%2% bytes in %3% chunks, compressed %4$.1f%% in %5% ms) to binary cache",
+        printStorePath(narInfo->path), info.narSize, narInfo->chunks.size(),
+        ((1.0 - (double) fileSize / info.narSize) * 100.0),
+        duration);
+
+    auto nar = std::unique_ptr<PreparedNar>(new PreparedNar {
+        .tempFile = tempDir,
+        .narInfo = narInfo,
+        .narAccessor = narAccessor,
+        .compressionTimeMs = (uint64_t) duration,
+        .chunkFiles = std::move(chunkFiles),
+    });
+
+    nar->autoDelete.reset(tempDir, true);
+    autoDelete.cancel();
+
+    return nar;
+}
+
+void BinaryCacheStore::checkReferences(const ValidPathInfo & info)
+{
     /* Verify that all references are valid. This may do some .narinfo
        reads, but typically they'll already be cached. */
     for (auto & ref : info.references)
@@ -189,6 +324,12 @@ ref<const ValidPathInfo> BinaryCacheStore::addToStoreCommon(
             throw Error("cannot add '%s' to the binary cache because the reference '%s' is not valid",
                 printStorePath(info.path), printStorePath(ref));
         }
+}
+
+void BinaryCacheStore::uploadNar(PreparedNar & nar, RepairFlag repair)
+{
+    auto & narInfo = nar.narInfo;
+    auto & narAccessor = nar.narAccessor;
 
     /* Optionally write a JSON file containing a listing of the
        contents of the NAR. */
@@ -198,13 +339,14 @@ ref<const ValidPathInfo> BinaryCacheStore::addToStoreCommon(
             {"root", listNar(ref<FSAccessor>(narAccessor), "", true)},
         };
 
-        upsertFile(std::string(info.path.hashPart()) + ".ls", j.dump(), "application/json");
+        upsertFile(std::string(narInfo->path.hashPart()) + ".ls", j.dump(), "application/json");
     }
 
     /* Optionally maintain an index of DWARF debug info files
        consisting of JSON files named 'debuginfo/<build-id>' that
-       specify the NAR file and member containing the debug info. */
-    if (writeDebugInfo) {
+       specify the NAR file and member containing the debug info. A
+       chunked NAR has no file to refer to. */
+    if (writeDebugInfo && narInfo->chunks.empty()) {
 
         std::string buildIdDir = "/lib/debug/.build-id";
 
@@ -258,18 +400,42 @@ ref<const ValidPathInfo> BinaryCacheStore::addToStoreCommon(
         }
     }
 
+    /* Upload the chunks that the binary cache doesn't have yet. */
+    if (!narInfo->chunks.empty()) {
+        uint64_t chunksWritten = 0;
+        for (size_t i = 0; i < narInfo->chunks.size(); ++i) {
+            auto key = chunkKey(narInfo->chunks[i], compression);
+            if (repair || !fileExists(key)) {
+                upsertFile(key,
+                    std::make_shared<std::fstream>(nar.chunkFiles[i], std::ios_base::in | std::ios_base::binary),
+                    "application/x-nix-nar-chunk");
+                chunksWritten++;
+            }
+        }
+        debug("uploaded %d of %d chunks of '%s'", chunksWritten, narInfo->chunks.size(), printStorePath(narInfo->path));
+        if (chunksWritten) stats.narWrite++; else stats.narWriteAverted++;
+        /* Approximate, since some chunks may have been there already. */
+        if (chunksWritten) metrics().bytesUploaded += narInfo->fileSize;
+    }
+
     /* Atomically write the NAR file. */
-    if (repair || !fileExists(narInfo->url)) {
+    else if (repair || !fileExists(narInfo->url)) {
         stats.narWrite++;
         upsertFile(narInfo->url,
-            std::make_shared<std::fstream>(fnTemp, std::ios_base::in | std::ios_base::binary),
+            std::make_shared<std::fstream>(nar.tempFile, std::ios_base::in | std::ios_base::binary),
             "application/x-nix-nar");
+        metrics().bytesUploaded += narInfo->fileSize;
     } else
         stats.narWriteAverted++;
 
-    stats.narWriteBytes += info.narSize;
-    stats.narWriteCompressedBytes += fileSize;
-    stats.narWriteCompressionTimeMs += duration;
+    stats.narWriteBytes += narInfo->narSize;
+    stats.narWriteCompressedBytes += narInfo->fileSize;
+    stats.narWriteCompressionTimeMs += nar.compressionTimeMs;
+}
+
+ref<const ValidPathInfo> BinaryCacheStore::finishNar(PreparedNar & nar)
+{
+    auto & narInfo = nar.narInfo;
 
     /* Atomically write the NAR info file.*/
     if (secretKey) narInfo->sign(*this, *secretKey);
@@ -299,6 +465,303 @@ void BinaryCacheStore::addToStore(const ValidPathInfo & info, Source & narSource
     }});
 }
 
+void BinaryCacheStore::addMultipleToStore(
+    PathsSource & pathsToCopy,
+    Activity & act,
+    RepairFlag repair,
+    CheckSigsFlag checkSigs)
+{
+    /* Unlike Store::addMultipleToStore(), don't wait for the
+       references of a path to be added before compressing and
+       uploading it. Only writing the .narinfo, which makes the path
+       valid, has to wait for that. */
+
+    size_t nrCompressors = compressionJobs
+        ? compressionJobs.get()
+        : std::max(1U, std::thread::hardware_concurrency());
+    size_t nrUploaders = std::max(1U, uploadJobs.get());
+
+    /* The maximum number of compressed NARs (i.e. temporary files)
+       waiting to be uploaded. */
+    size_t maxQueued = 2 * nrUploaders;
+
+    struct Item
+    {
+        std::unique_ptr<Source> source;
+        std::unique_ptr<PreparedNar> nar;
+        /* The references that are being added but aren't valid yet. */
+        StorePathSet waitingFor;
+        bool uploaded = false;
+        bool failed = false;
+    };
+
+    struct State
+    {
+        std::map<StorePath, Item> items;
+        std::map<StorePath, StorePathSet> referrers;
+        std::vector<StorePath> order;
+        size_t nextToCompress = 0;
+        std::list<StorePath> toUpload;
+        /* The number of NARs being compressed or waiting to be uploaded. */
+        size_t queued = 0;
+        size_t left = 0;
+        uint64_t nrDone = 0, nrRunning = 0, nrFailed = 0;
+        std::exception_ptr ex;
+    };
+
+    Sync<State> state_;
+    std::condition_variable wakeup;
+    std::atomic<bool> quit{false};
+
+    uint64_t bytesExpected = 0;
+
+    {
+        auto state(state_.lock());
+        for (auto & [info, source] : pathsToCopy) {
+            auto [i, inserted] = state->items.insert_or_assign(info.path, Item { .source = std::move(source) });
+            if (!inserted) continue;
+            state->order.push_back(info.path);
+            bytesExpected += info.narSize;
+        }
+        for (auto & [info, _] : pathsToCopy)
+            for (auto & ref : info.references)
+                if (ref != info.path && state->items.count(ref)) {
+                    state->items.at(info.path).waitingFor.insert(ref);
+                    state->referrers[ref].insert(info.path);
+                }
+        state->left = state->order.size();
+    }
+
+    std::map<StorePath, const ValidPathInfo *> infos;
+    for (auto & [info, _] : pathsToCopy)
+        infos.insert_or_assign(info.path, &info);
+
+    act.setExpected(actCopyPath, bytesExpected);
+
+    auto showProgress = [&](State & state) {
+        act.progress(state.nrDone, state.order.size(), state.nrRunning, state.nrFailed);
+    };
+
+    /* With --keep-going, mark a path and everything that refers to
+       it as failed. Otherwise, stop. */
+    auto fail = [&](State & state, const StorePath & path, std::exception_ptr ex) {
+        if (settings.keepGoing && !quit) {
+            try {
+                std::rethrow_exception(ex);
+            } catch (Error & e) {
+                printMsg(lvlError, "could not copy %s: %s", printStorePath(path), e.what());
+                std::vector<StorePath> todo{path};
+                while (!todo.empty()) {
+                    auto p = std::move(todo.back());
+                    todo.pop_back();
+                    auto & item = state.items.at(p);
+                    if (item.failed) continue;
+                    /* Its NAR, if any, is freed by the thread that
+                       is using it. */
+                    item.failed = true;
+                    state.nrFailed++;
+                    state.left--;
+                    for (auto & referrer : state.referrers[p])
+                        todo.push_back(referrer);
+                }
+                showProgress(state);
+                wakeup.notify_all();
+                return;
+            } catch (...) {
+            }
+        }
+        if (!state.ex) state.ex = ex;
+        quit = true;
+        wakeup.notify_all();
+    };
+
+    /* Write the .narinfo of a path that has been uploaded and whose
+       references are valid, and then of any referrers that become
+       ready to be written. */
+    auto finish = [&](const StorePath & path) {
+        std::vector<StorePath> ready{path};
+        while (!ready.empty() && !quit) {
+            auto p = std::move(ready.back());
+            ready.pop_back();
+
+            PreparedNar * nar;
+            {
+                auto state(state_.lock());
+                auto & item = state->items.at(p);
+                if (item.failed) continue;
+                nar = item.nar.get();
+            }
+
+            std::exception_ptr ex;
+            if (nar) {
+                try {
+                    checkReferences(*nar->narInfo);
+                    finishNar(*nar);
+                } catch (...) {
+                    ex = std::current_exception();
+                }
+            }
+
+            auto state(state_.lock());
+            state->items.at(p).nar.reset();
+            if (ex) {
+                fail(*state, p, ex);
+                continue;
+            }
+            state->nrDone++;
+            state->left--;
+            for (auto & referrer : state->referrers[p]) {
+                auto & item = state->items.at(referrer);
+                item.waitingFor.erase(p);
+                if (item.waitingFor.empty() && item.uploaded && !item.failed)
+                    ready.push_back(referrer);
+            }
+            showProgress(*state);
+            wakeup.notify_all();
+        }
+    };
+
+    auto markUploaded = [&](const StorePath & path) {
+        bool ready;
+        {
+            auto state(state_.lock());
+            auto & item = state->items.at(path);
+            item.uploaded = true;
+            ready = item.waitingFor.empty() && !item.failed;
+        }
+        if (ready) finish(path);
+    };
+
+    auto compressor = [&]() {
+        interruptCheck = [&]() { return (bool) quit; };
+
+        while (true) {
+            StorePath path = StorePath::dummy;
+            std::unique_ptr<Source> source;
+            {
+                auto state(state_.lock());
+                while (!quit && state->nextToCompress < state->order.size() && state->queued >= maxQueued)
+                    state.wait(wakeup);
+                if (quit || state->nextToCompress == state->order.size()) return;
+                path = state->order[state->nextToCompress++];
+                auto & item = state->items.at(path);
+                /* Make sure that the Source object is destroyed when
+                   we're done (see Store::addMultipleToStore()). */
+                source = std::move(item.source);
+                if (item.failed) continue;
+                state->queued++;
+                state->nrRunning++;
+                showProgress(*state);
+            }
+
+            try {
+                std::unique_ptr<PreparedNar> nar;
+                auto & info = *infos.at(path);
+                if (repair || !isValidPath(info.path))
+                    nar = prepareNar(*source, [&](HashResult) {
+                        auto info2 = info;
+                        info2.ultimate = false;
+                        return info2;
+                    });
+                source.reset();
+
+                auto state(state_.lock());
+                auto & item = state->items.at(path);
+                if (nar && !item.failed) {
+                    item.nar = std::move(nar);
+                    state->toUpload.push_back(path);
+                    wakeup.notify_all();
+                    continue;
+                }
+                state->queued--;
+                state->nrRunning--;
+            } catch (...) {
+                auto state(state_.lock());
+                state->queued--;
+                state->nrRunning--;
+                fail(*state, path, std::current_exception());
+                continue;
+            }
+
+            /* The path is already valid. */
+            markUploaded(path);
+        }
+    };
+
+    auto uploader = [&]() {
+        interruptCheck = [&]() { return (bool) quit; };
+
+        while (true) {
+            StorePath path = StorePath::dummy;
+            PreparedNar * nar;
+            {
+                auto state(state_.lock());
+                while (!quit && state->toUpload.empty())
+                    state.wait(wakeup);
+                if (quit) return;
+                path = state->toUpload.front();
+                state->toUpload.pop_front();
+                auto & item = state->items.at(path);
+                if (item.failed) {
+                    item.nar.reset();
+                    state->queued--;
+                    state->nrRunning--;
+                    wakeup.notify_all();
+                    continue;
+                }
+                nar = item.nar.get();
+            }
+
+            try {
+                uploadNar(*nar, repair);
+            } catch (...) {
+                auto state(state_.lock());
+                state->items.at(path).nar.reset();
+                state->queued--;
+                state->nrRunning--;
+                fail(*state, path, std::current_exception());
+                continue;
+            }
+
+            {
+                auto state(state_.lock());
+                state->queued--;
+                state->nrRunning--;
+                wakeup.notify_all();
+                auto & item = state->items.at(path);
+                if (item.failed) {
+                    item.nar.reset();
+                    continue;
+                }
+            }
+
+            markUploaded(path);
+        }
+    };
+
+    std::vector<std::thread> threads;
+
+    Finally joinThreads([&]() {
+        quit = true;
+        wakeup.notify_all();
+        for (auto & thread : threads)
+            thread.join();
+    });
+
+    for (size_t n = 0; n < nrCompressors; ++n)
+        threads.emplace_back(compressor);
+    for (size_t n = 0; n < nrUploaders; ++n)
+        threads.emplace_back(uploader);
+
+    while (true) {
+        checkInterrupt();
+        auto state(state_.lock());
+        if (state->ex) std::rethrow_exception(state->ex);
+        if (!state->left) break;
+        state.wait_for(wakeup, std::chrono::milliseconds(100));
+    }
+}
+
 StorePath BinaryCacheStore::addToStoreFromDump(Source & dump, std::string_view name,
     FileIngestionMethod method, HashType hashAlgo, RepairFlag repair, const StorePathSet & references)
 {
@@ -345,26 +808,383 @@ std::optional<StorePath> BinaryCacheStore::queryPathFromHashPart(const std::stri
 
 void BinaryCacheStore::narFromPath(const StorePath & storePath, Sink & sink)
 {
+    TraceSpan span("store", "narFromPath %s", storePath.to_string());
     auto info = queryPathInfo(storePath).cast<const NarInfo>();
 
+    if (!info->chunks.empty()) {
+        narFromChunks(*info, sink);
+        return;
+    }
+
     LengthSink narSize;
     TeeSink tee { sink, narSize };
 
     auto decompressor = makeDecompressionSink(info->compression, tee);
 
+    LengthSink fileSize;
+    TeeSink teeCompressed { *decompressor, fileSize };
+
+    auto now1 = std::chrono::steady_clock::now();
+
     try {
-        getFile(info->url, *decompressor);
+        if (downloadConnections > 1 && info->fileSize >= parallelDownloadThreshold)
+            getFileInParallel(info->url, info->fileSize, teeCompressed);
+        else
+            getFile(info->url, teeCompressed);
     } catch (NoSuchBinaryCacheFile & e) {
         throw SubstituteGone(std::move(e.info()));
     }
 
     decompressor->finish();
 
+    auto now2 = std::chrono::steady_clock::now();
+
+    /* Small NARs say more about latency than about throughput. */
+    if (diskCache && fileSize.length >= 1024 * 1024)
+        diskCache->recordDownload(getUri(), fileSize.length,
+            std::chrono::duration_cast<std::chrono::milliseconds>(now2 - now1));
+
     stats.narRead++;
-    //stats.narReadCompressedBytes += nar->size(); // FIXME
+    stats.narReadCompressedBytes += fileSize.length;
     stats.narReadBytes += narSize.length;
 }
 
+/* Remove the least recently used chunks from the local chunk cache
+   until it is no bigger than `maxSize`. */
+static void evictChunkCache(const Path & cacheDir, uint64_t maxSize)
+{
+    /* If another process is already cleaning up the cache, leave it
+       to that process. */
+    auto lockFd = openLockFile(cacheDir + "/.lock", true);
+    if (!lockFile(lockFd.get(), ltWrite, false)) return;
+
+    std::vector<std::tuple<time_t, uint64_t, std::string>> chunks;
+    uint64_t totalSize = 0;
+
+    for (auto & i : readDirectory(cacheDir)) {
+        if (hasPrefix(i.name, ".") || i.name.find(".tmp-") != std::string::npos) continue;
+        struct stat st;
+        if (lstat((cacheDir + "/" + i.name).c_str(), &st) == -1) continue;
+        chunks.emplace_back(st.st_mtime, st.st_size, i.name);
+        totalSize += st.st_size;
+    }
+
+    if (totalSize <= maxSize) return;
+
+    std::sort(chunks.begin(), chunks.end());
+
+    for (auto & [lastUsed, size, name] : chunks) {
+        if (totalSize <= maxSize) break;
+        auto path = cacheDir + "/" + name;
+        if (unlink(path.c_str()) == -1 && errno != ENOENT)
+            debug("cannot remove '%s': %s", path, strerror(errno));
+        totalSize -= size;
+    }
+}
+
+void BinaryCacheStore::narFromChunks(const NarInfo & info, Sink & sink)
+{
+    std::optional<Path> cacheDir;
+    if (localChunkCacheSize) {
+        cacheDir = localChunkCache.get() != "" ? localChunkCache.get() : getCacheDir() + "/nix/nar-chunks";
+        createDirs(*cacheDir);
+    }
+
+    auto cacheFile = [&](const Hash & hash) {
+        return *cacheDir + "/" + hash.to_string(HashFormat::Base32, false);
+    };
+
+    /* Get a chunk from the local cache, if it's there and intact. */
+    auto getLocal = [&](const Hash & hash) -> std::optional<std::string> {
+        if (!cacheDir) return std::nullopt;
+        auto path = cacheFile(hash);
+        try {
+            auto data = readFile(path);
+            if (hashString(htSHA256, data) == hash) {
+                /* Use the modification time as the time of last
+                   use. */
+                utimes(path.c_str(), nullptr);
+                return data;
+            }
+            warn("removing corrupt NAR chunk '%s'", path);
+            unlink(path.c_str());
+        } catch (SysError & e) {
+            if (e.errNo != ENOENT) throw;
+        }
+        return std::nullopt;
+    };
+
+    static std::atomic<uint64_t> tempCounter{0};
+
+    auto putLocal = [&](const Hash & hash, std::string_view data) {
+        auto path = cacheFile(hash);
+        auto tmp = fmt("%s.tmp-%d-%d", path, getpid(), tempCounter++);
+        writeFile(tmp, data);
+        if (rename(tmp.c_str(), path.c_str()) == -1)
+            throw SysError("renaming '%s' to '%s'", tmp, path);
+    };
+
+    /* Fetch the chunks that aren't in the local cache, a few at a
+       time, but pass them to `sink` in order. */
+    struct Chunk
+    {
+        std::optional<std::string> data;
+        std::future<std::optional<std::string>> download;
+    };
+
+    std::list<Chunk> window;
+    size_t maxWindow = std::max(4U, downloadConnections.get());
+    size_t nextChunk = 0;
+
+    auto startChunk = [&]() {
+        auto & hash = info.chunks[nextChunk++];
+        Chunk chunk { .data = getLocal(hash) };
+        if (!chunk.data) {
+            auto promise = std::make_shared<std::promise<std::optional<std::string>>>();
+            chunk.download = promise->get_future();
+            getFile(chunkKey(hash, info.compression),
+                {[promise](std::future<std::optional<std::string>> result) {
+                    try {
+                        promise->set_value(result.get());
+                    } catch (...) {
+                        promise->set_exception(std::current_exception());
+                    }
+                }});
+        }
+        window.push_back(std::move(chunk));
+    };
+
+    uint64_t narSize = 0, downloadedSize = 0;
+    size_t chunksDownloaded = 0;
+
+    for (auto & hash : info.chunks) {
+        while (nextChunk < info.chunks.size() && window.size() < maxWindow)
+            startChunk();
+
+        auto chunk = std::move(window.front());
+        window.pop_front();
+
+        if (!chunk.data) {
+            auto compressed = chunk.download.get();
+            if (!compressed)
+                throw SubstituteGone("chunk '%s' of '%s' does not exist in binary cache '%s'",
+                    hash.to_string(HashFormat::Base32, false), printStorePath(info.path), getUri());
+            downloadedSize += compressed->size();
+            chunksDownloaded++;
+            chunk.data = decompress(info.compression, *compressed);
+            if (hashString(htSHA256, *chunk.data) != hash)
+                throw Error("chunk '%s' of '%s' in binary cache '%s' is corrupt",
+                    hash.to_string(HashFormat::Base32, false), printStorePath(info.path), getUri());
+            if (cacheDir) putLocal(hash, *chunk.data);
+        }
+
+        narSize += chunk.data->size();
+        sink(*chunk.data);
+    }
+
+    debug("fetched %d of %d chunks of '%s' from '%s'",
+        chunksDownloaded, info.chunks.size(), printStorePath(info.path), getUri());
+
+    if (cacheDir && chunksDownloaded)
+        evictChunkCache(*cacheDir, localChunkCacheSize);
+
+    stats.narRead++;
+    stats.narReadCompressedBytes += downloadedSize;
+    stats.narReadBytes += narSize;
+}
+
+void BinaryCacheStore::narFromPathDelta(const StorePath & storePath, Sink & sink, Store & localStore)
+{
+    auto info = queryPathInfo(storePath).cast<const NarInfo>();
+
+    if (useNarDeltas && info->deltaBase && &localStore != this && localStore.storeDir == storeDir) {
+        /* Get the base and the delta before writing anything to
+           `sink`, so that we can still fall back to the full NAR. */
+        std::optional<std::string> baseNar;
+        StringSink delta;
+        LengthSink deltaSize;
+        try {
+            if (localStore.isValidPath(*info->deltaBase)
+                && localStore.queryPathInfo(*info->deltaBase)->narHash == info->deltaBaseNarHash)
+            {
+                StringSink base;
+                localStore.narFromPath(*info->deltaBase, base);
+                auto decompressor = makeDecompressionSink(info->deltaCompression, delta);
+                TeeSink teeCompressed { *decompressor, deltaSize };
+                getFile(info->deltaUrl, teeCompressed);
+                decompressor->finish();
+                baseNar = std::move(base.s);
+            }
+        } catch (Error & e) {
+            warn("cannot use the delta of '%s' from '%s', fetching the entire NAR: %s",
+                printStorePath(storePath), getUri(), e.msg());
+        }
+
+        if (baseNar) {
+            debug("reconstructing '%s' from '%s' using a %d-byte delta",
+                printStorePath(storePath), printStorePath(*info->deltaBase), deltaSize.length);
+
+            LengthSink narSize;
+            TeeSink tee { sink, narSize };
+            StringSource source(delta.s);
+            applyDelta(*baseNar, source, tee);
+
+            stats.narRead++;
+            stats.narReadCompressedBytes += deltaSize.length;
+            stats.narReadBytes += narSize.length;
+            return;
+        }
+    }
+
+    narFromPath(storePath, sink);
+}
+
+bool BinaryCacheStore::addNarDelta(const StorePath & storePath, const StorePath & base, Store & srcStore)
+{
+    auto info = queryPathInfo(storePath).cast<const NarInfo>();
+    auto baseInfo = srcStore.queryPathInfo(base);
+
+    StringSink baseNar, nar;
+    srcStore.narFromPath(base, baseNar);
+    srcStore.narFromPath(storePath, nar);
+
+    if (hashString(info->narHash.type, nar.s) != info->narHash)
+        throw Error("path '%s' in '%s' differs from the one in '%s'",
+            printStorePath(storePath), srcStore.getUri(), getUri());
+
+    StringSink delta;
+    computeDelta(baseNar.s, nar.s, delta);
+    auto compressed = compress(compression, delta.s, parallelCompression, compressionLevel);
+
+    if (info->fileSize && compressed.size() >= info->fileSize) {
+        debug("not adding a delta for '%s' against '%s', since it is not smaller than the NAR",
+            printStorePath(storePath), printStorePath(base));
+        return false;
+    }
+
+    auto narInfo = make_ref<NarInfo>(*info);
+    narInfo->deltaBase = base;
+    narInfo->deltaBaseNarHash = baseInfo->narHash;
+    narInfo->deltaCompression = compression;
+    narInfo->deltaSize = compressed.size();
+    narInfo->deltaUrl = "delta/" + hashString(htSHA256, compressed).to_string(HashFormat::Base32, false) + ".ndelta"
+        + compressionExtension(compression);
+
+    upsertFile(narInfo->deltaUrl, std::move(compressed), "application/x-nix-delta");
+
+    writeNarInfo(narInfo);
+
+    return true;
+}
+
+void BinaryCacheStore::getFileInParallel(const std::string & path, uint64_t size, Sink & sink)
+{
+    const uint64_t chunkSize = 16 * 1024 * 1024;
+
+    auto nrChunks = (size + chunkSize - 1) / chunkSize;
+
+    /* Fetch the first part by itself, to find out whether the binary
+       cache supports range requests. */
+    auto first = getFileRange(path, 0, std::min(chunkSize, size));
+    if (!first) {
+        debug("binary cache '%s' doesn't support range requests, downloading '%s' over a single connection",
+            getUri(), path);
+        getFile(path, sink);
+        return;
+    }
+    sink(*first);
+    first.reset();
+
+    if (nrChunks <= 1) return;
+
+    struct State
+    {
+        /* The next part to fetch. */
+        uint64_t nextFetch = 1;
+        /* The next part to write to the sink. */
+        uint64_t nextWrite = 1;
+        std::map<uint64_t, std::string> fetched;
+        std::exception_ptr exc;
+        bool quit = false;
+    };
+
+    Sync<State> state_;
+
+    std::condition_variable wakeup;
+
+    auto nrThreads = std::min((uint64_t) downloadConnections, nrChunks - 1);
+
+    /* Limit how far the fetchers can get ahead of the sink, to bound
+       memory use. */
+    auto maxAhead = 2 * nrThreads;
+
+    auto act = getCurActivity();
+
+    auto fetcher = [&]() {
+        PushActivity pact(act);
+        try {
+            while (true) {
+                uint64_t chunk;
+                {
+                    auto state(state_.lock());
+                    while (!state->quit
+                        && state->nextFetch < nrChunks
+                        && state->nextFetch >= state->nextWrite + maxAhead)
+                        state.wait(wakeup);
+                    if (state->quit || state->nextFetch >= nrChunks) return;
+                    chunk = state->nextFetch++;
+                }
+
+                auto offset = chunk * chunkSize;
+                auto data = getFileRange(path, offset, std::min(chunkSize, size - offset));
+                if (!data)
+                    throw Error("binary cache '%s' did not return the requested part of '%s'", getUri(), path);
+
+                auto state(state_.lock());
+                state->fetched.emplace(chunk, std::move(*data));
+                wakeup.notify_all();
+            }
+        } catch (...) {
+            auto state(state_.lock());
+            if (!state->exc) state->exc = std::current_exception();
+            state->quit = true;
+            wakeup.notify_all();
+        }
+    };
+
+    std::vector<std::thread> threads;
+
+    Finally joinThreads([&]() {
+        state_.lock()->quit = true;
+        wakeup.notify_all();
+        for (auto & thread : threads)
+            thread.join();
+    });
+
+    for (uint64_t n = 0; n < nrThreads; ++n)
+        threads.emplace_back(fetcher);
+
+    /* Write the parts to the sink in order. */
+    while (true) {
+        std::string data;
+        {
+            auto state(state_.lock());
+            if (state->nextWrite == nrChunks) break;
+            while (!state->exc && !state->fetched.count(state->nextWrite)) {
+                checkInterrupt();
+                state.wait_for(wakeup, std::chrono::milliseconds(100));
+            }
+            if (state->exc) std::rethrow_exception(state->exc);
+            auto i = state->fetched.find(state->nextWrite);
+            data = std::move(i->second);
+            state->fetched.erase(i);
+            state->nextWrite++;
+            wakeup.notify_all();
+        }
+        sink(data);
+    }
+}
+
 void BinaryCacheStore::queryPathInfoUncached(const StorePath & storePath,
     Callback<std::shared_ptr<const ValidPathInfo>> callback) noexcept
 {
@@ -378,10 +1198,24 @@ void BinaryCacheStore::queryPathInfoUncached(const StorePath & storePath,
 
     auto callbackPtr = std::make_shared<decltype(callback)>(std::move(callback));
 
+    auto start = std::chrono::steady_clock::now();
+
     getFile(narInfoFile,
         {[=,this](std::future<std::optional<std::string>> fut) {
             try {
-                auto data = fut.get();
+                std::optional<std::string> data;
+                try {
+                    data = fut.get();
+                } catch (...) {
+                    if (diskCache) diskCache->recordRequest(uri, {}, true);
+                    throw;
+                }
+
+                if (diskCache)
+                    diskCache->recordRequest(uri,
+                        std::chrono::duration_cast<std::chrono::milliseconds>(
+                            std::chrono::steady_clock::now() - start),
+                        false);
 
                 if (!data) return (*callbackPtr)({});
 
@@ -410,24 +1244,34 @@ StorePath BinaryCacheStore::addToStore(
        non-recursive+sha256 so we can just use the default
        implementation of this method in terms of addToStoreFromDump. */
 
-    HashSink sink { hashAlgo };
-    if (method == FileIngestionMethod::Recursive) {
-        dumpPath(srcPath, sink, filter);
-    } else {
-        readFile(srcPath, sink);
+    /* For recursive SHA-256 hashing, the content hash is the NAR
+       hash, which addToStoreCommon() computes anyway, so we only
+       need to read the path once. */
+    std::optional<Hash> h;
+    if (method != FileIngestionMethod::Recursive || hashAlgo != htSHA256) {
+        HashSink sink { hashAlgo };
+        if (method == FileIngestionMethod::Recursive) {
+            dumpPath(srcPath, sink, filter);
+        } else {
+            readFile(srcPath, sink);
+        }
+        h = sink.finish().first;
     }
-    auto h = sink.finish().first;
 
+    /* As in Store::addToStore(), read the files on a separate thread
+       unless a custom filter might call the evaluator. */
     auto source = sinkToSource([&](Sink & sink) {
         dumpPath(srcPath, sink, filter);
-    });
+    }, []() {
+        throw EndOfFile("coroutine has finished");
+    }, &filter == &defaultPathFilter ? SinkToSourceMode::Thread : SinkToSourceMode::Coroutine);
     return addToStoreCommon(*source, repair, CheckSigs, [&](HashResult nar) {
         ValidPathInfo info {
             *this,
             name,
             FixedOutputInfo {
                 .method = method,
-                .hash = h,
+                .hash = h ? *h : nar.first,
                 .references = {
                     .others = references,
                     // caller is not capable of creating a self-reference, because this is content-addressed without modulus
@@ -503,9 +1347,83 @@ void BinaryCacheStore::registerDrvOutput(const Realisation& info) {
     upsertFile(filePath, info.toJSON().dump(), "application/json");
 }
 
+std::shared_ptr<FSAccessor> BinaryCacheStore::getLazyNarAccessor(const StorePath & storePath)
+{
+    auto info = queryPathInfo(storePath).cast<const NarInfo>();
+
+    bool seekable = info->compression == "zstd-seekable" && info->fileSize;
+    if (info->compression != "none" && !seekable) return nullptr;
+
+    auto listing = getFile(std::string(storePath.hashPart()) + ".ls");
+    if (!listing) return nullptr;
+
+    auto j = nlohmann::json::parse(*listing, nullptr, false);
+    if (!j.is_object() || j.value("version", 0) != 1 || !j.contains("root")) return nullptr;
+
+    auto store = ref<BinaryCacheStore>(std::dynamic_pointer_cast<BinaryCacheStore>(shared_from_this()));
+    auto url = info->url;
+
+    auto getRange = [store, url](uint64_t offset, uint64_t length) {
+        auto data = store->getFileRange(url, offset, length);
+        if (!data || data->size() != length)
+            throw Error("unable to fetch %d bytes at offset %d of '%s' from '%s'",
+                length, offset, url, store->getUri());
+        return std::move(*data);
+    };
+
+    if (!seekable) {
+        /* Check that we can actually fetch parts of the NAR. */
+        auto magic = getFileRange(url, 0, 8);
+        if (!magic || magic->size() != 8) return nullptr;
+
+        return makeLazyNarAccessor(j["root"].dump(),
+            [store, getRange](uint64_t offset, uint64_t length) -> std::string {
+                if (!length) return "";
+                store->stats.narReadBytes += length;
+                return getRange(offset, length);
+            }).get_ptr();
+    }
+
+    /* Get the seek table at the end of the file, which tells us
+       where each frame starts. */
+    auto fileSize = info->fileSize;
+    if (fileSize < seekableZstdFooterSize) return nullptr;
+    auto footer = getFileRange(url, fileSize - seekableZstdFooterSize, seekableZstdFooterSize);
+    if (!footer || footer->size() != seekableZstdFooterSize) return nullptr;
+    auto tableSize = parseSeekableZstdFooter(*footer);
+    if (tableSize > fileSize) return nullptr;
+    auto frames = parseSeekableZstdTable(getRange(fileSize - tableSize, tableSize));
+
+    return makeLazyNarAccessor(j["root"].dump(),
+        [store, getRange, frames{std::move(frames)}](uint64_t offset, uint64_t length) -> std::string {
+            if (!length) return "";
+
+            /* Find the frames containing the first and last byte. */
+            auto findFrame = [&](uint64_t pos) {
+                auto i = std::upper_bound(frames.begin(), frames.end(), pos,
+                    [](uint64_t pos, const SeekableZstdFrame & frame) { return pos < frame.decompressedOffset; });
+                if (i == frames.begin())
+                    throw Error("invalid NAR offset %d", pos);
+                return std::prev(i);
+            };
+            auto first = findFrame(offset);
+            auto last = findFrame(offset + length - 1);
+
+            auto data = decompress("zstd", getRange(first->compressedOffset,
+                    last->compressedOffset + last->compressedSize - first->compressedOffset));
+
+            store->stats.narReadBytes += data.size();
+
+            if (offset - first->decompressedOffset + length > data.size())
+                throw Error("NAR offset %d is beyond the end of the NAR", offset + length);
+
+            return data.substr(offset - first->decompressedOffset, length);
+        }).get_ptr();
+}
+
 ref<FSAccessor> BinaryCacheStore::getFSAccessor()
 {
-    return make_ref<RemoteFSAccessor>(ref<Store>(shared_from_this()), localNarCache);
+    return make_ref<RemoteFSAccessor>(ref<Store>(shared_from_this()), localNarCache, localNarCacheSize);
 }
 
 void BinaryCacheStore::addSignatures(const StorePath & storePath, const StringSet & sigs)
@@ -18,7 +18,14 @@ struct BinaryCacheStoreConfig : virtual StoreConfig
     using StoreConfig::StoreConfig;
 
     const Setting<std::string> compression{this, "xz", "compression",
-        "NAR compression method (`xz`, `bzip2`, `gzip`, `zstd`, or `none`)."};
+        R"(
+          NAR compression method (`xz`, `bzip2`, `gzip`, `zstd`,
+          `zstd-seekable`, or `none`). `zstd-seekable` compresses NARs
+          as a series of independently compressed zstd frames with an
+          index, so that together with `write-nar-listing`, individual
+          files can be read from a NAR without fetching all of it.
+          These NARs can be decompressed by any zstd decompressor.
+        )"};
 
     const Setting<bool> writeNARListing{this, false, "write-nar-listing",
         "Whether to write a JSON file that lists the files in each NAR."};
@@ -32,9 +39,65 @@ struct BinaryCacheStoreConfig : virtual StoreConfig
     const Setting<Path> secretKeyFile{this, "", "secret-key",
         "Path to the secret key used to sign the binary cache."};
 
+    const Setting<unsigned int> compressionJobs{this, 0, "compression-jobs",
+        R"(
+          When copying several paths to this binary cache, the maximum
+          number of NARs to compress at the same time. 0 means the number
+          of CPU cores.
+        )"};
+
+    const Setting<unsigned int> uploadJobs{this, 4, "upload-jobs",
+        R"(
+          When copying several paths to this binary cache, the maximum
+          number of compressed NARs to upload at the same time. At most
+          twice as many compressed NARs are kept waiting for an upload
+          slot; compression pauses when that limit is reached.
+        )"};
+
+    const Setting<bool> writeNarChunks{this, false, "write-nar-chunks",
+        R"(
+          Whether to store NARs as content-defined chunks of about half
+          a megabyte, rather than as a single file. Chunks are shared
+          between NARs, so a NAR that differs only slightly from one
+          already in the binary cache takes little extra space, and
+          clients only download the chunks that they don't have in
+          their `local-chunk-cache`.
+
+          Versions of Nix before 2.19 cannot substitute paths stored
+          this way.
+        )"};
+
+    const Setting<Path> localChunkCache{this, "", "local-chunk-cache",
+        R"(
+          The directory in which to keep NAR chunks fetched from
+          binary caches that use `write-nar-chunks`. Defaults to
+          `$XDG_CACHE_HOME/nix/nar-chunks`.
+        )"};
+
+    const Setting<uint64_t> localChunkCacheSize{this, 1024 * 1024 * 1024, "local-chunk-cache-size",
+        R"(
+          The maximum size in bytes of the `local-chunk-cache`. When it
+          grows beyond this size, the least recently used chunks are
+          removed. 0 disables the chunk cache.
+        )"};
+
+    const Setting<bool> useNarDeltas{this, true, "use-nar-deltas",
+        R"(
+          Whether to fetch a binary delta instead of the full NAR of a
+          path, if the binary cache has one against a path that is
+          already valid in the destination store.
+        )"};
+
     const Setting<Path> localNarCache{this, "", "local-nar-cache",
         "Path to a local cache of NARs fetched from this binary cache, used by commands such as `nix store cat`."};
 
+    const Setting<uint64_t> localNarCacheSize{this, 0, "local-nar-cache-size",
+        R"(
+          The maximum size in bytes of the `local-nar-cache`, or 0 for
+          no limit. When the cache grows beyond this size, the least
+          recently used NARs are removed from it.
+        )"};
+
     const Setting<bool> parallelCompression{this, false, "parallel-compression",
         "Enable multi-threaded compression of NARs. This is currently only available for `xz` and `zstd`."};
 
@@ -44,6 +107,19 @@ struct BinaryCacheStoreConfig : virtual StoreConfig
           The meaning and accepted values depend on the compression method selected.
           `-1` specifies that the default compression level should be used.
         )"};
+
+    const Setting<unsigned int> downloadConnections{this, 1, "download-connections",
+        R"(
+          The number of connections used to download a single NAR that
+          is at least `parallel-download-threshold` bytes in size. If
+          greater than 1, the NAR is fetched in parts using range
+          requests, which can be much faster on high-latency links.
+          Binary caches that don't support range requests are
+          downloaded over a single connection.
+        )"};
+
+    const Setting<uint64_t> parallelDownloadThreshold{this, 64 * 1024 * 1024, "parallel-download-threshold",
+        "The minimum size in bytes of a (compressed) NAR to download over multiple connections, if `download-connections` is greater than 1."};
 };
 
 
@@ -95,6 +171,26 @@ public:
 
     std::optional<std::string> getFile(const std::string & path);
 
+    /**
+     * Fetch `length` bytes of the specified file, starting at
+     * `offset`. Returns nothing if this store doesn't support
+     * fetching part of a file.
+     */
+    virtual std::optional<std::string> getFileRange(
+        const std::string & path, uint64_t offset, uint64_t length)
+    {
+        return std::nullopt;
+    }
+
+    /**
+     * Return an accessor for the NAR of `storePath` that only fetches
+     * the files that are actually read, using the listing written by
+     * `write-nar-listing`. Returns nothing if the NAR is compressed
+     * (other than with `zstd-seekable`), there is no listing, or the
+     * store doesn't support fetching part of a file.
+     */
+    std::shared_ptr<FSAccessor> getLazyNarAccessor(const StorePath & storePath);
+
 public:
 
     virtual void init() override;
@@ -111,6 +207,31 @@ private:
         Source & narSource, RepairFlag repair, CheckSigsFlag checkSigs,
         std::function<ValidPathInfo(HashResult)> mkInfo);
 
+    /**
+     * A compressed NAR in a temporary file, ready to be uploaded.
+     */
+    struct PreparedNar;
+
+    /**
+     * The stages of adding a path: compress the NAR into a temporary
+     * file, upload it (and its listing), and finally make the path
+     * valid by writing its `.narinfo`, which requires its references
+     * to be valid (see `checkReferences()`).
+     */
+    std::unique_ptr<PreparedNar> prepareNar(
+        Source & narSource,
+        std::function<ValidPathInfo(HashResult)> mkInfo);
+
+    std::unique_ptr<PreparedNar> prepareChunkedNar(
+        Source & narSource,
+        std::function<ValidPathInfo(HashResult)> mkInfo);
+
+    void checkReferences(const ValidPathInfo & info);
+
+    void uploadNar(PreparedNar & nar, RepairFlag repair);
+
+    ref<const ValidPathInfo> finishNar(PreparedNar & nar);
+
 public:
 
     bool isValidPathUncached(const StorePath & path) override;
@@ -123,6 +244,19 @@ public:
     void addToStore(const ValidPathInfo & info, Source & narSource,
         RepairFlag repair, CheckSigsFlag checkSigs) override;
 
+    using Store::addMultipleToStore;
+
+    /**
+     * Add several paths, compressing some NARs while uploading
+     * others. Only the `.narinfo` files are written in dependency
+     * order.
+     */
+    void addMultipleToStore(
+        PathsSource & pathsToCopy,
+        Activity & act,
+        RepairFlag repair,
+        CheckSigsFlag checkSigs) override;
+
     StorePath addToStoreFromDump(Source & dump, std::string_view name,
         FileIngestionMethod method, HashType hashAlgo, RepairFlag repair, const StorePathSet & references) override;
 
@@ -148,6 +282,33 @@ public:
 
     void narFromPath(const StorePath & path, Sink & sink) override;
 
+    void narFromPathDelta(const StorePath & path, Sink & sink, Store & localStore) override;
+
+    /**
+     * Upload a delta that turns the NAR of `base` into the NAR of
+     * `path`, and add it to the `.narinfo` of `path`, which must
+     * already be in this binary cache. Both NARs are read from
+     * `srcStore`. Returns false (and uploads nothing) if the
+     * compressed delta isn't smaller than the compressed NAR.
+     */
+    bool addNarDelta(const StorePath & path, const StorePath & base, Store & srcStore);
+
+private:
+
+    /**
+     * Write the NAR consisting of `info.chunks` to `sink`, using the
+     * local chunk cache.
+     */
+    void narFromChunks(const NarInfo & info, Sink & sink);
+
+    /**
+     * Write the file `path`, which is `size` bytes long, to `sink`,
+     * fetching parts of it over several connections in parallel.
+     */
+    void getFileInParallel(const std::string & path, uint64_t size, Sink & sink);
+
+public:
+
     ref<FSAccessor> getFSAccessor() override;
 
     void addSignatures(const StorePath & storePath, const StringSet & sigs) override;
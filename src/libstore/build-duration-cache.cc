@@ -0,0 +1,113 @@
+#include "build-duration-cache.hh"
+#include "names.hh"
+#include "sqlite.hh"
+#include "sync.hh"
+#include "util.hh"
+
+namespace nix {
+
+static const char * schema = R"sql(
+
+create table if not exists BuildStats (
+    name       text not null,
+    system     text not null,
+    duration   integer not null, -- in seconds
+    peakMemory integer, -- in bytes
+    outputSize integer, -- in bytes
+    timestamp  integer not null,
+    primary key (name, system)
+);
+
+)sql";
+
+class BuildDurationCacheImpl : public BuildDurationCache
+{
+public:
+
+    /* The weight of a new sample in the estimates. */
+    const double sampleWeight = 0.5;
+
+    struct State
+    {
+        SQLite db;
+        SQLiteStmt queryStats, upsertStats;
+    };
+
+    Sync<State> _state;
+
+    BuildDurationCacheImpl(Path dbPath = getCacheDir() + "/nix/build-stats-v1.sqlite")
+    {
+        auto state(_state.lock());
+
+        createDirs(dirOf(dbPath));
+
+        state->db = SQLite(dbPath);
+
+        state->db.isCache();
+
+        state->db.exec(schema);
+
+        state->queryStats.create(state->db,
+            "select duration, peakMemory, outputSize from BuildStats where name = ? and system = ?");
+
+        state->upsertStats.create(state->db,
+            "insert or replace into BuildStats(name, system, duration, peakMemory, outputSize, timestamp) values (?, ?, ?, ?, ?, ?)");
+    }
+
+    std::optional<BuildStats> lookup(State & state, std::string_view name, std::string_view system)
+    {
+        auto query(state.queryStats.use()(name)(system));
+        if (!query.next()) return std::nullopt;
+        BuildStats stats{.duration = (uint64_t) query.getInt(0)};
+        if (!query.isNull(1)) stats.peakMemory = query.getInt(1);
+        if (!query.isNull(2)) stats.outputSize = query.getInt(2);
+        return stats;
+    }
+
+    std::optional<BuildStats> lookup(std::string_view name, std::string_view system) override
+    {
+        return retrySQLite<std::optional<BuildStats>>([&]() {
+            auto state(_state.lock());
+            return lookup(*state, DrvName(name).name, system);
+        });
+    }
+
+    uint64_t average(uint64_t sample, std::optional<uint64_t> old)
+    {
+        return old ? sampleWeight * sample + (1 - sampleWeight) * *old : sample;
+    }
+
+    void record(std::string_view name, std::string_view system, const BuildStats & stats) override
+    {
+        retrySQLite<void>([&]() {
+            auto state(_state.lock());
+            auto pname = DrvName(name).name;
+            auto old = lookup(*state, pname, system);
+            auto peakMemory = old ? old->peakMemory : std::nullopt;
+            if (stats.peakMemory) peakMemory = average(*stats.peakMemory, peakMemory);
+            auto outputSize = old ? old->outputSize : std::nullopt;
+            if (stats.outputSize) outputSize = average(*stats.outputSize, outputSize);
+            state->upsertStats.use()
+                (pname)
+                (system)
+                ((int64_t) average(stats.duration, old ? std::optional(old->duration) : std::nullopt))
+                ((int64_t) peakMemory.value_or(0), (bool) peakMemory)
+                ((int64_t) outputSize.value_or(0), (bool) outputSize)
+                (time(0))
+                .exec();
+        });
+    }
+};
+
+ref<BuildDurationCache> getBuildDurationCache()
+{
+    static ref<BuildDurationCache> cache = make_ref<BuildDurationCacheImpl>();
+    return cache;
+}
+
+ref<BuildDurationCache> getTestBuildDurationCache(Path dbPath)
+{
+    return make_ref<BuildDurationCacheImpl>(dbPath);
+}
+
+}
@@ -0,0 +1,63 @@
+#pragma once
+///@file
+
+#include "ref.hh"
+#include "types.hh"
+
+#include <optional>
+
+namespace nix {
+
+/**
+ * Statistics about building a derivation.
+ */
+struct BuildStats
+{
+    /**
+     * How long the build took, in seconds.
+     */
+    uint64_t duration;
+
+    /**
+     * The peak memory usage of the build's processes in bytes, if
+     * known (i.e. if the build ran in a cgroup).
+     */
+    std::optional<uint64_t> peakMemory;
+
+    /**
+     * The total NAR size of the outputs in bytes, if known.
+     */
+    std::optional<uint64_t> outputSize;
+};
+
+/**
+ * A per-user cache of statistics about previous builds, used to
+ * estimate how long a build will take and how much memory it
+ * needs. Derivations are identified by their name without the
+ * version and by their system type, so that the estimate carries over
+ * to new versions of a package.
+ */
+class BuildDurationCache
+{
+public:
+
+    virtual ~BuildDurationCache() { }
+
+    /**
+     * @return The estimated statistics of building a derivation, or
+     * nothing if it hasn't been built before.
+     */
+    virtual std::optional<BuildStats> lookup(std::string_view name, std::string_view system) = 0;
+
+    /**
+     * Record the statistics of a build. They are averaged with the
+     * previous estimate.
+     */
+    virtual void record(std::string_view name, std::string_view system, const BuildStats & stats) = 0;
+};
+
+ref<BuildDurationCache> getBuildDurationCache();
+
+ref<BuildDurationCache> getTestBuildDurationCache(Path dbPath);
+
+}
@@ -13,6 +13,9 @@ GENERATE_CMP_EXT(
     me->startTime,
     me->stopTime,
     me->cpuUser,
-    me->cpuSystem);
+    me->cpuSystem,
+    me->peakMemory,
+    me->bytesRead,
+    me->bytesWritten);
 
 }
@@ -101,6 +101,16 @@ struct BuildResult
      */
     std::optional<std::chrono::microseconds> cpuUser, cpuSystem;
 
+    /**
+     * The peak memory usage of the build in bytes.
+     */
+    std::optional<uint64_t> peakMemory;
+
+    /**
+     * The number of bytes the build read from and wrote to disk.
+     */
+    std::optional<uint64_t> bytesRead, bytesWritten;
+
     DECLARE_CMP(BuildResult);
 
     bool success()
@@ -8,6 +8,7 @@
 #include "util.hh"
 #include "archive.hh"
 #include "compression.hh"
+#include "thread-pipe.hh"
 #include "common-protocol.hh"
 #include "common-protocol-impl.hh"
 #include "topo-sort.hh"
@@ -237,9 +238,11 @@ void DerivationGoal::haveDerivation()
         return;
     }
 
+    StorePathSet outputPaths;
     for (auto & i : drv->outputsAndOptPaths(worker.store))
         if (i.second.second)
-            worker.store.addTempRoot(*i.second.second);
+            outputPaths.insert(*i.second.second);
+    worker.store.addTempRoots(outputPaths);
 
     auto outputHashes = staticOutputHashes(worker.evalStore, *drv);
     for (auto & [outputName, outputHash] : outputHashes)
@@ -649,8 +652,10 @@ void DerivationGoal::started()
         "building '%s'", worker.store.printStorePath(drvPath));
     fmt("building '%s'", worker.store.printStorePath(drvPath));
     if (hook) msg += fmt(" on '%s'", machineName);
+    auto & previous = previousBuild();
     act = std::make_unique<Activity>(*logger, lvlInfo, actBuild, msg,
-        Logger::Fields{worker.store.printStorePath(drvPath), hook ? machineName : "", 1, 1});
+        Logger::Fields{worker.store.printStorePath(drvPath), hook ? machineName : "", 1, 1,
+            previous ? previous->duration : 0});
     mcRunningBuilds = std::make_unique<MaintainCount<uint64_t>>(worker.runningBuilds);
     worker.updateProgress();
 }
@@ -821,12 +826,15 @@ void replaceValidPath(const Path & storePath, const Path & tmpPath)
 
 int DerivationGoal::getChildStatus()
 {
+    if (hookDone) return 0;
     return hook->pid.kill();
 }
 
 
 void DerivationGoal::closeReadPipes()
 {
+    /* A persistent hook keeps its pipes for the next build. */
+    if (hookDone) return;
     hook->builderOut.readSide = -1;
     hook->fromHook.readSide = -1;
 }
@@ -924,6 +932,11 @@ void DerivationGoal::buildDone()
 {
     trace("build done");
 
+    Finally releaseHook([&]() {
+        if (hook && hookDone)
+            worker.idleHooks.push_back(std::move(hook));
+    });
+
     Finally releaseBuildUser([&](){ this->cleanupHookFinally(); });
 
     cleanupPreChildKill();
@@ -996,6 +1009,8 @@ void DerivationGoal::buildDone()
            being valid. */
         auto builtOutputs = registerOutputs();
 
+        recordBuildStats(builtOutputs);
+
         StorePathSet outputPaths;
         for (auto & [_, output] : builtOutputs)
             outputPaths.insert(output.outPath);
@@ -1113,15 +1128,20 @@ HookReply DerivationGoal::tryBuildHook()
 {
     if (!worker.tryBuildHook || !useDerivation) return rpDecline;
 
-    if (!worker.hook)
-        worker.hook = std::make_unique<HookInstance>();
+    if (!worker.hook) {
+        if (!worker.idleHooks.empty()) {
+            worker.hook = std::move(worker.idleHooks.front());
+            worker.idleHooks.pop_front();
+        } else
+            worker.hook = std::make_unique<HookInstance>();
+    }
 
     try {
 
         /* Send the request to the hook. */
         worker.hook->sink
             << "try"
-            << (worker.getNrLocalBuilds() < settings.maxBuildJobs ? 1 : 0)
+            << (worker.getNrLocalBuilds() < settings.maxBuildJobs && worker.admitBuild(requiredMemory()) ? 1 : 0)
             << drv->platform
             << worker.store.printStorePath(drvPath)
             << parsedDrv->getRequiredSystemFeatures();
@@ -1158,6 +1178,7 @@ HookReply DerivationGoal::tryBuildHook()
         else if (reply == "decline-permanently") {
             worker.tryBuildHook = false;
             worker.hook = 0;
+            worker.idleHooks.clear();
             return rpDecline;
         }
         else if (reply == "postpone")
@@ -1203,8 +1224,13 @@ HookReply DerivationGoal::tryBuildHook()
         CommonProto::write(worker.store, conn, missingOutputs);
     }
 
-    hook->sink = FdSink();
-    hook->toHook.writeSide = -1;
+    /* A persistent hook reads its next request from the same pipe. */
+    if (settings.persistentBuildHook)
+        hook->sink.flush();
+    else {
+        hook->sink = FdSink();
+        hook->toHook.writeSide = -1;
+    }
 
     /* Create the log file and pipe. */
     Path logFile = openLogFile();
@@ -1247,17 +1273,22 @@ Path DerivationGoal::openLogFile()
     Path dir = fmt("%s/%s/%s/", logDir, LocalFSStore::drvsLogDir, baseName.substr(0, 2));
     createDirs(dir);
 
+    auto compression = settings.buildLogCompression.get();
+
     Path logFileName = fmt("%s/%s%s", dir, baseName.substr(2),
-        settings.compressLog ? ".bz2" : "");
+        settings.compressLog ? LocalFSStore::logExtension(compression) : "");
 
     fdLogFile = open(logFileName.c_str(), O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0666);
     if (!fdLogFile) throw SysError("creating log file '%1%'", logFileName);
 
     logFileSink = std::make_shared<FdSink>(fdLogFile.get());
 
-    if (settings.compressLog)
-        logSink = std::shared_ptr<CompressionSink>(makeCompressionSink("bzip2", *logFileSink));
-    else
+    if (settings.compressLog) {
+        /* Compress and write the log on a separate thread, so that
+           a chatty builder isn't slowed down by the compression. */
+        logCompressionSink = std::shared_ptr<CompressionSink>(makeCompressionSink(compression, *logFileSink));
+        logSink = std::make_shared<AsyncSink>(*logCompressionSink, 16 * 1024 * 1024);
+    } else
         logSink = logFileSink;
 
     return logFileName;
@@ -1266,10 +1297,12 @@ Path DerivationGoal::openLogFile()
 
 void DerivationGoal::closeLogFile()
 {
-    auto logSink2 = std::dynamic_pointer_cast<CompressionSink>(logSink);
+    auto logSink2 = std::dynamic_pointer_cast<AsyncSink>(logSink);
     if (logSink2) logSink2->finish();
+    if (logCompressionSink) logCompressionSink->finish();
     if (logFileSink) logFileSink->flush();
     logSink = logFileSink = 0;
+    logCompressionSink = 0;
     fdLogFile = -1;
 }
 
@@ -1312,6 +1345,20 @@ void DerivationGoal::handleChildOutput(int fd, std::string_view data)
     if (hook && fd == hook->fromHook.readSide.get()) {
         for (auto c : data)
             if (c == '\n') {
+                if (currentHookLine == "# done") {
+                    /* A persistent hook has finished the build. Pick
+                       up the builder output that's still in the pipe,
+                       since we won't get an EOF on it. */
+                    currentHookLine.clear();
+                    auto builderFd = hook->builderOut.readSide.get();
+                    StringSink rest;
+                    drainFD(builderFd, rest, false);
+                    if (!rest.s.empty()) handleChildOutput(builderFd, rest.s);
+                    if (!hook) return;
+                    hookDone = true;
+                    handleEOF(fd);
+                    return;
+                }
                 auto json = parseJSONMessage(currentHookLine);
                 if (json) {
                     auto s = handleJSONLogMessage(*json, worker.act, hook->activities, true);
@@ -1538,4 +1585,61 @@ void DerivationGoal::waiteeDone(GoalPtr waitee, ExitCode result)
     }
 }
 
+
+uint64_t DerivationGoal::requiredMemory()
+{
+    auto s = parsedDrv->getStringAttr("requiredMemory");
+    if (!s) {
+        auto & previous = previousBuild();
+        return previous ? previous->peakMemory.value_or(0) : 0;
+    }
+    if (auto n = string2Int<uint64_t>(*s)) return *n;
+    throw Error("derivation '%s' has an invalid 'requiredMemory' attribute '%s'",
+        worker.store.printStorePath(drvPath), *s);
+}
+
+
+const std::optional<BuildStats> & DerivationGoal::previousBuild()
+{
+    if (!previousBuildLooked && drv) {
+        try {
+            previousBuild_ = getBuildDurationCache()->lookup(drv->name, drv->platform);
+        } catch (...) {
+            ignoreException(lvlDebug);
+        }
+        previousBuildLooked = true;
+    }
+
+    return previousBuild_;
+}
+
+
+uint64_t DerivationGoal::estimatedDuration()
+{
+    /* The duration of builds that we don't know anything about. */
+    const uint64_t defaultDuration = 60;
+
+    auto & previous = previousBuild();
+    return previous ? previous->duration : defaultDuration;
+}
+
+
+void DerivationGoal::recordBuildStats(const SingleDrvOutputs & builtOutputs)
+{
+    if (!settings.criticalPathScheduling || !buildResult.startTime) return;
+
+    try {
+        BuildStats stats{
+            .duration = (uint64_t) std::max<time_t>(1, buildResult.stopTime - buildResult.startTime),
+            .peakMemory = buildResult.peakMemory,
+            .outputSize = 0,
+        };
+        for (auto & [_, output] : builtOutputs)
+            *stats.outputSize += worker.store.queryPathInfo(output.outPath)->narSize;
+        getBuildDurationCache()->record(drv->name, drv->platform, stats);
+    } catch (...) {
+        ignoreException(lvlDebug);
+    }
+}
+
 }
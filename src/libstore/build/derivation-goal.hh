@@ -7,11 +7,14 @@
 #include "store-api.hh"
 #include "pathlocks.hh"
 #include "goal.hh"
+#include "build-duration-cache.hh"
 
 namespace nix {
 
 using std::map;
 
+struct CompressionSink;
+
 struct HookInstance;
 
 typedef enum {rpAccept, rpDecline, rpPostpone} HookReply;
@@ -162,6 +165,7 @@ struct DerivationGoal : public Goal
      */
     AutoCloseFD fdLogFile;
     std::shared_ptr<BufferedSink> logFileSink, logSink;
+    std::shared_ptr<CompressionSink> logCompressionSink;
 
     /**
      * Number of bytes received from the builder's stdout/stderr.
@@ -183,6 +187,13 @@ struct DerivationGoal : public Goal
      */
     std::unique_ptr<HookInstance> hook;
 
+    /**
+     * Set when a persistent build hook has reported that the build
+     * succeeded. The hook is then given back to the worker instead of
+     * being killed.
+     */
+    bool hookDone = false;
+
     /**
      * The sort of derivation we are building.
      */
@@ -249,6 +260,13 @@ struct DerivationGoal : public Goal
      */
     HookReply tryBuildHook();
 
+    /**
+     * @return The memory in bytes that the derivation declares it
+     * needs to build with its `requiredMemory` attribute, or
+     * otherwise the peak memory usage of its previous build, or 0.
+     */
+    uint64_t requiredMemory();
+
     virtual int getChildStatus();
 
     /**
@@ -339,6 +357,27 @@ struct DerivationGoal : public Goal
     JobCategory jobCategory() const override {
         return JobCategory::Build;
     };
+
+    uint64_t estimatedDuration() override;
+
+private:
+
+    /**
+     * Cache for `previousBuild()`.
+     */
+    std::optional<BuildStats> previousBuild_;
+    bool previousBuildLooked = false;
+
+    /**
+     * @return The statistics of previous builds of derivations with
+     * the same name and system, if any.
+     */
+    const std::optional<BuildStats> & previousBuild();
+
+    /**
+     * Record the statistics of the build for `previousBuild()`.
+     */
+    void recordBuildStats(const SingleDrvOutputs & builtOutputs);
 };
 
 MakeError(NotDeterministic, BuildError);
@@ -20,12 +20,60 @@ DrvOutputSubstitutionGoal::DrvOutputSubstitutionGoal(
 }
 
 
+void DrvOutputSubstitutionGoal::prefetch(Worker & worker,
+    const std::vector<std::shared_ptr<DrvOutputSubstitutionGoal>> & goals)
+{
+    std::map<DrvOutput, std::shared_ptr<DrvOutputSubstitutionGoal>> pending;
+    for (auto & goal : goals)
+        if (!goal->prefetched) {
+            goal->prefetched = Prefetched {};
+            pending.insert_or_assign(goal->id, goal);
+        }
+
+    auto wanted = [&]() {
+        std::set<DrvOutput> ids;
+        for (auto & [id, _] : pending) ids.insert(id);
+        return ids;
+    };
+
+    for (auto & [id, _] : worker.store.queryRealisations(wanted())) {
+        pending.at(id)->prefetched->local = true;
+        pending.erase(id);
+    }
+
+    if (!settings.useSubstitutes) return;
+
+    /* Ask the substituters in order of priority, each about the
+       outputs that the previous ones don't have. */
+    for (auto & sub : getDefaultSubstituters()) {
+        if (pending.empty()) break;
+        try {
+            auto found = sub->queryRealisations(wanted());
+            for (auto i = pending.begin(); i != pending.end(); ) {
+                auto j = found.find(i->first);
+                if (j != found.end()) {
+                    i->second->prefetched->subs.insert_or_assign(&*sub, j->second.get_ptr());
+                    i = pending.erase(i);
+                } else {
+                    i->second->prefetched->subs.insert_or_assign(&*sub, nullptr);
+                    ++i;
+                }
+            }
+        } catch (Error & e) {
+            /* The goals will ask this substituter themselves and
+               report the error. */
+            debug("cannot look up realisations on '%s': %s", sub->getUri(), e.what());
+        }
+    }
+}
+
+
 void DrvOutputSubstitutionGoal::init()
 {
     trace("init");
 
     /* If the derivation already exists, we’re done */
-    if (worker.store.queryRealisation(id)) {
+    if (prefetched ? prefetched->local : (bool) worker.store.queryRealisation(id)) {
         amDone(ecSuccess);
         return;
     }
@@ -59,8 +107,13 @@ void DrvOutputSubstitutionGoal::tryNext()
     sub = subs.front();
     subs.pop_front();
 
-    // FIXME: Make async
-    // outputInfo = sub->queryRealisation(id);
+    if (prefetched) {
+        auto i = prefetched->subs.find(&*sub);
+        if (i != prefetched->subs.end()) {
+            outputInfo = i->second;
+            return realisationKnown();
+        }
+    }
 
     /* The callback of the curl download below can outlive `this` (if
        some other error occurs), so it must not touch `this`. So put
@@ -95,21 +148,32 @@ void DrvOutputSubstitutionGoal::realisationFetched()
         substituterFailed = true;
     }
 
+    realisationKnown();
+}
+
+void DrvOutputSubstitutionGoal::realisationKnown()
+{
     if (!outputInfo) {
         return tryNext();
     }
 
+    std::set<DrvOutput> depIds;
+    for (const auto & [depId, _] : outputInfo->dependentRealisations)
+        if (depId != id) depIds.insert(depId);
+
+    auto localOutputInfos = worker.store.queryRealisations(depIds);
+
     for (const auto & [depId, depPath] : outputInfo->dependentRealisations) {
         if (depId != id) {
-            if (auto localOutputInfo = worker.store.queryRealisation(depId);
-                localOutputInfo && localOutputInfo->outPath != depPath) {
+            if (auto localOutputInfo = localOutputInfos.find(depId);
+                localOutputInfo != localOutputInfos.end() && localOutputInfo->second->outPath != depPath) {
                 warn(
                     "substituter '%s' has an incompatible realisation for '%s', ignoring.\n"
                     "Local:  %s\n"
                     "Remote: %s",
                     sub->getUri(),
                     depId.to_string(),
-                    worker.store.printStorePath(localOutputInfo->outPath),
+                    worker.store.printStorePath(localOutputInfo->second->outPath),
                     worker.store.printStorePath(depPath)
                 );
                 tryNext();
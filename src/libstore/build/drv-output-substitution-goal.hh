@@ -54,15 +54,45 @@ class DrvOutputSubstitutionGoal : public Goal {
      */
     bool substituterFailed = false;
 
+    /**
+     * Realisations of `id` looked up in advance by `prefetch()`.
+     */
+    struct Prefetched
+    {
+        /**
+         * Whether the local store already has a realisation.
+         */
+        bool local = false;
+
+        /**
+         * The answer of each substituter that was asked, `nullptr`
+         * if it has no realisation.
+         */
+        std::map<const Store *, std::shared_ptr<const Realisation>> subs;
+    };
+
+    std::optional<Prefetched> prefetched;
+
 public:
     DrvOutputSubstitutionGoal(const DrvOutput& id, Worker & worker, RepairFlag repair = NoRepair, std::optional<ContentAddress> ca = std::nullopt);
 
     typedef void (DrvOutputSubstitutionGoal::*GoalState)();
     GoalState state;
 
+    /**
+     * Look up the realisations wanted by `goals`, which haven't
+     * started yet, with one query to the local store and to each
+     * substituter instead of one per goal. This resolves the
+     * outputs that become wanted together, e.g. the dependencies of
+     * a realisation, a level at a time.
+     */
+    static void prefetch(Worker & worker,
+        const std::vector<std::shared_ptr<DrvOutputSubstitutionGoal>> & goals);
+
     void init();
     void tryNext();
     void realisationFetched();
+    void realisationKnown();
     void outPathValid();
     void finished();
 
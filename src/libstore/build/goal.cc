@@ -1,5 +1,7 @@
 #include "goal.hh"
 #include "worker.hh"
+#include "metrics.hh"
+#include "tracing.hh"
 
 namespace nix {
 
@@ -83,6 +85,14 @@ void Goal::amDone(ExitCode result, std::optional<Error> ex)
     assert(result == ecSuccess || result == ecFailed || result == ecNoSubstituters || result == ecIncompleteClosure);
     exitCode = result;
 
+    if (result == ecSuccess)
+        metrics().goalsSucceeded++;
+    else
+        metrics().goalsFailed++;
+
+    if (tracingEnabled)
+        traceAsync("goal", name, (uint64_t) this, startTime, std::chrono::steady_clock::now());
+
     if (ex) {
         if (!waiters.empty())
             logError(ex->info());
@@ -98,6 +98,11 @@ struct Goal : public std::enable_shared_from_this<Goal>
      */
     ExitCode exitCode = ecBusy;
 
+    /**
+     * When the goal was created, for its trace span.
+     */
+    const std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+
 protected:
     /**
      * Build result.
@@ -173,6 +178,18 @@ public:
      * @see JobCategory
      */
     virtual JobCategory jobCategory() const = 0;
+
+    /**
+     * @brief Hint for the scheduler: the estimated time in seconds
+     * this goal will spend in its build slot.
+     */
+    virtual uint64_t estimatedDuration() { return 0; }
+
+    /**
+     * @brief Hint for the scheduler: the memory in bytes that this
+     * goal is expected to use in addition to what it's using now.
+     */
+    virtual uint64_t memoryReservation() { return 0; }
 };
 
 void addToWeakGoals(WeakGoals & goals, GoalPtr p);
@@ -16,6 +16,8 @@
 #include "cgroup.hh"
 #include "personality.hh"
 #include "namespaces.hh"
+#include "sync.hh"
+#include "thread-pool.hh"
 
 #include <regex>
 #include <queue>
@@ -154,6 +156,9 @@ void LocalDerivationGoal::killSandbox(bool getStats)
         if (getStats) {
             buildResult.cpuUser = stats.cpuUser;
             buildResult.cpuSystem = stats.cpuSystem;
+            buildResult.peakMemory = stats.memoryPeak;
+            buildResult.bytesRead = stats.ioRead;
+            buildResult.bytesWritten = stats.ioWrite;
         }
         #else
         abort();
@@ -168,6 +173,18 @@ void LocalDerivationGoal::killSandbox(bool getStats)
 }
 
 
+uint64_t LocalDerivationGoal::memoryReservation()
+{
+    auto required = requiredMemory();
+#if __linux__
+    if (cgroup)
+        if (auto usage = getCgroupMemoryUsage(*cgroup))
+            return required > *usage ? required - *usage : 0;
+#endif
+    return required;
+}
+
+
 void LocalDerivationGoal::tryLocalBuild()
 {
     unsigned int curBuilds = worker.getNrLocalBuilds();
@@ -178,6 +195,19 @@ void LocalDerivationGoal::tryLocalBuild()
         return;
     }
 
+    /* Wait until the system has the resources for another build. A
+       build finishing isn't the only thing that changes that, so
+       check again periodically. */
+    if (!worker.admitBuild(requiredMemory())) {
+        state = &DerivationGoal::tryToBuild;
+        if (!actLock)
+            actLock = std::make_unique<Activity>(*logger, lvlInfo, actBuildWaiting,
+                fmt("waiting for system resources to build '%s'", yellowtxt(worker.store.printStorePath(drvPath))));
+        worker.waitForAWhile(shared_from_this());
+        outputLocks.unlock();
+        return;
+    }
+
     assert(derivationType);
 
     /* Are we doing a chroot build? */
@@ -284,6 +314,75 @@ static void movePath(const Path & src, const Path & dst)
 extern void replaceValidPath(const Path & storePath, const Path & tmpPath);
 
 
+#if __linux__
+static void initLoopback()
+{
+    AutoCloseFD fd(socket(PF_INET, SOCK_DGRAM, IPPROTO_IP));
+    if (!fd) throw SysError("cannot open IP socket");
+
+    struct ifreq ifr;
+    strcpy(ifr.ifr_name, "lo");
+    ifr.ifr_flags = IFF_UP | IFF_LOOPBACK | IFF_RUNNING;
+    if (ioctl(fd.get(), SIOCSIFFLAGS, &ifr) == -1)
+        throw SysError("cannot set loopback interface flags");
+}
+
+
+/**
+ * Network namespaces that sandboxed builds have finished with, to be
+ * reused by later builds. See `sandbox-network-namespace-pool`.
+ */
+static Sync<std::vector<AutoCloseFD>> networkNamespacePool;
+
+
+static AutoCloseFD getNetworkNamespace()
+{
+    {
+        auto pool(networkNamespacePool.lock());
+        if (!pool->empty()) {
+            auto fd = std::move(pool->back());
+            pool->pop_back();
+            return fd;
+        }
+    }
+
+    /* Create a new network namespace with the loopback interface up
+       in a child process, and keep a reference to it after the child
+       is gone. */
+    Pipe ready;
+    ready.create();
+
+    Pid child = startProcess([&]() {
+        ready.readSide.close();
+        if (unshare(CLONE_NEWNET) == -1)
+            throw SysError("creating a network namespace");
+        initLoopback();
+        writeFull(ready.writeSide.get(), "1\n");
+        while (true) pause();
+    });
+
+    ready.writeSide.close();
+
+    if (readLine(ready.readSide.get()) != "1")
+        throw Error("unable to create a network namespace");
+
+    AutoCloseFD fd = open(fmt("/proc/%d/ns/net", (pid_t) child).c_str(), O_RDONLY | O_CLOEXEC);
+    if (!fd)
+        throw SysError("getting network namespace");
+
+    return fd;
+}
+
+
+static void releaseNetworkNamespace(AutoCloseFD && fd)
+{
+    auto pool(networkNamespacePool.lock());
+    if (pool->size() < settings.sandboxNetworkNamespacePool)
+        pool->push_back(std::move(fd));
+}
+#endif
+
+
 int LocalDerivationGoal::getChildStatus()
 {
     return hook ? DerivationGoal::getChildStatus() : pid.kill();
@@ -325,6 +424,13 @@ void LocalDerivationGoal::cleanupPostChildKill()
 
     /* Terminate the recursive Nix daemon. */
     stopDaemon();
+
+#if __linux__
+    /* Now that the builder is gone, its network namespace can be
+       used by another build. */
+    if (networkNamespace)
+        releaseNetworkNamespace(std::move(networkNamespace));
+#endif
 }
 
 
@@ -405,6 +511,31 @@ static void doBind(const Path & source, const Path & target, bool optional = fal
     if (mount(source.c_str(), target.c_str(), "", MS_BIND | MS_REC, 0) == -1)
         throw SysError("bind mount from '%1%' to '%2%' failed", source, target);
 };
+
+
+/* Make a store path that isn't a directory available at `target` by
+   hard-linking it, or copying it if it's a symlink. This is a lot
+   cheaper than a bind mount, and keeps the mount table of the sandbox
+   small. Return false if `source` is a directory or can't be
+   linked, e.g. because it's on another file system. */
+static bool linkIntoChroot(const Path & source, const Path & target)
+{
+    struct stat st;
+    if (lstat(source.c_str(), &st) == -1)
+        return false;
+    if (S_ISLNK(st.st_mode)) {
+        debug("copying symlink '%1%' to '%2%'", source, target);
+        createSymlink(readLink(source), target);
+        return true;
+    }
+    if (!S_ISREG(st.st_mode))
+        return false;
+    debug("hard-linking '%1%' to '%2%'", source, target);
+    if (link(source.c_str(), target.c_str()) == 0)
+        return true;
+    debug("cannot hard-link '%1%': %2%", source, strerror(errno));
+    return false;
+}
 #endif
 
 void LocalDerivationGoal::startBuilder()
@@ -697,8 +828,9 @@ void LocalDerivationGoal::startBuilder()
         /* Make the closure of the inputs available in the chroot,
            rather than the whole Nix store.  This prevents any access
            to undeclared dependencies.  Directories are bind-mounted,
-           while other inputs are hard-linked (since only directories
-           can be bind-mounted).  !!! As an extra security
+           while other inputs are hard-linked (which is cheaper, and
+           possible because the chroot is on the same file system as
+           the store).  !!! As an extra security
            precaution, make the fake Nix store only writable by the
            build user. */
         Path chrootStoreDir = chrootRootDir + worker.store.storeDir;
@@ -729,6 +861,15 @@ void LocalDerivationGoal::startBuilder()
                 pathsInChroot.erase(worker.store.printStorePath(*i.second.second));
         }
 
+        /* Hard-link the inputs that aren't directories into the
+           chroot here, since the builder can't create hard links to
+           files it doesn't own. It bind-mounts the rest. */
+        for (auto i = pathsInChroot.begin(); i != pathsInChroot.end(); )
+            if (worker.store.isStorePath(i->first) && linkIntoChroot(i->second.source, chrootRootDir + i->first))
+                i = pathsInChroot.erase(i);
+            else
+                ++i;
+
         if (cgroup) {
             if (mkdir(cgroup->c_str(), 0755) != 0)
                 throw SysError("creating cgroup '%s'", *cgroup);
@@ -895,6 +1036,13 @@ void LocalDerivationGoal::startBuilder()
         if (derivationType->isSandboxed())
             privateNetwork = true;
 
+        /* Reuse the network namespace of an earlier build if
+           enabled. Such a namespace belongs to the initial user
+           namespace, so only root can enter it, and builds don't
+           get to reconfigure it. */
+        if (privateNetwork && settings.sandboxNetworkNamespacePool && getuid() == 0)
+            networkNamespace = getNetworkNamespace();
+
         userNamespaceSync.create();
 
         usingUserNamespace = userNamespacesSupported();
@@ -919,9 +1067,12 @@ void LocalDerivationGoal::startBuilder()
                     throw Error("setgroups failed. Set the require-drop-supplementary-groups option to false to skip this step.");
             }
 
+            if (networkNamespace && setns(networkNamespace.get(), CLONE_NEWNET) == -1)
+                throw SysError("entering network namespace");
+
             ProcessOptions options;
             options.cloneFlags = CLONE_NEWPID | CLONE_NEWNS | CLONE_NEWIPC | CLONE_NEWUTS | CLONE_PARENT | SIGCHLD;
-            if (privateNetwork)
+            if (privateNetwork && !networkNamespace)
                 options.cloneFlags |= CLONE_NEWNET;
             if (usingUserNamespace)
                 options.cloneFlags |= CLONE_NEWUSER;
@@ -1721,18 +1872,10 @@ void LocalDerivationGoal::runChild()
 
             userNamespaceSync.readSide = -1;
 
-            if (privateNetwork) {
-
-                /* Initialise the loopback interface. */
-                AutoCloseFD fd(socket(PF_INET, SOCK_DGRAM, IPPROTO_IP));
-                if (!fd) throw SysError("cannot open IP socket");
-
-                struct ifreq ifr;
-                strcpy(ifr.ifr_name, "lo");
-                ifr.ifr_flags = IFF_UP | IFF_LOOPBACK | IFF_RUNNING;
-                if (ioctl(fd.get(), SIOCSIFFLAGS, &ifr) == -1)
-                    throw SysError("cannot set loopback interface flags");
-            }
+            /* Initialise the loopback interface, unless we're in a
+               reused network namespace, where it's already up. */
+            if (privateNetwork && !networkNamespace)
+                initLoopback();
 
             /* Set the hostname etc. to fixed values. */
             char hostname[] = "localhost";
@@ -2238,9 +2381,15 @@ SingleDrvOutputs LocalDerivationGoal::registerOutputs()
        name so we can also use it in rewrites. */
     StringSet outputsToSort;
     struct AlreadyRegistered { StorePath path; };
-    struct PerhapsNeedToRegister { StorePathSet refs; };
+    struct PerhapsNeedToRegister {
+        StorePathSet refs;
+        /* The NAR hash of the output as it was scanned, if it's
+           input-addressed. */
+        std::optional<HashResult> narHash;
+    };
     std::map<std::string, std::variant<AlreadyRegistered, PerhapsNeedToRegister>> outputReferencesIfUnregistered;
     std::map<std::string, struct stat> outputStats;
+    std::vector<std::pair<std::string, Path>> outputsToScan;
     for (auto & [outputName, _] : drv->outputs) {
         auto scratchOutput = get(scratchOutputs, outputName);
         if (!scratchOutput)
@@ -2309,21 +2458,41 @@ SingleDrvOutputs LocalDerivationGoal::registerOutputs()
             }
         }
 
-        StorePathSet references;
+        outputReferencesIfUnregistered.insert_or_assign(
+            outputName,
+            PerhapsNeedToRegister {});
+        outputStats.insert_or_assign(outputName, std::move(st));
+
         if (discardReferences)
             debug("discarding references of output '%s'", outputName);
-        else {
-            debug("scanning for references for output '%s' in temp location '%s'", outputName, actualPath);
+        else
+            outputsToScan.emplace_back(outputName, actualPath);
+    }
 
-            /* Pass blank Sink as we are not ready to hash data at this stage. */
-            NullSink blank;
-            references = scanForReferences(blank, actualPath, referenceablePaths);
+    /* Scan the outputs for references in parallel. This happens after
+       all outputs have been canonicalised, since hard links between
+       outputs are only accepted once one of them has been. For
+       input-addressed outputs, compute the NAR hash at the same time;
+       it stays valid unless the output has to be rewritten. */
+    {
+        ThreadPool pool;
+        for (auto & [outputName, actualPath] : outputsToScan) {
+            auto & result = std::get<PerhapsNeedToRegister>(outputReferencesIfUnregistered.at(outputName));
+            bool inputAddressed = std::holds_alternative<DerivationOutput::InputAddressed>(drv->outputs.at(outputName).raw);
+            pool.enqueue([&, outputName, actualPath, inputAddressed]() {
+                debug("scanning for references for output '%s' in temp location '%s'", outputName, actualPath);
+                if (inputAddressed) {
+                    HashSink narSink(htSHA256);
+                    result.refs = scanForReferences(narSink, actualPath, referenceablePaths);
+                    result.narHash = narSink.finish();
+                } else {
+                    /* Pass blank Sink as we are not ready to hash data at this stage. */
+                    NullSink blank;
+                    result.refs = scanForReferences(blank, actualPath, referenceablePaths);
+                }
+            });
         }
-
-        outputReferencesIfUnregistered.insert_or_assign(
-            outputName,
-            PerhapsNeedToRegister { .refs = references });
-        outputStats.insert_or_assign(outputName, std::move(st));
+        pool.process();
     }
 
     auto sortedOutputNames = topoSort(outputsToSort,
@@ -2360,6 +2529,9 @@ SingleDrvOutputs LocalDerivationGoal::registerOutputs()
 
     OutputPathMap finalOutputs;
 
+    /* The outputs to deduplicate once they're all in place. */
+    Paths outputsToOptimise;
+
     for (auto & outputName : sortedOutputNames) {
         auto output = get(drv->outputs, outputName);
         auto scratchPath = get(scratchOutputs, outputName);
@@ -2523,10 +2695,17 @@ SingleDrvOutputs LocalDerivationGoal::registerOutputs()
                     outputRewrites.insert_or_assign(
                         std::string { scratchPath->hashPart() },
                         std::string { requiredFinalPath.hashPart() });
-                rewriteOutput(outputRewrites);
-                auto narHashAndSize = hashPath(htSHA256, actualPath);
-                ValidPathInfo newInfo0 { requiredFinalPath, narHashAndSize.first };
-                newInfo0.narSize = narHashAndSize.second;
+                /* Reuse the NAR hash from scanning, unless the output
+                   needs rewriting. */
+                std::optional<HashResult> narHashAndSize;
+                if (outputRewrites.empty())
+                    narHashAndSize = std::get<PerhapsNeedToRegister>(*orifu).narHash;
+                if (!narHashAndSize) {
+                    rewriteOutput(outputRewrites);
+                    narHashAndSize = hashPath(htSHA256, actualPath);
+                }
+                ValidPathInfo newInfo0 { requiredFinalPath, narHashAndSize->first };
+                newInfo0.narSize = narHashAndSize->second;
                 auto refs = rewriteRefs();
                 newInfo0.references = std::move(refs.others);
                 if (refs.self)
@@ -2668,7 +2847,8 @@ SingleDrvOutputs LocalDerivationGoal::registerOutputs()
                 debug("unreferenced input: '%1%'", worker.store.printStorePath(i));
         }
 
-        localStore.optimisePath(actualPath, NoRepair); // FIXME: combine with scanForReferences()
+        if (settings.autoOptimiseStore)
+            outputsToOptimise.push_back(actualPath);
         worker.markContentsGood(newInfo.path);
 
         newInfo.deriver = drvPath;
@@ -2686,6 +2866,14 @@ SingleDrvOutputs LocalDerivationGoal::registerOutputs()
         infos.emplace(outputName, std::move(newInfo));
     }
 
+    /* Deduplicate the outputs in parallel. */
+    {
+        ThreadPool pool;
+        for (auto & path : outputsToOptimise)
+            pool.enqueue([&, path]() { getLocalStore().optimisePath(path, NoRepair); });
+        pool.process();
+    }
+
     if (buildMode == bmCheck) {
         /* In case of fixed-output derivations, if there are
            mismatches on `--check` an error must be thrown as this is
@@ -53,6 +53,12 @@ struct LocalDerivationGoal : public DerivationGoal
     AutoCloseFD sandboxMountNamespace;
     AutoCloseFD sandboxUserNamespace;
 
+    /**
+     * The network namespace of the builder, if it was taken from the
+     * pool of reusable network namespaces.
+     */
+    AutoCloseFD networkNamespace;
+
     /**
      * On Linux, whether we're doing the build in its own user
      * namespace.
@@ -183,6 +189,8 @@ struct LocalDerivationGoal : public DerivationGoal
      */
     void tryLocalBuild() override;
 
+    uint64_t memoryReservation() override;
+
     /**
      * Start building a derivation.
      */
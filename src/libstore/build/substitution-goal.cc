@@ -2,6 +2,9 @@
 #include "substitution-goal.hh"
 #include "nar-info.hh"
 #include "finally.hh"
+#include "metrics.hh"
+#include "local-fs-store.hh"
+#include "pathlocks.hh"
 
 namespace nix {
 
@@ -196,6 +199,32 @@ void PathSubstitutionGoal::referencesValid()
 }
 
 
+/**
+ * If another process is adding `path` to `store` (typically because
+ * it is substituting it as well), wait for it to finish.
+ *
+ * @return Whether `path` is now valid, in which case there is no need
+ * to download it again.
+ */
+static bool waitForOtherSubstitution(Store & store, const StorePath & path)
+{
+    auto localStore = dynamic_cast<LocalFSStore *>(&store);
+    if (!localStore) return false;
+
+    auto realPath = localStore->toRealPath(store.printStorePath(path));
+
+    PathLocks lock;
+    if (lock.lockPaths({realPath}, "", false))
+        return false;
+
+    lock.lockPaths({realPath},
+        fmt("waiting for another process to finish adding '%s'", store.printStorePath(path)));
+    lock.unlock();
+
+    return store.isValidPath(path);
+}
+
+
 void PathSubstitutionGoal::tryToRun()
 {
     trace("trying to run");
@@ -223,6 +252,13 @@ void PathSubstitutionGoal::tryToRun()
             Activity act(*logger, actSubstitute, Logger::Fields{worker.store.printStorePath(storePath), sub->getUri()});
             PushActivity pact(act.id);
 
+            /* Otherwise addToStore() would wait for the lock and then
+               throw away the NAR we downloaded. */
+            if (!repair && waitForOtherSubstitution(worker.store, storePath)) {
+                promise.set_value();
+                return;
+            }
+
             copyStorePath(*sub, worker.store,
                 subPath ? *subPath : storePath, repair, sub->isTrusted ? NoCheckSigs : CheckSigs);
 
@@ -269,6 +305,8 @@ void PathSubstitutionGoal::finished()
 
     worker.markContentsGood(storePath);
 
+    metrics().bytesSubstituted += info->narSize;
+
     printMsg(lvlChatty, "substitution of path '%s' succeeded", worker.store.printStorePath(storePath));
 
     maintainRunningSubstitutions.reset();
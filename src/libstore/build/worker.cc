@@ -4,8 +4,13 @@
 #include "drv-output-substitution-goal.hh"
 #include "local-derivation-goal.hh"
 #include "hook-instance.hh"
+#include "metrics.hh"
 
+#if __linux__
+#include <sys/epoll.h>
+#else
 #include <poll.h>
+#endif
 
 namespace nix {
 
@@ -24,6 +29,12 @@ Worker::Worker(Store & store, Store & evalStore)
     timedOut = false;
     hashMismatch = false;
     checkMismatch = false;
+
+#if __linux__
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (!epollFd)
+        throw SysError("creating epoll instance");
+#endif
 }
 
 
@@ -197,9 +208,24 @@ void Worker::childStarted(GoalPtr goal, const std::set<int> & fds,
     child.inBuildSlot = inBuildSlot;
     child.respectTimeouts = respectTimeouts;
     children.emplace_back(child);
+    for (auto fd : fds) {
+        childFds.insert_or_assign(fd, std::prev(children.end()));
+#if __linux__
+        struct epoll_event event { .events = EPOLLIN, .data = { .fd = fd } };
+        if (epoll_ctl(epollFd.get(), EPOLL_CTL_ADD, fd, &event) == -1)
+            throw SysError("waiting for input on file descriptor %d", fd);
+#endif
+    }
     if (inBuildSlot) {
-        if (goal->jobCategory() == JobCategory::Substitution) nrSubstitutions++;
-        else nrLocalBuilds++;
+        if (goal->jobCategory() == JobCategory::Substitution) {
+            nrSubstitutions++;
+            metrics().substitutionsStarted++;
+            metrics().activeSubstitutions++;
+        } else {
+            nrLocalBuilds++;
+            metrics().buildsStarted++;
+            metrics().activeBuilds++;
+        }
     }
 }
 
@@ -214,12 +240,22 @@ void Worker::childTerminated(Goal * goal, bool wakeSleepers)
         if (goal->jobCategory() == JobCategory::Substitution) {
             assert(nrSubstitutions > 0);
             nrSubstitutions--;
+            metrics().activeSubstitutions--;
         } else {
             assert(nrLocalBuilds > 0);
             nrLocalBuilds--;
+            metrics().activeBuilds--;
         }
     }
 
+    /* The goal may have closed a file descriptor already, in which
+       case it may now belong to another child. */
+    for (auto fd : std::set<int>(i->fds)) {
+        auto j = childFds.find(fd);
+        if (j != childFds.end() && j->second == i)
+            unwatchChildFd(fd);
+    }
+
     children.erase(i);
 
     if (wakeSleepers) {
@@ -235,6 +271,20 @@ void Worker::childTerminated(Goal * goal, bool wakeSleepers)
 }
 
 
+void Worker::unwatchChildFd(int fd)
+{
+    auto i = childFds.find(fd);
+    if (i == childFds.end()) return;
+    i->second->fds.erase(fd);
+    childFds.erase(i);
+#if __linux__
+    /* This fails if the goal has already closed `fd`, which also
+       removes it from the epoll instance. */
+    epoll_ctl(epollFd.get(), EPOLL_CTL_DEL, fd, nullptr);
+#endif
+}
+
+
 void Worker::waitForBuildSlot(GoalPtr goal)
 {
     debug("wait for build slot");
@@ -247,6 +297,89 @@ void Worker::waitForBuildSlot(GoalPtr goal)
 }
 
 
+#if __linux__
+/**
+ * @return The memory available for starting new applications without
+ * swapping, as estimated by the kernel.
+ */
+static std::optional<uint64_t> getAvailableMemory()
+{
+    try {
+        for (auto & line : tokenizeString<std::vector<std::string>>(readFile("/proc/meminfo"), "\n"))
+            if (hasPrefix(line, "MemAvailable:")) {
+                auto fields = tokenizeString<std::vector<std::string>>(line);
+                if (fields.size() >= 2)
+                    if (auto kb = string2Int<uint64_t>(fields[1]))
+                        return *kb * 1024;
+            }
+    } catch (SysError &) {
+    }
+    return std::nullopt;
+}
+
+/**
+ * @return The percentage of time in the last 10 seconds in which some
+ * processes were stalled waiting for memory.
+ */
+static std::optional<double> getMemoryPressure()
+{
+    try {
+        for (auto & line : tokenizeString<std::vector<std::string>>(readFile("/proc/pressure/memory"), "\n"))
+            if (hasPrefix(line, "some "))
+                for (auto & field : tokenizeString<std::vector<std::string>>(line))
+                    if (hasPrefix(field, "avg10="))
+                        return string2Float<double>(field.substr(6));
+    } catch (SysError &) {
+    }
+    return std::nullopt;
+}
+#endif
+
+
+bool Worker::admitBuild(uint64_t requiredMemory)
+{
+    /* Always allow one build, so that we make progress. */
+    if (nrLocalBuilds == 0) return true;
+
+    if (settings.maxLoad) {
+        double load;
+        if (getloadavg(&load, 1) == 1 && load >= settings.maxLoad) {
+            debug("not starting another build because the load average is %.2f", load);
+            return false;
+        }
+    }
+
+#if __linux__
+    if (settings.minAvailableMemory || requiredMemory) {
+        if (auto available = getAvailableMemory()) {
+            /* Memory that running builds have asked for but aren't
+               using yet isn't really available. */
+            uint64_t reserved = 0;
+            for (auto & child : children)
+                if (child.inBuildSlot)
+                    if (auto goal = child.goal.lock())
+                        reserved += goal->memoryReservation();
+            if (*available < reserved + requiredMemory + settings.minAvailableMemory) {
+                debug("not starting another build because only %d bytes of memory are available, of which %d are reserved",
+                    *available, reserved);
+                return false;
+            }
+        }
+    }
+
+    if (settings.maxMemoryPressure) {
+        auto pressure = getMemoryPressure();
+        if (pressure && *pressure >= settings.maxMemoryPressure) {
+            debug("not starting another build because the memory pressure is %.2f%%", *pressure);
+            return false;
+        }
+    }
+#endif
+
+    return true;
+}
+
+
 void Worker::waitForAnyGoal(GoalPtr goal)
 {
     debug("wait for any goal");
@@ -293,7 +426,8 @@ void Worker::run(const Goals & _topGoals)
             localStore->autoGC(false);
 
         /* Call every wake goal (in the ordering established by
-           CompareGoalPtrs). */
+           CompareGoalPtrs, or by the longest remaining critical
+           path). */
         while (!awake.empty() && !topGoals.empty()) {
             Goals awake2;
             for (auto & i : awake) {
@@ -301,7 +435,20 @@ void Worker::run(const Goals & _topGoals)
                 if (goal) awake2.insert(goal);
             }
             awake.clear();
-            for (auto & goal : awake2) {
+
+            /* Look up the realisations of derivation outputs that are
+               wanted together, such as the outputs of a derivation's
+               inputs, in one batch. A single one is looked up
+               asynchronously by its goal instead. */
+            std::vector<std::shared_ptr<DrvOutputSubstitutionGoal>> drvOutputGoals;
+            for (auto & goal : awake2)
+                if (auto subGoal = std::dynamic_pointer_cast<DrvOutputSubstitutionGoal>(goal);
+                    subGoal && subGoal->state == &DrvOutputSubstitutionGoal::init)
+                    drvOutputGoals.push_back(subGoal);
+            if (drvOutputGoals.size() > 1)
+                DrvOutputSubstitutionGoal::prefetch(*this, drvOutputGoals);
+
+            for (auto & goal : prioritise(awake2)) {
                 checkInterrupt();
                 goal->work();
                 if (topGoals.empty()) break; // stuff may have been cancelled
@@ -338,6 +485,42 @@ void Worker::run(const Goals & _topGoals)
     assert(!settings.keepGoing || children.empty());
 }
 
+/**
+ * The estimated time in seconds until `goal` and the goals waiting
+ * for it (and so on) are done, following the longest chain of
+ * waiters.
+ */
+static uint64_t remainingCriticalPath(Goal & goal, std::map<Goal *, uint64_t> & memo)
+{
+    if (auto i = memo.find(&goal); i != memo.end()) return i->second;
+    uint64_t longest = 0;
+    for (auto & i : goal.waiters)
+        if (auto waiter = i.lock())
+            longest = std::max(longest, remainingCriticalPath(*waiter, memo));
+    return memo[&goal] = goal.estimatedDuration() + longest;
+}
+
+
+std::vector<GoalPtr> Worker::prioritise(const Goals & goals)
+{
+    std::vector<GoalPtr> res(goals.begin(), goals.end());
+
+    /* Goals that get a build slot as soon as they ask for it go
+       first, so call the goals on the longest chain of builds
+       first. */
+    if (settings.criticalPathScheduling && res.size() > 1) {
+        std::map<Goal *, uint64_t> memo;
+        for (auto & goal : res)
+            remainingCriticalPath(*goal, memo);
+        std::stable_sort(res.begin(), res.end(), [&](const GoalPtr & a, const GoalPtr & b) {
+            return memo[a.get()] > memo[b.get()];
+        });
+    }
+
+    return res;
+}
+
+
 void Worker::waitForInput()
 {
     printMsg(lvlVomit, "waiting for children");
@@ -356,9 +539,6 @@ void Worker::waitForInput()
        is a build timeout, then wait for input until the first
        deadline for any child. */
     auto nearest = steady_time_point::max(); // nearest deadline
-    if (settings.minFree.get() != 0)
-        // Periodicallty wake up to see if we need to run the garbage collector.
-        nearest = before + std::chrono::seconds(10);
     for (auto & i : children) {
         if (!i.respectTimeouts) continue;
         if (0 != settings.maxSilentTime)
@@ -366,8 +546,12 @@ void Worker::waitForInput()
         if (0 != settings.buildTimeout)
             nearest = std::min(nearest, i.timeStarted + std::chrono::seconds(settings.buildTimeout));
     }
-    if (nearest != steady_time_point::max()) {
-        timeout = std::max(1L, (long) std::chrono::duration_cast<std::chrono::seconds>(nearest - before).count());
+    auto wakeUpAt = nearest;
+    if (settings.minFree.get() != 0)
+        // Periodicallty wake up to see if we need to run the garbage collector.
+        wakeUpAt = std::min(wakeUpAt, before + std::chrono::seconds(10));
+    if (wakeUpAt != steady_time_point::max()) {
+        timeout = std::max(1L, (long) std::chrono::duration_cast<std::chrono::seconds>(wakeUpAt - before).count());
         useTimeout = true;
     }
 
@@ -384,82 +568,100 @@ void Worker::waitForInput()
     if (useTimeout)
         vomit("sleeping %d seconds", timeout);
 
-    /* Use select() to wait for the input side of any logger pipe to
-       become `available'.  Note that `available' (i.e., non-blocking)
+    /* Wait for the input side of any logger pipe to become
+       `available'.  Note that `available' (i.e., non-blocking)
        includes EOF. */
-    std::vector<struct pollfd> pollStatus;
-    std::map<int, size_t> fdToPollStatus;
-    for (auto & i : children) {
-        for (auto & j : i.fds) {
-            pollStatus.push_back((struct pollfd) { .fd = j, .events = POLLIN });
-            fdToPollStatus[j] = pollStatus.size() - 1;
-        }
+    std::vector<int> ready;
+
+#if __linux__
+    /* The file descriptors are registered on the epoll instance by
+       childStarted(), so this doesn't depend on the number of
+       children. */
+    struct epoll_event events[128];
+    auto n = epoll_wait(epollFd.get(), events, std::size(events),
+        useTimeout ? timeout * 1000 : -1);
+    if (n == -1) {
+        if (errno == EINTR) return;
+        throw SysError("waiting for input");
     }
+    for (int i = 0; i < n; ++i)
+        ready.push_back(events[i].data.fd);
+#else
+    std::vector<struct pollfd> pollStatus;
+    for (auto & [fd, _] : childFds)
+        pollStatus.push_back((struct pollfd) { .fd = fd, .events = POLLIN });
 
     if (poll(pollStatus.data(), pollStatus.size(),
             useTimeout ? timeout * 1000 : -1) == -1) {
         if (errno == EINTR) return;
         throw SysError("waiting for input");
     }
+    for (auto & i : pollStatus)
+        if (i.revents) ready.push_back(i.fd);
+#endif
 
     auto after = steady_time_point::clock::now();
 
-    /* Process all available file descriptors. FIXME: this is
-       O(children * fds). */
-    decltype(children)::iterator i;
-    for (auto j = children.begin(); j != children.end(); j = i) {
-        i = std::next(j);
-
+    /* Process all available file descriptors. */
+    std::vector<unsigned char> buffer(64 * 1024);
+    for (auto fd : ready) {
         checkInterrupt();
 
-        GoalPtr goal = j->goal.lock();
+        /* Handling an earlier file descriptor may have terminated
+           the child that this one belongs to. */
+        auto i = childFds.find(fd);
+        if (i == childFds.end()) continue;
+        auto & child = *i->second;
+
+        GoalPtr goal = child.goal.lock();
         assert(goal);
 
-        std::set<int> fds2(j->fds);
-        std::vector<unsigned char> buffer(4096);
-        for (auto & k : fds2) {
-            const auto fdPollStatusId = get(fdToPollStatus, k);
-            assert(fdPollStatusId);
-            assert(*fdPollStatusId < pollStatus.size());
-            if (pollStatus.at(*fdPollStatusId).revents) {
-                ssize_t rd = ::read(k, buffer.data(), buffer.size());
-                // FIXME: is there a cleaner way to handle pt close
-                // than EIO? Is this even standard?
-                if (rd == 0 || (rd == -1 && errno == EIO)) {
-                    debug("%1%: got EOF", goal->getName());
-                    goal->handleEOF(k);
-                    j->fds.erase(k);
-                } else if (rd == -1) {
-                    if (errno != EINTR)
-                        throw SysError("%s: read failed", goal->getName());
-                } else {
-                    printMsg(lvlVomit, "%1%: read %2% bytes",
-                        goal->getName(), rd);
-                    std::string data((char *) buffer.data(), rd);
-                    j->lastOutput = after;
-                    goal->handleChildOutput(k, data);
-                }
-            }
+        ssize_t rd = ::read(fd, buffer.data(), buffer.size());
+        // FIXME: is there a cleaner way to handle pt close
+        // than EIO? Is this even standard?
+        if (rd == 0 || (rd == -1 && errno == EIO)) {
+            debug("%1%: got EOF", goal->getName());
+            unwatchChildFd(fd);
+            goal->handleEOF(fd);
+        } else if (rd == -1) {
+            if (errno != EINTR)
+                throw SysError("%s: read failed", goal->getName());
+        } else {
+            printMsg(lvlVomit, "%1%: read %2% bytes",
+                goal->getName(), rd);
+            child.lastOutput = after;
+            goal->handleChildOutput(fd, {(char *) buffer.data(), (size_t) rd});
         }
+    }
 
-        if (goal->exitCode == Goal::ecBusy &&
-            0 != settings.maxSilentTime &&
-            j->respectTimeouts &&
-            after - j->lastOutput >= std::chrono::seconds(settings.maxSilentTime))
-        {
-            goal->timedOut(Error(
-                    "%1% timed out after %2% seconds of silence",
-                    goal->getName(), settings.maxSilentTime));
-        }
+    /* Check for timeouts, but only if a deadline has passed. */
+    if (after >= nearest) {
+        decltype(children)::iterator i;
+        for (auto j = children.begin(); j != children.end(); j = i) {
+            i = std::next(j);
+
+            GoalPtr goal = j->goal.lock();
+            assert(goal);
+
+            if (goal->exitCode == Goal::ecBusy &&
+                0 != settings.maxSilentTime &&
+                j->respectTimeouts &&
+                after - j->lastOutput >= std::chrono::seconds(settings.maxSilentTime))
+            {
+                goal->timedOut(Error(
+                        "%1% timed out after %2% seconds of silence",
+                        goal->getName(), settings.maxSilentTime));
+            }
 
-        else if (goal->exitCode == Goal::ecBusy &&
-            0 != settings.buildTimeout &&
-            j->respectTimeouts &&
-            after - j->timeStarted >= std::chrono::seconds(settings.buildTimeout))
-        {
-            goal->timedOut(Error(
-                    "%1% timed out after %2% seconds",
-                    goal->getName(), settings.buildTimeout));
+            else if (goal->exitCode == Goal::ecBusy &&
+                0 != settings.buildTimeout &&
+                j->respectTimeouts &&
+                after - j->timeStarted >= std::chrono::seconds(settings.buildTimeout))
+            {
+                goal->timedOut(Error(
+                        "%1% timed out after %2% seconds",
+                        goal->getName(), settings.buildTimeout));
+            }
         }
     }
 
@@ -86,6 +86,25 @@ private:
      */
     std::list<Child> children;
 
+    /**
+     * The child to which each file descriptor that we're waiting for
+     * input on belongs.
+     */
+    std::map<int, std::list<Child>::iterator> childFds;
+
+#if __linux__
+    /**
+     * The epoll instance on which the file descriptors in `childFds`
+     * are registered.
+     */
+    AutoCloseFD epollFd;
+#endif
+
+    /**
+     * Stop waiting for input on `fd`, e.g. because we got EOF on it.
+     */
+    void unwatchChildFd(int fd);
+
     /**
      * Number of build slots occupied.  This includes local builds but does not
      * include substitutions or remote builds via the build hook.
@@ -157,6 +176,12 @@ public:
 
     std::unique_ptr<HookInstance> hook;
 
+    /**
+     * Persistent build hooks that have finished a build and can be
+     * asked to do another one.
+     */
+    std::list<std::unique_ptr<HookInstance>> idleHooks;
+
     uint64_t expectedBuilds = 0;
     uint64_t doneBuilds = 0;
     uint64_t failedBuilds = 0;
@@ -255,6 +280,14 @@ public:
      */
     void waitForBuildSlot(GoalPtr goal);
 
+    /**
+     * Whether the system has the resources to start another local
+     * build that needs `requiredMemory` bytes of memory, given the
+     * `max-load`, `min-available-memory` and `max-memory-pressure`
+     * settings. This is in addition to `max-jobs`.
+     */
+    bool admitBuild(uint64_t requiredMemory);
+
     /**
      * Wait for any goal to finish.  Pretty indiscriminate way to
      * wait for some resource that some other goal is holding.
@@ -279,6 +312,12 @@ public:
      */
     void waitForInput();
 
+    /**
+     * Return the order in which to call the goals that have been
+     * woken up.
+     */
+    std::vector<GoalPtr> prioritise(const Goals & goals);
+
     /***
      * The exit status in case of failure.
      *
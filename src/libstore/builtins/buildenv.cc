@@ -11,6 +11,14 @@ struct State
 {
     std::map<Path, int> priorities;
     unsigned long symlinks = 0;
+
+    /**
+     * Whether we're adding packages to a previous profile, and thus
+     * possibly not in priority order. Collisions whose outcome
+     * depends on that order then fail, so that the caller can fall
+     * back to building the profile from scratch.
+     */
+    bool extending = false;
 };
 
 /* For each activated package, create symlinks */
@@ -90,6 +98,8 @@ static void createLinks(State & state, const Path & srcDir, const Path & dstDir,
             auto res = lstat(dstFile.c_str(), &dstSt);
             if (res == 0) {
                 if (S_ISLNK(dstSt.st_mode)) {
+                    if (state.extending && S_ISDIR(lstat(canonPath(dstFile, true)).st_mode))
+                        throw Error("collision between '%1%' and directory '%2%'", srcFile, dstFile);
                     auto prevPriority = state.priorities[dstFile];
                     if (prevPriority == priority)
                         throw BuildEnvFileConflictError(
@@ -113,10 +123,111 @@ static void createLinks(State & state, const Path & srcDir, const Path & dstDir,
     }
 }
 
-void buildProfile(const Path & out, Packages && pkgs)
+/* Copy the symlink tree `srcDir` of a previous profile to `dstDir`,
+   recording the priority of the package that each symlink points
+   into. */
+static void copyLinks(State & state, const Path & srcDir, const Path & dstDir, const std::map<Path, int> & owners)
+{
+    for (const auto & ent : readDirectory(srcDir)) {
+        auto srcFile = srcDir + "/" + ent.name;
+        auto dstFile = dstDir + "/" + ent.name;
+
+        if (hasSuffix(srcFile, "/manifest.nix") || hasSuffix(srcFile, "/manifest.json"))
+            continue;
+
+        auto st = lstat(srcFile);
+
+        if (S_ISDIR(st.st_mode)) {
+            if (mkdir(dstFile.c_str(), 0755) == -1)
+                throw SysError("creating directory '%1%'", dstFile);
+            copyLinks(state, srcFile, dstFile, owners);
+        }
+
+        else if (S_ISLNK(st.st_mode)) {
+            auto target = readLink(srcFile);
+            auto owner = owners.upper_bound(target);
+            if (owner == owners.begin()
+                || (--owner, !(target == owner->first || hasPrefix(target, owner->first + "/"))))
+                throw Error("'%s' doesn't point into a package of the previous profile", srcFile);
+            createSymlink(target, dstFile);
+            state.priorities[dstFile] = owner->second;
+            state.symlinks++;
+        }
+
+        else
+            throw Error("'%s' is not a symlink or directory", srcFile);
+    }
+}
+
+static bool hasPropagatedPackages(const Path & pkgDir)
+{
+    return pathExists(pkgDir + "/nix-support/propagated-user-env-packages");
+}
+
+/* Try to build the profile by adding the packages in `pkgs` that are
+   not in `prev.pkgs` to a copy of `prev.path`, rather than by linking
+   every package again. Return false if that's not equivalent to
+   building the profile from scratch. */
+static bool extendProfile(State & state, const Path & out, const PreviousProfile & prev, const Packages & pkgs)
+{
+    auto activePriorities = [](const Packages & pkgs, std::map<Path, int> & priorities) {
+        for (const auto & pkg : pkgs)
+            if (pkg.active && !priorities.emplace(pkg.path, pkg.priority).second)
+                return false;
+        return true;
+    };
+
+    std::map<Path, int> prevPriorities, newPriorities;
+    if (!activePriorities(prev.pkgs, prevPriorities) || !activePriorities(pkgs, newPriorities))
+        return false;
+
+    /* Removing or re-prioritising a package can uncover links of
+       other packages, so only additions are done incrementally. */
+    for (const auto & [path, priority] : prevPriorities) {
+        auto i = newPriorities.find(path);
+        if (i == newPriorities.end() || i->second != priority)
+            return false;
+    }
+
+    /* Propagated packages are numbered in the order they are found,
+       so adding a package can change their priorities. */
+    for (const auto & [path, priority] : newPriorities)
+        if (hasPropagatedPackages(path))
+            return false;
+
+    std::vector<std::pair<int, Path>> added;
+    for (const auto & [path, priority] : newPriorities)
+        if (!prevPriorities.count(path))
+            added.emplace_back(priority, path);
+    std::sort(added.begin(), added.end());
+
+    copyLinks(state, prev.path, out, prevPriorities);
+
+    state.extending = true;
+    for (const auto & [priority, path] : added)
+        createLinks(state, path, out, priority);
+
+    return true;
+}
+
+void buildProfile(const Path & out, Packages && pkgs, const std::optional<PreviousProfile> & prev)
 {
     State state;
 
+    if (prev) {
+        try {
+            if (extendProfile(state, out, *prev, pkgs)) {
+                debug("extended profile '%s' to %d symlinks", prev->path, state.symlinks);
+                return;
+            }
+        } catch (Error & e) {
+            debug("cannot extend profile '%s', building it from scratch: %s", prev->path, e.what());
+        }
+        deletePath(out);
+        createDirs(out);
+        state = State();
+    }
+
     std::set<Path> done, postponed;
 
     auto addPkg = [&](const Path & pkgDir, int priority) {
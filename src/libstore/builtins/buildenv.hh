@@ -41,7 +41,25 @@ public:
 
 typedef std::vector<Package> Packages;
 
-void buildProfile(const Path & out, Packages && pkgs);
+/**
+ * A symlink tree created by `buildProfile()` for `pkgs`.
+ */
+struct PreviousProfile
+{
+    Path path;
+    Packages pkgs;
+};
+
+/**
+ * Create the symlink tree of a profile containing `pkgs` in `out`.
+ *
+ * If `prev` is given and `pkgs` only adds packages to it, this copies
+ * the symlink tree of `prev` and links just the new packages, rather
+ * than walking every package again. Otherwise, or if the result could
+ * differ from building the profile from scratch, `out` is built from
+ * scratch.
+ */
+void buildProfile(const Path & out, Packages && pkgs, const std::optional<PreviousProfile> & prev = std::nullopt);
 
 void builtinBuildenv(const BasicDerivation & drv);
 
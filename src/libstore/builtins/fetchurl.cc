@@ -30,6 +30,17 @@ void builtinFetchurl(const BasicDerivation & drv, const std::string & netrcData)
        a forked process. */
     auto fileTransfer = makeFileTransfer();
 
+    /* If we can tell from the data as it arrives whether it has the
+       expected hash (the flat hash of a plain file, or the NAR hash
+       of an unpacked NAR), check it here, so that a bad download
+       (e.g. from a hashed mirror) is rejected before it is written
+       out completely and hashed again during output registration. */
+    std::optional<Hash> expectedHash;
+    auto hashMode = getOr(drv.env, "outputHashMode", "flat");
+    auto outputHash = getOr(drv.env, "outputHash", "");
+    if (outputHash != "" && (hashMode == "recursive") == unpack)
+        expectedHash = newHashAllowEmpty(outputHash, parseHashTypeOpt(getOr(drv.env, "outputHashAlgo", "")));
+
     auto fetch = [&](const std::string & url) {
 
         auto source = sinkToSource([&](Sink & sink) {
@@ -46,10 +57,29 @@ void builtinFetchurl(const BasicDerivation & drv, const std::string & netrcData)
             decompressor->finish();
         });
 
+        std::optional<HashSink> hashSink;
+        std::optional<TeeSource> hashSource;
+        if (expectedHash) {
+            hashSink.emplace(expectedHash->type);
+            hashSource.emplace(*source, *hashSink);
+        }
+        Source & from = hashSource ? (Source &) *hashSource : *source;
+
         if (unpack)
-            restorePath(storePath, *source);
+            restorePath(storePath, from);
         else
-            writeFile(storePath, *source);
+            writeFile(storePath, from);
+
+        if (hashSink) {
+            auto got = hashSink->finish().first;
+            if (got != *expectedHash) {
+                deletePath(storePath);
+                throw Error("hash mismatch in file downloaded from '%s':\n  specified: %s\n     got:    %s",
+                    url,
+                    expectedHash->to_string(HashFormat::SRI, true),
+                    got.to_string(HashFormat::SRI, true));
+            }
+        }
 
         auto executable = drv.env.find("executable");
         if (executable != drv.env.end() && executable->second == "1") {
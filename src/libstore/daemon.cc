@@ -13,6 +13,12 @@
 #include "archive.hh"
 #include "derivations.hh"
 #include "args.hh"
+#include "compression.hh"
+#include "metrics.hh"
+#include "sync.hh"
+
+#include <queue>
+#include <thread>
 
 namespace nix::daemon {
 
@@ -35,7 +41,7 @@ Sink & operator << (Sink & sink, const Logger::Fields & fields)
    true). */
 struct TunnelLogger : public Logger
 {
-    FdSink & to;
+    BufferedSink & to;
 
     struct State
     {
@@ -47,7 +53,13 @@ struct TunnelLogger : public Logger
 
     WorkerProto::Version clientVersion;
 
-    TunnelLogger(FdSink & to, WorkerProto::Version clientVersion)
+    /**
+     * The verbosity requested by the client, if it isn't applied to
+     * the whole process (`nix::verbosity`), as in a threaded daemon.
+     */
+    std::optional<Verbosity> clientVerbosity;
+
+    TunnelLogger(BufferedSink & to, WorkerProto::Version clientVersion)
         : to(to), clientVersion(clientVersion) { }
 
     void enqueueMsg(const std::string & s)
@@ -71,7 +83,7 @@ struct TunnelLogger : public Logger
 
     void log(Verbosity lvl, std::string_view s) override
     {
-        if (lvl > verbosity) return;
+        if (lvl > clientVerbosity.value_or(verbosity)) return;
 
         StringSink buf;
         buf << STDERR_NEXT << (s + "\n");
@@ -80,7 +92,7 @@ struct TunnelLogger : public Logger
 
     void logEI(const ErrorInfo & ei) override
     {
-        if (ei.level > verbosity) return;
+        if (ei.level > clientVerbosity.value_or(verbosity)) return;
 
         std::stringstream oss;
         showErrorInfo(oss, ei, false);
@@ -206,12 +218,62 @@ struct ClientSettings
         settings.buildCores = buildCores;
         settings.useSubstitutes = useSubstitutes;
 
+        for (auto & [name, value] : allowedOverrides(trusted)) {
+            try {
+                settings.set(name, value);
+            } catch (UsageError & e) {
+                warn(e.what());
+            }
+        }
+    }
+
+    /**
+     * Whether applying these settings would leave the settings of
+     * this process unchanged, apart from the verbosity.
+     */
+    bool matchesGlobalSettings(TrustedFlag trusted)
+    {
+        if (keepFailed != settings.keepFailed
+            || keepGoing != settings.keepGoing
+            || tryFallback != settings.tryFallback
+            || maxBuildJobs != settings.maxBuildJobs.get()
+            || maxSilentTime != settings.maxSilentTime
+            || verboseBuild != settings.verboseBuild
+            || buildCores != settings.buildCores
+            || useSubstitutes != settings.useSubstitutes)
+            return false;
+
+        std::map<std::string, AbstractConfig::SettingInfo> current;
+        settings.getSettings(current);
+
+        for (auto & [name, value] : allowedOverrides(trusted)) {
+            /* Aliases and `extra-` settings aren't in `current`, so
+               they count as a change. */
+            auto i = current.find(name);
+            if (i == current.end()
+                || tokenizeString<Strings>(i->second.value) != tokenizeString<Strings>(value))
+                return false;
+        }
+
+        return true;
+    }
+
+private:
+
+    /**
+     * The overrides that the client may set, with untrusted
+     * substituters removed.
+     */
+    StringMap allowedOverrides(TrustedFlag trusted)
+    {
+        StringMap res;
+
         for (auto & i : overrides) {
             auto & name(i.first);
             auto & value(i.second);
 
-            auto setSubstituters = [&](Setting<Strings> & res) {
-                if (name != res.name && res.aliases.count(name) == 0)
+            auto setSubstituters = [&](Setting<Strings> & setting) {
+                if (name != setting.name && setting.aliases.count(name) == 0)
                     return false;
                 StringSet trusted = settings.trustedSubstituters;
                 for (auto & s : settings.substituters.get())
@@ -226,7 +288,7 @@ struct ClientSettings
                     else
                         warn("ignoring untrusted substituter '%s', you are not a trusted user.\n"
                              "Run `man nix.conf` for more information on the `substituters` configuration option.", s);
-                res = subs;
+                res.insert_or_assign(name, concatStringsSep(" ", subs));
                 return true;
             };
 
@@ -249,7 +311,7 @@ struct ClientSettings
                     || name == settings.pollInterval.name
                     || name == "connect-timeout"
                     || (name == "builders" && value == ""))
-                    settings.set(name, value);
+                    res.insert_or_assign(name, value);
                 else if (setSubstituters(settings.substituters))
                     ;
                 else
@@ -258,9 +320,101 @@ struct ClientSettings
                 warn(e.what());
             }
         }
+
+        return res;
+    }
+};
+
+static ClientSettings readClientSettings(Source & from, WorkerProto::Version clientVersion)
+{
+    ClientSettings clientSettings;
+
+    clientSettings.keepFailed = readInt(from);
+    clientSettings.keepGoing = readInt(from);
+    clientSettings.tryFallback = readInt(from);
+    clientSettings.verbosity = (Verbosity) readInt(from);
+    clientSettings.maxBuildJobs = readInt(from);
+    clientSettings.maxSilentTime = readInt(from);
+    readInt(from); // obsolete useBuildHook
+    clientSettings.verboseBuild = lvlError == (Verbosity) readInt(from);
+    readInt(from); // obsolete logType
+    readInt(from); // obsolete printBuildTrace
+    clientSettings.buildCores = readInt(from);
+    clientSettings.useSubstitutes = readInt(from);
+
+    if (GET_PROTOCOL_MINOR(clientVersion) >= 12) {
+        unsigned int n = readInt(from);
+        for (unsigned int i = 0; i < n; i++) {
+            auto name = readString(from);
+            auto value = readString(from);
+            clientSettings.overrides.emplace(name, value);
+        }
+    }
+
+    return clientSettings;
+}
+
+/**
+ * Whether `op` only queries the store, so that it may be performed by
+ * a process that serves other connections at the same time. Other
+ * operations may build or substitute paths, add temporary roots that
+ * last as long as the process, or depend on settings that are global
+ * to the process.
+ *
+ * `QueryValidPaths` only queries the store if the client doesn't ask
+ * for substitution.
+ */
+static bool isQueryOp(WorkerProto::Op op)
+{
+    switch (op) {
+    case WorkerProto::Op::IsValidPath:
+    case WorkerProto::Op::HasSubstitutes:
+    case WorkerProto::Op::QuerySubstitutablePaths:
+    case WorkerProto::Op::QueryPathHash:
+    case WorkerProto::Op::QueryReferences:
+    case WorkerProto::Op::QueryReferrers:
+    case WorkerProto::Op::QueryValidDerivers:
+    case WorkerProto::Op::QueryDerivationOutputs:
+    case WorkerProto::Op::QueryDerivationOutputNames:
+    case WorkerProto::Op::QueryDerivationOutputMap:
+    case WorkerProto::Op::QueryDeriver:
+    case WorkerProto::Op::QueryPathFromHashPart:
+    case WorkerProto::Op::QuerySubstitutablePathInfo:
+    case WorkerProto::Op::QuerySubstitutablePathInfos:
+    case WorkerProto::Op::QueryAllValidPaths:
+    case WorkerProto::Op::QueryPathInfo:
+    case WorkerProto::Op::QueryPathInfos:
+    case WorkerProto::Op::QueryValidPathsByPrefix:
+    case WorkerProto::Op::NarFromPath:
+    case WorkerProto::Op::QueryMissing:
+    case WorkerProto::Op::QueryRealisation:
+    case WorkerProto::Op::QueryRealisations:
+        return true;
+    default:
+        return false;
     }
+}
+
+static void serveMultiplexed(ref<Store> store, TrustedFlag trusted,
+    WorkerProto::Version clientVersion, Source & from, BufferedSink & to);
+
+/**
+ * The methods with which NARs sent over a connection may be
+ * compressed, and the highest compression level that a client may ask
+ * for with each of them.
+ */
+static const std::map<std::string, unsigned int> narCompressionMethods = {
+    {"zstd", 19},
 };
 
+static std::string readNarCompression(Source & from)
+{
+    auto method = readString(from);
+    if (method != "none" && !narCompressionMethods.count(method))
+        throw Error("NAR compression method '%s' is not supported", method);
+    return method;
+}
+
 static void performOp(TunnelLogger * logger, ref<Store> store,
     TrustedFlag trusted, RecursiveFlag recursive, WorkerProto::Version clientVersion,
     Source & from, BufferedSink & to, WorkerProto::Op op)
@@ -479,11 +633,14 @@ static void performOp(TunnelLogger * logger, ref<Store> store,
         from >> repair >> dontCheckSigs;
         if (!trusted && dontCheckSigs)
             dontCheckSigs = false;
+        auto compression = GET_PROTOCOL_MINOR(clientVersion) >= 38
+            ? readNarCompression(from) : "none";
 
         logger->startWork();
         {
             FramedSource source(from);
-            store->addMultipleToStore(source,
+            auto decompressed = makeDecompressionSource(compression, source);
+            store->addMultipleToStore(*decompressed,
                 RepairFlag{repair},
                 dontCheckSigs ? NoCheckSigs : CheckSigs);
         }
@@ -657,6 +814,15 @@ static void performOp(TunnelLogger * logger, ref<Store> store,
         break;
     }
 
+    case WorkerProto::Op::AddTempRoots: {
+        auto paths = WorkerProto::Serialise<StorePathSet>::read(*store, rconn);
+        logger->startWork();
+        store->addTempRoots(paths);
+        logger->stopWork();
+        to << 1;
+        break;
+    }
+
     case WorkerProto::Op::AddIndirectRoot: {
         Path path = absPath(readString(from));
 
@@ -722,29 +888,7 @@ static void performOp(TunnelLogger * logger, ref<Store> store,
 
     case WorkerProto::Op::SetOptions: {
 
-        ClientSettings clientSettings;
-
-        clientSettings.keepFailed = readInt(from);
-        clientSettings.keepGoing = readInt(from);
-        clientSettings.tryFallback = readInt(from);
-        clientSettings.verbosity = (Verbosity) readInt(from);
-        clientSettings.maxBuildJobs = readInt(from);
-        clientSettings.maxSilentTime = readInt(from);
-        readInt(from); // obsolete useBuildHook
-        clientSettings.verboseBuild = lvlError == (Verbosity) readInt(from);
-        readInt(from); // obsolete logType
-        readInt(from); // obsolete printBuildTrace
-        clientSettings.buildCores = readInt(from);
-        clientSettings.useSubstitutes = readInt(from);
-
-        if (GET_PROTOCOL_MINOR(clientVersion) >= 12) {
-            unsigned int n = readInt(from);
-            for (unsigned int i = 0; i < n; i++) {
-                auto name = readString(from);
-                auto value = readString(from);
-                clientSettings.overrides.emplace(name, value);
-            }
-        }
+        auto clientSettings = readClientSettings(from, clientVersion);
 
         logger->startWork();
 
@@ -827,6 +971,55 @@ static void performOp(TunnelLogger * logger, ref<Store> store,
         break;
     }
 
+    case WorkerProto::Op::QueryPathInfos: {
+        auto paths = WorkerProto::Serialise<StorePathSet>::read(*store, rconn);
+        logger->startWork();
+        auto infos = store->queryPathInfos(paths);
+        logger->stopWork();
+        to << infos.size();
+        for (auto & [_, info] : infos)
+            WorkerProto::write(*store, wconn, *info);
+        break;
+    }
+
+    case WorkerProto::Op::QueryValidPathsByPrefix: {
+        auto prefixes = readString(from);
+        auto count = prefixes.size() / WorkerProto::hashPrefixLen;
+        logger->startWork();
+        /* Reply with a bitmap of the prefixes that match a valid
+           path, and a hash of the matching paths that lets the client
+           check that they're the paths it asked about. If the store
+           can't look up prefixes, claim that all of them match, so
+           that the client checks them all. */
+        std::string present((count + 7) / 8, 0);
+        HashSink digest(htSHA256);
+        try {
+            for (size_t i = 0; i < count; ++i) {
+                auto path = store->queryPathFromHashPrefix(
+                    std::string_view(prefixes).substr(i * WorkerProto::hashPrefixLen, WorkerProto::hashPrefixLen));
+                if (!path) continue;
+                present[i / 8] |= 1 << (i % 8);
+                digest << store->printStorePath(*path);
+            }
+        } catch (Unsupported &) {
+            present.assign(present.size(), (char) 0xff);
+        }
+        auto hash = digest.finish().first;
+        logger->stopWork();
+        to << present << std::string_view((char *) hash.hash, hash.hashSize);
+        break;
+    }
+
+    case WorkerProto::Op::Multiplex: {
+        logger->startWork();
+        if (recursive)
+            throw Error("multiplexing is not supported in recursive Nix");
+        logger->stopWork();
+        to.flush();
+        serveMultiplexed(store, trusted, clientVersion, from, to);
+        break;
+    }
+
     case WorkerProto::Op::OptimiseStore:
         logger->startWork();
         store->optimiseStore();
@@ -858,9 +1051,28 @@ static void performOp(TunnelLogger * logger, ref<Store> store,
 
     case WorkerProto::Op::NarFromPath: {
         auto path = store->parseStorePath(readString(from));
+        std::string compression = "none";
+        unsigned int level = 0;
+        if (GET_PROTOCOL_MINOR(clientVersion) >= 38) {
+            compression = readNarCompression(from);
+            from >> level;
+        }
         logger->startWork();
+        if (compression != "none" && level > narCompressionMethods.at(compression))
+            throw Error("compression level %d is not supported for '%s'", level, compression);
         logger->stopWork();
-        dumpPath(store->toRealPath(path), to);
+        if (compression == "none")
+            dumpPath(store->toRealPath(path), to);
+        else {
+            /* The compressed stream is framed since it doesn't tell
+               where the NAR ends. */
+            std::exception_ptr ex;
+            FramedSink framed(to, ex);
+            auto compressor = makeCompressionSink(compression, framed, false, level ? (int) level : -1);
+            dumpPath(store->toRealPath(path), *compressor);
+            compressor->finish();
+            framed.flush();
+        }
         break;
     }
 
@@ -881,12 +1093,15 @@ static void performOp(TunnelLogger * logger, ref<Store> store,
             dontCheckSigs = false;
         if (!trusted)
             info.ultimate = false;
+        auto compression = GET_PROTOCOL_MINOR(clientVersion) >= 38
+            ? readNarCompression(from) : "none";
 
         if (GET_PROTOCOL_MINOR(clientVersion) >= 23) {
             logger->startWork();
             {
                 FramedSource source(from);
-                store->addToStore(info, source, (RepairFlag) repair,
+                auto decompressed = makeDecompressionSource(compression, source);
+                store->addToStore(info, *decompressed, (RepairFlag) repair,
                     dontCheckSigs ? NoCheckSigs : CheckSigs);
             }
             logger->stopWork();
@@ -962,6 +1177,18 @@ static void performOp(TunnelLogger * logger, ref<Store> store,
         break;
     }
 
+    case WorkerProto::Op::QueryRealisations: {
+        auto ids = WorkerProto::Serialise<std::set<DrvOutput>>::read(*store, rconn);
+        logger->startWork();
+        auto realisations = store->queryRealisations(ids);
+        logger->stopWork();
+        std::set<Realisation> res;
+        for (auto & [_, realisation] : realisations)
+            res.insert(*realisation);
+        WorkerProto::write(*store, wconn, res);
+        break;
+    }
+
     case WorkerProto::Op::AddBuildLog: {
         StorePath path{readString(from)};
         logger->startWork();
@@ -988,16 +1215,14 @@ static void performOp(TunnelLogger * logger, ref<Store> store,
     }
 }
 
-void processConnection(
-    ref<Store> store,
-    FdSource & from,
-    FdSink & to,
-    TrustedFlag trusted,
-    RecursiveFlag recursive)
+/**
+ * Exchange the greeting with a new client.
+ *
+ * @return The protocol version of the client.
+ */
+static WorkerProto::Version exchangeGreeting(ref<Store> store,
+    Source & from, FdSink & to, TrustedFlag trusted)
 {
-    auto monitor = !recursive ? std::make_unique<MonitorFdHup>(from.fd) : nullptr;
-
-    /* Exchange the greeting. */
     unsigned int magic = readInt(from);
     if (magic != WORKER_MAGIC_1) throw Error("protocol mismatch");
     to << WORKER_MAGIC_2 << PROTOCOL_VERSION;
@@ -1007,19 +1232,6 @@ void processConnection(
     if (clientVersion < 0x10a)
         throw Error("the Nix client version is too old");
 
-    auto tunnelLogger = new TunnelLogger(to, clientVersion);
-    auto prevLogger = nix::logger;
-    // FIXME
-    if (!recursive)
-        logger = tunnelLogger;
-
-    unsigned int opCount = 0;
-
-    Finally finally([&]() {
-        _isInterrupted = false;
-        printMsgUsing(prevLogger, lvlDebug, "%d operations", opCount);
-    });
-
     if (GET_PROTOCOL_MINOR(clientVersion) >= 14 && readInt(from)) {
         // Obsolete CPU affinity.
         readInt(from);
@@ -1044,13 +1256,71 @@ void processConnection(
         WorkerProto::write(*store, wconn, temp);
     }
 
+    if (GET_PROTOCOL_MINOR(clientVersion) >= 38) {
+        Strings methods;
+        for (auto & [method, _] : narCompressionMethods)
+            methods.push_back(method);
+        to << methods;
+    }
+
+    return clientVersion;
+}
+
+/**
+ * What `serveConnection()` should do with an operation.
+ */
+enum struct OpDisposition {
+    /**
+     * Perform it with `performOp()`.
+     */
+    Perform,
+    /**
+     * Nothing, it has been performed already.
+     */
+    Done,
+    /**
+     * Stop serving the connection, it has been handed off.
+     */
+    HandedOff,
+};
+
+/**
+ * Process client requests until the client disconnects.
+ *
+ * @param daemonLogger The logger for messages about the connection
+ * that are not meant for the client.
+ *
+ * @param resumed Whether another process has already served the
+ * connection, and so sent the startup messages.
+ *
+ * @param filterOp If set, called for each operation before it is
+ * performed.
+ */
+static void serveConnection(TunnelLogger * tunnelLogger, Logger * daemonLogger,
+    ref<Store> store, TrustedFlag trusted, RecursiveFlag recursive,
+    WorkerProto::Version clientVersion, Source & from, FdSink & to,
+    bool resumed = false,
+    std::function<OpDisposition(WorkerProto::Op)> filterOp = {})
+{
+    unsigned int opCount = 0;
+
+    if (!resumed) metrics().connections++;
+    metrics().activeConnections++;
+
+    Finally finally([&]() {
+        metrics().activeConnections--;
+        printMsgUsing(daemonLogger, lvlDebug, "%d operations", opCount);
+    });
+
     /* Send startup error messages to the client. */
-    tunnelLogger->startWork();
+    if (!resumed) tunnelLogger->startWork();
 
     try {
 
-        tunnelLogger->stopWork();
-        to.flush();
+        if (!resumed) {
+            tunnelLogger->stopWork();
+            to.flush();
+        }
 
         /* Process client requests. */
         while (true) {
@@ -1063,14 +1333,22 @@ void processConnection(
                 break;
             }
 
-            printMsgUsing(prevLogger, lvlDebug, "received daemon op %d", op);
+            printMsgUsing(daemonLogger, lvlDebug, "received daemon op %d", op);
 
             opCount++;
 
             debug("performing daemon worker op: %d", op);
 
+            auto opStart = std::chrono::steady_clock::now();
+            Finally recordOp([&]() {
+                metrics().recordDaemonOp((uint64_t) op, std::chrono::steady_clock::now() - opStart);
+            });
+
             try {
-                performOp(tunnelLogger, store, trusted, recursive, clientVersion, from, to, op);
+                auto disposition = filterOp ? filterOp(op) : OpDisposition::Perform;
+                if (disposition == OpDisposition::HandedOff) return;
+                if (disposition == OpDisposition::Perform)
+                    performOp(tunnelLogger, store, trusted, recursive, clientVersion, from, to, op);
             } catch (Error & e) {
                 /* If we're not in a state where we can send replies, then
                    something went wrong processing the input of the
@@ -1103,4 +1381,319 @@ void processConnection(
     }
 }
 
+void processConnection(
+    ref<Store> store,
+    FdSource & from,
+    FdSink & to,
+    TrustedFlag trusted,
+    RecursiveFlag recursive)
+{
+    auto monitor = !recursive ? std::make_unique<MonitorFdHup>(from.fd) : nullptr;
+
+    auto clientVersion = exchangeGreeting(store, from, to, trusted);
+
+    auto tunnelLogger = new TunnelLogger(to, clientVersion);
+    auto prevLogger = nix::logger;
+    // FIXME
+    if (!recursive)
+        logger = tunnelLogger;
+
+    Finally finally([&]() {
+        _isInterrupted = false;
+    });
+
+    serveConnection(tunnelLogger, prevLogger, store, trusted, recursive, clientVersion, from, to);
+}
+
+/**
+ * In a threaded daemon, the logger of the thread serving a
+ * connection. See `ThreadLogger`.
+ */
+static thread_local Logger * connectionLogger = nullptr;
+
+/**
+ * The logger of a threaded daemon. It sends messages logged by a
+ * thread that serves a connection to the client of that connection,
+ * and other messages to the logger of the daemon itself. Messages
+ * logged by other threads on behalf of a connection (e.g. those of a
+ * `ThreadPool`) end up in the log of the daemon.
+ */
+struct ThreadLogger : Logger
+{
+    Logger * daemonLogger;
+
+    ThreadLogger(Logger * daemonLogger) : daemonLogger(daemonLogger) { }
+
+    Logger & target()
+    {
+        return connectionLogger ? *connectionLogger : *daemonLogger;
+    }
+
+    void stop() override { daemonLogger->stop(); }
+
+    void pause() override { daemonLogger->pause(); }
+
+    void resume() override { daemonLogger->resume(); }
+
+    bool isVerbose() override { return target().isVerbose(); }
+
+    void log(Verbosity lvl, std::string_view s) override { target().log(lvl, s); }
+
+    void logEI(const ErrorInfo & ei) override { target().logEI(ei); }
+
+    void warn(const std::string & msg) override { target().warn(msg); }
+
+    void startActivity(ActivityId act, Verbosity lvl, ActivityType type,
+        const std::string & s, const Fields & fields, ActivityId parent) override
+    {
+        target().startActivity(act, lvl, type, s, fields, parent);
+    }
+
+    void stopActivity(ActivityId act) override { target().stopActivity(act); }
+
+    void result(ActivityId act, ResultType type, const Fields & fields) override
+    {
+        target().result(act, type, fields);
+    }
+
+    void writeToStdout(std::string_view s) override { daemonLogger->writeToStdout(s); }
+};
+
+/**
+ * The number of requests on a multiplexed connection that are
+ * performed at the same time.
+ */
+static const size_t multiplexThreads = 8;
+
+/**
+ * A `BufferedSink` that collects the reply to a multiplexed request.
+ */
+struct ReplySink : BufferedSink
+{
+    std::string s;
+
+    void writeUnbuffered(std::string_view data) override
+    {
+        s.append(data);
+    }
+};
+
+/**
+ * Serve a multiplexed connection until the client closes it. The
+ * client sends requests prefixed with a tag without waiting for the
+ * replies to earlier ones. The requests are performed by a number of
+ * threads, and each reply, including the log messages of the request,
+ * is sent prefixed with the tag of its request as soon as it is
+ * done, so replies can be out of order.
+ *
+ * Only queries can be multiplexed, since the other operations may
+ * stream data or depend on settings of the connection.
+ */
+static void serveMultiplexed(ref<Store> store, TrustedFlag trusted,
+    WorkerProto::Version clientVersion, Source & from, BufferedSink & to)
+{
+    auto prevLogger = logger;
+    logger = new ThreadLogger(prevLogger);
+    Finally restoreLogger([&]() {
+        delete logger;
+        logger = prevLogger;
+    });
+
+    struct Request
+    {
+        uint64_t tag;
+        std::string data;
+    };
+
+    struct State
+    {
+        std::queue<Request> queue;
+        bool done = false;
+    };
+
+    Sync<State> state_;
+    std::condition_variable wakeup, space;
+    std::mutex sendLock;
+
+    auto worker = [&]() {
+        while (true) {
+            Request req;
+            {
+                auto state(state_.lock());
+                while (state->queue.empty() && !state->done)
+                    state.wait(wakeup);
+                if (state->queue.empty()) return;
+                req = std::move(state->queue.front());
+                state->queue.pop();
+            }
+            space.notify_one();
+
+            ReplySink reply;
+            TunnelLogger tunnelLogger(reply, clientVersion);
+            connectionLogger = &tunnelLogger;
+            Finally resetLogger([]() { connectionLogger = nullptr; });
+
+            StringSource source(req.data);
+            auto opStart = std::chrono::steady_clock::now();
+            try {
+                auto op = (WorkerProto::Op) readInt(source);
+                Finally recordOp([&]() {
+                    metrics().recordDaemonOp((uint64_t) op, std::chrono::steady_clock::now() - opStart);
+                });
+                if ((!isQueryOp(op) && op != WorkerProto::Op::QueryValidPaths)
+                    || op == WorkerProto::Op::NarFromPath)
+                    throw Error("daemon operation %d cannot be multiplexed", op);
+                performOp(&tunnelLogger, store, trusted, NotRecursive, clientVersion, source, reply, op);
+            } catch (Error & e) {
+                tunnelLogger.stopWork(&e);
+            } catch (std::exception & e) {
+                auto ex = Error(e.what());
+                tunnelLogger.stopWork(&ex);
+            }
+            reply.flush();
+
+            /* If the client has gone away, the reader notices. */
+            try {
+                std::lock_guard<std::mutex> lock(sendLock);
+                to << req.tag << reply.s;
+                to.flush();
+            } catch (...) {
+                ignoreException(lvlDebug);
+            }
+        }
+    };
+
+    std::vector<std::thread> workers;
+    Finally joinWorkers([&]() {
+        state_.lock()->done = true;
+        wakeup.notify_all();
+        for (auto & thread : workers)
+            thread.join();
+    });
+    for (size_t n = 0; n < multiplexThreads; ++n)
+        workers.emplace_back(worker);
+
+    while (true) {
+        Request req;
+        try {
+            req.tag = readNum<uint64_t>(from);
+        } catch (EndOfFile &) {
+            break;
+        }
+        req.data = readString(from);
+
+        auto state(state_.lock());
+        while (state->queue.size() >= 2 * multiplexThreads)
+            state.wait(space);
+        state->queue.push(std::move(req));
+        wakeup.notify_one();
+    }
+}
+
+void initThreadedConnections()
+{
+    logger = new ThreadLogger(logger);
+}
+
+void processThreadedConnection(
+    ref<Store> store,
+    FdSource & from,
+    FdSink & to,
+    TrustedFlag trusted,
+    std::function<void(ConnectionHandOff &&)> handOff)
+{
+    auto daemonLogger = logger;
+
+    auto clientVersion = exchangeGreeting(store, from, to, trusted);
+
+    TunnelLogger tunnelLogger(to, clientVersion);
+    tunnelLogger.clientVerbosity = verbosity;
+    connectionLogger = &tunnelLogger;
+    Finally resetLogger([]() { connectionLogger = nullptr; });
+
+    std::optional<std::string> clientSettings;
+
+    /* Hand off the connection just after the client sent `op`, of
+       which `payload` has already been read. */
+    auto doHandOff = [&](WorkerProto::Op op, std::string_view payload) {
+        StringSink pending;
+        pending << (uint64_t) op;
+        pending(payload);
+        char buf[4096];
+        while (from.hasData())
+            pending({buf, from.BufferedSource::read(buf, sizeof(buf))});
+        handOff(ConnectionHandOff {
+            .clientVersion = clientVersion,
+            .clientSettings = clientSettings,
+            .pending = std::move(pending.s),
+        });
+        return OpDisposition::HandedOff;
+    };
+
+    serveConnection(&tunnelLogger, daemonLogger, store, trusted, NotRecursive, clientVersion, from, to, false,
+        [&](WorkerProto::Op op)
+        {
+            if (op == WorkerProto::Op::SetOptions) {
+                StringSink payload;
+                TeeSource tee(from, payload);
+                auto settings = readClientSettings(tee, clientVersion);
+                if (!settings.matchesGlobalSettings(trusted))
+                    return doHandOff(op, payload.s);
+                tunnelLogger.startWork();
+                tunnelLogger.clientVerbosity = settings.verbosity;
+                clientSettings = std::move(payload.s);
+                tunnelLogger.stopWork();
+                return OpDisposition::Done;
+            }
+
+            if (op == WorkerProto::Op::QueryValidPaths && GET_PROTOCOL_MINOR(clientVersion) >= 27) {
+                StringSink payload;
+                TeeSource tee(from, payload);
+                WorkerProto::ReadConn rconn {
+                    .from = tee,
+                    .version = clientVersion,
+                };
+                WorkerProto::Serialise<StorePathSet>::read(*store, rconn);
+                if (readInt(tee))
+                    return doHandOff(op, payload.s);
+                StringSource source(payload.s);
+                performOp(&tunnelLogger, store, trusted, NotRecursive, clientVersion, source, to, op);
+                return OpDisposition::Done;
+            }
+
+            if (!isQueryOp(op))
+                return doHandOff(op, "");
+
+            return OpDisposition::Perform;
+        });
+}
+
+void resumeConnection(
+    ref<Store> store,
+    FdSource & from,
+    FdSink & to,
+    TrustedFlag trusted,
+    ConnectionHandOff && state)
+{
+    auto monitor = std::make_unique<MonitorFdHup>(from.fd);
+
+    /* Apply the settings that the previous process acknowledged,
+       before installing the tunnel logger so that the client doesn't
+       get the same warnings twice. */
+    if (state.clientSettings) {
+        StringSource source(*state.clientSettings);
+        auto clientSettings = readClientSettings(source, state.clientVersion);
+        clientSettings.apply(trusted);
+    }
+
+    auto tunnelLogger = new TunnelLogger(to, state.clientVersion);
+    auto prevLogger = nix::logger;
+    logger = tunnelLogger;
+
+    StringSource pending(state.pending);
+    ChainSource source(pending, from);
+
+    serveConnection(tunnelLogger, prevLogger, store, trusted, NotRecursive, state.clientVersion, source, to, true);
+}
+
 }
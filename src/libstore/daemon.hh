@@ -3,6 +3,7 @@
 
 #include "serialise.hh"
 #include "store-api.hh"
+#include "worker-protocol.hh"
 
 namespace nix::daemon {
 
@@ -15,4 +16,60 @@ void processConnection(
     TrustedFlag trusted,
     RecursiveFlag recursive);
 
+/**
+ * The state of a connection that a thread of a threaded daemon hands
+ * off to a separate process. See `processThreadedConnection()`.
+ */
+struct ConnectionHandOff
+{
+    WorkerProto::Version clientVersion;
+
+    /**
+     * The payload of the last `SetOptions` operation acknowledged to
+     * the client, if any.
+     */
+    std::optional<std::string> clientSettings;
+
+    /**
+     * Data received from the client but not processed yet, starting
+     * with the operation that caused the hand-off.
+     */
+    std::string pending;
+};
+
+/**
+ * Prepare this process for serving several connections at the same
+ * time with `processThreadedConnection()`, by installing a logger that
+ * sends the messages of each thread to its own client. Must be called
+ * before starting any threads.
+ */
+void initThreadedConnections();
+
+/**
+ * Serve a connection on the current thread, with a store that is
+ * shared with other connections. Only operations that query the
+ * store are performed on this thread. As soon as the client asks for
+ * anything else, or for settings that differ from those of this
+ * process, the state of the connection is passed to `handOff`, which
+ * must arrange for another process to continue serving it with
+ * `resumeConnection()`, and this function returns.
+ */
+void processThreadedConnection(
+    ref<Store> store,
+    FdSource & from,
+    FdSink & to,
+    TrustedFlag trusted,
+    std::function<void(ConnectionHandOff &&)> handOff);
+
+/**
+ * Continue serving a connection handed off by
+ * `processThreadedConnection()`.
+ */
+void resumeConnection(
+    ref<Store> store,
+    FdSource & from,
+    FdSink & to,
+    TrustedFlag trusted,
+    ConnectionHandOff && state);
+
 }
@@ -7,6 +7,8 @@
 #include "common-protocol.hh"
 #include "common-protocol-impl.hh"
 #include "fs-accessor.hh"
+#include "drv-hash-cache.hh"
+#include "thread-pool.hh"
 #include <boost/container/small_vector.hpp>
 #include <nlohmann/json.hpp>
 
@@ -149,33 +151,82 @@ StorePath writeDerivation(Store & store,
 }
 
 
+/**
+ * A cursor into the ATerm representation of a derivation. Parsing
+ * works directly on the unparsed text to avoid copying it.
+ */
+struct StringViewStream
+{
+    std::string_view remaining;
+
+    int peek() const
+    {
+        return remaining.empty() ? EOF : (unsigned char) remaining[0];
+    }
+
+    int get()
+    {
+        if (remaining.empty()) return EOF;
+        auto c = (unsigned char) remaining[0];
+        remaining.remove_prefix(1);
+        return c;
+    }
+};
+
+
 /* Read string `s' from stream `str'. */
-static void expect(std::istream & str, std::string_view s)
+static void expect(StringViewStream & str, std::string_view s)
 {
-    char s2[s.size()];
-    str.read(s2, s.size());
-    std::string_view s2View { s2, s.size() };
-    if (s2View != s)
-        throw FormatError("expected string '%s', got '%s'", s, s2View);
+    if (!str.remaining.starts_with(s))
+        throw FormatError("expected string '%s', got '%s'", s, str.remaining.substr(0, s.size()));
+    str.remaining.remove_prefix(s.size());
 }
 
 
-/* Read a C-style string from stream `str'. */
-static std::string parseString(std::istream & str)
+/* Read a C-style string from stream `str'. If the string contains no
+   escapes, the result points into the input; otherwise it is unescaped
+   into `buf'. */
+static std::string_view parseString(StringViewStream & str, std::string & buf)
 {
-    std::string res;
     expect(str, "\"");
-    int c;
-    while ((c = str.get()) != '"')
-        if (c == '\\') {
-            c = str.get();
-            if (c == 'n') res += '\n';
-            else if (c == 'r') res += '\r';
-            else if (c == 't') res += '\t';
-            else res += c;
+    auto & s = str.remaining;
+
+    /* Copy runs of unescaped characters in bulk. Most strings don't
+       contain escapes at all. */
+    auto end = s.find_first_of("\"\\");
+    if (end != s.npos && s[end] == '"') {
+        auto res = s.substr(0, end);
+        s.remove_prefix(end + 1);
+        return res;
+    }
+
+    buf.clear();
+    while (true) {
+        if (end == s.npos)
+            throw FormatError("unterminated string in derivation");
+        buf.append(s.substr(0, end));
+        if (s[end] == '"') {
+            s.remove_prefix(end + 1);
+            return buf;
         }
-        else res += c;
-    return res;
+        if (end + 1 == s.size())
+            throw FormatError("unterminated string in derivation");
+        auto c = s[end + 1];
+        if (c == 'n') buf += '\n';
+        else if (c == 'r') buf += '\r';
+        else if (c == 't') buf += '\t';
+        else buf += c;
+        s.remove_prefix(end + 2);
+        end = s.find_first_of("\"\\");
+    }
+}
+
+
+static std::string parseString(StringViewStream & str)
+{
+    std::string buf;
+    auto res = parseString(str, buf);
+    return res.data() == buf.data() ? std::move(buf) : std::string(res);
 }
 
 static void validatePath(std::string_view s) {
@@ -183,15 +234,15 @@ static void validatePath(std::string_view s) {
         throw FormatError("bad path '%1%' in derivation", s);
 }
 
-static Path parsePath(std::istream & str)
+static std::string_view parsePath(StringViewStream & str, std::string & buf)
 {
-    auto s = parseString(str);
+    auto s = parseString(str, buf);
     validatePath(s);
     return s;
 }
 
 
-static bool endOfList(std::istream & str)
+static bool endOfList(StringViewStream & str)
 {
     if (str.peek() == ',') {
         str.get();
@@ -205,12 +256,12 @@ static bool endOfList(std::istream & str)
 }
 
 
-static StringSet parseStrings(std::istream & str, bool arePaths)
+static StringSet parseStrings(StringViewStream & str)
 {
     StringSet res;
     expect(str, "[");
     while (!endOfList(str))
-        res.insert(arePaths ? parsePath(str) : parseString(str));
+        res.insert(parseString(str));
     return res;
 }
 
@@ -263,12 +314,13 @@ static DerivationOutput parseDerivationOutput(
 }
 
 static DerivationOutput parseDerivationOutput(
-    const Store & store, std::istringstream & str,
+    const Store & store, StringViewStream & str,
     const ExperimentalFeatureSettings & xpSettings = experimentalFeatureSettings)
 {
-    expect(str, ","); const auto pathS = parseString(str);
-    expect(str, ","); const auto hashAlgo = parseString(str);
-    expect(str, ","); const auto hash = parseString(str);
+    std::string buf1, buf2, buf3;
+    expect(str, ","); const auto pathS = parseString(str, buf1);
+    expect(str, ","); const auto hashAlgo = parseString(str, buf2);
+    expect(str, ","); const auto hash = parseString(str, buf3);
     expect(str, ")");
 
     return parseDerivationOutput(store, pathS, hashAlgo, hash, xpSettings);
@@ -293,13 +345,13 @@ enum struct DerivationATermVersion {
 
 static DerivedPathMap<StringSet>::ChildNode parseDerivedPathMapNode(
     const Store & store,
-    std::istringstream & str,
+    StringViewStream & str,
     DerivationATermVersion version)
 {
     DerivedPathMap<StringSet>::ChildNode node;
 
     auto parseNonDynamic = [&]() {
-        node.value = parseStrings(str, false);
+        node.value = parseStrings(str);
     };
 
     // Older derivation should never use new form, but newer
@@ -315,7 +367,7 @@ static DerivedPathMap<StringSet>::ChildNode parseDerivedPathMapNode(
             break;
         case '(':
             expect(str, "(");
-            node.value = parseStrings(str, false);
+            node.value = parseStrings(str);
             expect(str, ",[");
             while (!endOfList(str)) {
                 expect(str, "(");
@@ -345,7 +397,7 @@ Derivation parseDerivation(
     Derivation drv;
     drv.name = name;
 
-    std::istringstream str(std::move(s));
+    StringViewStream str { s };
     expect(str, "D");
     DerivationATermVersion version;
     switch (str.peek()) {
@@ -377,15 +429,18 @@ Derivation parseDerivation(
 
     /* Parse the list of input derivations. */
     expect(str, ",[");
+    std::string buf;
     while (!endOfList(str)) {
         expect(str, "(");
-        Path drvPath = parsePath(str);
+        auto drvPath = store.parseStorePath(parsePath(str, buf));
         expect(str, ",");
-        drv.inputDrvs.map.insert_or_assign(store.parseStorePath(drvPath), parseDerivedPathMapNode(store, str, version));
+        drv.inputDrvs.map.insert_or_assign(std::move(drvPath), parseDerivedPathMapNode(store, str, version));
         expect(str, ")");
     }
 
-    expect(str, ","); drv.inputSrcs = store.parseStorePathSet(parseStrings(str, true));
+    expect(str, ",[");
+    while (!endOfList(str))
+        drv.inputSrcs.insert(store.parseStorePath(parsePath(str, buf)));
     expect(str, ","); drv.platform = parseString(str);
     expect(str, ","); drv.builder = parseString(str);
 
@@ -400,7 +455,7 @@ Derivation parseDerivation(
         expect(str, "("); auto name = parseString(str);
         expect(str, ","); auto value = parseString(str);
         expect(str, ")");
-        drv.env[name] = value;
+        drv.env.insert_or_assign(std::move(name), std::move(value));
     }
 
     expect(str, ")");
@@ -726,6 +781,47 @@ Sync<DrvHashes> drvHashes;
 /* pathDerivationModulo and hashDerivationModulo are mutually recursive
  */
 
+/* Look up the hash of a derivation in the persistent cache, and
+   memoize it if found. */
+static std::optional<DrvHash> lookupDrvHash(Store & store, const StorePath & drvPath)
+{
+    auto drvCache = getDrvHashCache();
+    if (!drvCache) return std::nullopt;
+
+    auto drvPathS = store.printStorePath(drvPath);
+    try {
+        if (auto h = drvCache->lookup(drvPathS)) {
+            drvHashes.lock()->insert_or_assign(drvPath, *h);
+            return *h;
+        }
+    } catch (Error & e) {
+        debug("looking up '%s' in the derivation hash cache: %s", drvPathS, e.msg());
+    }
+    return std::nullopt;
+}
+
+/* Compute the hash of a derivation and memoize it. */
+static DrvHash memoizeDrvHash(Store & store, const StorePath & drvPath, const Derivation & drv)
+{
+    auto h = hashDerivationModulo(store, drv, false);
+    // Cache it
+    drvHashes.lock()->insert_or_assign(drvPath, h);
+
+    /* Only valid derivations are immutable, so only those can be
+       cached persistently. */
+    auto drvCache = getDrvHashCache();
+    if (drvCache && store.isValidPath(drvPath)) {
+        auto drvPathS = store.printStorePath(drvPath);
+        try {
+            drvCache->upsert(drvPathS, h);
+        } catch (Error & e) {
+            debug("adding '%s' to the derivation hash cache: %s", drvPathS, e.msg());
+        }
+    }
+
+    return h;
+}
+
 /* Look up the derivation by value and memoize the
    `hashDerivationModulo` call.
  */
@@ -738,13 +834,74 @@ static const DrvHash pathDerivationModulo(Store & store, const StorePath & drvPa
             return h->second;
         }
     }
-    auto h = hashDerivationModulo(
-        store,
-        store.readInvalidDerivation(drvPath),
-        false);
-    // Cache it
-    drvHashes.lock()->insert_or_assign(drvPath, h);
-    return h;
+
+    if (auto h = lookupDrvHash(store, drvPath))
+        return *h;
+
+    return memoizeDrvHash(store, drvPath, store.readInvalidDerivation(drvPath));
+}
+
+/* Compute the hashes of `drvPaths` and of all the derivations they
+   depend on that haven't been hashed yet, on a thread pool. First the
+   graph of derivations is read, one level at a time, and then the
+   derivations are hashed bottom-up, so that independent derivations
+   are hashed concurrently and every hash only depends on memoized
+   ones. */
+static void precomputeDrvHashes(Store & store, const StorePathSet & drvPaths)
+{
+    Sync<std::map<StorePath, std::shared_ptr<const Derivation>>> drvs_;
+
+    {
+        ThreadPool pool;
+
+        std::function<void(const StorePath &)> visit;
+
+        visit = [&](const StorePath & drvPath) {
+            if (drvHashes.lock()->count(drvPath)) return;
+
+            {
+                auto drvs(drvs_.lock());
+                if (!drvs->emplace(drvPath, nullptr).second) return;
+            }
+
+            if (lookupDrvHash(store, drvPath)) {
+                drvs_.lock()->erase(drvPath);
+                return;
+            }
+
+            auto drv = std::make_shared<const Derivation>(store.readInvalidDerivation(drvPath));
+
+            for (auto & [inputDrv, _] : drv->inputDrvs.map)
+                pool.enqueue(std::bind(visit, inputDrv));
+
+            drvs_.lock()->insert_or_assign(drvPath, drv);
+        };
+
+        for (auto & drvPath : drvPaths)
+            pool.enqueue(std::bind(visit, drvPath));
+
+        pool.process();
+    }
+
+    auto drvs(std::move(*drvs_.lock()));
+
+    StorePathSet nodes;
+    for (auto & [drvPath, _] : drvs)
+        nodes.insert(drvPath);
+
+    ThreadPool pool;
+
+    processGraph<StorePath>(pool, nodes,
+        [&](const StorePath & drvPath) {
+            StorePathSet inputs;
+            for (auto & [inputDrv, _] : drvs.at(drvPath)->inputDrvs.map)
+                inputs.insert(inputDrv);
+            return inputs;
+        },
+        [&](const StorePath & drvPath) {
+            checkInterrupt();
+            memoizeDrvHash(store, drvPath, *drvs.at(drvPath));
+        });
 }
 
 /* See the header for interface details. These are the implementation details.
@@ -811,6 +968,20 @@ DrvHash hashDerivationModulo(Store & store, const Derivation & drv, bool maskOut
         }
     }, drv.type().raw);
 
+    /* If any inputs haven't been hashed yet, hash them and their
+       own unhashed inputs in parallel. */
+    {
+        StorePathSet unhashed;
+        {
+            auto hashes = drvHashes.lock();
+            for (auto & [drvPath, _] : drv.inputDrvs.map)
+                if (!hashes->count(drvPath))
+                    unhashed.insert(drvPath);
+        }
+        if (!unhashed.empty())
+            precomputeDrvHashes(store, unhashed);
+    }
+
     DerivedPathMap<StringSet>::ChildNode::Map inputs2;
     for (auto & [drvPath, node] : drv.inputDrvs.map) {
         const auto & res = pathDerivationModulo(store, drvPath);
@@ -0,0 +1,112 @@
+#include "drv-hash-cache.hh"
+#include "sync.hh"
+#include "sqlite.hh"
+#include "globals.hh"
+
+namespace nix {
+
+static const char * schema = R"sql(
+
+create table if not exists DrvHashes (
+    path   text primary key not null,
+    kind   integer not null,
+    hashes text not null -- space-separated list of <output>=<hash>
+);
+
+)sql";
+
+class DrvHashCacheImpl : public DrvHashCache
+{
+public:
+
+    struct State
+    {
+        SQLite db;
+        SQLiteStmt insertHash, queryHash;
+    };
+
+    Sync<State> _state;
+
+    DrvHashCacheImpl(Path dbPath = getCacheDir() + "/nix/drv-hashes-v1.sqlite")
+    {
+        auto state(_state.lock());
+
+        createDirs(dirOf(dbPath));
+
+        state->db = SQLite(dbPath);
+
+        state->db.isCache();
+
+        state->db.exec(schema);
+
+        state->insertHash.create(state->db,
+            "insert or replace into DrvHashes(path, kind, hashes) values (?, ?, ?)");
+
+        state->queryHash.create(state->db,
+            "select kind, hashes from DrvHashes where path = ?");
+    }
+
+    std::optional<DrvHash> lookup(const Path & drvPath) override
+    {
+        return retrySQLite<std::optional<DrvHash>>([&]() -> std::optional<DrvHash> {
+            auto state(_state.lock());
+
+            auto queryHash(state->queryHash.use()(drvPath));
+            if (!queryHash.next())
+                return std::nullopt;
+
+            DrvHash res {
+                .kind = queryHash.getInt(0) ? DrvHash::Kind::Deferred : DrvHash::Kind::Regular,
+            };
+
+            for (auto & s : tokenizeString<Strings>(queryHash.getStr(1), " ")) {
+                auto eq = s.find('=');
+                if (eq == s.npos)
+                    throw Error("invalid entry '%s' in the derivation hash cache", s);
+                res.hashes.insert_or_assign(s.substr(0, eq), Hash::parseAnyPrefixed(s.substr(eq + 1)));
+            }
+
+            return res;
+        });
+    }
+
+    void upsert(const Path & drvPath, const DrvHash & hash) override
+    {
+        std::string hashes;
+        for (auto & [outputName, h] : hash.hashes) {
+            if (!hashes.empty()) hashes.push_back(' ');
+            hashes += outputName + "=" + h.to_string(HashFormat::Base16, true);
+        }
+
+        retrySQLite<void>([&]() {
+            auto state(_state.lock());
+
+            state->insertHash.use()
+                (drvPath)
+                (hash.kind == DrvHash::Kind::Deferred ? 1 : 0)
+                (hashes)
+                .exec();
+        });
+    }
+};
+
+std::shared_ptr<DrvHashCache> getDrvHashCache()
+{
+    static std::shared_ptr<DrvHashCache> cache = []() -> std::shared_ptr<DrvHashCache> {
+        if (!settings.useDrvHashCache) return nullptr;
+        try {
+            return std::make_shared<DrvHashCacheImpl>();
+        } catch (Error & e) {
+            debug("cannot open the derivation hash cache: %s", e.msg());
+            return nullptr;
+        }
+    }();
+    return cache;
+}
+
+ref<DrvHashCache> getTestDrvHashCache(Path dbPath)
+{
+    return make_ref<DrvHashCacheImpl>(dbPath);
+}
+
+}
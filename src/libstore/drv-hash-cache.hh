@@ -0,0 +1,36 @@
+#pragma once
+///@file
+
+#include "ref.hh"
+#include "derivations.hh"
+
+namespace nix {
+
+/**
+ * A persistent cache of the results of `hashDerivationModulo()` for
+ * derivations in the store, shared by all processes of a user. The
+ * hash of a derivation is a function of the contents of the
+ * derivation and its inputs, which are all determined by the
+ * derivation's store path, so entries never become stale.
+ */
+class DrvHashCache
+{
+public:
+
+    virtual ~DrvHashCache() { }
+
+    virtual std::optional<DrvHash> lookup(const Path & drvPath) = 0;
+
+    virtual void upsert(const Path & drvPath, const DrvHash & hash) = 0;
+};
+
+/**
+ * Return a singleton cache object that can be used concurrently by
+ * multiple threads, or `nullptr` if the cache is disabled or cannot
+ * be opened.
+ */
+std::shared_ptr<DrvHashCache> getDrvHashCache();
+
+ref<DrvHashCache> getTestDrvHashCache(Path dbPath);
+
+}
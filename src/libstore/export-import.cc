@@ -3,6 +3,8 @@
 #include "archive.hh"
 #include "common-protocol.hh"
 #include "common-protocol-impl.hh"
+#include "compression.hh"
+#include "thread-pool.hh"
 
 #include <algorithm>
 
@@ -54,11 +56,239 @@ void Store::exportPath(const StorePath & path, Sink & sink)
         << 0;
 }
 
+/**
+ * Writes data in the frames expected by `FramedSource`, without a
+ * terminating empty frame.
+ */
+struct FrameWriter : BufferedSink
+{
+    Sink & to;
+
+    FrameWriter(Sink & to) : BufferedSink(FramedSink::frameSize), to(to) { }
+
+    void writeUnbuffered(std::string_view data) override
+    {
+        to << data.size();
+        to(data);
+    }
+};
+
+void Store::exportArchive(const StorePathSet & paths, Sink & sink, const std::string & compression)
+{
+    auto sorted = topoSortPaths(paths);
+    std::reverse(sorted.begin(), sorted.end());
+
+    auto infos = queryPathInfos(paths);
+
+    /* The index. */
+    sink << exportArchiveMagic << 2 << sorted.size();
+    for (auto & path : sorted) {
+        auto & info = infos.at(path);
+        sink << printStorePath(path);
+        CommonProto::write(*this,
+            CommonProto::WriteConn { .to = sink },
+            info->references);
+        sink
+            << (info->deriver ? printStorePath(*info->deriver) : "")
+            << info->narHash.to_string(HashFormat::Base32, true)
+            << info->narSize
+            << compression;
+    }
+
+    /* The NARs, in the order of the index, each compressed and
+       framed so that they can be streamed without knowing their
+       compressed size in advance. */
+    for (auto & path : sorted) {
+        auto & info = infos.at(path);
+
+        HashSink hashSink(htSHA256);
+        {
+            FrameWriter frames(sink);
+            auto compressionSink = makeCompressionSink(compression, frames, true);
+            TeeSink teeSink(*compressionSink, hashSink);
+            narFromPath(path, teeSink);
+            compressionSink->finish();
+            frames.flush();
+        }
+        sink << 0;
+
+        /* Refuse to export paths that have changed, as exportPath()
+           does. The importer checks the hashes in the index, so it
+           rejects the archive. */
+        Hash hash = hashSink.currentHash().first;
+        if (hash != info->narHash && info->narHash != Hash(info->narHash.type))
+            throw Error("hash of path '%s' has changed from '%s' to '%s'!",
+                printStorePath(path), info->narHash.to_string(HashFormat::Base32, true), hash.to_string(HashFormat::Base32, true));
+    }
+}
+
+/**
+ * The amount of compressed NAR data that importArchive() reads ahead
+ * of the paths being restored.
+ */
+static constexpr uint64_t importBufferSize = 256 * 1024 * 1024;
+
+static StorePaths importArchive(Store & store, Source & source, CheckSigsFlag checkSigs)
+{
+    auto version = readNum<uint64_t>(source);
+    if (version != 2)
+        throw Error("export archive has unsupported version %d", version);
+
+    struct Entry
+    {
+        ValidPathInfo info;
+        std::string compression;
+        std::string data;
+        bool read = false;
+        size_t depsLeft = 0;
+        std::vector<size_t> dependents;
+    };
+
+    std::vector<Entry> entries;
+    std::map<StorePath, size_t> positions;
+
+    auto count = readNum<size_t>(source);
+    for (size_t n = 0; n < count; ++n) {
+        auto path = store.parseStorePath(readString(source));
+        auto references = CommonProto::Serialise<StorePathSet>::read(store,
+            CommonProto::ReadConn { .from = source });
+        auto deriver = readString(source);
+        ValidPathInfo info { path, Hash::parseAnyPrefixed(readString(source)) };
+        if (deriver != "")
+            info.deriver = store.parseStorePath(deriver);
+        info.references = references;
+        info.narSize = readNum<uint64_t>(source);
+        auto compression = readString(source);
+        if (!positions.emplace(path, n).second)
+            throw Error("export archive contains '%s' twice", store.printStorePath(path));
+        entries.push_back(Entry { .info = std::move(info), .compression = compression });
+    }
+
+    /* A path can only be added after the paths it refers to. */
+    for (size_t n = 0; n < count; ++n)
+        for (auto & ref : entries[n].info.references) {
+            auto i = positions.find(ref);
+            if (i == positions.end() || i->second == n) continue;
+            entries[n].depsLeft++;
+            entries[i->second].dependents.push_back(n);
+        }
+
+    struct State
+    {
+        uint64_t buffered = 0;
+        size_t running = 0;
+        size_t done = 0;
+        bool failed = false;
+    };
+
+    Sync<State> state_;
+    std::condition_variable wakeup;
+    ThreadPool pool;
+
+    std::function<void(size_t)> restore;
+
+    restore = [&](size_t n) {
+        if (state_.lock()->failed) return;
+
+        auto & entry = entries[n];
+        auto dataSize = entry.data.size();
+
+        try {
+            checkInterrupt();
+
+            auto nar = entry.compression == "none"
+                ? std::move(entry.data)
+                : decompress(entry.compression, entry.data);
+            entry.data = std::string();
+
+            auto narHash = hashString(entry.info.narHash.type, nar);
+            if (narHash != entry.info.narHash)
+                throw Error("hash mismatch importing path '%s';\n  specified: %s\n  got:       %s",
+                    store.printStorePath(entry.info.path),
+                    entry.info.narHash.to_string(HashFormat::SRI, true),
+                    narHash.to_string(HashFormat::SRI, true));
+            if (nar.size() != entry.info.narSize)
+                throw Error("size mismatch importing path '%s'", store.printStorePath(entry.info.path));
+
+            StringSource source(nar);
+            store.addToStore(entry.info, source, NoRepair, checkSigs);
+        } catch (...) {
+            auto state(state_.lock());
+            state->failed = true;
+            wakeup.notify_all();
+            throw;
+        }
+
+        auto state(state_.lock());
+        state->buffered -= dataSize;
+        state->running--;
+        state->done++;
+        for (auto dependent : entry.dependents)
+            if (!--entries[dependent].depsLeft && entries[dependent].read) {
+                state->running++;
+                pool.enqueue(std::bind(restore, dependent));
+            }
+        wakeup.notify_all();
+    };
+
+    /* Read the NARs while restoring the ones that have been read and
+       whose references have been restored. Reading waits while too
+       much data is buffered, unless nothing is being restored that
+       would free it. */
+    try {
+        for (size_t n = 0; n < count; ++n) {
+            {
+                auto state(state_.lock());
+                while (!state->failed && state->running && state->buffered >= importBufferSize)
+                    state.wait(wakeup);
+                if (state->failed) break;
+            }
+
+            FramedSource frames(source);
+            auto data = frames.drain();
+
+            auto state(state_.lock());
+            auto & entry = entries[n];
+            state->buffered += data.size();
+            entry.data = std::move(data);
+            entry.read = true;
+            if (!entry.depsLeft) {
+                state->running++;
+                pool.enqueue(std::bind(restore, n));
+            }
+        }
+    } catch (...) {
+        /* Wait for the restores that have started, since they refer
+           to the state above. */
+        state_.lock()->failed = true;
+        try {
+            pool.process();
+        } catch (...) {
+            ignoreException();
+        }
+        throw;
+    }
+
+    pool.process();
+
+    if (state_.lock()->done != count)
+        throw Error("export archive is not sorted topologically");
+
+    StorePaths res;
+    for (auto & entry : entries)
+        res.push_back(entry.info.path);
+    return res;
+}
+
 StorePaths Store::importPaths(Source & source, CheckSigsFlag checkSigs)
 {
     StorePaths res;
+    bool first = true;
     while (true) {
         auto n = readNum<uint64_t>(source);
+        if (first && n == exportArchiveMagic)
+            return importArchive(*this, source, checkSigs);
+        first = false;
         if (n == 0) break;
         if (n != 1) throw Error("input doesn't look like something created by 'nix-store --export'");
 
@@ -0,0 +1,192 @@
+#include "file-hash-cache.hh"
+#include "archive.hh"
+#include "globals.hh"
+#include "sqlite.hh"
+#include "sync.hh"
+
+#include <sys/stat.h>
+
+namespace nix {
+
+static const char * schema = R"sql(
+
+create table if not exists FileHashes (
+    path        text not null,
+    method      integer not null,
+    hashType    text not null,
+    fingerprint text not null,
+    hash        text not null,
+    primary key (path, method, hashType)
+);
+
+)sql";
+
+struct FileHashDb
+{
+    struct State
+    {
+        SQLite db;
+        SQLiteStmt insertHash, queryHash;
+    };
+
+    Sync<State> _state;
+
+    FileHashDb()
+    {
+        auto state(_state.lock());
+
+        auto dbPath = getCacheDir() + "/nix/file-hashes-v1.sqlite";
+        createDirs(dirOf(dbPath));
+
+        state->db = SQLite(dbPath);
+
+        state->db.isCache();
+
+        state->db.exec(schema);
+
+        state->insertHash.create(state->db,
+            "insert or replace into FileHashes(path, method, hashType, fingerprint, hash) values (?, ?, ?, ?, ?)");
+
+        state->queryHash.create(state->db,
+            "select hash from FileHashes where path = ? and method = ? and hashType = ? and fingerprint = ?");
+    }
+};
+
+static std::shared_ptr<FileHashDb> getFileHashDb()
+{
+    static std::shared_ptr<FileHashDb> db = []() -> std::shared_ptr<FileHashDb> {
+        if (!settings.useFileHashCache) return nullptr;
+        try {
+            return std::make_shared<FileHashDb>();
+        } catch (Error & e) {
+            debug("cannot open the file hash cache: %s", e.msg());
+            return nullptr;
+        }
+    }();
+    return db;
+}
+
+static std::string showStat(const struct stat & st)
+{
+    return fmt("%o %d %d %d %d %d %d %d",
+        st.st_mode, st.st_size, st.st_dev, st.st_ino,
+#if __APPLE__
+        st.st_mtime, st.st_mtimespec.tv_nsec, st.st_ctime, st.st_ctimespec.tv_nsec
+#else
+        st.st_mtime, st.st_mtim.tv_nsec, st.st_ctime, st.st_ctim.tv_nsec
+#endif
+        );
+}
+
+/**
+ * Return a fingerprint of the metadata of the files that determine
+ * the hash of `path`, or `std::nullopt` if some file has been
+ * modified too recently to be cached safely.
+ */
+static std::optional<std::string> fingerprintPath(const Path & path, FileIngestionMethod method)
+{
+    auto now = time(nullptr);
+
+    auto isRacy = [&](const struct stat & st) {
+        return st.st_mtime >= now - 2 || st.st_ctime >= now - 2;
+    };
+
+    if (method == FileIngestionMethod::Flat) {
+        auto st = nix::stat(path);
+        if (isRacy(st)) return std::nullopt;
+        return showStat(st);
+    }
+
+    HashSink sink(htSHA256);
+
+    std::function<bool(const Path &)> recurse;
+    recurse = [&](const Path & path) {
+        checkInterrupt();
+        auto st = nix::lstat(path);
+        if (isRacy(st)) return false;
+        sink(path);
+        sink(std::string_view("\0", 1));
+        sink(showStat(st));
+        sink(std::string_view("\0", 1));
+        if (S_ISDIR(st.st_mode)) {
+            auto entries = readDirectory(path);
+            std::sort(entries.begin(), entries.end(),
+                [](const DirEntry & a, const DirEntry & b) { return a.name < b.name; });
+            for (auto & entry : entries)
+                if (!recurse(path + "/" + entry.name)) return false;
+        }
+        return true;
+    };
+
+    if (!recurse(path)) return std::nullopt;
+
+    return sink.finish().first.to_string(HashFormat::Base16, false);
+}
+
+Hash hashPathCached(const Path & path, FileIngestionMethod method, HashType ht)
+{
+    typedef std::tuple<Path, FileIngestionMethod, HashType> Key;
+    static Sync<std::map<Key, std::pair<std::string, Hash>>> memoryCache;
+
+    auto compute = [&]() {
+        return method == FileIngestionMethod::Flat
+            ? hashFile(ht, path)
+            : hashPath(ht, path).first;
+    };
+
+    auto fingerprint = fingerprintPath(path, method);
+    if (!fingerprint) return compute();
+
+    Key key{path, method, ht};
+
+    {
+        auto cache(memoryCache.lock());
+        auto i = cache->find(key);
+        if (i != cache->end() && i->second.first == *fingerprint)
+            return i->second.second;
+    }
+
+    auto db = getFileHashDb();
+
+    std::optional<Hash> hash;
+
+    if (db) {
+        hash = retrySQLite<std::optional<Hash>>([&]() -> std::optional<Hash> {
+            auto state(db->_state.lock());
+            auto queryHash(state->queryHash.use()
+                (path)
+                (method == FileIngestionMethod::Recursive ? 1 : 0)
+                (printHashType(ht))
+                (*fingerprint));
+            if (!queryHash.next()) return std::nullopt;
+            return Hash::parseAnyPrefixed(queryHash.getStr(0));
+        });
+    }
+
+    if (!hash) {
+        hash = compute();
+
+        /* Don't record the hash if the file changed while we were
+           reading it. */
+        if (fingerprintPath(path, method) != fingerprint)
+            return *hash;
+
+        if (db)
+            retrySQLite<void>([&]() {
+                auto state(db->_state.lock());
+                state->insertHash.use()
+                    (path)
+                    (method == FileIngestionMethod::Recursive ? 1 : 0)
+                    (printHashType(ht))
+                    (*fingerprint)
+                    (hash->to_string(HashFormat::Base16, true))
+                    .exec();
+            });
+    }
+
+    memoryCache.lock()->insert_or_assign(key, std::make_pair(*fingerprint, *hash));
+
+    return *hash;
+}
+
+}
@@ -0,0 +1,23 @@
+#pragma once
+///@file
+
+#include "hash.hh"
+#include "content-address.hh"
+
+namespace nix {
+
+/**
+ * Return the hash of the contents of the file `path` (if `method` is
+ * `Flat`) or of its NAR serialisation (if `method` is `Recursive`).
+ *
+ * Results are cached in memory and, if the `file-hash-cache` setting
+ * is enabled, in a SQLite database shared by all processes of a user.
+ * Entries are validated against a fingerprint of the metadata (size,
+ * inode, modification and status change times) of the files involved,
+ * so unchanged files are not read again. Files modified in the last
+ * few seconds are never cached, since further changes within the
+ * timestamp granularity would go unnoticed.
+ */
+Hash hashPathCached(const Path & path, FileIngestionMethod method, HashType ht);
+
+}
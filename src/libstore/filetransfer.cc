@@ -6,6 +6,7 @@
 #include "compression.hh"
 #include "finally.hh"
 #include "callback.hh"
+#include "startup-profile.hh"
 
 #if ENABLE_S3
 #include <aws/core/client/ClientConfiguration.h>
@@ -17,9 +18,11 @@
 #include <curl/curl.h>
 
 #include <algorithm>
+#include <array>
 #include <cmath>
 #include <cstring>
 #include <iostream>
+#include <mutex>
 #include <queue>
 #include <random>
 #include <thread>
@@ -37,6 +40,10 @@ struct curlFileTransfer : public FileTransfer
 {
     CURLM * curlm = 0;
 
+    /* Shares DNS lookups and TLS sessions between all transfers. */
+    CURLSH * curlsh = 0;
+    std::array<std::mutex, CURL_LOCK_DATA_LAST> shareLocks;
+
     std::random_device rd;
     std::mt19937 mt19937;
 
@@ -66,6 +73,27 @@ struct curlFileTransfer : public FileTransfer
 
         curl_off_t writtenToSink = 0;
 
+        /**
+         * Data received by earlier attempts of a download into
+         * memory, from which the next attempt resumes.
+         */
+        std::string partialData;
+
+        /**
+         * The `Last-Modified` header of the response, used like the
+         * ETag to check that a resumed download continues the same
+         * file.
+         */
+        std::string lastModified;
+
+        bool ifRangeSent = false;
+
+        /**
+         * Whether the transfer has been paused because of
+         * `request.shouldPause`.
+         */
+        bool paused = false;
+
         inline static const std::set<long> successfulStatuses {200, 201, 204, 206, 304, 0 /* other protocol */};
         /* Get the HTTP status code, or 0 for other protocols. */
         long getHTTPStatus()
@@ -150,8 +178,28 @@ struct curlFileTransfer : public FileTransfer
 
         std::exception_ptr writeException;
 
+        /**
+         * Whether the server ignored the range we asked for and
+         * started sending the whole file.
+         */
+        bool rangeIgnored = false;
+
         size_t writeCallback(void * contents, size_t size, size_t nmemb)
         {
+            /* Don't download a whole file when only part of it was
+               requested. */
+            if (request.range && getHTTPStatus() == 200) {
+                rangeIgnored = true;
+                return 0;
+            }
+
+            /* Decide before decompressing, since curl hands us the
+               same data again after unpausing. */
+            if (request.shouldPause && request.shouldPause()) {
+                paused = true;
+                return CURL_WRITEFUNC_PAUSE;
+            }
+
             try {
                 size_t realSize = size * nmemb;
                 result.bodySize += realSize;
@@ -195,6 +243,7 @@ struct curlFileTransfer : public FileTransfer
                 statusMsg = trim(match.str(1));
                 acceptRanges = false;
                 encoding = "";
+                lastModified = "";
             } else {
 
                 auto i = line.find(':');
@@ -219,6 +268,9 @@ struct curlFileTransfer : public FileTransfer
                     else if (name == "content-encoding")
                         encoding = trim(line.substr(i + 1));
 
+                    else if (name == "last-modified")
+                        lastModified = trim(line.substr(i + 1));
+
                     else if (name == "accept-ranges" && toLower(trim(line.substr(i + 1))) == "bytes")
                         acceptRanges = true;
 
@@ -285,6 +337,8 @@ struct curlFileTransfer : public FileTransfer
 
             curl_easy_reset(req);
 
+            curl_easy_setopt(req, CURLOPT_SHARE, fileTransfer.curlsh);
+
             if (verbosity >= lvlVomit) {
                 curl_easy_setopt(req, CURLOPT_VERBOSE, 1);
                 curl_easy_setopt(req, CURLOPT_DEBUGFUNCTION, TransferItem::debugCallback);
@@ -348,8 +402,13 @@ struct curlFileTransfer : public FileTransfer
             curl_easy_setopt(req, CURLOPT_NETRC_FILE, settings.netrcFile.get().c_str());
             curl_easy_setopt(req, CURLOPT_NETRC, CURL_NETRC_OPTIONAL);
 
-            if (writtenToSink)
-                curl_easy_setopt(req, CURLOPT_RESUME_FROM_LARGE, writtenToSink);
+            if (auto offset = request.dataCallback ? writtenToSink : (curl_off_t) partialData.size())
+                curl_easy_setopt(req, CURLOPT_RESUME_FROM_LARGE, offset);
+
+            if (request.range) {
+                auto range = fmt("%d-%d", request.range->first, request.range->first + request.range->second - 1);
+                curl_easy_setopt(req, CURLOPT_RANGE, range.c_str());
+            }
 
             result.data.clear();
             result.bodySize = 0;
@@ -375,6 +434,14 @@ struct curlFileTransfer : public FileTransfer
                 }
             }
 
+            /* Report a successful download of nothing, which callers
+               can tell apart from the requested range. */
+            if (code == CURLE_WRITE_ERROR && rangeIgnored) {
+                code = CURLE_OK;
+                result.data.clear();
+                result.bodySize = 0;
+            }
+
             if (code == CURLE_WRITE_ERROR && result.etag == request.expectedETag) {
                 code = CURLE_OK;
                 httpStatus = 304;
@@ -393,6 +460,11 @@ struct curlFileTransfer : public FileTransfer
                 if (httpStatus == 304 && result.etag == "")
                     result.etag = request.expectedETag;
 
+                if (!partialData.empty()) {
+                    result.data = std::move(partialData) + result.data;
+                    result.bodySize = result.data.size();
+                }
+
                 act.progress(result.bodySize, result.bodySize);
                 done = true;
                 callback(std::move(result));
@@ -419,6 +491,11 @@ struct curlFileTransfer : public FileTransfer
                     //   * 505 http version not supported
                     //   * 511 we're behind a captive portal
                     err = Misc;
+                } else if (code == CURLE_RANGE_ERROR && this->request.dataCallback && writtenToSink) {
+                    // The server didn't resume the download, possibly
+                    // because the file changed, and we can't take
+                    // back the data already written to the sink
+                    err = Misc;
                 } else {
                     // Don't bother retrying on certain cURL errors either
 
@@ -467,19 +544,49 @@ struct curlFileTransfer : public FileTransfer
                         "unable to %s '%s': %s (%d)",
                         request.verb(), request.uri, curl_easy_strerror(code), code);
 
+                /* Resume downloads into memory from where this
+                   attempt stopped if the server supports ranged
+                   requests, unless it didn't resume this attempt. */
+                bool resumable =
+                    (acceptRanges || httpStatus == 206)
+                    && encoding.empty()
+                    && !request.range
+                    && (httpStatus == 200 || httpStatus == 206);
+
+                if (!this->request.dataCallback) {
+                    if (resumable && code != CURLE_RANGE_ERROR)
+                        partialData += result.data;
+                    else
+                        partialData.clear();
+                }
+
+                /* Make sure that a resumed download continues the
+                   same file; otherwise the server sends the whole
+                   file, which curl reports as a range error. */
+                if (resumable && !ifRangeSent) {
+                    auto validator =
+                        !result.etag.empty() && !hasPrefix(result.etag, "W/")
+                        ? result.etag
+                        : lastModified;
+                    if (!validator.empty()) {
+                        requestHeaders = curl_slist_append(requestHeaders, ("If-Range: " + validator).c_str());
+                        ifRangeSent = true;
+                    }
+                }
+
                 /* If this is a transient error, then maybe retry the
                    download after a while. If we're writing to a
-                   sink, we can only retry if the server supports
-                   ranged requests. */
+                   sink, we can only retry if the download can be
+                   resumed. */
                 if (err == Transient
                     && attempt < request.tries
                     && (!this->request.dataCallback
                         || writtenToSink == 0
-                        || (acceptRanges && encoding.empty())))
+                        || resumable))
                 {
                     int ms = request.baseRetryTimeMs * std::pow(2.0f, attempt - 1 + std::uniform_real_distribution<>(0.0, 0.5)(fileTransfer.mt19937));
-                    if (writtenToSink)
-                        warn("%s; retrying from offset %d in %d ms", exc.what(), writtenToSink, ms);
+                    if (auto offset = this->request.dataCallback ? writtenToSink : (curl_off_t) partialData.size())
+                        warn("%s; retrying from offset %d in %d ms", exc.what(), offset, ms);
                     else
                         warn("%s; retrying in %d ms", exc.what(), ms);
                     embargo = std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
@@ -514,6 +621,10 @@ struct curlFileTransfer : public FileTransfer
     curlFileTransfer()
         : mt19937(rd())
     {
+        state_.setName("file-transfer");
+
+        StartupPhase phase("initialise libcurl");
+
         static std::once_flag globalInit;
         std::call_once(globalInit, curl_global_init, CURL_GLOBAL_ALL);
 
@@ -525,8 +636,20 @@ struct curlFileTransfer : public FileTransfer
         #if LIBCURL_VERSION_NUM >= 0x071e00 // Max connections requires >= 7.30.0
         curl_multi_setopt(curlm, CURLMOPT_MAX_TOTAL_CONNECTIONS,
             fileTransferSettings.httpConnections.get());
+        curl_multi_setopt(curlm, CURLMOPT_MAX_HOST_CONNECTIONS,
+            fileTransferSettings.httpConnectionsPerHost.get());
         #endif
 
+        curlsh = curl_share_init();
+        curl_share_setopt(curlsh, CURLSHOPT_LOCKFUNC, lockShare);
+        curl_share_setopt(curlsh, CURLSHOPT_UNLOCKFUNC, unlockShare);
+        curl_share_setopt(curlsh, CURLSHOPT_USERDATA, this);
+        curl_share_setopt(curlsh, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(curlsh, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+
+        if (fileTransferSettings.tlsSessionCache)
+            importTlsSessions();
+
         wakeupPipe.create();
         fcntl(wakeupPipe.readSide.get(), F_SETFL, O_NONBLOCK);
 
@@ -540,6 +663,100 @@ struct curlFileTransfer : public FileTransfer
         workerThread.join();
 
         if (curlm) curl_multi_cleanup(curlm);
+
+        if (curlsh) {
+            if (fileTransferSettings.tlsSessionCache)
+                exportTlsSessions();
+            curl_share_cleanup(curlsh);
+        }
+    }
+
+    static void lockShare(CURL *, curl_lock_data data, curl_lock_access, void * userp)
+    {
+        ((curlFileTransfer *) userp)->shareLocks[data].lock();
+    }
+
+    static void unlockShare(CURL *, curl_lock_data data, void * userp)
+    {
+        ((curlFileTransfer *) userp)->shareLocks[data].unlock();
+    }
+
+    static Path tlsSessionsFile()
+    {
+        return getCacheDir() + "/nix/tls-sessions";
+    }
+
+    /* Load the TLS sessions saved by previous processes into the
+       share, so that the first connection to a server can resume a
+       session. Both this and exportTlsSessions() are best-effort. */
+    void importTlsSessions()
+    {
+        #if LIBCURL_VERSION_NUM >= 0x080c00
+        try {
+            auto path = tlsSessionsFile();
+            if (!pathExists(path)) return;
+
+            auto handle = curl_easy_init();
+            Finally cleanup([&]() { curl_easy_cleanup(handle); });
+            curl_easy_setopt(handle, CURLOPT_SHARE, curlsh);
+
+            auto contents = readFile(path);
+            StringSource source(contents);
+            auto now = time(nullptr);
+            while (source.pos < contents.size()) {
+                auto validUntil = readNum<uint64_t>(source);
+                auto key = readString(source);
+                auto shmac = readString(source);
+                auto data = readString(source);
+                if ((time_t) validUntil <= now) continue;
+                auto res = curl_easy_ssls_import(handle, key.c_str(),
+                    (const unsigned char *) shmac.data(), shmac.size(),
+                    (const unsigned char *) data.data(), data.size());
+                if (res == CURLE_NOT_BUILT_IN || res == CURLE_UNKNOWN_OPTION) return;
+            }
+        } catch (Error & e) {
+            debug("cannot load TLS sessions: %s", e.msg());
+        }
+        #endif
+    }
+
+    void exportTlsSessions()
+    {
+        #if LIBCURL_VERSION_NUM >= 0x080c00
+        try {
+            auto handle = curl_easy_init();
+            Finally cleanup([&]() { curl_easy_cleanup(handle); });
+            curl_easy_setopt(handle, CURLOPT_SHARE, curlsh);
+
+            StringSink sink;
+            auto callback = [](CURL *, void * userp,
+                const char * key,
+                const unsigned char * shmac, size_t shmacLen,
+                const unsigned char * data, size_t dataLen,
+                curl_off_t validUntil,
+                int, const char *, size_t) -> CURLcode
+            {
+                auto & sink = *(StringSink *) userp;
+                sink << (uint64_t) validUntil
+                    << std::string_view(key)
+                    << std::string_view((const char *) shmac, shmacLen)
+                    << std::string_view((const char *) data, dataLen);
+                return CURLE_OK;
+            };
+            if (curl_easy_ssls_export(handle, callback, &sink) != CURLE_OK || sink.s.empty())
+                return;
+
+            /* Session tickets are secrets, so don't make them
+               readable by others. */
+            auto path = tlsSessionsFile();
+            createDirs(dirOf(path));
+            auto tmp = fmt("%s.tmp.%d", path, getpid());
+            writeFile(tmp, sink.s, 0600);
+            renameFile(tmp, path);
+        } catch (Error & e) {
+            debug("cannot save TLS sessions: %s", e.msg());
+        }
+        #endif
     }
 
     void stopWorkerThread()
@@ -563,6 +780,9 @@ struct curlFileTransfer : public FileTransfer
 
         std::map<CURL *, std::shared_ptr<TransferItem>> items;
 
+        /* Bulk transfers that are waiting for a free slot. */
+        std::queue<std::shared_ptr<TransferItem>> bulkItems;
+
         bool quit = false;
 
         std::chrono::steady_clock::time_point nextWakeup;
@@ -618,6 +838,13 @@ struct curlFileTransfer : public FileTransfer
                     throw SysError("reading curl wakeup socket");
             }
 
+            for (auto & [req, item] : items) {
+                if (item->paused && !item->request.shouldPause()) {
+                    item->paused = false;
+                    curl_easy_pause(req, CURLPAUSE_CONT);
+                }
+            }
+
             std::vector<std::shared_ptr<TransferItem>> incoming;
             auto now = std::chrono::steady_clock::now();
 
@@ -638,12 +865,27 @@ struct curlFileTransfer : public FileTransfer
                 quit = state->quit;
             }
 
-            for (auto & item : incoming) {
+            auto start = [&](std::shared_ptr<TransferItem> item) {
                 debug("starting %s of %s", item->request.verb(), item->request.uri);
                 item->init();
                 curl_multi_add_handle(curlm, item->req);
                 item->active = true;
                 items[item->req] = item;
+            };
+
+            for (auto & item : incoming) {
+                if (item->request.bulk)
+                    bulkItems.push(item);
+                else
+                    start(item);
+            }
+
+            /* Don't let curl queue bulk transfers internally, since
+               other transfers would then have to wait for them. */
+            auto maxBulk = fileTransferSettings.httpConnections.get();
+            while (!bulkItems.empty() && (maxBulk == 0 || items.size() < maxBulk)) {
+                start(bulkItems.front());
+                bulkItems.pop();
             }
         }
 
@@ -666,6 +908,11 @@ struct curlFileTransfer : public FileTransfer
         }
     }
 
+    void unpause() override
+    {
+        writeFull(wakeupPipe.writeSide.get(), " ", false);
+    }
+
     void enqueueItem(std::shared_ptr<TransferItem> item)
     {
         if (item->request.data
@@ -778,7 +1025,7 @@ FileTransferResult FileTransfer::upload(const FileTransferRequest & request)
     return enqueueFileTransfer(request).get();
 }
 
-void FileTransfer::download(FileTransferRequest && request, Sink & sink)
+FileTransferResult FileTransfer::download(FileTransferRequest && request, Sink & sink)
 {
     /* Note: we can't call 'sink' via request.dataCallback, because
        that would cause the sink to execute on the fileTransfer
@@ -786,64 +1033,63 @@ void FileTransfer::download(FileTransferRequest && request, Sink & sink)
        sink is expensive (e.g. one that does decompression and writing
        to the Nix store), it would stall the download thread too much.
        Therefore we use a buffer to communicate data between the
-       download thread and the calling thread. */
+       download thread and the calling thread. When the buffer is
+       full, the transfer is paused until the calling thread has
+       emptied it, so memory use stays bounded no matter how slow the
+       sink is. */
+
+    static constexpr size_t bufferSize = 1024 * 1024;
 
     struct State {
         bool quit = false;
         std::exception_ptr exc;
+        std::optional<FileTransferResult> result;
         std::string data;
-        std::condition_variable avail, request;
+        std::condition_variable avail;
     };
 
     auto _state = std::make_shared<Sync<State>>();
 
-    /* In case of an exception, wake up the download thread. FIXME:
-       abort the download request. */
+    /* In case of an exception, let the download thread discard the
+       remaining data. FIXME: abort the download request. */
     Finally finally([&]() {
-        auto state(_state->lock());
-        state->quit = true;
-        state->request.notify_one();
+        _state->lock()->quit = true;
+        unpause();
     });
 
     request.dataCallback = [_state](std::string_view data) {
-
         auto state(_state->lock());
 
         if (state->quit) return;
 
-        /* If the buffer is full, then go to sleep until the calling
-           thread wakes us up (i.e. when it has removed data from the
-           buffer). We don't wait forever to prevent stalling the
-           download thread. (Hopefully sleeping will throttle the
-           sender.) */
-        if (state->data.size() > 1024 * 1024) {
-            debug("download buffer is full; going to sleep");
-            state.wait_for(state->request, std::chrono::seconds(10));
-        }
-
         /* Append data to the buffer and wake up the calling
            thread. */
         state->data.append(data);
         state->avail.notify_one();
     };
 
+    request.shouldPause = [_state]() {
+        auto state(_state->lock());
+        return !state->quit && state->data.size() >= bufferSize;
+    };
+
     enqueueFileTransfer(request,
         {[_state](std::future<FileTransferResult> fut) {
             auto state(_state->lock());
             state->quit = true;
             try {
-                fut.get();
+                state->result = fut.get();
             } catch (...) {
                 state->exc = std::current_exception();
             }
             state->avail.notify_one();
-            state->request.notify_one();
         }});
 
     while (true) {
         checkInterrupt();
 
         std::string chunk;
+        bool wasFull;
 
         /* Grab data if available, otherwise wait for the download
            thread to wake us up. */
@@ -854,7 +1100,7 @@ void FileTransfer::download(FileTransferRequest && request, Sink & sink)
 
                 if (state->quit) {
                     if (state->exc) std::rethrow_exception(state->exc);
-                    return;
+                    return std::move(*state->result);
                 }
 
                 state.wait(state->avail);
@@ -862,17 +1108,18 @@ void FileTransfer::download(FileTransferRequest && request, Sink & sink)
                 if (state->data.empty()) continue;
             }
 
+            wasFull = state->data.size() >= bufferSize;
+
             chunk = std::move(state->data);
             /* Reset state->data after the move, since we check data.empty() */
             state->data = "";
-
-            state->request.notify_one();
         }
 
-        /* Flush the data to the sink and wake up the download thread
-           if it's blocked on a full buffer. We don't hold the state
-           lock while doing this to prevent blocking the download
-           thread if sink() takes a long time. */
+        if (wasFull) unpause();
+
+        /* Flush the data to the sink. We don't hold the state lock
+           while doing this to prevent blocking the download thread
+           if sink() takes a long time. */
         sink(chunk);
     }
 }
@@ -27,6 +27,15 @@ struct FileTransferSettings : Config
         )",
         {"binary-caches-parallel-connections"}};
 
+    Setting<size_t> httpConnectionsPerHost{
+        this, 0, "http-connections-per-host",
+        R"(
+          The maximum number of parallel TCP connections to a single
+          host. This keeps a burst of downloads from saturating one
+          binary cache or mirror. 0 means no limit other than
+          [`http-connections`](#conf-http-connections).
+        )"};
+
     Setting<unsigned long> connectTimeout{
         this, 0, "connect-timeout",
         R"(
@@ -43,6 +52,16 @@ struct FileTransferSettings : Config
           timeout's duration.
         )"};
 
+    Setting<bool> tlsSessionCache{
+        this, true, "tls-session-cache",
+        R"(
+          Whether to keep TLS session tickets in `~/.cache/nix/tls-sessions`
+          so that the next Nix process can resume TLS sessions with
+          binary caches and other servers instead of doing a full
+          handshake. This requires curl 8.12 or newer, built with
+          support for exporting SSL sessions.
+        )"};
+
     Setting<unsigned int> tries{this, 5, "download-attempts",
         "How often Nix will attempt to download a file before giving up."};
 };
@@ -63,6 +82,25 @@ struct FileTransferRequest
     std::optional<std::string> data;
     std::string mimeType;
     std::function<void(std::string_view data)> dataCallback;
+    /**
+     * If set, the transfer is paused while this returns true. This
+     * lets a slow consumer of `dataCallback` throttle the transfer
+     * without blocking the download thread. Call
+     * `FileTransfer::unpause()` when it may have become false.
+     */
+    std::function<bool()> shouldPause;
+    /**
+     * Whether this is a bulk transfer, such as a NAR download. Bulk
+     * transfers are only started while fewer than `http-connections`
+     * transfers are running, so that small requests such as
+     * `.narinfo` lookups don't queue behind them.
+     */
+    bool bulk = false;
+    /**
+     * If set, only download this many bytes (the second element)
+     * starting at this offset (the first element).
+     */
+    std::optional<std::pair<uint64_t, uint64_t>> range;
 
     FileTransferRequest(std::string_view uri)
         : uri(uri), parentAct(getCurActivity()) { }
@@ -114,9 +152,17 @@ struct FileTransfer
 
     /**
      * Download a file, writing its data to a sink. The sink will be
-     * invoked on the thread of the caller.
+     * invoked on the thread of the caller. At most a small, fixed
+     * amount of data is buffered; the transfer is paused while the
+     * sink is busy. The returned result has no `data`.
+     */
+    FileTransferResult download(FileTransferRequest && request, Sink & sink);
+
+    /**
+     * Make the download thread resume transfers that were paused by
+     * `FileTransferRequest::shouldPause`.
      */
-    void download(FileTransferRequest && request, Sink & sink);
+    virtual void unpause() = 0;
 
     enum Error { NotFound, Forbidden, Misc, Transient, Interrupted };
 };
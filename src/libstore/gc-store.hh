@@ -52,6 +52,19 @@ struct GCOptions
      * Stop after at least `maxFreed` bytes have been freed.
      */
     uint64_t maxFreed{std::numeric_limits<uint64_t>::max()};
+
+    /**
+     * Paths to treat as alive without checking, e.g. because a
+     * previous run found them to be alive. Any of them that have
+     * become garbage since are not deleted.
+     */
+    StorePathSet assumeAlive;
+
+    /**
+     * If non-zero, delete at most this many bytes per second on
+     * average, so that the collector doesn't starve other I/O.
+     */
+    uint64_t maxDeleteRate{0};
 };
 
 
@@ -68,6 +81,12 @@ struct GCResults
      * number of bytes that would be or was freed.
      */
     uint64_t bytesFreed = 0;
+
+    /**
+     * For `gcDeleteDead`, the paths found to be alive. This is not
+     * all of them if the collector stopped after `maxFreed` bytes.
+     */
+    StorePathSet alive;
 };
 
 
@@ -2,6 +2,7 @@
 #include "globals.hh"
 #include "local-store.hh"
 #include "finally.hh"
+#include "thread-pool.hh"
 
 #include <functional>
 #include <queue>
@@ -107,13 +108,34 @@ void LocalStore::createTempRootsFile()
 }
 
 
+/* The number of roots sent to the garbage collector before reading
+   its acknowledgements, so that these don't fill up the socket
+   buffer while we're still writing. */
+static constexpr size_t tempRootsChunkSize = 1024;
+
+
 void LocalStore::addTempRoot(const StorePath & path)
+{
+    addTempRoots({path});
+}
+
+
+void LocalStore::addTempRoots(const StorePathSet & paths)
 {
     if (readOnly) {
       debug("Read-only store doesn't support creating lock files for temp roots, but nothing can be deleted anyways.");
       return;
     }
 
+    std::vector<StorePath> todo;
+    {
+        auto added(_addedTempRoots.lock());
+        for (auto & path : paths)
+            if (!added->count(path))
+                todo.push_back(path);
+    }
+    if (todo.empty()) return;
+
     createTempRootsFile();
 
     /* Open/create the global GC lock file. */
@@ -132,7 +154,7 @@ void LocalStore::addTempRoot(const StorePath & path)
     if (!gcLock.acquired) {
         /* We couldn't get a shared global GC lock, so the garbage
            collector is running. So we have to connect to the garbage
-           collector and inform it about our root. */
+           collector and inform it about our roots. */
         auto fdRootsSocket(_fdRootsSocket.lock());
 
         if (!*fdRootsSocket) {
@@ -154,12 +176,20 @@ void LocalStore::addTempRoot(const StorePath & path)
         }
 
         try {
-            debug("sending GC root '%s'", printStorePath(path));
-            writeFull(fdRootsSocket->get(), printStorePath(path) + "\n", false);
-            char c;
-            readFull(fdRootsSocket->get(), &c, 1);
-            assert(c == '1');
-            debug("got ack for GC root '%s'", printStorePath(path));
+            for (size_t i = 0; i < todo.size(); i += tempRootsChunkSize) {
+                auto end = std::min(todo.size(), i + tempRootsChunkSize);
+                std::string s;
+                for (auto j = i; j < end; ++j) {
+                    s += printStorePath(todo[j]);
+                    s += '\n';
+                }
+                debug("sending %d GC roots", end - i);
+                writeFull(fdRootsSocket->get(), s, false);
+                std::string acks(end - i, 0);
+                readFull(fdRootsSocket->get(), acks.data(), acks.size());
+                for (auto c : acks) assert(c == '1');
+                debug("got ack for %d GC roots", end - i);
+            }
         } catch (SysError & e) {
             /* The garbage collector may have exited, so we need to
                restart. */
@@ -176,10 +206,18 @@ void LocalStore::addTempRoot(const StorePath & path)
         }
     }
 
-    /* Record the store path in the temporary roots file so it will be
-       seen by a future run of the garbage collector. */
-    auto s = printStorePath(path) + '\0';
+    /* Record the store paths in the temporary roots file so they will
+       be seen by a future run of the garbage collector. */
+    std::string s;
+    for (auto & path : todo) {
+        s += printStorePath(path);
+        s += '\0';
+    }
     writeFull(_fdTempRoots.lock()->get(), s);
+
+    auto added(_addedTempRoots.lock());
+    for (auto & path : todo)
+        added->insert(std::move(path));
 }
 
 
@@ -344,10 +382,65 @@ try_again:
             .emplace(file);
 }
 
-static std::string quoteRegexChars(const std::string & raw)
+/**
+ * Call `f` on every occurrence of a store path (i.e. `storeDir`
+ * followed by a slash and a store path name) in `s`. This is
+ * equivalent to matching the regular expression
+ * `storeDir/[0-9a-z]+[0-9a-zA-Z+\-._?=]*`, but searches for the store
+ * directory with `std::string_view::find()`, which is much faster.
+ */
+static void findStorePaths(std::string_view s, std::string_view storeDir, std::function<void(std::string_view)> f)
 {
-    static auto specialRegex = std::regex(R"([.^$\\*+?()\[\]{}|])");
-    return std::regex_replace(raw, specialRegex, R"(\$&)");
+    auto isNameStart = [](char c) {
+        return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z');
+    };
+
+    auto isNameChar = [&](char c) {
+        return isNameStart(c) || (c >= 'A' && c <= 'Z')
+            || c == '+' || c == '-' || c == '.' || c == '_' || c == '?' || c == '=';
+    };
+
+    size_t pos = 0;
+    while ((pos = s.find(storeDir, pos)) != s.npos) {
+        auto end = pos + storeDir.size();
+        if (end + 1 < s.size() && s[end] == '/' && isNameStart(s[end + 1])) {
+            end += 2;
+            while (end < s.size() && isNameChar(s[end])) end++;
+            f(s.substr(pos, end - pos));
+            pos = end;
+        } else
+            pos++;
+    }
+}
+
+/**
+ * Return the path name of a line in `/proc/<pid>/maps`, i.e. the
+ * sixth field, if it is an absolute path without whitespace.
+ */
+static std::optional<std::string_view> parseMapsLine(std::string_view line)
+{
+    auto isSpace = [](char c) { return c == ' ' || c == '\t'; };
+
+    size_t pos = 0;
+
+    for (int field = 0; field < 5; ++field) {
+        while (pos < line.size() && isSpace(line[pos])) pos++;
+        if (pos == line.size()) return std::nullopt;
+        while (pos < line.size() && !isSpace(line[pos])) pos++;
+        if (pos == line.size()) return std::nullopt;
+    }
+
+    while (pos < line.size() && isSpace(line[pos])) pos++;
+    if (pos == line.size() || line[pos] != '/') return std::nullopt;
+
+    auto end = pos + 1;
+    while (end < line.size() && !isSpace(line[end])) end++;
+    if (end == pos + 1) return std::nullopt;
+
+    for (auto i = end; i < line.size(); ++i)
+        if (!isSpace(line[i])) return std::nullopt;
+
+    return line.substr(pos, end - pos);
 }
 
 #if __linux__
@@ -368,58 +461,75 @@ void LocalStore::findRuntimeRoots(Roots & roots, bool censor)
 
     auto procDir = AutoCloseDir{opendir("/proc")};
     if (procDir) {
-        struct dirent * ent;
-        auto digitsRegex = std::regex(R"(^\d+$)");
-        auto mapRegex = std::regex(R"(^\s*\S+\s+\S+\s+\S+\s+\S+\s+\S+\s+(/\S+)\s*$)");
-        auto storePathRegex = std::regex(quoteRegexChars(storeDir) + R"(/[0-9a-z]+[0-9a-zA-Z\+\-\._\?=]*)");
-        while (errno = 0, ent = readdir(procDir.get())) {
-            checkInterrupt();
-            if (std::regex_match(ent->d_name, digitsRegex)) {
-                try {
-                    readProcLink(fmt("/proc/%s/exe" ,ent->d_name), unchecked);
-                    readProcLink(fmt("/proc/%s/cwd", ent->d_name), unchecked);
-
-                    auto fdStr = fmt("/proc/%s/fd", ent->d_name);
-                    auto fdDir = AutoCloseDir(opendir(fdStr.c_str()));
-                    if (!fdDir) {
-                        if (errno == ENOENT || errno == EACCES)
-                            continue;
-                        throw SysError("opening %1%", fdStr);
-                    }
-                    struct dirent * fd_ent;
-                    while (errno = 0, fd_ent = readdir(fdDir.get())) {
-                        if (fd_ent->d_name[0] != '.')
-                            readProcLink(fmt("%s/%s", fdStr, fd_ent->d_name), unchecked);
-                    }
-                    if (errno) {
-                        if (errno == ESRCH)
-                            continue;
-                        throw SysError("iterating /proc/%1%/fd", ent->d_name);
-                    }
-                    fdDir.reset();
-
-                    auto mapFile = fmt("/proc/%s/maps", ent->d_name);
-                    auto mapLines = tokenizeString<std::vector<std::string>>(readFile(mapFile), "\n");
-                    for (const auto & line : mapLines) {
-                        auto match = std::smatch{};
-                        if (std::regex_match(line, match, mapRegex))
-                            unchecked[match[1]].emplace(mapFile);
-                    }
+        /* Scan the processes in parallel, since reading their
+           `maps` and `environ` files can take a while when there
+           are many processes. */
+        Sync<UncheckedRoots> unchecked_;
+        ThreadPool pool;
+
+        auto scanProcess = [&](const std::string & pid) {
+            UncheckedRoots roots;
 
-                    auto envFile = fmt("/proc/%s/environ", ent->d_name);
-                    auto envString = readFile(envFile);
-                    auto env_end = std::sregex_iterator{};
-                    for (auto i = std::sregex_iterator{envString.begin(), envString.end(), storePathRegex}; i != env_end; ++i)
-                        unchecked[i->str()].emplace(envFile);
-                } catch (SysError & e) {
-                    if (errno == ENOENT || errno == EACCES || errno == ESRCH)
-                        continue;
-                    throw;
+            try {
+                readProcLink(fmt("/proc/%s/exe", pid), roots);
+                readProcLink(fmt("/proc/%s/cwd", pid), roots);
+
+                auto fdStr = fmt("/proc/%s/fd", pid);
+                auto fdDir = AutoCloseDir(opendir(fdStr.c_str()));
+                if (!fdDir) {
+                    if (errno == ENOENT || errno == EACCES)
+                        return;
+                    throw SysError("opening %1%", fdStr);
+                }
+                struct dirent * fd_ent;
+                while (errno = 0, fd_ent = readdir(fdDir.get())) {
+                    if (fd_ent->d_name[0] != '.')
+                        readProcLink(fmt("%s/%s", fdStr, fd_ent->d_name), roots);
+                }
+                if (errno) {
+                    if (errno == ESRCH)
+                        return;
+                    throw SysError("iterating /proc/%1%/fd", pid);
+                }
+                fdDir.reset();
+
+                auto mapFile = fmt("/proc/%s/maps", pid);
+                auto maps = readFile(mapFile);
+                for (std::string_view rest = maps; !rest.empty(); ) {
+                    auto eol = rest.find('\n');
+                    if (auto path = parseMapsLine(rest.substr(0, eol)))
+                        roots[std::string(*path)].emplace(mapFile);
+                    rest = eol == rest.npos ? std::string_view() : rest.substr(eol + 1);
                 }
+
+                auto envFile = fmt("/proc/%s/environ", pid);
+                findStorePaths(readFile(envFile), storeDir, [&](std::string_view path) {
+                    roots[std::string(path)].emplace(envFile);
+                });
+            } catch (SysError & e) {
+                if (errno == ENOENT || errno == EACCES || errno == ESRCH)
+                    return;
+                throw;
             }
+
+            auto unchecked(unchecked_.lock());
+            for (auto & [target, links] : roots)
+                (*unchecked)[target].merge(links);
+        };
+
+        struct dirent * ent;
+        while (errno = 0, ent = readdir(procDir.get())) {
+            checkInterrupt();
+            std::string_view name = ent->d_name;
+            if (!name.empty() && std::all_of(name.begin(), name.end(), [](char c) { return c >= '0' && c <= '9'; }))
+                pool.enqueue(std::bind(scanProcess, std::string(name)));
         }
         if (errno)
             throw SysError("iterating /proc");
+
+        pool.process();
+
+        unchecked = std::move(*unchecked_.lock());
     }
 
 #if !defined(__linux__)
@@ -466,13 +576,34 @@ void LocalStore::findRuntimeRoots(Roots & roots, bool censor)
 struct GCLimitReached { };
 
 
+/**
+ * Prefix of the directories in the store to which the garbage
+ * collector moves paths that are being deleted.
+ */
+static const std::string trashPrefix = ".gc-trash-";
+
+/**
+ * Maximum number of paths removed from the database in a single
+ * transaction when deleting paths in parallel.
+ */
+static const size_t gcBatchSize = 1024;
+
+
+struct PendingDeletion
+{
+    std::string baseName;
+    std::optional<StorePath> path;
+    uint64_t narSize;
+};
+
+
 void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
 {
     bool shouldDelete = options.action == GCOptions::gcDeleteDead || options.action == GCOptions::gcDeleteSpecific;
     bool gcKeepOutputs = settings.gcKeepOutputs;
     bool gcKeepDerivations = settings.gcKeepDerivations;
 
-    StorePathSet roots, dead, alive;
+    StorePathSet roots, dead, alive(options.assumeAlive);
 
     struct Shared
     {
@@ -480,9 +611,8 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
         // ignore suffixes like '.lock', '.chroot' and '.check'.
         std::unordered_set<std::string> tempRoots;
 
-        // Hash part of the store path currently being deleted, if
-        // any.
-        std::optional<std::string> pending;
+        // Hash parts of the store paths currently being deleted.
+        std::unordered_set<std::string> pending;
     };
 
     Sync<Shared> _shared;
@@ -587,7 +717,7 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
                                    done. FIXME: ideally we would use a
                                    FD for this so we don't block the
                                    poll loop. */
-                                while (shared->pending == hashPart) {
+                                while (shared->pending.count(hashPart)) {
                                     debug("synchronising with deletion of path '%s'", path);
                                     shared.wait(wakeup);
                                 }
@@ -630,6 +760,63 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
         roots.insert(root.first);
     }
 
+    /* Mark the paths reachable from the roots in an in-memory copy of
+       the reference graph. This is only a shortcut: paths that aren't
+       marked are still checked with database queries below, which
+       also take care of roots added since. */
+    std::optional<ReferenceGraph> graph;
+    std::vector<bool> marked;
+
+    if (settings.gcLoadReferenceGraph
+        && options.action != GCOptions::gcDeleteSpecific
+        && options.maxFreed > 0)
+    {
+        printInfo("loading the reference graph...");
+        graph = loadReferenceGraph();
+        marked.resize(graph->size());
+
+        std::vector<uint32_t> todo;
+        auto mark = [&](uint32_t i) {
+            if (i != ReferenceGraph::none && !marked[i]) {
+                marked[i] = true;
+                todo.push_back(i);
+            }
+        };
+
+        for (auto & root : roots)
+            mark(graph->find(root.hashPart()));
+
+        while (!todo.empty()) {
+            auto i = todo.back();
+            todo.pop_back();
+            for (auto j = graph->referencesStart[i]; j < graph->referencesStart[i + 1]; ++j)
+                mark(graph->references[j]);
+            if (gcKeepOutputs)
+                for (auto j = graph->outputsStart[i]; j < graph->outputsStart[i + 1]; ++j)
+                    mark(graph->outputs[j]);
+            if (gcKeepDerivations)
+                mark(graph->derivers[i]);
+        }
+    }
+
+    auto isMarked = [&](const StorePath & path) {
+        if (!graph) return false;
+        auto i = graph->find(path.hashPart());
+        return i != ReferenceGraph::none && marked[i];
+    };
+
+    struct Deletions
+    {
+        /* Bytes freed by the thread pool so far. */
+        uint64_t bytesFreed = 0;
+
+        /* The total NAR size of the paths that are waiting to be
+           deleted. */
+        uint64_t inFlight = 0;
+    };
+
+    Sync<Deletions> _deletions;
+
     /* Helper function that deletes a path from the store and throws
        GCLimitReached if we've deleted enough garbage. */
     auto deleteFromStore = [&](std::string_view baseName)
@@ -656,12 +843,150 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
         deletePath(realPath, bytesFreed);
         results.bytesFreed += bytesFreed;
 
-        if (results.bytesFreed > options.maxFreed) {
+        if (results.bytesFreed + _deletions.lock()->bytesFreed > options.maxFreed) {
             printInfo("deleted more than %d bytes; stopping", options.maxFreed);
             throw GCLimitReached();
         }
     };
 
+    /* If `gc-delete-jobs` is greater than 1, dead paths are not
+       deleted right away. Instead they're collected in `batch`, then
+       removed from the database in a single transaction and moved
+       into `trashDir`, from where a thread pool deletes them. The
+       paths stay in `pending` until they have been moved. */
+    std::vector<PendingDeletion> batch;
+
+    auto releaseBatch = [&]() {
+        if (batch.empty()) return;
+        auto shared(_shared.lock());
+        for (auto & d : batch)
+            if (d.path) shared->pending.erase(std::string(d.path->hashPart()));
+        batch.clear();
+        wakeup.notify_all();
+    };
+
+    Finally releaseBatchOnExit(releaseBatch);
+
+    std::optional<ThreadPool> deletePool;
+
+    auto trashName = fmt("%s%d", trashPrefix, getpid());
+    auto trashDir = realStoreDir + "/" + trashName;
+
+    if (shouldDelete && settings.gcDeleteJobs > 1) {
+        if (pathExists(trashDir)) deletePath(trashDir);
+        createDirs(trashDir);
+        deletePool.emplace(settings.gcDeleteJobs);
+    }
+
+    auto flushDeletions = [&]()
+    {
+        if (batch.empty()) return;
+
+        std::vector<StorePath> paths;
+        for (auto & d : batch)
+            if (d.path) paths.push_back(*d.path);
+        invalidatePathsChecked(paths);
+
+        for (auto & d : batch) {
+            Path realPath = realStoreDir + "/" + d.baseName;
+            Path trashPath = trashDir + "/" + d.baseName;
+
+            printInfo("deleting '%1%'", storeDir + "/" + d.baseName);
+
+            results.paths.insert(storeDir + "/" + d.baseName);
+
+            /* Moving a directory to another parent directory requires
+               write permission on it, since its `..` entry changes. */
+            struct stat st;
+            if (lstat(realPath.c_str(), &st) == -1) {
+                if (errno == ENOENT) continue;
+                throw SysError("getting status of '%1%'", realPath);
+            }
+            if (S_ISDIR(st.st_mode) && !(st.st_mode & S_IWUSR)
+                && chmod(realPath.c_str(), st.st_mode | S_IWUSR) == -1)
+                throw SysError("making '%1%' writable", realPath);
+
+            renameFile(realPath, trashPath);
+
+            deletePool->enqueue([&, trashPath, narSize(d.narSize)]() {
+                uint64_t bytesFreed;
+                deletePath(trashPath, bytesFreed);
+                auto deletions(_deletions.lock());
+                deletions->bytesFreed += bytesFreed;
+                deletions->inFlight -= narSize;
+            });
+        }
+
+        releaseBatch();
+    };
+
+    /* Schedule the deletion of a path. Before doing so, check
+       whether the paths being deleted (counted by their NAR size)
+       together with what has been deleted so far exceed `maxFreed`.
+       If so, wait for the pending deletions to finish and check again
+       with the actual number of bytes freed. */
+    auto scheduleDeletion = [&](std::string_view baseName, std::optional<StorePath> path)
+    {
+        auto overBudget = [&]() {
+            auto deletions(_deletions.lock());
+            return results.bytesFreed + deletions->bytesFreed + deletions->inFlight >= options.maxFreed;
+        };
+
+        if (overBudget()) {
+            flushDeletions();
+            deletePool->process();
+            deletePool.emplace(settings.gcDeleteJobs);
+            if (overBudget()) {
+                printInfo("deleted more than %d bytes; stopping", options.maxFreed);
+                throw GCLimitReached();
+            }
+        }
+
+        uint64_t narSize = 0;
+        if (path) {
+            try {
+                narSize = queryPathInfo(*path)->narSize;
+            } catch (InvalidPath &) {
+            }
+        }
+
+        _deletions.lock()->inFlight += narSize;
+        batch.push_back({std::string(baseName), std::move(path), narSize});
+
+        if (batch.size() >= gcBatchSize)
+            flushDeletions();
+    };
+
+    /* If `maxDeleteRate` is set, sleep until the bytes deleted or
+       scheduled for deletion so far are within the allowed rate. */
+    auto startTime = std::chrono::steady_clock::now();
+
+    auto throttle = [&]()
+    {
+        if (!options.maxDeleteRate) return;
+
+        uint64_t deleted;
+        {
+            auto deletions(_deletions.lock());
+            deleted = results.bytesFreed + deletions->bytesFreed + deletions->inFlight;
+        }
+
+        auto due = startTime + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>((double) deleted / options.maxDeleteRate));
+        if (std::chrono::steady_clock::now() >= due) return;
+
+        /* Don't keep the paths in the batch pending while we sleep. */
+        flushDeletions();
+
+        while (true) {
+            checkInterrupt();
+            auto now = std::chrono::steady_clock::now();
+            if (now >= due) break;
+            std::this_thread::sleep_for(std::min<std::chrono::steady_clock::duration>(
+                due - now, std::chrono::milliseconds(100)));
+        }
+    };
+
     std::map<StorePath, StorePathSet> referrersCache;
 
     /* Helper function that visits all paths reachable from `start`
@@ -672,11 +997,17 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
         StorePathSet visited;
         std::queue<StorePath> todo;
 
+        /* The paths that we've marked as pending. Paths that are
+           handed over to `batch` are removed from this list, since
+           they stay pending until they've been moved. */
+        std::vector<std::string> markedPending;
+
         /* Wake up any GC client waiting for deletion of the paths in
            'visited' to finish. */
         Finally releasePending([&]() {
             auto shared(_shared.lock());
-            shared->pending.reset();
+            for (auto & hashPart : markedPending)
+                shared->pending.erase(hashPart);
             wakeup.notify_all();
         });
 
@@ -692,7 +1023,8 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
 
             /* Bail out if we've previously discovered that this path
                is alive. */
-            if (alive.count(*path)) {
+            if (alive.count(*path) || isMarked(*path)) {
+                alive.insert(*path);
                 alive.insert(start);
                 return;
             }
@@ -731,7 +1063,8 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
                     debug("cannot delete '%s' because it's a temporary root", printStorePath(*path));
                     return markAlive();
                 }
-                shared->pending = hashPart;
+                if (shared->pending.insert(hashPart).second)
+                    markedPending.push_back(hashPart);
             }
 
             if (isValidPath(*path)) {
@@ -769,8 +1102,13 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
         for (auto & path : topoSortPaths(visited)) {
             if (!dead.insert(path).second) continue;
             if (shouldDelete) {
-                invalidatePathChecked(path);
-                deleteFromStore(path.to_string());
+                if (deletePool) {
+                    scheduleDeletion(path.to_string(), path);
+                    std::erase(markedPending, std::string(path.hashPart()));
+                } else {
+                    invalidatePathChecked(path);
+                    deleteFromStore(path.to_string());
+                }
                 referrersCache.erase(path);
             }
         }
@@ -814,18 +1152,33 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
             while (errno = 0, dirent = readdir(dir.get())) {
                 checkInterrupt();
                 std::string name = dirent->d_name;
-                if (name == "." || name == ".." || name == linksName) continue;
+                if (name == "." || name == ".." || name == linksName || name == trashName) continue;
 
                 if (auto storePath = maybeParseStorePath(storeDir + "/" + name))
                     deleteReferrersClosure(*storePath);
+                else if (deletePool && !hasPrefix(name, "tmp-"))
+                    scheduleDeletion(name, std::nullopt);
                 else
                     deleteFromStore(name);
 
+                throttle();
             }
         } catch (GCLimitReached & e) {
         }
     }
 
+    if (deletePool) {
+        flushDeletions();
+        deletePool->process();
+        deletePool.reset();
+        results.bytesFreed += _deletions.lock()->bytesFreed;
+        if (rmdir(trashDir.c_str()) == -1)
+            throw SysError("deleting '%1%'", trashDir);
+    }
+
+    if (options.action == GCOptions::gcDeleteDead)
+        results.alive = alive;
+
     if (options.action == GCOptions::gcReturnLive) {
         for (auto & i : alive)
             results.paths.insert(printStorePath(i));
@@ -871,6 +1224,10 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
             if (unlink(path.c_str()) == -1)
                 throw SysError("deleting '%1%'", path);
 
+            withOptimiseIndex([&](OptimiseIndex & index) {
+                index.deleteLink.use()((int64_t) st.st_ino).exec();
+            });
+
             /* Do not accound for deleted file here. Rely on deletePath()
                accounting.  */
         }
@@ -906,6 +1263,9 @@ void LocalStore::autoGC(bool sync)
 
     std::shared_future<void> future;
 
+    /* A rate-limited GC may take a long time, so don't wait for it. */
+    if (settings.autoGCMaxRate) sync = false;
+
     {
         auto state(_state.lock());
 
@@ -946,6 +1306,9 @@ void LocalStore::autoGC(bool sync)
 
                 GCOptions options;
                 options.maxFreed = settings.maxFree - avail;
+                options.maxDeleteRate = settings.autoGCMaxRate;
+                if (options.maxDeleteRate)
+                    options.assumeAlive = std::move(_state.lock()->autoGCAlive);
 
                 printInfo("running auto-GC to free %d bytes", options.maxFreed);
 
@@ -953,7 +1316,23 @@ void LocalStore::autoGC(bool sync)
 
                 collectGarbage(options, results);
 
-                _state.lock()->availAfterGC = getAvail();
+                /* Paths that were alive during the previous run may
+                   have become garbage since. If we couldn't free
+                   enough without them, check them again. */
+                if (results.bytesFreed < options.maxFreed && !options.assumeAlive.empty()) {
+                    options.maxFreed -= results.bytesFreed;
+                    options.assumeAlive.clear();
+                    printInfo("running auto-GC again to free %d bytes", options.maxFreed);
+                    results = {};
+                    collectGarbage(options, results);
+                }
+
+                auto availAfterGC = getAvail();
+
+                auto state(_state.lock());
+                if (options.maxDeleteRate)
+                    state->autoGCAlive = std::move(results.alive);
+                state->availAfterGC = availAfterGC;
 
             } catch (...) {
                 // FIXME: we could propagate the exception to the
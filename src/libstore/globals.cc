@@ -4,6 +4,7 @@
 #include "args.hh"
 #include "abstract-setting-to-json.hh"
 #include "compute-levels.hh"
+#include "startup-profile.hh"
 
 #include <algorithm>
 #include <map>
@@ -295,6 +296,30 @@ template<> void BaseSetting<SandboxMode>::convertToArg(Args & args, const std::s
     });
 }
 
+NLOHMANN_JSON_SERIALIZE_ENUM(OptimiseMethod, {
+    {OptimiseMethod::omHardLink, "hardlink"},
+    {OptimiseMethod::omReflink, "reflink"},
+});
+
+template<> OptimiseMethod BaseSetting<OptimiseMethod>::parse(const std::string & str) const
+{
+    if (str == "hardlink") return omHardLink;
+    else if (str == "reflink") return omReflink;
+    else throw UsageError("option '%s' has invalid value '%s'", name, str);
+}
+
+template<> struct BaseSetting<OptimiseMethod>::trait
+{
+    static constexpr bool appendable = false;
+};
+
+template<> std::string BaseSetting<OptimiseMethod>::to_string() const
+{
+    if (value == omHardLink) return "hardlink";
+    else if (value == omReflink) return "reflink";
+    else abort();
+}
+
 unsigned int MaxBuildJobsSetting::parse(const std::string & str) const
 {
     if (str == "auto") return std::max(1U, std::thread::hardware_concurrency());
@@ -317,6 +342,8 @@ Paths PluginFilesSetting::parse(const std::string & str) const
 
 void initPlugins()
 {
+    StartupPhase phase("load plugins");
+
     assert(!settings.pluginFiles.pluginsLoaded);
     for (const auto & pluginFile : settings.pluginFiles.get()) {
         Paths pluginFiles;
@@ -400,9 +427,15 @@ void initLibStore() {
     if (sodium_init() == -1)
         throw Error("could not initialise libsodium");
 
-    loadConfFile();
+    {
+        StartupPhase phase("load configuration");
+        loadConfFile();
+    }
 
-    preloadNSS();
+    {
+        StartupPhase phase("preload NSS");
+        preloadNSS();
+    }
 
     /* On macOS, don't use the per-session TMPDIR (as set e.g. by
        sshd). This breaks build users because they don't have access
@@ -15,6 +15,8 @@ namespace nix {
 
 typedef enum { smEnabled, smRelaxed, smDisabled } SandboxMode;
 
+typedef enum { omHardLink, omReflink } OptimiseMethod;
+
 struct MaxBuildJobsSetting : public BaseSetting<unsigned int>
 {
     MaxBuildJobsSetting(Config * options,
@@ -169,6 +171,60 @@ public:
         )",
         {"substitution-max-jobs"}};
 
+    Setting<bool> criticalPathScheduling{
+        this, true, "critical-path-scheduling",
+        R"(
+          Whether to start the builds on the longest remaining chain of
+          dependent builds first, rather than in the order in which they
+          become ready. Each build on such a chain counts with the time
+          that a derivation with the same name (ignoring its version)
+          took to build before, as recorded in a cache in `~/.cache/nix`.
+          This ensures that, for instance, a compiler that many other
+          builds depend on is built as early as possible.
+
+          The cache also records the peak memory usage (if the build ran
+          in a cgroup) and the output size of builds. The progress bar
+          uses the recorded durations to show how long a build is
+          expected to take. Builds are only recorded if this setting is
+          enabled.
+        )"};
+
+    Setting<unsigned int> maxLoad{
+        this, 0, "max-load",
+        R"(
+          If set to a non-zero value, Nix doesn't start another local
+          build while the 1-minute load average of the system is at least
+          this value, even if fewer than [`max-jobs`](#conf-max-jobs)
+          builds are running. One build is always allowed to run.
+        )"};
+
+    Setting<uint64_t> minAvailableMemory{
+        this, 0, "min-available-memory",
+        R"(
+          If set to a non-zero value, Nix doesn't start another local
+          build if that would leave less than this amount of memory (in
+          bytes) available. The memory that running builds have declared
+          with the [`requiredMemory`](@docroot@/language/advanced-attributes.md#adv-attr-requiredMemory)
+          attribute, but aren't using yet, doesn't count as available.
+          One build is always allowed to run.
+
+          This is only supported on Linux. The memory used by running
+          builds is only known if [`use-cgroups`](#conf-use-cgroups) is
+          enabled.
+        )"};
+
+    Setting<unsigned int> maxMemoryPressure{
+        this, 0, "max-memory-pressure",
+        R"(
+          If set to a non-zero value, Nix doesn't start another local
+          build while the memory pressure of the system, i.e. the
+          percentage of time in the last 10 seconds in which some
+          processes were stalled waiting for memory, is at least this
+          value. One build is always allowed to run.
+
+          This is only supported on Linux.
+        )"};
+
     Setting<unsigned int> buildCores{
         this,
         getDefaultCores(),
@@ -255,6 +311,16 @@ public:
           > Change this setting only if you really know what you’re doing.
         )"};
 
+    Setting<bool> persistentBuildHook{
+        this, true, "persistent-build-hook",
+        R"(
+          If set to `true`, a [build hook](#conf-build-hook) that has
+          finished a remote build is kept running to handle further
+          builds, so that it can reuse its connections to the remote
+          build machines. Build hooks that don't support this simply
+          exit after each build, as before.
+        )"};
+
     Setting<std::string> builders{
         this, "@" + nixConfDir + "/machines", "builders",
         R"(
@@ -298,7 +364,12 @@ public:
         "Whether SQLite should use WAL mode."};
 
     Setting<bool> syncBeforeRegistering{this, false, "sync-before-registering",
-        "Whether to call `sync()` before registering a path as valid."};
+        R"(
+          Whether to flush the file system containing the store (with
+          `syncfs()` where available, `sync()` otherwise) before
+          registering a path as valid. Paths registered concurrently
+          are flushed and registered together.
+        )"};
 
     Setting<bool> useSubstitutes{
         this, true, "substitute",
@@ -402,11 +473,25 @@ public:
         this, true, "compress-build-log",
         R"(
           If set to `true` (the default), build logs written to
-          `/nix/var/log/nix/drvs` will be compressed on the fly using bzip2.
+          `/nix/var/log/nix/drvs` will be compressed on the fly using
+          the method set by
+          [`build-log-compression`](#conf-build-log-compression).
           Otherwise, they will not be compressed.
         )",
         {"build-compress-log"}};
 
+    Setting<std::string> buildLogCompression{
+        this, "bzip2", "build-log-compression",
+        R"(
+          The compression method for build logs if
+          [`compress-build-log`](#conf-compress-build-log) is enabled:
+          `bzip2` or `zstd`. `zstd` is much faster, which matters for
+          builds that produce a lot of log output. Build logs are
+          compressed on a separate thread, so that compression doesn't
+          slow down the processing of the builder's output. Logs in
+          either format can be read by `nix log`.
+        )"};
+
     Setting<unsigned long> maxLogSize{
         this, 0, "max-build-log-size",
         R"(
@@ -461,6 +546,26 @@ public:
           duplicate files.
         )"};
 
+    Setting<OptimiseMethod> optimiseMethod{
+        this, omHardLink, "optimise-method",
+        R"(
+          How identical files in the store are deduplicated, both by
+          `nix-store --optimise` and by
+          [`auto-optimise-store`](#conf-auto-optimise-store). Possible
+          values:
+
+          - `hardlink` (default): Replace identical files with hard links
+            to a single copy in `/nix/store/.links`.
+
+          - `reflink`: Let the file system share the data blocks of
+            identical files (using the `FIDEDUPERANGE` ioctl), while
+            keeping them as separate files. This is only supported on
+            Linux with file systems such as Btrfs and XFS, and avoids
+            running into the file system's maximum number of hard links.
+            If the file system doesn't support it, Nix falls back to
+            hard links.
+        )"};
+
     Setting<bool> envKeepDerivations{
         this, false, "keep-env-derivations",
         R"(
@@ -569,6 +674,20 @@ public:
 
     Setting<Path> sandboxBuildDir{this, "/build", "sandbox-build-dir",
         "The build directory inside the sandbox."};
+
+    Setting<unsigned int> sandboxNetworkNamespacePool{this, 0, "sandbox-network-namespace-pool",
+        R"(
+          The number of network namespaces of finished sandboxed builds
+          that Nix keeps for reuse by later builds. Creating and
+          destroying a network namespace is expensive, and can take
+          longer than short builds such as `writeText` themselves.
+
+          A reused network namespace is owned by the initial user
+          namespace, so builds cannot reconfigure it, as they can with
+          a fresh one (e.g. add network interfaces). This only has an
+          effect if Nix runs as root. The default is 0, i.e. every
+          build gets a new network namespace.
+        )"};
 #endif
 
     Setting<PathSet> allowedImpureHostPrefixes{this, {}, "allowed-impure-host-deps",
@@ -777,6 +896,33 @@ public:
         )",
         {"trusted-binary-caches"}};
 
+    Setting<unsigned int> substituterRaceWidth{
+        this, 1, "substituter-race-width",
+        R"(
+          The number of substituters that are asked for information
+          about a store path at the same time. With the default of 1,
+          the substituters are asked one after the other. With a larger
+          value, the first *n* substituters are queried in parallel, and
+          a path's information is used as soon as it has arrived from a
+          substituter and every substituter with a higher priority has
+          answered that it doesn't have the path. This way, a slow
+          substituter only delays the paths that faster, higher-priority
+          substituters don't have, at the cost of some extra requests.
+        )"};
+
+    Setting<bool> adaptiveSubstituterOrder{
+        this, false, "adaptive-substituter-order",
+        R"(
+          If set to `true`, substituters that have the same priority are
+          tried in order of their recent performance from this machine,
+          rather than in the order in which they appear in
+          [`substituters`](#conf-substituters). Nix keeps track of the
+          latency, error rate and download throughput of each HTTP and
+          S3 binary cache in its binary cache metadata cache.
+          Substituters that haven't been used yet are tried first, so
+          that their performance becomes known.
+        )"};
+
     Setting<unsigned int> ttlNegativeNarInfoCache{
         this, 3600, "narinfo-cache-negative-ttl",
         R"(
@@ -799,6 +945,26 @@ public:
           mismatch if the build isn't reproducible.
         )"};
 
+    Setting<bool> useDrvHashCache{
+        this, true, "drv-hash-cache",
+        R"(
+          Whether to remember, in `~/.cache/nix/drv-hashes-v1.sqlite`, the
+          hashes of derivations read from the Nix store that are used to
+          compute the output paths of derivations depending on them. This
+          avoids reading and hashing the same input derivations again in
+          every evaluation.
+        )"};
+
+    Setting<bool> useFileHashCache{
+        this, true, "file-hash-cache",
+        R"(
+          Whether to remember, in `~/.cache/nix/file-hashes-v1.sqlite`, the
+          hashes computed by `builtins.hashFile`, `nix hash file` and
+          `nix hash path`, so that unchanged files are not read and hashed
+          again. A cached hash is only used if the size, inode and
+          modification and status change times of the files are unchanged.
+        )"};
+
     Setting<bool> printMissing{this, true, "print-missing",
         "Whether to print what paths need to be built or downloaded."};
 
@@ -991,6 +1157,49 @@ public:
     Setting<uint64_t> minFreeCheckInterval{this, 5, "min-free-check-interval",
         "Number of seconds between checking free disk space."};
 
+    Setting<uint64_t> autoGCMaxRate{
+        this, 0, "auto-gc-max-rate",
+        R"(
+          If non-zero, a garbage collection triggered by `min-free`
+          deletes at most this many bytes per second. Such a collection
+          runs in the background: builds and substitutions don't wait
+          for it to finish. It also assumes that the paths found to be
+          alive by the previous one still are, and only rechecks them if
+          it can't free enough space otherwise. The default, `0`, means
+          no limit.
+        )"};
+
+    Setting<unsigned int> verifyJobs{
+        this, 0, "verify-jobs",
+        R"(
+          The number of threads used to check the contents of store paths
+          by `nix-store --verify --check-contents` and `nix store verify`.
+          The default, `0`, uses one thread per CPU.
+        )"};
+
+    Setting<unsigned int> gcDeleteJobs{
+        this, 1, "gc-delete-jobs",
+        R"(
+          The number of threads that the garbage collector uses to delete
+          store paths. If greater than 1, garbage paths are removed from
+          the Nix database in large transactions and then moved out of
+          the way, after which their contents are deleted in the
+          background. The garbage collector keeps track of how much space
+          the paths being deleted will free, so that it doesn't delete
+          much more than requested with `max-free` or `--max`.
+        )"};
+
+    Setting<bool> gcLoadReferenceGraph{
+        this, true, "gc-load-reference-graph",
+        R"(
+          If set to `true` (the default), the garbage collector first
+          loads the references between all valid paths from the Nix
+          database into memory and marks the paths reachable from the
+          roots, rather than determining whether each path is alive with
+          separate database queries. This is much faster on large stores,
+          at the cost of some memory while the collector runs.
+        )"};
+
     PluginFilesSetting pluginFiles{
         this, {}, "plugin-files",
         R"(
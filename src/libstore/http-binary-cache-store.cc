@@ -155,6 +155,7 @@ protected:
     {
         checkEnabled();
         auto request(makeRequest(path));
+        request.bulk = true;
         try {
             getFileTransfer()->download(std::move(request), sink);
         } catch (FileTransferError & e) {
@@ -165,6 +166,28 @@ protected:
         }
     }
 
+    std::optional<std::string> getFileRange(
+        const std::string & path, uint64_t offset, uint64_t length) override
+    {
+        checkEnabled();
+        auto request(makeRequest(path));
+        request.range = {offset, length};
+        /* A range of a compressed response can't be decompressed. */
+        request.decompress = false;
+        try {
+            auto res = getFileTransfer()->download(request);
+            /* Servers that don't support range requests return the
+               whole file. */
+            if (res.data.size() != length) return std::nullopt;
+            return std::move(res.data);
+        } catch (FileTransferError & e) {
+            if (e.error == FileTransfer::NotFound || e.error == FileTransfer::Forbidden)
+                throw NoSuchBinaryCacheFile("file '%s' does not exist in binary cache '%s'", path, getUri());
+            maybeDisable();
+            throw;
+        }
+    }
+
     void getFile(const std::string & path,
         Callback<std::optional<std::string>> callback) noexcept override
     {
@@ -10,6 +10,9 @@
 #include "ssh.hh"
 #include "derivations.hh"
 #include "callback.hh"
+#include "compression.hh"
+#include "worker-protocol.hh"
+#include "worker-protocol-impl.hh"
 
 namespace nix {
 
@@ -23,6 +26,16 @@ struct LegacySSHStoreConfig : virtual CommonSSHStoreConfig
     const Setting<int> maxConnections{this, 1, "max-connections",
         "Maximum number of concurrent SSH connections."};
 
+    const Setting<std::string> narCompression{this, "none", "nar-compression",
+        R"(
+          The compression method for NARs that are copied to or from the
+          remote machine several at a time (e.g. by `nix copy`), such as
+          `zstd`. This requires Nix 2.19 or later on the remote side.
+        )"};
+
+    const Setting<int> narCompressionLevel{this, -1, "nar-compression-level",
+        "The compression level for `nar-compression`. -1 specifies the default level of the method."};
+
     const std::string name() override { return "SSH Store"; }
 
     std::string doc() override
@@ -254,6 +267,65 @@ struct LegacySSHStore : public virtual LegacySSHStoreConfig, public virtual Stor
             throw Error("failed to add path '%s' to remote host '%s'", printStorePath(info.path), host);
     }
 
+    void addMultipleToStore(
+        PathsSource & pathsToCopy,
+        Activity & act,
+        RepairFlag repair,
+        CheckSigsFlag checkSigs) override
+    {
+        if (GET_PROTOCOL_MINOR(getProtocol()) < 8) {
+            Store::addMultipleToStore(pathsToCopy, act, repair, checkSigs);
+            return;
+        }
+
+        StorePathSet paths;
+        for (auto & [info, _] : pathsToCopy)
+            paths.insert(info.path);
+        auto valid = queryValidPaths(paths);
+
+        debug("adding %d paths to remote host '%s'", paths.size() - valid.size(), host);
+
+        auto conn(connections->get());
+
+        conn->to
+            << ServeProto::Command::AddMultipleToStore
+            << narCompression.get();
+
+        try {
+            std::exception_ptr ex;
+            FramedSink framed(conn->to, ex);
+            auto compressor = narCompression.get() == "none"
+                ? makeCompressionSink("none", framed)
+                : makeCompressionSink(narCompression, framed, false, narCompressionLevel);
+
+            *compressor << paths.size() - valid.size();
+            size_t nrDone = valid.size();
+            for (auto & [info, source] : pathsToCopy) {
+                if (valid.count(info.path)) continue;
+                WorkerProto::Serialise<ValidPathInfo>::write(*this,
+                    WorkerProto::WriteConn {
+                        .to = *compressor,
+                        .version = 16,
+                    },
+                    info);
+                source->drainInto(*compressor);
+                /* Destroy the source, see Store::addMultipleToStore(). */
+                source.reset();
+                act.progress(++nrDone, pathsToCopy.size(), 1, 0);
+            }
+
+            compressor->finish();
+            framed.flush();
+        } catch (...) {
+            conn->good = false;
+            throw;
+        }
+        conn->to.flush();
+
+        if (readInt(conn->from) != 1)
+            throw Error("failed to add paths to remote host '%s'", host);
+    }
+
     void narFromPath(const StorePath & path, Sink & sink) override
     {
         auto conn(connections->get());
@@ -263,6 +335,53 @@ struct LegacySSHStore : public virtual LegacySSHStoreConfig, public virtual Stor
         copyNAR(conn->from, sink);
     }
 
+    bool narsFromPaths(const StorePaths & paths,
+        std::function<void(const StorePath & path, Source & nar)> fun) override
+    {
+        auto conn(connections->get());
+
+        if (GET_PROTOCOL_MINOR(conn->remoteVersion) < 8)
+            return false;
+
+        Strings ss;
+        for (auto & path : paths)
+            ss.push_back(printStorePath(path));
+        conn->to
+            << ServeProto::Command::DumpStorePaths
+            << ss
+            << narCompression.get()
+            << std::max(narCompressionLevel.get(), 0);
+        conn->to.flush();
+
+        try {
+            /* A compressed stream is framed, since it doesn't tell
+               where the last NAR ends. */
+            std::unique_ptr<FramedSource> framed;
+            std::unique_ptr<Source> decompressed;
+            Source * from = &conn->from;
+            if (narCompression.get() != "none") {
+                framed = std::make_unique<FramedSource>(conn->from);
+                decompressed = makeDecompressionSource(narCompression, *framed);
+                from = decompressed.get();
+            }
+
+            for (auto & path : paths) {
+                auto nar = sinkToSource([&](Sink & sink) {
+                    copyNAR(*from, sink);
+                });
+                fun(path, *nar);
+                /* Skip whatever `fun` didn't read. */
+                NullSink null;
+                nar->drainInto(null);
+            }
+        } catch (...) {
+            conn->good = false;
+            throw;
+        }
+
+        return true;
+    }
+
     std::optional<StorePath> queryPathFromHashPart(const std::string & hashPart) override
     { unsupported("queryPathFromHashPart"); }
 
@@ -1,8 +1,12 @@
 #include "binary-cache-store.hh"
 #include "globals.hh"
 #include "nar-info-disk-cache.hh"
+#include "sync.hh"
 
 #include <atomic>
+#include <unordered_set>
+
+#include <fcntl.h>
 
 namespace nix {
 
@@ -26,6 +30,30 @@ private:
 
     Path binaryCacheDir;
 
+    /**
+     * The hash parts of the `.narinfo` files known to be in the
+     * cache: read from the directory when many paths are queried at
+     * once, and extended with the files we find or write. It is only
+     * used to answer positively, since other processes may have added
+     * files since it was read; absence is still checked with a stat.
+     */
+    Sync<std::optional<std::unordered_set<std::string>>> _narInfoIndex;
+
+    /**
+     * The number of paths in a `queryValidPaths()` call above which
+     * it is cheaper to read the directory than to stat each
+     * `.narinfo`.
+     */
+    static constexpr size_t narInfoIndexThreshold = 64;
+
+    static std::optional<std::string_view> narInfoHashPart(std::string_view path)
+    {
+        if (path.size() != 40 || !hasSuffix(path, ".narinfo")) return std::nullopt;
+        return path.substr(0, 32);
+    }
+
+    void loadNarInfoIndex();
+
 public:
 
     LocalBinaryCacheStore(
@@ -66,6 +94,11 @@ protected:
         writeFile(tmp, source);
         renameFile(tmp, path2);
         del.cancel();
+
+        if (auto hashPart = narInfoHashPart(path)) {
+            auto index(_narInfoIndex.lock());
+            if (*index) (*index)->emplace(*hashPart);
+        }
     }
 
     void getFile(const std::string & path, Sink & sink) override
@@ -79,18 +112,41 @@ protected:
         }
     }
 
+    std::optional<std::string> getFileRange(
+        const std::string & path, uint64_t offset, uint64_t length) override
+    {
+        auto path2 = binaryCacheDir + "/" + path;
+        AutoCloseFD fd = open(path2.c_str(), O_RDONLY | O_CLOEXEC);
+        if (!fd) {
+            if (errno == ENOENT)
+                throw NoSuchBinaryCacheFile("file '%s' does not exist in binary cache", path);
+            throw SysError("opening '%s'", path2);
+        }
+        if (lseek(fd.get(), offset, SEEK_SET) != (off_t) offset)
+            throw SysError("seeking in '%s'", path2);
+        std::string buf(length, 0);
+        readFull(fd.get(), buf.data(), length);
+        return buf;
+    }
+
+    StorePathSet queryValidPaths(const StorePathSet & paths,
+        SubstituteFlag maybeSubstitute = NoSubstitute) override
+    {
+        if (paths.size() >= narInfoIndexThreshold)
+            loadNarInfoIndex();
+        return BinaryCacheStore::queryValidPaths(paths, maybeSubstitute);
+    }
+
     StorePathSet queryAllValidPaths() override
     {
+        /* Re-read the directory to see files added by others. */
+        *_narInfoIndex.lock() = std::nullopt;
+        loadNarInfoIndex();
+
         StorePathSet paths;
 
-        for (auto & entry : readDirectory(binaryCacheDir)) {
-            if (entry.name.size() != 40 ||
-                !hasSuffix(entry.name, ".narinfo"))
-                continue;
-            paths.insert(parseStorePath(
-                    storeDir + "/" + entry.name.substr(0, entry.name.size() - 8)
-                    + "-" + MissingName));
-        }
+        for (auto & hashPart : **_narInfoIndex.lock())
+            paths.insert(parseStorePath(storeDir + "/" + hashPart + "-" + MissingName));
 
         return paths;
     }
@@ -111,9 +167,46 @@ void LocalBinaryCacheStore::init()
     BinaryCacheStore::init();
 }
 
+void LocalBinaryCacheStore::loadNarInfoIndex()
+{
+    if (*_narInfoIndex.lock()) return;
+
+    std::unordered_set<std::string> index;
+
+    for (auto & entry : readDirectory(binaryCacheDir))
+        if (auto hashPart = narInfoHashPart(entry.name))
+            index.emplace(*hashPart);
+
+    debug("read %d .narinfo files from '%s'", index.size(), binaryCacheDir);
+
+    auto index_(_narInfoIndex.lock());
+    if (*index_)
+        /* Another thread loaded it in the meantime, and may have added
+           files that we didn't see. */
+        (*index_)->merge(index);
+    else
+        *index_ = std::move(index);
+}
+
 bool LocalBinaryCacheStore::fileExists(const std::string & path)
 {
-    return pathExists(binaryCacheDir + "/" + path);
+    auto hashPart = narInfoHashPart(path);
+
+    if (hashPart) {
+        auto index(_narInfoIndex.lock());
+        if (*index && (*index)->count(std::string(*hashPart)))
+            return true;
+    }
+
+    if (!pathExists(binaryCacheDir + "/" + path))
+        return false;
+
+    if (hashPart) {
+        auto index(_narInfoIndex.lock());
+        if (*index) (*index)->emplace(*hashPart);
+    }
+
+    return true;
 }
 
 std::set<std::string> LocalBinaryCacheStore::uriSchemes()
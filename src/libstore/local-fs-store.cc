@@ -5,6 +5,7 @@
 #include "globals.hh"
 #include "compression.hh"
 #include "derivations.hh"
+#include "tracing.hh"
 
 namespace nix {
 
@@ -80,6 +81,7 @@ ref<FSAccessor> LocalFSStore::getFSAccessor()
 
 void LocalFSStore::narFromPath(const StorePath & path, Sink & sink)
 {
+    TraceSpan span("store", "narFromPath %s", path.to_string());
     if (!isValidPath(path))
         throw Error("path '%s' is not valid", printStorePath(path));
     dumpPath(getRealStoreDir() + std::string(printStorePath(path), storeDir.size()), sink);
@@ -87,6 +89,18 @@ void LocalFSStore::narFromPath(const StorePath & path, Sink & sink)
 
 const std::string LocalFSStore::drvsLogDir = "drvs";
 
+const std::vector<std::pair<std::string, std::string>> LocalFSStore::logCompressionMethods = {
+    {"bzip2", ".bz2"},
+    {"zstd", ".zst"},
+};
+
+std::string LocalFSStore::logExtension(std::string_view method)
+{
+    for (auto & [name, extension] : logCompressionMethods)
+        if (name == method) return extension;
+    throw UsageError("unsupported build log compression method '%s'", method);
+}
+
 std::optional<std::string> LocalFSStore::getBuildLogExact(const StorePath & path)
 {
     auto baseName = path.to_string();
@@ -97,20 +111,40 @@ std::optional<std::string> LocalFSStore::getBuildLogExact(const StorePath & path
             j == 0
             ? fmt("%s/%s/%s/%s", logDir, drvsLogDir, baseName.substr(0, 2), baseName.substr(2))
             : fmt("%s/%s/%s", logDir, drvsLogDir, baseName);
-        Path logBz2Path = logPath + ".bz2";
 
         if (pathExists(logPath))
             return readFile(logPath);
 
-        else if (pathExists(logBz2Path)) {
-            try {
-                return decompress("bzip2", readFile(logBz2Path));
-            } catch (Error &) { }
-        }
+        for (auto & [method, extension] : logCompressionMethods)
+            if (pathExists(logPath + extension)) {
+                try {
+                    return decompress(method, readFile(logPath + extension));
+                } catch (Error &) { }
+            }
 
     }
 
     return std::nullopt;
 }
 
+std::vector<StorePath> LocalFSStore::sortByInode(const StorePathSet & paths)
+{
+    std::vector<std::pair<ino_t, StorePath>> sorted;
+    sorted.reserve(paths.size());
+
+    for (auto & path : paths) {
+        struct stat st;
+        auto realPath = getRealStoreDir() + "/" + std::string(path.to_string());
+        sorted.emplace_back(lstat(realPath.c_str(), &st) == 0 ? st.st_ino : 0, path);
+    }
+
+    std::sort(sorted.begin(), sorted.end());
+
+    std::vector<StorePath> res;
+    res.reserve(sorted.size());
+    for (auto & i : sorted)
+        res.push_back(std::move(i.second));
+    return res;
+}
+
 }
@@ -40,6 +40,18 @@ public:
 
     const static std::string drvsLogDir;
 
+    /**
+     * The compression methods that build logs can be stored with, and
+     * the file name extensions they are stored with.
+     */
+    const static std::vector<std::pair<std::string, std::string>> logCompressionMethods;
+
+    /**
+     * @return The file name extension of build logs compressed with
+     * `method`, as set by `build-log-compression`.
+     */
+    static std::string logExtension(std::string_view method);
+
     LocalFSStore(const Params & params);
 
     void narFromPath(const StorePath & path, Sink & sink) override;
@@ -71,6 +83,14 @@ public:
 
     std::optional<std::string> getBuildLogExact(const StorePath & path) override;
 
+    /**
+     * Return `paths` ordered by the inode number of their top-level
+     * file. Since file systems tend to allocate inodes and data
+     * blocks in the same order, this reduces seeking when reading
+     * many paths in this order.
+     */
+    std::vector<StorePath> sortByInode(const StorePathSet & paths);
+
 };
 
 }
@@ -10,10 +10,18 @@
 #include "topo-sort.hh"
 #include "finally.hh"
 #include "compression.hh"
+#include "pool.hh"
+#include "thread-pool.hh"
+#include "thread-pipe.hh"
+#include "tracing.hh"
+#include "startup-profile.hh"
 
 #include <iostream>
 #include <algorithm>
 #include <cstring>
+#include <future>
+#include <queue>
+#include <thread>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -51,13 +59,22 @@ std::string LocalStoreConfig::doc()
         ;
 }
 
-struct LocalStore::State::Stmts {
+/**
+ * The number of paths looked up by a single `QueryPathInfos`
+ * statement, well below SQLite's default limit on the number of
+ * parameters.
+ */
+static constexpr size_t pathInfoBatchSize = 256;
+
+struct LocalStore::Connection::Stmts {
     /* Some precompiled SQLite statements. */
     SQLiteStmt RegisterValidPath;
     SQLiteStmt UpdatePathInfo;
     SQLiteStmt AddReference;
     SQLiteStmt QueryPathInfo;
     SQLiteStmt QueryReferences;
+    SQLiteStmt QueryPathInfos;
+    SQLiteStmt QueryReferencesOfIds;
     SQLiteStmt QueryReferrers;
     SQLiteStmt InvalidatePath;
     SQLiteStmt AddDerivationOutput;
@@ -185,6 +202,7 @@ LocalStore::LocalStore(const Params & params)
     , fnTempRoots(fmt("%s/%d", tempRootsDir, getpid()))
     , locksHeld(tokenizeString<PathSet>(getEnv("NIX_HELD_LOCKS").value_or("")))
 {
+    _state.setName("local-store");
     auto state(_state.lock());
     state->stmts = std::make_unique<State::Stmts>();
 
@@ -287,6 +305,7 @@ LocalStore::LocalStore(const Params & params)
 
     /* Check the current database schema and if necessary do an
        upgrade.  */
+    StartupPhase phase("open database");
     int curSchema = getSchema();
     if (readOnly && curSchema < nixSchemaVersion) {
         debug("current schema version: %d", curSchema);
@@ -367,40 +386,66 @@ LocalStore::LocalStore(const Params & params)
         }
     }
 
-    /* Prepare SQL statements. */
-    state->stmts->RegisterValidPath.create(state->db,
+    prepareStatements(*state);
+
+    /* Open additional read-only connections on demand. */
+    if (settings.useSQLiteWAL || readOnly)
+        readConnections = std::make_shared<Pool<Connection>>(
+            std::max(1U, std::thread::hardware_concurrency()),
+            [this]() {
+                auto conn = make_ref<Connection>();
+                conn->db = SQLite(dbDir + "/db.sqlite",
+                    readOnly ? SQLiteOpenMode::Immutable : SQLiteOpenMode::ReadOnly);
+                conn->stmts = std::make_unique<Connection::Stmts>();
+                prepareStatements(*conn);
+                return conn;
+            });
+}
+
+
+
+void LocalStore::prepareStatements(Connection & conn)
+{
+    conn.stmts->RegisterValidPath.create(conn.db,
         "insert into ValidPaths (path, hash, registrationTime, deriver, narSize, ultimate, sigs, ca) values (?, ?, ?, ?, ?, ?, ?, ?);");
-    state->stmts->UpdatePathInfo.create(state->db,
+    conn.stmts->UpdatePathInfo.create(conn.db,
         "update ValidPaths set narSize = ?, hash = ?, ultimate = ?, sigs = ?, ca = ? where path = ?;");
-    state->stmts->AddReference.create(state->db,
+    conn.stmts->AddReference.create(conn.db,
         "insert or replace into Refs (referrer, reference) values (?, ?);");
-    state->stmts->QueryPathInfo.create(state->db,
+    conn.stmts->QueryPathInfo.create(conn.db,
         "select id, hash, registrationTime, deriver, narSize, ultimate, sigs, ca from ValidPaths where path = ?;");
-    state->stmts->QueryReferences.create(state->db,
+    conn.stmts->QueryReferences.create(conn.db,
         "select path from Refs join ValidPaths on reference = id where referrer = ?;");
-    state->stmts->QueryReferrers.create(state->db,
+    {
+        auto params = concatStringsSep(", ", std::vector<std::string>(pathInfoBatchSize, "?"));
+        conn.stmts->QueryPathInfos.create(conn.db,
+            "select id, hash, registrationTime, deriver, narSize, ultimate, sigs, ca, path from ValidPaths where path in (" + params + ");");
+        conn.stmts->QueryReferencesOfIds.create(conn.db,
+            "select referrer, path from Refs join ValidPaths on reference = id where referrer in (" + params + ");");
+    }
+    conn.stmts->QueryReferrers.create(conn.db,
         "select path from Refs join ValidPaths on referrer = id where reference = (select id from ValidPaths where path = ?);");
-    state->stmts->InvalidatePath.create(state->db,
+    conn.stmts->InvalidatePath.create(conn.db,
         "delete from ValidPaths where path = ?;");
-    state->stmts->AddDerivationOutput.create(state->db,
+    conn.stmts->AddDerivationOutput.create(conn.db,
         "insert or replace into DerivationOutputs (drv, id, path) values (?, ?, ?);");
-    state->stmts->QueryValidDerivers.create(state->db,
+    conn.stmts->QueryValidDerivers.create(conn.db,
         "select v.id, v.path from DerivationOutputs d join ValidPaths v on d.drv = v.id where d.path = ?;");
-    state->stmts->QueryDerivationOutputs.create(state->db,
+    conn.stmts->QueryDerivationOutputs.create(conn.db,
         "select id, path from DerivationOutputs where drv = ?;");
     // Use "path >= ?" with limit 1 rather than "path like '?%'" to
     // ensure efficient lookup.
-    state->stmts->QueryPathFromHashPart.create(state->db,
+    conn.stmts->QueryPathFromHashPart.create(conn.db,
         "select path from ValidPaths where path >= ? limit 1;");
-    state->stmts->QueryValidPaths.create(state->db, "select path from ValidPaths");
+    conn.stmts->QueryValidPaths.create(conn.db, "select path from ValidPaths");
     if (experimentalFeatureSettings.isEnabled(Xp::CaDerivations)) {
-        state->stmts->RegisterRealisedOutput.create(state->db,
+        conn.stmts->RegisterRealisedOutput.create(conn.db,
             R"(
                 insert into Realisations (drvPath, outputName, outputPath, signatures)
                 values (?, ?, (select id from ValidPaths where path = ?), ?)
                 ;
             )");
-        state->stmts->UpdateRealisedOutput.create(state->db,
+        conn.stmts->UpdateRealisedOutput.create(conn.db,
             R"(
                 update Realisations
                     set signatures = ?
@@ -409,27 +454,27 @@ LocalStore::LocalStore(const Params & params)
                     outputName = ?
                 ;
             )");
-        state->stmts->QueryRealisedOutput.create(state->db,
+        conn.stmts->QueryRealisedOutput.create(conn.db,
             R"(
                 select Realisations.id, Output.path, Realisations.signatures from Realisations
                     inner join ValidPaths as Output on Output.id = Realisations.outputPath
                     where drvPath = ? and outputName = ?
                     ;
             )");
-        state->stmts->QueryAllRealisedOutputs.create(state->db,
+        conn.stmts->QueryAllRealisedOutputs.create(conn.db,
             R"(
                 select outputName, Output.path from Realisations
                     inner join ValidPaths as Output on Output.id = Realisations.outputPath
                     where drvPath = ?
                     ;
             )");
-        state->stmts->QueryRealisationReferences.create(state->db,
+        conn.stmts->QueryRealisationReferences.create(conn.db,
             R"(
                 select drvPath, outputName from Realisations
                     join RealisationsRefs on realisationReference = Realisations.id
                     where referrer = ?;
             )");
-        state->stmts->AddRealisationReference.create(state->db,
+        conn.stmts->AddRealisationReference.create(conn.db,
             R"(
                 insert or replace into RealisationsRefs (referrer, realisationReference)
                 values (
@@ -439,7 +484,6 @@ LocalStore::LocalStore(const Params & params)
     }
 }
 
-
 LocalStore::LocalStore(std::string scheme, std::string path, const Params & params)
     : LocalStore(params)
 {
@@ -858,42 +902,46 @@ uint64_t LocalStore::addValidPath(State & state,
         }
     }
 
-    {
-        auto state_(Store::state.lock());
-        state_->pathInfoCache.upsert(std::string(info.path.to_string()),
-            PathInfoCacheValue{ .value = std::make_shared<const ValidPathInfo>(info) });
-    }
+    pathInfoCache.upsert(std::string(info.path.to_string()),
+        PathInfoCacheValue{ .value = std::make_shared<const ValidPathInfo>(info) });
 
     return id;
 }
 
 
+template<typename T>
+T LocalStore::withReadConnection(std::function<T(Connection &)> fun)
+{
+    return retrySQLite<T>([&]() {
+        if (readConnections) {
+            auto conn(readConnections->get());
+            return fun(*conn);
+        }
+        auto state(_state.lock());
+        return fun(*state);
+    });
+}
+
+
 void LocalStore::queryPathInfoUncached(const StorePath & path,
     Callback<std::shared_ptr<const ValidPathInfo>> callback) noexcept
 {
     try {
-        callback(retrySQLite<std::shared_ptr<const ValidPathInfo>>([&]() {
-            auto state(_state.lock());
-            return queryPathInfoInternal(*state, path);
+        callback(withReadConnection<std::shared_ptr<const ValidPathInfo>>([&](Connection & conn) {
+            return queryPathInfoInternal(conn, path);
         }));
 
     } catch (...) { callback.rethrow(); }
 }
 
 
-std::shared_ptr<const ValidPathInfo> LocalStore::queryPathInfoInternal(State & state, const StorePath & path)
+std::shared_ptr<ValidPathInfo> LocalStore::readPathInfo(const StorePath & path, SQLiteStmt::Use & use)
 {
-    /* Get the path info. */
-    auto useQueryPathInfo(state.stmts->QueryPathInfo.use()(printStorePath(path)));
-
-    if (!useQueryPathInfo.next())
-        return std::shared_ptr<ValidPathInfo>();
-
-    auto id = useQueryPathInfo.getInt(0);
+    auto id = use.getInt(0);
 
     auto narHash = Hash::dummy;
     try {
-        narHash = Hash::parseAnyPrefixed(useQueryPathInfo.getStr(1));
+        narHash = Hash::parseAnyPrefixed(use.getStr(1));
     } catch (BadHash & e) {
         throw Error("invalid-path entry for '%s': %s", printStorePath(path), e.what());
     }
@@ -902,21 +950,32 @@ std::shared_ptr<const ValidPathInfo> LocalStore::queryPathInfoInternal(State & s
 
     info->id = id;
 
-    info->registrationTime = useQueryPathInfo.getInt(2);
+    info->registrationTime = use.getInt(2);
 
-    auto s = (const char *) sqlite3_column_text(state.stmts->QueryPathInfo, 3);
-    if (s) info->deriver = parseStorePath(s);
+    if (!use.isNull(3)) info->deriver = parseStorePath(use.getStr(3));
 
     /* Note that narSize = NULL yields 0. */
-    info->narSize = useQueryPathInfo.getInt(4);
+    info->narSize = use.getInt(4);
 
-    info->ultimate = useQueryPathInfo.getInt(5) == 1;
+    info->ultimate = use.getInt(5) == 1;
 
-    s = (const char *) sqlite3_column_text(state.stmts->QueryPathInfo, 6);
-    if (s) info->sigs = tokenizeString<StringSet>(s, " ");
+    if (!use.isNull(6)) info->sigs = tokenizeString<StringSet>(use.getStr(6), " ");
 
-    s = (const char *) sqlite3_column_text(state.stmts->QueryPathInfo, 7);
-    if (s) info->ca = ContentAddress::parseOpt(s);
+    if (!use.isNull(7)) info->ca = ContentAddress::parseOpt(use.getStr(7));
+
+    return info;
+}
+
+
+std::shared_ptr<const ValidPathInfo> LocalStore::queryPathInfoInternal(Connection & state, const StorePath & path)
+{
+    /* Get the path info. */
+    auto useQueryPathInfo(state.stmts->QueryPathInfo.use()(printStorePath(path)));
+
+    if (!useQueryPathInfo.next())
+        return std::shared_ptr<ValidPathInfo>();
+
+    auto info = readPathInfo(path, useQueryPathInfo);
 
     /* Get the references. */
     auto useQueryReferences(state.stmts->QueryReferences.use()(info->id));
@@ -928,6 +987,76 @@ std::shared_ptr<const ValidPathInfo> LocalStore::queryPathInfoInternal(State & s
 }
 
 
+std::map<StorePath, ref<const ValidPathInfo>> LocalStore::queryPathInfos(const StorePathSet & paths)
+{
+    std::map<StorePath, ref<const ValidPathInfo>> res;
+    std::vector<StorePath> missing;
+
+    for (auto & path : paths) {
+        auto i = pathInfoCache.get(std::string(path.to_string()));
+        if (i && i->isKnownNow()) {
+            stats.narInfoReadAverted++;
+            if (i->didExist())
+                res.insert_or_assign(path, ref<const ValidPathInfo>(i->value));
+        } else
+            missing.push_back(path);
+    }
+
+    if (missing.empty()) return res;
+
+    /* Look up the remaining paths `pathInfoBatchSize` at a time,
+       with unused parameters bound to NULL. */
+    auto infos = withReadConnection<std::vector<std::shared_ptr<ValidPathInfo>>>([&](Connection & conn) {
+        std::vector<std::shared_ptr<ValidPathInfo>> infos;
+
+        for (size_t n = 0; n < missing.size(); n += pathInfoBatchSize) {
+            std::map<int64_t, std::shared_ptr<ValidPathInfo>> byId;
+
+            {
+                auto use(conn.stmts->QueryPathInfos.use());
+                for (size_t i = n; i < n + pathInfoBatchSize; ++i)
+                    if (i < missing.size())
+                        use(printStorePath(missing[i]));
+                    else
+                        use.bind();
+                while (use.next()) {
+                    auto info = readPathInfo(parseStorePath(use.getStr(8)), use);
+                    byId.emplace(info->id, info);
+                    infos.push_back(info);
+                }
+            }
+
+            if (byId.empty()) continue;
+
+            auto use(conn.stmts->QueryReferencesOfIds.use());
+            auto i = byId.begin();
+            for (size_t j = 0; j < pathInfoBatchSize; ++j)
+                if (i != byId.end())
+                    use((i++)->first);
+                else
+                    use.bind();
+            while (use.next())
+                byId.at(use.getInt(0))->references.insert(parseStorePath(use.getStr(1)));
+        }
+
+        return infos;
+    });
+
+    for (auto & info : infos) {
+        pathInfoCache.upsert(std::string(info->path.to_string()), PathInfoCacheValue { .value = info });
+        res.insert_or_assign(info->path, ref<const ValidPathInfo>(info));
+    }
+
+    for (auto & path : missing)
+        if (!res.count(path)) {
+            pathInfoCache.upsert(std::string(path.to_string()), PathInfoCacheValue{});
+            stats.narInfoMissing++;
+        }
+
+    return res;
+}
+
+
 /* Update path info in the database. */
 void LocalStore::updatePathInfo(State & state, const ValidPathInfo & info)
 {
@@ -942,7 +1071,7 @@ void LocalStore::updatePathInfo(State & state, const ValidPathInfo & info)
 }
 
 
-uint64_t LocalStore::queryValidPathId(State & state, const StorePath & path)
+uint64_t LocalStore::queryValidPathId(Connection & state, const StorePath & path)
 {
     auto use(state.stmts->QueryPathInfo.use()(printStorePath(path)));
     if (!use.next())
@@ -951,7 +1080,7 @@ uint64_t LocalStore::queryValidPathId(State & state, const StorePath & path)
 }
 
 
-bool LocalStore::isValidPath_(State & state, const StorePath & path)
+bool LocalStore::isValidPath_(Connection & state, const StorePath & path)
 {
     return state.stmts->QueryPathInfo.use()(printStorePath(path)).next();
 }
@@ -959,9 +1088,8 @@ bool LocalStore::isValidPath_(State & state, const StorePath & path)
 
 bool LocalStore::isValidPathUncached(const StorePath & path)
 {
-    return retrySQLite<bool>([&]() {
-        auto state(_state.lock());
-        return isValidPath_(*state, path);
+    return withReadConnection<bool>([&](Connection & conn) {
+        return isValidPath_(conn, path);
     });
 }
 
@@ -969,17 +1097,16 @@ bool LocalStore::isValidPathUncached(const StorePath & path)
 StorePathSet LocalStore::queryValidPaths(const StorePathSet & paths, SubstituteFlag maybeSubstitute)
 {
     StorePathSet res;
-    for (auto & i : paths)
-        if (isValidPath(i)) res.insert(i);
+    for (auto & [path, info] : queryPathInfos(paths))
+        res.insert(path);
     return res;
 }
 
 
 StorePathSet LocalStore::queryAllValidPaths()
 {
-    return retrySQLite<StorePathSet>([&]() {
-        auto state(_state.lock());
-        auto use(state->stmts->QueryValidPaths.use());
+    return withReadConnection<StorePathSet>([&](Connection & conn) {
+        auto use(conn.stmts->QueryValidPaths.use());
         StorePathSet res;
         while (use.next()) res.insert(parseStorePath(use.getStr(0)));
         return res;
@@ -987,7 +1114,7 @@ StorePathSet LocalStore::queryAllValidPaths()
 }
 
 
-void LocalStore::queryReferrers(State & state, const StorePath & path, StorePathSet & referrers)
+void LocalStore::queryReferrers(Connection & state, const StorePath & path, StorePathSet & referrers)
 {
     auto useQueryReferrers(state.stmts->QueryReferrers.use()(printStorePath(path)));
 
@@ -998,19 +1125,16 @@ void LocalStore::queryReferrers(State & state, const StorePath & path, StorePath
 
 void LocalStore::queryReferrers(const StorePath & path, StorePathSet & referrers)
 {
-    return retrySQLite<void>([&]() {
-        auto state(_state.lock());
-        queryReferrers(*state, path, referrers);
+    return withReadConnection<void>([&](Connection & conn) {
+        queryReferrers(conn, path, referrers);
     });
 }
 
 
 StorePathSet LocalStore::queryValidDerivers(const StorePath & path)
 {
-    return retrySQLite<StorePathSet>([&]() {
-        auto state(_state.lock());
-
-        auto useQueryValidDerivers(state->stmts->QueryValidDerivers.use()(printStorePath(path)));
+    return withReadConnection<StorePathSet>([&](Connection & conn) {
+        auto useQueryValidDerivers(conn.stmts->QueryValidDerivers.use()(printStorePath(path)));
 
         StorePathSet derivers;
         while (useQueryValidDerivers.next())
@@ -1024,12 +1148,11 @@ StorePathSet LocalStore::queryValidDerivers(const StorePath & path)
 std::map<std::string, std::optional<StorePath>>
 LocalStore::queryStaticPartialDerivationOutputMap(const StorePath & path)
 {
-    return retrySQLite<std::map<std::string, std::optional<StorePath>>>([&]() {
-        auto state(_state.lock());
+    return withReadConnection<std::map<std::string, std::optional<StorePath>>>([&](Connection & conn) {
         std::map<std::string, std::optional<StorePath>> outputs;
         uint64_t drvId;
-        drvId = queryValidPathId(*state, path);
-        auto use(state->stmts->QueryDerivationOutputs.use()(drvId));
+        drvId = queryValidPathId(conn, path);
+        auto use(conn.stmts->QueryDerivationOutputs.use()(drvId));
         while (use.next())
             outputs.insert_or_assign(
                 use.getStr(0), parseStorePath(use.getStr(1)));
@@ -1042,16 +1165,22 @@ std::optional<StorePath> LocalStore::queryPathFromHashPart(const std::string & h
 {
     if (hashPart.size() != StorePath::HashLen) throw Error("invalid hash part");
 
-    Path prefix = storeDir + "/" + hashPart;
+    return queryPathFromHashPrefix(hashPart);
+}
 
-    return retrySQLite<std::optional<StorePath>>([&]() -> std::optional<StorePath> {
-        auto state(_state.lock());
 
-        auto useQueryPathFromHashPart(state->stmts->QueryPathFromHashPart.use()(prefix));
+std::optional<StorePath> LocalStore::queryPathFromHashPrefix(std::string_view hashPrefix)
+{
+    if (hashPrefix.size() > StorePath::HashLen) throw Error("invalid hash prefix");
+
+    Path prefix = storeDir + "/" + hashPrefix;
+
+    return withReadConnection<std::optional<StorePath>>([&](Connection & conn) -> std::optional<StorePath> {
+        auto useQueryPathFromHashPart(conn.stmts->QueryPathFromHashPart.use()(prefix));
 
         if (!useQueryPathFromHashPart.next()) return {};
 
-        const char * s = (const char *) sqlite3_column_text(state->stmts->QueryPathFromHashPart, 0);
+        const char * s = (const char *) sqlite3_column_text(conn.stmts->QueryPathFromHashPart, 0);
         if (s && prefix.compare(0, prefix.size(), s, prefix.size()) == 0)
             return parseStorePath(s);
         return {};
@@ -1097,13 +1226,96 @@ void LocalStore::registerValidPath(const ValidPathInfo & info)
 
 
 void LocalStore::registerValidPaths(const ValidPathInfos & infos)
+{
+    PendingRegistration self { .infos = infos };
+    std::vector<PendingRegistration *> batch;
+
+    {
+        auto queue(_registrationQueue.lock());
+        queue->pending.push_back(&self);
+
+        /* Wait until another thread has committed our registration,
+           or until nobody is committing, in which case we commit
+           everything that is pending. */
+        while (!self.done && queue->committing)
+            queue.wait(registrationDone);
+
+        if (!self.done) {
+            queue->committing = true;
+            batch = std::move(queue->pending);
+            queue->pending.clear();
+        }
+    }
+
+    if (!batch.empty()) {
+        Finally finishCommit([&]() {
+            auto queue(_registrationQueue.lock());
+            for (auto r : batch) r->done = true;
+            queue->committing = false;
+            registrationDone.notify_all();
+        });
+
+        try {
+            commitRegistrations(batch);
+        } catch (...) {
+            for (auto r : batch)
+                if (!r->ex) r->ex = std::current_exception();
+        }
+    }
+
+    if (self.ex) std::rethrow_exception(self.ex);
+}
+
+
+void LocalStore::commitRegistrations(const std::vector<PendingRegistration *> & batch)
 {
     /* SQLite will fsync by default, but the new valid paths may not
        be fsync-ed.  So some may want to fsync them before registering
        the validity, at the expense of some speed of the path
        registering operation. */
-    if (settings.syncBeforeRegistering) sync();
+    if (settings.syncBeforeRegistering) syncStore();
+
+    if (batch.size() > 1) {
+        ValidPathInfos all;
+        for (auto r : batch)
+            for (auto & [path, info] : r->infos)
+                all.insert_or_assign(path, info);
 
+        debug("registering %d paths from %d callers in one transaction", all.size(), batch.size());
+
+        try {
+            registerValidPathsNow(all);
+            return;
+        } catch (Error & e) {
+            /* Retry each registration separately, so that callers
+               only get their own errors. */
+            debug("group registration failed, retrying separately: %s", e.what());
+        }
+    }
+
+    for (auto r : batch) {
+        try {
+            registerValidPathsNow(r->infos);
+        } catch (...) {
+            r->ex = std::current_exception();
+        }
+    }
+}
+
+
+void LocalStore::syncStore()
+{
+#if __linux__
+    /* Only flush the file system containing the store. */
+    AutoCloseFD fd = open(realStoreDir.get().c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd && syncfs(fd.get()) == 0) return;
+#endif
+    sync();
+}
+
+
+void LocalStore::registerValidPathsNow(const ValidPathInfos & infos)
+{
     return retrySQLite<void>([&]() {
         auto state(_state.lock());
 
@@ -1166,10 +1378,7 @@ void LocalStore::invalidatePath(State & state, const StorePath & path)
     /* Note that the foreign key constraints on the Refs table take
        care of deleting the references entries for `path'. */
 
-    {
-        auto state_(Store::state.lock());
-        state_->pathInfoCache.erase(std::string(path.to_string()));
-    }
+    pathInfoCache.erase(std::string(path.to_string()));
 }
 
 const PublicKeys & LocalStore::getPublicKeys()
@@ -1193,6 +1402,16 @@ bool LocalStore::realisationIsUntrusted(const Realisation & realisation)
 void LocalStore::addToStore(const ValidPathInfo & info, Source & source,
     RepairFlag repair, CheckSigsFlag checkSigs)
 {
+    addToStore(info, source, repair, checkSigs, {});
+}
+
+
+void LocalStore::addToStore(const ValidPathInfo & info, Source & source,
+    RepairFlag repair, CheckSigsFlag checkSigs,
+    std::function<void()> beforeRegistering)
+{
+    TraceSpan span("store", "addToStore %s", info.path.to_string());
+
     if (checkSigs && pathInfoIsUntrusted(info))
         throw Error("cannot add path '%s' because it lacks a signature by a trusted key", printStorePath(info.path));
 
@@ -1224,14 +1443,21 @@ void LocalStore::addToStore(const ValidPathInfo & info, Source & source,
             deletePath(realPath);
 
             /* While restoring the path from the NAR, compute the hash
-               of the NAR. */
+               of the NAR. For large NARs, do this on a separate
+               thread. */
             HashSink hashSink(htSHA256);
 
-            TeeSource wrapperSource { source, hashSink };
+            std::optional<AsyncSink> asyncHashSink;
+            if (info.narSize >= 1024 * 1024)
+                asyncHashSink.emplace(hashSink);
+
+            TeeSource wrapperSource { source, asyncHashSink ? (Sink &) *asyncHashSink : hashSink };
 
             narRead = true;
             restorePath(realPath, wrapperSource);
 
+            if (asyncHashSink) asyncHashSink->finish();
+
             auto hashResult = hashSink.finish();
 
             if (hashResult.first != info.narHash)
@@ -1263,6 +1489,8 @@ void LocalStore::addToStore(const ValidPathInfo & info, Source & source,
 
             optimisePath(realPath, repair); // FIXME: combine with hashPath()
 
+            if (beforeRegistering) beforeRegistering();
+
             registerValidPath(info);
         }
 
@@ -1271,6 +1499,150 @@ void LocalStore::addToStore(const ValidPathInfo & info, Source & source,
 }
 
 
+void LocalStore::addMultipleToStore(
+    Source & source,
+    RepairFlag repair,
+    CheckSigsFlag checkSigs)
+{
+    struct Item
+    {
+        ValidPathInfo info;
+        /**
+         * The NAR, unless it has been written to `narFile`.
+         */
+        std::string nar;
+        std::optional<Path> narFile;
+        /**
+         * Whether the paths that this path references that precede it
+         * in `source` have been registered.
+         */
+        std::vector<std::shared_future<void>> references;
+        std::promise<void> registered;
+    };
+
+    struct State
+    {
+        std::queue<std::unique_ptr<Item>> queue;
+        bool done = false;
+        std::exception_ptr failure;
+    };
+
+    Sync<State> state_;
+    std::condition_variable wakeup, space;
+
+    auto nrThreads = std::max(1U, std::thread::hardware_concurrency());
+
+    auto worker = [&]() {
+        while (true) {
+            std::unique_ptr<Item> item;
+            {
+                auto state(state_.lock());
+                while (state->queue.empty() && !state->done)
+                    state.wait(wakeup);
+                if (state->queue.empty()) return;
+                item = std::move(state->queue.front());
+                state->queue.pop();
+            }
+            space.notify_one();
+
+            try {
+                std::unique_ptr<Source> nar;
+                AutoCloseFD fd;
+                if (item->narFile) {
+                    fd = open(item->narFile->c_str(), O_RDONLY | O_CLOEXEC);
+                    if (!fd) throw SysError("opening '%s'", *item->narFile);
+                    nar = std::make_unique<FdSource>(fd.get());
+                } else
+                    nar = std::make_unique<StringSource>(item->nar);
+
+                addToStore(item->info, *nar, repair, checkSigs, [&]() {
+                    for (auto & reference : item->references)
+                        reference.get();
+                });
+
+                item->registered.set_value();
+            } catch (...) {
+                auto ex = std::current_exception();
+                item->registered.set_exception(ex);
+                auto state(state_.lock());
+                if (!state->failure) state->failure = ex;
+            }
+
+            if (item->narFile) deletePath(*item->narFile);
+        }
+    };
+
+    /* NARs that are too big to keep in memory are spilled to a
+       temporary directory in the store. */
+    std::optional<std::pair<Path, AutoCloseFD>> tempDir;
+    std::unique_ptr<AutoDelete> delTempDir;
+
+    std::vector<std::thread> workers;
+    auto joinWorkers = [&]() {
+        state_.lock()->done = true;
+        wakeup.notify_all();
+        for (auto & thread : workers)
+            thread.join();
+        workers.clear();
+    };
+    Finally cleanup(joinWorkers);
+    for (unsigned int n = 0; n < nrThreads; ++n)
+        workers.emplace_back(worker);
+
+    std::map<StorePath, std::shared_future<void>> registered;
+
+    auto expected = readNum<uint64_t>(source);
+    for (uint64_t i = 0; i < expected; ++i) {
+        auto item = std::make_unique<Item>(Item {
+            // FIXME we should not be using the worker protocol here, let
+            // alone the worker protocol with a hard-coded version!
+            .info = WorkerProto::Serialise<ValidPathInfo>::read(*this,
+                WorkerProto::ReadConn {
+                    .from = source,
+                    .version = 16,
+                }),
+        });
+        item->info.ultimate = false;
+
+        if (item->info.narSize <= settings.narBufferSize) {
+            StringSink sink;
+            copyNAR(source, sink);
+            item->nar = std::move(sink.s);
+        } else {
+            if (!tempDir) {
+                tempDir = createTempDirInStore();
+                delTempDir = std::make_unique<AutoDelete>(tempDir->first);
+            }
+            item->narFile = fmt("%s/%d", tempDir->first, i);
+            AutoCloseFD fd = open(item->narFile->c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+            if (!fd) throw SysError("creating '%s'", *item->narFile);
+            FdSink sink(fd.get());
+            copyNAR(source, sink);
+            sink.flush();
+        }
+
+        for (auto & reference : item->info.references) {
+            auto j = registered.find(reference);
+            if (j != registered.end())
+                item->references.push_back(j->second);
+        }
+        registered.insert_or_assign(item->info.path, item->registered.get_future().share());
+
+        auto state(state_.lock());
+        if (state->failure) std::rethrow_exception(state->failure);
+        while (state->queue.size() >= nrThreads)
+            state.wait(space);
+        state->queue.push(std::move(item));
+        wakeup.notify_one();
+    }
+
+    joinWorkers();
+
+    if (auto ex = state_.lock()->failure)
+        std::rethrow_exception(ex);
+}
+
+
 StorePath LocalStore::addToStoreFromDump(Source & source0, std::string_view name,
     FileIngestionMethod method, HashType hashAlgo, RepairFlag repair, const StorePathSet & references)
 {
@@ -1478,19 +1850,27 @@ std::pair<Path, AutoCloseFD> LocalStore::createTempDirInStore()
 
 
 void LocalStore::invalidatePathChecked(const StorePath & path)
+{
+    invalidatePathsChecked({path});
+}
+
+
+void LocalStore::invalidatePathsChecked(const std::vector<StorePath> & paths)
 {
     retrySQLite<void>([&]() {
         auto state(_state.lock());
 
         SQLiteTxn txn(state->db);
 
-        if (isValidPath_(*state, path)) {
-            StorePathSet referrers; queryReferrers(*state, path, referrers);
-            referrers.erase(path); /* ignore self-references */
-            if (!referrers.empty())
-                throw PathInUse("cannot delete path '%s' because it is in use by %s",
-                    printStorePath(path), showPaths(referrers));
-            invalidatePath(*state, path);
+        for (auto & path : paths) {
+            if (isValidPath_(*state, path)) {
+                StorePathSet referrers; queryReferrers(*state, path, referrers);
+                referrers.erase(path); /* ignore self-references */
+                if (!referrers.empty())
+                    throw PathInUse("cannot delete path '%s' because it is in use by %s",
+                        printStorePath(path), showPaths(referrers));
+                invalidatePath(*state, path);
+            }
         }
 
         txn.commit();
@@ -1498,6 +1878,95 @@ void LocalStore::invalidatePathChecked(const StorePath & path)
 }
 
 
+ReferenceGraph LocalStore::loadReferenceGraph()
+{
+    return withReadConnection<ReferenceGraph>([&](Connection & conn) {
+        ReferenceGraph graph;
+
+        /* Read all tables in one transaction, so that they're
+           consistent with each other. */
+        SQLiteTxn txn(conn.db);
+
+        /* The database IDs of the paths, in increasing order, so that
+           the index of an ID can be found by binary search. */
+        std::vector<int64_t> ids;
+        std::vector<std::pair<uint32_t, std::string>> derivers;
+
+        auto hashPartOf = [&](std::string_view path) {
+            return baseNameOf(path).substr(0, StorePath::HashLen);
+        };
+
+        {
+            SQLiteStmt stmt(conn.db, "select id, path, deriver from ValidPaths order by id;");
+            auto use(stmt.use());
+            while (use.next()) {
+                auto path = use.getStr(1);
+                if (!use.isNull(2))
+                    derivers.emplace_back(ids.size(), use.getStr(2));
+                ids.push_back(use.getInt(0));
+                graph.hashParts.append(hashPartOf(path));
+            }
+        }
+
+        auto n = ids.size();
+
+        for (uint32_t i = 0; i < n; ++i)
+            graph.byHashPart.emplace(
+                std::string_view(graph.hashParts).substr(i * StorePath::HashLen, StorePath::HashLen), i);
+
+        auto indexOf = [&](int64_t id) {
+            auto i = std::lower_bound(ids.begin(), ids.end(), id);
+            return i != ids.end() && *i == id ? (uint32_t) (i - ids.begin()) : ReferenceGraph::none;
+        };
+
+        graph.derivers.assign(n, ReferenceGraph::none);
+        for (auto & [i, deriver] : derivers)
+            graph.derivers[i] = graph.find(hashPartOf(deriver));
+
+        /* Turn a list of edges into adjacency arrays. */
+        auto makeAdjacency = [&](const std::vector<std::pair<uint32_t, uint32_t>> & edges,
+            std::vector<uint32_t> & start, std::vector<uint32_t> & targets)
+        {
+            start.assign(n + 1, 0);
+            for (auto & [from, to] : edges) start[from + 1]++;
+            for (size_t i = 0; i < n; ++i) start[i + 1] += start[i];
+            targets.resize(edges.size());
+            auto next = start;
+            for (auto & [from, to] : edges) targets[next[from]++] = to;
+        };
+
+        std::vector<std::pair<uint32_t, uint32_t>> edges;
+
+        {
+            SQLiteStmt stmt(conn.db, "select referrer, reference from Refs;");
+            auto use(stmt.use());
+            while (use.next()) {
+                auto from = indexOf(use.getInt(0)), to = indexOf(use.getInt(1));
+                if (from != ReferenceGraph::none && to != ReferenceGraph::none)
+                    edges.emplace_back(from, to);
+            }
+        }
+
+        makeAdjacency(edges, graph.referencesStart, graph.references);
+        edges.clear();
+
+        {
+            SQLiteStmt stmt(conn.db, "select drv, path from DerivationOutputs;");
+            auto use(stmt.use());
+            while (use.next()) {
+                auto from = indexOf(use.getInt(0)), to = graph.find(hashPartOf(use.getStr(1)));
+                if (from != ReferenceGraph::none && to != ReferenceGraph::none)
+                    edges.emplace_back(from, to);
+            }
+        }
+
+        makeAdjacency(edges, graph.outputsStart, graph.outputs);
+
+        return graph;
+    });
+}
+
+
 bool LocalStore::verifyStore(bool checkContents, RepairFlag repair)
 {
     printInfo("reading the Nix store...");
@@ -1540,81 +2009,118 @@ bool LocalStore::verifyStore(bool checkContents, RepairFlag repair)
     /* Optionally, check the content hashes (slow). */
     if (checkContents) {
 
+        std::atomic<bool> contentErrors{false};
+
         printInfo("checking link hashes...");
 
-        for (auto & link : readDirectory(linksDir)) {
-            printMsg(lvlTalkative, "checking contents of '%s'", link.name);
-            Path linkPath = linksDir + "/" + link.name;
-            std::string hash = hashPath(htSHA256, linkPath).first.to_string(HashFormat::Base32, false);
-            if (hash != link.name) {
-                printError("link '%s' was modified! expected hash '%s', got '%s'",
-                    linkPath, link.name, hash);
-                if (repair) {
-                    if (unlink(linkPath.c_str()) == 0)
-                        printInfo("removed link '%s'", linkPath);
-                    else
-                        throw SysError("removing corrupt link '%s'", linkPath);
-                } else {
-                    errors = true;
-                }
+        {
+            ThreadPool pool(settings.verifyJobs);
+
+            for (auto & link : readDirectory(linksDir)) {
+                pool.enqueue([&, name(link.name)]() {
+                    checkInterrupt();
+                    printMsg(lvlTalkative, "checking contents of '%s'", name);
+                    Path linkPath = linksDir + "/" + name;
+                    std::string hash = hashPath(htSHA256, linkPath).first.to_string(HashFormat::Base32, false);
+                    if (hash != name) {
+                        printError("link '%s' was modified! expected hash '%s', got '%s'",
+                            linkPath, name, hash);
+                        if (repair) {
+                            if (unlink(linkPath.c_str()) == 0)
+                                printInfo("removed link '%s'", linkPath);
+                            else
+                                throw SysError("removing corrupt link '%s'", linkPath);
+                        } else {
+                            contentErrors = true;
+                        }
+                    }
+                });
             }
+
+            pool.process();
         }
 
         printInfo("checking store hashes...");
 
         Hash nullHash(htSHA256);
 
-        for (auto & i : validPaths) {
-            try {
-                auto info = std::const_pointer_cast<ValidPathInfo>(std::shared_ptr<const ValidPathInfo>(queryPathInfo(i)));
-
-                /* Check the content hash (optionally - slow). */
-                printMsg(lvlTalkative, "checking contents of '%s'", printStorePath(i));
-
-                auto hashSink = HashSink(info->narHash.type);
-
-                dumpPath(Store::toRealPath(i), hashSink);
-                auto current = hashSink.finish();
+        /* Paths are checked in parallel, in the order in which they
+           are likely to be laid out on disk. Repairs are done
+           afterwards, since they may involve builds. */
+        Sync<StorePathSet> toRepair_;
 
-                if (info->narHash != nullHash && info->narHash != current.first) {
-                    printError("path '%s' was modified! expected hash '%s', got '%s'",
-                        printStorePath(i), info->narHash.to_string(HashFormat::Base32, true), current.first.to_string(HashFormat::Base32, true));
-                    if (repair) repairPath(i); else errors = true;
-                } else {
+        Activity act(*logger, actVerifyPaths);
+        std::atomic<size_t> done{0};
+        act.progress(0, validPaths.size());
 
-                    bool update = false;
-
-                    /* Fill in missing hashes. */
-                    if (info->narHash == nullHash) {
-                        printInfo("fixing missing hash on '%s'", printStorePath(i));
-                        info->narHash = current.first;
-                        update = true;
+        {
+            ThreadPool pool(settings.verifyJobs);
+
+            for (auto & i : sortByInode(validPaths)) {
+                pool.enqueue([&, i]() {
+                    checkInterrupt();
+
+                    try {
+                        auto info = std::const_pointer_cast<ValidPathInfo>(std::shared_ptr<const ValidPathInfo>(queryPathInfo(i)));
+
+                        /* Check the content hash (optionally - slow). */
+                        printMsg(lvlTalkative, "checking contents of '%s'", printStorePath(i));
+
+                        auto hashSink = HashSink(info->narHash.type);
+
+                        dumpPath(Store::toRealPath(i), hashSink);
+                        auto current = hashSink.finish();
+
+                        if (info->narHash != nullHash && info->narHash != current.first) {
+                            printError("path '%s' was modified! expected hash '%s', got '%s'",
+                                printStorePath(i), info->narHash.to_string(HashFormat::Base32, true), current.first.to_string(HashFormat::Base32, true));
+                            if (repair) toRepair_.lock()->insert(i); else contentErrors = true;
+                        } else {
+
+                            bool update = false;
+
+                            /* Fill in missing hashes. */
+                            if (info->narHash == nullHash) {
+                                printInfo("fixing missing hash on '%s'", printStorePath(i));
+                                info->narHash = current.first;
+                                update = true;
+                            }
+
+                            /* Fill in missing narSize fields (from old stores). */
+                            if (info->narSize == 0) {
+                                printInfo("updating size field on '%s' to %s", printStorePath(i), current.second);
+                                info->narSize = current.second;
+                                update = true;
+                            }
+
+                            if (update) {
+                                auto state(_state.lock());
+                                updatePathInfo(*state, *info);
+                            }
+
+                        }
+
+                    } catch (Error & e) {
+                        /* It's possible that the path got GC'ed, so ignore
+                           errors on invalid paths. */
+                        if (isValidPath(i))
+                            logError(e.info());
+                        else
+                            warn(e.msg());
+                        contentErrors = true;
                     }
 
-                    /* Fill in missing narSize fields (from old stores). */
-                    if (info->narSize == 0) {
-                        printInfo("updating size field on '%s' to %s", printStorePath(i), current.second);
-                        info->narSize = current.second;
-                        update = true;
-                    }
+                    act.progress(++done, validPaths.size());
+                });
+            }
 
-                    if (update) {
-                        auto state(_state.lock());
-                        updatePathInfo(*state, *info);
-                    }
+            pool.process();
+        }
 
-                }
+        for (auto & i : *toRepair_.lock())
+            repairPath(i);
 
-            } catch (Error & e) {
-                /* It's possible that the path got GC'ed, so ignore
-                   errors on invalid paths. */
-                if (isValidPath(i))
-                    logError(e.info());
-                else
-                    warn(e.msg());
-                errors = true;
-            }
-        }
+        if (contentErrors) errors = true;
     }
 
     return errors;
@@ -1779,7 +2285,7 @@ void LocalStore::signPathInfo(ValidPathInfo & info)
 
 
 std::optional<std::pair<int64_t, Realisation>> LocalStore::queryRealisationCore_(
-        LocalStore::State & state,
+        LocalStore::Connection & state,
         const DrvOutput & id)
 {
     auto useQueryRealisedOutput(
@@ -1804,7 +2310,7 @@ std::optional<std::pair<int64_t, Realisation>> LocalStore::queryRealisationCore_
 }
 
 std::optional<const Realisation> LocalStore::queryRealisation_(
-            LocalStore::State & state,
+            LocalStore::Connection & state,
             const DrvOutput & id)
 {
     auto maybeCore = queryRealisationCore_(state, id);
@@ -1852,6 +2358,19 @@ void LocalStore::queryRealisationUncached(const DrvOutput & id,
     }
 }
 
+std::map<DrvOutput, ref<const Realisation>> LocalStore::queryRealisations(const std::set<DrvOutput> & ids)
+{
+    /* Look up all outputs on one connection rather than acquiring
+       one per output. */
+    return withReadConnection<std::map<DrvOutput, ref<const Realisation>>>([&](Connection & conn) {
+        std::map<DrvOutput, ref<const Realisation>> res;
+        for (auto & id : ids)
+            if (auto realisation = queryRealisation_(conn, id))
+                res.insert_or_assign(id, make_ref<const Realisation>(*realisation));
+        return res;
+    });
+}
+
 ContentAddress LocalStore::hashCAPath(
     const ContentAddressMethod & method, const HashType & hashType,
     const StorePath & path)
@@ -1894,15 +2413,19 @@ void LocalStore::addBuildLog(const StorePath & drvPath, std::string_view log)
 
     auto baseName = drvPath.to_string();
 
-    auto logPath = fmt("%s/%s/%s/%s.bz2", logDir, drvsLogDir, baseName.substr(0, 2), baseName.substr(2));
+    auto logPathBase = fmt("%s/%s/%s/%s", logDir, drvsLogDir, baseName.substr(0, 2), baseName.substr(2));
+
+    for (auto & [_, extension] : logCompressionMethods)
+        if (pathExists(logPathBase + extension)) return;
 
-    if (pathExists(logPath)) return;
+    auto method = settings.buildLogCompression.get();
+    auto logPath = logPathBase + logExtension(method);
 
     createDirs(dirOf(logPath));
 
     auto tmpFile = fmt("%s.tmp.%d", logPath, getpid());
 
-    writeFile(tmpFile, compress("bzip2", log));
+    writeFile(tmpFile, compress(method, log));
 
     renameFile(tmpFile, logPath);
 }
@@ -17,6 +17,8 @@
 
 namespace nix {
 
+template<typename T> class Pool;
+
 
 /**
  * Nix store and database schema version.
@@ -36,6 +38,45 @@ struct OptimiseStats
     uint64_t blocksFreed = 0;
 };
 
+/**
+ * The references, derivers and derivation outputs of all valid paths,
+ * loaded from the database in one go. Paths are identified by their
+ * index, and edges are stored as adjacency arrays: the references of
+ * path `i` are `references[referencesStart[i]]` up to
+ * `references[referencesStart[i + 1]]`, and likewise for outputs.
+ */
+struct ReferenceGraph
+{
+    static constexpr uint32_t none = std::numeric_limits<uint32_t>::max();
+
+    /**
+     * The hash parts of the paths, concatenated.
+     */
+    std::string hashParts;
+
+    std::unordered_map<std::string_view, uint32_t> byHashPart;
+
+    std::vector<uint32_t> referencesStart, references;
+
+    std::vector<uint32_t> outputsStart, outputs;
+
+    /**
+     * The deriver of each path, or `none`.
+     */
+    std::vector<uint32_t> derivers;
+
+    size_t size() const
+    {
+        return derivers.size();
+    }
+
+    uint32_t find(std::string_view hashPart) const
+    {
+        auto i = byHashPart.find(hashPart);
+        return i == byHashPart.end() ? none : i->second;
+    }
+};
+
 struct LocalStoreConfig : virtual LocalFSStoreConfig
 {
     using LocalFSStoreConfig::LocalFSStoreConfig;
@@ -78,7 +119,10 @@ private:
      */
     AutoCloseFD globalLock;
 
-    struct State
+    /**
+     * A connection to the Nix database and its prepared statements.
+     */
+    struct Connection
     {
         /**
          * The SQLite database object.
@@ -87,6 +131,10 @@ private:
 
         struct Stmts;
         std::unique_ptr<Stmts> stmts;
+    };
+
+    struct State : Connection
+    {
 
         /**
          * The last time we checked whether to do an auto-GC, or an
@@ -109,11 +157,102 @@ private:
          */
         uint64_t availAfterGC = std::numeric_limits<uint64_t>::max();
 
+        /**
+         * The paths that the previous rate-limited auto-GC found to
+         * be alive, so that the next one doesn't have to check them
+         * again.
+         */
+        StorePathSet autoGCAlive;
+
         std::unique_ptr<PublicKeys> publicKeys;
     };
 
     Sync<State> _state;
 
+    /**
+     * Read-only connections used by queries that don't need to see
+     * uncommitted changes, so that they neither wait for `_state`
+     * nor for each other. Only available in WAL mode, where readers
+     * don't block the writer.
+     */
+    std::shared_ptr<Pool<Connection>> readConnections;
+
+    /**
+     * Run `fun` on a connection from `readConnections` if available,
+     * or on the main connection otherwise.
+     */
+    template<typename T>
+    T withReadConnection(std::function<T(Connection &)> fun);
+
+    /**
+     * A persistent index of the inodes of the files in `linksDir`, and
+     * of the store paths that have already been optimised, so that
+     * `optimiseStore()` doesn't have to read all of `linksDir` or
+     * re-hash paths it has seen before. It lives in a separate
+     * database (`optimise.sqlite`) and is only a hint: `linksDir`
+     * itself remains authoritative.
+     */
+    struct OptimiseIndex
+    {
+        SQLite db;
+        SQLiteStmt insertLink, deleteLink, queryLink, insertPath, queryPaths;
+        bool populated = false;
+    };
+
+    /**
+     * Opened on first use. Empty if the index could not be opened,
+     * e.g. because the store is read-only.
+     */
+    Sync<std::unique_ptr<OptimiseIndex>> _optimiseIndex;
+    bool optimiseIndexFailed = false;
+
+    /**
+     * Run `fun` on the optimise index. Returns false if the index is
+     * not available.
+     */
+    bool withOptimiseIndex(std::function<void(OptimiseIndex &)> fun);
+
+    /**
+     * A call to `registerValidPaths()` waiting to be committed.
+     */
+    struct PendingRegistration
+    {
+        const ValidPathInfos & infos;
+        bool done = false;
+        std::exception_ptr ex;
+    };
+
+    /**
+     * Registrations made while another one is being committed are
+     * queued, and then committed together by one of the waiting
+     * threads with a single sync and SQLite transaction (group
+     * commit).
+     */
+    struct RegistrationQueue
+    {
+        std::vector<PendingRegistration *> pending;
+        bool committing = false;
+    };
+
+    Sync<RegistrationQueue> _registrationQueue;
+    std::condition_variable registrationDone;
+
+    /**
+     * Commit a batch of registrations, setting the `ex` of those
+     * that failed.
+     */
+    void commitRegistrations(const std::vector<PendingRegistration *> & batch);
+
+    /**
+     * Register `infos` in one transaction.
+     */
+    void registerValidPathsNow(const ValidPathInfos & infos);
+
+    /**
+     * Flush the store's file system to disk.
+     */
+    void syncStore();
+
 public:
 
     const Path dbDir;
@@ -162,6 +301,8 @@ public:
     void queryPathInfoUncached(const StorePath & path,
         Callback<std::shared_ptr<const ValidPathInfo>> callback) noexcept override;
 
+    std::map<StorePath, ref<const ValidPathInfo>> queryPathInfos(const StorePathSet & paths) override;
+
     void queryReferrers(const StorePath & path, StorePathSet & referrers) override;
 
     StorePathSet queryValidDerivers(const StorePath & path) override;
@@ -170,6 +311,8 @@ public:
 
     std::optional<StorePath> queryPathFromHashPart(const std::string & hashPart) override;
 
+    std::optional<StorePath> queryPathFromHashPrefix(std::string_view prefix) override;
+
     StorePathSet querySubstitutablePaths(const StorePathSet & paths) override;
 
     bool pathInfoIsUntrusted(const ValidPathInfo &) override;
@@ -178,6 +321,19 @@ public:
     void addToStore(const ValidPathInfo & info, Source & source,
         RepairFlag repair, CheckSigsFlag checkSigs) override;
 
+    using Store::addMultipleToStore;
+
+    /**
+     * Add the paths in `source` (see `Store::addMultipleToStore()`).
+     * The NARs are read one after the other, but restored and
+     * verified on several threads. A path is registered only after
+     * the paths it references that precede it in `source`.
+     */
+    void addMultipleToStore(
+        Source & source,
+        RepairFlag repair,
+        CheckSigsFlag checkSigs) override;
+
     StorePath addToStoreFromDump(Source & dump, std::string_view name,
         FileIngestionMethod method, HashType hashAlgo, RepairFlag repair, const StorePathSet & references) override;
 
@@ -189,10 +345,23 @@ public:
 
     void addTempRoot(const StorePath & path) override;
 
+    /**
+     * Register the roots with a running garbage collector, and
+     * record them in our temporary roots file, with one write each.
+     * Roots that were already added are skipped.
+     */
+    void addTempRoots(const StorePathSet & paths) override;
+
 private:
 
     void createTempRootsFile();
 
+    /**
+     * The temporary roots added so far. They last until we exit, so
+     * there is no need to add them again.
+     */
+    Sync<StorePathSet> _addedTempRoots;
+
     /**
      * The file to which we write our temporary roots.
      */
@@ -256,6 +425,10 @@ public:
      */
     void registerValidPath(const ValidPathInfo & info);
 
+    /**
+     * Register the validity of several paths at once. Calls made
+     * concurrently from several threads are committed together.
+     */
     void registerValidPaths(const ValidPathInfos & infos);
 
     unsigned int getProtocol() override;
@@ -268,7 +441,9 @@ public:
 
     /**
      * If free disk space in /nix/store if below minFree, delete
-     * garbage until it exceeds maxFree.
+     * garbage until it exceeds maxFree. If `sync` is set, wait for
+     * the collection to finish, unless it's rate-limited by
+     * `auto-gc-max-rate`.
      */
     void autoGC(bool sync = true);
 
@@ -284,10 +459,11 @@ public:
         const std::string & outputName,
         const StorePath & output);
 
-    std::optional<const Realisation> queryRealisation_(State & state, const DrvOutput & id);
-    std::optional<std::pair<int64_t, Realisation>> queryRealisationCore_(State & state, const DrvOutput & id);
+    std::optional<const Realisation> queryRealisation_(Connection & state, const DrvOutput & id);
+    std::optional<std::pair<int64_t, Realisation>> queryRealisationCore_(Connection & state, const DrvOutput & id);
     void queryRealisationUncached(const DrvOutput&,
         Callback<std::shared_ptr<const Realisation>> callback) noexcept override;
+    std::map<DrvOutput, ref<const Realisation>> queryRealisations(const std::set<DrvOutput> & ids) override;
 
     std::optional<std::string> getVersion() override;
 
@@ -301,9 +477,11 @@ private:
 
     void openDB(State & state, bool create);
 
+    void prepareStatements(Connection & conn);
+
     void makeStoreWritable();
 
-    uint64_t queryValidPathId(State & state, const StorePath & path);
+    uint64_t queryValidPathId(Connection & state, const StorePath & path);
 
     uint64_t addValidPath(State & state, const ValidPathInfo & info, bool checkOutputs = true);
 
@@ -314,10 +492,30 @@ private:
      */
     void invalidatePathChecked(const StorePath & path);
 
+    /**
+     * Delete a sequence of paths from the Nix database in a single
+     * transaction. Each path may only be referenced by paths that
+     * precede it.
+     */
+    void invalidatePathsChecked(const std::vector<StorePath> & paths);
+
+    /**
+     * Load the graph of all valid paths from a consistent snapshot of
+     * the database, using one sequential scan of each table.
+     */
+    ReferenceGraph loadReferenceGraph();
+
     void verifyPath(const StorePath & path, const StorePathSet & store,
         StorePathSet & done, StorePathSet & validPaths, RepairFlag repair, bool & errors);
 
-    std::shared_ptr<const ValidPathInfo> queryPathInfoInternal(State & state, const StorePath & path);
+    std::shared_ptr<const ValidPathInfo> queryPathInfoInternal(Connection & state, const StorePath & path);
+
+    /**
+     * Construct a ValidPathInfo for `path` from the current row of a
+     * `QueryPathInfo` or `QueryPathInfos` statement, without its
+     * references.
+     */
+    std::shared_ptr<ValidPathInfo> readPathInfo(const StorePath & path, SQLiteStmt::Use & use);
 
     void updatePathInfo(State & state, const ValidPathInfo & info);
 
@@ -334,15 +532,25 @@ private:
 
     std::pair<Path, AutoCloseFD> createTempDirInStore();
 
+    /**
+     * Like `addToStore()`, but call `beforeRegistering` once the path
+     * has been restored and verified, just before it is registered.
+     */
+    void addToStore(const ValidPathInfo & info, Source & source,
+        RepairFlag repair, CheckSigsFlag checkSigs,
+        std::function<void()> beforeRegistering);
+
     typedef std::unordered_set<ino_t> InodeHash;
 
     InodeHash loadInodeHash();
+    void indexLinks(OptimiseIndex & index);
+    bool isKnownLink(ino_t ino, const InodeHash & inodeHash);
     Strings readDirectoryIgnoringInodes(const Path & path, const InodeHash & inodeHash);
-    void optimisePath_(Activity * act, OptimiseStats & stats, const Path & path, InodeHash & inodeHash, RepairFlag repair);
+    void optimisePath_(Activity * act, OptimiseStats & stats, const Path & path, const InodeHash & inodeHash, RepairFlag repair);
 
     // Internal versions that are not wrapped in retry_sqlite.
-    bool isValidPath_(State & state, const StorePath & path);
-    void queryReferrers(State & state, const StorePath & path, StorePathSet & referrers);
+    bool isValidPath_(Connection & state, const StorePath & path);
+    void queryReferrers(Connection & state, const StorePath & path, StorePathSet & referrers);
 
     /**
      * Add signatures to a ValidPathInfo or Realisation using the secret keys
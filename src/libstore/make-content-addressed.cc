@@ -1,5 +1,6 @@
 #include "make-content-addressed.hh"
 #include "references.hh"
+#include "thread-pool.hh"
 
 namespace nix {
 
@@ -11,42 +12,56 @@ std::map<StorePath, StorePath> makeContentAddressed(
     StorePathSet closure;
     srcStore.computeFSClosure(storePaths, closure);
 
-    auto paths = srcStore.topoSortPaths(closure);
+    auto infos = srcStore.queryPathInfos(closure);
 
-    std::reverse(paths.begin(), paths.end());
+    Sync<std::map<StorePath, StorePath>> remappings_;
 
-    std::map<StorePath, StorePath> remappings;
+    auto rewritePath = [&](const StorePath & path) {
+        checkInterrupt();
 
-    for (auto & path : paths) {
         auto pathS = srcStore.printStorePath(path);
-        auto oldInfo = srcStore.queryPathInfo(path);
+        auto & oldInfo = infos.at(path);
         std::string oldHashPart(path.hashPart());
 
-        StringSink sink;
-        srcStore.narFromPath(path, sink);
-
         StringMap rewrites;
 
         StoreReferences refs;
-        for (auto & ref : oldInfo->references) {
-            if (ref == path)
-                refs.self = true;
-            else {
-                auto i = remappings.find(ref);
-                auto replacement = i != remappings.end() ? i->second : ref;
-                // FIXME: warn about unremapped paths?
-                if (replacement != ref)
-                    rewrites.insert_or_assign(srcStore.printStorePath(ref), srcStore.printStorePath(replacement));
-                refs.others.insert(std::move(replacement));
+        {
+            auto remappings(remappings_.lock());
+            for (auto & ref : oldInfo->references) {
+                if (ref == path)
+                    refs.self = true;
+                else {
+                    auto i = remappings->find(ref);
+                    auto replacement = i != remappings->end() ? i->second : ref;
+                    // FIXME: warn about unremapped paths?
+                    if (replacement != ref)
+                        rewrites.insert_or_assign(srcStore.printStorePath(ref), srcStore.printStorePath(replacement));
+                    refs.others.insert(std::move(replacement));
+                }
             }
         }
 
-        sink.s = rewriteStrings(sink.s, rewrites);
+        /* Rewrite the references in a single pass over the NAR,
+           spooling the result to a temporary file while computing
+           the hash modulo the old self-references. The final NAR is
+           only known once the new path is, so it is produced from the
+           temporary file by rewriting the self-references, once to
+           hash it and once to add it to the destination store. */
+        auto [fdTemp, fnTemp] = createTempFile();
+        AutoDelete autoDelete(fnTemp);
 
         HashModuloSink hashModuloSink(htSHA256, oldHashPart);
-        hashModuloSink(sink.s);
+        {
+            FdSink fileSink(fdTemp.get());
+            TeeSink teeSink { fileSink, hashModuloSink };
+            RewritingSink rsink(rewrites, teeSink);
+            srcStore.narFromPath(path, rsink);
+            rsink.flush();
+            fileSink.flush();
+        }
 
-        auto narModuloHash = hashModuloSink.finish().first;
+        auto [narModuloHash, narSize] = hashModuloSink.finish();
 
         ValidPathInfo info {
             dstStore,
@@ -61,21 +76,38 @@ std::map<StorePath, StorePath> makeContentAddressed(
 
         printInfo("rewriting '%s' to '%s'", pathS, dstStore.printStorePath(info.path));
 
-        StringSink sink2;
-        RewritingSink rsink2(oldHashPart, std::string(info.path.hashPart()), sink2);
-        rsink2(sink.s);
-        rsink2.flush();
+        std::string newHashPart(info.path.hashPart());
+
+        auto replay = [&, fd(fdTemp.get())](Sink & sink) {
+            if (lseek(fd, 0, SEEK_SET) == -1)
+                throw SysError("seeking in '%s'", fnTemp);
+            FdSource source(fd);
+            RewritingSink rsink(oldHashPart, newHashPart, sink);
+            source.drainInto(rsink);
+            rsink.flush();
+        };
+
+        HashSink narHashSink(htSHA256);
+        replay(narHashSink);
+
+        info.narHash = narHashSink.finish().first;
+        info.narSize = narSize;
+
+        auto source = sinkToSource(replay);
+        dstStore.addToStore(info, *source);
 
-        info.narHash = hashString(htSHA256, sink2.s);
-        info.narSize = sink.s.size();
+        remappings_.lock()->insert_or_assign(path, std::move(info.path));
+    };
 
-        StringSource source(sink2.s);
-        dstStore.addToStore(info, source);
+    /* Rewrite paths in parallel once the paths they refer to have
+       been rewritten. */
+    ThreadPool pool;
 
-        remappings.insert_or_assign(std::move(path), std::move(info.path));
-    }
+    processGraph<StorePath>(pool, closure,
+        [&](const StorePath & path) { return infos.at(path)->references; },
+        rewritePath);
 
-    return remappings;
+    return std::move(*remappings_.lock());
 }
 
 StorePath makeContentAddressed(
@@ -0,0 +1,240 @@
+#include "store-api.hh"
+#include "archive.hh"
+#include "callback.hh"
+#include "remote-fs-accessor.hh"
+#include "realisation.hh"
+#include "sync.hh"
+
+namespace nix {
+
+struct MemoryStoreConfig : virtual StoreConfig {
+    using StoreConfig::StoreConfig;
+
+    const std::string name() override { return "Memory Store"; }
+
+    std::string doc() override
+    {
+        return
+          #include "memory-store.md"
+          ;
+    }
+};
+
+/**
+ * A store that keeps its paths, as NARs, in memory.
+ */
+struct MemoryStore : public virtual MemoryStoreConfig, public virtual Store
+{
+    struct Entry
+    {
+        ref<const ValidPathInfo> info;
+        ref<const std::string> nar;
+    };
+
+    struct State
+    {
+        /**
+         * Keyed by hash part, for `queryPathFromHashPart()`.
+         */
+        std::map<std::string, Entry, std::less<>> paths;
+
+        std::map<DrvOutput, ref<const Realisation>> realisations;
+    };
+
+    Sync<State> _state;
+
+    MemoryStore(const std::string scheme, const std::string uri, const Params & params)
+        : MemoryStore(params)
+    { }
+
+    MemoryStore(const Params & params)
+        : StoreConfig(params)
+        , MemoryStoreConfig(params)
+        , Store(params)
+    { }
+
+    std::string getUri() override
+    {
+        return *uriSchemes().begin();
+    }
+
+    static std::set<std::string> uriSchemes() {
+        return {"memory"};
+    }
+
+    std::optional<TrustedFlag> isTrustedClient() override
+    {
+        return Trusted;
+    }
+
+    void queryPathInfoUncached(const StorePath & path,
+        Callback<std::shared_ptr<const ValidPathInfo>> callback) noexcept override
+    {
+        try {
+            callback(lookup(path));
+        } catch (...) { callback.rethrow(); }
+    }
+
+    std::optional<Entry> lookupEntry(const StorePath & path)
+    {
+        auto state(_state.lock());
+        auto i = state->paths.find(path.hashPart());
+        if (i == state->paths.end() || i->second.info->path != path)
+            return std::nullopt;
+        return i->second;
+    }
+
+    std::shared_ptr<const ValidPathInfo> lookup(const StorePath & path)
+    {
+        auto entry = lookupEntry(path);
+        return entry ? entry->info.get_ptr() : nullptr;
+    }
+
+    std::optional<StorePath> queryPathFromHashPart(const std::string & hashPart) override
+    {
+        auto state(_state.lock());
+        auto i = state->paths.find(hashPart);
+        if (i == state->paths.end()) return std::nullopt;
+        return i->second.info->path;
+    }
+
+    StorePathSet queryAllValidPaths() override
+    {
+        StorePathSet paths;
+        for (auto & [_, entry] : _state.lock()->paths)
+            paths.insert(entry.info->path);
+        return paths;
+    }
+
+    void addPath(ValidPathInfo && info, std::string && nar, RepairFlag repair)
+    {
+        auto state(_state.lock());
+        auto hashPart = std::string(info.path.hashPart());
+        auto i = state->paths.find(hashPart);
+        if (i != state->paths.end() && !repair) return;
+        state->paths.insert_or_assign(std::move(hashPart),
+            Entry {
+                make_ref<const ValidPathInfo>(std::move(info)),
+                make_ref<const std::string>(std::move(nar)),
+            });
+    }
+
+    void addToStore(const ValidPathInfo & info, Source & source,
+        RepairFlag repair, CheckSigsFlag checkSigs) override
+    {
+        StringSink nar;
+        copyNAR(source, nar);
+
+        auto narHash = hashString(info.narHash.type, nar.s);
+        if (narHash != info.narHash)
+            throw Error("hash mismatch importing path '%s';\n  specified: %s\n  got:       %s",
+                printStorePath(info.path),
+                info.narHash.to_string(HashFormat::Base32, true),
+                narHash.to_string(HashFormat::Base32, true));
+
+        if (info.narSize && info.narSize != nar.s.size())
+            throw Error("size mismatch importing path '%s';\n  specified: %s\n  got:       %s",
+                printStorePath(info.path), info.narSize, nar.s.size());
+
+        auto info2(info);
+        info2.narSize = nar.s.size();
+        addPath(std::move(info2), std::move(nar.s), repair);
+    }
+
+    StorePath addToStoreFromDump(Source & dump, std::string_view name,
+        FileIngestionMethod method, HashType hashAlgo, RepairFlag repair,
+        const StorePathSet & references) override
+    {
+        auto contents = dump.drain();
+
+        std::string nar;
+        if (method == FileIngestionMethod::Recursive)
+            nar = contents;
+        else {
+            StringSink sink;
+            dumpString(contents, sink);
+            nar = std::move(sink.s);
+        }
+
+        ValidPathInfo info {
+            *this,
+            name,
+            FixedOutputInfo {
+                .method = method,
+                .hash = hashString(hashAlgo, contents),
+                .references = {
+                    .others = references,
+                    // caller is not capable of creating a self-reference, because this is content-addressed without modulus
+                    .self = false,
+                },
+            },
+            hashString(htSHA256, nar),
+        };
+        info.narSize = nar.size();
+
+        auto path = info.path;
+        addPath(std::move(info), std::move(nar), repair);
+        return path;
+    }
+
+    StorePath addTextToStore(
+        std::string_view name,
+        std::string_view s,
+        const StorePathSet & references,
+        RepairFlag repair) override
+    {
+        StringSink nar;
+        dumpString(s, nar);
+
+        ValidPathInfo info {
+            *this,
+            std::string { name },
+            TextInfo {
+                .hash = hashString(htSHA256, s),
+                .references = references,
+            },
+            hashString(htSHA256, nar.s),
+        };
+        info.narSize = nar.s.size();
+
+        auto path = info.path;
+        addPath(std::move(info), std::move(nar.s), repair);
+        return path;
+    }
+
+    void narFromPath(const StorePath & path, Sink & sink) override
+    {
+        auto entry = lookupEntry(path);
+        if (!entry)
+            throw InvalidPath("path '%s' is not valid", printStorePath(path));
+        sink(*entry->nar);
+    }
+
+    void registerDrvOutput(const Realisation & output) override
+    {
+        _state.lock()->realisations.insert_or_assign(output.id, make_ref<const Realisation>(output));
+    }
+
+    void queryRealisationUncached(const DrvOutput & id,
+        Callback<std::shared_ptr<const Realisation>> callback) noexcept override
+    {
+        try {
+            std::shared_ptr<const Realisation> res;
+            {
+                auto state(_state.lock());
+                auto i = state->realisations.find(id);
+                if (i != state->realisations.end()) res = i->second.get_ptr();
+            }
+            callback(std::move(res));
+        } catch (...) { callback.rethrow(); }
+    }
+
+    ref<FSAccessor> getFSAccessor() override
+    {
+        return make_ref<RemoteFSAccessor>(ref<Store>(shared_from_this()));
+    }
+};
+
+static RegisterStoreImplementation<MemoryStore, MemoryStoreConfig> regMemoryStore;
+
+}
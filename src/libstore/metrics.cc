@@ -0,0 +1,199 @@
+#include "metrics.hh"
+#include "worker-protocol.hh"
+#include "util.hh"
+#include "lock-stats.hh"
+
+#include <sys/mman.h>
+
+namespace nix {
+
+void DurationHistogram::observe(std::chrono::steady_clock::duration d)
+{
+    auto seconds = std::chrono::duration<double>(d).count();
+    size_t i = 0;
+    while (i < bounds.size() && seconds > bounds[i]) ++i;
+    counts[i]++;
+    sumMicroseconds += std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+}
+
+uint64_t DurationHistogram::count() const
+{
+    uint64_t n = 0;
+    for (auto & c : counts) n += c;
+    return n;
+}
+
+static Metrics localMetrics;
+
+static Metrics * metrics_ = &localMetrics;
+
+Metrics & metrics()
+{
+    return *metrics_;
+}
+
+void initSharedMetrics()
+{
+    static_assert(std::atomic<uint64_t>::is_always_lock_free);
+    auto p = mmap(nullptr, sizeof(Metrics), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        throw SysError("allocating shared memory for metrics");
+    /* Anonymous mappings are zero-filled, which is the initial state
+       of the counters. */
+    metrics_ = (Metrics *) p;
+}
+
+static std::string opName(uint64_t op)
+{
+    switch ((WorkerProto::Op) op) {
+    case WorkerProto::Op::IsValidPath: return "IsValidPath";
+    case WorkerProto::Op::HasSubstitutes: return "HasSubstitutes";
+    case WorkerProto::Op::QueryPathHash: return "QueryPathHash";
+    case WorkerProto::Op::QueryReferences: return "QueryReferences";
+    case WorkerProto::Op::QueryReferrers: return "QueryReferrers";
+    case WorkerProto::Op::AddToStore: return "AddToStore";
+    case WorkerProto::Op::AddTextToStore: return "AddTextToStore";
+    case WorkerProto::Op::BuildPaths: return "BuildPaths";
+    case WorkerProto::Op::EnsurePath: return "EnsurePath";
+    case WorkerProto::Op::AddTempRoot: return "AddTempRoot";
+    case WorkerProto::Op::AddIndirectRoot: return "AddIndirectRoot";
+    case WorkerProto::Op::SyncWithGC: return "SyncWithGC";
+    case WorkerProto::Op::FindRoots: return "FindRoots";
+    case WorkerProto::Op::ExportPath: return "ExportPath";
+    case WorkerProto::Op::QueryDeriver: return "QueryDeriver";
+    case WorkerProto::Op::SetOptions: return "SetOptions";
+    case WorkerProto::Op::CollectGarbage: return "CollectGarbage";
+    case WorkerProto::Op::QuerySubstitutablePathInfo: return "QuerySubstitutablePathInfo";
+    case WorkerProto::Op::QueryDerivationOutputs: return "QueryDerivationOutputs";
+    case WorkerProto::Op::QueryAllValidPaths: return "QueryAllValidPaths";
+    case WorkerProto::Op::QueryFailedPaths: return "QueryFailedPaths";
+    case WorkerProto::Op::ClearFailedPaths: return "ClearFailedPaths";
+    case WorkerProto::Op::QueryPathInfo: return "QueryPathInfo";
+    case WorkerProto::Op::ImportPaths: return "ImportPaths";
+    case WorkerProto::Op::QueryDerivationOutputNames: return "QueryDerivationOutputNames";
+    case WorkerProto::Op::QueryPathFromHashPart: return "QueryPathFromHashPart";
+    case WorkerProto::Op::QuerySubstitutablePathInfos: return "QuerySubstitutablePathInfos";
+    case WorkerProto::Op::QueryValidPaths: return "QueryValidPaths";
+    case WorkerProto::Op::QuerySubstitutablePaths: return "QuerySubstitutablePaths";
+    case WorkerProto::Op::QueryValidDerivers: return "QueryValidDerivers";
+    case WorkerProto::Op::OptimiseStore: return "OptimiseStore";
+    case WorkerProto::Op::VerifyStore: return "VerifyStore";
+    case WorkerProto::Op::BuildDerivation: return "BuildDerivation";
+    case WorkerProto::Op::AddSignatures: return "AddSignatures";
+    case WorkerProto::Op::NarFromPath: return "NarFromPath";
+    case WorkerProto::Op::AddToStoreNar: return "AddToStoreNar";
+    case WorkerProto::Op::QueryMissing: return "QueryMissing";
+    case WorkerProto::Op::QueryDerivationOutputMap: return "QueryDerivationOutputMap";
+    case WorkerProto::Op::RegisterDrvOutput: return "RegisterDrvOutput";
+    case WorkerProto::Op::QueryRealisation: return "QueryRealisation";
+    case WorkerProto::Op::AddMultipleToStore: return "AddMultipleToStore";
+    case WorkerProto::Op::AddBuildLog: return "AddBuildLog";
+    case WorkerProto::Op::BuildPathsWithResults: return "BuildPathsWithResults";
+    case WorkerProto::Op::QueryPathInfos: return "QueryPathInfos";
+    case WorkerProto::Op::Multiplex: return "Multiplex";
+    case WorkerProto::Op::QueryValidPathsByPrefix: return "QueryValidPathsByPrefix";
+    case WorkerProto::Op::QueryRealisations: return "QueryRealisations";
+    case WorkerProto::Op::AddTempRoots: return "AddTempRoots";
+    default: return std::to_string(op);
+    }
+}
+
+static void renderHistogram(std::string & out, const std::string & name,
+    const std::string & labels, const DurationHistogram & h)
+{
+    auto sep = labels.empty() ? "" : ",";
+    uint64_t n = 0;
+    for (size_t i = 0; i < h.bounds.size(); ++i) {
+        n += h.counts[i];
+        out += fmt("%s_bucket{%s%sle=\"%s\"} %d\n", name, labels, sep, h.bounds[i], n);
+    }
+    n += h.counts[h.bounds.size()];
+    out += fmt("%s_bucket{%s%sle=\"+Inf\"} %d\n", name, labels, sep, n);
+    auto braced = labels.empty() ? "" : "{" + labels + "}";
+    out += fmt("%s_sum%s %s\n", name, braced, h.sumMicroseconds / 1e6);
+    out += fmt("%s_count%s %d\n", name, braced, n);
+}
+
+static void renderLockHistogram(std::string & out, const std::string & name,
+    const std::string & lock, const LockStats::Histogram & h)
+{
+    uint64_t n = 0;
+    for (size_t i = 0; i < LockStats::nrBuckets - 1; ++i) {
+        n += h.counts[i];
+        out += fmt("%s_bucket{lock=\"%s\",le=\"%s\"} %d\n", name, lock, (uint64_t(1) << i) / 1e9, n);
+    }
+    n += h.counts[LockStats::nrBuckets - 1];
+    out += fmt("%s_bucket{lock=\"%s\",le=\"+Inf\"} %d\n", name, lock, n);
+    out += fmt("%s_sum{lock=\"%s\"} %s\n", name, lock, h.sumNanoseconds / 1e9);
+    out += fmt("%s_count{lock=\"%s\"} %d\n", name, lock, n);
+}
+
+/**
+ * Render the statistics of the named `Sync` instances of this
+ * process, if `NIX_LOCK_STATS` is set.
+ */
+static void renderLockStats(std::string & out)
+{
+    std::vector<const LockStats *> stats;
+    forEachLockStats([&](const LockStats & s) { stats.push_back(&s); });
+    if (stats.empty()) return;
+
+    out += "# HELP nix_sync_acquisitions_total Acquisitions of internal locks.\n"
+        "# TYPE nix_sync_acquisitions_total counter\n";
+    for (auto s : stats)
+        out += fmt("nix_sync_acquisitions_total{lock=\"%s\"} %d\n", s->name, s->acquisitions);
+
+    out += "# HELP nix_sync_contended_total Acquisitions of internal locks that had to wait.\n"
+        "# TYPE nix_sync_contended_total counter\n";
+    for (auto s : stats)
+        out += fmt("nix_sync_contended_total{lock=\"%s\"} %d\n", s->name, s->contended);
+
+    out += "# HELP nix_sync_wait_seconds Time spent waiting for internal locks that were held.\n"
+        "# TYPE nix_sync_wait_seconds histogram\n";
+    for (auto s : stats)
+        renderLockHistogram(out, "nix_sync_wait_seconds", s->name, s->waits);
+
+    out += "# HELP nix_sync_hold_seconds Time internal locks were held.\n"
+        "# TYPE nix_sync_hold_seconds histogram\n";
+    for (auto s : stats)
+        renderLockHistogram(out, "nix_sync_hold_seconds", s->name, s->holds);
+}
+
+std::string renderMetrics()
+{
+    auto & m = metrics();
+    std::string out;
+
+    auto metric = [&](const std::string & name, const char * type, const char * help, auto & value) {
+        out += fmt("# HELP %s %s\n# TYPE %s %s\n%s %d\n", name, help, name, type, name, value.load());
+    };
+
+    out += "# HELP nix_daemon_op_duration_seconds Duration of daemon operations.\n"
+        "# TYPE nix_daemon_op_duration_seconds histogram\n";
+    for (size_t op = 0; op < Metrics::maxDaemonOps; ++op)
+        if (m.daemonOps[op].count())
+            renderHistogram(out, "nix_daemon_op_duration_seconds",
+                fmt("op=\"%s\"", opName(op)), m.daemonOps[op]);
+
+    metric("nix_daemon_connections_total", "counter", "Connections accepted by the daemon.", m.connections);
+    metric("nix_daemon_active_connections", "gauge", "Connections being served.", m.activeConnections);
+    metric("nix_builds_started_total", "counter", "Builds started.", m.buildsStarted);
+    metric("nix_active_builds", "gauge", "Builds running.", m.activeBuilds);
+    metric("nix_substitutions_started_total", "counter", "Substitutions started.", m.substitutionsStarted);
+    metric("nix_active_substitutions", "gauge", "Substitutions running.", m.activeSubstitutions);
+    metric("nix_goals_succeeded_total", "counter", "Build and substitution goals that succeeded.", m.goalsSucceeded);
+    metric("nix_goals_failed_total", "counter", "Build and substitution goals that failed.", m.goalsFailed);
+    metric("nix_substituted_bytes_total", "counter", "NAR size of the substituted paths.", m.bytesSubstituted);
+    metric("nix_uploaded_bytes_total", "counter", "Compressed size of the NARs written to binary caches.", m.bytesUploaded);
+    metric("nix_sqlite_busy_retries_total", "counter", "SQLite transactions retried because the database was busy.", m.sqliteBusyRetries);
+
+    out += "# HELP nix_lock_wait_seconds Time spent waiting for locks that were held.\n"
+        "# TYPE nix_lock_wait_seconds histogram\n";
+    renderHistogram(out, "nix_lock_wait_seconds", "", m.lockWaits);
+
+    renderLockStats(out);
+
+    return out;
+}
+
+}
@@ -0,0 +1,104 @@
+#pragma once
+///@file
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <string>
+
+namespace nix {
+
+/**
+ * A histogram of durations with fixed buckets, in the style of
+ * Prometheus.
+ */
+struct DurationHistogram
+{
+    /**
+     * The upper bounds of the buckets, in seconds. There is an
+     * additional bucket for everything above the last bound.
+     */
+    static constexpr std::array<double, 12> bounds = {
+        0.0001, 0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1, 5, 10, 60, 600
+    };
+
+    std::atomic<uint64_t> counts[bounds.size() + 1];
+
+    std::atomic<uint64_t> sumMicroseconds;
+
+    void observe(std::chrono::steady_clock::duration d);
+
+    uint64_t count() const;
+};
+
+/**
+ * Counters about the operation of the Nix daemon and the store code it
+ * runs. `nix daemon` serves them in the Prometheus text format if
+ * `metrics-address` is set.
+ *
+ * All members are lock-free atomics that start out as zero, so the
+ * counters can live in zero-filled memory that is shared with the
+ * processes that the daemon forks for its connections.
+ */
+struct Metrics
+{
+    static constexpr size_t maxDaemonOps = 64;
+
+    /**
+     * The duration of worker protocol operations, by operation.
+     */
+    DurationHistogram daemonOps[maxDaemonOps];
+
+    std::atomic<uint64_t> connections;
+    std::atomic<int64_t> activeConnections;
+
+    std::atomic<uint64_t> buildsStarted;
+    std::atomic<int64_t> activeBuilds;
+    std::atomic<uint64_t> substitutionsStarted;
+    std::atomic<int64_t> activeSubstitutions;
+
+    std::atomic<uint64_t> goalsSucceeded;
+    std::atomic<uint64_t> goalsFailed;
+
+    /**
+     * The NAR size of the paths that have been substituted.
+     */
+    std::atomic<uint64_t> bytesSubstituted;
+
+    /**
+     * The compressed size of the NARs written to binary caches.
+     */
+    std::atomic<uint64_t> bytesUploaded;
+
+    std::atomic<uint64_t> sqliteBusyRetries;
+
+    /**
+     * The time spent waiting for locks on store paths and other lock
+     * files, if the lock wasn't free.
+     */
+    DurationHistogram lockWaits;
+
+    void recordDaemonOp(uint64_t op, std::chrono::steady_clock::duration d)
+    {
+        if (op < maxDaemonOps) daemonOps[op].observe(d);
+    }
+};
+
+/**
+ * The metrics of this process, or those shared with the daemon after
+ * `initSharedMetrics()`.
+ */
+Metrics & metrics();
+
+/**
+ * Move the metrics to memory that is shared with the processes forked
+ * after this call. Must be called before starting any threads.
+ */
+void initSharedMetrics();
+
+/**
+ * Render the metrics in the Prometheus text exposition format.
+ */
+std::string renderMetrics();
+
+}
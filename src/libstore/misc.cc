@@ -6,72 +6,107 @@
 #include "thread-pool.hh"
 #include "topo-sort.hh"
 #include "callback.hh"
-#include "closure.hh"
 #include "filetransfer.hh"
 
+#include <future>
+
 namespace nix {
 
 void Store::computeFSClosure(const StorePathSet & startPaths,
     StorePathSet & paths_, bool flipDirection, bool includeOutputs, bool includeDerivers)
 {
-    std::function<std::set<StorePath>(const StorePath & path, std::future<ref<const ValidPathInfo>> &)> queryDeps;
-    if (flipDirection)
-        queryDeps = [&](const StorePath& path,
-                        std::future<ref<const ValidPathInfo>> & fut) {
-            StorePathSet res;
-            StorePathSet referrers;
-            queryReferrers(path, referrers);
-            for (auto& ref : referrers)
-                if (ref != path)
-                    res.insert(ref);
-
-            if (includeOutputs)
-                for (auto& i : queryValidDerivers(path))
-                    res.insert(i);
-
-            if (includeDerivers && path.isDerivation())
-                for (auto& [_, maybeOutPath] : queryPartialDerivationOutputMap(path))
-                    if (maybeOutPath && isValidPath(*maybeOutPath))
-                        res.insert(*maybeOutPath);
-            return res;
-        };
-    else
-        queryDeps = [&](const StorePath& path,
-                        std::future<ref<const ValidPathInfo>> & fut) {
-            StorePathSet res;
-            auto info = fut.get();
-            for (auto& ref : info->references)
-                if (ref != path)
-                    res.insert(ref);
-
-            if (includeOutputs && path.isDerivation())
-                for (auto& [_, maybeOutPath] : queryPartialDerivationOutputMap(path))
-                    if (maybeOutPath && isValidPath(*maybeOutPath))
-                        res.insert(*maybeOutPath);
-
-            if (includeDerivers && info->deriver && isValidPath(*info->deriver))
-                res.insert(*info->deriver);
-            return res;
+    /* Traverse the closure one level at a time, so that the latency
+       depends on the depth of the closure rather than its size: the
+       path infos of each level are fetched in a single batch, and
+       referrers are queried in parallel. */
+    StorePathSet todo;
+    for (auto & path : startPaths)
+        if (paths_.insert(path).second)
+            todo.insert(path);
+
+    while (!todo.empty()) {
+        checkInterrupt();
+
+        StorePathSet next;
+        auto enqueue = [&](const StorePath & path) {
+            if (paths_.insert(path).second)
+                next.insert(path);
         };
 
-    computeClosure<StorePath>(
-        startPaths, paths_,
-        [&](const StorePath& path,
-            std::function<void(std::promise<std::set<StorePath>>&)>
-                processEdges) {
-            std::promise<std::set<StorePath>> promise;
-            std::function<void(std::future<ref<const ValidPathInfo>>)>
-                getDependencies =
-                    [&](std::future<ref<const ValidPathInfo>> fut) {
-                        try {
-                            promise.set_value(queryDeps(path, fut));
-                        } catch (...) {
-                            promise.set_exception(std::current_exception());
-                        }
-                    };
-            queryPathInfo(path, getDependencies);
-            processEdges(promise);
-        });
+        /* Paths that are only part of the closure if they're valid,
+           checked in one batch at the end of the level. */
+        StorePathSet maybeValid;
+
+        if (!flipDirection) {
+            auto infos = queryPathInfos(todo);
+
+            for (auto & path : todo) {
+                auto i = infos.find(path);
+                if (i == infos.end())
+                    throw InvalidPath("path '%s' is not valid", printStorePath(path));
+                auto & info = i->second;
+
+                for (auto & ref : info->references)
+                    if (ref != path)
+                        enqueue(ref);
+
+                if (includeOutputs && path.isDerivation())
+                    for (auto & [_, maybeOutPath] : queryPartialDerivationOutputMap(path))
+                        if (maybeOutPath && !paths_.count(*maybeOutPath))
+                            maybeValid.insert(*maybeOutPath);
+
+                if (includeDerivers && info->deriver && !paths_.count(*info->deriver))
+                    maybeValid.insert(*info->deriver);
+            }
+        }
+
+        else {
+            struct Found
+            {
+                StorePathSet referrers, outputs;
+            };
+
+            Sync<Found> found_;
+
+            ThreadPool pool;
+
+            for (auto & path : todo)
+                pool.enqueue([&, path]() {
+                    StorePathSet referrers;
+                    queryReferrers(path, referrers);
+                    referrers.erase(path);
+
+                    if (includeOutputs)
+                        for (auto & i : queryValidDerivers(path))
+                            referrers.insert(i);
+
+                    StorePathSet outputs;
+                    if (includeDerivers && path.isDerivation())
+                        for (auto & [_, maybeOutPath] : queryPartialDerivationOutputMap(path))
+                            if (maybeOutPath)
+                                outputs.insert(*maybeOutPath);
+
+                    auto found(found_.lock());
+                    found->referrers.merge(referrers);
+                    found->outputs.merge(outputs);
+                });
+
+            pool.process();
+
+            auto found(found_.lock());
+            for (auto & path : found->referrers)
+                enqueue(path);
+            for (auto & path : found->outputs)
+                if (!paths_.count(path))
+                    maybeValid.insert(path);
+        }
+
+        if (!maybeValid.empty())
+            for (auto & path : queryValidPaths(maybeValid))
+                enqueue(path);
+
+        todo = std::move(next);
+    }
 }
 
 void Store::computeFSClosure(const StorePath & startPath,
@@ -94,6 +129,189 @@ const ContentAddress * getDerivationCA(const BasicDerivation & drv)
     return nullptr;
 }
 
+/**
+ * Looks up paths in the substituters ahead of queryMissing()'s
+ * workers. As soon as the info of a path arrives, its references are
+ * looked up too, so that the closure is discovered at the speed of
+ * the substituters rather than that of the workers. The results end up
+ * in the substituters' path info caches, where the workers find them.
+ */
+struct SubstitutablePathPrefetcher
+{
+    Store & store;
+    std::vector<ref<Store>> subs;
+    const size_t maxInFlight;
+
+    struct State
+    {
+        /* The paths whose lookup has been started, so that no path
+           is looked up twice. */
+        std::map<StorePath, std::shared_future<void>> started;
+        size_t inFlight = 0;
+        bool stopping = false;
+    };
+
+    Sync<State> state_;
+
+    std::condition_variable wakeup;
+
+    SubstitutablePathPrefetcher(Store & store, size_t maxInFlight)
+        : store(store), maxInFlight(maxInFlight)
+    {
+        for (auto & sub : getDefaultSubstituters())
+            if (sub->storeDir == store.storeDir)
+                subs.push_back(sub);
+    }
+
+    ~SubstitutablePathPrefetcher()
+    {
+        auto state(state_.lock());
+        state->stopping = true;
+        while (state->inFlight)
+            state.wait(wakeup);
+    }
+
+    void prefetch(const StorePath & path)
+    {
+        auto promise = std::make_shared<std::promise<void>>();
+
+        {
+            auto state(state_.lock());
+            if (state->stopping
+                || state->inFlight >= maxInFlight
+                || state->started.count(path))
+                return;
+            state->started.emplace(path, promise->get_future().share());
+            state->inFlight++;
+        }
+
+        lookup(path, 0, promise);
+    }
+
+    /**
+     * Wait for the lookup of `path` to finish, if it has been started.
+     */
+    void wait(const StorePath & path)
+    {
+        std::shared_future<void> future;
+        {
+            auto state(state_.lock());
+            auto i = state->started.find(path);
+            if (i == state->started.end()) return;
+            future = i->second;
+        }
+        future.wait();
+    }
+
+private:
+
+    /**
+     * Look up `path` in the group of `substituter-race-width`
+     * substituters starting at `first` at the same time. The lookup is
+     * decided by the first substituter in the group that has the path,
+     * once all substituters before it have answered that they don't.
+     */
+    void lookup(const StorePath & path, size_t first, std::shared_ptr<std::promise<void>> promise)
+    {
+        if (first >= subs.size()) {
+            promise->set_value();
+            finish();
+            return;
+        }
+
+        auto end = std::min(subs.size(), first + std::max(settings.substituterRaceWidth.get(), 1U));
+
+        struct Group
+        {
+            enum Answer { Pending, Missing, Found, Failed };
+            std::vector<Answer> answers;
+            std::vector<std::shared_ptr<const ValidPathInfo>> infos;
+            bool decided = false;
+        };
+
+        auto group_ = std::make_shared<Sync<Group>>();
+        {
+            auto group(group_->lock());
+            group->answers.resize(end - first, Group::Pending);
+            group->infos.resize(end - first);
+        }
+
+        /* Each query holds a slot until its callback has run. */
+        state_.lock()->inFlight += end - first - 1;
+
+        for (size_t sub = first; sub < end; ++sub)
+            subs[sub]->queryPathInfo(path,
+                {[this, path, first, end, sub, promise, group_](std::future<ref<const ValidPathInfo>> future) {
+                    auto answer = Group::Failed;
+                    std::shared_ptr<const ValidPathInfo> info;
+                    try {
+                        info = future.get().get_ptr();
+                        answer = Group::Found;
+                    } catch (InvalidPath &) {
+                        answer = Group::Missing;
+                    } catch (...) {
+                        /* The workers will report the error. */
+                    }
+
+                    /* The first answer other than "missing" decides,
+                       once every answer before it has arrived. */
+                    enum { Wait, Decided, NextGroup } action = Wait;
+                    {
+                        auto group(group_->lock());
+                        group->answers[sub - first] = answer;
+                        group->infos[sub - first] = info;
+                        if (!group->decided) {
+                            action = NextGroup;
+                            info = nullptr;
+                            for (size_t i = 0; i < group->answers.size(); ++i)
+                                if (group->answers[i] != Group::Missing) {
+                                    action = group->answers[i] == Group::Pending ? Wait : Decided;
+                                    info = group->infos[i];
+                                    break;
+                                }
+                            if (action != Wait)
+                                group->decided = true;
+                        }
+                    }
+
+                    if (action == NextGroup)
+                        /* Pass this query's slot on to the next
+                           group. */
+                        return lookup(path, end, promise);
+
+                    if (action == Decided) {
+                        if (info) follow(path, *info);
+                        promise->set_value();
+                    }
+
+                    finish();
+                }});
+    }
+
+    /**
+     * Start on the references of `path`, so that the substituters
+     * are asked for them before the workers get to them.
+     */
+    void follow(const StorePath & path, const ValidPathInfo & info)
+    {
+        try {
+            for (auto & ref : info.references)
+                if (ref != path && !store.isValidPath(ref))
+                    prefetch(ref);
+        } catch (...) {
+            ignoreException(lvlDebug);
+        }
+    }
+
+    void finish()
+    {
+        auto state(state_.lock());
+        assert(state->inFlight);
+        state->inFlight--;
+        wakeup.notify_all();
+    }
+};
+
 void Store::queryMissing(const std::vector<DerivedPath> & targets,
     StorePathSet & willBuild_, StorePathSet & willSubstitute_, StorePathSet & unknown_,
     uint64_t & downloadSize_, uint64_t & narSize_)
@@ -102,6 +320,10 @@ void Store::queryMissing(const std::vector<DerivedPath> & targets,
 
     downloadSize_ = narSize_ = 0;
 
+    std::optional<SubstitutablePathPrefetcher> prefetcher;
+    if (settings.useSubstitutes)
+        prefetcher.emplace(*this, 4 * fileTransferSettings.httpConnections);
+
     // FIXME: make async.
     ThreadPool pool(fileTransferSettings.httpConnections);
 
@@ -113,14 +335,6 @@ void Store::queryMissing(const std::vector<DerivedPath> & targets,
         uint64_t & narSize;
     };
 
-    struct DrvState
-    {
-        size_t left;
-        bool done = false;
-        StorePathSet outPaths;
-        DrvState(size_t left) : left(left) { }
-    };
-
     Sync<State> state_(State{{}, unknown_, willSubstitute_, willBuild_, downloadSize_, narSize_});
 
     std::function<void(DerivedPath)> doPath;
@@ -147,36 +361,25 @@ void Store::queryMissing(const std::vector<DerivedPath> & targets,
         }
     };
 
-    auto checkOutput = [&](
-        const StorePath & drvPath, ref<Derivation> drv, const StorePath & outPath, ref<Sync<DrvState>> drvState_)
+    /* Check whether all the missing outputs of a derivation can be
+       substituted, in one batch so that the substituters are asked
+       about all of them at the same time. */
+    auto checkOutputs = [&](
+        const StorePath & drvPath, ref<Derivation> drv, const StorePathSet & outPaths)
     {
-        if (drvState_->lock()->done) return;
+        auto * cap = getDerivationCA(*drv);
+        StorePathCAMap query;
+        for (auto & outPath : outPaths)
+            query.insert_or_assign(outPath, cap ? std::optional { *cap } : std::nullopt);
 
         SubstitutablePathInfos infos;
-        auto * cap = getDerivationCA(*drv);
-        querySubstitutablePathInfos({
-            {
-                outPath,
-                cap ? std::optional { *cap } : std::nullopt,
-            },
-        }, infos);
+        querySubstitutablePathInfos(query, infos);
 
-        if (infos.empty()) {
-            drvState_->lock()->done = true;
+        if (infos.size() < outPaths.size())
             mustBuildDrv(drvPath, *drv);
-        } else {
-            {
-                auto drvState(drvState_->lock());
-                if (drvState->done) return;
-                assert(drvState->left);
-                drvState->left--;
-                drvState->outPaths.insert(outPath);
-                if (!drvState->left) {
-                    for (auto & path : drvState->outPaths)
-                        pool.enqueue(std::bind(doPath, DerivedPath::Opaque { path } ));
-                }
-            }
-        }
+        else
+            for (auto & path : outPaths)
+                pool.enqueue(std::bind(doPath, DerivedPath::Opaque { path } ));
     };
 
     doPath = [&](const DerivedPath & req) {
@@ -251,9 +454,7 @@ void Store::queryMissing(const std::vector<DerivedPath> & targets,
             }
 
             if (knownOutputPaths && settings.useSubstitutes && parsedDrv.substitutesAllowed()) {
-                auto drvState = make_ref<Sync<DrvState>>(DrvState(invalid.size()));
-                for (auto & output : invalid)
-                    pool.enqueue(std::bind(checkOutput, drvPath, drv, output, drvState));
+                pool.enqueue(std::bind(checkOutputs, drvPath, drv, invalid));
             } else
                 mustBuildDrv(drvPath, *drv);
 
@@ -262,6 +463,8 @@ void Store::queryMissing(const std::vector<DerivedPath> & targets,
 
             if (isValidPath(bo.path)) return;
 
+            if (prefetcher) prefetcher->wait(bo.path);
+
             SubstitutablePathInfos infos;
             querySubstitutablePathInfos({{bo.path, std::nullopt}}, infos);
 
@@ -281,8 +484,11 @@ void Store::queryMissing(const std::vector<DerivedPath> & targets,
                 state->narSize += info->second.narSize;
             }
 
-            for (auto & ref : info->second.references)
+            for (auto & ref : info->second.references) {
+                if (prefetcher && ref != bo.path && !isValidPath(ref))
+                    prefetcher->prefetch(ref);
                 pool.enqueue(std::bind(doPath, DerivedPath::Opaque { ref }));
+            }
           },
         }, req.raw());
     };
@@ -296,13 +502,12 @@ void Store::queryMissing(const std::vector<DerivedPath> & targets,
 
 StorePaths Store::topoSortPaths(const StorePathSet & paths)
 {
+    auto infos = queryPathInfos(paths);
+
     return topoSort(paths,
         {[&](const StorePath & path) {
-            try {
-                return queryPathInfo(path)->references;
-            } catch (InvalidPath &) {
-                return StorePathSet();
-            }
+            auto i = infos.find(path);
+            return i != infos.end() ? i->second->references : StorePathSet();
         }},
         {[&](const StorePath & path, const StorePath & parent) {
             return BuildError(
@@ -5,6 +5,10 @@
 #include <stack>
 #include <algorithm>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 #include <nlohmann/json.hpp>
 
 namespace nix {
@@ -119,6 +123,13 @@ struct NarAccessor : public FSAccessor
         parseDump(indexer, indexer);
     }
 
+    NarAccessor(Source & source, GetNarBytes getNarBytes)
+        : getNarBytes(getNarBytes)
+    {
+        NarIndexer indexer(*this, source);
+        parseDump(indexer, indexer);
+    }
+
     NarAccessor(const std::string & listing, GetNarBytes getNarBytes)
         : getNarBytes(getNarBytes)
     {
@@ -242,6 +253,76 @@ ref<FSAccessor> makeLazyNarAccessor(const std::string & listing,
     return make_ref<NarAccessor>(listing, getNarBytes);
 }
 
+/**
+ * A read-only mapping of a NAR file.
+ */
+struct MappedNar
+{
+    Path path;
+    void * data = MAP_FAILED;
+    size_t size = 0;
+
+    MappedNar(const Path & path) : path(path)
+    {
+        AutoCloseFD fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (!fd)
+            throw SysError("opening NAR file '%s'", path);
+
+        struct stat st;
+        if (fstat(fd.get(), &st))
+            throw SysError("getting status of '%s'", path);
+        size = st.st_size;
+
+        if (size) {
+            data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd.get(), 0);
+            if (data == MAP_FAILED)
+                throw SysError("mapping NAR file '%s'", path);
+        }
+    }
+
+    ~MappedNar()
+    {
+        if (data != MAP_FAILED)
+            munmap(data, size);
+    }
+
+    std::string_view view() const
+    {
+        return data == MAP_FAILED ? std::string_view() : std::string_view((const char *) data, size);
+    }
+
+    void advise(int advice)
+    {
+        if (data != MAP_FAILED)
+            madvise(data, size, advice);
+    }
+};
+
+ref<FSAccessor> makeNarAccessorFromFile(const Path & narFile, const std::optional<std::string> & listing)
+{
+    auto mapping = std::make_shared<MappedNar>(narFile);
+
+    auto getNarBytes = [mapping](uint64_t offset, uint64_t length) {
+        auto nar = mapping->view();
+        if (offset > nar.size() || length > nar.size() - offset)
+            throw Error("NAR file '%s' is truncated", mapping->path);
+        return std::string(nar.substr(offset, length));
+    };
+
+    if (listing)
+        return make_ref<NarAccessor>(*listing, getNarBytes);
+
+    /* Build the index by scanning the NAR once, and then tell the
+       kernel that we don't need the pages we read anymore, so that
+       the NAR doesn't stay resident. */
+    mapping->advise(MADV_SEQUENTIAL);
+    StringSource source(mapping->view());
+    auto accessor = make_ref<NarAccessor>(source, getNarBytes);
+    mapping->advise(MADV_DONTNEED);
+    mapping->advise(MADV_RANDOM);
+    return accessor;
+}
+
 using nlohmann::json;
 json listNar(ref<FSAccessor> accessor, const Path & path, bool recurse)
 {
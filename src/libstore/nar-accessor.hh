@@ -30,6 +30,17 @@ ref<FSAccessor> makeLazyNarAccessor(
     const std::string & listing,
     GetNarBytes getNarBytes);
 
+/**
+ * Return an accessor for the NAR file `narFile`. The file is mapped
+ * into memory rather than read, and `readFile()` copies only the
+ * requested file out of the mapping. If `listing` is set, it is used
+ * as the index of the NAR (in the format produced by listNar());
+ * otherwise the NAR is scanned once to build the index.
+ */
+ref<FSAccessor> makeNarAccessorFromFile(
+    const Path & narFile,
+    const std::optional<std::string> & listing = std::nullopt);
+
 /**
  * Write a JSON representation of the contents of a NAR (except file
  * contents).
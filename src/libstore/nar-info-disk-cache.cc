@@ -3,6 +3,9 @@
 #include "sqlite.hh"
 #include "globals.hh"
 
+#include <condition_variable>
+#include <thread>
+
 #include <sqlite3.h>
 #include <nlohmann/json.hpp>
 
@@ -39,6 +42,26 @@ create table if not exists NARs (
     foreign key (cache) references BinaryCaches(id) on delete cascade
 );
 
+create table if not exists NarDeltas (
+    cache            integer not null,
+    hashPart         text not null,
+    base             text not null,
+    baseNarHash      text not null,
+    url              text not null,
+    compression      text not null,
+    size             integer not null,
+    primary key (cache, hashPart),
+    foreign key (cache) references BinaryCaches(id) on delete cascade
+);
+
+create table if not exists NarChunks (
+    cache            integer not null,
+    hashPart         text not null,
+    chunks           text not null,
+    primary key (cache, hashPart),
+    foreign key (cache) references BinaryCaches(id) on delete cascade
+);
+
 create table if not exists Realisations (
     cache integer not null,
     outputId text not null,
@@ -48,6 +71,14 @@ create table if not exists Realisations (
     foreign key (cache) references BinaryCaches(id) on delete cascade
 );
 
+create table if not exists Performance (
+    url        text primary key not null,
+    latency    integer not null, -- in microseconds
+    errorRate  integer not null, -- in parts per million
+    throughput integer not null, -- in bytes per second
+    timestamp  integer not null
+);
+
 create table if not exists LastPurge (
     dummy            text primary key,
     value            integer
@@ -73,19 +104,77 @@ public:
         int priority;
     };
 
+    /* How long to collect writes before sending them to the
+       database in a single transaction. */
+    const std::chrono::milliseconds flushInterval{1000};
+
+    /* Send the pending writes to the database early once there are
+       this many of them. */
+    const size_t maxPendingWrites = 1000;
+
+    /* The weight of a new sample in the performance averages. */
+    const double performanceWeight = 0.2;
+
+    /* The connection used for writing. */
     struct State
     {
         SQLite db;
         SQLiteStmt insertCache, queryCache, insertNAR, insertMissingNAR,
-            queryNAR, insertRealisation, insertMissingRealisation,
-            queryRealisation, purgeCache;
-        std::map<std::string, Cache> caches;
+            insertNarDelta, deleteNarDelta, insertNarChunks, deleteNarChunks,
+            insertRealisation, insertMissingRealisation, purgeCache,
+            upsertPerformance;
     };
 
     Sync<State> _state;
 
+    /* A separate read-only connection for lookups, so that they
+       don't have to wait for writes made by this process. */
+    struct ReadState
+    {
+        SQLite db;
+        SQLiteStmt queryNAR, queryNarDelta, queryNarChunks, queryRealisation, queryPerformance;
+    };
+
+    Sync<ReadState> _readState;
+
+    Sync<std::map<std::string, Cache>> _caches;
+
+    /* Writes that haven't been sent to the database yet. Lookups
+       check these first, so that they see what this process has
+       written. Only the latest write for each key is kept. */
+    template<typename T>
+    struct PendingWrite
+    {
+        std::shared_ptr<const T> value;
+        time_t timestamp;
+        uint64_t seq;
+    };
+
+    typedef std::pair<int, std::string> Key;
+
+    struct Pending
+    {
+        std::map<Key, PendingWrite<ValidPathInfo>> narInfos;
+        std::map<Key, PendingWrite<Realisation>> realisations;
+        /* The current performance of each binary cache we've looked
+           at, and which of them need to be written. */
+        std::map<std::string, Performance> performance;
+        std::set<std::string> dirtyPerformance;
+        uint64_t seq = 0;
+        bool quit = false;
+    };
+
+    Sync<Pending> _pending;
+
+    std::condition_variable wakeup;
+
+    std::thread writerThread;
+
+    pid_t ownerPid;
+
     NarInfoDiskCacheImpl(Path dbPath = getCacheDir() + "/nix/binary-cache-v6.sqlite")
     {
+        _state.setName("nar-info-disk-cache");
         auto state(_state.lock());
 
         createDirs(dirOf(dbPath));
@@ -109,8 +198,17 @@ public:
         state->insertMissingNAR.create(state->db,
             "insert or replace into NARs(cache, hashPart, timestamp, present) values (?, ?, ?, 0)");
 
-        state->queryNAR.create(state->db,
-            "select present, namePart, url, compression, fileHash, fileSize, narHash, narSize, refs, deriver, sigs, ca from NARs where cache = ? and hashPart = ? and ((present = 0 and timestamp > ?) or (present = 1 and timestamp > ?))");
+        state->insertNarDelta.create(state->db,
+            "insert or replace into NarDeltas(cache, hashPart, base, baseNarHash, url, compression, size) values (?, ?, ?, ?, ?, ?, ?)");
+
+        state->deleteNarDelta.create(state->db,
+            "delete from NarDeltas where cache = ? and hashPart = ?");
+
+        state->insertNarChunks.create(state->db,
+            "insert or replace into NarChunks(cache, hashPart, chunks) values (?, ?, ?)");
+
+        state->deleteNarChunks.create(state->db,
+            "delete from NarChunks where cache = ? and hashPart = ?");
 
         state->insertRealisation.create(state->db,
             R"(
@@ -124,13 +222,8 @@ public:
                     values (?, ?, ?)
             )");
 
-        state->queryRealisation.create(state->db,
-            R"(
-                select content from Realisations
-                    where cache = ? and outputId = ?  and
-                        ((content is null and timestamp > ?) or
-                         (content is not null and timestamp > ?))
-            )");
+        state->upsertPerformance.create(state->db,
+            "insert or replace into Performance(url, latency, errorRate, throughput, timestamp) values (?, ?, ?, ?, ?)");
 
         /* Periodically purge expired entries from the database. */
         retrySQLite<void>([&]() {
@@ -151,17 +244,70 @@ public:
 
                 debug("deleted %d entries from the NAR info disk cache", sqlite3_changes(state->db));
 
+                SQLiteStmt(state->db,
+                    "delete from NarDeltas where not exists (select 1 from NARs where NARs.cache = NarDeltas.cache and NARs.hashPart = NarDeltas.hashPart)")
+                    .use().exec();
+
+                SQLiteStmt(state->db,
+                    "delete from NarChunks where not exists (select 1 from NARs where NARs.cache = NarChunks.cache and NARs.hashPart = NarChunks.hashPart)")
+                    .use().exec();
+
                 SQLiteStmt(state->db,
                     "insert or replace into LastPurge(dummy, value) values ('', ?)")
                     .use()(now).exec();
             }
         });
+
+        {
+            auto readState(_readState.lock());
+
+            readState->db = SQLite(dbPath, SQLiteOpenMode::ReadOnly);
+
+            readState->queryNAR.create(readState->db,
+                "select present, namePart, url, compression, fileHash, fileSize, narHash, narSize, refs, deriver, sigs, ca from NARs where cache = ? and hashPart = ? and ((present = 0 and timestamp > ?) or (present = 1 and timestamp > ?))");
+
+            readState->queryNarDelta.create(readState->db,
+                "select base, baseNarHash, url, compression, size from NarDeltas where cache = ? and hashPart = ?");
+
+            readState->queryNarChunks.create(readState->db,
+                "select chunks from NarChunks where cache = ? and hashPart = ?");
+
+            readState->queryRealisation.create(readState->db,
+                R"(
+                    select content from Realisations
+                        where cache = ? and outputId = ?  and
+                            ((content is null and timestamp > ?) or
+                             (content is not null and timestamp > ?))
+                )");
+
+            readState->queryPerformance.create(readState->db,
+                "select latency, errorRate, throughput from Performance where url = ?");
+        }
+
+        ownerPid = getpid();
+
+        writerThread = std::thread([this]() { writer(); });
     }
 
-    Cache & getCache(State & state, const std::string & uri)
+    ~NarInfoDiskCacheImpl()
     {
-        auto i = state.caches.find(uri);
-        if (i == state.caches.end()) abort();
+        /* A forked child doesn't have the writer thread, and leaves
+           the pending writes to its parent. */
+        if (getpid() != ownerPid) {
+            writerThread.detach();
+            return;
+        }
+
+        _pending.lock()->quit = true;
+        wakeup.notify_one();
+        writerThread.join();
+    }
+
+    Cache getCache(const std::string & uri)
+    {
+        auto caches(_caches.lock());
+        auto i = caches->find(uri);
+        if (i == caches->end()) abort();
         return i->second;
     }
 
@@ -169,20 +315,198 @@ private:
 
     std::optional<Cache> queryCacheRaw(State & state, const std::string & uri)
     {
-        auto i = state.caches.find(uri);
-        if (i == state.caches.end()) {
-            auto queryCache(state.queryCache.use()(uri)(time(0) - cacheInfoTtl));
-            if (!queryCache.next())
-                return std::nullopt;
-            auto cache = Cache {
-                .id = (int) queryCache.getInt(0),
-                .storeDir = queryCache.getStr(1),
-                .wantMassQuery = queryCache.getInt(2) != 0,
-                .priority = (int) queryCache.getInt(3),
-            };
-            state.caches.emplace(uri, cache);
+        {
+            auto caches(_caches.lock());
+            auto i = caches->find(uri);
+            if (i != caches->end()) return i->second;
+        }
+        auto queryCache(state.queryCache.use()(uri)(time(0) - cacheInfoTtl));
+        if (!queryCache.next())
+            return std::nullopt;
+        auto cache = Cache {
+            .id = (int) queryCache.getInt(0),
+            .storeDir = queryCache.getStr(1),
+            .wantMassQuery = queryCache.getInt(2) != 0,
+            .priority = (int) queryCache.getInt(3),
+        };
+        _caches.lock()->emplace(uri, cache);
+        return cache;
+    }
+
+    /* Send pending writes to the database, one transaction at a
+       time, until we're asked to quit. */
+    void writer()
+    {
+        while (true) {
+            std::map<Key, PendingWrite<ValidPathInfo>> narInfos;
+            std::map<Key, PendingWrite<Realisation>> realisations;
+            std::map<std::string, Performance> performance;
+            bool quit;
+
+            {
+                auto pending(_pending.lock());
+                while (pending->narInfos.empty() && pending->realisations.empty()
+                    && pending->dirtyPerformance.empty() && !pending->quit)
+                    pending.wait(wakeup);
+                /* Give other writes a chance to join this batch. */
+                auto deadline = std::chrono::steady_clock::now() + flushInterval;
+                while (!pending->quit
+                    && pending->narInfos.size() + pending->realisations.size() < maxPendingWrites
+                    && pending.wait_until(wakeup, deadline) != std::cv_status::timeout)
+                    ;
+                narInfos = pending->narInfos;
+                realisations = pending->realisations;
+                for (auto & uri : pending->dirtyPerformance)
+                    performance.insert_or_assign(uri, pending->performance.at(uri));
+                pending->dirtyPerformance.clear();
+                quit = pending->quit;
+            }
+
+            if (!narInfos.empty() || !realisations.empty() || !performance.empty()) {
+                try {
+                    writePending(narInfos, realisations, performance);
+                } catch (...) {
+                    ignoreException();
+                }
+
+                /* Forget the writes that have been done, unless
+                   they've been superseded in the meantime. */
+                auto pending(_pending.lock());
+                for (auto & [key, write] : narInfos) {
+                    auto i = pending->narInfos.find(key);
+                    if (i != pending->narInfos.end() && i->second.seq == write.seq)
+                        pending->narInfos.erase(i);
+                }
+                for (auto & [key, write] : realisations) {
+                    auto i = pending->realisations.find(key);
+                    if (i != pending->realisations.end() && i->second.seq == write.seq)
+                        pending->realisations.erase(i);
+                }
+            }
+
+            if (quit) break;
         }
-        return getCache(state, uri);
+    }
+
+    void writePending(
+        const std::map<Key, PendingWrite<ValidPathInfo>> & narInfos,
+        const std::map<Key, PendingWrite<Realisation>> & realisations,
+        const std::map<std::string, Performance> & performance)
+    {
+        retrySQLite<void>([&]() {
+            auto state(_state.lock());
+
+            SQLiteTxn txn(state->db);
+
+            for (auto & [key, write] : narInfos) {
+                auto & [cacheId, hashPart] = key;
+                auto & info = write.value;
+
+                if (info) {
+
+                    auto narInfo = std::dynamic_pointer_cast<const NarInfo>(info);
+
+                    //assert(hashPart == storePathToHash(info->path));
+
+                    state->insertNAR.use()
+                        (cacheId)
+                        (hashPart)
+                        (std::string(info->path.name()))
+                        (narInfo ? narInfo->url : "", narInfo != 0)
+                        (narInfo ? narInfo->compression : "", narInfo != 0)
+                        (narInfo && narInfo->fileHash ? narInfo->fileHash->to_string(HashFormat::Base32, true) : "", narInfo && narInfo->fileHash)
+                        (narInfo ? narInfo->fileSize : 0, narInfo != 0 && narInfo->fileSize)
+                        (info->narHash.to_string(HashFormat::Base32, true))
+                        (info->narSize)
+                        (concatStringsSep(" ", info->shortRefs()))
+                        (info->deriver ? std::string(info->deriver->to_string()) : "", (bool) info->deriver)
+                        (concatStringsSep(" ", info->sigs))
+                        (renderContentAddress(info->ca))
+                        (write.timestamp).exec();
+
+                    if (narInfo && narInfo->deltaBase && narInfo->deltaBaseNarHash)
+                        state->insertNarDelta.use()
+                            (cacheId)
+                            (hashPart)
+                            (std::string(narInfo->deltaBase->to_string()))
+                            (narInfo->deltaBaseNarHash->to_string(HashFormat::Base32, true))
+                            (narInfo->deltaUrl)
+                            (narInfo->deltaCompression)
+                            (narInfo->deltaSize).exec();
+                    else
+                        state->deleteNarDelta.use()(cacheId)(hashPart).exec();
+
+                    if (narInfo && !narInfo->chunks.empty()) {
+                        Strings chunks;
+                        for (auto & chunk : narInfo->chunks)
+                            chunks.push_back(chunk.to_string(HashFormat::Base32, false));
+                        state->insertNarChunks.use()
+                            (cacheId)
+                            (hashPart)
+                            (concatStringsSep(" ", chunks)).exec();
+                    } else
+                        state->deleteNarChunks.use()(cacheId)(hashPart).exec();
+
+                } else {
+                    state->insertMissingNAR.use()
+                        (cacheId)
+                        (hashPart)
+                        (write.timestamp).exec();
+                }
+            }
+
+            for (auto & [key, write] : realisations) {
+                auto & [cacheId, outputId] = key;
+
+                if (write.value)
+                    state->insertRealisation.use()
+                        (cacheId)
+                        (outputId)
+                        (write.value->toJSON().dump())
+                        (write.timestamp).exec();
+                else
+                    state->insertMissingRealisation.use()
+                        (cacheId)
+                        (outputId)
+                        (write.timestamp).exec();
+            }
+
+            for (auto & [uri, perf] : performance)
+                state->upsertPerformance.use()
+                    (uri)
+                    ((int64_t) (perf.latency * 1000))
+                    ((int64_t) (perf.errorRate * 1000000))
+                    ((int64_t) perf.throughput)
+                    (time(0)).exec();
+
+            txn.commit();
+        });
+    }
+
+    template<typename T>
+    void enqueue(std::map<Key, PendingWrite<T>> Pending::* map, Key && key, std::shared_ptr<const T> value)
+    {
+        auto pending(_pending.lock());
+        ((*pending).*map).insert_or_assign(std::move(key),
+            PendingWrite<T> { std::move(value), time(0), ++pending->seq });
+        if (pending->narInfos.size() + pending->realisations.size() == 1
+            || pending->narInfos.size() + pending->realisations.size() >= maxPendingWrites)
+            wakeup.notify_one();
+    }
+
+    /* Return the pending write for `key`, if there is one that hasn't
+       expired yet. */
+    template<typename T>
+    std::optional<PendingWrite<T>> lookupPending(std::map<Key, PendingWrite<T>> Pending::* map, const Key & key)
+    {
+        auto pending(_pending.lock());
+        auto i = ((*pending).*map).find(key);
+        if (i == ((*pending).*map).end()) return std::nullopt;
+        time_t ttl = i->second.value
+            ? settings.ttlPositiveNarInfoCache.get()
+            : settings.ttlNegativeNarInfoCache.get();
+        if (i->second.timestamp <= time(0) - ttl) return std::nullopt;
+        return i->second;
     }
 
 public:
@@ -212,7 +536,7 @@ public:
                 ret.id = (int) r.getInt(0);
             }
 
-            state->caches[uri] = ret;
+            _caches.lock()->insert_or_assign(uri, ret);
 
             txn.commit();
             return ret.id;
@@ -239,14 +563,21 @@ public:
     {
         return retrySQLite<std::pair<Outcome, std::shared_ptr<NarInfo>>>(
             [&]() -> std::pair<Outcome, std::shared_ptr<NarInfo>> {
-            auto state(_state.lock());
+            auto cacheId = getCache(uri).id;
+
+            if (auto write = lookupPending(&Pending::narInfos, {cacheId, hashPart})) {
+                if (!write->value) return {oInvalid, 0};
+                if (auto narInfo = std::dynamic_pointer_cast<const NarInfo>(write->value))
+                    return {oValid, std::make_shared<NarInfo>(*narInfo)};
+                return {oValid, std::make_shared<NarInfo>(*write->value)};
+            }
 
-            auto & cache(getCache(*state, uri));
+            auto readState(_readState.lock());
 
             auto now = time(0);
 
-            auto queryNAR(state->queryNAR.use()
-                (cache.id)
+            auto queryNAR(readState->queryNAR.use()
+                (cacheId)
                 (hashPart)
                 (now - settings.ttlNegativeNarInfoCache)
                 (now - settings.ttlPositiveNarInfoCache));
@@ -275,6 +606,20 @@ public:
                 narInfo->sigs.insert(sig);
             narInfo->ca = ContentAddress::parseOpt(queryNAR.getStr(11));
 
+            auto queryNarDelta(readState->queryNarDelta.use()(cacheId)(hashPart));
+            if (queryNarDelta.next()) {
+                narInfo->deltaBase = StorePath(queryNarDelta.getStr(0));
+                narInfo->deltaBaseNarHash = Hash::parseAnyPrefixed(queryNarDelta.getStr(1));
+                narInfo->deltaUrl = queryNarDelta.getStr(2);
+                narInfo->deltaCompression = queryNarDelta.getStr(3);
+                narInfo->deltaSize = queryNarDelta.getInt(4);
+            }
+
+            auto queryNarChunks(readState->queryNarChunks.use()(cacheId)(hashPart));
+            if (queryNarChunks.next())
+                for (auto & chunk : tokenizeString<Strings>(queryNarChunks.getStr(0), " "))
+                    narInfo->chunks.push_back(Hash::parseNonSRIUnprefixed(chunk, htSHA256));
+
             return {oValid, narInfo};
         });
     }
@@ -284,14 +629,19 @@ public:
     {
         return retrySQLite<std::pair<Outcome, std::shared_ptr<Realisation>>>(
             [&]() -> std::pair<Outcome, std::shared_ptr<Realisation>> {
-            auto state(_state.lock());
+            auto cacheId = getCache(uri).id;
+
+            if (auto write = lookupPending(&Pending::realisations, {cacheId, id.to_string()})) {
+                if (!write->value) return {oInvalid, 0};
+                return {oValid, std::make_shared<Realisation>(*write->value)};
+            }
 
-            auto & cache(getCache(*state, uri));
+            auto readState(_readState.lock());
 
             auto now = time(0);
 
-            auto queryRealisation(state->queryRealisation.use()
-                (cache.id)
+            auto queryRealisation(readState->queryRealisation.use()
+                (cacheId)
                 (id.to_string())
                 (now - settings.ttlNegativeNarInfoCache)
                 (now - settings.ttlPositiveNarInfoCache));
@@ -315,72 +665,94 @@ public:
         const std::string & uri, const std::string & hashPart,
         std::shared_ptr<const ValidPathInfo> info) override
     {
-        retrySQLite<void>([&]() {
-            auto state(_state.lock());
+        enqueue(&Pending::narInfos, {getCache(uri).id, hashPart}, std::move(info));
+    }
 
-            auto & cache(getCache(*state, uri));
+    void upsertRealisation(
+        const std::string & uri,
+        const Realisation & realisation) override
+    {
+        enqueue(&Pending::realisations, {getCache(uri).id, realisation.id.to_string()},
+            std::shared_ptr<const Realisation>(std::make_shared<Realisation>(realisation)));
+    }
+
+    virtual void upsertAbsentRealisation(
+        const std::string & uri,
+        const DrvOutput & id) override
+    {
+        enqueue(&Pending::realisations, {getCache(uri).id, id.to_string()},
+            std::shared_ptr<const Realisation>());
+    }
 
-            if (info) {
+private:
 
-                auto narInfo = std::dynamic_pointer_cast<const NarInfo>(info);
+    /* Update the performance of `uri`, reading it from the database
+       first if this process hasn't looked at it yet. */
+    void updatePerformance(const std::string & uri, std::function<void(Performance &, bool)> update)
+    {
+        std::optional<Performance> perf;
+        try {
+            perf = lookupPerformance(uri);
+        } catch (...) {
+            ignoreException();
+        }
+        auto pending(_pending.lock());
+        auto [i, inserted] = pending->performance.try_emplace(uri, perf.value_or(Performance()));
+        update(i->second, !perf.has_value());
+        pending->dirtyPerformance.insert(uri);
+        if (pending->dirtyPerformance.size() == 1)
+            wakeup.notify_one();
+    }
 
-                //assert(hashPart == storePathToHash(info->path));
+    double average(double current, double sample)
+    {
+        return current + performanceWeight * (sample - current);
+    }
 
-                state->insertNAR.use()
-                    (cache.id)
-                    (hashPart)
-                    (std::string(info->path.name()))
-                    (narInfo ? narInfo->url : "", narInfo != 0)
-                    (narInfo ? narInfo->compression : "", narInfo != 0)
-                    (narInfo && narInfo->fileHash ? narInfo->fileHash->to_string(HashFormat::Base32, true) : "", narInfo && narInfo->fileHash)
-                    (narInfo ? narInfo->fileSize : 0, narInfo != 0 && narInfo->fileSize)
-                    (info->narHash.to_string(HashFormat::Base32, true))
-                    (info->narSize)
-                    (concatStringsSep(" ", info->shortRefs()))
-                    (info->deriver ? std::string(info->deriver->to_string()) : "", (bool) info->deriver)
-                    (concatStringsSep(" ", info->sigs))
-                    (renderContentAddress(info->ca))
-                    (time(0)).exec();
+public:
 
+    void recordRequest(const std::string & uri,
+        std::chrono::milliseconds latency, bool failed) override
+    {
+        updatePerformance(uri, [&](Performance & perf, bool isNew) {
+            if (isNew) {
+                perf.latency = latency.count();
+                perf.errorRate = failed ? 1 : 0;
             } else {
-                state->insertMissingNAR.use()
-                    (cache.id)
-                    (hashPart)
-                    (time(0)).exec();
+                if (!failed) perf.latency = average(perf.latency, latency.count());
+                perf.errorRate = average(perf.errorRate, failed ? 1 : 0);
             }
         });
     }
 
-    void upsertRealisation(
-        const std::string & uri,
-        const Realisation & realisation) override
+    void recordDownload(const std::string & uri,
+        uint64_t bytes, std::chrono::milliseconds duration) override
     {
-        retrySQLite<void>([&]() {
-            auto state(_state.lock());
-
-            auto & cache(getCache(*state, uri));
-
-            state->insertRealisation.use()
-                (cache.id)
-                (realisation.id.to_string())
-                (realisation.toJSON().dump())
-                (time(0)).exec();
+        auto throughput = (double) bytes * 1000 / std::max(duration.count(), (decltype(duration.count())) 1);
+        updatePerformance(uri, [&](Performance & perf, bool isNew) {
+            perf.throughput = isNew || !perf.throughput
+                ? throughput
+                : average(perf.throughput, throughput);
         });
-
     }
 
-    virtual void upsertAbsentRealisation(
-        const std::string & uri,
-        const DrvOutput & id) override
+    std::optional<Performance> lookupPerformance(const std::string & uri) override
     {
-        retrySQLite<void>([&]() {
-            auto state(_state.lock());
+        {
+            auto pending(_pending.lock());
+            auto i = pending->performance.find(uri);
+            if (i != pending->performance.end()) return i->second;
+        }
 
-            auto & cache(getCache(*state, uri));
-            state->insertMissingRealisation.use()
-                (cache.id)
-                (id.to_string())
-                (time(0)).exec();
+        return retrySQLite<std::optional<Performance>>([&]() -> std::optional<Performance> {
+            auto readState(_readState.lock());
+            auto queryPerformance(readState->queryPerformance.use()(uri));
+            if (!queryPerformance.next()) return std::nullopt;
+            Performance perf;
+            perf.latency = queryPerformance.getInt(0) / 1000.0;
+            perf.errorRate = queryPerformance.getInt(1) / 1000000.0;
+            perf.throughput = queryPerformance.getInt(2);
+            return perf;
         });
     }
 };
@@ -5,6 +5,8 @@
 #include "nar-info.hh"
 #include "realisation.hh"
 
+#include <chrono>
+
 namespace nix {
 
 class NarInfoDiskCache
@@ -41,6 +43,35 @@ public:
         const DrvOutput & id) = 0;
     virtual std::pair<Outcome, std::shared_ptr<Realisation>> lookupRealisation(
         const std::string & uri, const DrvOutput & id) = 0;
+
+    /**
+     * Recent performance of a binary cache, as exponentially
+     * weighted averages of the requests made to it.
+     */
+    struct Performance
+    {
+        /**
+         * Latency of metadata requests, in milliseconds.
+         */
+        double latency = 0;
+        /**
+         * Fraction of requests that failed.
+         */
+        double errorRate = 0;
+        /**
+         * Download throughput in bytes per second, or 0 if nothing
+         * has been downloaded yet.
+         */
+        double throughput = 0;
+    };
+
+    virtual void recordRequest(const std::string & uri,
+        std::chrono::milliseconds latency, bool failed) = 0;
+
+    virtual void recordDownload(const std::string & uri,
+        uint64_t bytes, std::chrono::milliseconds duration) = 0;
+
+    virtual std::optional<Performance> lookupPerformance(const std::string & uri) = 0;
 };
 
 /**
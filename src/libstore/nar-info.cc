@@ -4,7 +4,7 @@
 
 namespace nix {
 
-NarInfo::NarInfo(const Store & store, const std::string & s, const std::string & whence)
+NarInfo::NarInfo(const Store & store, std::string_view s, const std::string & whence)
     : ValidPathInfo(StorePath(StorePath::dummy), Hash(Hash::dummy)) // FIXME: hack
 {
     unsigned line = 1;
@@ -14,7 +14,7 @@ NarInfo::NarInfo(const Store & store, const std::string & s, const std::string &
             std::string(reason) + (line > 0 ? " at line " + std::to_string(line) : ""));
     };
 
-    auto parseHashField = [&](const std::string & s) {
+    auto parseHashField = [&](std::string_view s) {
         try {
             return Hash::parseAnyPrefixed(s);
         } catch (BadHash &) {
@@ -22,21 +22,38 @@ NarInfo::NarInfo(const Store & store, const std::string & s, const std::string &
         }
     };
 
+    /* Call `f` on each space-separated word of `s`, as views into
+       `s`, so that lists like `References` don't need a copy of each
+       word. */
+    auto forEachWord = [](std::string_view s, auto f) {
+        while (true) {
+            auto start = s.find_first_not_of(' ');
+            if (start == s.npos) break;
+            s.remove_prefix(start);
+            auto end = s.find(' ');
+            f(s.substr(0, end));
+            if (end == s.npos) break;
+            s.remove_prefix(end);
+        }
+    };
+
     bool havePath = false;
     bool haveNarHash = false;
 
+    /* The name and value of each field are views into `s`. Only the
+       fields that are kept as strings are copied. */
     size_t pos = 0;
     while (pos < s.size()) {
 
         size_t colon = s.find(':', pos);
-        if (colon == std::string::npos) throw corrupt("expecting ':'");
+        if (colon == s.npos) throw corrupt("expecting ':'");
 
-        std::string name(s, pos, colon - pos);
+        auto name = s.substr(pos, colon - pos);
 
         size_t eol = s.find('\n', colon + 2);
-        if (eol == std::string::npos) throw corrupt("expecting '\\n'");
+        if (eol == s.npos) throw corrupt("expecting '\\n'");
 
-        std::string value(s, colon + 2, eol - colon - 2);
+        auto value = s.substr(colon + 2, eol - colon - 2);
 
         if (name == "StorePath") {
             path = store.parseStorePath(value);
@@ -53,6 +70,29 @@ NarInfo::NarInfo(const Store & store, const std::string & s, const std::string &
             if (!n) throw corrupt("invalid FileSize");
             fileSize = *n;
         }
+        else if (name == "Chunks") {
+            if (!chunks.empty()) throw corrupt("extra Chunks");
+            forEachWord(value, [&](std::string_view h) {
+                try {
+                    chunks.push_back(Hash::parseNonSRIUnprefixed(h, htSHA256));
+                } catch (BadHash &) {
+                    throw corrupt("bad chunk hash");
+                }
+            });
+        }
+        else if (name == "DeltaBase")
+            deltaBase = StorePath(value);
+        else if (name == "DeltaBaseNarHash")
+            deltaBaseNarHash = parseHashField(value);
+        else if (name == "DeltaURL")
+            deltaUrl = value;
+        else if (name == "DeltaCompression")
+            deltaCompression = value;
+        else if (name == "DeltaSize") {
+            auto n = string2Int<decltype(deltaSize)>(value);
+            if (!n) throw corrupt("invalid DeltaSize");
+            deltaSize = *n;
+        }
         else if (name == "NarHash") {
             narHash = parseHashField(value);
             haveNarHash = true;
@@ -63,17 +103,19 @@ NarInfo::NarInfo(const Store & store, const std::string & s, const std::string &
             narSize = *n;
         }
         else if (name == "References") {
-            auto refs = tokenizeString<Strings>(value, " ");
             if (!references.empty()) throw corrupt("extra References");
-            for (auto & r : refs)
-                references.insert(StorePath(r));
+            /* References are written in sorted order, so inserting
+               at the end is usually constant time. */
+            forEachWord(value, [&](std::string_view r) {
+                references.emplace_hint(references.end(), r);
+            });
         }
         else if (name == "Deriver") {
             if (value != "unknown-deriver")
                 deriver = StorePath(value);
         }
         else if (name == "Sig")
-            sigs.insert(value);
+            sigs.emplace(value);
         else if (name == "CA") {
             if (ca) throw corrupt("extra CA");
             // FIXME: allow blank ca or require skipping field?
@@ -86,12 +128,18 @@ NarInfo::NarInfo(const Store & store, const std::string & s, const std::string &
 
     if (compression == "") compression = "bzip2";
 
-    if (!havePath || !haveNarHash || url.empty() || narSize == 0) {
+    if (deltaBase && (deltaUrl.empty() || !deltaBaseNarHash)) {
+        line = 0;
+        throw corrupt(deltaUrl.empty() ? "DeltaURL missing" : "DeltaBaseNarHash missing");
+    }
+    if (deltaBase && deltaCompression == "") deltaCompression = "none";
+
+    if (!havePath || !haveNarHash || (url.empty() && chunks.empty()) || narSize == 0) {
         line = 0; // don't include line information in the error
         throw corrupt(
             !havePath ? "StorePath missing" :
             !haveNarHash ? "NarHash missing" :
-            url.empty() ? "URL missing" :
+            url.empty() && chunks.empty() ? "URL missing" :
             narSize == 0 ? "NarSize missing or zero"
             : "?");
     }
@@ -100,27 +148,66 @@ NarInfo::NarInfo(const Store & store, const std::string & s, const std::string &
 std::string NarInfo::to_string(const Store & store) const
 {
     std::string res;
-    res += "StorePath: " + store.printStorePath(path) + "\n";
-    res += "URL: " + url + "\n";
+
+    /* Roughly the final size, so that the appends below rarely
+       reallocate. */
+    res.reserve(512 + references.size() * (StorePath::HashLen + 32) + sigs.size() * 128
+        + chunks.size() * 53);
+
+    auto field = [&](std::string_view name, std::string_view value) {
+        res += name;
+        res += ": ";
+        res += value;
+        res += '\n';
+    };
+
+    field("StorePath", store.printStorePath(path));
+    if (chunks.empty()) {
+        field("URL", url);
+    } else {
+        res += "Chunks:";
+        for (auto & chunk : chunks) {
+            res += ' ';
+            res += chunk.to_string(HashFormat::Base32, false);
+        }
+        res += '\n';
+    }
     assert(compression != "");
-    res += "Compression: " + compression + "\n";
-    assert(fileHash && fileHash->type == htSHA256);
-    res += "FileHash: " + fileHash->to_string(HashFormat::Base32, true) + "\n";
-    res += "FileSize: " + std::to_string(fileSize) + "\n";
+    field("Compression", compression);
+    if (chunks.empty()) {
+        assert(fileHash && fileHash->type == htSHA256);
+        field("FileHash", fileHash->to_string(HashFormat::Base32, true));
+    }
+    field("FileSize", std::to_string(fileSize));
     assert(narHash.type == htSHA256);
-    res += "NarHash: " + narHash.to_string(HashFormat::Base32, true) + "\n";
-    res += "NarSize: " + std::to_string(narSize) + "\n";
+    field("NarHash", narHash.to_string(HashFormat::Base32, true));
+    field("NarSize", std::to_string(narSize));
 
-    res += "References: " + concatStringsSep(" ", shortRefs()) + "\n";
+    res += "References:";
+    for (auto & ref : references) {
+        res += ' ';
+        res += ref.to_string();
+    }
+    if (references.empty()) res += ' ';
+    res += '\n';
+
+    if (deltaBase) {
+        field("DeltaBase", deltaBase->to_string());
+        assert(deltaBaseNarHash);
+        field("DeltaBaseNarHash", deltaBaseNarHash->to_string(HashFormat::Base32, true));
+        field("DeltaURL", deltaUrl);
+        field("DeltaCompression", deltaCompression);
+        field("DeltaSize", std::to_string(deltaSize));
+    }
 
     if (deriver)
-        res += "Deriver: " + std::string(deriver->to_string()) + "\n";
+        field("Deriver", deriver->to_string());
 
-    for (auto sig : sigs)
-        res += "Sig: " + sig + "\n";
+    for (auto & sig : sigs)
+        field("Sig", sig);
 
     if (ca)
-        res += "CA: " + renderContentAddress(*ca) + "\n";
+        field("CA", renderContentAddress(*ca));
 
     return res;
 }
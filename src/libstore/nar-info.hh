@@ -16,13 +16,44 @@ struct NarInfo : ValidPathInfo
     std::optional<Hash> fileHash;
     uint64_t fileSize = 0;
 
+    /**
+     * If not empty, the NAR is not stored as a single file at `url`,
+     * but as the concatenation of these chunks (see `ChunkingSink`).
+     * Each chunk is stored at `chunks/<hash>` plus the file extension
+     * of `compression`, and is identified by the SHA-256 hash of its
+     * uncompressed contents. `fileSize` is the sum of the sizes of
+     * the compressed chunks, and `url` and `fileHash` are not set.
+     */
+    std::vector<Hash> chunks;
+
+    /**
+     * An optional binary delta (see `computeDelta()`) that turns the
+     * NAR of `deltaBase` into the NAR of this path. Substituters use
+     * it instead of the full NAR if `deltaBase` is already valid
+     * locally and has NAR hash `deltaBaseNarHash`, i.e. is identical
+     * to the base the delta was made against. The result is still
+     * checked against `narHash`.
+     */
+    std::optional<StorePath> deltaBase;
+    std::optional<Hash> deltaBaseNarHash;
+    std::string deltaUrl;
+    std::string deltaCompression;
+    uint64_t deltaSize = 0;
+
     NarInfo() = delete;
     NarInfo(const Store & store, std::string && name, ContentAddressWithReferences && ca, Hash narHash)
         : ValidPathInfo(store, std::move(name), std::move(ca), narHash)
     { }
     NarInfo(StorePath && path, Hash narHash) : ValidPathInfo(std::move(path), narHash) { }
     NarInfo(const ValidPathInfo & info) : ValidPathInfo(info) { }
-    NarInfo(const Store & store, const std::string & s, const std::string & whence);
+
+    /**
+     * Parse the textual form of a `.narinfo` file. The fields are
+     * parsed in place, so only the values that are kept as strings
+     * are copied out of `s`.
+     */
+    NarInfo(const Store & store, std::string_view s, const std::string & whence);
+
 
     std::string to_string(const Store & store) const;
 };
@@ -1,6 +1,7 @@
 #include "util.hh"
 #include "local-store.hh"
 #include "globals.hh"
+#include "thread-pool.hh"
 
 #include <cstdlib>
 #include <cstring>
@@ -11,6 +12,12 @@
 #include <stdio.h>
 #include <regex>
 
+#if __linux__
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
 
 namespace nix {
 
@@ -39,6 +46,174 @@ struct MakeReadOnly
 };
 
 
+static const char * optimiseIndexSchema = R"sql(
+
+create table if not exists Links (
+    inode integer primary key not null,
+    hash  text not null
+);
+
+create table if not exists OptimisedPaths (
+    path             text primary key not null,
+    registrationTime integer not null
+);
+
+create table if not exists Info (
+    name  text primary key not null,
+    value integer not null
+);
+
+)sql";
+
+
+bool LocalStore::withOptimiseIndex(std::function<void(OptimiseIndex &)> fun)
+{
+    auto index(_optimiseIndex.lock());
+
+    if (!*index) {
+        if (readOnly || optimiseIndexFailed) return false;
+
+        try {
+            auto i = std::make_unique<OptimiseIndex>();
+            i->db = SQLite(dbDir + "/optimise.sqlite");
+            /* The index can be rebuilt from the links directory, so
+               it doesn't need to survive a crash. */
+            i->db.isCache();
+            i->db.exec(optimiseIndexSchema);
+            i->insertLink.create(i->db, "insert or replace into Links(inode, hash) values (?, ?)");
+            i->deleteLink.create(i->db, "delete from Links where inode = ?");
+            i->queryLink.create(i->db, "select 1 from Links where inode = ?");
+            i->insertPath.create(i->db, "insert or replace into OptimisedPaths(path, registrationTime) values (?, ?)");
+            i->queryPaths.create(i->db, "select path, registrationTime from OptimisedPaths");
+            *index = std::move(i);
+        } catch (Error & e) {
+            warn("cannot open the optimisation index: %s", e.msg());
+            optimiseIndexFailed = true;
+            return false;
+        }
+    }
+
+    retrySQLite<void>([&]() { fun(**index); });
+
+    return true;
+}
+
+
+void LocalStore::indexLinks(OptimiseIndex & index)
+{
+    if (index.populated) return;
+
+    {
+        SQLiteStmt query(index.db, "select value from Info where name = 'linksIndexed'");
+        auto use(query.use());
+        if (use.next() && use.getInt(0)) {
+            index.populated = true;
+            return;
+        }
+    }
+
+    /* This is the only time we need to read all of `linksDir`. After
+       this, the index is kept up to date by optimisePath_() and the
+       garbage collector. */
+    printInfo("indexing '%s'...", linksDir);
+
+    SQLiteTxn txn(index.db);
+
+    index.db.exec("delete from Links");
+
+    AutoCloseDir dir(opendir(linksDir.c_str()));
+    if (!dir) throw SysError("opening directory '%1%'", linksDir);
+
+    uint64_t n = 0;
+    struct dirent * dirent;
+    while (errno = 0, dirent = readdir(dir.get())) { /* sic */
+        checkInterrupt();
+        std::string name = dirent->d_name;
+        if (name == "." || name == "..") continue;
+        index.insertLink.use()((int64_t) dirent->d_ino)(name).exec();
+        n++;
+    }
+    if (errno) throw SysError("reading directory '%1%'", linksDir);
+
+    index.db.exec("insert or replace into Info(name, value) values ('linksIndexed', 1)");
+
+    txn.commit();
+
+    printMsg(lvlTalkative, "indexed %1% links", n);
+
+    index.populated = true;
+}
+
+
+#ifdef FIDEDUPERANGE
+/**
+ * Ask the file system to share the data blocks of `to` with those of
+ * `from`, which must have the same contents. Returns the number of
+ * bytes that were deduplicated, or nothing if the file system doesn't
+ * support this.
+ */
+static std::optional<uint64_t> dedupeFile(const Path & from, const Path & to, uint64_t size)
+{
+    AutoCloseFD fdFrom = open(from.c_str(), O_RDONLY | O_CLOEXEC);
+    if (!fdFrom) throw SysError("opening '%s'", from);
+
+    AutoCloseFD fdTo = open(to.c_str(), O_RDONLY | O_CLOEXEC);
+    if (!fdTo) throw SysError("opening '%s'", to);
+
+    /* File systems may limit the amount of data deduplicated per
+       call, so do it in chunks. */
+    const uint64_t chunkSize = 16 * 1024 * 1024;
+
+    std::vector<char> buf(sizeof(struct file_dedupe_range) + sizeof(struct file_dedupe_range_info));
+    auto range = (struct file_dedupe_range *) buf.data();
+
+    uint64_t offset = 0;
+
+    while (offset < size) {
+        std::fill(buf.begin(), buf.end(), 0);
+        range->src_offset = offset;
+        range->src_length = std::min(size - offset, chunkSize);
+        range->dest_count = 1;
+        range->info[0].dest_fd = fdTo.get();
+        range->info[0].dest_offset = offset;
+
+        int err = 0;
+        if (ioctl(fdFrom.get(), FIDEDUPERANGE, range) == -1)
+            err = errno;
+        else if (range->info[0].status < 0)
+            err = -range->info[0].status;
+
+        if (err == EOPNOTSUPP || err == ENOTTY || err == EINVAL || err == EXDEV || err == EPERM)
+            return std::nullopt;
+        if (err)
+            throw SysError(err, "deduplicating '%s' with '%s'", to, from);
+
+        if (range->info[0].status == FILE_DEDUPE_RANGE_DIFFERS) {
+            warn("'%s' unexpectedly differs from '%s'", to, from);
+            break;
+        }
+
+        if (!range->info[0].bytes_deduped) break;
+        offset += range->info[0].bytes_deduped;
+    }
+
+    return offset;
+}
+#endif
+
+
+bool LocalStore::isKnownLink(ino_t ino, const InodeHash & inodeHash)
+{
+    if (inodeHash.count(ino)) return true;
+    bool found = false;
+    withOptimiseIndex([&](OptimiseIndex & index) {
+        if (index.populated)
+            found = index.queryLink.use()((int64_t) ino).next();
+    });
+    return found;
+}
+
+
 LocalStore::InodeHash LocalStore::loadInodeHash()
 {
     debug("loading hash inodes in memory");
@@ -88,7 +263,7 @@ Strings LocalStore::readDirectoryIgnoringInodes(const Path & path, const InodeHa
 
 
 void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
-    const Path & path, InodeHash & inodeHash, RepairFlag repair)
+    const Path & path, const InodeHash & inodeHash, RepairFlag repair)
 {
     checkInterrupt();
 
@@ -130,8 +305,9 @@ void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
         return;
     }
 
-    /* This can still happen on top-level files. */
-    if (st.st_nlink > 1 && inodeHash.count(st.st_ino)) {
+    /* This can still happen on top-level files, and on any file
+       when we're using the index rather than `inodeHash`. */
+    if (st.st_nlink > 1 && isKnownLink(st.st_ino, inodeHash)) {
         debug("'%s' is already linked, with %d other file(s)", path, st.st_nlink - 2);
         return;
     }
@@ -161,14 +337,19 @@ void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
             warn("removing corrupted link '%s'", linkPath);
             warn("There may be more corrupted paths."
                  "\nYou should run `nix-store --verify --check-contents --repair` to fix them all");
-            unlink(linkPath.c_str());
+            if (unlink(linkPath.c_str()) == 0)
+                withOptimiseIndex([&](OptimiseIndex & index) {
+                    index.deleteLink.use()((int64_t) stLink.st_ino).exec();
+                });
         }
     }
 
     if (!pathExists(linkPath)) {
         /* Nope, create a hard link in the links directory. */
         if (link(path.c_str(), linkPath.c_str()) == 0) {
-            inodeHash.insert(st.st_ino);
+            withOptimiseIndex([&](OptimiseIndex & index) {
+                index.insertLink.use()((int64_t) st.st_ino)(hash.to_string(HashFormat::Base32, false)).exec();
+            });
             return;
         }
 
@@ -200,6 +381,25 @@ void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
         return;
     }
 
+#ifdef FIDEDUPERANGE
+    if (settings.optimiseMethod == omReflink && S_ISREG(st.st_mode)) {
+        if (auto deduped = dedupeFile(linkPath, path, st.st_size)) {
+            if (*deduped) {
+                printMsg(lvlTalkative, "deduplicated '%1%' with '%2%'", path, linkPath);
+                stats.filesLinked++;
+                stats.bytesFreed += *deduped;
+                stats.blocksFreed += *deduped / 512;
+                if (act)
+                    act->result(resFileLinked, *deduped, *deduped / 512);
+            }
+            return;
+        }
+        static std::atomic<bool> warned{false};
+        if (!warned.exchange(true))
+            printInfo("the file system of '%s' doesn't support deduplication, using hard links instead", realStoreDir);
+    }
+#endif
+
     printMsg(lvlTalkative, "linking '%1%' to '%2%'", path, linkPath);
 
     /* Make the containing directory writable, but only if it's not
@@ -258,22 +458,73 @@ void LocalStore::optimiseStore(OptimiseStats & stats)
     Activity act(*logger, actOptimiseStore);
 
     auto paths = queryAllValidPaths();
-    InodeHash inodeHash = loadInodeHash();
+
+    /* Find out which paths have already been optimised. A path that
+       has been deleted and added again since then has a different
+       registration time, so it isn't skipped. If the index isn't
+       available, fall back to loading the inodes of all links. */
+    std::unordered_map<std::string, time_t> optimised;
+    InodeHash inodeHash;
+
+    if (!withOptimiseIndex([&](OptimiseIndex & index) {
+            indexLinks(index);
+            auto use(index.queryPaths.use());
+            while (use.next())
+                optimised.emplace(use.getStr(0), use.getInt(1));
+        }))
+        inodeHash = loadInodeHash();
 
     act.progress(0, paths.size());
 
-    uint64_t done = 0;
+    Sync<OptimiseStats> stats_(stats);
+    std::atomic<uint64_t> done{0};
+
+    /* Optimise paths in parallel. Each path is handled by a single
+       thread, so there is no contention on the directories being
+       modified; concurrent attempts to create the same link are
+       already handled by optimisePath_(), since other processes may
+       be doing the same thing. */
+    ThreadPool pool;
 
     for (auto & i : paths) {
-        addTempRoot(i);
-        if (!isValidPath(i)) continue; /* path was GC'ed, probably */
-        {
-            Activity act(*logger, lvlTalkative, actUnknown, fmt("optimising path '%s'", printStorePath(i)));
-            optimisePath_(&act, stats, realStoreDir + "/" + std::string(i.to_string()), inodeHash, NoRepair);
-        }
-        done++;
-        act.progress(done, paths.size());
+        pool.enqueue([&, path(i)]() {
+            checkInterrupt();
+
+            addTempRoot(path);
+
+            std::shared_ptr<const ValidPathInfo> info;
+            try {
+                info = queryPathInfo(path).get_ptr();
+            } catch (InvalidPath &) {
+                /* Path was GC'ed, probably. */
+            }
+
+            auto j = optimised.find(printStorePath(path));
+
+            if (info && (j == optimised.end() || j->second != info->registrationTime)) {
+                OptimiseStats pathStats;
+                {
+                    Activity act(*logger, lvlTalkative, actUnknown, fmt("optimising path '%s'", printStorePath(path)));
+                    optimisePath_(&act, pathStats, realStoreDir + "/" + std::string(path.to_string()), inodeHash, NoRepair);
+                }
+
+                withOptimiseIndex([&](OptimiseIndex & index) {
+                    index.insertPath.use()(printStorePath(path))(info->registrationTime).exec();
+                });
+
+                auto stats(stats_.lock());
+                stats->filesLinked += pathStats.filesLinked;
+                stats->bytesFreed += pathStats.bytesFreed;
+                stats->blocksFreed += pathStats.blocksFreed;
+            }
+
+            act.progress(++done, paths.size());
+        });
     }
+
+    pool.process();
+
+    stats = *stats_.lock();
 }
 
 void LocalStore::optimiseStore()
@@ -282,8 +533,9 @@ void LocalStore::optimiseStore()
 
     optimiseStore(stats);
 
-    printInfo("%s freed by hard-linking %d files",
+    printInfo("%s freed by %s %d files",
         showBytes(stats.bytesFreed),
+        settings.optimiseMethod == omReflink ? "deduplicating" : "hard-linking",
         stats.filesLinked);
 }
 
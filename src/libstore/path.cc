@@ -2,6 +2,11 @@
 
 #include <sodium.h>
 
+#include <array>
+#include <deque>
+#include <shared_mutex>
+#include <unordered_set>
+
 namespace nix {
 
 static void checkName(std::string_view path, std::string_view name)
@@ -22,22 +27,65 @@ static void checkName(std::string_view path, std::string_view name)
             throw BadStorePath("store path '%s' contains illegal character '%s'", path, c);
 }
 
+/**
+ * The table of interned base names. It's split into shards with their
+ * own lock so that threads creating store paths concurrently rarely
+ * contend. Base names are never removed, so the number of entries is
+ * bounded by the number of distinct store paths the process has seen.
+ */
+struct InternTable
+{
+    static constexpr size_t nrShards = 16;
+
+    struct alignas(64) Shard
+    {
+        std::shared_mutex mutex;
+        std::unordered_set<std::string_view> index;
+        /* A deque doesn't move its elements when it grows, so views
+           of them stay valid. */
+        std::deque<std::string> storage;
+    };
+
+    std::array<Shard, nrShards> shards;
+};
+
+std::string_view StorePath::intern(std::string_view baseName)
+{
+    /* Never destroyed, since store paths may outlive static
+       destructors. */
+    static auto table = new InternTable;
+
+    auto & shard = table->shards[std::hash<std::string_view>()(baseName) % InternTable::nrShards];
+
+    {
+        std::shared_lock lock(shard.mutex);
+        auto i = shard.index.find(baseName);
+        if (i != shard.index.end()) return *i;
+    }
+
+    std::unique_lock lock(shard.mutex);
+    auto i = shard.index.find(baseName);
+    if (i != shard.index.end()) return *i;
+    return *shard.index.insert(shard.storage.emplace_back(baseName)).first;
+}
+
 StorePath::StorePath(std::string_view _baseName)
-    : baseName(_baseName)
 {
-    if (baseName.size() < HashLen + 1)
-        throw BadStorePath("'%s' is too short to be a valid store path", baseName);
-    for (auto c : hashPart())
+    if (_baseName.size() < HashLen + 1)
+        throw BadStorePath("'%s' is too short to be a valid store path", _baseName);
+    for (auto c : _baseName.substr(0, HashLen))
         if (c == 'e' || c == 'o' || c == 'u' || c == 't'
             || !((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z')))
-            throw BadStorePath("store path '%s' contains illegal base-32 character '%s'", baseName, c);
-    checkName(baseName, name());
+            throw BadStorePath("store path '%s' contains illegal base-32 character '%s'", _baseName, c);
+    checkName(_baseName, _baseName.substr(HashLen + 1));
+    baseName = intern(_baseName);
 }
 
 StorePath::StorePath(const Hash & hash, std::string_view _name)
-    : baseName((hash.to_string(HashFormat::Base32, false) + "-").append(std::string(_name)))
 {
-    checkName(baseName, name());
+    auto s = (hash.to_string(HashFormat::Base32, false) + "-").append(std::string(_name));
+    checkName(s, _name);
+    baseName = intern(s);
 }
 
 bool StorePath::isDerivation() const
@@ -18,7 +18,15 @@ struct Hash;
  */
 class StorePath
 {
-    std::string baseName;
+    /**
+     * The base name, interned so that all store paths with the same
+     * base name share the same characters. Copying a store path thus
+     * doesn't allocate, and two store paths are equal iff they point
+     * to the same characters.
+     */
+    std::string_view baseName;
+
+    static std::string_view intern(std::string_view baseName);
 
 public:
 
@@ -42,17 +50,17 @@ public:
 
     bool operator < (const StorePath & other) const
     {
-        return baseName < other.baseName;
+        return baseName.data() != other.baseName.data() && baseName < other.baseName;
     }
 
     bool operator == (const StorePath & other) const
     {
-        return baseName == other.baseName;
+        return baseName.data() == other.baseName.data();
     }
 
     bool operator != (const StorePath & other) const
     {
-        return baseName != other.baseName;
+        return baseName.data() != other.baseName.data();
     }
 
     /**
@@ -62,12 +70,12 @@ public:
 
     std::string_view name() const
     {
-        return std::string_view(baseName).substr(HashLen + 1);
+        return baseName.substr(HashLen + 1);
     }
 
     std::string_view hashPart() const
     {
-        return std::string_view(baseName).substr(0, HashLen);
+        return baseName.substr(0, HashLen);
     }
 
     static StorePath dummy;
@@ -1,8 +1,11 @@
 #include "pathlocks.hh"
 #include "util.hh"
 #include "sync.hh"
+#include "metrics.hh"
+#include "finally.hh"
 
 #include <cerrno>
+#include <condition_variable>
 #include <cstdlib>
 
 #include <fcntl.h>
@@ -68,6 +71,65 @@ bool lockFile(int fd, LockType lockType, bool wait)
 }
 
 
+/* The paths locked by `PathLocks` objects in this process. Other
+   threads of this process that want one of them wait here, rather
+   than by repeatedly opening and flock()ing the lock file, which may
+   be deleted and recreated by the holder in the meantime. The file
+   system lock is still needed to exclude other processes. */
+struct HeldLocks
+{
+    pid_t pid = 0;
+    std::set<Path> paths;
+};
+
+static Sync<HeldLocks> heldLocks;
+static std::condition_variable heldLockReleased;
+
+/* Forked children don't hold the locks of their parent, even though
+   they have a copy of `heldLocks`. */
+static std::set<Path> & heldPaths(Sync<HeldLocks>::Lock & held)
+{
+    auto pid = getpid();
+    if (held->pid != pid) {
+        held->pid = pid;
+        held->paths.clear();
+    }
+    return held->paths;
+}
+
+/**
+ * Acquire the in-process lock on `lockPath`.
+ *
+ * @return false if `wait` is false and another thread holds it.
+ */
+static bool lockInProcess(const Path & lockPath, const std::string & waitMsg, bool wait)
+{
+    auto held(heldLocks.lock());
+
+    if (heldPaths(held).count(lockPath)) {
+        if (!wait) return false;
+        if (waitMsg != "") printError(waitMsg);
+        debug("waiting for another thread to release '%s'", lockPath);
+        auto start = std::chrono::steady_clock::now();
+        while (heldPaths(held).count(lockPath)) {
+            checkInterrupt();
+            held.wait_for(heldLockReleased, std::chrono::seconds(1));
+        }
+        metrics().lockWaits.observe(std::chrono::steady_clock::now() - start);
+    }
+
+    heldPaths(held).insert(lockPath);
+    return true;
+}
+
+static void unlockInProcess(const Path & lockPath)
+{
+    auto held(heldLocks.lock());
+    heldPaths(held).erase(lockPath);
+    heldLockReleased.notify_all();
+}
+
+
 PathLocks::PathLocks()
     : deletePaths(false)
 {
@@ -98,6 +160,18 @@ bool PathLocks::lockPaths(const PathSet & paths,
 
         debug("locking path '%1%'", path);
 
+        if (!lockInProcess(lockPath, waitMsg, wait)) {
+            unlock();
+            return false;
+        }
+
+        /* Release the in-process lock if we don't get the file
+           system lock. */
+        Finally releaseInProcess([&]() {
+            if (fds.empty() || fds.back().second != lockPath)
+                unlockInProcess(lockPath);
+        });
+
         AutoCloseFD fd;
 
         while (1) {
@@ -109,7 +183,9 @@ bool PathLocks::lockPaths(const PathSet & paths,
             if (!lockFile(fd.get(), ltWrite, false)) {
                 if (wait) {
                     if (waitMsg != "") printError(waitMsg);
+                    auto start = std::chrono::steady_clock::now();
                     lockFile(fd.get(), ltWrite, true);
+                    metrics().lockWaits.observe(std::chrono::steady_clock::now() - start);
                 } else {
                     /* Failed to lock this path; release all other
                        locks. */
@@ -163,6 +239,8 @@ void PathLocks::unlock()
                 "error (ignored): cannot close lock file on '%1%'",
                 i.second);
 
+        unlockInProcess(i.second);
+
         debug("lock released on '%1%'", i.second);
     }
 
@@ -182,7 +260,9 @@ FdLock::FdLock(int fd, LockType lockType, bool wait, std::string_view waitMsg)
     if (wait) {
         if (!lockFile(fd, lockType, false)) {
             printInfo("%s", waitMsg);
+            auto start = std::chrono::steady_clock::now();
             acquired = lockFile(fd, lockType, true);
+            metrics().lockWaits.observe(std::chrono::steady_clock::now() - start);
         }
     } else
         acquired = lockFile(fd, lockType, false);
@@ -21,6 +21,11 @@ enum LockType { ltRead, ltWrite, ltNone };
 
 bool lockFile(int fd, LockType lockType, bool wait);
 
+/**
+ * Exclusive locks on a set of paths, held through `<path>.lock` files.
+ * Threads of the same process contending for a lock wait for each
+ * other in memory, and only the thread that gets it locks the file.
+ */
 class PathLocks
 {
 private:
@@ -0,0 +1,145 @@
+#include "remote-builder-cache.hh"
+#include "sqlite.hh"
+#include "sync.hh"
+#include "util.hh"
+
+namespace nix {
+
+static const char * schema = R"sql(
+
+create table if not exists ValidPaths (
+    machine   text not null,
+    path      text not null, -- base name of the store path
+    timestamp integer not null,
+    primary key (machine, path)
+);
+
+create table if not exists Uploads (
+    machine    text primary key not null,
+    throughput integer not null, -- in bytes per second
+    timestamp  integer not null
+);
+
+)sql";
+
+class RemoteBuilderCacheImpl : public RemoteBuilderCache
+{
+public:
+
+    /* How long a path is assumed to remain valid on a builder after
+       it was last seen there. */
+    const int validPathTtl = 24 * 3600;
+
+    /* The weight of a new sample in the estimated throughput. */
+    const double throughputWeight = 0.5;
+
+    struct State
+    {
+        SQLite db;
+        SQLiteStmt insertValidPath, queryValidPath, purgeValidPaths;
+        SQLiteStmt queryThroughput, upsertThroughput;
+    };
+
+    Sync<State> _state;
+
+    RemoteBuilderCacheImpl(Path dbPath = getCacheDir() + "/nix/remote-builders-v1.sqlite")
+    {
+        auto state(_state.lock());
+
+        createDirs(dirOf(dbPath));
+
+        state->db = SQLite(dbPath);
+
+        state->db.isCache();
+
+        state->db.exec(schema);
+
+        state->insertValidPath.create(state->db,
+            "insert or replace into ValidPaths(machine, path, timestamp) values (?, ?, ?)");
+
+        state->queryValidPath.create(state->db,
+            "select 1 from ValidPaths where machine = ? and path = ? and timestamp > ?");
+
+        state->purgeValidPaths.create(state->db,
+            "delete from ValidPaths where timestamp <= ?");
+
+        state->queryThroughput.create(state->db,
+            "select throughput from Uploads where machine = ?");
+
+        state->upsertThroughput.create(state->db,
+            "insert or replace into Uploads(machine, throughput, timestamp) values (?, ?, ?)");
+
+        retrySQLite<void>([&]() {
+            state->purgeValidPaths.use()(time(0) - validPathTtl).exec();
+        });
+    }
+
+    void addValidPaths(std::string_view machine, const StorePathSet & paths) override
+    {
+        retrySQLite<void>([&]() {
+            auto state(_state.lock());
+            SQLiteTxn txn(state->db);
+            auto now = time(0);
+            for (auto & path : paths)
+                state->insertValidPath.use()(machine)(path.to_string())(now).exec();
+            txn.commit();
+        });
+    }
+
+    StorePathSet queryValidPaths(std::string_view machine, const StorePathSet & paths) override
+    {
+        return retrySQLite<StorePathSet>([&]() {
+            auto state(_state.lock());
+            StorePathSet res;
+            auto cutoff = time(0) - validPathTtl;
+            for (auto & path : paths)
+                if (state->queryValidPath.use()(machine)(path.to_string())(cutoff).next())
+                    res.insert(path);
+            return res;
+        });
+    }
+
+    std::optional<uint64_t> uploadThroughput(State & state, std::string_view machine)
+    {
+        auto query(state.queryThroughput.use()(machine));
+        if (!query.next()) return std::nullopt;
+        return query.getInt(0);
+    }
+
+    void recordUpload(std::string_view machine, uint64_t bytes, double seconds) override
+    {
+        if (seconds <= 0) return;
+        retrySQLite<void>([&]() {
+            auto state(_state.lock());
+            uint64_t throughput = bytes / seconds;
+            if (auto old = uploadThroughput(*state, machine))
+                throughput = throughputWeight * throughput + (1 - throughputWeight) * *old;
+            state->upsertThroughput.use()
+                (machine)
+                ((int64_t) throughput)
+                (time(0))
+                .exec();
+        });
+    }
+
+    std::optional<uint64_t> uploadThroughput(std::string_view machine) override
+    {
+        return retrySQLite<std::optional<uint64_t>>([&]() {
+            auto state(_state.lock());
+            return uploadThroughput(*state, machine);
+        });
+    }
+};
+
+ref<RemoteBuilderCache> getRemoteBuilderCache()
+{
+    static ref<RemoteBuilderCache> cache = make_ref<RemoteBuilderCacheImpl>();
+    return cache;
+}
+
+ref<RemoteBuilderCache> getTestRemoteBuilderCache(Path dbPath)
+{
+    return make_ref<RemoteBuilderCacheImpl>(dbPath);
+}
+
+}
@@ -0,0 +1,55 @@
+#pragma once
+///@file
+
+#include "path.hh"
+#include "ref.hh"
+#include "types.hh"
+
+#include <optional>
+
+namespace nix {
+
+/**
+ * A cache shared by all invocations of the build hook that records
+ * what is known about each remote builder: which store paths it has
+ * (so that builds can be sent where their inputs already are) and how
+ * fast paths could be uploaded to it. Builders are identified by their
+ * store URI.
+ *
+ * The cache is only a hint. Paths may have been garbage-collected on
+ * the builder since they were recorded.
+ */
+class RemoteBuilderCache
+{
+public:
+
+    virtual ~RemoteBuilderCache() { }
+
+    /**
+     * Record that `machine` has `paths`.
+     */
+    virtual void addValidPaths(std::string_view machine, const StorePathSet & paths) = 0;
+
+    /**
+     * @return The subset of `paths` that `machine` has been recently
+     * recorded to have.
+     */
+    virtual StorePathSet queryValidPaths(std::string_view machine, const StorePathSet & paths) = 0;
+
+    /**
+     * Record that uploading `bytes` to `machine` took `seconds`.
+     */
+    virtual void recordUpload(std::string_view machine, uint64_t bytes, double seconds) = 0;
+
+    /**
+     * @return The estimated upload throughput to `machine` in bytes
+     * per second, or nothing if nothing has been uploaded to it yet.
+     */
+    virtual std::optional<uint64_t> uploadThroughput(std::string_view machine) = 0;
+};
+
+ref<RemoteBuilderCache> getRemoteBuilderCache();
+
+ref<RemoteBuilderCache> getTestRemoteBuilderCache(Path dbPath);
+
+}
@@ -1,16 +1,20 @@
 #include <nlohmann/json.hpp>
 #include "remote-fs-accessor.hh"
 #include "nar-accessor.hh"
+#include "binary-cache-store.hh"
+#include "pathlocks.hh"
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sys/time.h>
 
 namespace nix {
 
-RemoteFSAccessor::RemoteFSAccessor(ref<Store> store, const Path & cacheDir)
+RemoteFSAccessor::RemoteFSAccessor(ref<Store> store, const Path & cacheDir, uint64_t maxCacheSize)
     : store(store)
     , cacheDir(cacheDir)
+    , maxCacheSize(maxCacheSize)
 {
     if (cacheDir != "")
         createDirs(cacheDir);
@@ -36,6 +40,73 @@ ref<FSAccessor> RemoteFSAccessor::addToCache(std::string_view hashPart, std::str
     auto narAccessor = makeNarAccessor(std::move(nar));
     nars.emplace(hashPart, narAccessor);
 
+    writeListing(hashPart, narAccessor);
+
+    return narAccessor;
+}
+
+void RemoteFSAccessor::touchCacheFile(const Path & cacheFile)
+{
+    /* Use the modification time as the time of last use, since
+       access times are often not updated. */
+    if (maxCacheSize && utimes(cacheFile.c_str(), nullptr) == -1)
+        debug("cannot update the time of last use of '%s': %s", cacheFile, strerror(errno));
+}
+
+void RemoteFSAccessor::evictCache()
+{
+    if (!maxCacheSize) return;
+
+    /* If another process is already cleaning up the cache, leave it
+       to that process. */
+    auto lockFd = openLockFile(cacheDir + "/.lock", true);
+    if (!lockFile(lockFd.get(), ltWrite, false)) return;
+
+    struct Entry
+    {
+        time_t lastUsed = 0;
+        uint64_t size = 0;
+    };
+
+    std::map<std::string, Entry> entries;
+    uint64_t totalSize = 0;
+
+    for (auto & i : nix::readDirectory(cacheDir)) {
+        auto dot = i.name.find('.');
+        if (dot == std::string::npos || dot == 0) continue;
+        auto ext = i.name.substr(dot + 1);
+        if (ext != "nar" && ext != "ls") continue;
+        struct stat st;
+        if (lstat((cacheDir + "/" + i.name).c_str(), &st) == -1) continue;
+        auto & entry = entries[i.name.substr(0, dot)];
+        if (ext == "nar") entry.lastUsed = st.st_mtime;
+        entry.size += st.st_size;
+        totalSize += st.st_size;
+    }
+
+    if (totalSize <= maxCacheSize) return;
+
+    std::vector<std::pair<time_t, std::string>> byAge;
+    for (auto & [hashPart, entry] : entries)
+        byAge.emplace_back(entry.lastUsed, hashPart);
+    std::sort(byAge.begin(), byAge.end());
+
+    /* Processes that have a NAR mapped can keep using it after it
+       has been deleted. */
+    for (auto & [lastUsed, hashPart] : byAge) {
+        if (totalSize <= maxCacheSize) break;
+        debug("removing '%s' from the local NAR cache", hashPart);
+        for (auto ext : {"nar", "ls"}) {
+            auto p = makeCacheFile(hashPart, ext);
+            if (unlink(p.c_str()) == -1 && errno != ENOENT)
+                debug("cannot remove '%s': %s", p, strerror(errno));
+        }
+        totalSize -= entries[hashPart].size;
+    }
+}
+
+void RemoteFSAccessor::writeListing(std::string_view hashPart, ref<FSAccessor> narAccessor)
+{
     if (cacheDir != "") {
         try {
             nlohmann::json j = listNar(narAccessor, "", true);
@@ -44,8 +115,6 @@ ref<FSAccessor> RemoteFSAccessor::addToCache(std::string_view hashPart, std::str
             ignoreException();
         }
     }
-
-    return narAccessor;
 }
 
 std::pair<ref<FSAccessor>, Path> RemoteFSAccessor::fetch(const Path & path_, bool requireValidPath)
@@ -60,40 +129,67 @@ std::pair<ref<FSAccessor>, Path> RemoteFSAccessor::fetch(const Path & path_, boo
     auto i = nars.find(std::string(storePath.hashPart()));
     if (i != nars.end()) return {i->second, restPath};
 
-    std::string listing;
     Path cacheFile;
 
     if (cacheDir != "" && pathExists(cacheFile = makeCacheFile(storePath.hashPart(), "nar"))) {
 
+        /* Map the cached NAR rather than reading it, so that it
+           doesn't stay in memory. */
         try {
-            listing = nix::readFile(makeCacheFile(storePath.hashPart(), "ls"));
-
-            auto narAccessor = makeLazyNarAccessor(listing,
-                [cacheFile](uint64_t offset, uint64_t length) {
-
-                    AutoCloseFD fd = open(cacheFile.c_str(), O_RDONLY | O_CLOEXEC);
-                    if (!fd)
-                        throw SysError("opening NAR cache file '%s'", cacheFile);
-
-                    if (lseek(fd.get(), offset, SEEK_SET) != (off_t) offset)
-                        throw SysError("seeking in '%s'", cacheFile);
-
-                    std::string buf(length, 0);
-                    readFull(fd.get(), buf.data(), length);
-
-                    return buf;
-                });
-
+            std::optional<std::string> listing;
+            try {
+                listing = nix::readFile(makeCacheFile(storePath.hashPart(), "ls"));
+            } catch (SysError &) { }
+
+            auto narAccessor = makeNarAccessorFromFile(cacheFile, listing);
+            if (!listing) writeListing(storePath.hashPart(), narAccessor);
+            touchCacheFile(cacheFile);
             nars.emplace(storePath.hashPart(), narAccessor);
             return {narAccessor, restPath};
-
         } catch (SysError &) { }
+    }
 
+    /* If the binary cache allows it, only fetch the parts of the NAR
+       that are needed. */
+    if (auto binaryCacheStore = store.dynamic_pointer_cast<BinaryCacheStore>()) {
         try {
-            auto narAccessor = makeNarAccessor(nix::readFile(cacheFile));
+            if (auto narAccessor = binaryCacheStore->getLazyNarAccessor(storePath)) {
+                auto accessor = ref<FSAccessor>(narAccessor);
+                nars.emplace(storePath.hashPart(), accessor);
+                return {accessor, restPath};
+            }
+        } catch (Error & e) {
+            debug("cannot fetch parts of the NAR of '%s', fetching all of it: %s",
+                store->printStorePath(storePath), e.msg());
+        }
+    }
+
+    /* Write the NAR straight to the cache, if there is one, instead
+       of keeping it in memory. */
+    if (cacheDir != "") {
+        try {
+            cacheFile = makeCacheFile(storePath.hashPart(), "nar");
+            auto tmpFile = cacheFile + ".tmp";
+            AutoDelete del(tmpFile, false);
+            {
+                AutoCloseFD fd = open(tmpFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+                if (!fd)
+                    throw SysError("creating NAR cache file '%s'", tmpFile);
+                FdSink sink(fd.get());
+                store->narFromPath(storePath, sink);
+                sink.flush();
+            }
+            renameFile(tmpFile, cacheFile);
+            del.cancel();
+
+            auto narAccessor = makeNarAccessorFromFile(cacheFile);
+            writeListing(storePath.hashPart(), narAccessor);
             nars.emplace(storePath.hashPart(), narAccessor);
+            evictCache();
             return {narAccessor, restPath};
-        } catch (SysError &) { }
+        } catch (SysError &) {
+            ignoreException();
+        }
     }
 
     StringSink sink;
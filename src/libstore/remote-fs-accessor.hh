@@ -15,6 +15,8 @@ class RemoteFSAccessor : public FSAccessor
 
     Path cacheDir;
 
+    uint64_t maxCacheSize;
+
     std::pair<ref<FSAccessor>, Path> fetch(const Path & path_, bool requireValidPath = true);
 
     friend class BinaryCacheStore;
@@ -23,10 +25,24 @@ class RemoteFSAccessor : public FSAccessor
 
     ref<FSAccessor> addToCache(std::string_view hashPart, std::string && nar);
 
+    void writeListing(std::string_view hashPart, ref<FSAccessor> narAccessor);
+
+    /**
+     * Mark the cached NAR as recently used.
+     */
+    void touchCacheFile(const Path & cacheFile);
+
+    /**
+     * Remove the least recently used NARs from the cache until it is
+     * no bigger than `maxCacheSize`.
+     */
+    void evictCache();
+
 public:
 
     RemoteFSAccessor(ref<Store> store,
-        const /* FIXME: use std::optional */ Path & cacheDir = "");
+        const /* FIXME: use std::optional */ Path & cacheDir = "",
+        uint64_t maxCacheSize = 0);
 
     Stat stat(const Path & path) override;
 
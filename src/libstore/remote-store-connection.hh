@@ -53,6 +53,12 @@ struct RemoteStore::Connection
      */
     std::optional<std::string> daemonNixVersion;
 
+    /**
+     * The compression method for NARs sent over this connection, as
+     * negotiated with the daemon.
+     */
+    std::string narCompression = "none";
+
     /**
      * Time this connection was established.
      */
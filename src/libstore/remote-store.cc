@@ -16,10 +16,39 @@
 #include "logging.hh"
 #include "callback.hh"
 #include "filetransfer.hh"
+#include "compression.hh"
+#include "tracing.hh"
 #include <nlohmann/json.hpp>
 
+#include <future>
+#include <mutex>
+#include <thread>
+
+#include <poll.h>
+
 namespace nix {
 
+/**
+ * Process the log messages and the final error or success from the
+ * daemon that precede the reply to a request. `to` may be null if the
+ * daemon can't ask for input.
+ */
+static std::exception_ptr processDaemonMessages(Source & from, BufferedSink * to,
+    WorkerProto::Version daemonVersion, Sink * sink, Source * source);
+
+/**
+ * Check that the daemon hasn't closed an idle connection, e.g. because
+ * it was restarted or because the SSH connection to it timed out. An
+ * idle connection has nothing to read, so if it is readable, that can
+ * only be the end of the stream (or garbage).
+ */
+static bool isIdleConnectionAlive(RemoteStore::Connection & conn)
+{
+    if (conn.from.hasData()) return false;
+    struct pollfd fd { .fd = conn.from.fd, .events = POLLIN };
+    return poll(&fd, 1, 0) == 0;
+}
+
 /* TODO: Separate these store impls into different files, give them better names */
 RemoteStore::RemoteStore(const Params & params)
     : RemoteStoreConfig(params)
@@ -41,10 +70,14 @@ RemoteStore::RemoteStore(const Params & params)
                     r->to.good()
                     && r->from.good()
                     && std::chrono::duration_cast<std::chrono::seconds>(
-                        std::chrono::steady_clock::now() - r->startTime).count() < maxConnectionAge;
+                        std::chrono::steady_clock::now() - r->startTime).count() < maxConnectionAge
+                    && isIdleConnectionAlive(*r);
             }
             ))
 {
+    connections->setBurst(
+        std::max(0, (int) burstConnections),
+        std::chrono::milliseconds(burstDelay));
 }
 
 
@@ -108,6 +141,17 @@ void RemoteStore::initConnection(Connection & conn)
             conn.remoteTrustsUs = std::nullopt;
         }
 
+        StringSet narCompressionMethods;
+        if (GET_PROTOCOL_MINOR(conn.daemonVersion) >= 38)
+            narCompressionMethods = readStrings<StringSet>(conn.from);
+        if (narCompression != "none") {
+            if (narCompressionMethods.count(narCompression))
+                conn.narCompression = narCompression;
+            else
+                warn("the Nix daemon of '%s' does not support NAR compression method '%s', so NARs are sent uncompressed",
+                    getUri(), narCompression);
+        }
+
         auto ex = conn.processStderr();
         if (ex) std::rethrow_exception(ex);
     }
@@ -196,9 +240,200 @@ void RemoteStore::ConnectionHandle::processStderr(Sink * sink, Source * source,
 
 RemoteStore::ConnectionHandle RemoteStore::getConnection()
 {
+    std::call_once(prewarmStarted, [&]() { startPrewarm(); });
     return ConnectionHandle(connections->get());
 }
 
+
+void RemoteStore::startPrewarm()
+{
+    size_t n = std::min((int) prewarmConnections, (int) maxConnections);
+    if (n <= 1) return;
+
+    /* The threads keep the store alive while they're opening
+       connections, since the pool's factory refers to it. */
+    auto self = std::dynamic_pointer_cast<RemoteStore>(weak_from_this().lock());
+    if (!self) return;
+
+    /* The calling thread is about to open a connection itself. */
+    for (size_t i = 1; i < n; ++i)
+        std::thread([self, n]() {
+            try {
+                self->connections->prewarm(n);
+            } catch (...) {
+                ignoreException();
+            }
+        }).detach();
+}
+
+
+/**
+ * A connection on which requests are sent without waiting for the
+ * replies to earlier requests. Every request and reply is prefixed
+ * with a tag that matches them up, since the daemon may reply out of
+ * order. A thread reads the replies and hands them to the threads
+ * waiting for them.
+ */
+struct RemoteStore::Multiplexer
+{
+    ref<Connection> conn;
+
+    struct State
+    {
+        uint64_t nextTag = 1;
+        std::map<uint64_t, std::promise<std::string>> replies;
+        std::exception_ptr failure;
+    };
+
+    Sync<State> state_;
+
+    std::mutex sendLock;
+
+    std::thread reader;
+
+    Multiplexer(ref<Connection> conn)
+        : conn(conn)
+        , reader([this]() { readReplies(); })
+    { }
+
+    ~Multiplexer()
+    {
+        /* The daemon closes the connection once it has replied to
+           all requests, which stops the reader. */
+        try {
+            conn->closeWrite();
+        } catch (...) {
+            ignoreException();
+        }
+        reader.join();
+    }
+
+    bool failed()
+    {
+        return (bool) state_.lock()->failure;
+    }
+
+    void readReplies()
+    {
+        try {
+            while (true) {
+                auto tag = readNum<uint64_t>(conn->from);
+                auto reply = readString(conn->from);
+                auto state(state_.lock());
+                auto i = state->replies.find(tag);
+                if (i == state->replies.end())
+                    throw Error("Nix daemon replied to unknown request %d", tag);
+                i->second.set_value(std::move(reply));
+                state->replies.erase(i);
+            }
+        } catch (...) {
+            auto state(state_.lock());
+            state->failure = std::current_exception();
+            for (auto & [_, reply] : state->replies)
+                reply.set_exception(state->failure);
+            state->replies.clear();
+        }
+    }
+
+    void query(
+        std::function<void(WorkerProto::WriteConn)> request,
+        std::function<void(WorkerProto::ReadConn)> reply)
+    {
+        StringSink buf;
+        request(WorkerProto::WriteConn {
+            .to = buf,
+            .version = conn->daemonVersion,
+        });
+
+        uint64_t tag;
+        std::future<std::string> future;
+        {
+            auto state(state_.lock());
+            if (state->failure) std::rethrow_exception(state->failure);
+            tag = state->nextTag++;
+            future = state->replies[tag].get_future();
+        }
+
+        try {
+            std::lock_guard<std::mutex> lock(sendLock);
+            conn->to << tag << buf.s;
+            conn->to.flush();
+        } catch (...) {
+            state_.lock()->replies.erase(tag);
+            throw;
+        }
+
+        while (future.wait_for(std::chrono::milliseconds(100)) != std::future_status::ready)
+            checkInterrupt();
+
+        StringSource from(future.get());
+        if (auto ex = processDaemonMessages(from, nullptr, conn->daemonVersion, nullptr, nullptr))
+            std::rethrow_exception(ex);
+        reply(WorkerProto::ReadConn {
+            .from = from,
+            .version = conn->daemonVersion,
+        });
+    }
+};
+
+
+std::shared_ptr<RemoteStore::Multiplexer> RemoteStore::getMultiplexer()
+{
+    auto multiplexer(multiplexer_.lock());
+
+    if (*multiplexer && !(*multiplexer)->failed())
+        return *multiplexer;
+
+    auto conn = openConnectionWrapper();
+    initConnection(*conn);
+
+    if (GET_PROTOCOL_MINOR(conn->daemonVersion) < 37) {
+        multiplexingUnsupported = true;
+        return nullptr;
+    }
+
+    conn->to << WorkerProto::Op::Multiplex;
+    try {
+        if (auto ex = conn->processStderr())
+            std::rethrow_exception(ex);
+    } catch (Error & e) {
+        debug("not multiplexing queries to '%s': %s", getUri(), e.what());
+        multiplexingUnsupported = true;
+        return nullptr;
+    }
+
+    *multiplexer = std::make_shared<Multiplexer>(conn);
+    return *multiplexer;
+}
+
+
+void RemoteStore::query(
+    std::function<void(WorkerProto::WriteConn)> request,
+    std::function<void(WorkerProto::ReadConn)> reply)
+{
+    auto run = [&](ConnectionHandle & conn) {
+        request(*conn);
+        conn.processStderr();
+        reply(*conn);
+    };
+
+    if (multiplexQueries && !multiplexingUnsupported) {
+        if (auto handle = connections->tryGet()) {
+            ConnectionHandle conn(std::move(*handle));
+            run(conn);
+            return;
+        }
+        if (auto multiplexer = getMultiplexer()) {
+            multiplexer->query(request, reply);
+            return;
+        }
+    }
+
+    auto conn(getConnection());
+    run(conn);
+}
+
+
 void RemoteStore::setOptions()
 {
     setOptions(*(getConnection().handle));
@@ -206,22 +441,23 @@ void RemoteStore::setOptions()
 
 bool RemoteStore::isValidPathUncached(const StorePath & path)
 {
-    auto conn(getConnection());
-    conn->to << WorkerProto::Op::IsValidPath << printStorePath(path);
-    conn.processStderr();
-    return readInt(conn->from);
+    bool valid;
+    query(
+        [&](WorkerProto::WriteConn conn) {
+            conn.to << WorkerProto::Op::IsValidPath << printStorePath(path);
+        },
+        [&](WorkerProto::ReadConn conn) {
+            valid = readInt(conn.from);
+        });
+    return valid;
 }
 
 
 StorePathSet RemoteStore::queryValidPaths(const StorePathSet & paths, SubstituteFlag maybeSubstitute)
 {
     auto conn(getConnection());
-    if (GET_PROTOCOL_MINOR(conn->daemonVersion) < 12) {
-        StorePathSet res;
-        for (auto & i : paths)
-            if (isValidPath(i)) res.insert(i);
-        return res;
-    } else {
+
+    auto queryExact = [&](const StorePathSet & paths) {
         conn->to << WorkerProto::Op::QueryValidPaths;
         WorkerProto::write(*this, *conn, paths);
         if (GET_PROTOCOL_MINOR(conn->daemonVersion) >= 27) {
@@ -229,7 +465,48 @@ StorePathSet RemoteStore::queryValidPaths(const StorePathSet & paths, Substitute
         }
         conn.processStderr();
         return WorkerProto::Serialise<StorePathSet>::read(*this, *conn);
-    }
+    };
+
+    if (GET_PROTOCOL_MINOR(conn->daemonVersion) < 12) {
+        StorePathSet res;
+        for (auto & i : paths)
+            if (isValidPath(i)) res.insert(i);
+        return res;
+    } else if (compactPathQueries
+        && !settings.buildersUseSubstitutes
+        && GET_PROTOCOL_MINOR(conn->daemonVersion) >= 39)
+    {
+        std::string prefixes;
+        prefixes.reserve(paths.size() * WorkerProto::hashPrefixLen);
+        for (auto & path : paths)
+            prefixes += path.hashPart().substr(0, WorkerProto::hashPrefixLen);
+        conn->to << WorkerProto::Op::QueryValidPathsByPrefix << prefixes;
+        conn.processStderr();
+        auto present = readString(conn->from);
+        auto digest = readString(conn->from);
+        if (present.size() != (paths.size() + 7) / 8)
+            throw Error("daemon sent a bitmap of the wrong size");
+
+        StorePathSet res;
+        HashSink expected(htSHA256);
+        size_t i = 0;
+        for (auto & path : paths) {
+            if (present[i / 8] & (1 << (i % 8))) {
+                res.insert(path);
+                expected << printStorePath(path);
+            }
+            ++i;
+        }
+        auto hash = expected.finish().first;
+
+        /* The daemon may have found other paths with the same hash
+           prefixes, so ask about the paths themselves unless the
+           hash of the paths it found matches. */
+        if (digest == std::string_view((char *) hash.hash, hash.hashSize))
+            return res;
+        return res.empty() ? res : queryExact(res);
+    } else
+        return queryExact(paths);
 }
 
 
@@ -316,38 +593,100 @@ void RemoteStore::queryPathInfoUncached(const StorePath & path,
 {
     try {
         std::shared_ptr<const ValidPathInfo> info;
-        {
-            auto conn(getConnection());
-            conn->to << WorkerProto::Op::QueryPathInfo << printStorePath(path);
-            try {
-                conn.processStderr();
-            } catch (Error & e) {
-                // Ugly backwards compatibility hack.
-                if (e.msg().find("is not valid") != std::string::npos)
-                    throw InvalidPath(std::move(e.info()));
-                throw;
-            }
-            if (GET_PROTOCOL_MINOR(conn->daemonVersion) >= 17) {
-                bool valid; conn->from >> valid;
-                if (!valid) throw InvalidPath("path '%s' is not valid", printStorePath(path));
-            }
-            info = std::make_shared<ValidPathInfo>(
-                StorePath{path},
-                WorkerProto::Serialise<UnkeyedValidPathInfo>::read(*this, *conn));
+        bool valid = true;
+        try {
+            query(
+                [&](WorkerProto::WriteConn conn) {
+                    conn.to << WorkerProto::Op::QueryPathInfo << printStorePath(path);
+                },
+                [&](WorkerProto::ReadConn conn) {
+                    if (GET_PROTOCOL_MINOR(conn.version) >= 17) {
+                        conn.from >> valid;
+                        if (!valid) return;
+                    }
+                    info = std::make_shared<ValidPathInfo>(
+                        StorePath{path},
+                        WorkerProto::Serialise<UnkeyedValidPathInfo>::read(*this, conn));
+                });
+        } catch (Error & e) {
+            // Ugly backwards compatibility hack.
+            if (e.msg().find("is not valid") != std::string::npos)
+                throw InvalidPath(std::move(e.info()));
+            throw;
         }
+        if (!valid) throw InvalidPath("path '%s' is not valid", printStorePath(path));
         callback(std::move(info));
     } catch (...) { callback.rethrow(); }
 }
 
 
+std::map<StorePath, ref<const ValidPathInfo>> RemoteStore::queryPathInfos(const StorePathSet & paths)
+{
+    std::map<StorePath, ref<const ValidPathInfo>> res;
+    StorePathSet missing;
+
+    for (auto & path : paths) {
+        auto i = pathInfoCache.get(std::string(path.to_string()));
+        if (i && i->isKnownNow()) {
+            stats.narInfoReadAverted++;
+            if (i->didExist())
+                res.insert_or_assign(path, ref<const ValidPathInfo>(i->value));
+        } else
+            missing.insert(path);
+    }
+
+    if (missing.empty()) return res;
+
+    std::vector<std::shared_ptr<const ValidPathInfo>> infos;
+    bool batched;
+
+    {
+        auto conn(getConnection());
+        batched = GET_PROTOCOL_MINOR(conn->daemonVersion) >= 36;
+        if (batched) {
+            conn->to << WorkerProto::Op::QueryPathInfos;
+            WorkerProto::write(*this, *conn, missing);
+            conn.processStderr();
+            auto count = readNum<size_t>(conn->from);
+            for (size_t n = 0; n < count; ++n)
+                infos.push_back(std::make_shared<const ValidPathInfo>(
+                    WorkerProto::Serialise<ValidPathInfo>::read(*this, *conn)));
+        }
+    }
+
+    /* Older daemons need a round trip per path. */
+    if (!batched) {
+        for (auto & [path, info] : Store::queryPathInfos(missing))
+            res.insert_or_assign(path, info);
+        return res;
+    }
+
+    for (auto & info : infos) {
+        pathInfoCache.upsert(std::string(info->path.to_string()), PathInfoCacheValue { .value = info });
+        res.insert_or_assign(info->path, ref<const ValidPathInfo>(info));
+    }
+
+    for (auto & path : missing)
+        if (!res.count(path)) {
+            pathInfoCache.upsert(std::string(path.to_string()), PathInfoCacheValue{});
+            stats.narInfoMissing++;
+        }
+
+    return res;
+}
+
+
 void RemoteStore::queryReferrers(const StorePath & path,
     StorePathSet & referrers)
 {
-    auto conn(getConnection());
-    conn->to << WorkerProto::Op::QueryReferrers << printStorePath(path);
-    conn.processStderr();
-    for (auto & i : WorkerProto::Serialise<StorePathSet>::read(*this, *conn))
-        referrers.insert(i);
+    query(
+        [&](WorkerProto::WriteConn conn) {
+            conn.to << WorkerProto::Op::QueryReferrers << printStorePath(path);
+        },
+        [&](WorkerProto::ReadConn conn) {
+            for (auto & i : WorkerProto::Serialise<StorePathSet>::read(*this, conn))
+                referrers.insert(i);
+        });
 }
 
 
@@ -407,10 +746,14 @@ std::map<std::string, std::optional<StorePath>> RemoteStore::queryPartialDerivat
 
 std::optional<StorePath> RemoteStore::queryPathFromHashPart(const std::string & hashPart)
 {
-    auto conn(getConnection());
-    conn->to << WorkerProto::Op::QueryPathFromHashPart << hashPart;
-    conn.processStderr();
-    Path path = readString(conn->from);
+    Path path;
+    query(
+        [&](WorkerProto::WriteConn conn) {
+            conn.to << WorkerProto::Op::QueryPathFromHashPart << hashPart;
+        },
+        [&](WorkerProto::ReadConn conn) {
+            path = readString(conn.from);
+        });
     if (path.empty()) return {};
     return parseStorePath(path);
 }
@@ -548,9 +891,14 @@ void RemoteStore::addToStore(const ValidPathInfo & info, Source & source,
                  << info.ultimate << info.sigs << renderContentAddress(info.ca)
                  << repair << !checkSigs;
 
+        if (GET_PROTOCOL_MINOR(conn->daemonVersion) >= 38)
+            conn->to << conn->narCompression;
+
         if (GET_PROTOCOL_MINOR(conn->daemonVersion) >= 23) {
             conn.withFramedSink([&](Sink & sink) {
-                copyNAR(source, sink);
+                auto compressor = makeNarCompressionSink(*conn, sink);
+                copyNAR(source, *compressor);
+                compressor->finish();
             });
         } else if (GET_PROTOCOL_MINOR(conn->daemonVersion) >= 21) {
             conn.processStderr(0, &source);
@@ -595,8 +943,12 @@ void RemoteStore::addMultipleToStore(
             << WorkerProto::Op::AddMultipleToStore
             << repair
             << !checkSigs;
+        if (GET_PROTOCOL_MINOR(conn->daemonVersion) >= 38)
+            conn->to << conn->narCompression;
         conn.withFramedSink([&](Sink & sink) {
-            source.drainInto(sink);
+            auto compressor = makeNarCompressionSink(*conn, sink);
+            source.drainInto(*compressor);
+            compressor->finish();
         });
     } else
         Store::addMultipleToStore(source, repair, checkSigs);
@@ -661,6 +1013,34 @@ void RemoteStore::queryRealisationUncached(const DrvOutput & id,
     } catch (...) { return callback.rethrow(); }
 }
 
+std::map<DrvOutput, ref<const Realisation>> RemoteStore::queryRealisations(const std::set<DrvOutput> & ids)
+{
+    if (ids.empty()) return {};
+
+    std::set<Realisation> realisations;
+    bool batched;
+
+    {
+        auto conn(getConnection());
+        batched = GET_PROTOCOL_MINOR(conn->daemonVersion) >= 40;
+        if (batched) {
+            conn->to << WorkerProto::Op::QueryRealisations;
+            WorkerProto::write(*this, *conn, ids);
+            conn.processStderr();
+            realisations = WorkerProto::Serialise<std::set<Realisation>>::read(*this, *conn);
+        }
+    }
+
+    /* Older daemons need a round trip per output. */
+    if (!batched)
+        return Store::queryRealisations(ids);
+
+    std::map<DrvOutput, ref<const Realisation>> res;
+    for (auto & realisation : realisations)
+        res.insert_or_assign(realisation.id, make_ref<const Realisation>(realisation));
+    return res;
+}
+
 void RemoteStore::copyDrvsFromEvalStore(
     const std::vector<DerivedPath> & paths,
     std::shared_ptr<Store> evalStore)
@@ -816,6 +1196,29 @@ void RemoteStore::addTempRoot(const StorePath & path)
 }
 
 
+void RemoteStore::addTempRoots(const StorePathSet & paths)
+{
+    if (paths.empty()) return;
+
+    auto conn(getConnection());
+
+    if (GET_PROTOCOL_MINOR(conn->daemonVersion) >= 42) {
+        conn->to << WorkerProto::Op::AddTempRoots;
+        WorkerProto::write(*this, *conn, paths);
+        conn.processStderr();
+        readInt(conn->from);
+    } else {
+        /* The roots must be registered by the same daemon process,
+           so use one connection for all of them. */
+        for (auto & path : paths) {
+            conn->to << WorkerProto::Op::AddTempRoot << printStorePath(path);
+            conn.processStderr();
+            readInt(conn->from);
+        }
+    }
+}
+
+
 Roots RemoteStore::findRoots(bool censor)
 {
     auto conn(getConnection());
@@ -850,10 +1253,7 @@ void RemoteStore::collectGarbage(const GCOptions & options, GCResults & results)
     results.bytesFreed = readLongLong(conn->from);
     readLongLong(conn->from); // obsolete
 
-    {
-        auto state_(Store::state.lock());
-        state_->pathInfoCache.clear();
-    }
+    pathInfoCache.clear();
 }
 
 
@@ -952,6 +1352,16 @@ void RemoteStore::flushBadConnections()
     connections->flushBad();
 }
 
+void RemoteStore::forgetConnections()
+{
+    connections->forgetIdle();
+
+    /* The thread that reads from the multiplexed connection doesn't
+       exist in this process, so the multiplexer can't be shut down
+       cleanly. Leak it. */
+    new std::shared_ptr<Multiplexer>(std::move(*multiplexer_.lock()));
+}
+
 
 RemoteStore::Connection::~Connection()
 {
@@ -964,10 +1374,27 @@ RemoteStore::Connection::~Connection()
 
 void RemoteStore::narFromPath(const StorePath & path, Sink & sink)
 {
+    TraceSpan span("store", "narFromPath %s", path.to_string());
     auto conn(connections->get());
     conn->to << WorkerProto::Op::NarFromPath << printStorePath(path);
+    if (GET_PROTOCOL_MINOR(conn->daemonVersion) >= 38)
+        conn->to << conn->narCompression << std::max(narCompressionLevel.get(), 0);
     conn->processStderr();
-    copyNAR(conn->from, sink);
+    if (conn->narCompression == "none")
+        copyNAR(conn->from, sink);
+    else {
+        FramedSource framed(conn->from);
+        auto decompressor = makeDecompressionSink(conn->narCompression, sink);
+        framed.drainInto(*decompressor);
+        decompressor->finish();
+    }
+}
+
+ref<CompressionSink> RemoteStore::makeNarCompressionSink(Connection & conn, Sink & sink)
+{
+    return conn.narCompression == "none"
+        ? makeCompressionSink("none", sink)
+        : makeCompressionSink(conn.narCompression, sink, false, narCompressionLevel);
 }
 
 ref<FSAccessor> RemoteStore::getFSAccessor()
@@ -997,6 +1424,12 @@ std::exception_ptr RemoteStore::Connection::processStderr(Sink * sink, Source *
     if (flush)
         to.flush();
 
+    return processDaemonMessages(from, &to, daemonVersion, sink, source);
+}
+
+static std::exception_ptr processDaemonMessages(Source & from, BufferedSink * to,
+    WorkerProto::Version daemonVersion, Sink * sink, Source * source)
+{
     while (true) {
 
         auto msg = readNum<uint64_t>(from);
@@ -1008,11 +1441,11 @@ std::exception_ptr RemoteStore::Connection::processStderr(Sink * sink, Source *
         }
 
         else if (msg == STDERR_READ) {
-            if (!source) throw Error("no source");
+            if (!source || !to) throw Error("no source");
             size_t len = readNum<size_t>(from);
             auto buf = std::make_unique<char[]>(len);
-            writeString({(const char *) buf.get(), source->read(buf.get(), len)}, to);
-            to.flush();
+            writeString({(const char *) buf.get(), source->read(buf.get(), len)}, *to);
+            to->flush();
         }
 
         else if (msg == STDERR_ERROR) {
@@ -2,11 +2,13 @@
 ///@file
 
 #include <limits>
+#include <mutex>
 #include <string>
 
 #include "store-api.hh"
 #include "gc-store.hh"
 #include "log-store.hh"
+#include "worker-protocol.hh"
 
 
 namespace nix {
@@ -16,6 +18,7 @@ class Pipe;
 class Pid;
 struct FdSink;
 struct FdSource;
+struct CompressionSink;
 template<typename T> class Pool;
 
 struct RemoteStoreConfig : virtual StoreConfig
@@ -29,6 +32,60 @@ struct RemoteStoreConfig : virtual StoreConfig
         std::numeric_limits<unsigned int>::max(),
         "max-connection-age",
         "Maximum age of a connection before it is closed."};
+
+    const Setting<int> prewarmConnections{this, 0, "prewarm-connections",
+        R"(
+          The number of connections (at most `max-connections`) to open
+          in the background as soon as the store is first used, so that
+          concurrent operations don't all have to wait for a connection
+          to be established.
+        )"};
+
+    const Setting<int> burstConnections{this, 0, "burst-connections",
+        R"(
+          The number of connections beyond `max-connections` that may be
+          opened for operations that have waited longer than
+          `burst-delay` for a free connection. These connections are
+          closed as soon as they're no longer in use.
+        )"};
+
+    const Setting<unsigned int> burstDelay{this, 100, "burst-delay",
+        "The time in milliseconds an operation waits for a free connection before `burst-connections` are used."};
+
+    const Setting<bool> multiplexQueries{this, true, "multiplex-queries",
+        R"(
+          Whether queries that would have to wait for a free connection
+          (see `max-connections`) are sent over one additional connection
+          on which many queries can be in flight at the same time. This
+          requires a daemon that supports it.
+        )"};
+
+    const Setting<bool> compactPathQueries{this, false, "compact-path-queries",
+        R"(
+          Whether to ask the daemon which of a set of paths are valid
+          (e.g. when copying paths to it) by sending only a short prefix
+          of the hash part of each path, rather than the full paths. The
+          daemon replies with a bitmap of the prefixes that match a valid
+          path, and a hash that confirms that these are the paths that
+          were asked about. Only if that check fails are the matching
+          paths sent in full. This requires a daemon that supports it.
+        )"};
+
+    const Setting<std::string> narCompression{this, "none", "nar-compression",
+        R"(
+          The compression method for NARs sent to and received from the
+          daemon, e.g. when copying paths or building remotely. Only
+          `zstd` and `none` are supported. This is usually much faster
+          than the SSH compression enabled by `compress`, and is worth it
+          on slow links. If the daemon doesn't support the method, NARs
+          are sent uncompressed.
+        )"};
+
+    const Setting<int> narCompressionLevel{this, -1, "nar-compression-level",
+        R"(
+          The compression level for `nar-compression`, from 1 to 19 for
+          `zstd`. -1 specifies the default level of the method.
+        )"};
 };
 
 /**
@@ -56,6 +113,8 @@ public:
     void queryPathInfoUncached(const StorePath & path,
         Callback<std::shared_ptr<const ValidPathInfo>> callback) noexcept override;
 
+    std::map<StorePath, ref<const ValidPathInfo>> queryPathInfos(const StorePathSet & paths) override;
+
     void queryReferrers(const StorePath & path, StorePathSet & referrers) override;
 
     StorePathSet queryValidDerivers(const StorePath & path) override;
@@ -112,6 +171,8 @@ public:
     void queryRealisationUncached(const DrvOutput &,
         Callback<std::shared_ptr<const Realisation>> callback) noexcept override;
 
+    std::map<DrvOutput, ref<const Realisation>> queryRealisations(const std::set<DrvOutput> & ids) override;
+
     void buildPaths(const std::vector<DerivedPath> & paths, BuildMode buildMode, std::shared_ptr<Store> evalStore) override;
 
     std::vector<KeyedBuildResult> buildPathsWithResults(
@@ -126,6 +187,8 @@ public:
 
     void addTempRoot(const StorePath & path) override;
 
+    void addTempRoots(const StorePathSet & paths) override;
+
     Roots findRoots(bool censor) override;
 
     void collectGarbage(const GCOptions & options, GCResults & results) override;
@@ -163,6 +226,13 @@ public:
 
     void flushBadConnections();
 
+    /**
+     * Stop using the inherited connections to the daemon, so that
+     * new ones are opened on demand. To be called in a child process
+     * after fork().
+     */
+    void forgetConnections();
+
     struct Connection;
 
     ref<Connection> openConnectionWrapper();
@@ -189,10 +259,46 @@ protected:
 
     virtual void narFromPath(const StorePath & path, Sink & sink) override;
 
+    /**
+     * Perform an operation that only queries the daemon. `request`
+     * sends the operation and its arguments and `reply` reads its
+     * result. If no connection is free, the operation is sent over
+     * the multiplexed connection rather than waiting for one.
+     */
+    void query(
+        std::function<void(WorkerProto::WriteConn)> request,
+        std::function<void(WorkerProto::ReadConn)> reply);
+
 private:
 
     std::atomic_bool failed{false};
 
+    std::once_flag prewarmStarted;
+
+    /**
+     * Open `prewarm-connections` connections in the background.
+     */
+    void startPrewarm();
+
+    struct Multiplexer;
+
+    Sync<std::shared_ptr<Multiplexer>> multiplexer_;
+
+    std::atomic_bool multiplexingUnsupported{false};
+
+    /**
+     * Return a sink that compresses NARs sent to `sink` as
+     * negotiated for `conn`.
+     */
+    ref<CompressionSink> makeNarCompressionSink(Connection & conn, Sink & sink);
+
+    /**
+     * Get the multiplexed connection, opening it if necessary.
+     *
+     * @return Nothing if the daemon doesn't support multiplexing.
+     */
+    std::shared_ptr<Multiplexer> getMultiplexer();
+
     void copyDrvsFromEvalStore(
         const std::vector<DerivedPath> & paths,
         std::shared_ptr<Store> evalStore);
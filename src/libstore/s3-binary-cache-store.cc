@@ -7,6 +7,7 @@
 #include "globals.hh"
 #include "compression.hh"
 #include "filetransfer.hh"
+#include "serialise.hh"
 
 #include <aws/core/Aws.h>
 #include <aws/core/VersionConfig.h>
@@ -14,6 +15,7 @@
 #include <aws/core/auth/AWSCredentialsProviderChain.h>
 #include <aws/core/client/ClientConfiguration.h>
 #include <aws/core/client/DefaultRetryStrategy.h>
+#include <aws/core/http/HttpResponse.h>
 #include <aws/core/utils/logging/FormattedLogSystem.h>
 #include <aws/core/utils/logging/LogMacros.h>
 #include <aws/core/utils/threading/Executor.h>
@@ -143,11 +145,16 @@ ref<Aws::Client::ClientConfiguration> S3Helper::makeConfig(
     res->connectTimeoutMs = 5 * 1000;
     res->retryStrategy = std::make_shared<RetryStrategy>();
     res->caFile = settings.caFile;
+    /* The client is shared by all threads using the store (e.g. in
+       copyPaths()), so allow as many connections as other transfers. */
+    if (fileTransferSettings.httpConnections)
+        res->maxConnections = fileTransferSettings.httpConnections;
     return res;
 }
 
 S3Helper::FileTransferResult S3Helper::getObject(
-    const std::string & bucketName, const std::string & key)
+    const std::string & bucketName, const std::string & key,
+    std::optional<std::pair<uint64_t, uint64_t>> range)
 {
     debug("fetching 's3://%s/%s'...", bucketName, key);
 
@@ -156,6 +163,9 @@ S3Helper::FileTransferResult S3Helper::getObject(
         .WithBucket(bucketName)
         .WithKey(key);
 
+    if (range)
+        request.SetRange(fmt("bytes=%d-%d", range->first, range->first + range->second - 1));
+
     request.SetResponseStreamFactory([&]() {
         return Aws::New<std::stringstream>("STRINGSTREAM");
     });
@@ -169,8 +179,152 @@ S3Helper::FileTransferResult S3Helper::getObject(
         auto result = checkAws(fmt("AWS error fetching '%s'", key),
             client->GetObject(request));
 
-        res.data = decompress(result.GetContentEncoding(),
-            dynamic_cast<std::stringstream &>(result.GetBody()).str());
+        auto body = dynamic_cast<std::stringstream &>(result.GetBody()).str();
+
+        /* A range of a compressed object can't be decompressed. */
+        res.data = range ? std::move(body) : decompress(result.GetContentEncoding(), body);
+
+    } catch (S3Error & e) {
+        if ((e.err != Aws::S3::S3Errors::NO_SUCH_KEY) &&
+            (e.err != Aws::S3::S3Errors::ACCESS_DENIED)) throw;
+    }
+
+    auto now2 = std::chrono::steady_clock::now();
+
+    res.durationMs = std::chrono::duration_cast<std::chrono::milliseconds>(now2 - now1).count();
+
+    return res;
+}
+
+/* A stream buffer for the body of a GetObject response that passes
+   the data to a sink as soon as the response turns out to be a
+   successful one without a content encoding. Until then (i.e. for
+   error responses and encoded objects), the data is buffered. */
+struct SinkStreamBuf : std::streambuf
+{
+    Sink & sink;
+
+    /* The number of bytes written to `sink` by all attempts of the
+       request. When the SDK retries a request, the new attempt skips
+       the data that was already passed on. */
+    uint64_t & written;
+
+    uint64_t received = 0;
+
+    bool passThrough = false;
+
+    std::string pending;
+
+    std::exception_ptr ex;
+
+    SinkStreamBuf(Sink & sink, uint64_t & written)
+        : sink(sink), written(written)
+    { }
+
+    void forward(std::string_view data)
+    {
+        auto start = received;
+        received += data.size();
+        if (received <= written) return;
+        if (start < written) data.remove_prefix(written - start);
+        sink(data);
+        written += data.size();
+    }
+
+    void startPassThrough()
+    {
+        if (passThrough) return;
+        passThrough = true;
+        forward(pending);
+        pending.clear();
+    }
+
+    std::streamsize xsputn(const char * s, std::streamsize n) override
+    {
+        if (ex) return 0;
+        try {
+            if (passThrough)
+                forward({s, (size_t) n});
+            else
+                pending.append(s, n);
+        } catch (...) {
+            /* Returning less than `n` makes the SDK abort the
+               transfer. */
+            ex = std::current_exception();
+            return 0;
+        }
+        return n;
+    }
+
+    int_type overflow(int_type c) override
+    {
+        if (c == traits_type::eof()) return traits_type::not_eof(c);
+        char ch = c;
+        return xsputn(&ch, 1) == 1 ? c : traits_type::eof();
+    }
+};
+
+S3Helper::StreamingTransferResult S3Helper::getObject(
+    const std::string & bucketName, const std::string & key, Sink & sink)
+{
+    debug("fetching 's3://%s/%s'...", bucketName, key);
+
+    auto request =
+        Aws::S3::Model::GetObjectRequest()
+        .WithBucket(bucketName)
+        .WithKey(key);
+
+    uint64_t written = 0;
+
+    /* One stream buffer per attempt of the request. */
+    std::vector<std::unique_ptr<SinkStreamBuf>> bufs;
+
+    request.SetResponseStreamFactory([&]() {
+        auto buf = std::make_unique<SinkStreamBuf>(sink, written);
+        /* Don't write to the sink again if it has failed. */
+        if (!bufs.empty()) buf->ex = bufs.back()->ex;
+        bufs.push_back(std::move(buf));
+        return Aws::New<std::iostream>("SINKSTREAM", bufs.back().get());
+    });
+
+    request.SetDataReceivedEventHandler(
+        [&](const Aws::Http::HttpRequest *, Aws::Http::HttpResponse * response, long long) {
+            if (bufs.empty() || bufs.back()->passThrough) return;
+            auto code = response->GetResponseCode();
+            if ((code == Aws::Http::HttpResponseCode::OK || code == Aws::Http::HttpResponseCode::PARTIAL_CONTENT)
+                && !response->HasHeader("content-encoding"))
+                bufs.back()->startPassThrough();
+        });
+
+    StreamingTransferResult res { .found = false, .size = 0 };
+
+    auto now1 = std::chrono::steady_clock::now();
+
+    try {
+
+        auto outcome = client->GetObject(request);
+
+        for (auto & buf : bufs)
+            if (buf->ex) std::rethrow_exception(buf->ex);
+
+        auto result = checkAws(fmt("AWS error fetching '%s'", key), std::move(outcome));
+
+        if (!bufs.empty() && !bufs.back()->passThrough) {
+            auto & buf = *bufs.back();
+            auto encoding = result.GetContentEncoding();
+            if (encoding.empty())
+                buf.startPassThrough();
+            else if (written)
+                throw Error("content encoding of 's3://%s/%s' changed during the transfer", bucketName, key);
+            else {
+                auto data = decompress(encoding, buf.pending);
+                sink(data);
+                written = data.size();
+            }
+        }
+
+        res.found = true;
+        res.size = written;
 
     } catch (S3Error & e) {
         if ((e.err != Aws::S3::S3Errors::NO_SUCH_KEY) &&
@@ -250,6 +404,13 @@ struct S3BinaryCacheStoreConfig : virtual BinaryCacheStoreConfig
         this, 5 * 1024 * 1024, "buffer-size",
         "Size (in bytes) of each part in multi-part uploads."};
 
+    const Setting<unsigned int> uploadParallelism{
+        this, 0, "upload-parallelism",
+        R"(
+          The number of parts of a multi-part upload that are uploaded
+          at the same time. 0 means the number of CPU cores.
+        )"};
+
     const std::string name() override { return "S3 Binary Cache Store"; }
 
     std::string doc() override
@@ -341,6 +502,7 @@ struct S3BinaryCacheStoreImpl : virtual S3BinaryCacheStoreConfig, public virtual
         return true;
     }
 
+    std::shared_ptr<Aws::Utils::Threading::PooledThreadExecutor> executor;
     std::shared_ptr<TransferManager> transferManager;
     std::once_flag transferManagerCreated;
 
@@ -353,18 +515,24 @@ struct S3BinaryCacheStoreImpl : virtual S3BinaryCacheStoreConfig, public virtual
         auto size = istream->tellg();
         istream->seekg(0, istream->beg);
 
-        auto maxThreads = std::thread::hardware_concurrency();
-
-        static std::shared_ptr<Aws::Utils::Threading::PooledThreadExecutor>
-            executor = std::make_shared<Aws::Utils::Threading::PooledThreadExecutor>(maxThreads);
-
         std::call_once(transferManagerCreated, [&]()
         {
             if (multipartUpload) {
+                size_t maxThreads = uploadParallelism
+                    ? uploadParallelism.get()
+                    : std::max(1U, std::thread::hardware_concurrency());
+
+                executor = std::make_shared<Aws::Utils::Threading::PooledThreadExecutor>(maxThreads);
+
                 TransferManagerConfiguration transferConfig(executor.get());
 
                 transferConfig.s3Client = s3Helper.client;
                 transferConfig.bufferSize = bufferSize;
+                /* The transfer manager doesn't start a part until it
+                   has a buffer for it, so allow one buffer per
+                   thread. */
+                transferConfig.transferBufferMaxHeapSize =
+                    std::max<uint64_t>(transferConfig.transferBufferMaxHeapSize, bufferSize * maxThreads);
 
                 transferConfig.uploadProgressCallback =
                     [](const TransferManager *transferManager,
@@ -462,19 +630,34 @@ struct S3BinaryCacheStoreImpl : virtual S3BinaryCacheStoreConfig, public virtual
     {
         stats.get++;
 
-        // FIXME: stream output to sink.
-        auto res = s3Helper.getObject(bucketName, path);
+        auto res = s3Helper.getObject(bucketName, path, sink);
 
-        stats.getBytes += res.data ? res.data->size() : 0;
+        stats.getBytes += res.size;
         stats.getTimeMs += res.durationMs;
 
-        if (res.data) {
+        if (res.found)
             printTalkative("downloaded 's3://%s/%s' (%d bytes) in %d ms",
-                bucketName, path, res.data->size(), res.durationMs);
+                bucketName, path, res.size, res.durationMs);
+        else
+            throw NoSuchBinaryCacheFile("file '%s' does not exist in binary cache '%s'", path, getUri());
+    }
+
+    std::optional<std::string> getFileRange(
+        const std::string & path, uint64_t offset, uint64_t length) override
+    {
+        stats.get++;
+
+        auto res = s3Helper.getObject(bucketName, path, std::make_pair(offset, length));
 
-            sink(*res.data);
-        } else
+        stats.getBytes += res.data ? res.data->size() : 0;
+        stats.getTimeMs += res.durationMs;
+
+        if (!res.data)
             throw NoSuchBinaryCacheFile("file '%s' does not exist in binary cache '%s'", path, getUri());
+
+        if (res.data->size() != length) return std::nullopt;
+
+        return std::move(res.data);
     }
 
     StorePathSet queryAllValidPaths() override
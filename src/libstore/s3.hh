@@ -13,6 +13,8 @@ namespace Aws { namespace S3 { class S3Client; } }
 
 namespace nix {
 
+struct Sink;
+
 struct S3Helper
 {
     ref<Aws::Client::ClientConfiguration> config;
@@ -28,8 +30,29 @@ struct S3Helper
         unsigned int durationMs;
     };
 
+    /**
+     * Fetch an object, or only `range->second` bytes of it starting
+     * at `range->first`.
+     */
     FileTransferResult getObject(
-        const std::string & bucketName, const std::string & key);
+        const std::string & bucketName, const std::string & key,
+        std::optional<std::pair<uint64_t, uint64_t>> range = std::nullopt);
+
+    struct StreamingTransferResult
+    {
+        bool found;
+        uint64_t size;
+        unsigned int durationMs;
+    };
+
+    /**
+     * Fetch an object and write it to `sink` while it is being
+     * received, rather than buffering it in memory. Objects with a
+     * `Content-Encoding` are still buffered, since they have to be
+     * decompressed.
+     */
+    StreamingTransferResult getObject(
+        const std::string & bucketName, const std::string & key, Sink & sink);
 };
 
 }
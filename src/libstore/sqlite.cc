@@ -2,6 +2,7 @@
 #include "globals.hh"
 #include "util.hh"
 #include "url.hh"
+#include "metrics.hh"
 
 #include <sqlite3.h>
 
@@ -58,7 +59,7 @@ SQLite::SQLite(const Path & path, SQLiteOpenMode mode)
     // for Linux (WSL) where useSQLiteWAL should be false by default.
     const char *vfs = settings.useSQLiteWAL ? 0 : "unix-dotfile";
     bool immutable = mode == SQLiteOpenMode::Immutable;
-    int flags = immutable ? SQLITE_OPEN_READONLY : SQLITE_OPEN_READWRITE;
+    int flags = immutable || mode == SQLiteOpenMode::ReadOnly ? SQLITE_OPEN_READONLY : SQLITE_OPEN_READWRITE;
     if (mode == SQLiteOpenMode::Normal) flags |= SQLITE_OPEN_CREATE;
     auto uri = "file:" + percentEncode(path) + "?immutable=" + (immutable ? "1" : "0");
     int ret = sqlite3_open_v2(uri.c_str(), &db, SQLITE_OPEN_URI | flags, vfs);
@@ -107,16 +108,29 @@ uint64_t SQLite::getLastInsertedRowId()
     return sqlite3_last_insert_rowid(db);
 }
 
+uint64_t SQLite::getRowsChanged()
+{
+    return sqlite3_changes(db);
+}
+
 void SQLiteStmt::create(sqlite3 * db, const std::string & sql)
 {
-    checkInterrupt();
-    assert(!stmt);
-    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, 0) != SQLITE_OK)
-        SQLiteError::throw_(db, "creating statement '%s'", sql);
+    assert(!this->db);
     this->db = db;
     this->sql = sql;
 }
 
+sqlite3_stmt * SQLiteStmt::get()
+{
+    if (!stmt) {
+        assert(db);
+        checkInterrupt();
+        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, 0) != SQLITE_OK)
+            SQLiteError::throw_(db, "creating statement '%s'", sql);
+    }
+    return stmt;
+}
+
 SQLiteStmt::~SQLiteStmt()
 {
     try {
@@ -130,7 +144,7 @@ SQLiteStmt::~SQLiteStmt()
 SQLiteStmt::Use::Use(SQLiteStmt & stmt)
     : stmt(stmt)
 {
-    assert(stmt.stmt);
+    stmt.get();
     /* Note: sqlite3_reset() returns the error code for the most
        recent call to sqlite3_step().  So ignore it. */
     sqlite3_reset(stmt);
@@ -244,6 +258,8 @@ SQLiteTxn::~SQLiteTxn()
 
 void handleSQLiteBusy(const SQLiteBusy & e, time_t & nextWarning)
 {
+    metrics().sqliteBusyRetries++;
+
     time_t now = time(0);
     if (now > nextWarning) {
         nextWarning = now + 10;
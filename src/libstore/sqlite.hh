@@ -22,6 +22,12 @@ enum class SQLiteOpenMode {
      * Fails with an error if the database does not exist.
      */
     NoCreate,
+    /**
+     * Open the database in read-only mode, while other connections
+     * may still write to it.
+     * Fails with an error if the database does not exist.
+     */
+    ReadOnly,
     /**
      * Open the database in immutable mode.
      * In addition to the database being read-only,
@@ -54,10 +60,17 @@ struct SQLite
     void exec(const std::string & stmt);
 
     uint64_t getLastInsertedRowId();
+
+    /**
+     * @return The number of rows modified by the most recent statement.
+     */
+    uint64_t getRowsChanged();
 };
 
 /**
  * RAII wrapper to create and destroy SQLite prepared statements.
+ * Statements are only prepared when first used, since most processes
+ * use only a few of the statements of a database.
  */
 struct SQLiteStmt
 {
@@ -68,7 +81,13 @@ struct SQLiteStmt
     SQLiteStmt(sqlite3 * db, const std::string & sql) { create(db, sql); }
     void create(sqlite3 * db, const std::string & s);
     ~SQLiteStmt();
-    operator sqlite3_stmt * () { return stmt; }
+
+    /**
+     * @return The prepared statement, preparing it if necessary.
+     */
+    sqlite3_stmt * get();
+
+    operator sqlite3_stmt * () { return get(); }
 
     /**
      * Helper for binding / executing statements.
@@ -10,7 +10,10 @@
 #include "references.hh"
 #include "archive.hh"
 #include "callback.hh"
+#include "topo-sort.hh"
 #include "remote-store.hh"
+#include "tracing.hh"
+#include "startup-profile.hh"
 // FIXME this should not be here, see TODO below on
 // `addMultipleToStore`.
 #include "worker-protocol.hh"
@@ -268,13 +271,19 @@ StorePath Store::addToStore(
     RepairFlag repair,
     const StorePathSet & references)
 {
+    TraceSpan span("store", "addToStore %s", _srcPath);
     Path srcPath(absPath(_srcPath));
+    /* Read the files on a separate thread while the store hashes and
+       copies them. This isn't possible with a custom filter, since
+       that may call the evaluator. */
     auto source = sinkToSource([&](Sink & sink) {
         if (method == FileIngestionMethod::Recursive)
             dumpPath(srcPath, sink, filter);
         else
             readFile(srcPath, sink);
-    });
+    }, []() {
+        throw EndOfFile("coroutine has finished");
+    }, &filter == &defaultPathFilter ? SinkToSourceMode::Thread : SinkToSourceMode::Coroutine);
     return addToStoreFromDump(*source, name, method, hashAlgo, repair, references);
 }
 
@@ -302,6 +311,42 @@ void Store::addMultipleToStore(
         act.progress(nrDone, pathsToCopy.size(), nrRunning, nrFailed);
     };
 
+    /* Start paths that lie on a long chain of bytes to copy first:
+       the priority of a path is its NAR size plus the largest
+       priority of the paths that refer to it. Otherwise, a big path
+       at the top of the closure may only start when everything else
+       is done, leaving the other threads idle. */
+    std::map<StorePath, uint64_t> priorities;
+    {
+        auto sorted = topoSort<StorePath>(storePathsToAdd,
+            {[&](const StorePath & path) {
+                return infosMap.at(path)->first.references;
+            }},
+            {[&](const StorePath & path, const StorePath & parent) {
+                return BuildError(
+                    "cycle detected in the references of '%s' from '%s'",
+                    printStorePath(path),
+                    printStorePath(parent));
+            }});
+
+        std::map<StorePath, uint64_t> referrersPriority;
+        for (auto & path : sorted) {
+            auto & info = infosMap.at(path)->first;
+            auto priority = info.narSize + referrersPriority[path];
+            priorities.insert_or_assign(path, priority);
+            for (auto & ref : info.references)
+                if (ref != path && infosMap.count(ref)) {
+                    auto & p = referrersPriority[ref];
+                    p = std::max(p, priority);
+                }
+        }
+    }
+
+    /* Check which paths are already valid in one batch, rather than
+       one at a time on the copying threads, which would keep them
+       waiting for a round trip each when this is a remote store. */
+    auto validPaths = queryValidPaths(storePathsToAdd);
+
     ThreadPool pool;
 
     processGraph<StorePath>(pool,
@@ -311,7 +356,7 @@ void Store::addMultipleToStore(
 
             auto & [info, _] = *infosMap.at(path);
 
-            if (isValidPath(info.path)) {
+            if (validPaths.count(info.path)) {
                 nrDone++;
                 showProgress();
                 return StorePathSet();
@@ -354,6 +399,10 @@ void Store::addMultipleToStore(
 
             nrDone++;
             showProgress();
+        },
+
+        [&](const StorePath & path) {
+            return priorities.at(path);
         });
 }
 
@@ -485,7 +534,7 @@ StringSet StoreConfig::getDefaultSystemFeatures()
 
 Store::Store(const Params & params)
     : StoreConfig(params)
-    , state({(size_t) pathInfoCacheSize})
+    , pathInfoCache((size_t) pathInfoCacheSize)
 {
     assertLibStoreInitialized();
 }
@@ -565,61 +614,206 @@ StorePathSet Store::queryDerivationOutputs(const StorePath & path)
 }
 
 
-void Store::querySubstitutablePathInfos(const StorePathCAMap & paths, SubstitutablePathInfos & infos)
+/**
+ * Look up `paths` in all of `subs` at the same time. A path gets the
+ * information of the first substituter in `subs` that has it, as soon
+ * as that substituter and all the ones before it have answered, so
+ * the result is the same as when querying them one after the other.
+ */
+static void querySubstitutersInParallel(
+    Store & store,
+    const std::vector<ref<Store>> & subs,
+    const StorePathCAMap & paths,
+    SubstitutablePathInfos & infos)
 {
-    if (!settings.useSubstitutes) return;
-    for (auto & sub : getDefaultSubstituters()) {
+    struct Answer
+    {
+        enum { Pending, Missing, Found, Failed } status = Pending;
+        std::shared_ptr<const ValidPathInfo> info;
+        std::exception_ptr exc;
+    };
+
+    struct Lookup
+    {
+        StorePath path;
+        std::vector<std::optional<StorePath>> subPaths;
+        std::vector<Answer> answers;
+        bool decided = false;
+    };
+
+    struct State
+    {
+        std::vector<Lookup> lookups;
+        size_t undecided = 0;
+        std::vector<bool> errorShown;
+        std::exception_ptr exc;
+    };
+
+    /* Shared with the callbacks, since the answers of lower-priority
+       substituters may arrive after we've returned. */
+    auto state_ = std::make_shared<Sync<State>>();
+    auto wakeup = std::make_shared<std::condition_variable>();
+
+    {
+        auto state(state_->lock());
+        state->errorShown.resize(subs.size(), false);
+
         for (auto & path : paths) {
             if (infos.count(path.first))
                 // Choose first succeeding substituter.
                 continue;
 
-            auto subPath(path.first);
+            Lookup lookup { .path = path.first };
+
+            for (auto & sub : subs) {
+                auto subPath(path.first);
+
+                // Recompute store path so that we can use a different store root.
+                if (path.second) {
+                    subPath = store.makeFixedOutputPathFromCA(
+                        path.first.name(),
+                        ContentAddressWithReferences::withoutRefs(*path.second));
+                    if (sub->storeDir == store.storeDir)
+                        assert(subPath == path.first);
+                    if (subPath != path.first)
+                        debug("replaced path '%s' with '%s' for substituter '%s'", store.printStorePath(path.first), sub->printStorePath(subPath), sub->getUri());
+                } else if (sub->storeDir != store.storeDir) {
+                    lookup.subPaths.push_back(std::nullopt);
+                    lookup.answers.push_back({ .status = Answer::Missing });
+                    continue;
+                }
 
-            // Recompute store path so that we can use a different store root.
-            if (path.second) {
-                subPath = makeFixedOutputPathFromCA(
-                    path.first.name(),
-                    ContentAddressWithReferences::withoutRefs(*path.second));
-                if (sub->storeDir == storeDir)
-                    assert(subPath == path.first);
-                if (subPath != path.first)
-                    debug("replaced path '%s' with '%s' for substituter '%s'", printStorePath(path.first), sub->printStorePath(subPath), sub->getUri());
-            } else if (sub->storeDir != storeDir) continue;
+                debug("checking substituter '%s' for path '%s'", sub->getUri(), sub->printStorePath(subPath));
+                lookup.subPaths.push_back(subPath);
+                lookup.answers.push_back({});
+            }
 
-            debug("checking substituter '%s' for path '%s'", sub->getUri(), sub->printStorePath(subPath));
-            try {
-                auto info = sub->queryPathInfo(subPath);
+            state->lookups.push_back(std::move(lookup));
+            state->undecided++;
+        }
+    }
 
-                if (sub->storeDir != storeDir && !(info->isContentAddressed(*sub) && info->references.empty()))
-                    continue;
+    /* Decide a lookup if its answer is known, i.e. if some
+       substituter has the path and all the ones before it have
+       answered. */
+    auto decide = [](State & state, Lookup & lookup)
+    {
+        if (lookup.decided) return;
+        for (auto & answer : lookup.answers) {
+            if (answer.status == Answer::Pending) return;
+            if (answer.status == Answer::Found) break;
+            if (answer.status == Answer::Failed && !settings.tryFallback) {
+                if (!state.exc) state.exc = answer.exc;
+                break;
+            }
+        }
+        lookup.decided = true;
+        assert(state.undecided);
+        state.undecided--;
+    };
 
-                auto narInfo = std::dynamic_pointer_cast<const NarInfo>(
-                    std::shared_ptr<const ValidPathInfo>(info));
-                infos.insert_or_assign(path.first, SubstitutablePathInfo{
-                    .deriver = info->deriver,
-                    .references = info->references,
-                    .downloadSize = narInfo ? narInfo->fileSize : 0,
-                    .narSize = info->narSize,
+    {
+        auto state(state_->lock());
+        for (auto & lookup : state->lookups)
+            decide(*state, lookup);
+    }
+
+    /* Use a thread pool so that substituters that answer
+       synchronously are queried in parallel as well. */
+    ThreadPool pool;
+
+    auto storeDir = store.storeDir;
+
+    {
+        auto state(state_->lock());
+        for (size_t n = 0; n < state->lookups.size(); ++n)
+            for (size_t i = 0; i < subs.size(); ++i) {
+                auto & subPath = state->lookups[n].subPaths[i];
+                if (!subPath) continue;
+                pool.enqueue([state_, wakeup, decide, storeDir, sub(subs[i]), subPath(*subPath), n, i]() {
+                    checkInterrupt();
+                    sub->queryPathInfo(subPath,
+                        {[state_, wakeup, decide, storeDir, sub, n, i](std::future<ref<const ValidPathInfo>> fut) {
+                            Answer answer;
+                            try {
+                                std::shared_ptr<const ValidPathInfo> info = fut.get();
+                                if (sub->storeDir != storeDir && !(info->isContentAddressed(*sub) && info->references.empty()))
+                                    answer.status = Answer::Missing;
+                                else {
+                                    answer.status = Answer::Found;
+                                    answer.info = info;
+                                }
+                            } catch (InvalidPath &) {
+                                answer.status = Answer::Missing;
+                            } catch (SubstituterDisabled &) {
+                                answer.status = Answer::Missing;
+                            } catch (...) {
+                                answer.status = Answer::Failed;
+                                answer.exc = std::current_exception();
+                            }
+
+                            auto state(state_->lock());
+                            if (answer.status == Answer::Failed && settings.tryFallback && !state->errorShown[i]) {
+                                state->errorShown[i] = true;
+                                try {
+                                    std::rethrow_exception(answer.exc);
+                                } catch (Error & e) {
+                                    logError(e.info());
+                                } catch (...) {
+                                }
+                            }
+                            auto & lookup = state->lookups[n];
+                            lookup.answers[i] = std::move(answer);
+                            decide(*state, lookup);
+                            if (!state->undecided) wakeup->notify_all();
+                        }});
                 });
-            } catch (InvalidPath &) {
-            } catch (SubstituterDisabled &) {
-            } catch (Error & e) {
-                if (settings.tryFallback)
-                    logError(e.info());
-                else
-                    throw;
             }
-        }
     }
+
+    pool.process();
+
+    auto state(state_->lock());
+    while (state->undecided)
+        state.wait(*wakeup);
+
+    if (state->exc) std::rethrow_exception(state->exc);
+
+    for (auto & lookup : state->lookups)
+        for (auto & answer : lookup.answers)
+            if (answer.status == Answer::Found) {
+                auto narInfo = std::dynamic_pointer_cast<const NarInfo>(answer.info);
+                infos.insert_or_assign(lookup.path, SubstitutablePathInfo{
+                    .deriver = answer.info->deriver,
+                    .references = answer.info->references,
+                    .downloadSize = narInfo ? narInfo->fileSize : 0,
+                    .narSize = answer.info->narSize,
+                });
+                break;
+            }
 }
 
+void Store::querySubstitutablePathInfos(const StorePathCAMap & paths, SubstitutablePathInfos & infos)
+{
+    if (!settings.useSubstitutes) return;
+
+    auto subs = getDefaultSubstituters();
+    size_t width = std::max(settings.substituterRaceWidth.get(), 1U);
+
+    /* Query the substituters in groups of `substituter-race-width`,
+       in order of priority. */
+    for (auto i = subs.begin(); i != subs.end(); ) {
+        std::vector<ref<Store>> group;
+        while (i != subs.end() && group.size() < width)
+            group.push_back(*i++);
+        querySubstitutersInParallel(*this, group, paths, infos);
+    }
+}
 
 bool Store::isValidPath(const StorePath & storePath)
 {
     {
-        auto state_(state.lock());
-        auto res = state_->pathInfoCache.get(std::string(storePath.to_string()));
+        auto res = pathInfoCache.get(std::string(storePath.to_string()));
         if (res && res->isKnownNow()) {
             stats.narInfoReadAverted++;
             return res->didExist();
@@ -630,8 +824,7 @@ bool Store::isValidPath(const StorePath & storePath)
         auto res = diskCache->lookupNarInfo(getUri(), std::string(storePath.hashPart()));
         if (res.first != NarInfoDiskCache::oUnknown) {
             stats.narInfoReadAverted++;
-            auto state_(state.lock());
-            state_->pathInfoCache.upsert(std::string(storePath.to_string()),
+            pathInfoCache.upsert(std::string(storePath.to_string()),
                 res.first == NarInfoDiskCache::oInvalid ? PathInfoCacheValue{} : PathInfoCacheValue { .value = res.second });
             return res.first == NarInfoDiskCache::oValid;
         }
@@ -692,7 +885,7 @@ void Store::queryPathInfo(const StorePath & storePath,
 
     try {
         {
-            auto res = state.lock()->pathInfoCache.get(std::string(storePath.to_string()));
+            auto res = pathInfoCache.get(std::string(storePath.to_string()));
             if (res && res->isKnownNow()) {
                 stats.narInfoReadAverted++;
                 if (!res->didExist())
@@ -706,8 +899,7 @@ void Store::queryPathInfo(const StorePath & storePath,
             if (res.first != NarInfoDiskCache::oUnknown) {
                 stats.narInfoReadAverted++;
                 {
-                    auto state_(state.lock());
-                    state_->pathInfoCache.upsert(std::string(storePath.to_string()),
+                    pathInfoCache.upsert(std::string(storePath.to_string()),
                         res.first == NarInfoDiskCache::oInvalid ? PathInfoCacheValue{} : PathInfoCacheValue{ .value = res.second });
                     if (res.first == NarInfoDiskCache::oInvalid ||
                         !goodStorePath(storePath, res.second->path))
@@ -721,8 +913,16 @@ void Store::queryPathInfo(const StorePath & storePath,
 
     auto callbackPtr = std::make_shared<decltype(callback)>(std::move(callback));
 
+    auto startTime = std::chrono::steady_clock::now();
+
     queryPathInfoUncached(storePath,
-        {[this, storePath, hashPart, callbackPtr](std::future<std::shared_ptr<const ValidPathInfo>> fut) {
+        {[this, storePath, hashPart, callbackPtr, startTime](std::future<std::shared_ptr<const ValidPathInfo>> fut) {
+
+            if (tracingEnabled) {
+                static std::atomic<uint64_t> nextId{0};
+                traceAsync("store", fmt("queryPathInfo %s", storePath.to_string()),
+                    nextId++, startTime, std::chrono::steady_clock::now());
+            }
 
             try {
                 auto info = fut.get();
@@ -730,10 +930,7 @@ void Store::queryPathInfo(const StorePath & storePath,
                 if (diskCache)
                     diskCache->upsertNarInfo(getUri(), hashPart, info);
 
-                {
-                    auto state_(state.lock());
-                    state_->pathInfoCache.upsert(std::string(storePath.to_string()), PathInfoCacheValue { .value = info });
-                }
+                pathInfoCache.upsert(std::string(storePath.to_string()), PathInfoCacheValue { .value = info });
 
                 if (!info || !goodStorePath(storePath, info->path)) {
                     stats.narInfoMissing++;
@@ -745,6 +942,51 @@ void Store::queryPathInfo(const StorePath & storePath,
         }});
 }
 
+std::map<StorePath, ref<const ValidPathInfo>> Store::queryPathInfos(const StorePathSet & paths)
+{
+    struct State
+    {
+        size_t left;
+        std::map<StorePath, ref<const ValidPathInfo>> infos;
+        std::exception_ptr exc;
+    };
+
+    Sync<State> state_(State{paths.size(), {}});
+
+    std::condition_variable wakeup;
+    ThreadPool pool;
+
+    auto doQuery = [&](const StorePath & path) {
+        checkInterrupt();
+        queryPathInfo(path, {[path, &state_, &wakeup](std::future<ref<const ValidPathInfo>> fut) {
+            auto state(state_.lock());
+            try {
+                state->infos.insert_or_assign(path, fut.get());
+            } catch (InvalidPath &) {
+            } catch (...) {
+                state->exc = std::current_exception();
+            }
+            assert(state->left);
+            if (!--state->left)
+                wakeup.notify_one();
+        }});
+    };
+
+    for (auto & path : paths)
+        pool.enqueue(std::bind(doQuery, path));
+
+    pool.process();
+
+    while (true) {
+        auto state(state_.lock());
+        if (!state->left) {
+            if (state->exc) std::rethrow_exception(state->exc);
+            return std::move(state->infos);
+        }
+        state.wait(wakeup);
+    }
+}
+
 void Store::queryRealisation(const DrvOutput & id,
         Callback<std::shared_ptr<const Realisation>> callback) noexcept
 {
@@ -814,6 +1056,51 @@ std::shared_ptr<const Realisation> Store::queryRealisation(const DrvOutput & id)
     return promise.get_future().get();
 }
 
+std::map<DrvOutput, ref<const Realisation>> Store::queryRealisations(const std::set<DrvOutput> & ids)
+{
+    struct State
+    {
+        size_t left;
+        std::map<DrvOutput, ref<const Realisation>> realisations;
+        std::exception_ptr exc;
+    };
+
+    Sync<State> state_(State{ids.size(), {}});
+
+    std::condition_variable wakeup;
+    ThreadPool pool;
+
+    auto doQuery = [&](const DrvOutput & id) {
+        checkInterrupt();
+        queryRealisation(id, {[id, &state_, &wakeup](std::future<std::shared_ptr<const Realisation>> fut) {
+            auto state(state_.lock());
+            try {
+                if (auto realisation = fut.get())
+                    state->realisations.insert_or_assign(id, ref<const Realisation>(realisation));
+            } catch (...) {
+                state->exc = std::current_exception();
+            }
+            assert(state->left);
+            if (!--state->left)
+                wakeup.notify_one();
+        }});
+    };
+
+    for (auto & id : ids)
+        pool.enqueue(std::bind(doQuery, id));
+
+    pool.process();
+
+    while (true) {
+        auto state(state_.lock());
+        if (!state->left) {
+            if (state->exc) std::rethrow_exception(state->exc);
+            return std::move(state->realisations);
+        }
+        state.wait(wakeup);
+    }
+}
+
 void Store::substitutePaths(const StorePathSet & paths)
 {
     std::vector<DerivedPath> paths2;
@@ -956,6 +1243,10 @@ json Store::pathInfoToJSON(const StorePathSet & storePaths,
 {
     json::array_t jsonList = json::array();
 
+    std::map<StorePath, std::pair<uint64_t, uint64_t>> allClosureSizes;
+    if (showClosureSize)
+        allClosureSizes = getClosureSizes(queryValidPaths(storePaths));
+
     for (auto & storePath : storePaths) {
         auto& jsonPath = jsonList.emplace_back(json::object());
 
@@ -979,7 +1270,7 @@ json Store::pathInfoToJSON(const StorePathSet & storePaths,
             std::pair<uint64_t, uint64_t> closureSizes;
 
             if (showClosureSize) {
-                closureSizes = getClosureSize(info->path);
+                closureSizes = allClosureSizes.at(info->path);
                 jsonPath["closureSize"] = closureSizes.first;
             }
 
@@ -1025,27 +1316,106 @@ json Store::pathInfoToJSON(const StorePathSet & storePaths,
 
 std::pair<uint64_t, uint64_t> Store::getClosureSize(const StorePath & storePath)
 {
-    uint64_t totalNarSize = 0, totalDownloadSize = 0;
+    return getClosureSizes({storePath}).at(storePath);
+}
+
+
+std::map<StorePath, std::pair<uint64_t, uint64_t>> Store::getClosureSizes(const StorePathSet & storePaths)
+{
+    /* Fetch the infos of the combined closure a level at a time, so
+       that each level is queried in one batch. */
+    std::map<StorePath, ref<const ValidPathInfo>> infos;
+    StorePathSet todo = storePaths;
+
+    while (!todo.empty()) {
+        checkInterrupt();
+
+        auto levelInfos = queryPathInfos(todo);
+
+        StorePathSet next;
+        for (auto & path : todo) {
+            auto i = levelInfos.find(path);
+            if (i == levelInfos.end())
+                throw InvalidPath("path '%s' is not valid", printStorePath(path));
+            for (auto & ref : i->second->references)
+                if (!infos.count(ref) && !todo.count(ref))
+                    next.insert(ref);
+            infos.insert_or_assign(path, i->second);
+        }
+
+        todo = std::move(next);
+    }
+
     StorePathSet closure;
-    computeFSClosure(storePath, closure, false, false);
-    for (auto & p : closure) {
-        auto info = queryPathInfo(p);
-        totalNarSize += info->narSize;
+    for (auto & [path, _] : infos)
+        closure.insert(path);
+
+    auto sorted = topoSort<StorePath>(closure,
+        {[&](const StorePath & path) {
+            return infos.at(path)->references;
+        }},
+        {[&](const StorePath & path, const StorePath & parent) {
+            return BuildError(
+                "cycle detected in the references of '%s' from '%s'",
+                printStorePath(path),
+                printStorePath(parent));
+        }});
+
+    /* Compute the closure of every path as a bitset over the
+       topological order, going from the leaves up, so that each path
+       just merges the closures of its references. */
+    auto n = sorted.size();
+    auto words = (n + 63) / 64;
+
+    std::map<StorePath, size_t> index;
+    for (size_t i = 0; i < n; ++i)
+        index.emplace(sorted[i], i);
+
+    std::vector<std::vector<uint64_t>> closures(n);
+    std::vector<uint64_t> narSizes(n), downloadSizes(n);
+
+    for (size_t i = n; i-- > 0; ) {
+        auto & info = infos.at(sorted[i]);
+        narSizes[i] = info->narSize;
         auto narInfo = std::dynamic_pointer_cast<const NarInfo>(
             std::shared_ptr<const ValidPathInfo>(info));
         if (narInfo)
-            totalDownloadSize += narInfo->fileSize;
+            downloadSizes[i] = narInfo->fileSize;
+
+        auto & bits = closures[i];
+        bits.resize(words, 0);
+        bits[i / 64] |= (uint64_t) 1 << (i % 64);
+        for (auto & ref : info->references) {
+            if (ref == sorted[i]) continue;
+            auto & refBits = closures[index.at(ref)];
+            for (size_t w = 0; w < words; ++w)
+                bits[w] |= refBits[w];
+        }
     }
-    return {totalNarSize, totalDownloadSize};
-}
 
+    std::map<StorePath, std::pair<uint64_t, uint64_t>> res;
+
+    for (auto & path : storePaths) {
+        uint64_t totalNarSize = 0, totalDownloadSize = 0;
+        auto & bits = closures[index.at(path)];
+        for (size_t w = 0; w < words; ++w)
+            for (auto word = bits[w]; word; word &= word - 1) {
+                auto i = w * 64 + __builtin_ctzll(word);
+                totalNarSize += narSizes[i];
+                totalDownloadSize += downloadSizes[i];
+            }
+        res.insert_or_assign(path, std::make_pair(totalNarSize, totalDownloadSize));
+    }
+
+    return res;
+}
 
 const Store::Stats & Store::getStats()
 {
-    {
-        auto state_(state.lock());
-        stats.pathInfoCacheSize = state_->pathInfoCache.size();
-    }
+    stats.pathInfoCacheSize = pathInfoCache.size();
+    stats.pathInfoCacheHits = pathInfoCache.getHits();
+    stats.pathInfoCacheMisses = pathInfoCache.getMisses();
+    stats.pathInfoCacheEvictions = pathInfoCache.getEvictions();
     return stats;
 }
 
@@ -1099,16 +1469,24 @@ void copyStorePath(
         info = info2;
     }
 
-    auto source = sinkToSource([&](Sink & sink) {
+    auto fetchNar = [&](Sink & sink) {
         LambdaSink progressSink([&](std::string_view data) {
             total += data.size();
             act.progress(total, info->narSize);
         });
         TeeSink tee { sink, progressSink };
-        srcStore.narFromPath(storePath, tee);
-    }, [&]() {
-           throw EndOfFile("NAR for '%s' fetched from '%s' is incomplete", srcStore.printStorePath(storePath), srcStore.getUri());
-    });
+        srcStore.narFromPathDelta(storePath, tee, dstStore);
+    };
+
+    auto eof = [&]() {
+        throw EndOfFile("NAR for '%s' fetched from '%s' is incomplete", srcStore.printStorePath(storePath), srcStore.getUri());
+    };
+
+    /* For large NARs, fetch (and decompress) the NAR on a separate
+       thread, so that it can happen at the same time as unpacking
+       it. */
+    auto source = sinkToSource(fetchNar, eof,
+        info->narSize >= 1024 * 1024 ? SinkToSourceMode::Thread : SinkToSourceMode::Coroutine);
 
     dstStore.addToStore(*info, *source, repair, checkSigs);
 }
@@ -1184,6 +1562,10 @@ std::map<StorePath, StorePath> copyPaths(
 
     Activity act(*logger, lvlInfo, actCopyPaths, fmt("copying %d paths", missing.size()));
 
+    /* Look up the infos of all paths at once, rather than one round
+       trip per path when the source is a remote store. */
+    auto infos = srcStore.queryPathInfos(missing);
+
     // In the general case, `addMultipleToStore` requires a sorted list of
     // store paths to add, so sort them right now
     auto sortedMissing = srcStore.topoSortPaths(missing);
@@ -1213,19 +1595,49 @@ std::map<StorePath, StorePath> copyPaths(
         return storePathForDst;
     };
 
-    // total is accessed by each copy, which are each handled in separate threads
-    std::atomic<uint64_t> total = 0;
-
-    for (auto & missingPath : sortedMissing) {
-        auto info = srcStore.queryPathInfo(missingPath);
+    auto makeInfoForDst = [&](const StorePath & missingPath) {
+        auto i = infos.find(missingPath);
+        auto info = i != infos.end() ? i->second : srcStore.queryPathInfo(missingPath);
 
         auto storePathForDst = computeStorePathForDst(*info);
         pathsMap.insert_or_assign(missingPath, storePathForDst);
 
         ValidPathInfo infoForDst = *info;
         infoForDst.path = storePathForDst;
+        return infoForDst;
+    };
+
+    /* If the source store can stream all NARs at once, add them in
+       the order in which they arrive. */
+    size_t nrDone = 0;
+    if (srcStore.narsFromPaths(sortedMissing, [&](const StorePath & missingPath, Source & nar) {
+        auto info = makeInfoForDst(missingPath);
+        info.ultimate = false;
 
-        auto source = sinkToSource([&](Sink & sink) {
+        auto srcUri = srcStore.getUri();
+        auto dstUri = dstStore.getUri();
+        auto storePathS = srcStore.printStorePath(missingPath);
+        Activity act2(*logger, lvlInfo, actCopyPath,
+            makeCopyPathMessage(srcUri, dstUri, storePathS),
+            {storePathS, srcUri, dstUri});
+        PushActivity pact(act2.id);
+
+        uint64_t copied = 0;
+        LambdaSink progressSink([&](std::string_view data) {
+            copied += data.size();
+            act2.progress(copied, info.narSize);
+        });
+        TeeSource tee { nar, progressSink };
+
+        dstStore.addToStore(info, tee, repair, checkSigs);
+        act.progress(++nrDone, sortedMissing.size());
+    }))
+        return pathsMap;
+
+    for (auto & missingPath : sortedMissing) {
+        auto infoForDst = makeInfoForDst(missingPath);
+
+        auto source = sinkToSource([&, narSize{infoForDst.narSize}](Sink & sink) {
             // We can reasonably assume that the copy will happen whenever we
             // read the path, so log something about that at that point
             auto srcUri = srcStore.getUri();
@@ -1236,13 +1648,14 @@ std::map<StorePath, StorePath> copyPaths(
                 {storePathS, srcUri, dstUri});
             PushActivity pact(act.id);
 
+            uint64_t copied = 0;
             LambdaSink progressSink([&](std::string_view data) {
-                total += data.size();
-                act.progress(total, info->narSize);
+                copied += data.size();
+                act.progress(copied, narSize);
             });
             TeeSink tee { sink, progressSink };
 
-            srcStore.narFromPath(missingPath, tee);
+            srcStore.narFromPathDelta(missingPath, tee, dstStore);
         });
         pathsToCopy.push_back(std::pair{infoForDst, std::move(source)});
     }
@@ -1495,6 +1908,7 @@ static std::string extractConnStr(const std::string &proto, const std::string &c
 ref<Store> openStore(const std::string & uri_,
     const Store::Params & extraParams)
 {
+    StartupPhase phase(fmt("open store '%s'", uri_));
     auto params = extraParams;
     try {
         auto parsedUri = parseURL(uri_);
@@ -1556,7 +1970,34 @@ std::list<ref<Store>> getDefaultSubstituters()
         return stores;
     } ());
 
-    return stores;
+    if (!settings.adaptiveSubstituterOrder || stores.size() < 2)
+        return stores;
+
+    /* Estimate how long each substituter takes to look up a path and
+       download a typical NAR, and try the fastest ones first. */
+    std::map<std::string, double> cost;
+    for (auto & store : stores) {
+        auto uri = store->getUri();
+        try {
+            if (auto perf = getNarInfoDiskCache()->lookupPerformance(uri)) {
+                double typicalNarSize = 4 * 1024 * 1024;
+                cost[uri] =
+                    perf->latency / (1.0 - std::min(perf->errorRate, 0.99))
+                    + (perf->throughput ? typicalNarSize * 1000 / perf->throughput : 0);
+            }
+        } catch (Error & e) {
+            debug("cannot get the performance of substituter '%s': %s", uri, e.msg());
+        }
+    }
+
+    auto sorted(stores);
+    sorted.sort([&](ref<Store> & a, ref<Store> & b) {
+        if (a->priority != b->priority)
+            return a->priority < b->priority;
+        return cost[a->getUri()] < cost[b->getUri()];
+    });
+
+    return sorted;
 }
 
 std::vector<StoreFactory> * Implementations::registered = 0;
@@ -8,7 +8,7 @@
 #include "hash.hh"
 #include "content-address.hh"
 #include "serialise.hh"
-#include "lru-cache.hh"
+#include "sharded-cache.hh"
 #include "sync.hh"
 #include "globals.hh"
 #include "config.hh"
@@ -87,6 +87,11 @@ enum AllowInvalidFlag : bool { DisallowInvalid = false, AllowInvalid = true };
  */
 const uint32_t exportMagic = 0x4558494e;
 
+/**
+ * Magic number at the start of exportArchive() output.
+ */
+const uint64_t exportArchiveMagic = 0x6576696863726158;
+
 
 enum BuildMode { bmNormal, bmRepair, bmCheck };
 enum TrustedFlag : bool { NotTrusted = false, Trusted = true };
@@ -202,12 +207,7 @@ protected:
         }
     };
 
-    struct State
-    {
-        LRUCache<std::string, PathInfoCacheValue> pathInfoCache;
-    };
-
-    Sync<State> state;
+    ShardedCache<std::string, PathInfoCacheValue> pathInfoCache;
 
     std::shared_ptr<NarInfoDiskCache> diskCache;
 
@@ -373,6 +373,14 @@ public:
     void queryPathInfo(const StorePath & path,
         Callback<ref<const ValidPathInfo>> callback) noexcept;
 
+    /**
+     * Query information about a set of paths. Paths that are not
+     * valid are omitted from the result. The default implementation
+     * queries the paths in parallel using queryPathInfo(); stores
+     * that can look up many paths at once more cheaply override it.
+     */
+    virtual std::map<StorePath, ref<const ValidPathInfo>> queryPathInfos(const StorePathSet & paths);
+
     /**
      * Query the information about a realisation.
      */
@@ -384,6 +392,14 @@ public:
     void queryRealisation(const DrvOutput &,
         Callback<std::shared_ptr<const Realisation>> callback) noexcept;
 
+    /**
+     * Query the realisations of a set of derivation outputs. Outputs
+     * that have no realisation are omitted from the result. The
+     * default implementation queries them in parallel using
+     * queryRealisation(); stores that can look up many realisations
+     * at once more cheaply override it.
+     */
+    virtual std::map<DrvOutput, ref<const Realisation>> queryRealisations(const std::set<DrvOutput> & ids);
 
     /**
      * Check whether the given valid path info is sufficiently attested, by
@@ -469,6 +485,14 @@ public:
      */
     virtual std::optional<StorePath> queryPathFromHashPart(const std::string & hashPart) = 0;
 
+    /**
+     * Like `queryPathFromHashPart()`, but `prefix` may be a prefix of
+     * a hash part. If several valid paths match, the first one in
+     * lexicographic order is returned.
+     */
+    virtual std::optional<StorePath> queryPathFromHashPrefix(std::string_view prefix)
+    { unsupported("queryPathFromHashPrefix"); }
+
     /**
      * Query which of the given paths have substitutes.
      */
@@ -579,6 +603,25 @@ public:
      */
     virtual void narFromPath(const StorePath & path, Sink & sink) = 0;
 
+    /**
+     * Like narFromPath(), but the store may reconstruct the NAR from
+     * the NAR of a path that is valid in `localStore` (such as a
+     * previous version of `path`) instead of transferring all of it.
+     */
+    virtual void narFromPathDelta(const StorePath & path, Sink & sink, Store & localStore)
+    { narFromPath(path, sink); }
+
+    /**
+     * Call `fun` with the NAR of each of `paths`, in that order, if
+     * the store can stream them all at once rather than with a round
+     * trip per path.
+     *
+     * @return Whether it could. If not, `fun` has not been called.
+     */
+    virtual bool narsFromPaths(const StorePaths & paths,
+        std::function<void(const StorePath & path, Source & nar)> fun)
+    { return false; }
+
     /**
      * For each path, if it's a derivation, build it.  Building a
      * derivation means ensuring that the output paths are valid.  If
@@ -657,6 +700,16 @@ public:
     virtual void addTempRoot(const StorePath & path)
     { debug("not creating temporary root, store doesn't support GC"); }
 
+    /**
+     * Add several temporary roots at once, which some stores can do
+     * more cheaply than adding them one by one.
+     */
+    virtual void addTempRoots(const StorePathSet & paths)
+    {
+        for (auto & path : paths)
+            addTempRoot(path);
+    }
+
     /**
      * @return a string representing information about the path that
      * can be loaded into the database using `nix-store --load-db` or
@@ -687,6 +740,13 @@ public:
      */
     std::pair<uint64_t, uint64_t> getClosureSize(const StorePath & storePath);
 
+    /**
+     * Like getClosureSize(), but for many paths at once. The path
+     * infos of the combined closure are fetched only once, and the
+     * closures are computed in a single pass over it.
+     */
+    std::map<StorePath, std::pair<uint64_t, uint64_t>> getClosureSizes(const StorePathSet & storePaths);
+
     /**
      * Optimise the disk space usage of the Nix store by hard-linking files
      * with the same contents.
@@ -778,9 +838,16 @@ public:
     void exportPath(const StorePath & path, Sink & sink);
 
     /**
-     * Import a sequence of NAR dumps created by exportPaths() into the
-     * Nix store. Optionally, the contents of the NARs are preloaded
-     * into the specified FS accessor to speed up subsequent access.
+     * Export multiple paths in version 2 of the export format. It
+     * starts with an index of the paths and their hashes, followed by
+     * their NARs compressed with `compression`, which lets
+     * importPaths() restore and verify the paths in parallel.
+     */
+    void exportArchive(const StorePathSet & paths, Sink & sink, const std::string & compression = "none");
+
+    /**
+     * Import a sequence of NAR dumps created by exportPaths() or
+     * exportArchive() into the Nix store.
      */
     StorePaths importPaths(Source & source, CheckSigsFlag checkSigs = CheckSigs);
 
@@ -791,6 +858,9 @@ public:
         std::atomic<uint64_t> narInfoMissing{0};
         std::atomic<uint64_t> narInfoWrite{0};
         std::atomic<uint64_t> pathInfoCacheSize{0};
+        std::atomic<uint64_t> pathInfoCacheHits{0};
+        std::atomic<uint64_t> pathInfoCacheMisses{0};
+        std::atomic<uint64_t> pathInfoCacheEvictions{0};
         std::atomic<uint64_t> narRead{0};
         std::atomic<uint64_t> narReadBytes{0};
         std::atomic<uint64_t> narReadCompressedBytes{0};
@@ -822,7 +892,7 @@ public:
      */
     void clearPathInfoCache()
     {
-        state.lock()->pathInfoCache.clear();
+        pathInfoCache.clear();
     }
 
     /**
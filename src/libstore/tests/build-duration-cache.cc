@@ -0,0 +1,57 @@
+#include "build-duration-cache.hh"
+#include "util.hh"
+
+#include <gtest/gtest.h>
+
+namespace nix {
+
+TEST(BuildDurationCache, recordAndLookup) {
+    Path tmpDir = createTempDir();
+    AutoDelete delTmpDir(tmpDir);
+    Path dbPath(tmpDir + "/test-build-stats.sqlite");
+
+    {
+        auto cache = getTestBuildDurationCache(dbPath);
+
+        ASSERT_FALSE(cache->lookup("hello-2.12", "x86_64-linux"));
+
+        cache->record("hello-2.12", "x86_64-linux", {.duration = 100});
+        ASSERT_EQ(cache->lookup("hello-2.12", "x86_64-linux")->duration, 100);
+
+        // The estimate applies to other versions, but not to other systems.
+        ASSERT_EQ(cache->lookup("hello-2.13", "x86_64-linux")->duration, 100);
+        ASSERT_FALSE(cache->lookup("hello-2.12", "aarch64-linux"));
+
+        // New durations are averaged with the estimate.
+        cache->record("hello-2.13", "x86_64-linux", {.duration = 200});
+        ASSERT_EQ(cache->lookup("hello-2.13", "x86_64-linux")->duration, 150);
+    }
+
+    // The estimates are persistent.
+    auto cache = getTestBuildDurationCache(dbPath);
+    ASSERT_EQ(cache->lookup("hello", "x86_64-linux")->duration, 150);
+}
+
+TEST(BuildDurationCache, memoryAndOutputSize) {
+    Path tmpDir = createTempDir();
+    AutoDelete delTmpDir(tmpDir);
+    auto cache = getTestBuildDurationCache(tmpDir + "/test-build-stats.sqlite");
+
+    cache->record("hello-2.12", "x86_64-linux", {.duration = 100});
+    auto stats = cache->lookup("hello", "x86_64-linux");
+    ASSERT_EQ(stats->peakMemory, std::nullopt);
+    ASSERT_EQ(stats->outputSize, std::nullopt);
+
+    cache->record("hello-2.12", "x86_64-linux", {.duration = 100, .peakMemory = 1000, .outputSize = 4000});
+    stats = cache->lookup("hello", "x86_64-linux");
+    ASSERT_EQ(stats->peakMemory, 1000);
+    ASSERT_EQ(stats->outputSize, 4000);
+
+    // Unknown values don't affect the estimate.
+    cache->record("hello-2.12", "x86_64-linux", {.duration = 100, .peakMemory = 3000});
+    stats = cache->lookup("hello", "x86_64-linux");
+    ASSERT_EQ(stats->peakMemory, 2000);
+    ASSERT_EQ(stats->outputSize, 4000);
+}
+
+}
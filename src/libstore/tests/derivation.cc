@@ -71,6 +71,26 @@ TEST_F(DynDerivationTest, BadATerm_oldVersionDynDeps) {
         FormatError);
 }
 
+TEST_F(DerivationTest, BadATerm_unterminatedString) {
+    ASSERT_THROW(
+        parseDerivation(
+            *store,
+            R"(Derive([],[],[],"x86_64-linux","/bin/sh)",
+            "whatever",
+            mockXpSettings),
+        FormatError);
+}
+
+TEST_F(DerivationTest, ATerm_escapes) {
+    auto drv = parseDerivation(
+        *store,
+        R"(Derive([],[],[],"x86_64-linux","/bin/sh",["a\nb\\c\t",""],[("k","v\"w\r")]))",
+        "whatever",
+        mockXpSettings);
+    ASSERT_EQ(drv.args, (Strings { "a\nb\\c\t", "" }));
+    ASSERT_EQ(drv.env, (StringPairs { { "k", "v\"w\r" } }));
+}
+
 #define TEST_JSON(FIXTURE, NAME, VAL, DRV_NAME, OUTPUT_NAME)              \
     TEST_F(FIXTURE, DerivationOutput_ ## NAME ## _from_json) {            \
         if (testAccept())                                                 \
@@ -0,0 +1,46 @@
+#include "drv-hash-cache.hh"
+
+#include <gtest/gtest.h>
+
+namespace nix {
+
+TEST(DrvHashCacheImpl, create_and_read) {
+    Path tmpDir = createTempDir();
+    AutoDelete delTmpDir(tmpDir);
+    Path dbPath(tmpDir + "/test-drv-hash-cache.sqlite");
+
+    auto h1 = hashString(htSHA256, "foo");
+    auto h2 = hashString(htSHA256, "bar");
+
+    {
+        auto cache = getTestDrvHashCache(dbPath);
+
+        ASSERT_EQ(cache->lookup("/nix/store/g1w7hy3qg1w7hy3qg1w7hy3qg1w7hy3q-x.drv"), std::nullopt);
+
+        cache->upsert("/nix/store/g1w7hy3qg1w7hy3qg1w7hy3qg1w7hy3q-x.drv", DrvHash {
+            .hashes = { { "out", h1 }, { "dev", h2 } },
+            .kind = DrvHash::Kind::Regular,
+        });
+        cache->upsert("/nix/store/g1w7hy3qg1w7hy3qg1w7hy3qg1w7hy3q-y.drv", DrvHash {
+            .hashes = { { "out", h2 } },
+            .kind = DrvHash::Kind::Deferred,
+        });
+    }
+
+    {
+        // Check that the entries survive reopening the database.
+        auto cache = getTestDrvHashCache(dbPath);
+
+        auto x = cache->lookup("/nix/store/g1w7hy3qg1w7hy3qg1w7hy3qg1w7hy3q-x.drv");
+        ASSERT_TRUE(x);
+        ASSERT_EQ(x->kind, DrvHash::Kind::Regular);
+        ASSERT_EQ(x->hashes, (std::map<std::string, Hash> { { "out", h1 }, { "dev", h2 } }));
+
+        auto y = cache->lookup("/nix/store/g1w7hy3qg1w7hy3qg1w7hy3qg1w7hy3q-y.drv");
+        ASSERT_TRUE(y);
+        ASSERT_EQ(y->kind, DrvHash::Kind::Deferred);
+        ASSERT_EQ(y->hashes, (std::map<std::string, Hash> { { "out", h2 } }));
+    }
+}
+
+}
@@ -0,0 +1,22 @@
+#include "file-hash-cache.hh"
+
+#include <gtest/gtest.h>
+
+namespace nix {
+
+TEST(hashPathCached, follows_changes) {
+    Path tmpDir = createTempDir();
+    AutoDelete delTmpDir(tmpDir);
+    Path file(tmpDir + "/file");
+
+    writeFile(file, "foo");
+    ASSERT_EQ(hashPathCached(file, FileIngestionMethod::Flat, htSHA256), hashString(htSHA256, "foo"));
+
+    writeFile(file, "bar");
+    ASSERT_EQ(hashPathCached(file, FileIngestionMethod::Flat, htSHA256), hashString(htSHA256, "bar"));
+    ASSERT_EQ(hashPathCached(file, FileIngestionMethod::Flat, htSHA1), hashString(htSHA1, "bar"));
+
+    ASSERT_EQ(hashPathCached(tmpDir, FileIngestionMethod::Recursive, htSHA256), hashPath(htSHA256, tmpDir).first);
+}
+
+}
@@ -120,4 +120,89 @@ TEST(NarInfoDiskCacheImpl, create_and_read) {
     }
 }
 
+TEST(NarInfoDiskCacheImpl, write_behind) {
+    Path tmpDir = createTempDir();
+    AutoDelete delTmpDir(tmpDir);
+    Path dbPath(tmpDir + "/test-narinfo-disk-cache.sqlite");
+
+    std::string hashPart = "c015dhfh5l0lp6wxyvdn7bmwhbbr6hr9";
+    std::string missingHashPart = "g1w7hy3qg1w7hy3qg1w7hy3qg1w7hy3q";
+
+    {
+        auto cache = getTestNarInfoDiskCache(dbPath);
+        cache->createCache("http://foo", "/nix/storedir", true, 10);
+
+        auto info = std::make_shared<NarInfo>(StorePath(hashPart + "-foo"), Hash::dummy);
+        info->url = "nar/foo.nar.xz";
+        info->narSize = 123;
+        info->deltaBase = StorePath(missingHashPart + "-foo");
+        info->deltaBaseNarHash = Hash::dummy;
+        info->deltaUrl = "delta/foo.ndelta.xz";
+        info->deltaCompression = "xz";
+        info->deltaSize = 12;
+        cache->upsertNarInfo("http://foo", hashPart, info);
+        cache->upsertNarInfo("http://foo", missingHashPart, nullptr);
+
+        // Pending writes are visible immediately.
+        auto [outcome, narInfo] = cache->lookupNarInfo("http://foo", hashPart);
+        ASSERT_EQ(outcome, NarInfoDiskCache::oValid);
+        ASSERT_EQ(narInfo->url, "nar/foo.nar.xz");
+        ASSERT_EQ(cache->lookupNarInfo("http://foo", missingHashPart).first, NarInfoDiskCache::oInvalid);
+    }
+
+    {
+        // Destroying the cache object has flushed the writes.
+        auto cache2 = getTestNarInfoDiskCache(dbPath);
+        cache2->createCache("http://foo", "/nix/storedir", true, 10);
+
+        auto [outcome, narInfo] = cache2->lookupNarInfo("http://foo", hashPart);
+        ASSERT_EQ(outcome, NarInfoDiskCache::oValid);
+        ASSERT_EQ(narInfo->url, "nar/foo.nar.xz");
+        ASSERT_EQ(narInfo->narSize, 123);
+        ASSERT_EQ(narInfo->deltaBase, StorePath(missingHashPart + "-foo"));
+        ASSERT_EQ(narInfo->deltaUrl, "delta/foo.ndelta.xz");
+        ASSERT_EQ(narInfo->deltaCompression, "xz");
+        ASSERT_EQ(narInfo->deltaSize, 12);
+        ASSERT_EQ(cache2->lookupNarInfo("http://foo", missingHashPart).first, NarInfoDiskCache::oInvalid);
+    }
+}
+
+TEST(NarInfoDiskCacheImpl, performance) {
+    Path tmpDir = createTempDir();
+    AutoDelete delTmpDir(tmpDir);
+    Path dbPath(tmpDir + "/test-narinfo-disk-cache.sqlite");
+
+    {
+        auto cache = getTestNarInfoDiskCache(dbPath);
+        ASSERT_FALSE(cache->lookupPerformance("http://foo"));
+
+        cache->recordRequest("http://foo", std::chrono::milliseconds(100), false);
+        cache->recordDownload("http://foo", 10 * 1024 * 1024, std::chrono::milliseconds(1000));
+
+        auto perf = cache->lookupPerformance("http://foo");
+        ASSERT_TRUE(perf);
+        ASSERT_EQ(perf->latency, 100);
+        ASSERT_EQ(perf->errorRate, 0);
+        ASSERT_EQ(perf->throughput, 10 * 1024 * 1024);
+
+        // Later samples move the averages towards them.
+        cache->recordRequest("http://foo", std::chrono::milliseconds(200), false);
+        cache->recordRequest("http://foo", {}, true);
+        perf = cache->lookupPerformance("http://foo");
+        ASSERT_GT(perf->latency, 100);
+        ASSERT_LT(perf->latency, 200);
+        ASSERT_GT(perf->errorRate, 0);
+    }
+
+    {
+        // The averages are kept in the database.
+        auto cache2 = getTestNarInfoDiskCache(dbPath);
+        auto perf = cache2->lookupPerformance("http://foo");
+        ASSERT_TRUE(perf);
+        ASSERT_GT(perf->latency, 100);
+        ASSERT_GT(perf->errorRate, 0);
+        ASSERT_EQ(perf->throughput, 10 * 1024 * 1024);
+    }
+}
+
 }
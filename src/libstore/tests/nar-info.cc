@@ -0,0 +1,58 @@
+#include <gtest/gtest.h>
+
+#include "nar-info.hh"
+
+#include "tests/libstore.hh"
+
+namespace nix {
+
+class NarInfoTest : public LibStoreTest
+{
+};
+
+static const std::string narInfoText =
+    "StorePath: /nix/store/7h7qgvchvmsvbxrzwvfbl549xidplw1y-hello-2.12.1\n"
+    "URL: nar/1b1a5vpar6a8k0bn1ss1i9sqbdvac0kcpi5ak2ynpcnfpx5qw8b1.nar.xz\n"
+    "Compression: xz\n"
+    "FileHash: sha256:1b1a5vpar6a8k0bn1ss1i9sqbdvac0kcpi5ak2ynpcnfpx5qw8b1\n"
+    "FileSize: 50088\n"
+    "NarHash: sha256:0yzhigwjl6bws649vcs2asa4lbs8hg93hyix187gc7s7a74w5h80\n"
+    "NarSize: 226488\n"
+    "References: 7h7qgvchvmsvbxrzwvfbl549xidplw1y-hello-2.12.1 ld63rvkrjyxa2rl4k9gnq9g4hs0p8xgc-glibc-2.37-8\n"
+    "Deriver: vdgks8y7n4v4d6hjqc8kzv4rcqwd4iyd-hello-2.12.1.drv\n"
+    "Sig: cache.nixos.org-1:SdvcEZl6ED+6gGRQ1mO3fIq0XgwxpMP3qRlQ8lH0uSxhvfcHQ6gFhCx8j5ij2Pn/rb3sBHrhKn2zAw1LuAhgAQ==\n";
+
+TEST_F(NarInfoTest, parse) {
+    NarInfo info(*store, narInfoText, "test");
+    ASSERT_EQ(info.path.to_string(), "7h7qgvchvmsvbxrzwvfbl549xidplw1y-hello-2.12.1");
+    ASSERT_EQ(info.url, "nar/1b1a5vpar6a8k0bn1ss1i9sqbdvac0kcpi5ak2ynpcnfpx5qw8b1.nar.xz");
+    ASSERT_EQ(info.compression, "xz");
+    ASSERT_EQ(info.fileSize, 50088);
+    ASSERT_EQ(info.narSize, 226488);
+    ASSERT_EQ(info.references.size(), 2);
+    ASSERT_TRUE(info.references.count(StorePath("ld63rvkrjyxa2rl4k9gnq9g4hs0p8xgc-glibc-2.37-8")));
+    ASSERT_EQ(info.deriver, StorePath("vdgks8y7n4v4d6hjqc8kzv4rcqwd4iyd-hello-2.12.1.drv"));
+    ASSERT_EQ(info.sigs.size(), 1);
+}
+
+TEST_F(NarInfoTest, roundTrip) {
+    NarInfo info(*store, narInfoText, "test");
+    ASSERT_EQ(info.to_string(*store), narInfoText);
+}
+
+TEST_F(NarInfoTest, noReferences) {
+    auto text = narInfoText;
+    auto refs = text.find("References: ");
+    auto eol = text.find('\n', refs);
+    text.replace(refs, eol - refs, "References: ");
+    NarInfo info(*store, text, "test");
+    ASSERT_TRUE(info.references.empty());
+    ASSERT_EQ(info.to_string(*store), text);
+}
+
+TEST_F(NarInfoTest, corrupt) {
+    ASSERT_THROW(NarInfo(*store, "StorePath: /nix/store/7h7qgvchvmsvbxrzwvfbl549xidplw1y-hello\n", "test"), Error);
+    ASSERT_THROW(NarInfo(*store, "StorePath /nix/store/7h7qgvchvmsvbxrzwvfbl549xidplw1y-hello", "test"), Error);
+}
+
+}
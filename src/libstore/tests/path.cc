@@ -66,6 +66,19 @@ TEST_DO_PARSE(equals_sign, "foo=foo")
 
 #undef TEST_DO_PARSE
 
+TEST_F(StorePathTest, interned) {
+    std::string baseName = HASH_PART "-foo";
+    StorePath p1(baseName);
+    baseName.back() = 'x';
+    StorePath p2(HASH_PART "-foo");
+    ASSERT_EQ(p1, p2);
+    ASSERT_EQ(p1.to_string(), HASH_PART "-foo");
+    ASSERT_EQ(p1.to_string().data(), p2.to_string().data());
+    ASSERT_NE(p1, StorePath(baseName));
+    ASSERT_FALSE(p1 < p2);
+    ASSERT_TRUE(p1 < StorePath(baseName));
+}
+
 // For rapidcheck
 void showValue(const StorePath & p, std::ostream & os) {
     os << p.to_string();
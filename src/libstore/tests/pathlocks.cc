@@ -0,0 +1,67 @@
+#include "pathlocks.hh"
+
+#include <gtest/gtest.h>
+
+#include <thread>
+
+namespace nix {
+
+TEST(PathLocks, excludesOtherThreads) {
+    Path tmpDir = createTempDir();
+    AutoDelete delTmpDir(tmpDir);
+    Path path = tmpDir + "/foo";
+
+    PathLocks lock({path});
+
+    std::thread([&]() {
+        PathLocks lock2;
+        ASSERT_FALSE(lock2.lockPaths({path}, "", false));
+    }).join();
+
+    lock.unlock();
+
+    std::thread([&]() {
+        PathLocks lock2;
+        ASSERT_TRUE(lock2.lockPaths({path}, "", false));
+    }).join();
+}
+
+TEST(PathLocks, waitsForOtherThread) {
+    Path tmpDir = createTempDir();
+    AutoDelete delTmpDir(tmpDir);
+    Path path = tmpDir + "/foo";
+
+    auto lock = std::make_unique<PathLocks>(PathSet {path});
+    lock->setDeletion(true);
+
+    std::atomic<bool> acquired{false};
+    std::thread waiter([&]() {
+        PathLocks lock2({path});
+        acquired = true;
+    });
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    ASSERT_FALSE(acquired);
+
+    lock.reset();
+    waiter.join();
+    ASSERT_TRUE(acquired);
+}
+
+TEST(PathLocks, releasesOnFailure) {
+    Path tmpDir = createTempDir();
+    AutoDelete delTmpDir(tmpDir);
+    Path a = tmpDir + "/a", b = tmpDir + "/b";
+
+    PathLocks lockB({b});
+
+    std::thread([&]() {
+        PathLocks lock2;
+        ASSERT_FALSE(lock2.lockPaths({a, b}, "", false));
+        /* The lock on `a` must have been released. */
+        PathLocks lock3;
+        ASSERT_TRUE(lock3.lockPaths({a}, "", false));
+    }).join();
+}
+
+}
@@ -40,6 +40,22 @@ TEST(references, scan)
             scanner(std::string(1, i));
         ASSERT_EQ(scanner.getResult(), StringSet({hash1, hash2}));
     }
+
+    {
+        /* References embedded in long runs of base-32 characters. */
+        RefScanSink scanner(StringSet{hash1, hash2});
+        auto s = std::string(100, 'a') + hash1 + std::string(7, '0') + hash2 + "zzz";
+        scanner(s);
+        ASSERT_EQ(scanner.getResult(), StringSet({hash1, hash2}));
+    }
+
+    {
+        /* A run that is one character too short. */
+        RefScanSink scanner(StringSet{hash1});
+        auto s = "-" + hash1.substr(1) + "-";
+        scanner(s);
+        ASSERT_EQ(scanner.getResult(), StringSet{});
+    }
 }
 
 }
@@ -0,0 +1,47 @@
+#include "remote-builder-cache.hh"
+#include "util.hh"
+
+#include <gtest/gtest.h>
+
+namespace nix {
+
+TEST(RemoteBuilderCache, validPaths) {
+    Path tmpDir = createTempDir();
+    AutoDelete delTmpDir(tmpDir);
+    Path dbPath(tmpDir + "/test-remote-builders.sqlite");
+
+    StorePath foo("g1w7hy3qg1w7hy3qg1w7hy3qg1w7hy3q-foo");
+    StorePath bar("ljx1ypqzrkx2bbjr1bv6ymbqfjqfb5pb-bar");
+
+    {
+        auto cache = getTestRemoteBuilderCache(dbPath);
+
+        ASSERT_EQ(cache->queryValidPaths("ssh://a", {foo, bar}), StorePathSet{});
+
+        cache->addValidPaths("ssh://a", {foo});
+        ASSERT_EQ(cache->queryValidPaths("ssh://a", {foo, bar}), StorePathSet{foo});
+        ASSERT_EQ(cache->queryValidPaths("ssh://b", {foo, bar}), StorePathSet{});
+    }
+
+    // The cache is persistent.
+    auto cache = getTestRemoteBuilderCache(dbPath);
+    ASSERT_EQ(cache->queryValidPaths("ssh://a", {foo, bar}), StorePathSet{foo});
+}
+
+TEST(RemoteBuilderCache, uploadThroughput) {
+    Path tmpDir = createTempDir();
+    AutoDelete delTmpDir(tmpDir);
+    auto cache = getTestRemoteBuilderCache(tmpDir + "/test-remote-builders.sqlite");
+
+    ASSERT_EQ(cache->uploadThroughput("ssh://a"), std::nullopt);
+
+    cache->recordUpload("ssh://a", 1000, 1);
+    ASSERT_EQ(cache->uploadThroughput("ssh://a"), 1000);
+
+    // New samples are averaged with the estimate.
+    cache->recordUpload("ssh://a", 6000, 2);
+    ASSERT_EQ(cache->uploadThroughput("ssh://a"), 2000);
+    ASSERT_EQ(cache->uploadThroughput("ssh://b"), std::nullopt);
+}
+
+}
@@ -99,6 +99,20 @@ void WorkerProto::Serialise<KeyedBuildResult>::write(const Store & store, Worker
 }
 
 
+static std::optional<uint64_t> readOptionalNum(Source & from)
+{
+    if (!readNum<uint64_t>(from)) return std::nullopt;
+    return readNum<uint64_t>(from);
+}
+
+static void writeOptionalNum(Sink & to, std::optional<uint64_t> n)
+{
+    if (n)
+        to << 1 << *n;
+    else
+        to << 0;
+}
+
 BuildResult WorkerProto::Serialise<BuildResult>::read(const Store & store, WorkerProto::ReadConn conn)
 {
     BuildResult res;
@@ -118,6 +132,15 @@ BuildResult WorkerProto::Serialise<BuildResult>::read(const Store & store, Worke
                 std::move(output.outputName),
                 std::move(realisation));
     }
+    if (GET_PROTOCOL_MINOR(conn.version) >= 41) {
+        if (auto n = readOptionalNum(conn.from))
+            res.cpuUser = std::chrono::microseconds(*n);
+        if (auto n = readOptionalNum(conn.from))
+            res.cpuSystem = std::chrono::microseconds(*n);
+        res.peakMemory = readOptionalNum(conn.from);
+        res.bytesRead = readOptionalNum(conn.from);
+        res.bytesWritten = readOptionalNum(conn.from);
+    }
     return res;
 }
 
@@ -139,6 +162,17 @@ void WorkerProto::Serialise<BuildResult>::write(const Store & store, WorkerProto
             builtOutputs.insert_or_assign(realisation.id, realisation);
         WorkerProto::write(store, conn, builtOutputs);
     }
+    if (GET_PROTOCOL_MINOR(conn.version) >= 41) {
+        auto count = [](const std::optional<std::chrono::microseconds> & t) -> std::optional<uint64_t> {
+            if (!t) return std::nullopt;
+            return t->count();
+        };
+        writeOptionalNum(conn.to, count(res.cpuUser));
+        writeOptionalNum(conn.to, count(res.cpuSystem));
+        writeOptionalNum(conn.to, res.peakMemory);
+        writeOptionalNum(conn.to, res.bytesRead);
+        writeOptionalNum(conn.to, res.bytesWritten);
+    }
 }
 
 
@@ -9,7 +9,7 @@ namespace nix {
 #define WORKER_MAGIC_1 0x6e697863
 #define WORKER_MAGIC_2 0x6478696f
 
-#define PROTOCOL_VERSION (1 << 8 | 35)
+#define PROTOCOL_VERSION (1 << 8 | 42)
 #define GET_PROTOCOL_MAJOR(x) ((x) & 0xff00)
 #define GET_PROTOCOL_MINOR(x) ((x) & 0x00ff)
 
@@ -56,6 +56,12 @@ struct WorkerProto
      */
     using Version = unsigned int;
 
+    /**
+     * The number of characters of the hash part of a store path that
+     * `Op::QueryValidPathsByPrefix` sends to identify it.
+     */
+    static constexpr size_t hashPrefixLen = 12;
+
     /**
      * A unidirectional read connection, to be used by the read half of the
      * canonical serializers below.
@@ -161,6 +167,11 @@ enum struct WorkerProto::Op : uint64_t
     AddMultipleToStore = 44,
     AddBuildLog = 45,
     BuildPathsWithResults = 46,
+    QueryPathInfos = 47,
+    Multiplex = 48,
+    QueryValidPathsByPrefix = 49,
+    QueryRealisations = 50,
+    AddTempRoots = 51,
 };
 
 /**
@@ -116,7 +116,12 @@ void SourceAccessor::dumpPath(
 time_t dumpPathAndGetMtime(const Path & path, Sink & sink, PathFilter & filter)
 {
     PosixSourceAccessor accessor;
-    accessor.dumpPath(CanonPath::fromCwd(path), sink, filter);
+    auto root = CanonPath::fromCwd(path);
+    /* Only prefetch if there is no filter, since the filter would
+       have to be called twice for every file. */
+    if (&filter == &defaultPathFilter)
+        accessor.prefetch(root);
+    accessor.dumpPath(root, sink, filter);
     return accessor.mtime;
 }
 
@@ -291,6 +296,7 @@ void restorePath(const Path & path, Source & source)
     RestoreSink sink;
     sink.dstPath = path;
     parseDump(sink, source);
+    sink.finish();
 }
 
 
@@ -0,0 +1,56 @@
+#include "compression.hh"
+#include "hash.hh"
+
+#include <benchmark/benchmark.h>
+
+namespace nix {
+
+    /* Somewhat compressible data: hex digits of a hash chain. */
+    static std::string makeData(size_t size)
+    {
+        std::string data;
+        auto hash = hashString(htSHA256, "");
+        while (data.size() < size) {
+            hash = hashString(htSHA256, hash.to_string(HashFormat::Base16, false));
+            data += hash.to_string(HashFormat::Base16, false);
+        }
+        data.resize(size);
+        return data;
+    }
+
+    static void compress(benchmark::State & state, std::string method)
+    {
+        auto data = makeData(1 << 22);
+        for (auto _ : state) {
+            StringSink out;
+            auto sink = makeCompressionSink(method, out);
+            (*sink)(data);
+            sink->finish();
+            benchmark::DoNotOptimize(out.s);
+        }
+        state.SetBytesProcessed(state.iterations() * data.size());
+    }
+
+    static void decompress(benchmark::State & state, std::string method)
+    {
+        auto data = makeData(1 << 22);
+        auto compressed = nix::compress(method, data);
+        for (auto _ : state)
+            benchmark::DoNotOptimize(nix::decompress(method, compressed));
+        state.SetBytesProcessed(state.iterations() * data.size());
+    }
+
+    BENCHMARK_CAPTURE(compress, none, "none");
+    BENCHMARK_CAPTURE(compress, xz, "xz");
+    BENCHMARK_CAPTURE(compress, bzip2, "bzip2");
+    BENCHMARK_CAPTURE(compress, gzip, "gzip");
+    BENCHMARK_CAPTURE(compress, zstd, "zstd");
+    BENCHMARK_CAPTURE(compress, br, "br");
+
+    BENCHMARK_CAPTURE(decompress, xz, "xz");
+    BENCHMARK_CAPTURE(decompress, bzip2, "bzip2");
+    BENCHMARK_CAPTURE(decompress, gzip, "gzip");
+    BENCHMARK_CAPTURE(decompress, zstd, "zstd");
+    BENCHMARK_CAPTURE(decompress, br, "br");
+
+}
@@ -0,0 +1,38 @@
+#include "hash.hh"
+#include "util.hh"
+
+#include <benchmark/benchmark.h>
+
+namespace nix {
+
+    static void hashString(benchmark::State & state, HashType ht)
+    {
+        std::string data(state.range(0), 'x');
+        for (auto _ : state)
+            benchmark::DoNotOptimize(hashString(ht, data));
+        state.SetBytesProcessed(state.iterations() * data.size());
+    }
+
+    BENCHMARK_CAPTURE(hashString, md5, htMD5)->Range(1 << 10, 1 << 24);
+    BENCHMARK_CAPTURE(hashString, sha1, htSHA1)->Range(1 << 10, 1 << 24);
+    BENCHMARK_CAPTURE(hashString, sha256, htSHA256)->Range(1 << 10, 1 << 24);
+    BENCHMARK_CAPTURE(hashString, sha512, htSHA512)->Range(1 << 10, 1 << 24);
+
+    /* A directory of `range(0)` files of 4 KiB each. */
+    static void hashPath(benchmark::State & state)
+    {
+        auto dir = createTempDir();
+        AutoDelete del(dir, true);
+        std::string contents(4096, 'x');
+        for (int64_t n = 0; n < state.range(0); ++n)
+            writeFile(fmt("%s/file-%d", dir, n), contents);
+
+        uint64_t narSize = 0;
+        for (auto _ : state)
+            narSize = nix::hashPath(htSHA256, dir).second;
+        state.SetBytesProcessed(state.iterations() * narSize);
+    }
+
+    BENCHMARK(hashPath)->Range(1, 1 << 12);
+
+}
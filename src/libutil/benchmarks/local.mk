@@ -0,0 +1,17 @@
+bench: libutil-benchmarks_RUN
+
+programs += libutil-benchmarks
+
+libutil-benchmarks_NAME = libnixutil-benchmarks
+
+libutil-benchmarks_DIR := $(d)
+
+libutil-benchmarks_INSTALL_DIR :=
+
+libutil-benchmarks_SOURCES := $(wildcard $(d)/*.cc)
+
+libutil-benchmarks_CXXFLAGS += -I src/libutil $(GBENCHMARK_CFLAGS)
+
+libutil-benchmarks_LIBS = libutil
+
+libutil-benchmarks_LDFLAGS := $(GBENCHMARK_LIBS)
@@ -0,0 +1,29 @@
+#include "references.hh"
+
+#include <benchmark/benchmark.h>
+
+namespace nix {
+
+    /* Scan 16 MiB that contains a reference every 64 KiB for
+       `range(0)` candidate hashes. */
+    static void refScanSink(benchmark::State & state)
+    {
+        StringSet hashes;
+        for (int64_t n = 0; n < state.range(0); ++n)
+            hashes.insert(fmt("%032d", n));
+
+        std::string data(1 << 24, 'x');
+        for (size_t pos = 0; pos + 32 < data.size(); pos += 1 << 16)
+            data.replace(pos, 32, fmt("%032d", pos % state.range(0)));
+
+        for (auto _ : state) {
+            RefScanSink sink { StringSet(hashes) };
+            sink(data);
+            benchmark::DoNotOptimize(sink.getResult());
+        }
+        state.SetBytesProcessed(state.iterations() * data.size());
+    }
+
+    BENCHMARK(refScanSink)->Range(1, 1 << 12);
+
+}
@@ -1,16 +1,71 @@
 #include "canon-path.hh"
 #include "util.hh"
 
+#include <array>
+#include <deque>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+
 namespace nix {
 
+/**
+ * The table of interned paths, split into shards with their own lock
+ * so that threads rarely contend. Paths are never removed.
+ */
+struct CanonPathTable
+{
+    static constexpr size_t nrShards = 16;
+
+    template<typename Node>
+    struct alignas(64) Shard
+    {
+        std::shared_mutex mutex;
+        /* Keyed by views of the paths in `nodes`, which don't move
+           since a deque doesn't move its elements when it grows. */
+        std::unordered_map<std::string_view, const Node *> index;
+        std::deque<Node> nodes;
+    };
+};
+
+const CanonPath::Node * CanonPath::intern(std::string_view path)
+{
+    using Shard = CanonPathTable::Shard<Node>;
+
+    /* Never destroyed, since paths may outlive static destructors. */
+    static auto shards = new std::array<Shard, CanonPathTable::nrShards>;
+
+    auto hash = std::hash<std::string_view>()(path);
+    auto & shard = (*shards)[hash % CanonPathTable::nrShards];
+
+    {
+        std::shared_lock lock(shard.mutex);
+        auto i = shard.index.find(path);
+        if (i != shard.index.end()) return i->second;
+    }
+
+    /* Intern the parent first, without holding the lock, since it
+       may be in the same shard. */
+    const Node * parent = path.size() <= 1
+        ? nullptr
+        : intern(path.substr(0, std::max((size_t) 1, path.rfind('/'))));
+
+    std::unique_lock lock(shard.mutex);
+    auto i = shard.index.find(path);
+    if (i != shard.index.end()) return i->second;
+    auto & node = shard.nodes.emplace_back(Node { .path = std::string(path), .parent = parent, .hash = hash });
+    shard.index.emplace(node.path, &node);
+    return &node;
+}
+
 CanonPath CanonPath::root = CanonPath("/");
 
 CanonPath::CanonPath(std::string_view raw)
-    : path(absPath((Path) raw, "/"))
+    : node(intern(absPath((Path) raw, "/")))
 { }
 
 CanonPath::CanonPath(std::string_view raw, const CanonPath & root)
-    : path(absPath((Path) raw, root.abs()))
+    : node(intern(absPath((Path) raw, root.abs())))
 { }
 
 CanonPath CanonPath::fromCwd(std::string_view path)
@@ -21,39 +76,41 @@ CanonPath CanonPath::fromCwd(std::string_view path)
 std::optional<CanonPath> CanonPath::parent() const
 {
     if (isRoot()) return std::nullopt;
-    return CanonPath(unchecked_t(), path.substr(0, std::max((size_t) 1, path.rfind('/'))));
+    return CanonPath(node->parent);
 }
 
 void CanonPath::pop()
 {
     assert(!isRoot());
-    path.resize(std::max((size_t) 1, path.rfind('/')));
+    node = node->parent;
 }
 
 bool CanonPath::isWithin(const CanonPath & parent) const
 {
-    return !(
-        path.size() < parent.path.size()
-        || path.substr(0, parent.path.size()) != parent.path
-        || (parent.path.size() > 1 && path.size() > parent.path.size()
-            && path[parent.path.size()] != '/'));
+    auto & path = node->path;
+    auto & parentPath = parent.node->path;
+    return node == parent.node || !(
+        path.size() < parentPath.size()
+        || std::string_view(path).substr(0, parentPath.size()) != parentPath
+        || (parentPath.size() > 1 && path.size() > parentPath.size()
+            && path[parentPath.size()] != '/'));
 }
 
 CanonPath CanonPath::removePrefix(const CanonPath & prefix) const
 {
     assert(isWithin(prefix));
     if (prefix.isRoot()) return *this;
-    if (path.size() == prefix.path.size()) return root;
-    return CanonPath(unchecked_t(), path.substr(prefix.path.size()));
+    if (node == prefix.node) return root;
+    return CanonPath(unchecked_t(), std::string_view(node->path).substr(prefix.node->path.size()));
 }
 
 void CanonPath::extend(const CanonPath & x)
 {
     if (x.isRoot()) return;
     if (isRoot())
-        path += x.rel();
+        node = x.node;
     else
-        path += x.abs();
+        node = intern(node->path + x.abs());
 }
 
 CanonPath CanonPath::operator + (const CanonPath & x) const
@@ -67,8 +124,13 @@ void CanonPath::push(std::string_view c)
 {
     assert(c.find('/') == c.npos);
     assert(c != "." && c != "..");
-    if (!isRoot()) path += '/';
-    path += c;
+    /* Build the child's path in a reused buffer, so that looking up
+       an existing child doesn't allocate. */
+    thread_local std::string buf;
+    buf = node->path;
+    if (!isRoot()) buf += '/';
+    buf += c;
+    node = intern(buf);
 }
 
 CanonPath CanonPath::operator + (std::string_view c) const
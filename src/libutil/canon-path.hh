@@ -23,10 +23,32 @@ namespace nix {
  * Note that the path does not need to correspond to an actually
  * existing path, and there is no guarantee that symlinks are
  * resolved.
+ *
+ * Paths are interned: every distinct path is stored once, together
+ * with a pointer to its parent. Copying a path, comparing two paths
+ * for equality, hashing a path and taking its parent are therefore
+ * constant-time operations that don't allocate.
  */
 class CanonPath
 {
-    std::string path;
+    struct Node
+    {
+        std::string path;
+        /**
+         * `nullptr` for the root.
+         */
+        const Node * parent;
+        size_t hash;
+    };
+
+    const Node * node;
+
+    CanonPath(const Node * node) : node(node) { }
+
+    /**
+     * @return The node of `path`, which must be canonical.
+     */
+    static const Node * intern(std::string_view path);
 
 public:
 
@@ -42,8 +64,8 @@ public:
 
     struct unchecked_t { };
 
-    CanonPath(unchecked_t _, std::string path)
-        : path(std::move(path))
+    CanonPath(unchecked_t _, std::string_view path)
+        : node(intern(path))
     { }
 
     static CanonPath fromCwd(std::string_view path = ".");
@@ -58,13 +80,13 @@ public:
     CanonPath(std::string_view raw, const CanonPath & root);
 
     bool isRoot() const
-    { return path.size() <= 1; }
+    { return !node->parent; }
 
     explicit operator std::string_view() const
-    { return path; }
+    { return node->path; }
 
     const std::string & abs() const
-    { return path; }
+    { return node->path; }
 
     /**
      * Like abs(), but return an empty string if this path is
@@ -73,14 +95,14 @@ public:
     const std::string & absOrEmpty() const
     {
         const static std::string epsilon;
-        return isRoot() ? epsilon : path;
+        return isRoot() ? epsilon : node->path;
     }
 
     const char * c_str() const
-    { return path.c_str(); }
+    { return node->path.c_str(); }
 
     std::string_view rel() const
-    { return ((std::string_view) path).substr(1); }
+    { return ((std::string_view) node->path).substr(1); }
 
     struct Iterator
     {
@@ -113,7 +135,7 @@ public:
     };
 
     Iterator begin() const { return Iterator(rel()); }
-    Iterator end() const { return Iterator(rel().substr(path.size() - 1)); }
+    Iterator end() const { return Iterator(rel().substr(node->path.size() - 1)); }
 
     std::optional<CanonPath> parent() const;
 
@@ -125,20 +147,23 @@ public:
     std::optional<std::string_view> dirOf() const
     {
         if (isRoot()) return std::nullopt;
-        return ((std::string_view) path).substr(0, path.rfind('/'));
+        return ((std::string_view) node->path).substr(0, node->path.rfind('/'));
     }
 
     std::optional<std::string_view> baseName() const
     {
         if (isRoot()) return std::nullopt;
-        return ((std::string_view) path).substr(path.rfind('/') + 1);
+        return ((std::string_view) node->path).substr(node->path.rfind('/') + 1);
     }
 
     bool operator == (const CanonPath & x) const
-    { return path == x.path; }
+    { return node == x.node; }
 
     bool operator != (const CanonPath & x) const
-    { return path != x.path; }
+    { return node != x.node; }
+
+    size_t hash() const
+    { return node->hash; }
 
     /**
      * Compare paths lexicographically except that path separators
@@ -148,9 +173,11 @@ public:
      */
     bool operator < (const CanonPath & x) const
     {
+        if (node == x.node) return false;
+        auto & path = node->path;
         auto i = path.begin();
-        auto j = x.path.begin();
-        for ( ; i != path.end() && j != x.path.end(); ++i, ++j) {
+        auto j = x.node->path.begin();
+        for ( ; i != path.end() && j != x.node->path.end(); ++i, ++j) {
             auto c_i = *i;
             if (c_i == '/') c_i = 0;
             auto c_j = *j;
@@ -158,7 +185,7 @@ public:
             if (c_i < c_j) return true;
             if (c_i > c_j) return false;
         }
-        return i == path.end() && j != x.path.end();
+        return i == path.end() && j != x.node->path.end();
     }
 
     /**
@@ -204,3 +231,12 @@ public:
 std::ostream & operator << (std::ostream & stream, const CanonPath & path);
 
 }
+
+template<>
+struct std::hash<nix::CanonPath>
+{
+    std::size_t operator()(const nix::CanonPath & path) const noexcept
+    {
+        return path.hash();
+    }
+};
@@ -130,6 +130,27 @@ static CgroupStats destroyCgroup(const Path & cgroup, bool returnStats)
             }
         }
 
+        auto memoryPeakPath = cgroup + "/memory.peak";
+
+        if (pathExists(memoryPeakPath))
+            stats.memoryPeak = string2Int<uint64_t>(trim(readFile(memoryPeakPath)));
+
+        auto ioStatPath = cgroup + "/io.stat";
+
+        /* Each line has the counters of one device, like
+           `8:0 rbytes=1459200 wbytes=314773504 rios=192 ...`. */
+        if (pathExists(ioStatPath)) {
+            uint64_t read = 0, written = 0;
+            for (auto & line : tokenizeString<std::vector<std::string>>(readFile(ioStatPath), "\n"))
+                for (auto & field : tokenizeString<std::vector<std::string>>(line)) {
+                    if (hasPrefix(field, "rbytes="))
+                        read += string2Int<uint64_t>(field.substr(7)).value_or(0);
+                    else if (hasPrefix(field, "wbytes="))
+                        written += string2Int<uint64_t>(field.substr(7)).value_or(0);
+                }
+            stats.ioRead = read;
+            stats.ioWrite = written;
+        }
     }
 
     if (rmdir(cgroup.c_str()) == -1)
@@ -143,6 +164,13 @@ CgroupStats destroyCgroup(const Path & cgroup)
     return destroyCgroup(cgroup, true);
 }
 
+std::optional<uint64_t> getCgroupMemoryUsage(const Path & cgroup)
+{
+    auto memoryFile = cgroup + "/memory.current";
+    if (!pathExists(memoryFile)) return std::nullopt;
+    return string2Int<uint64_t>(trim(readFile(memoryFile)));
+}
+
 }
 
 #endif
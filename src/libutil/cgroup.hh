@@ -17,6 +17,17 @@ std::map<std::string, std::string> getCgroups(const Path & cgroupFile);
 struct CgroupStats
 {
     std::optional<std::chrono::microseconds> cpuUser, cpuSystem;
+
+    /**
+     * The peak memory usage of the cgroup in bytes.
+     */
+    std::optional<uint64_t> memoryPeak;
+
+    /**
+     * The number of bytes read from and written to block devices by
+     * the cgroup.
+     */
+    std::optional<uint64_t> ioRead, ioWrite;
 };
 
 /**
@@ -27,6 +38,13 @@ struct CgroupStats
  */
 CgroupStats destroyCgroup(const Path & cgroup);
 
+/**
+ * @return The memory currently used by the processes in the cgroup
+ * denoted by 'path', or nothing if it doesn't have a memory
+ * controller.
+ */
+std::optional<uint64_t> getCgroupMemoryUsage(const Path & cgroup);
+
 }
 
 #endif
@@ -0,0 +1,75 @@
+#include "chunking.hh"
+
+#include <array>
+
+namespace nix {
+
+/* A cut point is where the top `maskBits` bits of the hash are
+   zero. The hash covers the last 64 bytes, since every byte is
+   shifted one bit further up. */
+static const unsigned int maskBits = 19;
+static const uint64_t mask = ~(~0ULL >> maskBits);
+
+static const std::array<uint64_t, 256> gear = []() {
+    /* The table must never change, since it determines where chunks
+       are cut. Generate it with splitmix64 from a fixed seed. */
+    std::array<uint64_t, 256> table;
+    uint64_t x = 0x6e69782d63686e6bULL;
+    for (auto & entry : table) {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        entry = z ^ (z >> 31);
+    }
+    return table;
+}();
+
+ChunkingSink::ChunkingSink(ChunkCallback onChunk)
+    : onChunk(std::move(onChunk))
+{
+    chunk.reserve(maxChunkSize);
+}
+
+void ChunkingSink::operator () (std::string_view data)
+{
+    while (!data.empty()) {
+        size_t i = 0;
+        bool cut = false;
+
+        /* Skip the bytes before the minimum size, but let the hash
+           see the last 64 of them. */
+        if (chunk.size() < minChunkSize - 64) {
+            i = std::min(data.size(), minChunkSize - 64 - chunk.size());
+        }
+
+        for (; i < data.size(); ++i) {
+            hash = (hash << 1) + gear[(unsigned char) data[i]];
+            auto size = chunk.size() + i + 1;
+            if ((size >= minChunkSize && !(hash & mask)) || size >= maxChunkSize) {
+                ++i;
+                cut = true;
+                break;
+            }
+        }
+
+        chunk.append(data.substr(0, i));
+        data.remove_prefix(i);
+
+        if (cut) {
+            onChunk(chunk);
+            chunk.clear();
+            hash = 0;
+        }
+    }
+}
+
+void ChunkingSink::finish()
+{
+    if (!chunk.empty()) {
+        onChunk(chunk);
+        chunk.clear();
+    }
+    hash = 0;
+}
+
+}
@@ -0,0 +1,40 @@
+#pragma once
+///@file
+
+#include "serialise.hh"
+
+#include <functional>
+
+namespace nix {
+
+/**
+ * A sink that splits its input into content-defined chunks, i.e. the
+ * chunk boundaries depend only on the data near them (using a "gear"
+ * rolling hash, as in FastCDC). So after an insertion or deletion,
+ * the chunks after the change are the same as before. Chunks are
+ * between `minChunkSize` and `maxChunkSize` bytes, and about half a
+ * megabyte on average, except that the last chunk may be smaller.
+ */
+struct ChunkingSink : Sink
+{
+    static constexpr size_t minChunkSize = 64 * 1024;
+    static constexpr size_t maxChunkSize = 4 * 1024 * 1024;
+
+    typedef std::function<void(std::string_view chunk)> ChunkCallback;
+
+    ChunkingSink(ChunkCallback onChunk);
+
+    void operator () (std::string_view data) override;
+
+    /**
+     * Pass the last chunk, if any, to the callback.
+     */
+    void finish();
+
+private:
+    ChunkCallback onChunk;
+    std::string chunk;
+    uint64_t hash = 0;
+};
+
+}
@@ -190,6 +190,125 @@ struct BrotliDecompressionSink : ChunkedCompressionSink
     }
 };
 
+static constexpr uint32_t skippableFrameMagic = 0x184D2A5E;
+static constexpr uint32_t seekableMagic = 0x8F92EAB1;
+
+/**
+ * Write the input as a sequence of independently compressed zstd
+ * frames of `frameSize` bytes each, followed by a seek table in a
+ * skippable frame.
+ */
+struct SeekableZstdCompressionSink : CompressionSink
+{
+    static constexpr size_t frameSize = 1024 * 1024;
+
+    Sink & nextSink;
+    int level;
+    std::string frame;
+    std::vector<std::pair<uint32_t, uint32_t>> frames;
+
+    SeekableZstdCompressionSink(Sink & nextSink, int level)
+        : nextSink(nextSink), level(level)
+    { }
+
+    void writeUnbuffered(std::string_view data) override
+    {
+        while (!data.empty()) {
+            auto n = std::min(frameSize - frame.size(), data.size());
+            frame.append(data.substr(0, n));
+            data.remove_prefix(n);
+            if (frame.size() == frameSize) writeFrame();
+        }
+    }
+
+    void writeFrame()
+    {
+        uint32_t compressedSize = 0;
+        LambdaSink out([&](std::string_view data) {
+            compressedSize += data.size();
+            nextSink(data);
+        });
+        ArchiveCompressionSink sink(out, "zstd", false, level);
+        sink(frame);
+        sink.finish();
+        frames.emplace_back(compressedSize, frame.size());
+        frame.clear();
+    }
+
+    void finish() override
+    {
+        flush();
+
+        /* Always write at least one frame, since a file starting with
+           a skippable frame isn't recognised as zstd. */
+        if (!frame.empty() || frames.empty())
+            writeFrame();
+
+        std::string table;
+        auto put32 = [&](uint32_t n) {
+            for (int i = 0; i < 4; ++i)
+                table.push_back((char) (n >> (8 * i)));
+        };
+        put32(skippableFrameMagic);
+        put32(frames.size() * 8 + seekableZstdFooterSize);
+        for (auto & [compressedSize, decompressedSize] : frames) {
+            put32(compressedSize);
+            put32(decompressedSize);
+        }
+        put32(frames.size());
+        table.push_back(0); // no checksums
+        put32(seekableMagic);
+        nextSink(table);
+    }
+};
+
+static uint32_t get32(std::string_view s, size_t pos)
+{
+    uint32_t n = 0;
+    for (int i = 3; i >= 0; --i)
+        n = (n << 8) | (unsigned char) s[pos + i];
+    return n;
+}
+
+uint64_t parseSeekableZstdFooter(std::string_view footer)
+{
+    if (footer.size() != seekableZstdFooterSize
+        || get32(footer, 5) != seekableMagic)
+        throw CompressionError("file does not have a zstd seek table");
+    uint64_t nrFrames = get32(footer, 0);
+    auto entrySize = footer[4] & 0x80 ? 12 : 8;
+    return 8 + nrFrames * entrySize + seekableZstdFooterSize;
+}
+
+std::vector<SeekableZstdFrame> parseSeekableZstdTable(std::string_view table)
+{
+    if (table.size() < 8 + seekableZstdFooterSize
+        || get32(table, 0) != skippableFrameMagic
+        || get32(table, 4) != table.size() - 8
+        || parseSeekableZstdFooter(table.substr(table.size() - seekableZstdFooterSize)) != table.size())
+        throw CompressionError("invalid zstd seek table");
+
+    auto entrySize = table[table.size() - 5] & 0x80 ? 12 : 8;
+    uint64_t nrFrames = get32(table, table.size() - seekableZstdFooterSize);
+
+    std::vector<SeekableZstdFrame> frames;
+    uint64_t compressedOffset = 0, decompressedOffset = 0;
+    for (uint64_t n = 0; n < nrFrames; ++n) {
+        auto pos = 8 + n * entrySize;
+        SeekableZstdFrame frame{
+            .compressedOffset = compressedOffset,
+            .compressedSize = get32(table, pos),
+            .decompressedOffset = decompressedOffset,
+            .decompressedSize = get32(table, pos + 4),
+        };
+        compressedOffset += frame.compressedSize;
+        decompressedOffset += frame.decompressedSize;
+        frames.push_back(frame);
+    }
+
+    return frames;
+}
+
 std::string decompress(const std::string & method, std::string_view in)
 {
     StringSink ssink;
@@ -212,6 +331,19 @@ std::unique_ptr<FinishSink> makeDecompressionSink(const std::string & method, Si
         });
 }
 
+std::unique_ptr<Source> makeDecompressionSource(const std::string & method, Source & source)
+{
+    if (method == "none" || method == "")
+        return std::make_unique<LambdaSource>([&source](char * data, size_t len) {
+            return source.read(data, len);
+        });
+    return sinkToSource([method, &source](Sink & sink) {
+        auto decompressor = makeDecompressionSink(method, sink);
+        source.drainInto(*decompressor);
+        decompressor->finish();
+    });
+}
+
 struct BrotliCompressionSink : ChunkedCompressionSink
 {
     Sink & nextSink;
@@ -277,6 +409,8 @@ ref<CompressionSink> makeCompressionSink(const std::string & method, Sink & next
         return make_ref<NoneSink>(nextSink);
     else if (method == "br")
         return make_ref<BrotliCompressionSink>(nextSink);
+    else if (method == "zstd-seekable")
+        return make_ref<SeekableZstdCompressionSink>(nextSink, level);
     else
         throw UnknownCompressionMethod("unknown compression method '%s'", method);
 }
@@ -20,10 +20,47 @@ std::string decompress(const std::string & method, std::string_view in);
 
 std::unique_ptr<FinishSink> makeDecompressionSink(const std::string & method, Sink & nextSink);
 
+/**
+ * Return a source that yields the decompressed contents of `source`,
+ * which is read until its end.
+ */
+std::unique_ptr<Source> makeDecompressionSource(const std::string & method, Source & source);
+
 std::string compress(const std::string & method, std::string_view in, const bool parallel = false, int level = -1);
 
 ref<CompressionSink> makeCompressionSink(const std::string & method, Sink & nextSink, const bool parallel = false, int level = -1);
 
+/**
+ * The location of a frame in a file compressed with `zstd-seekable`,
+ * i.e. in the [seekable zstd
+ * format](https://github.com/facebook/zstd/blob/dev/contrib/seekable_format/zstd_seekable_compression_format.md).
+ * Such a file consists of independently compressed zstd frames,
+ * followed by a seek table, so any decompressor for zstd can read it,
+ * but parts of it can also be decompressed on their own.
+ */
+struct SeekableZstdFrame
+{
+    uint64_t compressedOffset, compressedSize;
+    uint64_t decompressedOffset, decompressedSize;
+};
+
+/**
+ * The size of the footer at the end of a `zstd-seekable` file.
+ */
+constexpr size_t seekableZstdFooterSize = 9;
+
+/**
+ * Given the last `seekableZstdFooterSize` bytes of a `zstd-seekable`
+ * file, return the size of the seek table at the end of the file
+ * (including the footer).
+ */
+uint64_t parseSeekableZstdFooter(std::string_view footer);
+
+/**
+ * Parse the seek table at the end of a `zstd-seekable` file.
+ */
+std::vector<SeekableZstdFrame> parseSeekableZstdTable(std::string_view table);
+
 MakeError(UnknownCompressionMethod, Error);
 
 MakeError(CompressionError, Error);
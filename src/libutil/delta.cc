@@ -0,0 +1,126 @@
+#include "delta.hh"
+
+#include <cstring>
+#include <unordered_map>
+
+namespace nix {
+
+static const std::string deltaMagic = "nix-delta-1";
+
+enum : uint64_t {
+    opEnd = 0,
+    opCopy = 1,
+    opInsert = 2,
+};
+
+/* Size of the blocks of the base that are indexed. Smaller blocks
+   find more matches, but make the index bigger. */
+static const size_t blockSize = 64;
+
+/* Maximum size of a single insert instruction, to bound the memory
+   needed to apply a delta. */
+static const size_t maxInsert = 64 * 1024;
+
+/* Multiplier of the polynomial rolling hash (mod 2^64). */
+static const uint64_t hashBase = 0x100000001b3ULL;
+
+static uint64_t hashBlock(const char * p)
+{
+    uint64_t h = 0;
+    for (size_t i = 0; i < blockSize; ++i)
+        h = h * hashBase + (unsigned char) p[i];
+    return h;
+}
+
+void computeDelta(std::string_view base, std::string_view target, Sink & delta)
+{
+    delta << deltaMagic;
+
+    size_t literalStart = 0;
+
+    auto flushLiteral = [&](size_t end) {
+        while (literalStart < end) {
+            auto n = std::min(end - literalStart, maxInsert);
+            delta << opInsert << target.substr(literalStart, n);
+            literalStart += n;
+        }
+    };
+
+    if (base.size() >= blockSize && target.size() >= blockSize) {
+
+        std::unordered_map<uint64_t, size_t> index;
+        index.reserve(base.size() / blockSize);
+        for (size_t offset = 0; offset + blockSize <= base.size(); offset += blockSize)
+            index.emplace(hashBlock(base.data() + offset), offset);
+
+        /* hashBase^(blockSize - 1), to remove the byte that leaves the
+           window. */
+        uint64_t topFactor = 1;
+        for (size_t i = 1; i < blockSize; ++i)
+            topFactor *= hashBase;
+
+        size_t pos = 0;
+        uint64_t h = hashBlock(target.data());
+
+        while (true) {
+            auto i = index.find(h);
+            if (i != index.end()
+                && std::memcmp(base.data() + i->second, target.data() + pos, blockSize) == 0)
+            {
+                /* Extend the match in both directions. */
+                size_t baseStart = i->second, targetStart = pos;
+                while (baseStart > 0 && targetStart > literalStart
+                    && base[baseStart - 1] == target[targetStart - 1])
+                {
+                    --baseStart;
+                    --targetStart;
+                }
+                size_t len = pos + blockSize - targetStart;
+                while (baseStart + len < base.size() && targetStart + len < target.size()
+                    && base[baseStart + len] == target[targetStart + len])
+                    ++len;
+
+                flushLiteral(targetStart);
+                delta << opCopy << baseStart << len;
+                literalStart = pos = targetStart + len;
+
+                if (pos + blockSize > target.size()) break;
+                h = hashBlock(target.data() + pos);
+                continue;
+            }
+
+            if (pos + blockSize >= target.size()) break;
+            h = (h - topFactor * (unsigned char) target[pos]) * hashBase
+                + (unsigned char) target[pos + blockSize];
+            ++pos;
+        }
+    }
+
+    flushLiteral(target.size());
+
+    delta << opEnd;
+}
+
+void applyDelta(std::string_view base, Source & delta, Sink & target)
+{
+    if (readString(delta, deltaMagic.size()) != deltaMagic)
+        throw BadDelta("input is not a Nix delta");
+
+    while (true) {
+        auto op = readNum<uint64_t>(delta);
+        if (op == opEnd) break;
+        else if (op == opCopy) {
+            auto offset = readNum<uint64_t>(delta);
+            auto len = readNum<uint64_t>(delta);
+            if (offset > base.size() || len > base.size() - offset)
+                throw BadDelta("delta refers to data beyond the end of its base");
+            target(base.substr(offset, len));
+        }
+        else if (op == opInsert)
+            target(readString(delta, maxInsert));
+        else
+            throw BadDelta("delta contains unknown instruction %d", op);
+    }
+}
+
+}
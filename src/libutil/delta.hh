@@ -0,0 +1,32 @@
+#pragma once
+///@file
+
+#include "serialise.hh"
+
+#include <string_view>
+
+namespace nix {
+
+MakeError(BadDelta, Error);
+
+/**
+ * Write a binary delta to `delta` that turns `base` into
+ * `target`. The delta consists of instructions to copy a range of
+ * `base` or to insert literal data. Matching ranges are found by
+ * indexing `base` in fixed-size blocks and looking up every offset of
+ * `target` in that index using a rolling hash, so data that has moved
+ * compared to `base` is still matched.
+ *
+ * The delta is not compressed; it is meant to be compressed
+ * afterwards, since the literal data is usually the bulk of it.
+ */
+void computeDelta(std::string_view base, std::string_view target, Sink & delta);
+
+/**
+ * Apply a delta produced by `computeDelta()` to `base`, writing the
+ * result to `target`. Throws `BadDelta` if the delta is corrupt or
+ * doesn't fit `base`.
+ */
+void applyDelta(std::string_view base, Source & delta, Sink & target);
+
+}
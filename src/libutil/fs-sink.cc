@@ -1,7 +1,9 @@
 #include <fcntl.h>
 
 #include "config.hh"
+#include "finally.hh"
 #include "fs-sink.hh"
+#include "thread-pool.hh"
 
 namespace nix {
 
@@ -9,6 +11,15 @@ struct RestoreSinkSettings : Config
 {
     Setting<bool> preallocateContents{this, false, "preallocate-contents",
         "Whether to preallocate files when writing objects with known size."};
+
+    Setting<unsigned int> restoreJobs{this, 1, "restore-jobs",
+        R"(
+          The number of threads used to create files when unpacking a
+          store path, e.g. when substituting it. If greater than 1,
+          small files and symlinks are written in the background while
+          the rest of the archive is being read, which speeds up
+          unpacking store paths that contain many small files.
+        )"};
 };
 
 static RestoreSinkSettings restoreSinkSettings;
@@ -16,8 +27,109 @@ static RestoreSinkSettings restoreSinkSettings;
 static GlobalConfig::Register r1(&restoreSinkSettings);
 
 
+/**
+ * Files up to this size are written in the background.
+ */
+static constexpr uint64_t maxAsyncFileSize = 256 * 1024;
+
+/**
+ * When this much data is waiting to be written, new files are
+ * written synchronously until the workers have caught up.
+ */
+static constexpr uint64_t maxQueuedBytes = 64 * 1024 * 1024;
+
+static void makeExecutable(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+        throw SysError("fstat");
+    if (fchmod(fd, st.st_mode | (S_IXUSR | S_IXGRP | S_IXOTH)) == -1)
+        throw SysError("fchmod");
+}
+
+static AutoCloseFD openFile(const Path & p)
+{
+    AutoCloseFD fd = open(p.c_str(), O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0666);
+    if (!fd) throw SysError("creating file '%1%'", p);
+    return fd;
+}
+
+struct RestoreSink::AsyncState
+{
+    struct PendingFile
+    {
+        Path path;
+        bool executable = false;
+        std::shared_ptr<std::string> contents = std::make_shared<std::string>();
+    };
+
+    /**
+     * The regular file currently being parsed, if it is being
+     * buffered to be written in the background.
+     */
+    std::optional<PendingFile> file;
+
+    std::atomic<uint64_t> queuedBytes{0};
+
+    /* Destroyed first, since work items refer to `queuedBytes`. */
+    ThreadPool pool;
+
+    AsyncState(size_t nrThreads) : pool(nrThreads) { }
+
+    void run(uint64_t size, std::function<void()> job)
+    {
+        if (queuedBytes + size > maxQueuedBytes) {
+            job();
+            return;
+        }
+        queuedBytes += size;
+        try {
+            pool.enqueue([this, size, job]() {
+                Finally updateQueued([&]() { queuedBytes -= size; });
+                job();
+            });
+        } catch (ThreadPoolShutDown &) {
+            /* A work item failed, so throw its exception. */
+            pool.process();
+            throw;
+        }
+    }
+};
+
+RestoreSink::RestoreSink()
+{
+    if (restoreSinkSettings.restoreJobs > 1)
+        async = std::make_unique<AsyncState>(restoreSinkSettings.restoreJobs);
+}
+
+RestoreSink::~RestoreSink()
+{
+}
+
+void RestoreSink::flushPendingFile()
+{
+    if (!async || !async->file) return;
+    auto file = std::move(*async->file);
+    async->file.reset();
+    async->run(file.contents->size(), [file]() {
+        auto fd = openFile(file.path);
+        if (file.executable) makeExecutable(fd.get());
+        writeFull(fd.get(), *file.contents);
+        fd.close();
+    });
+}
+
+void RestoreSink::finish()
+{
+    if (!async) return;
+    flushPendingFile();
+    auto async2 = std::move(async);
+    async2->pool.process();
+}
+
 void RestoreSink::createDirectory(const Path & path)
 {
+    flushPendingFile();
     Path p = dstPath + path;
     if (mkdir(p.c_str(), 0777) == -1)
         throw SysError("creating directory '%1%'", p);
@@ -25,28 +137,47 @@ void RestoreSink::createDirectory(const Path & path)
 
 void RestoreSink::createRegularFile(const Path & path)
 {
+    flushPendingFile();
     Path p = dstPath + path;
-    fd = open(p.c_str(), O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0666);
-    if (!fd) throw SysError("creating file '%1%'", p);
+    if (async)
+        async->file = AsyncState::PendingFile{ .path = p };
+    else
+        fd = openFile(p);
 }
 
 void RestoreSink::closeRegularFile()
 {
+    if (async && async->file) {
+        flushPendingFile();
+        return;
+    }
+
     /* Call close explicitly to make sure the error is checked */
     fd.close();
 }
 
 void RestoreSink::isExecutable()
 {
-    struct stat st;
-    if (fstat(fd.get(), &st) == -1)
-        throw SysError("fstat");
-    if (fchmod(fd.get(), st.st_mode | (S_IXUSR | S_IXGRP | S_IXOTH)) == -1)
-        throw SysError("fchmod");
+    if (async && async->file)
+        async->file->executable = true;
+    else
+        makeExecutable(fd.get());
 }
 
 void RestoreSink::preallocateContents(uint64_t len)
 {
+    if (async && async->file) {
+        if (len <= maxAsyncFileSize) {
+            async->file->contents->reserve(len);
+            return;
+        }
+        /* Too big to buffer, so write it synchronously. */
+        auto file = std::move(*async->file);
+        async->file.reset();
+        fd = openFile(file.path);
+        if (file.executable) makeExecutable(fd.get());
+    }
+
     if (!restoreSinkSettings.preallocateContents)
         return;
 
@@ -65,13 +196,20 @@ void RestoreSink::preallocateContents(uint64_t len)
 
 void RestoreSink::receiveContents(std::string_view data)
 {
-    writeFull(fd.get(), data);
+    if (async && async->file)
+        async->file->contents->append(data);
+    else
+        writeFull(fd.get(), data);
 }
 
 void RestoreSink::createSymlink(const Path & path, const std::string & target)
 {
+    flushPendingFile();
     Path p = dstPath + path;
-    nix::createSymlink(target, p);
+    if (async)
+        async->run(0, [target, p]() { nix::createSymlink(target, p); });
+    else
+        nix::createSymlink(target, p);
 }
 
 }
@@ -27,6 +27,8 @@ struct RestoreSink : ParseSink
     Path dstPath;
     AutoCloseFD fd;
 
+    RestoreSink();
+    ~RestoreSink();
 
     void createDirectory(const Path & path) override;
 
@@ -37,6 +39,24 @@ struct RestoreSink : ParseSink
     void receiveContents(std::string_view data) override;
 
     void createSymlink(const Path & path, const std::string & target) override;
+
+    /**
+     * Wait until all files and symlinks have been written, throwing
+     * any error that occurred while writing them. Must be called
+     * after parsing the NAR and before using the result.
+     */
+    void finish();
+
+private:
+
+    /**
+     * State for writing small files and symlinks in the background,
+     * if enabled by the `restore-jobs` setting.
+     */
+    struct AsyncState;
+    std::unique_ptr<AsyncState> async;
+
+    void flushPendingFile();
 };
 
 }
@@ -5,7 +5,12 @@
 #include <openssl/md5.h>
 #include <openssl/sha.h>
 
+#if HAVE_LIBBLAKE3
+#include <blake3.h>
+#endif
+
 #include "args.hh"
+#include "config.hh"
 #include "hash.hh"
 #include "archive.hh"
 #include "split.hh"
@@ -23,12 +28,13 @@ static size_t regularHashSize(HashType type) {
     case htSHA1: return sha1HashSize;
     case htSHA256: return sha256HashSize;
     case htSHA512: return sha512HashSize;
+    case htBLAKE3: return blake3HashSize;
     }
     abort();
 }
 
 
-std::set<std::string> hashTypes = { "md5", "sha1", "sha256", "sha512" };
+std::set<std::string> hashTypes = { "md5", "sha1", "sha256", "sha512", "blake3" };
 
 
 Hash::Hash(HashType type) : type(type)
@@ -280,15 +286,27 @@ union Ctx
     SHA_CTX sha1;
     SHA256_CTX sha256;
     SHA512_CTX sha512;
+#if HAVE_LIBBLAKE3
+    blake3_hasher blake3;
+#endif
 };
 
 
+/* Note that OpenSSL uses the SHA extensions of x86 and ARMv8 CPUs if
+   they are available. */
 static void start(HashType ht, Ctx & ctx)
 {
     if (ht == htMD5) MD5_Init(&ctx.md5);
     else if (ht == htSHA1) SHA1_Init(&ctx.sha1);
     else if (ht == htSHA256) SHA256_Init(&ctx.sha256);
     else if (ht == htSHA512) SHA512_Init(&ctx.sha512);
+    else if (ht == htBLAKE3) {
+#if HAVE_LIBBLAKE3
+        blake3_hasher_init(&ctx.blake3);
+#else
+        throw Error("this build of Nix does not support BLAKE3 hashes");
+#endif
+    }
 }
 
 
@@ -299,6 +317,9 @@ static void update(HashType ht, Ctx & ctx,
     else if (ht == htSHA1) SHA1_Update(&ctx.sha1, data.data(), data.size());
     else if (ht == htSHA256) SHA256_Update(&ctx.sha256, data.data(), data.size());
     else if (ht == htSHA512) SHA512_Update(&ctx.sha512, data.data(), data.size());
+#if HAVE_LIBBLAKE3
+    else if (ht == htBLAKE3) blake3_hasher_update(&ctx.blake3, data.data(), data.size());
+#endif
 }
 
 
@@ -308,6 +329,9 @@ static void finish(HashType ht, Ctx & ctx, unsigned char * hash)
     else if (ht == htSHA1) SHA1_Final(hash, &ctx.sha1);
     else if (ht == htSHA256) SHA256_Final(hash, &ctx.sha256);
     else if (ht == htSHA512) SHA512_Final(hash, &ctx.sha512);
+#if HAVE_LIBBLAKE3
+    else if (ht == htBLAKE3) blake3_hasher_finalize(&ctx.blake3, hash, BLAKE3_OUT_LEN);
+#endif
 }
 
 
@@ -332,9 +356,10 @@ Hash hashFile(HashType ht, const Path & path)
 
 HashSink::HashSink(HashType ht) : ht(ht)
 {
-    ctx = new Ctx;
+    auto ctx = std::make_unique<Ctx>();
     bytes = 0;
     start(ht, *ctx);
+    this->ctx = ctx.release();
 }
 
 HashSink::~HashSink()
@@ -427,6 +452,10 @@ std::optional<HashType> parseHashTypeOpt(std::string_view s)
     if (s == "sha1") return htSHA1;
     if (s == "sha256") return htSHA256;
     if (s == "sha512") return htSHA512;
+    if (s == "blake3") {
+        experimentalFeatureSettings.require(Xp::BLAKE3Hashes);
+        return htBLAKE3;
+    }
     return std::nullopt;
 }
 
@@ -436,7 +465,7 @@ HashType parseHashType(std::string_view s)
     if (opt_h)
         return *opt_h;
     else
-        throw UsageError("unknown hash algorithm '%1%', expect 'md5', 'sha1', 'sha256', or 'sha512'", s);
+        throw UsageError("unknown hash algorithm '%1%', expect 'md5', 'sha1', 'sha256', 'sha512', or 'blake3'", s);
 }
 
 std::string_view printHashType(HashType ht)
@@ -446,6 +475,7 @@ std::string_view printHashType(HashType ht)
     case htSHA1: return "sha1";
     case htSHA256: return "sha256";
     case htSHA512: return "sha512";
+    case htBLAKE3: return "blake3";
     default:
         // illegal hash type enum value internally, as opposed to external input
         // which should be validated with nice error message.
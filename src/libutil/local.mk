@@ -16,3 +16,7 @@ $(foreach i, $(wildcard $(d)/args/*.hh), \
 ifeq ($(HAVE_LIBCPUID), 1)
 	libutil_LDFLAGS += -lcpuid
 endif
+
+ifeq ($(HAVE_LIBBLAKE3), 1)
+	libutil_LDFLAGS += $(LIBBLAKE3_LIBS)
+endif
@@ -0,0 +1,116 @@
+#include "lock-stats.hh"
+#include "util.hh"
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+
+namespace nix {
+
+void LockStats::Histogram::observe(std::chrono::steady_clock::duration d)
+{
+    uint64_t ns = std::max<int64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(d).count(), 0);
+    size_t i = 0;
+    while (i < nrBuckets - 1 && ns > (uint64_t(1) << i)) ++i;
+    counts[i].fetch_add(1, std::memory_order_relaxed);
+    sumNanoseconds.fetch_add(ns, std::memory_order_relaxed);
+}
+
+struct LockStatsRegistry
+{
+    std::mutex mutex;
+    std::map<std::string, std::unique_ptr<LockStats>, std::less<>> stats;
+    std::string reportFile;
+};
+
+/**
+ * @return The registry, or `nullptr` if lock statistics are disabled.
+ * It is never destroyed, since locks may still be used by static
+ * destructors.
+ */
+static LockStatsRegistry * getRegistry()
+{
+    static LockStatsRegistry * registry = []() -> LockStatsRegistry * {
+        auto file = getEnv("NIX_LOCK_STATS");
+        if (!file) return nullptr;
+        auto r = new LockStatsRegistry;
+        r->reportFile = *file;
+        /* Write the report at exit, to stderr or appended to the
+           given file, so that forked processes don't overwrite each
+           other's reports. */
+        std::atexit([]() {
+            try {
+                auto report = showLockStats();
+                auto & file = getRegistry()->reportFile;
+                if (file == "" || file == "1")
+                    writeFull(STDERR_FILENO, report);
+                else {
+                    AutoCloseFD fd = open(file.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+                    if (fd) writeFull(fd.get(), report);
+                }
+            } catch (...) {
+            }
+        });
+        return r;
+    }();
+    return registry;
+}
+
+LockStats * getLockStats(std::string_view name)
+{
+    auto registry = getRegistry();
+    if (!registry) return nullptr;
+    std::lock_guard lock(registry->mutex);
+    auto i = registry->stats.find(name);
+    if (i == registry->stats.end())
+        i = registry->stats.emplace(std::string(name), std::make_unique<LockStats>(name)).first;
+    return i->second.get();
+}
+
+void forEachLockStats(std::function<void(const LockStats &)> fun)
+{
+    auto registry = getRegistry();
+    if (!registry) return;
+    std::vector<const LockStats *> stats;
+    {
+        std::lock_guard lock(registry->mutex);
+        for (auto & [_, s] : registry->stats)
+            if (s->acquisitions) stats.push_back(s.get());
+    }
+    for (auto s : stats) fun(*s);
+}
+
+static uint64_t percentile(const LockStats::Histogram & h, double p)
+{
+    uint64_t total = 0;
+    for (auto & c : h.counts) total += c;
+    if (!total) return 0;
+    uint64_t n = 0;
+    for (size_t i = 0; i < LockStats::nrBuckets; ++i) {
+        n += h.counts[i];
+        if (n >= total * p) return uint64_t(1) << i;
+    }
+    return uint64_t(1) << (LockStats::nrBuckets - 1);
+}
+
+std::string showLockStats()
+{
+    std::vector<const LockStats *> stats;
+    forEachLockStats([&](const LockStats & s) { stats.push_back(&s); });
+    std::sort(stats.begin(), stats.end(), [](auto a, auto b) {
+        return a->waits.sumNanoseconds > b->waits.sumNanoseconds;
+    });
+
+    std::string out = fmt("lock statistics of process %d (times in microseconds, percentiles are upper bounds):\n", getpid());
+    out += fmt("%-24s %12s %12s %12s %10s %12s %10s\n",
+        "lock", "acquired", "contended", "wait total", "wait p99", "hold total", "hold p99");
+    auto us = [](uint64_t ns) { return fmt("%.1f", ns / 1000.0); };
+    for (auto s : stats)
+        out += fmt("%-24s %12d %12d %12s %10s %12s %10s\n",
+            s->name, s->acquisitions, s->contended,
+            us(s->waits.sumNanoseconds), us(percentile(s->waits, 0.99)),
+            us(s->holds.sumNanoseconds), us(percentile(s->holds, 0.99)));
+    return out;
+}
+
+}
@@ -0,0 +1,74 @@
+#pragma once
+///@file
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <string_view>
+
+namespace nix {
+
+/**
+ * Contention statistics of the `Sync` instances with a given name,
+ * collected if the environment variable `NIX_LOCK_STATS` is set.
+ */
+struct LockStats
+{
+    /**
+     * Durations are counted in buckets whose upper bounds are powers
+     * of two nanoseconds. The last bucket holds everything above
+     * 2^(nrBuckets - 2) ns, i.e. about half a minute.
+     */
+    static constexpr size_t nrBuckets = 36;
+
+    struct Histogram
+    {
+        std::array<std::atomic<uint64_t>, nrBuckets> counts{};
+        std::atomic<uint64_t> sumNanoseconds{0};
+
+        void observe(std::chrono::steady_clock::duration d);
+    };
+
+    const std::string name;
+
+    std::atomic<uint64_t> acquisitions{0};
+
+    /**
+     * The acquisitions that found the lock held by someone else.
+     */
+    std::atomic<uint64_t> contended{0};
+
+    /**
+     * The time spent waiting for the lock, for contended
+     * acquisitions.
+     */
+    Histogram waits;
+
+    /**
+     * The time the lock was held, excluding condition variable waits.
+     */
+    Histogram holds;
+
+    LockStats(std::string_view name) : name(name) { }
+};
+
+/**
+ * @return The statistics for the locks called `name`, or `nullptr` if
+ * lock statistics are disabled.
+ */
+LockStats * getLockStats(std::string_view name);
+
+/**
+ * Call `fun` on the statistics of every named lock that has been
+ * acquired at least once.
+ */
+void forEachLockStats(std::function<void(const LockStats &)> fun);
+
+/**
+ * Render the lock statistics as a table, slowest locks first.
+ */
+std::string showLockStats();
+
+}
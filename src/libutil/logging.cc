@@ -1,8 +1,11 @@
 #include "logging.hh"
 #include "util.hh"
 #include "config.hh"
+#include "sync.hh"
+#include "tracing.hh"
 
 #include <atomic>
+#include <chrono>
 #include <nlohmann/json.hpp>
 #include <iostream>
 
@@ -126,10 +129,33 @@ Logger * makeSimpleLogger(bool printBuildLogs)
 
 std::atomic<uint64_t> nextId{0};
 
+static std::string showActivityType(ActivityType type)
+{
+    switch (type) {
+    case actCopyPath: return "copy path";
+    case actFileTransfer: return "file transfer";
+    case actRealise: return "realise";
+    case actCopyPaths: return "copy paths";
+    case actBuilds: return "builds";
+    case actBuild: return "build";
+    case actOptimiseStore: return "optimise store";
+    case actVerifyPaths: return "verify paths";
+    case actSubstitute: return "substitute";
+    case actQueryPathInfo: return "query path info";
+    case actPostBuildHook: return "post-build hook";
+    case actBuildWaiting: return "build waiting";
+    default: return fmt("activity %d", type);
+    }
+}
+
 Activity::Activity(Logger & logger, Verbosity lvl, ActivityType type,
     const std::string & s, const Logger::Fields & fields, ActivityId parent)
     : logger(logger), id(nextId++ + (((uint64_t) getpid()) << 32))
 {
+    if (tracingEnabled.load(std::memory_order_relaxed)) {
+        traceName = s.empty() ? showActivityType(type) : s;
+        traceStart = std::chrono::steady_clock::now();
+    }
     logger.startActivity(id, lvl, type, s, fields, parent);
 }
 
@@ -151,7 +177,24 @@ void to_json(nlohmann::json & json, std::shared_ptr<AbstractPos> pos)
 struct JSONLogger : Logger {
     Logger & prevLogger;
 
-    JSONLogger(Logger & prevLogger) : prevLogger(prevLogger) { }
+    /**
+     * Progress results are written at most this often per activity,
+     * since copies and downloads report progress for every chunk.
+     */
+    static constexpr std::chrono::milliseconds progressInterval{100};
+
+    struct Progress
+    {
+        std::chrono::steady_clock::time_point lastWritten;
+        std::optional<nlohmann::json> pending;
+    };
+
+    Sync<std::map<ActivityId, Progress>> progress_;
+
+    JSONLogger(Logger & prevLogger) : prevLogger(prevLogger)
+    {
+        progress_.setName("json-logger");
+    }
 
     bool isVerbose() override {
         return true;
@@ -225,8 +268,24 @@ struct JSONLogger : Logger {
         write(json);
     }
 
+    /* Write the progress of `act` that was held back, so that it
+       precedes any later event of the activity. */
+    void flushProgress(ActivityId act, bool stop)
+    {
+        auto progress(progress_.lock());
+        auto i = progress->find(act);
+        if (i == progress->end()) return;
+        if (i->second.pending) write(*i->second.pending);
+        if (stop)
+            progress->erase(i);
+        else
+            i->second.pending.reset();
+    }
+
     void stopActivity(ActivityId act) override
     {
+        flushProgress(act, true);
+
         nlohmann::json json;
         json["action"] = "stop";
         json["id"] = act;
@@ -240,6 +299,23 @@ struct JSONLogger : Logger {
         json["id"] = act;
         json["type"] = type;
         addFields(json, fields);
+
+        if (type == resProgress) {
+            auto now = std::chrono::steady_clock::now();
+            bool finished = fields.size() >= 2 && fields[0].i == fields[1].i;
+            auto progress(progress_.lock());
+            auto & p = (*progress)[act];
+            if (!finished && now < p.lastWritten + progressInterval) {
+                p.pending = std::move(json);
+                return;
+            }
+            p.lastWritten = now;
+            p.pending.reset();
+            write(json);
+            return;
+        }
+
+        flushProgress(act, false);
         write(json);
     }
 };
@@ -322,6 +398,8 @@ bool handleJSONLogMessage(const std::string & msg,
 Activity::~Activity()
 {
     try {
+        if (!traceName.empty())
+            traceAsync("activity", std::move(traceName), id, traceStart, std::chrono::steady_clock::now());
         logger.stopActivity(id);
     } catch (...) {
         ignoreException();
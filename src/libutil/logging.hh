@@ -7,6 +7,8 @@
 
 #include <nlohmann/json_fwd.hpp>
 
+#include <chrono>
+
 namespace nix {
 
 typedef enum {
@@ -127,6 +129,17 @@ struct Activity
 
     const ActivityId id;
 
+private:
+
+    /**
+     * The name and start of the trace span of this activity, if
+     * tracing is enabled.
+     */
+    std::string traceName;
+    std::chrono::steady_clock::time_point traceStart;
+
+public:
+
     Activity(Logger & logger, Verbosity lvl, ActivityType type, const std::string & s = "",
         const Logger::Fields & fields = {}, ActivityId parent = getCurActivity());
 
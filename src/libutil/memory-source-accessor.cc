@@ -0,0 +1,139 @@
+#include "memory-source-accessor.hh"
+
+namespace nix {
+
+MemorySourceAccessor::File * MemorySourceAccessor::open(const CanonPath & path, std::optional<File> create)
+{
+    File * cur = &root;
+
+    for (std::string_view name : path) {
+        auto * curDirP = std::get_if<File::Directory>(&cur->raw);
+        if (!curDirP) {
+            if (!create) return nullptr;
+            /* Replace a non-directory on the way by a directory, as
+               extracting the file to disk would. */
+            cur->raw = File::Directory {};
+            curDirP = std::get_if<File::Directory>(&cur->raw);
+        }
+        auto & curDir = *curDirP;
+
+        auto i = curDir.contents.find(name);
+        if (i == curDir.contents.end()) {
+            if (!create)
+                return nullptr;
+            i = curDir.contents.emplace_hint(i, std::string { name }, File { File::Directory {} });
+        }
+        cur = &i->second;
+    }
+
+    /* Creating a directory that already exists keeps its contents. */
+    if (create && !(std::holds_alternative<File::Directory>(create->raw)
+            && std::holds_alternative<File::Directory>(cur->raw)))
+        *cur = std::move(*create);
+
+    return cur;
+}
+
+std::string MemorySourceAccessor::readFile(const CanonPath & path)
+{
+    auto * f = open(path, std::nullopt);
+    if (!f)
+        throw Error("file '%s' does not exist", path);
+    if (auto * r = std::get_if<File::Regular>(&f->raw))
+        return r->contents;
+    else
+        throw Error("file '%s' is not a regular file", path);
+}
+
+bool MemorySourceAccessor::pathExists(const CanonPath & path)
+{
+    return open(path, std::nullopt);
+}
+
+SourceAccessor::Stat MemorySourceAccessor::lstat(const CanonPath & path)
+{
+    auto * f = open(path, std::nullopt);
+    if (!f)
+        throw Error("file '%s' does not exist", path);
+    return std::visit(overloaded {
+        [](const File::Regular & r) {
+            return Stat { .type = tRegular, .isExecutable = r.executable };
+        },
+        [](const File::Directory &) {
+            return Stat { .type = tDirectory };
+        },
+        [](const File::Symlink &) {
+            return Stat { .type = tSymlink };
+        },
+    }, f->raw);
+}
+
+SourceAccessor::DirEntries MemorySourceAccessor::readDirectory(const CanonPath & path)
+{
+    auto * f = open(path, std::nullopt);
+    if (!f)
+        throw Error("directory '%s' does not exist", path);
+    if (auto * d = std::get_if<File::Directory>(&f->raw)) {
+        DirEntries res;
+        for (auto & [name, file] : d->contents)
+            res.insert_or_assign(name, std::visit(overloaded {
+                [](const File::Regular &) { return tRegular; },
+                [](const File::Directory &) { return tDirectory; },
+                [](const File::Symlink &) { return tSymlink; },
+            }, file.raw));
+        return res;
+    } else
+        throw Error("file '%s' is not a directory", path);
+}
+
+std::string MemorySourceAccessor::readLink(const CanonPath & path)
+{
+    auto * f = open(path, std::nullopt);
+    if (!f)
+        throw Error("file '%s' does not exist", path);
+    if (auto * s = std::get_if<File::Symlink>(&f->raw))
+        return s->target;
+    else
+        throw Error("file '%s' is not a symbolic link", path);
+}
+
+void MemorySink::createDirectory(const Path & path)
+{
+    dst.open(CanonPath(path), MemorySourceAccessor::File { MemorySourceAccessor::File::Directory {} });
+}
+
+void MemorySink::createRegularFile(const Path & path)
+{
+    auto * f = dst.open(CanonPath(path), MemorySourceAccessor::File { MemorySourceAccessor::File::Regular {} });
+    currentFile = &std::get<MemorySourceAccessor::File::Regular>(f->raw);
+}
+
+void MemorySink::closeRegularFile()
+{
+    currentFile = nullptr;
+}
+
+void MemorySink::isExecutable()
+{
+    assert(currentFile);
+    currentFile->executable = true;
+}
+
+void MemorySink::preallocateContents(uint64_t size)
+{
+    assert(currentFile);
+    currentFile->contents.reserve(size);
+}
+
+void MemorySink::receiveContents(std::string_view data)
+{
+    assert(currentFile);
+    currentFile->contents += data;
+}
+
+void MemorySink::createSymlink(const Path & path, const std::string & target)
+{
+    dst.open(CanonPath(path), MemorySourceAccessor::File { MemorySourceAccessor::File::Symlink { .target = target } });
+}
+
+}
@@ -0,0 +1,81 @@
+#pragma once
+///@file
+
+#include "source-accessor.hh"
+#include "fs-sink.hh"
+
+#include <variant>
+
+namespace nix {
+
+/**
+ * An in-memory file system tree, e.g. to hold the contents of an
+ * archive so that it can be dumped as a NAR without writing it to
+ * disk first.
+ */
+struct MemorySourceAccessor : SourceAccessor
+{
+    struct File
+    {
+        struct Regular
+        {
+            bool executable = false;
+            std::string contents;
+        };
+
+        struct Directory
+        {
+            std::map<std::string, File, std::less<>> contents;
+        };
+
+        struct Symlink
+        {
+            std::string target;
+        };
+
+        std::variant<Regular, Directory, Symlink> raw;
+    };
+
+    File root { File::Directory {} };
+
+    /**
+     * Look up the file at `path`. If it doesn't exist and `create`
+     * is set, create it (replacing anything that was there), along
+     * with any missing parent directories.
+     *
+     * @return The file, or `nullptr` if it doesn't exist.
+     */
+    File * open(const CanonPath & path, std::optional<File> create);
+
+    std::string readFile(const CanonPath & path) override;
+    bool pathExists(const CanonPath & path) override;
+    Stat lstat(const CanonPath & path) override;
+    DirEntries readDirectory(const CanonPath & path) override;
+    std::string readLink(const CanonPath & path) override;
+};
+
+/**
+ * A `ParseSink` that writes into a `MemorySourceAccessor`.
+ */
+struct MemorySink : ParseSink
+{
+    MemorySourceAccessor & dst;
+
+    MemorySink(MemorySourceAccessor & dst) : dst(dst) { }
+
+    void createDirectory(const Path & path) override;
+
+    void createRegularFile(const Path & path) override;
+    void closeRegularFile() override;
+    void isExecutable() override;
+    void preallocateContents(uint64_t size) override;
+    void receiveContents(std::string_view data) override;
+
+    void createSymlink(const Path & path, const std::string & target) override;
+
+private:
+
+    MemorySourceAccessor::File::Regular * currentFile = nullptr;
+};
+
+}
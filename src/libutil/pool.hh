@@ -1,10 +1,12 @@
 #pragma once
 ///@file
 
+#include <chrono>
 #include <functional>
 #include <limits>
 #include <list>
 #include <memory>
+#include <optional>
 #include <cassert>
 
 #include "sync.hh"
@@ -54,6 +56,8 @@ private:
     {
         size_t inUse = 0;
         size_t max;
+        size_t burst = 0;
+        std::chrono::milliseconds burstDelay{0};
         std::vector<ref<R>> idle;
     };
 
@@ -69,6 +73,7 @@ public:
         : factory(factory)
         , validator(validator)
     {
+        state.setName("pool");
         auto state_(state.lock());
         state_->max = max;
     }
@@ -89,6 +94,19 @@ public:
         state_->max--;
     }
 
+    /**
+     * Allow up to `burst` instances beyond the capacity to be created
+     * for callers of get() that have waited longer than `delay` for
+     * an instance. These extra instances are destroyed rather than
+     * kept idle once they're returned.
+     */
+    void setBurst(size_t burst, std::chrono::milliseconds delay)
+    {
+        auto state_(state.lock());
+        state_->burst = burst;
+        state_->burstDelay = delay;
+    }
+
     ~Pool()
     {
         auto state_(state.lock());
@@ -118,7 +136,7 @@ public:
             if (!r) return;
             {
                 auto state_(pool.state.lock());
-                if (!bad)
+                if (!bad && state_->idle.size() + state_->inUse <= state_->max)
                     state_->idle.push_back(ref<R>(r));
                 assert(state_->inUse);
                 state_->inUse--;
@@ -133,14 +151,38 @@ public:
     };
 
     Handle get()
+    {
+        return std::move(*get(true));
+    }
+
+    /**
+     * Like get(), but return nothing rather than wait for an instance
+     * to become available.
+     */
+    std::optional<Handle> tryGet()
+    {
+        return get(false);
+    }
+
+private:
+
+    std::optional<Handle> get(bool wait)
     {
         {
             auto state_(state.lock());
 
             /* If we're over the maximum number of instance, we need
-               to wait until a slot becomes available. */
-            while (state_->idle.empty() && state_->inUse >= state_->max)
-                state_.wait(wakeup);
+               to wait until a slot becomes available, or until we've
+               waited long enough to exceed the maximum. */
+            auto deadline = std::chrono::steady_clock::now() + state_->burstDelay;
+            while (state_->idle.empty() && state_->inUse >= state_->max) {
+                if (!wait) return std::nullopt;
+                if (state_->inUse < state_->max + state_->burst) {
+                    if (std::chrono::steady_clock::now() >= deadline) break;
+                    state_.wait_until(wakeup, deadline);
+                } else
+                    state_.wait(wakeup);
+            }
 
             while (!state_->idle.empty()) {
                 auto p = state_->idle.back();
@@ -167,6 +209,42 @@ public:
         }
     }
 
+public:
+
+    /**
+     * Create instances, without handing them out, until there are at
+     * least `n` (but no more than the capacity). This can be called
+     * from several threads at once to create instances in parallel.
+     */
+    void prewarm(size_t n)
+    {
+        while (true) {
+            {
+                auto state_(state.lock());
+                if (state_->idle.size() + state_->inUse >= std::min(n, state_->max))
+                    return;
+                state_->inUse++;
+            }
+
+            std::shared_ptr<R> r;
+            try {
+                r = factory();
+            } catch (...) {
+                auto state_(state.lock());
+                state_->inUse--;
+                wakeup.notify_one();
+                throw;
+            }
+
+            {
+                auto state_(state.lock());
+                state_->idle.push_back(ref<R>(r));
+                state_->inUse--;
+            }
+            wakeup.notify_one();
+        }
+    }
+
     size_t count()
     {
         auto state_(state.lock());
@@ -187,6 +265,19 @@ public:
                 left.push_back(p);
         std::swap(state_->idle, left);
     }
+
+    /**
+     * Forget all idle instances without destroying them. This is
+     * meant for a child process created by fork(), where the idle
+     * instances (e.g. connections) still belong to the parent.
+     */
+    void forgetIdle()
+    {
+        auto state_(state.lock());
+        for (auto & p : state_->idle)
+            new ref<R>(p);
+        state_->idle.clear();
+    }
 };
 
 }
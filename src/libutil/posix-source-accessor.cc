@@ -1,12 +1,334 @@
 #include "posix-source-accessor.hh"
+#include "sync.hh"
+#include "thread-pool.hh"
+
+#include <list>
+#include <thread>
+#include <dirent.h>
+#include <fcntl.h>
 
 namespace nix {
 
+namespace {
+
+/**
+ * The identity of a version of a file. If any of these change, the
+ * file has (probably) been modified.
+ */
+struct FileKey
+{
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime, ctime;
+    long mtimeNsec, ctimeNsec;
+
+    FileKey(const struct stat & st)
+        : dev(st.st_dev)
+        , ino(st.st_ino)
+        , size(st.st_size)
+        , mtime(st.st_mtime)
+        , ctime(st.st_ctime)
+#if __APPLE__
+        , mtimeNsec(st.st_mtimespec.tv_nsec)
+        , ctimeNsec(st.st_ctimespec.tv_nsec)
+#else
+        , mtimeNsec(st.st_mtim.tv_nsec)
+        , ctimeNsec(st.st_ctim.tv_nsec)
+#endif
+    { }
+
+    bool operator < (const FileKey & other) const
+    {
+        return std::tie(dev, ino, size, mtime, mtimeNsec, ctime, ctimeNsec)
+            < std::tie(other.dev, other.ino, other.size, other.mtime, other.mtimeNsec, other.ctime, other.ctimeNsec);
+    }
+};
+
+/**
+ * A cache of recently read file contents, shared by all accessors,
+ * since the evaluator often reads the same file several times (e.g.
+ * to parse it, to hash it and to copy it to the store). Entries are
+ * evicted in LRU order to stay within a fixed memory budget.
+ */
+struct ContentCache
+{
+    static constexpr size_t maxFileSize = 4 * 1024 * 1024;
+    static constexpr size_t maxTotalSize = 64 * 1024 * 1024;
+
+    typedef std::list<FileKey> LRU;
+
+    std::map<FileKey, std::pair<std::shared_ptr<const std::string>, LRU::iterator>> entries;
+    LRU lru;
+    size_t totalSize = 0;
+
+    std::shared_ptr<const std::string> get(const FileKey & key)
+    {
+        auto i = entries.find(key);
+        if (i == entries.end()) return nullptr;
+        lru.splice(lru.end(), lru, i->second.second);
+        return i->second.first;
+    }
+
+    void add(const FileKey & key, std::shared_ptr<const std::string> contents)
+    {
+        if (contents->size() > maxFileSize || entries.count(key)) return;
+        while (totalSize + contents->size() > maxTotalSize) {
+            auto i = entries.find(lru.front());
+            totalSize -= i->second.first->size();
+            entries.erase(i);
+            lru.pop_front();
+        }
+        totalSize += contents->size();
+        entries.emplace(key, std::make_pair(std::move(contents), lru.insert(lru.end(), key)));
+    }
+};
+
+}
+
+static Sync<ContentCache> contentCache;
+
+struct PosixSourceAccessor::Prefetcher
+{
+    static constexpr size_t nrThreads = 8;
+    static constexpr size_t maxFileSize = 1024 * 1024;
+    static constexpr size_t maxBufferedSize = 64 * 1024 * 1024;
+
+    /**
+     * Don't bother with trees that have fewer files than this.
+     */
+    static constexpr size_t minFiles = 64;
+
+    /**
+     * The results of lstat() and readDirectory() for every file and
+     * directory in the tree, gathered in parallel before dumping. They
+     * are not modified after prefetch() returns, so they can be read
+     * without locking.
+     */
+    std::map<CanonPath, struct stat> stats;
+    std::map<CanonPath, DirEntries> directories;
+
+    /**
+     * The files to prefetch, in the order in which they will be
+     * read.
+     */
+    std::vector<CanonPath> files;
+    std::map<CanonPath, size_t> positions;
+
+    struct State
+    {
+        /**
+         * The next file to be read by a worker thread.
+         */
+        size_t next = 0;
+
+        /**
+         * The position of the next file that readFile() expects.
+         */
+        size_t consumed = 0;
+
+        size_t bufferedSize = 0;
+
+        /**
+         * Contents of files that have been read, or nothing if a
+         * file couldn't be read, in which case readFile() reads it
+         * itself.
+         */
+        std::map<size_t, std::optional<std::string>> ready;
+
+        bool quit = false;
+    };
+
+    Sync<State> state_;
+    std::condition_variable wakeup;
+    std::vector<std::thread> threads;
+
+    void worker()
+    {
+        while (true) {
+            size_t pos;
+            {
+                auto state(state_.lock());
+                while (!state->quit
+                    && state->next < files.size()
+                    && state->bufferedSize >= maxBufferedSize)
+                    state.wait(wakeup);
+                if (state->quit || state->next >= files.size()) return;
+                pos = state->next++;
+            }
+
+            std::optional<std::string> contents;
+            try {
+                contents = nix::readFile(files[pos].abs());
+            } catch (...) {
+            }
+
+            auto state(state_.lock());
+            if (pos >= state->consumed) {
+                if (contents) state->bufferedSize += contents->size();
+                state->ready.emplace(pos, std::move(contents));
+            }
+            wakeup.notify_all();
+        }
+    }
+
+    /**
+     * Return the contents of `path` if it has been (or is being)
+     * prefetched, waiting for it if necessary.
+     */
+    std::optional<std::string> get(const CanonPath & path)
+    {
+        auto i = positions.find(path);
+        if (i == positions.end()) return std::nullopt;
+        auto pos = i->second;
+
+        auto state(state_.lock());
+
+        /* The dumper skipped some files; drop them. */
+        if (state->consumed < pos) {
+            for (auto j = state->ready.begin(); j != state->ready.end() && j->first < pos; ) {
+                if (j->second) state->bufferedSize -= j->second->size();
+                j = state->ready.erase(j);
+            }
+            state->consumed = pos;
+            wakeup.notify_all();
+        }
+
+        if (pos < state->consumed) return std::nullopt;
+
+        while (!state->ready.count(pos)) {
+            /* Files are handed out in order, so if no worker has
+               taken this one yet, it's quicker to read it here. */
+            if (state->next <= pos) {
+                state->consumed = pos + 1;
+                state->next = pos + 1;
+                return std::nullopt;
+            }
+            state.wait(wakeup);
+        }
+
+        auto contents = std::move(state->ready[pos]);
+        state->ready.erase(pos);
+        if (contents) state->bufferedSize -= contents->size();
+        state->consumed = pos + 1;
+        wakeup.notify_all();
+        return contents;
+    }
+
+    ~Prefetcher()
+    {
+        state_.lock()->quit = true;
+        wakeup.notify_all();
+        for (auto & thread : threads)
+            thread.join();
+    }
+};
+
+static SourceAccessor::Type typeOf(const struct stat & st)
+{
+    return
+        S_ISREG(st.st_mode) ? SourceAccessor::tRegular :
+        S_ISDIR(st.st_mode) ? SourceAccessor::tDirectory :
+        S_ISLNK(st.st_mode) ? SourceAccessor::tSymlink :
+        SourceAccessor::tMisc;
+}
+
+void PosixSourceAccessor::prefetch(const CanonPath & root)
+{
+    auto prefetcher = std::make_shared<Prefetcher>();
+
+    struct stat rootSt;
+    if (::lstat(root.c_str(), &rootSt) || !S_ISDIR(rootSt.st_mode))
+        return;
+    prefetcher->stats.emplace(root, rootSt);
+
+    /* Scan the directories in parallel, since on network file
+       systems the walk is bounded by the latency of each
+       readdir()/lstat() call rather than by throughput. */
+    struct Scanned
+    {
+        std::map<CanonPath, struct stat> stats;
+        std::map<CanonPath, DirEntries> directories;
+        bool failed = false;
+    };
+    Sync<Scanned> scanned_;
+
+    ThreadPool pool(Prefetcher::nrThreads);
+
+    std::function<void(const CanonPath &)> scan;
+    scan = [&](const CanonPath & dir) {
+        checkInterrupt();
+
+        DirEntries entries;
+        std::vector<std::pair<CanonPath, struct stat>> children;
+
+        try {
+            for (auto & entry : nix::readDirectory(dir.abs())) {
+                auto child = dir + entry.name;
+                struct stat st;
+                if (::lstat(child.c_str(), &st))
+                    throw SysError("getting status of '%s'", child);
+                entries.emplace(entry.name, typeOf(st));
+                children.emplace_back(std::move(child), st);
+            }
+        } catch (SysError &) {
+            /* Let dumpPath() report the error. */
+            scanned_.lock()->failed = true;
+            return;
+        }
+
+        {
+            auto scanned(scanned_.lock());
+            scanned->directories.emplace(dir, std::move(entries));
+            for (auto & [child, st] : children)
+                scanned->stats.emplace(child, st);
+        }
+
+        for (auto & [child, st] : children)
+            if (S_ISDIR(st.st_mode))
+                pool.enqueue(std::bind(scan, child));
+    };
+
+    pool.enqueue(std::bind(scan, root));
+    pool.process();
+
+    {
+        auto scanned(scanned_.lock());
+        if (scanned->failed) return;
+        prefetcher->stats.merge(scanned->stats);
+        prefetcher->directories = std::move(scanned->directories);
+    }
+
+    /* The stats are ordered by path, which sorted component-wise is
+       the order in which NARs list files. */
+    for (auto & [path, st] : prefetcher->stats)
+        if (S_ISREG(st.st_mode) && (size_t) st.st_size <= Prefetcher::maxFileSize)
+            prefetcher->files.push_back(path);
+
+    this->prefetcher = prefetcher;
+
+    if (prefetcher->files.size() < Prefetcher::minFiles) return;
+
+    for (size_t i = 0; i < prefetcher->files.size(); ++i)
+        prefetcher->positions.emplace(prefetcher->files[i], i);
+
+    for (size_t i = 0; i < Prefetcher::nrThreads; ++i)
+        prefetcher->threads.emplace_back(&Prefetcher::worker, prefetcher.get());
+}
+
 void PosixSourceAccessor::readFile(
     const CanonPath & path,
     Sink & sink,
     std::function<void(uint64_t)> sizeCallback)
 {
+    if (prefetcher) {
+        if (auto contents = prefetcher->get(path)) {
+            sizeCallback(contents->size());
+            sink(*contents);
+            return;
+        }
+    }
+
     // FIXME: add O_NOFOLLOW since symlinks should be resolved by the
     // caller?
     AutoCloseFD fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
@@ -17,14 +339,36 @@ void PosixSourceAccessor::readFile(
     if (fstat(fd.get(), &st) == -1)
         throw SysError("statting file");
 
+    bool cacheable = S_ISREG(st.st_mode) && (size_t) st.st_size <= ContentCache::maxFileSize;
+
+    if (cacheable) {
+        if (auto contents = contentCache.lock()->get(st)) {
+            sizeCallback(contents->size());
+            sink(*contents);
+            return;
+        }
+    }
+
     sizeCallback(st.st_size);
 
     off_t left = st.st_size;
 
-    std::vector<unsigned char> buf(64 * 1024);
+    /* Large files can be copied by the kernel if the sink writes to a
+       file descriptor. This doesn't apply to files small enough to be
+       cached, since we need their contents anyway. */
+    if (!cacheable && S_ISREG(st.st_mode))
+        left -= sink.writeFromFd(fd.get(), left);
+
+    /* Read cacheable files in one go, straight into the buffer that
+       gets cached. */
+    std::string contents;
+    if (cacheable) contents.resize(st.st_size);
+
+    std::vector<unsigned char> buf(cacheable ? 0 : 64 * 1024);
     while (left) {
         checkInterrupt();
-        ssize_t rd = read(fd.get(), buf.data(), (size_t) std::min(left, (off_t) buf.size()));
+        char * p = cacheable ? contents.data() + (st.st_size - left) : (char *) buf.data();
+        ssize_t rd = read(fd.get(), p, (size_t) (cacheable ? left : std::min(left, (off_t) buf.size())));
         if (rd == -1) {
             if (errno != EINTR)
                 throw SysError("reading from file '%s'", showPath(path));
@@ -33,10 +377,15 @@ void PosixSourceAccessor::readFile(
             throw SysError("unexpected end-of-file reading '%s'", showPath(path));
         else {
             assert(rd <= left);
-            sink({(char *) buf.data(), (size_t) rd});
+            if (!cacheable) sink({p, (size_t) rd});
             left -= rd;
         }
     }
+
+    if (cacheable) {
+        sink(contents);
+        contentCache.lock()->add(st, std::make_shared<const std::string>(std::move(contents)));
+    }
 }
 
 bool PosixSourceAccessor::pathExists(const CanonPath & path)
@@ -46,21 +395,87 @@ bool PosixSourceAccessor::pathExists(const CanonPath & path)
 
 SourceAccessor::Stat PosixSourceAccessor::lstat(const CanonPath & path)
 {
-    auto st = nix::lstat(path.abs());
-    mtime = std::max(mtime, st.st_mtime);
+    const struct stat * st;
+    struct stat st2;
+    if (auto i = prefetcher ? get(prefetcher->stats, path) : nullptr)
+        st = i;
+    else {
+        st2 = nix::lstat(path.abs());
+        st = &st2;
+    }
+    mtime = std::max(mtime, st->st_mtime);
     return Stat {
-        .type =
-            S_ISREG(st.st_mode) ? tRegular :
-            S_ISDIR(st.st_mode) ? tDirectory :
-            S_ISLNK(st.st_mode) ? tSymlink :
-            tMisc,
-        .isExecutable = S_ISREG(st.st_mode) && st.st_mode & S_IXUSR
+        .type = typeOf(*st),
+        .isExecutable = S_ISREG(st->st_mode) && st->st_mode & S_IXUSR
     };
 }
 
+struct PosixSourceAccessor::DirectoryCache
+{
+    std::map<CanonPath, std::pair<FileKey, DirEntries>> entries;
+};
+
+void PosixSourceAccessor::cacheDirectories()
+{
+    if (!directoryCache)
+        directoryCache = std::make_shared<Sync<DirectoryCache>>();
+}
+
+/**
+ * Fill in the types of the entries of the directory `dirFd` that
+ * readdir() didn't report (`DT_UNKNOWN`), which some file systems
+ * (e.g. XFS without ftype, many FUSE and network file systems) do
+ * for every entry. Since on those file systems each fstatat() is
+ * bounded by latency, large batches are spread over a few threads.
+ * Entries that disappeared in the meantime keep an unknown type.
+ */
+static void resolveTypes(int dirFd, std::vector<std::pair<const std::string *, std::optional<SourceAccessor::Type> *>> & unknown)
+{
+    static constexpr size_t nrThreads = 8;
+    static constexpr size_t minParallel = 64;
+
+    auto resolve = [&](size_t start, size_t step) {
+        for (size_t n = start; n < unknown.size(); n += step) {
+            struct stat st;
+            if (fstatat(dirFd, unknown[n].first->c_str(), &st, AT_SYMLINK_NOFOLLOW) == 0)
+                *unknown[n].second = typeOf(st);
+        }
+    };
+
+    if (unknown.size() < minParallel) {
+        resolve(0, 1);
+        return;
+    }
+
+    ThreadPool pool(nrThreads);
+    for (size_t n = 0; n < nrThreads; ++n)
+        pool.enqueue(std::bind(resolve, n, nrThreads));
+    pool.process();
+}
+
 SourceAccessor::DirEntries PosixSourceAccessor::readDirectory(const CanonPath & path)
 {
+    if (prefetcher)
+        if (auto entries = get(prefetcher->directories, path))
+            return *entries;
+
+    /* A directory's mtime changes whenever an entry is added,
+       removed or renamed, so a single stat() is enough to tell
+       whether a cached listing is still valid. */
+    std::optional<FileKey> key;
+    if (directoryCache) {
+        struct stat st;
+        if (::stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+            key = FileKey(st);
+            auto cache(directoryCache->lock());
+            auto i = cache->entries.find(path);
+            if (i != cache->entries.end() && !(i->second.first < *key) && !(*key < i->second.first))
+                return i->second.second;
+        }
+    }
+
     DirEntries res;
+    std::vector<std::pair<const std::string *, std::optional<Type> *>> unknown;
     for (auto & entry : nix::readDirectory(path.abs())) {
         std::optional<Type> type;
         switch (entry.type) {
@@ -68,8 +483,19 @@ SourceAccessor::DirEntries PosixSourceAccessor::readDirectory(const CanonPath &
         case DT_LNK: type = Type::tSymlink; break;
         case DT_DIR: type = Type::tDirectory; break;
         }
-        res.emplace(entry.name, type);
+        auto i = res.emplace(entry.name, type).first;
+        if (!type) unknown.emplace_back(&i->first, &i->second);
+    }
+
+    if (!unknown.empty()) {
+        AutoCloseFD dirFd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dirFd)
+            resolveTypes(dirFd.get(), unknown);
     }
+
+    if (key)
+        directoryCache->lock()->entries.insert_or_assign(path, std::make_pair(*key, res));
+
     return res;
 }
 
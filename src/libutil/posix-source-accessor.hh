@@ -1,6 +1,7 @@
 #pragma once
 
 #include "source-accessor.hh"
+#include "sync.hh"
 
 namespace nix {
 
@@ -15,6 +16,39 @@ struct PosixSourceAccessor : SourceAccessor
      */
     time_t mtime = 0;
 
+    struct Prefetcher;
+
+    /**
+     * If set, readFile() takes the contents of small files from here.
+     */
+    std::shared_ptr<Prefetcher> prefetcher;
+
+    /**
+     * Scan the tree under `root` on a pool of threads, caching the
+     * results of lstat() and readDirectory(), then start reading the
+     * small regular files on the pool in the order in which
+     * dumpPath() reads them. This hides the I/O latency of
+     * serialising trees with many small files, while the consumer of
+     * the NAR (e.g. the hash) remains sequential. The accessor must
+     * not be used after the tree changes.
+     */
+    void prefetch(const CanonPath & root);
+
+    struct DirectoryCache;
+
+    /**
+     * If set, readDirectory() remembers its results, revalidating them
+     * against the directory's mtime with a single stat().
+     */
+    std::shared_ptr<Sync<DirectoryCache>> directoryCache;
+
+    /**
+     * Enable `directoryCache`. This is meant for long-lived accessors
+     * such as the evaluator's root accessor, which tend to list the
+     * same directories over and over.
+     */
+    void cacheDirectories();
+
     void readFile(
         const CanonPath & path,
         Sink & sink,
@@ -7,6 +7,7 @@
 #include <cstdlib>
 #include <mutex>
 #include <algorithm>
+#include <array>
 
 
 namespace nix {
@@ -15,39 +16,89 @@ namespace nix {
 static size_t refLength = 32; /* characters */
 
 
+/**
+ * The index of each character in `base32Chars`, or -1 if it isn't a
+ * base-32 character.
+ */
+static const std::array<int8_t, 256> & base32Index()
+{
+    static const auto table = []() {
+        std::array<int8_t, 256> table;
+        table.fill(-1);
+        for (unsigned int i = 0; i < base32Chars.size(); ++i)
+            table[(unsigned char) base32Chars[i]] = i;
+        return table;
+    }();
+    return table;
+}
+
+
+static size_t filterKey(const std::array<int8_t, 256> & index, const char * p)
+{
+    return
+        index[(unsigned char) p[0]] * 32 * 32
+        + index[(unsigned char) p[1]] * 32
+        + index[(unsigned char) p[2]];
+}
+
+
 static void search(
     std::string_view s,
     StringSet & hashes,
-    StringSet & seen)
+    StringSet & seen,
+    const RefScanSink::Filter & filter)
 {
-    static std::once_flag initialised;
-    static bool isBase32[256];
-    std::call_once(initialised, [](){
-        for (unsigned int i = 0; i < 256; ++i) isBase32[i] = false;
-        for (unsigned int i = 0; i < base32Chars.size(); ++i)
-            isBase32[(unsigned char) base32Chars[i]] = true;
-    });
+    auto & index = base32Index();
+
+    auto isBase32 = [&](char c) { return index[(unsigned char) c] >= 0; };
 
     for (size_t i = 0; i + refLength <= s.size(); ) {
+        /* Look for a window of `refLength` base-32 characters,
+           starting from the end so that we can skip past the first
+           non-base-32 character. In binary data, this usually skips
+           `refLength` bytes at a time. */
         int j;
         bool match = true;
         for (j = refLength - 1; j >= 0; --j)
-            if (!isBase32[(unsigned char) s[i + j]]) {
+            if (!isBase32(s[i + j])) {
                 i += j + 1;
                 match = false;
                 break;
             }
         if (!match) continue;
-        std::string ref(s.substr(i, refLength));
-        if (hashes.erase(ref)) {
-            debug("found reference to '%1%' at offset '%2%'", ref, i);
-            seen.insert(ref);
+
+        /* Slide the window along the run of base-32 characters,
+           checking only the character that enters the window. Each
+           candidate is first checked against the filter, so that we
+           rarely need a lookup in `hashes`. */
+        while (true) {
+            if (filter[filterKey(index, s.data() + i)]) {
+                std::string_view ref(s.data() + i, refLength);
+                auto h = hashes.find(std::string(ref));
+                if (h != hashes.end()) {
+                    debug("found reference to '%1%' at offset '%2%'", ref, i);
+                    seen.insert(hashes.extract(h));
+                }
+            }
+            ++i;
+            if (i + refLength > s.size() || !isBase32(s[i + refLength - 1])) break;
         }
-        ++i;
+
+        i += refLength;
     }
 }
 
 
+RefScanSink::RefScanSink(StringSet && hashes)
+    : hashes(std::move(hashes))
+{
+    auto & index = base32Index();
+    for (auto & hash : this->hashes)
+        if (hash.size() >= 3 && filterKey(index, hash.data()) < filter.size())
+            filter.set(filterKey(index, hash.data()));
+}
+
+
 void RefScanSink::operator () (std::string_view data)
 {
     /* It's possible that a reference spans the previous and current
@@ -56,9 +107,9 @@ void RefScanSink::operator () (std::string_view data)
     auto s = tail;
     auto tailLen = std::min(data.size(), refLength);
     s.append(data.data(), tailLen);
-    search(s, hashes, seen);
+    search(s, hashes, seen, filter);
 
-    search(data, hashes, seen);
+    search(data, hashes, seen, filter);
 
     auto rest = refLength - tailLen;
     if (rest < tail.size())
@@ -3,6 +3,8 @@
 
 #include "hash.hh"
 
+#include <bitset>
+
 namespace nix {
 
 class RefScanSink : public Sink
@@ -14,8 +16,19 @@ class RefScanSink : public Sink
 
 public:
 
-    RefScanSink(StringSet && hashes) : hashes(hashes)
-    { }
+    /**
+     * A bitmap of the first three characters of the hashes being
+     * searched for, used to reject most candidates cheaply.
+     */
+    typedef std::bitset<32 * 32 * 32> Filter;
+
+private:
+
+    Filter filter;
+
+public:
+
+    RefScanSink(StringSet && hashes);
 
     StringSet & getResult()
     { return seen; }
@@ -1,15 +1,47 @@
 #include "serialise.hh"
+#include "thread-pipe.hh"
+#include "config.hh"
 #include "util.hh"
 
 #include <cstring>
 #include <cerrno>
 #include <memory>
 
+#include <sys/uio.h>
+
 #include <boost/coroutine2/coroutine.hpp>
 
+#if __linux__
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 
 namespace nix {
 
+struct FdBufferSettings : Config
+{
+    Setting<size_t> fdBufferSize{this, 32 * 1024, "fd-buffer-size",
+        R"(
+          The size in bytes of the buffers used when reading from or
+          writing to files, pipes and sockets, in particular the
+          connections between Nix clients and the Nix daemon, and to
+          remote stores over SSH. Larger buffers mean fewer system
+          calls when transferring large amounts of data, e.g. in
+          `nix copy`.
+        )"};
+};
+
+static FdBufferSettings fdBufferSettings;
+
+static GlobalConfig::Register rFdBufferSettings(&fdBufferSettings);
+
+size_t getFdBufferSize()
+{
+    return std::max(fdBufferSettings.fdBufferSize.get(), (size_t) 4096);
+}
+
 
 void BufferedSink::operator () (std::string_view data)
 {
@@ -19,8 +51,7 @@ void BufferedSink::operator () (std::string_view data)
         /* Optimisation: bypass the buffer if the data exceeds the
            buffer size. */
         if (bufPos + data.size() >= bufSize) {
-            flush();
-            writeUnbuffered(data);
+            flushAndWrite(data);
             break;
         }
         /* Otherwise, copy the bytes to the buffer.  Flush the buffer
@@ -60,6 +91,86 @@ void FdSink::writeUnbuffered(std::string_view data)
 }
 
 
+void FdSink::flushAndWrite(std::string_view data)
+{
+    std::string_view buffered(buffer.get(), bufPos);
+    bufPos = 0;
+
+    written += buffered.size() + data.size();
+
+    while (!buffered.empty() || !data.empty()) {
+        checkInterrupt();
+        struct iovec iov[2] = {
+            { (void *) buffered.data(), buffered.size() },
+            { (void *) data.data(), data.size() },
+        };
+        auto skip = buffered.empty() ? 1 : 0;
+        ssize_t res = writev(fd, iov + skip, 2 - skip);
+        if (res == -1) {
+            if (errno == EINTR) continue;
+            _good = false;
+            throw SysError("writing to file");
+        }
+        auto n = std::min((size_t) res, buffered.size());
+        buffered.remove_prefix(n);
+        data.remove_prefix(res - n);
+    }
+}
+
+
+uint64_t FdSink::writeFromFd(int srcFd, uint64_t size)
+{
+#if __linux__
+    if (noZeroCopy || !_good) return 0;
+
+    /* Anything we buffered must come first. */
+    flush();
+
+    /* copy_file_range() lets file systems share or copy extents
+       themselves, but only works between regular files. sendfile()
+       works for any destination, in particular sockets and pipes. */
+    struct stat st;
+    bool useCopyFileRange = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+
+    uint64_t done = 0;
+    while (done < size) {
+        checkInterrupt();
+        size_t chunk = std::min(size - done, (uint64_t) 1 << 30);
+        ssize_t n = useCopyFileRange
+            ? copy_file_range(srcFd, nullptr, fd, nullptr, chunk, 0)
+            : sendfile(fd, srcFd, nullptr, chunk);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            if (useCopyFileRange
+                && (errno == EXDEV || errno == EINVAL || errno == ENOSYS
+                    || errno == EOPNOTSUPP || errno == EBADF))
+            {
+                useCopyFileRange = false;
+                continue;
+            }
+            if (errno == EINVAL || errno == ENOSYS) {
+                noZeroCopy = true;
+                break;
+            }
+            /* E.g. a non-blocking destination that is full; let the
+               caller write the rest. */
+            if (errno == EAGAIN) break;
+            _good = false;
+            throw SysError("writing to file");
+        }
+        /* Premature end of file; the caller will notice. */
+        if (n == 0) break;
+        done += n;
+        written += n;
+    }
+
+    return done;
+#else
+    return 0;
+#endif
+}
+
+
 bool FdSink::good()
 {
     return _good;
@@ -101,6 +212,11 @@ std::string Source::drain()
 
 size_t BufferedSource::read(char * data, size_t len)
 {
+    /* Optimisation: bypass the buffer if it's empty and the caller
+       wants at least as much data as it can hold. */
+    if (!bufPosIn && len >= bufSize)
+        return readUnbuffered(data, len);
+
     if (!buffer) buffer = decltype(buffer)(new char[bufSize]);
 
     if (!bufPosIn) bufPosIn = readUnbuffered(buffer.get(), bufSize);
@@ -266,10 +382,61 @@ std::unique_ptr<FinishSink> sourceToSink(std::function<void(Source &)> fun)
 }
 
 
-std::unique_ptr<Source> sinkToSource(
+static std::unique_ptr<Source> threadSinkToSource(
     std::function<void(Sink &)> fun,
     std::function<void()> eof)
 {
+    struct ThreadSinkToSource : Source
+    {
+        std::function<void(Sink &)> fun;
+        ThreadPipe pipe;
+        ThreadPipe::Reader reader;
+        std::thread thread;
+
+        ThreadSinkToSource(std::function<void(Sink &)> fun, std::function<void()> eof)
+            : fun(fun), reader(pipe, eof)
+        {
+        }
+
+        ~ThreadSinkToSource()
+        {
+            if (thread.joinable()) {
+                pipe.cancel();
+                thread.join();
+            }
+        }
+
+        size_t read(char * data, size_t len) override
+        {
+            if (!thread.joinable())
+                thread = std::thread([this, act(getCurActivity())]() {
+                    PushActivity pact(act);
+                    try {
+                        ThreadPipe::Writer sink(pipe);
+                        fun(sink);
+                        sink.flush();
+                        pipe.close();
+                    } catch (...) {
+                        pipe.close(std::current_exception());
+                    }
+                });
+
+            return reader.read(data, len);
+        }
+    };
+
+    return std::make_unique<ThreadSinkToSource>(fun, eof);
+}
+
+
+std::unique_ptr<Source> sinkToSource(
+    std::function<void(Sink &)> fun,
+    std::function<void()> eof,
+    SinkToSourceMode mode)
+{
+    if (mode == SinkToSourceMode::Thread)
+        return threadSinkToSource(fun, eof);
+
     struct SinkToSource : Source
     {
         typedef boost::coroutines2::coroutine<std::string> coro_t;
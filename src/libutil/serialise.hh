@@ -19,6 +19,16 @@ struct Sink
     virtual ~Sink() { }
     virtual void operator () (std::string_view data) = 0;
     virtual bool good() { return true; }
+
+    /**
+     * Write up to `size` bytes read from the current offset of `fd`,
+     * which must be a regular file, advancing that offset. Sinks that
+     * write to a file descriptor can override this to let the kernel
+     * copy the data without passing it through user space. Returns
+     * the number of bytes written; the caller must write the
+     * remainder in the usual way.
+     */
+    virtual uint64_t writeFromFd(int fd, uint64_t size) { return 0; }
 };
 
 /**
@@ -56,9 +66,27 @@ struct BufferedSink : virtual Sink
 protected:
 
     virtual void writeUnbuffered(std::string_view data) = 0;
+
+    /**
+     * Write out the buffer followed by `data`, which is too big to
+     * buffer. Sinks that can write both at once should override
+     * this.
+     */
+    virtual void flushAndWrite(std::string_view data)
+    {
+        flush();
+        writeUnbuffered(data);
+    }
 };
 
 
+/**
+ * The buffer size of `FdSink` and `FdSource`, as set by the
+ * `fd-buffer-size` setting.
+ */
+size_t getFdBufferSize();
+
+
 /**
  * Abstract source of binary data.
  */
@@ -120,8 +148,8 @@ struct FdSink : BufferedSink
     int fd;
     size_t written = 0;
 
-    FdSink() : fd(-1) { }
-    FdSink(int fd) : fd(fd) { }
+    FdSink() : BufferedSink(getFdBufferSize()), fd(-1) { }
+    FdSink(int fd) : BufferedSink(getFdBufferSize()), fd(fd) { }
     FdSink(FdSink&&) = default;
 
     FdSink & operator=(FdSink && s)
@@ -130,6 +158,7 @@ struct FdSink : BufferedSink
         fd = s.fd;
         s.fd = -1;
         written = s.written;
+        noZeroCopy = s.noZeroCopy;
         return *this;
     }
 
@@ -137,10 +166,27 @@ struct FdSink : BufferedSink
 
     void writeUnbuffered(std::string_view data) override;
 
+    uint64_t writeFromFd(int fd, uint64_t size) override;
+
     bool good() override;
 
+protected:
+
+    /**
+     * Write the buffer and `data` with a single writev() call, so
+     * that e.g. a frame header and its payload don't need separate
+     * system calls.
+     */
+    void flushAndWrite(std::string_view data) override;
+
 private:
     bool _good = true;
+
+    /**
+     * Whether the kernel refused to copy to `fd` directly, in which
+     * case we don't try again.
+     */
+    bool noZeroCopy = false;
 };
 
 
@@ -152,8 +198,8 @@ struct FdSource : BufferedSource
     int fd;
     size_t read = 0;
 
-    FdSource() : fd(-1) { }
-    FdSource(int fd) : fd(fd) { }
+    FdSource() : BufferedSource(getFdBufferSize()), fd(-1) { }
+    FdSource(int fd) : BufferedSource(getFdBufferSize()), fd(fd) { }
     FdSource(FdSource&&) = default;
 
     FdSource& operator=(FdSource && s)
@@ -332,15 +378,35 @@ struct ChainSource : Source
 
 std::unique_ptr<FinishSink> sourceToSink(std::function<void(Source &)> fun);
 
+/**
+ * How sinkToSource() runs the function that produces the data.
+ */
+enum struct SinkToSourceMode {
+    /**
+     * As a coroutine, on the thread that reads from the source. The
+     * function only runs while the source is being read.
+     */
+    Coroutine,
+    /**
+     * On a separate thread, which writes into a bounded buffer that
+     * the source reads from, so that producing and consuming the
+     * data can happen at the same time. This is only worth it for
+     * large streams, and the function must be safe to run on another
+     * thread; in particular, it must not call into the evaluator.
+     */
+    Thread,
+};
+
 /**
  * Convert a function that feeds data into a Sink into a Source. The
- * Source executes the function as a coroutine.
+ * function is started when the source is first read from.
  */
 std::unique_ptr<Source> sinkToSource(
     std::function<void(Sink &)> fun,
     std::function<void()> eof = []() {
         throw EndOfFile("coroutine has finished");
-    });
+    },
+    SinkToSourceMode mode = SinkToSourceMode::Coroutine);
 
 
 void writePadding(size_t len, Sink & sink);
@@ -458,21 +524,32 @@ struct FramedSource : Source
 {
     Source & from;
     bool eof = false;
-    std::vector<char> pending;
-    size_t pos = 0;
+
+    /**
+     * The number of bytes left in the current frame. They are read
+     * directly into the caller's buffer.
+     */
+    uint64_t remaining = 0;
 
     FramedSource(Source & from) : from(from)
     { }
 
     ~FramedSource()
     {
-        if (!eof) {
-            while (true) {
-                auto n = readInt(from);
-                if (!n) break;
-                std::vector<char> data(n);
-                from(data.data(), n);
+        try {
+            if (!eof) {
+                char buf[8192];
+                while (true) {
+                    while (remaining) {
+                        auto n = from.read(buf, std::min(remaining, (uint64_t) sizeof(buf)));
+                        remaining -= n;
+                    }
+                    remaining = readNum<uint64_t>(from);
+                    if (!remaining) break;
+                }
             }
+        } catch (...) {
+            ignoreException();
         }
     }
 
@@ -480,20 +557,16 @@ struct FramedSource : Source
     {
         if (eof) throw EndOfFile("reached end of FramedSource");
 
-        if (pos >= pending.size()) {
-            size_t len = readInt(from);
-            if (!len) {
+        if (!remaining) {
+            remaining = readNum<uint64_t>(from);
+            if (!remaining) {
                 eof = true;
                 return 0;
             }
-            pending = std::vector<char>(len);
-            pos = 0;
-            from(pending.data(), len);
         }
 
-        auto n = std::min(len, pending.size() - pos);
-        memcpy(data, pending.data() + pos, n);
-        pos += n;
+        auto n = from.read(data, std::min((uint64_t) len, remaining));
+        remaining -= n;
         return n;
     }
 };
@@ -509,7 +582,16 @@ struct FramedSink : nix::BufferedSink
     BufferedSink & to;
     std::exception_ptr & ex;
 
-    FramedSink(BufferedSink & to, std::exception_ptr & ex) : to(to), ex(ex)
+    /**
+     * The size of the frames in which small writes are collected.
+     * Writes of at least `getFdBufferSize()` bytes are sent as a
+     * single frame together with the buffered data, without copying
+     * them.
+     */
+    static constexpr size_t frameSize = 256 * 1024;
+
+    FramedSink(BufferedSink & to, std::exception_ptr & ex)
+        : BufferedSink(std::max(getFdBufferSize(), frameSize)), to(to), ex(ex)
     { }
 
     ~FramedSink()
@@ -522,7 +604,29 @@ struct FramedSink : nix::BufferedSink
         }
     }
 
+    void operator () (std::string_view data) override
+    {
+        if (data.size() >= getFdBufferSize())
+            flushAndWrite(data);
+        else
+            BufferedSink::operator () (data);
+    }
+
     void writeUnbuffered(std::string_view data) override
+    {
+        writeFrame(data, {});
+    }
+
+    void flushAndWrite(std::string_view data) override
+    {
+        std::string_view buffered(buffer.get(), bufPos);
+        bufPos = 0;
+        writeFrame(buffered, data);
+    }
+
+private:
+
+    void writeFrame(std::string_view data1, std::string_view data2)
     {
         /* Don't send more data if the remote has
             encountered an error. */
@@ -531,9 +635,10 @@ struct FramedSink : nix::BufferedSink
             ex = nullptr;
             std::rethrow_exception(ex2);
         }
-        to << data.size();
-        to(data);
-    };
+        to << data1.size() + data2.size();
+        to(data1);
+        to(data2);
+    }
 };
 
 /**
@@ -0,0 +1,179 @@
+#pragma once
+///@file
+
+#include <array>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace nix {
+
+/**
+ * A thread-safe cache of bounded size. The keys are distributed over
+ * a number of shards, each with its own lock, and lookups only take a
+ * shared lock, so concurrent lookups don't contend with each other.
+ *
+ * Instead of maintaining an exact LRU order, which would require
+ * every lookup to modify the cache, each entry has a "referenced"
+ * bit that is set by lookups. When a shard is full, the CLOCK
+ * algorithm evicts the first entry whose bit is clear, clearing the
+ * bits it passes over.
+ */
+template<typename Key, typename Value, typename Hash = std::hash<Key>>
+class ShardedCache
+{
+private:
+
+    static constexpr size_t nrShards = 16;
+
+    /**
+     * Shards are cache-line aligned, and keep their own counters, so
+     * that threads working on different shards don't share memory.
+     */
+    struct alignas(64) Shard
+    {
+        std::shared_mutex mutex;
+        std::unordered_map<Key, size_t, Hash> index;
+        std::vector<std::pair<Key, Value>> slots;
+        std::vector<size_t> freeSlots;
+        std::unique_ptr<std::atomic<bool>[]> referenced;
+        size_t capacity = 0;
+        size_t hand = 0;
+        std::atomic<uint64_t> hits{0}, misses{0}, evictions{0};
+    };
+
+    std::array<Shard, nrShards> shards;
+
+    uint64_t sum(std::atomic<uint64_t> Shard::* counter) const
+    {
+        uint64_t n = 0;
+        for (auto & shard : shards)
+            n += (shard.*counter).load(std::memory_order_relaxed);
+        return n;
+    }
+
+    Shard & getShard(const Key & key)
+    {
+        return shards[Hash()(key) % nrShards];
+    }
+
+public:
+
+    ShardedCache(size_t capacity)
+    {
+        for (auto & shard : shards) {
+            shard.capacity = (capacity + nrShards - 1) / nrShards;
+            shard.referenced = std::make_unique<std::atomic<bool>[]>(shard.capacity);
+        }
+    }
+
+    /**
+     * Insert or update an item in the cache.
+     */
+    void upsert(const Key & key, const Value & value)
+    {
+        auto & shard(getShard(key));
+        if (shard.capacity == 0) return;
+
+        std::unique_lock lock(shard.mutex);
+
+        size_t slot;
+
+        if (auto i = shard.index.find(key); i != shard.index.end()) {
+            slot = i->second;
+            shard.slots[slot].second = value;
+            shard.referenced[slot].store(true, std::memory_order_relaxed);
+        }
+
+        else {
+            if (!shard.freeSlots.empty()) {
+                slot = shard.freeSlots.back();
+                shard.freeSlots.pop_back();
+                shard.slots[slot] = {key, value};
+            } else if (shard.slots.size() < shard.capacity) {
+                slot = shard.slots.size();
+                shard.slots.emplace_back(key, value);
+            } else {
+                /* Evict the first entry that hasn't been looked up
+                   since the hand last passed it. */
+                while (shard.referenced[shard.hand].exchange(false, std::memory_order_relaxed))
+                    shard.hand = (shard.hand + 1) % shard.capacity;
+                slot = shard.hand;
+                shard.hand = (shard.hand + 1) % shard.capacity;
+                shard.index.erase(shard.slots[slot].first);
+                shard.slots[slot] = {key, value};
+                shard.evictions.fetch_add(1, std::memory_order_relaxed);
+            }
+            /* New entries start out unreferenced, so that a burst
+               of insertions doesn't push out entries that are
+               actually being looked up. */
+            shard.referenced[slot].store(false, std::memory_order_relaxed);
+            shard.index.emplace(key, slot);
+        }
+    }
+
+    bool erase(const Key & key)
+    {
+        auto & shard(getShard(key));
+        std::unique_lock lock(shard.mutex);
+        auto i = shard.index.find(key);
+        if (i == shard.index.end()) return false;
+        auto slot = i->second;
+        shard.index.erase(i);
+        /* Don't keep the value alive in the unused slot. */
+        shard.slots[slot].second = Value();
+        shard.referenced[slot].store(false, std::memory_order_relaxed);
+        shard.freeSlots.push_back(slot);
+        return true;
+    }
+
+    /**
+     * Look up an item in the cache, marking it as recently used.
+     */
+    std::optional<Value> get(const Key & key)
+    {
+        auto & shard(getShard(key));
+        std::shared_lock lock(shard.mutex);
+        auto i = shard.index.find(key);
+        if (i == shard.index.end()) {
+            shard.misses.fetch_add(1, std::memory_order_relaxed);
+            return {};
+        }
+        shard.hits.fetch_add(1, std::memory_order_relaxed);
+        shard.referenced[i->second].store(true, std::memory_order_relaxed);
+        return shard.slots[i->second].second;
+    }
+
+    size_t size()
+    {
+        size_t n = 0;
+        for (auto & shard : shards) {
+            std::shared_lock lock(shard.mutex);
+            n += shard.index.size();
+        }
+        return n;
+    }
+
+    void clear()
+    {
+        for (auto & shard : shards) {
+            std::unique_lock lock(shard.mutex);
+            shard.index.clear();
+            shard.slots.clear();
+            shard.freeSlots.clear();
+            shard.hand = 0;
+            for (size_t i = 0; i < shard.capacity; ++i)
+                shard.referenced[i].store(false, std::memory_order_relaxed);
+        }
+    }
+
+    uint64_t getHits() const { return sum(&Shard::hits); }
+    uint64_t getMisses() const { return sum(&Shard::misses); }
+    uint64_t getEvictions() const { return sum(&Shard::evictions); }
+};
+
+}
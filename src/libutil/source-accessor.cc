@@ -17,6 +17,7 @@ std::string SourceAccessor::readFile(const CanonPath & path)
     readFile(path, sink, [&](uint64_t _size)
     {
         size = _size;
+        sink.s.reserve(_size);
     });
     assert(size && *size == sink.s.size());
     return std::move(sink.s);
@@ -0,0 +1,87 @@
+#include "startup-profile.hh"
+#include "sync.hh"
+#include "util.hh"
+
+#include <algorithm>
+
+namespace nix {
+
+namespace {
+
+struct Phase
+{
+    std::string name;
+    unsigned int depth;
+    std::chrono::steady_clock::time_point start, end;
+};
+
+}
+
+/* Never destroyed, since phases may end in static destructors. */
+static Sync<std::vector<Phase>> & phases()
+{
+    static auto phases = new Sync<std::vector<Phase>>;
+    return *phases;
+}
+
+static const auto processStart = std::chrono::steady_clock::now();
+
+/* Bounds the memory used by long-running processes that open stores
+   repeatedly. */
+static constexpr size_t maxPhases = 1024;
+
+/* Only phases in the same thread are nested. */
+thread_local unsigned int phaseDepth = 0;
+
+StartupPhase::StartupPhase(std::string name)
+    : name(std::move(name))
+    , start(std::chrono::steady_clock::now())
+    , depth(phaseDepth++)
+    , span("startup", "%s", this->name)
+{
+}
+
+StartupPhase::~StartupPhase()
+{
+    phaseDepth--;
+    try {
+        auto phases_(phases().lock());
+        if (phases_->size() >= maxPhases) return;
+        phases_->push_back(Phase {
+            .name = std::move(name),
+            .depth = depth,
+            .start = start,
+            .end = std::chrono::steady_clock::now(),
+        });
+    } catch (...) {
+        ignoreException();
+    }
+}
+
+std::string showStartupProfile()
+{
+    auto sorted = *phases().lock();
+
+    /* Phases are recorded when they end, i.e. children before their
+       parents. */
+    std::stable_sort(sorted.begin(), sorted.end(), [](const Phase & a, const Phase & b) {
+        return a.start < b.start || (a.start == b.start && a.depth < b.depth);
+    });
+
+    auto ms = [](auto d) {
+        return std::chrono::duration<double, std::milli>(d).count();
+    };
+
+    std::string res = fmt("%10s %10s  %s\n", "start (ms)", "time (ms)", "phase");
+    for (auto & phase : sorted)
+        res += fmt("%10.2f %10.2f  %s%s\n",
+            ms(phase.start - processStart),
+            ms(phase.end - phase.start),
+            std::string(phase.depth * 2, ' '),
+            phase.name);
+    res += fmt("%10s %10.2f  %s\n", "", ms(std::chrono::steady_clock::now() - processStart), "total");
+
+    return res;
+}
+
+}
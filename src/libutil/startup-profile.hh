@@ -0,0 +1,41 @@
+#pragma once
+///@file
+
+#include "tracing.hh"
+
+#include <chrono>
+
+namespace nix {
+
+/**
+ * Record the lifetime of this object as a phase of process startup
+ * (loading the configuration, opening the store, ...), to be shown
+ * by `showStartupProfile()`. Phases are always recorded, since there
+ * are only a handful of them and the profile is requested by a flag
+ * that is parsed after most of them have finished. They are also
+ * recorded as trace spans if tracing is enabled.
+ */
+class StartupPhase
+{
+    std::string name;
+    std::chrono::steady_clock::time_point start;
+    unsigned int depth;
+    TraceSpan span;
+
+public:
+
+    StartupPhase(std::string name);
+
+    StartupPhase(const StartupPhase &) = delete;
+
+    ~StartupPhase();
+};
+
+/**
+ * @return A table of the phases recorded by `StartupPhase` so far,
+ * in the order in which they started, nested phases indented under
+ * their parents, with the time spent in each.
+ */
+std::string showStartupProfile();
+
+}
@@ -5,6 +5,10 @@
 #include <mutex>
 #include <condition_variable>
 #include <cassert>
+#include <chrono>
+
+#include "finally.hh"
+#include "lock-stats.hh"
 
 namespace nix {
 
@@ -23,6 +27,10 @@ namespace nix {
  *
  * Here, "data" is automatically unlocked when "data_" goes out of
  * scope.
+ *
+ * Instances that are given a name with `setName()` record how often
+ * and how long they are waited for and held, if lock statistics are
+ * enabled (see `getLockStats()`).
  */
 template<class T, class M = std::mutex>
 class Sync
@@ -30,6 +38,7 @@ class Sync
 private:
     M mutex;
     T data;
+    LockStats * stats = nullptr;
 
 public:
 
@@ -37,24 +46,69 @@ public:
     Sync(const T & data) : data(data) { }
     Sync(T && data) noexcept : data(std::move(data)) { }
 
+    /**
+     * Record contention statistics for this instance under `name`.
+     * Instances with the same name share their statistics.
+     */
+    void setName(std::string_view name)
+    {
+        stats = getLockStats(name);
+    }
+
     class Lock
     {
     private:
         Sync * s;
         std::unique_lock<M> lk;
+        std::chrono::steady_clock::time_point acquired;
         friend Sync;
-        Lock(Sync * s) : s(s), lk(s->mutex) { }
+
+        Lock(Sync * s) : s(s), lk(s->mutex, std::defer_lock)
+        {
+            if (!s->stats) {
+                lk.lock();
+                return;
+            }
+            s->stats->acquisitions.fetch_add(1, std::memory_order_relaxed);
+            if (!lk.try_lock()) {
+                s->stats->contended.fetch_add(1, std::memory_order_relaxed);
+                auto before = std::chrono::steady_clock::now();
+                lk.lock();
+                acquired = std::chrono::steady_clock::now();
+                s->stats->waits.observe(acquired - before);
+            } else
+                acquired = std::chrono::steady_clock::now();
+        }
+
+        /**
+         * Call `fun`, which releases the lock while waiting on a
+         * condition variable, without counting that time as holding
+         * the lock.
+         */
+        template<typename F>
+        auto released(F fun)
+        {
+            if (!s->stats) return fun();
+            s->stats->holds.observe(std::chrono::steady_clock::now() - acquired);
+            Finally resume([&]() { acquired = std::chrono::steady_clock::now(); });
+            return fun();
+        }
+
     public:
         Lock(Lock && l) : s(l.s) { abort(); }
         Lock(const Lock & l) = delete;
-        ~Lock() { }
+        ~Lock()
+        {
+            if (s->stats && lk.owns_lock())
+                s->stats->holds.observe(std::chrono::steady_clock::now() - acquired);
+        }
         T * operator -> () { return &s->data; }
         T & operator * () { return s->data; }
 
         void wait(std::condition_variable & cv)
         {
             assert(s);
-            cv.wait(lk);
+            released([&]() { cv.wait(lk); });
         }
 
         template<class Rep, class Period>
@@ -62,7 +116,7 @@ public:
             const std::chrono::duration<Rep, Period> & duration)
         {
             assert(s);
-            return cv.wait_for(lk, duration);
+            return released([&]() { return cv.wait_for(lk, duration); });
         }
 
         template<class Rep, class Period, class Predicate>
@@ -71,7 +125,7 @@ public:
             Predicate pred)
         {
             assert(s);
-            return cv.wait_for(lk, duration, pred);
+            return released([&]() { return cv.wait_for(lk, duration, pred); });
         }
 
         template<class Clock, class Duration>
@@ -79,7 +133,7 @@ public:
             const std::chrono::time_point<Clock, Duration> & duration)
         {
             assert(s);
-            return cv.wait_until(lk, duration);
+            return released([&]() { return cv.wait_until(lk, duration); });
         }
     };
 
@@ -159,4 +159,15 @@ namespace nix {
         ASSERT_EQ(d.makeRelative(CanonPath("/foo/xyzzy/bla")), "../xyzzy/bla");
         ASSERT_EQ(d.makeRelative(CanonPath("/xyzzy/bla")), "../../xyzzy/bla");
     }
+
+    TEST(CanonPath, interned) {
+        CanonPath p("/foo/bar");
+        auto q = CanonPath("/foo") + "bar";
+        ASSERT_EQ(p, q);
+        ASSERT_EQ(&p.abs(), &q.abs());
+        ASSERT_EQ(p.hash(), q.hash());
+        ASSERT_EQ(&p.parent()->abs(), &CanonPath("/foo").abs());
+        ASSERT_EQ(*p.parent()->parent(), CanonPath::root);
+        ASSERT_NE(p, CanonPath("/foo/baz"));
+    }
 }
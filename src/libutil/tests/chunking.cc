@@ -0,0 +1,79 @@
+#include "chunking.hh"
+
+#include <gtest/gtest.h>
+
+#include <random>
+#include <set>
+
+namespace nix {
+
+    static std::string randomString(size_t size, unsigned seed)
+    {
+        std::mt19937 gen(seed);
+        std::string s(size, 0);
+        for (auto & c : s) c = gen();
+        return s;
+    }
+
+    static std::vector<std::string> chunk(std::string_view data, size_t writeSize = 4096)
+    {
+        std::vector<std::string> chunks;
+        ChunkingSink sink([&](std::string_view chunk) { chunks.emplace_back(chunk); });
+        for (size_t pos = 0; pos < data.size(); pos += writeSize)
+            sink(data.substr(pos, writeSize));
+        sink.finish();
+        return chunks;
+    }
+
+    static std::string concat(const std::vector<std::string> & chunks)
+    {
+        std::string s;
+        for (auto & chunk : chunks) s += chunk;
+        return s;
+    }
+
+    /* ----------------------------------------------------------------------------
+     * ChunkingSink
+     * --------------------------------------------------------------------------*/
+
+    TEST(ChunkingSink, empty) {
+        ASSERT_TRUE(chunk("").empty());
+    }
+
+    TEST(ChunkingSink, chunksAreWithinBounds) {
+        auto data = randomString(16 * 1024 * 1024, 1);
+        auto chunks = chunk(data);
+        ASSERT_EQ(concat(chunks), data);
+        ASSERT_GT(chunks.size(), 4);
+        for (size_t i = 0; i + 1 < chunks.size(); ++i) {
+            ASSERT_GE(chunks[i].size(), ChunkingSink::minChunkSize);
+            ASSERT_LE(chunks[i].size(), ChunkingSink::maxChunkSize);
+        }
+    }
+
+    TEST(ChunkingSink, uniformDataHitsMaximum) {
+        std::string data(10 * 1024 * 1024, 'x');
+        auto chunks = chunk(data);
+        ASSERT_EQ(concat(chunks), data);
+        ASSERT_EQ(chunks[0].size(), ChunkingSink::maxChunkSize);
+    }
+
+    TEST(ChunkingSink, independentOfWriteSize) {
+        auto data = randomString(8 * 1024 * 1024, 2);
+        ASSERT_EQ(chunk(data, 1), chunk(data, 1000000));
+    }
+
+    TEST(ChunkingSink, boundariesResynchronise) {
+        auto data = randomString(16 * 1024 * 1024, 3);
+        auto data2 = data;
+        data2.insert(1000, "inserted");
+        auto chunks = chunk(data), chunks2 = chunk(data2);
+        ASSERT_EQ(concat(chunks2), data2);
+        std::set<std::string> set(chunks.begin(), chunks.end());
+        size_t shared = 0;
+        for (auto & c : chunks2)
+            if (set.count(c)) shared++;
+        ASSERT_GE(shared, chunks.size() - 2);
+    }
+
+}
@@ -93,4 +93,50 @@ namespace nix {
         ASSERT_STREQ(strSink.s.c_str(), inputString);
     }
 
+    /* ----------------------------------------------------------------------------
+     * zstd-seekable
+     * --------------------------------------------------------------------------*/
+
+    TEST(seekableZstd, compressAndDecompress) {
+        std::string input;
+        for (int i = 0; input.size() < 3 * 1024 * 1024; ++i)
+            input += std::to_string(i) + " ";
+
+        auto compressed = compress("zstd-seekable", input);
+
+        ASSERT_EQ(decompress("zstd", compressed), input);
+    }
+
+    TEST(seekableZstd, decompressFrames) {
+        std::string input;
+        for (int i = 0; input.size() < 3 * 1024 * 1024; ++i)
+            input += std::to_string(i) + " ";
+
+        auto compressed = compress("zstd-seekable", input);
+
+        auto tableSize = parseSeekableZstdFooter(
+            std::string_view(compressed).substr(compressed.size() - seekableZstdFooterSize));
+        ASSERT_LE(tableSize, compressed.size());
+        auto frames = parseSeekableZstdTable(
+            std::string_view(compressed).substr(compressed.size() - tableSize));
+
+        ASSERT_EQ(frames.size(), 4);
+        ASSERT_EQ(frames.back().decompressedOffset + frames.back().decompressedSize, input.size());
+        ASSERT_EQ(frames.back().compressedOffset + frames.back().compressedSize, compressed.size() - tableSize);
+
+        for (auto & frame : frames)
+            ASSERT_EQ(
+                decompress("zstd", std::string_view(compressed).substr(frame.compressedOffset, frame.compressedSize)),
+                input.substr(frame.decompressedOffset, frame.decompressedSize));
+    }
+
+    TEST(seekableZstd, emptyInput) {
+        auto compressed = compress("zstd-seekable", "");
+        ASSERT_EQ(decompress("zstd", compressed), "");
+    }
+
+    TEST(seekableZstd, invalidFooter) {
+        ASSERT_THROW(parseSeekableZstdFooter("123456789"), CompressionError);
+    }
+
 }
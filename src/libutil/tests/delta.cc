@@ -0,0 +1,84 @@
+#include "delta.hh"
+
+#include <gtest/gtest.h>
+
+#include <random>
+
+namespace nix {
+
+    static std::string randomString(size_t size, unsigned seed)
+    {
+        std::mt19937 gen(seed);
+        std::string s(size, 0);
+        for (auto & c : s) c = gen();
+        return s;
+    }
+
+    static std::string roundTrip(std::string_view base, std::string_view target, size_t * deltaSize = nullptr)
+    {
+        StringSink delta;
+        computeDelta(base, target, delta);
+        if (deltaSize) *deltaSize = delta.s.size();
+        StringSource source(delta.s);
+        StringSink result;
+        applyDelta(base, source, result);
+        return result.s;
+    }
+
+    /* ----------------------------------------------------------------------------
+     * computeDelta / applyDelta
+     * --------------------------------------------------------------------------*/
+
+    TEST(delta, emptyInputs) {
+        ASSERT_EQ(roundTrip("", ""), "");
+        ASSERT_EQ(roundTrip("", "foo"), "foo");
+        ASSERT_EQ(roundTrip("foo", ""), "");
+    }
+
+    TEST(delta, identicalInputsGiveSmallDelta) {
+        auto s = randomString(1024 * 1024, 1);
+        size_t deltaSize;
+        ASSERT_EQ(roundTrip(s, s, &deltaSize), s);
+        ASSERT_LT(deltaSize, 100);
+    }
+
+    TEST(delta, smallChanges) {
+        auto base = randomString(1024 * 1024, 2);
+        auto target = base;
+        target[1000] ^= 1;
+        target.insert(500000, "inserted");
+        target.erase(700000, 1234);
+        target += randomString(100, 3);
+        size_t deltaSize;
+        ASSERT_EQ(roundTrip(base, target, &deltaSize), target);
+        ASSERT_LT(deltaSize, 1024);
+    }
+
+    TEST(delta, movedData) {
+        auto a = randomString(100000, 4), b = randomString(100000, 5);
+        size_t deltaSize;
+        ASSERT_EQ(roundTrip(a + b, b + a, &deltaSize), b + a);
+        ASSERT_LT(deltaSize, 1024);
+    }
+
+    TEST(delta, unrelatedInputs) {
+        auto base = randomString(200000, 6), target = randomString(300000, 7);
+        ASSERT_EQ(roundTrip(base, target), target);
+    }
+
+    TEST(delta, rejectsWrongBase) {
+        auto base = randomString(100000, 8);
+        StringSink delta;
+        computeDelta(base, base, delta);
+        StringSource source(delta.s);
+        StringSink result;
+        ASSERT_THROW(applyDelta(base.substr(0, 1000), source, result), BadDelta);
+    }
+
+    TEST(delta, rejectsGarbage) {
+        StringSource source("not a delta");
+        StringSink result;
+        ASSERT_ANY_THROW(applyDelta("", source, result));
+    }
+
+}
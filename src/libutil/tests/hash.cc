@@ -5,6 +5,7 @@
 #include <rapidcheck/gtest.h>
 
 #include <hash.hh>
+#include <experimental-features.hh>
 
 #include "tests/hash.hh"
 
@@ -80,6 +81,26 @@ namespace nix {
                 "c7d329eeb6dd26545e96e55b874be909");
     }
 
+#if HAVE_LIBBLAKE3
+    TEST(hashString, testKnownBLAKE3Hashes1) {
+        // values taken from: https://github.com/BLAKE3-team/BLAKE3
+        auto s = "abc";
+        auto hash = hashString(HashType::htBLAKE3, s);
+        ASSERT_EQ(hash.to_string(HashFormat::Base16, true),
+                "blake3:6437b3ac38465133ffb63b75273a8db548c558465d79db03fd359c6cd5bd9d85");
+    }
+
+    TEST(hashString, testKnownBLAKE3Hashes2) {
+        auto hash = hashString(HashType::htBLAKE3, "");
+        ASSERT_EQ(hash.to_string(HashFormat::Base16, true),
+                "blake3:af1349b9f5f9a1a6a0404dea36dcc9499bcb25c9adc112b7cc9a93cae41f3262");
+    }
+#endif
+
+    TEST(parseHashType, blake3RequiresExperimentalFeature) {
+        ASSERT_THROW(parseHashType("blake3"), MissingExperimentalFeature);
+    }
+
     /* ----------------------------------------------------------------------------
      * parseHashFormat, parseHashFormatOpt, printHashFormat
      * --------------------------------------------------------------------------*/
@@ -0,0 +1,78 @@
+#include "memory-source-accessor.hh"
+#include "archive.hh"
+
+#include <gtest/gtest.h>
+
+namespace nix {
+
+    static void makeTree(MemorySourceAccessor & accessor)
+    {
+        MemorySink sink(accessor);
+        sink.createDirectory("");
+        sink.createDirectory("/dir");
+        sink.createRegularFile("/dir/b");
+        sink.receiveContents("bar");
+        sink.closeRegularFile();
+        sink.createRegularFile("/dir/a");
+        sink.isExecutable();
+        sink.receiveContents("foo");
+        sink.closeRegularFile();
+        sink.createSymlink("/link", "dir/a");
+    }
+
+    /* ----------------------------------------------------------------------------
+     * MemorySourceAccessor
+     * --------------------------------------------------------------------------*/
+
+    TEST(MemorySourceAccessor, readTree) {
+        MemorySourceAccessor accessor;
+        makeTree(accessor);
+
+        ASSERT_EQ(accessor.lstat(CanonPath::root).type, SourceAccessor::tDirectory);
+        ASSERT_EQ(accessor.readFile(CanonPath("/dir/b")), "bar");
+        ASSERT_TRUE(accessor.lstat(CanonPath("/dir/a")).isExecutable);
+        ASSERT_FALSE(accessor.lstat(CanonPath("/dir/b")).isExecutable);
+        ASSERT_EQ(accessor.readLink(CanonPath("/link")), "dir/a");
+        ASSERT_FALSE(accessor.pathExists(CanonPath("/dir/c")));
+        ASSERT_FALSE(accessor.pathExists(CanonPath("/dir/a/x")));
+        ASSERT_THROW(accessor.readFile(CanonPath("/dir")), Error);
+
+        auto entries = accessor.readDirectory(CanonPath("/dir"));
+        ASSERT_EQ(entries.size(), 2);
+        ASSERT_EQ(entries.begin()->first, "a");
+    }
+
+    TEST(MemorySourceAccessor, narRoundTrip) {
+        MemorySourceAccessor accessor;
+        makeTree(accessor);
+
+        StringSink nar;
+        accessor.dumpPath(CanonPath::root, nar);
+
+        MemorySourceAccessor accessor2;
+        MemorySink sink(accessor2);
+        StringSource source(nar.s);
+        parseDump(sink, source);
+
+        StringSink nar2;
+        accessor2.dumpPath(CanonPath::root, nar2);
+        ASSERT_EQ(nar.s, nar2.s);
+        ASSERT_EQ(accessor2.readFile(CanonPath("/dir/a")), "foo");
+    }
+
+    TEST(MemorySourceAccessor, replaceFile) {
+        MemorySourceAccessor accessor;
+        makeTree(accessor);
+
+        MemorySink sink(accessor);
+        sink.createRegularFile("/dir/b");
+        sink.receiveContents("new");
+        sink.closeRegularFile();
+        ASSERT_EQ(accessor.readFile(CanonPath("/dir/b")), "new");
+
+        // Recreating an existing directory keeps its contents.
+        sink.createDirectory("/dir");
+        ASSERT_EQ(accessor.readFile(CanonPath("/dir/a")), "foo");
+    }
+
+}
@@ -124,4 +124,54 @@ namespace nix {
             ASSERT_NE(h->num, counter);
         }
     }
+
+    TEST(Pool, tryGetDoesNotWait) {
+        auto isGood = [](const ref<TestResource> & r) { return r->good; };
+        auto createResource = []() { return make_ref<TestResource>(); };
+
+        Pool<TestResource> pool = Pool<TestResource>((size_t)1, createResource, isGood);
+
+        {
+            auto h = pool.tryGet();
+            ASSERT_TRUE(h);
+            ASSERT_FALSE(pool.tryGet());
+        }
+
+        ASSERT_TRUE(pool.tryGet());
+    }
+
+    TEST(Pool, prewarmCreatesIdleResourcesUpToCapacity) {
+        auto isGood = [](const ref<TestResource> & r) { return r->good; };
+        auto createResource = []() { return make_ref<TestResource>(); };
+
+        Pool<TestResource> pool = Pool<TestResource>((size_t)2, createResource, isGood);
+
+        pool.prewarm(5);
+        ASSERT_EQ(pool.count(), 2);
+
+        {
+            auto h1 = pool.tryGet();
+            auto h2 = pool.tryGet();
+            ASSERT_TRUE(h1 && h2);
+            ASSERT_EQ(pool.count(), 2);
+        }
+    }
+
+    TEST(Pool, burstExceedsCapacityAfterDelay) {
+        auto isGood = [](const ref<TestResource> & r) { return r->good; };
+        auto createResource = []() { return make_ref<TestResource>(); };
+
+        Pool<TestResource> pool = Pool<TestResource>((size_t)1, createResource, isGood);
+        pool.setBurst(1, std::chrono::milliseconds(10));
+
+        {
+            auto h1 = pool.get();
+            auto h2 = pool.get();
+            ASSERT_EQ(pool.count(), 2);
+            ASSERT_FALSE(pool.tryGet());
+        }
+
+        // The extra resource is not kept once it's returned.
+        ASSERT_EQ(pool.count(), 1);
+    }
 }
@@ -42,5 +42,30 @@ INSTANTIATE_TEST_CASE_P(
     )
 );
 
+TEST(RewritingSink, chunkedInputMatchesWhole) {
+    std::string s = "xxabcdefxxabcabcdefxxdefabc";
+    StringMap rewrites {{"abc", "123"}, {"def", "456"}};
+
+    StringSink whole;
+    {
+        RewritingSink rewriter(rewrites, whole);
+        rewriter(s);
+        rewriter.flush();
+    }
+
+    StringSink chunked;
+    {
+        RewritingSink selfRewriter("xx", "yy", chunked);
+        RewritingSink rewriter(rewrites, selfRewriter);
+        for (auto c : s)
+            rewriter(std::string_view(&c, 1));
+        rewriter.flush();
+        selfRewriter.flush();
+    }
+
+    ASSERT_EQ(whole.s, "xx123456xx123123456xx456123");
+    ASSERT_EQ(chunked.s, "yy123456yy123123456yy456123");
+}
+
 }
 
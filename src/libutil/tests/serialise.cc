@@ -0,0 +1,140 @@
+#include "serialise.hh"
+#include "util.hh"
+
+#include <gtest/gtest.h>
+
+#include <thread>
+
+namespace nix {
+
+    static std::string writeToPipe(std::function<void(Sink &)> fun)
+    {
+        Pipe pipe;
+        pipe.create();
+        std::string result;
+        std::thread reader([&]() {
+            result = drainFD(pipe.readSide.get());
+        });
+        {
+            FdSink sink(pipe.writeSide.get());
+            fun(sink);
+            sink.flush();
+        }
+        pipe.writeSide.close();
+        reader.join();
+        return result;
+    }
+
+    /* ----------------------------------------------------------------------------
+     * FdSink
+     * --------------------------------------------------------------------------*/
+
+    TEST(FdSink, smallWrites) {
+        auto s = writeToPipe([](Sink & sink) {
+            sink("foo");
+            sink("bar");
+        });
+        ASSERT_EQ(s, "foobar");
+    }
+
+    TEST(FdSink, bufferedDataPrecedesLargeWrite) {
+        std::string big(getFdBufferSize() * 3 + 17, 'x');
+        auto s = writeToPipe([&](Sink & sink) {
+            sink << 42;
+            sink(big);
+            sink << 43;
+        });
+        StringSink expected;
+        expected << 42;
+        expected(big);
+        expected << 43;
+        ASSERT_EQ(s, expected.s);
+    }
+
+    TEST(FdSink, countsWrittenBytes) {
+        Pipe pipe;
+        pipe.create();
+        std::string big(getFdBufferSize() * 2, 'y');
+        std::thread reader([&]() { drainFD(pipe.readSide.get()); });
+        {
+            FdSink sink(pipe.writeSide.get());
+            sink("abc");
+            sink(big);
+            sink.flush();
+            ASSERT_EQ(sink.written, big.size() + 3);
+        }
+        pipe.writeSide.close();
+        reader.join();
+    }
+
+    /* ----------------------------------------------------------------------------
+     * FramedSink / FramedSource
+     * --------------------------------------------------------------------------*/
+
+    TEST(FramedSink, roundTrip) {
+        std::string big(getFdBufferSize() * 5 + 3, 'z');
+        std::exception_ptr ex;
+        StringSink out;
+        {
+            struct : BufferedSink {
+                StringSink * out;
+                void writeUnbuffered(std::string_view data) override { (*out)(data); }
+            } to;
+            to.out = &out;
+            {
+                FramedSink framed(to, ex);
+                framed("hello");
+                framed(big);
+            }
+            to.flush();
+        }
+        StringSource in(out.s);
+        FramedSource framed(in);
+        ASSERT_EQ(framed.drain(), "hello" + big);
+    }
+
+    TEST(FramedSink, largeWriteIsSentWithBufferedDataInOneFrame) {
+        std::string big(getFdBufferSize() * 2, 'z');
+        std::exception_ptr ex;
+        StringSink out;
+        {
+            struct : BufferedSink {
+                StringSink * out;
+                void writeUnbuffered(std::string_view data) override { (*out)(data); }
+            } to;
+            to.out = &out;
+            {
+                FramedSink framed(to, ex);
+                framed("hello");
+                framed(big);
+                framed.flush();
+            }
+            to.flush();
+        }
+        StringSource in(out.s);
+        ASSERT_EQ(readNum<uint64_t>(in), big.size() + 5);
+        std::string frame(big.size() + 5, 0);
+        in(frame.data(), frame.size());
+        ASSERT_EQ(frame, "hello" + big);
+        ASSERT_EQ(readNum<uint64_t>(in), 0);
+    }
+
+    TEST(FramedSource, skipsUnreadFramesOnDestruction) {
+        StringSink out;
+        for (std::string_view frame : {"foo", "barbaz"}) {
+            out << frame.size();
+            out(frame);
+        }
+        out << 0 << 42;
+
+        StringSource in(out.s);
+        {
+            FramedSource framed(in);
+            char c;
+            framed(&c, 1);
+            ASSERT_EQ(c, 'f');
+        }
+        ASSERT_EQ(readNum<uint64_t>(in), 42);
+    }
+
+}
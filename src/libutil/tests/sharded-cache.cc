@@ -0,0 +1,71 @@
+#include "sharded-cache.hh"
+#include <gtest/gtest.h>
+
+namespace nix {
+
+    TEST(ShardedCache, getFromEmptyCache) {
+        ShardedCache<std::string, std::string> c(10);
+        ASSERT_EQ(c.get("x").has_value(), false);
+        ASSERT_EQ(c.size(), 0);
+        ASSERT_EQ(c.getMisses(), 1);
+    }
+
+    TEST(ShardedCache, upsertAndGet) {
+        ShardedCache<std::string, std::string> c(10);
+        c.upsert("foo", "bar");
+        ASSERT_EQ(c.get("foo"), "bar");
+        c.upsert("foo", "baz");
+        ASSERT_EQ(c.get("foo"), "baz");
+        ASSERT_EQ(c.size(), 1);
+        ASSERT_EQ(c.getHits(), 2);
+    }
+
+    TEST(ShardedCache, zeroCapacity) {
+        ShardedCache<std::string, std::string> c(0);
+        c.upsert("foo", "bar");
+        ASSERT_EQ(c.get("foo").has_value(), false);
+        ASSERT_EQ(c.size(), 0);
+    }
+
+    TEST(ShardedCache, erase) {
+        ShardedCache<std::string, std::string> c(10);
+        c.upsert("foo", "bar");
+        ASSERT_EQ(c.erase("foo"), true);
+        ASSERT_EQ(c.erase("foo"), false);
+        ASSERT_EQ(c.get("foo").has_value(), false);
+        c.upsert("foo", "baz");
+        ASSERT_EQ(c.get("foo"), "baz");
+    }
+
+    TEST(ShardedCache, sizeIsBounded) {
+        ShardedCache<int, int> c(32);
+        for (int i = 0; i < 1000; ++i)
+            c.upsert(i, i);
+        ASSERT_LE(c.size(), 32);
+        ASSERT_GE(c.getEvictions(), 1000 - 32);
+    }
+
+    TEST(ShardedCache, recentlyUsedItemsSurvive) {
+        /* With std::hash<int>, all multiples of 16 end up in the
+           same shard. Keep looking up one of them while inserting
+           many others into that shard. */
+        ShardedCache<int, int> c(16 * 4);
+        const int hot = 0;
+        c.upsert(hot, 42);
+        for (int i = 1; i < 10000; ++i) {
+            ASSERT_EQ(c.get(hot), 42);
+            c.upsert(i * 16, i);
+        }
+        ASSERT_EQ(c.get(hot), 42);
+    }
+
+    TEST(ShardedCache, clear) {
+        ShardedCache<std::string, std::string> c(10);
+        c.upsert("foo", "bar");
+        c.upsert("bar", "foo");
+        c.clear();
+        ASSERT_EQ(c.size(), 0);
+        ASSERT_EQ(c.get("foo").has_value(), false);
+    }
+
+}
@@ -0,0 +1,129 @@
+#include "thread-pipe.hh"
+#include <gtest/gtest.h>
+
+namespace nix {
+
+    TEST(ThreadPipe, passesDataInOrder) {
+        ThreadPipe pipe(16);
+        std::thread writer([&]() {
+            for (int i = 0; i < 1000; ++i)
+                pipe.write(std::to_string(i) + " ");
+            pipe.close();
+        });
+
+        std::string expected, got;
+        for (int i = 0; i < 1000; ++i)
+            expected += std::to_string(i) + " ";
+        while (auto chunk = pipe.read())
+            got += *chunk;
+        writer.join();
+
+        ASSERT_EQ(got, expected);
+    }
+
+    TEST(ThreadPipe, readerThrowsWritersException) {
+        ThreadPipe pipe;
+        pipe.write("foo");
+        pipe.close(std::make_exception_ptr(Error("bar")));
+        ASSERT_EQ(pipe.read(), "foo");
+        ASSERT_THROW(pipe.read(), Error);
+    }
+
+    TEST(ThreadPipe, cancelUnblocksWriter) {
+        ThreadPipe pipe(4);
+        std::thread reader([&]() {
+            pipe.read();
+            pipe.cancel();
+        });
+        pipe.write("1234");
+        ASSERT_THROW(while (true) pipe.write("1234"), EndOfFile);
+        reader.join();
+    }
+
+    TEST(ThreadPipe, readerSource) {
+        ThreadPipe pipe;
+        pipe.write("foo");
+        pipe.write("bar");
+        pipe.close();
+        ThreadPipe::Reader reader(pipe);
+        std::string s(6, 0);
+        reader(s.data(), s.size());
+        ASSERT_EQ(s, "foobar");
+        ASSERT_THROW(reader(s.data(), 1), EndOfFile);
+    }
+
+    TEST(AsyncSink, passesAllData) {
+        StringSink sink;
+        std::string expected;
+        {
+            AsyncSink async(sink, 1024);
+            for (int i = 0; i < 100000; ++i) {
+                auto s = std::to_string(i);
+                async(s);
+                expected += s;
+            }
+            async.finish();
+        }
+        ASSERT_EQ(sink.s, expected);
+    }
+
+    TEST(AsyncSink, rethrowsConsumerException) {
+        LambdaSink failing([](std::string_view data) {
+            throw Error("consumer failed");
+        });
+        AsyncSink async(failing, 1024);
+        ASSERT_THROW(
+            {
+                for (int i = 0; i < 1000; ++i)
+                    async(std::string(1024, 'x'));
+                async.finish();
+            },
+            Error);
+    }
+
+    TEST(AsyncSink, destroyWithoutFinish) {
+        StringSink sink;
+        AsyncSink async(sink);
+        async("foo");
+    }
+
+    TEST(sinkToSource, threadMode) {
+        std::string expected;
+        for (int i = 0; i < 100000; ++i)
+            expected += std::to_string(i);
+
+        auto source = sinkToSource([&](Sink & sink) {
+            for (int i = 0; i < 100000; ++i)
+                sink(std::to_string(i));
+        }, []() { throw EndOfFile("done"); }, SinkToSourceMode::Thread);
+
+        std::string got(expected.size(), 0);
+        (*source)(got.data(), got.size());
+        ASSERT_EQ(got, expected);
+
+        char c;
+        ASSERT_THROW((*source)(&c, 1), EndOfFile);
+    }
+
+    TEST(sinkToSource, threadModeRethrowsProducerException) {
+        auto source = sinkToSource([&](Sink & sink) {
+            sink("foo");
+            throw Error("producer failed");
+        }, []() { throw EndOfFile("done"); }, SinkToSourceMode::Thread);
+
+        ASSERT_THROW(source->drain(), Error);
+    }
+
+    TEST(sinkToSource, threadModePartialRead) {
+        auto source = sinkToSource([&](Sink & sink) {
+            while (true)
+                sink(std::string(1024, 'x'));
+        }, []() { throw EndOfFile("done"); }, SinkToSourceMode::Thread);
+
+        char c;
+        (*source)(&c, 1);
+        ASSERT_EQ(c, 'x');
+        /* Destroying the source must stop the producer. */
+    }
+
+}
@@ -0,0 +1,51 @@
+#include "thread-pool.hh"
+
+#include <gtest/gtest.h>
+
+namespace nix {
+
+    /* ----------------------------------------------------------------------------
+     * ThreadPool
+     * --------------------------------------------------------------------------*/
+
+    TEST(ThreadPool, startsHigherPriorityItemsFirst) {
+        /* With a single thread, the items are run by process() in
+           the order in which they are started. */
+        ThreadPool pool(1);
+        std::vector<int> order;
+
+        pool.enqueue([&]() { order.push_back(1); }, 1);
+        pool.enqueue([&]() { order.push_back(2); }, 10);
+        pool.enqueue([&]() { order.push_back(3); }, 1);
+        pool.enqueue([&]() { order.push_back(4); });
+
+        pool.process();
+
+        ASSERT_EQ(order, (std::vector<int> { 2, 1, 3, 4 }));
+    }
+
+    TEST(processGraph, startsReadyNodesByPriority) {
+        ThreadPool pool(1);
+        std::vector<std::string> order;
+
+        /* "top" depends on everything else. */
+        std::map<std::string, std::set<std::string>> refs {
+            {"top", {"small", "big", "medium"}},
+            {"small", {}},
+            {"big", {}},
+            {"medium", {}},
+        };
+        std::map<std::string, uint64_t> priorities {
+            {"top", 0}, {"small", 1}, {"big", 100}, {"medium", 10},
+        };
+
+        processGraph<std::string>(pool,
+            {"top", "small", "big", "medium"},
+            [&](const std::string & node) { return refs.at(node); },
+            [&](const std::string & node) { order.push_back(node); },
+            [&](const std::string & node) { return priorities.at(node); });
+
+        ASSERT_EQ(order, (std::vector<std::string> { "big", "medium", "small", "top" }));
+    }
+
+}
@@ -0,0 +1,55 @@
+#include "topo-sort.hh"
+#include <gtest/gtest.h>
+
+namespace nix {
+
+using namespace std;
+
+static Error cycleError(const string & a, const string & b)
+{
+    return Error("cycle between '%s' and '%s'", a, b);
+}
+
+TEST(topoSort, sortsChildrenAfterParents) {
+    map<string, set<string>> graph = {
+        { "A", { "B", "C" } },
+        { "B", { "D" } },
+        { "C", { "D", "E" } },
+        { "D", {} },
+        { "E", { "X" } }, // Not in the set to sort
+        { "F", { "A", "F" } }, // Self reference
+    };
+
+    auto sorted = topoSort<string>({"A", "B", "C", "D", "E", "F"},
+        [&](const string & s) { return graph[s]; }, cycleError);
+
+    ASSERT_EQ(sorted, (vector<string>{"F", "A", "C", "E", "B", "D"}));
+}
+
+TEST(topoSort, detectsCycles) {
+    map<string, set<string>> graph = {
+        { "A", { "B" } },
+        { "B", { "C" } },
+        { "C", { "A" } },
+    };
+
+    ASSERT_THROW(
+        topoSort<string>({"A", "B", "C"}, [&](const string & s) { return graph[s]; }, cycleError),
+        Error);
+}
+
+TEST(topoSort, deepGraph) {
+    set<int> items;
+    for (int i = 0; i < 100000; ++i)
+        items.insert(i);
+
+    auto sorted = topoSort<int>(items,
+        [](const int & i) { return set<int>{i + 1}; },
+        [](const int &, const int &) { return Error("unexpected cycle"); });
+
+    ASSERT_EQ(sorted.size(), items.size());
+    ASSERT_EQ(sorted.front(), 0);
+    ASSERT_EQ(sorted.back(), 99999);
+}
+
+}
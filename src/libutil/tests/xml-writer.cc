@@ -102,4 +102,31 @@ namespace nix {
         ASSERT_EQ(out.str(), "<?xml version='1.0' encoding='utf-8'?>\n<foobar foo=\"bar\" />");
     }
 
+    TEST(XMLWriter, attrEscapingAtBoundaries) {
+        std::stringstream out;
+        {
+            XMLWriter t(false, out);
+            t.writeEmptyElement("foobar", { { "a", "\"x\ny&" }, { "b", "" } });
+        }
+
+        ASSERT_EQ(out.str(), "<?xml version='1.0' encoding='utf-8'?>\n<foobar a=\"&quot;x&#xA;y&amp;\" b=\"\" />");
+    }
+
+    TEST(XMLWriter, deepIndentation) {
+        std::stringstream out;
+        size_t depth = 100;
+        {
+            XMLWriter t(true, out);
+            for (size_t n = 0; n < depth; ++n)
+                t.openElement("e");
+        }
+
+        std::string expected = "<?xml version='1.0' encoding='utf-8'?>\n";
+        for (size_t n = 0; n < depth; ++n)
+            expected += std::string(n * 2, ' ') + "<e>\n";
+        for (size_t n = depth; n-- > 0; )
+            expected += std::string(n * 2, ' ') + "</e>\n";
+        ASSERT_EQ(out.str(), expected);
+    }
+
 }
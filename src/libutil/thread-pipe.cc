@@ -0,0 +1,119 @@
+#include "thread-pipe.hh"
+
+#include <cstring>
+
+namespace nix {
+
+void ThreadPipe::write(std::string && chunk)
+{
+    auto state(state_.lock());
+    /* Always accept a chunk if the buffer is empty, even if it's
+       bigger than the maximum. */
+    while (!state->cancelled && state->size && state->size + chunk.size() > maxSize)
+        state.wait(canWrite);
+    if (state->cancelled)
+        throw EndOfFile("the reader of the pipe has gone away");
+    state->size += chunk.size();
+    state->chunks.push_back(std::move(chunk));
+    canRead.notify_one();
+}
+
+void ThreadPipe::close(std::exception_ptr exception)
+{
+    auto state(state_.lock());
+    state->closed = true;
+    state->exception = exception;
+    canRead.notify_all();
+}
+
+std::optional<std::string> ThreadPipe::read()
+{
+    auto state(state_.lock());
+    while (state->chunks.empty() && !state->closed)
+        state.wait(canRead);
+    if (!state->chunks.empty()) {
+        auto chunk = std::move(state->chunks.front());
+        state->chunks.pop_front();
+        state->size -= chunk.size();
+        canWrite.notify_one();
+        return chunk;
+    }
+    if (state->exception)
+        std::rethrow_exception(state->exception);
+    return std::nullopt;
+}
+
+void ThreadPipe::cancel()
+{
+    auto state(state_.lock());
+    state->cancelled = true;
+    state->chunks.clear();
+    state->size = 0;
+    canWrite.notify_all();
+}
+
+size_t ThreadPipe::Reader::read(char * data, size_t len)
+{
+    while (pos == chunk.size()) {
+        auto next = pipe.read();
+        if (!next) {
+            if (eof) eof();
+            throw EndOfFile("unexpected end of stream");
+        }
+        chunk = std::move(*next);
+        pos = 0;
+    }
+
+    auto n = std::min(len, chunk.size() - pos);
+    memcpy(data, chunk.data() + pos, n);
+    pos += n;
+    return n;
+}
+
+
+AsyncSink::AsyncSink(Sink & next, size_t bufferSize)
+    : BufferedSink(256 * 1024)
+    , pipe(bufferSize)
+{
+    thread = std::thread([this, &next]() {
+        try {
+            while (auto chunk = pipe.read())
+                next(*chunk);
+        } catch (...) {
+            exception = std::current_exception();
+            pipe.cancel();
+        }
+    });
+}
+
+AsyncSink::~AsyncSink()
+{
+    if (thread.joinable()) {
+        /* We didn't finish, so throw away whatever is still
+           buffered. */
+        pipe.cancel();
+        pipe.close();
+        thread.join();
+    }
+}
+
+void AsyncSink::writeUnbuffered(std::string_view data)
+{
+    try {
+        pipe.write(std::string(data));
+    } catch (EndOfFile &) {
+        /* The consumer failed, so throw its exception instead. */
+        if (exception) std::rethrow_exception(exception);
+        throw;
+    }
+}
+
+void AsyncSink::finish()
+{
+    flush();
+    pipe.close();
+    thread.join();
+    if (exception) std::rethrow_exception(exception);
+}
+
+}
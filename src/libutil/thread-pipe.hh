@@ -0,0 +1,122 @@
+#pragma once
+///@file
+
+#include "serialise.hh"
+#include "sync.hh"
+
+#include <condition_variable>
+#include <list>
+#include <thread>
+
+namespace nix {
+
+/**
+ * A bounded buffer for passing a stream of data from one thread to
+ * another. The writer blocks while the buffer is full, and the reader
+ * blocks while it is empty, so the two threads can work at the same
+ * time without the buffer growing without bound.
+ */
+class ThreadPipe
+{
+    struct State
+    {
+        std::list<std::string> chunks;
+        size_t size = 0;
+        bool closed = false;
+        bool cancelled = false;
+        std::exception_ptr exception;
+    };
+
+    Sync<State> state_;
+
+    std::condition_variable canRead, canWrite;
+
+    const size_t maxSize;
+
+public:
+
+    ThreadPipe(size_t maxSize = 8 * 1024 * 1024) : maxSize(maxSize) { }
+
+    /**
+     * Append a chunk of data, waiting while the buffer is full. Throws
+     * `EndOfFile` if the reader has called `cancel()`.
+     */
+    void write(std::string && chunk);
+
+    /**
+     * Signal the end of the stream. If `exception` is set, the reader
+     * throws it instead of seeing the end of the stream.
+     */
+    void close(std::exception_ptr exception = nullptr);
+
+    /**
+     * Return the next chunk of data, waiting until there is one.
+     * Returns nothing at the end of the stream.
+     */
+    std::optional<std::string> read();
+
+    /**
+     * Tell the writer that nothing more will be read.
+     */
+    void cancel();
+
+    /**
+     * A sink that writes to a pipe, in chunks of at least the size of
+     * its buffer. Call `flush()` before closing the pipe.
+     */
+    struct Writer : BufferedSink
+    {
+        ThreadPipe & pipe;
+
+        Writer(ThreadPipe & pipe) : BufferedSink(256 * 1024), pipe(pipe) { }
+
+        void writeUnbuffered(std::string_view data) override
+        {
+            pipe.write(std::string(data));
+        }
+    };
+
+    /**
+     * A source that reads from a pipe. At the end of the stream, it
+     * calls `eof` if set, or throws `EndOfFile` otherwise.
+     */
+    struct Reader : Source
+    {
+        ThreadPipe & pipe;
+        std::function<void()> eof;
+        std::string chunk;
+        size_t pos = 0;
+
+        Reader(ThreadPipe & pipe, std::function<void()> eof = {})
+            : pipe(pipe), eof(eof)
+        { }
+
+        size_t read(char * data, size_t len) override;
+    };
+};
+
+/**
+ * A sink that passes its data to `next` on a separate thread, so that
+ * producing and consuming the data can happen on different cores.
+ * `finish()` waits until `next` has received everything, and rethrows
+ * any exception it threw.
+ */
+struct AsyncSink : BufferedSink, FinishSink
+{
+    using BufferedSink::operator ();
+
+    AsyncSink(Sink & next, size_t bufferSize = 8 * 1024 * 1024);
+
+    ~AsyncSink();
+
+    void writeUnbuffered(std::string_view data) override;
+
+    void finish() override;
+
+private:
+    ThreadPipe pipe;
+    std::exception_ptr exception;
+    std::thread thread;
+};
+
+}
@@ -1,10 +1,14 @@
 #include "thread-pool.hh"
 
+#include <limits>
+
 namespace nix {
 
 ThreadPool::ThreadPool(size_t _maxThreads)
     : maxThreads(_maxThreads)
 {
+    state_.setName("thread-pool");
+
     if (!maxThreads) {
         maxThreads = std::thread::hardware_concurrency();
         if (!maxThreads) maxThreads = 1;
@@ -37,12 +41,12 @@ void ThreadPool::shutdown()
         thr.join();
 }
 
-void ThreadPool::enqueue(const work_t & t)
+void ThreadPool::enqueue(const work_t & t, uint64_t priority)
 {
     auto state(state_.lock());
     if (quit)
         throw ThreadPoolShutDown("cannot enqueue a work item while the thread pool is shutting down");
-    state->pending.push(t);
+    state->pending.emplace(std::make_pair(std::numeric_limits<uint64_t>::max() - priority, state->nextSeq++), t);
     /* Note: process() also executes items, so count it as a worker. */
     if (state->pending.size() > state->workers.size() + 1 && state->workers.size() + 1 < maxThreads)
         state->workers.emplace_back(&ThreadPool::doWork, this, false);
@@ -133,8 +137,9 @@ void ThreadPool::doWork(bool mainThread)
                 state.wait(work);
             }
 
-            w = std::move(state->pending.front());
-            state->pending.pop();
+            auto next = state->pending.begin();
+            w = std::move(next->second);
+            state->pending.erase(next);
             state->active++;
         }
 
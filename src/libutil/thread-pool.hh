@@ -34,9 +34,12 @@ public:
     typedef std::function<void()> work_t;
 
     /**
-     * Enqueue a function to be executed by the thread pool.
+     * Enqueue a function to be executed by the thread pool. Pending
+     * items with a higher `priority` are started first; items with
+     * the same priority are started in the order in which they were
+     * enqueued.
      */
-    void enqueue(const work_t & t);
+    void enqueue(const work_t & t, uint64_t priority = 0);
 
     /**
      * Execute work items until the queue is empty.
@@ -58,7 +61,13 @@ private:
 
     struct State
     {
-        std::queue<work_t> pending;
+        /**
+         * Pending work items, keyed by the inverted priority and a
+         * sequence number, so that the first one is to be started
+         * next.
+         */
+        std::map<std::pair<uint64_t, uint64_t>, work_t> pending;
+        uint64_t nextSeq = 0;
         size_t active = 0;
         std::exception_ptr exception;
         std::vector<std::thread> workers;
@@ -79,15 +88,22 @@ private:
 /**
  * Process in parallel a set of items of type T that have a partial
  * ordering between them. Thus, any item is only processed after all
- * its dependencies have been processed.
+ * its dependencies have been processed. If `getPriority` is given,
+ * items with a higher priority are started first among the items
+ * whose dependencies are done.
  */
 template<typename T>
 void processGraph(
     ThreadPool & pool,
     const std::set<T> & nodes,
     std::function<std::set<T>(const T &)> getEdges,
-    std::function<void(const T &)> processNode)
+    std::function<void(const T &)> processNode,
+    std::function<uint64_t(const T &)> getPriority = {})
 {
+    auto priority = [&](const T & node) -> uint64_t {
+        return getPriority ? getPriority(node) : 0;
+    };
+
     struct Graph {
         std::set<T> left;
         std::map<T, std::set<T>> refs, rrefs;
@@ -139,7 +155,7 @@ void processGraph(
                 assert(i != refs.end());
                 refs.erase(i);
                 if (refs.empty())
-                    pool.enqueue(std::bind(worker, rref));
+                    pool.enqueue(std::bind(worker, rref), priority(rref));
             }
             graph->left.erase(node);
             graph->refs.erase(node);
@@ -148,7 +164,7 @@ void processGraph(
     };
 
     for (auto & node : nodes)
-        pool.enqueue(std::bind(worker, std::ref(node)));
+        pool.enqueue(std::bind(worker, std::ref(node)), priority(node));
 
     pool.process();
 
@@ -3,37 +3,79 @@
 
 #include "error.hh"
 
+#include <algorithm>
+
 namespace nix {
 
+/**
+ * Sort `items` topologically, i.e. every item comes before its
+ * children. Children that are not in `items` are ignored.
+ *
+ * This is a depth-first search that keeps its own stack, so deep
+ * graphs don't overflow the call stack. Items are numbered by their
+ * position in `items`, so the search only needs vectors indexed by
+ * item instead of sets of items.
+ */
 template<typename T>
 std::vector<T> topoSort(std::set<T> items,
         std::function<std::set<T>(const T &)> getChildren,
         std::function<Error(const T &, const T &)> makeCycleError)
 {
-    std::vector<T> sorted;
-    std::set<T> visited, parents;
-
-    std::function<void(const T & path, const T * parent)> dfsVisit;
+    std::vector<const T *> nodes;
+    nodes.reserve(items.size());
+    for (auto & i : items)
+        nodes.push_back(&i);
 
-    dfsVisit = [&](const T & path, const T * parent) {
-        if (parents.count(path)) throw makeCycleError(path, *parent);
+    auto find = [&](const T & item) -> std::optional<size_t> {
+        auto i = std::lower_bound(nodes.begin(), nodes.end(), &item,
+            [](const T * a, const T * b) { return *a < *b; });
+        if (i == nodes.end() || item < **i) return std::nullopt;
+        return i - nodes.begin();
+    };
 
-        if (!visited.insert(path).second) return;
-        parents.insert(path);
+    enum Status : uint8_t { Unvisited, OnStack, Done };
+    std::vector<Status> status(nodes.size(), Unvisited);
 
-        std::set<T> references = getChildren(path);
+    struct Frame
+    {
+        size_t node;
+        std::vector<size_t> children;
+        size_t next = 0;
+    };
 
-        for (auto & i : references)
-            /* Don't traverse into items that don't exist in our starting set. */
-            if (i != path && items.count(i))
-                dfsVisit(i, &path);
+    std::vector<Frame> stack;
 
-        sorted.push_back(path);
-        parents.erase(path);
+    auto push = [&](size_t node) {
+        status[node] = OnStack;
+        Frame frame { .node = node };
+        for (auto & child : getChildren(*nodes[node]))
+            if (auto id = find(child); id && *id != node)
+                frame.children.push_back(*id);
+        stack.push_back(std::move(frame));
     };
 
-    for (auto & i : items)
-        dfsVisit(i, nullptr);
+    std::vector<T> sorted;
+    sorted.reserve(nodes.size());
+
+    for (size_t start = 0; start < nodes.size(); ++start) {
+        if (status[start] != Unvisited) continue;
+        push(start);
+
+        while (!stack.empty()) {
+            auto & frame = stack.back();
+            if (frame.next < frame.children.size()) {
+                auto child = frame.children[frame.next++];
+                if (status[child] == OnStack)
+                    throw makeCycleError(*nodes[child], *nodes[frame.node]);
+                if (status[child] == Unvisited)
+                    push(child);
+            } else {
+                status[frame.node] = Done;
+                sorted.push_back(*nodes[frame.node]);
+                stack.pop_back();
+            }
+        }
+    }
 
     std::reverse(sorted.begin(), sorted.end());
 
@@ -0,0 +1,141 @@
+#include "tracing.hh"
+#include "sync.hh"
+#include "util.hh"
+
+#include <nlohmann/json.hpp>
+
+namespace nix {
+
+std::atomic<bool> tracingEnabled{false};
+
+namespace {
+
+struct Event
+{
+    const char * category;
+    std::string name;
+    /* Whether this is an asynchronous span, recorded as a begin and
+       end event with `id`, or a complete event in thread `tid`. */
+    bool async;
+    uint64_t id;
+    uint64_t tid;
+    std::chrono::steady_clock::time_point start, end;
+};
+
+struct Tracer
+{
+    Path file;
+    pid_t pid;
+    std::chrono::steady_clock::time_point epoch;
+    std::vector<Event> events;
+};
+
+}
+
+/* Never destroyed, since spans may end in static destructors. */
+static Sync<Tracer> & tracer()
+{
+    static auto tracer = new Sync<Tracer>;
+    return *tracer;
+}
+
+static uint64_t threadIndex()
+{
+    static std::atomic<uint64_t> nextIndex{1};
+    thread_local uint64_t index = nextIndex++;
+    return index;
+}
+
+static void addEvent(Event && event)
+{
+    auto tracer_(tracer().lock());
+    if (!tracingEnabled) return;
+    tracer_->events.push_back(std::move(event));
+}
+
+void startTracing(const Path & file)
+{
+    {
+        auto tracer_(tracer().lock());
+        tracer_->file = absPath(file);
+        tracer_->pid = getpid();
+        tracer_->epoch = std::chrono::steady_clock::now();
+        tracer_->events.clear();
+    }
+
+    static std::once_flag registered;
+    std::call_once(registered, []() { std::atexit(writeTrace); });
+
+    tracingEnabled = true;
+}
+
+void writeTrace()
+{
+    auto tracer_(tracer().lock());
+
+    /* Forked children inherit the spans of their parent but must
+       not overwrite its trace. */
+    if (!tracingEnabled || tracer_->pid != getpid()) return;
+    tracingEnabled = false;
+
+    auto us = [&](std::chrono::steady_clock::time_point t) {
+        return std::chrono::duration_cast<std::chrono::microseconds>(t - tracer_->epoch).count();
+    };
+
+    auto events = nlohmann::json::array();
+    for (auto & e : tracer_->events) {
+        if (e.async) {
+            auto id = fmt("0x%x", e.id);
+            events.push_back({{"name", e.name}, {"cat", e.category}, {"ph", "b"}, {"id", id},
+                {"ts", us(e.start)}, {"pid", tracer_->pid}, {"tid", 0}});
+            events.push_back({{"name", e.name}, {"cat", e.category}, {"ph", "e"}, {"id", id},
+                {"ts", us(e.end)}, {"pid", tracer_->pid}, {"tid", 0}});
+        } else
+            events.push_back({{"name", e.name}, {"cat", e.category}, {"ph", "X"},
+                {"ts", us(e.start)}, {"dur", us(e.end) - us(e.start)},
+                {"pid", tracer_->pid}, {"tid", e.tid}});
+    }
+    tracer_->events.clear();
+
+    try {
+        writeFile(tracer_->file, nlohmann::json{{"traceEvents", std::move(events)}}.dump());
+    } catch (Error & e) {
+        e.addTrace({}, "while writing the trace file '%s'", tracer_->file);
+        ignoreException();
+    }
+}
+
+void traceAsync(const char * category, std::string name, uint64_t id,
+    std::chrono::steady_clock::time_point start,
+    std::chrono::steady_clock::time_point end)
+{
+    if (!tracingEnabled.load(std::memory_order_relaxed)) return;
+    addEvent(Event {
+        .category = category,
+        .name = std::move(name),
+        .async = true,
+        .id = id,
+        .tid = 0,
+        .start = start,
+        .end = end,
+    });
+}
+
+TraceSpan::~TraceSpan()
+{
+    if (!category) return;
+    try {
+        addEvent(Event {
+            .category = category,
+            .name = std::move(name),
+            .async = false,
+            .id = 0,
+            .tid = threadIndex(),
+            .start = start,
+            .end = std::chrono::steady_clock::now(),
+        });
+    } catch (...) {
+    }
+}
+
+}
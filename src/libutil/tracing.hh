@@ -0,0 +1,69 @@
+#pragma once
+///@file
+
+#include "types.hh"
+#include "fmt.hh"
+
+#include <atomic>
+#include <chrono>
+
+namespace nix {
+
+/**
+ * Whether spans are being recorded, i.e. `startTracing()` has been
+ * called. Checked inline so that spans cost almost nothing otherwise.
+ */
+extern std::atomic<bool> tracingEnabled;
+
+/**
+ * Start recording spans. They are written to `file` in the Chrome
+ * trace event format (readable by `chrome://tracing` and Perfetto)
+ * when the process exits, or when `writeTrace()` is called.
+ */
+void startTracing(const Path & file);
+
+/**
+ * Stop recording spans and write the ones recorded so far.
+ */
+void writeTrace();
+
+/**
+ * Record an asynchronous span, i.e. one that may overlap with other
+ * spans in the same thread. Spans with the same `id` are nested by
+ * the viewer.
+ */
+void traceAsync(const char * category, std::string name, uint64_t id,
+    std::chrono::steady_clock::time_point start,
+    std::chrono::steady_clock::time_point end);
+
+/**
+ * Record the lifetime of this object as a span in the current thread.
+ * Spans in the same thread must be properly nested, so this must only
+ * be used for scopes. The name is only formatted if tracing is
+ * enabled.
+ */
+class TraceSpan
+{
+    const char * category;
+    std::string name;
+    std::chrono::steady_clock::time_point start;
+
+public:
+
+    template<typename... Args>
+    TraceSpan(const char * category, const std::string & fs, const Args & ... args)
+    {
+        if (tracingEnabled.load(std::memory_order_relaxed)) {
+            this->category = category;
+            name = fmt(fs, args...);
+            start = std::chrono::steady_clock::now();
+        } else
+            this->category = nullptr;
+    }
+
+    TraceSpan(const TraceSpan &) = delete;
+
+    ~TraceSpan();
+};
+
+}
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cassert>
 
 #include "xml-writer.hh"
@@ -9,7 +10,7 @@ namespace nix {
 XMLWriter::XMLWriter(bool indent, std::ostream & output)
     : output(output), indent(indent)
 {
-    output << "<?xml version='1.0' encoding='utf-8'?>" << std::endl;
+    output << "<?xml version='1.0' encoding='utf-8'?>\n";
     closed = false;
 }
 
@@ -31,7 +32,12 @@ void XMLWriter::close()
 void XMLWriter::indent_(size_t depth)
 {
     if (!indent) return;
-    output << std::string(depth * 2, ' ');
+    static const std::string spaces(64, ' ');
+    for (size_t n = depth * 2; n; ) {
+        auto chunk = std::min(n, spaces.size());
+        output.write(spaces.data(), chunk);
+        n -= chunk;
+    }
 }
 
 
@@ -44,7 +50,7 @@ void XMLWriter::openElement(
     output << "<" << name;
     writeAttrs(attrs);
     output << ">";
-    if (indent) output << std::endl;
+    if (indent) output << '\n';
     pendingElems.push_back(std::string(name));
 }
 
@@ -54,7 +60,7 @@ void XMLWriter::closeElement()
     assert(!pendingElems.empty());
     indent_(pendingElems.size() - 1);
     output << "</" << pendingElems.back() << ">";
-    if (indent) output << std::endl;
+    if (indent) output << '\n';
     pendingElems.pop_back();
     if (pendingElems.empty()) closed = true;
 }
@@ -69,7 +75,7 @@ void XMLWriter::writeEmptyElement(
     output << "<" << name;
     writeAttrs(attrs);
     output << " />";
-    if (indent) output << std::endl;
+    if (indent) output << '\n';
 }
 
 
@@ -77,8 +83,14 @@ void XMLWriter::writeAttrs(const XMLAttrs & attrs)
 {
     for (auto & i : attrs) {
         output << " " << i.first << "=\"";
-        for (size_t j = 0; j < i.second.size(); ++j) {
-            char c = i.second[j];
+        std::string_view value = i.second;
+        while (true) {
+            /* Write the characters that don't need escaping in one
+               go. */
+            auto j = value.find_first_of("\"<>&\n");
+            output.write(value.data(), std::min(j, value.size()));
+            if (j == value.npos) break;
+            char c = value[j];
             if (c == '"') output << "&quot;";
             else if (c == '<') output << "&lt;";
             else if (c == '>') output << "&gt;";
@@ -86,7 +98,7 @@ void XMLWriter::writeAttrs(const XMLAttrs & attrs)
             /* Escape newlines to prevent attribute normalisation (see
                XML spec, section 3.3.3. */
             else if (c == '\n') output << "&#xA;";
-            else output << c;
+            value.remove_prefix(j + 1);
         }
         output << "\"";
     }
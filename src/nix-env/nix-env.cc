@@ -22,6 +22,7 @@
 #include <algorithm>
 #include <iostream>
 #include <sstream>
+#include <thread>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -922,7 +923,7 @@ static VersionDiff compareVersionAgainstSet(
 }
 
 
-static void queryJSON(Globals & globals, std::vector<DrvInfo> & elems, bool printOutPath, bool printMeta)
+static void queryJSON(Globals & globals, std::vector<DrvInfo> & elems, bool printOutPath, bool printMeta, const StringSet & metaAttrs)
 {
     using nlohmann::json;
     json topObj = json::object();
@@ -956,9 +957,7 @@ static void queryJSON(Globals & globals, std::vector<DrvInfo> & elems, bool prin
             if (printMeta) {
                 json &metaObj = pkgObj["meta"];
                 metaObj = json::object();
-                StringSet metaNames = i.queryMetaNames();
-                for (auto & j : metaNames) {
-                    Value * v = i.queryMeta(j);
+                for (auto & [j, v] : i.queryMetaAttrs(metaAttrs)) {
                     if (!v) {
                         printError("derivation '%s' has invalid meta attribute '%s'", i.queryName(), j);
                         metaObj[j] = nullptr;
@@ -979,6 +978,122 @@ static void queryJSON(Globals & globals, std::vector<DrvInfo> & elems, bool prin
 }
 
 
+/* Evaluate the given columns of `elems` in `query-workers` forked
+   processes and cache the results in the DrvInfos, so that printing
+   them doesn't evaluate anything. Elements that fail to evaluate in
+   a worker are left alone; the parent evaluates them again and
+   reports the error as usual. */
+static void prefetchColumns(EvalState & state, std::vector<DrvInfo> & elems,
+    bool system, bool drvPath, bool outPath, bool outputs, bool description)
+{
+    size_t nrWorkers = std::min<size_t>(evalSettings.queryWorkers, elems.size());
+    if (nrWorkers <= 1 || !(system || drvPath || outPath || outputs || description))
+        return;
+
+    auto & store = *state.store;
+
+    /* The background fetch threads don't survive the fork. */
+    state.waitForFetches();
+
+    struct Worker
+    {
+        Pipe pipe;
+        Pid pid;
+        std::string records;
+    };
+
+    std::vector<Worker> workers(nrWorkers);
+
+    for (size_t n = 0; n < nrWorkers; ++n) {
+        auto & worker = workers[n];
+        worker.pipe.create();
+        worker.pid = startProcess([&]() {
+            FdSink sink(worker.pipe.writeSide.get());
+            for (size_t i = n; i < elems.size(); i += nrWorkers) {
+                auto & elem = elems[i];
+                StringSink record;
+                try {
+                    if (system)
+                        record << elem.querySystem();
+                    if (drvPath) {
+                        auto path = elem.queryDrvPath();
+                        record << (path ? store.printStorePath(*path) : "");
+                    }
+                    if (outPath)
+                        record << store.printStorePath(elem.queryOutPath());
+                    if (outputs) {
+                        auto outs = elem.queryOutputs();
+                        record << outs.size();
+                        for (auto & [name, path] : outs)
+                            record << name << (path ? store.printStorePath(*path) : "");
+                    }
+                    if (description)
+                        record << elem.queryMetaString("description");
+                } catch (Error &) {
+                    continue;
+                }
+                sink << i << record.s;
+            }
+            sink.flush();
+            _exit(0);
+        });
+        worker.pipe.writeSide.close();
+    }
+
+    std::vector<std::thread> readers;
+    for (auto & worker : workers)
+        readers.emplace_back([&worker]() {
+            try {
+                worker.records = drainFD(worker.pipe.readSide.get());
+            } catch (...) {
+            }
+        });
+    for (auto & reader : readers)
+        reader.join();
+
+    for (auto & worker : workers) {
+        if (worker.pid.wait())
+            debug("a 'nix-env --query' worker failed; evaluating its remaining packages serially");
+
+        /* A worker that died leaves a truncated last record, which we
+           skip. */
+        StringSource source(worker.records);
+        try {
+            while (source.pos < worker.records.size()) {
+                auto i = readNum<size_t>(source);
+                StringSource record(readString(source));
+                if (i >= elems.size()) break;
+                auto & elem = elems[i];
+                if (system)
+                    elem.setSystem(readString(record));
+                if (drvPath) {
+                    auto path = readString(record);
+                    if (!path.empty()) elem.setDrvPath(store.parseStorePath(path));
+                }
+                if (outPath)
+                    elem.setOutPath(store.parseStorePath(readString(record)));
+                if (outputs) {
+                    DrvInfo::Outputs outs;
+                    auto count = readNum<size_t>(record);
+                    while (count--) {
+                        auto name = readString(record);
+                        auto path = readString(record);
+                        outs.emplace(name, path.empty() ? std::nullopt : std::optional(store.parseStorePath(path)));
+                    }
+                    elem.setOutputs(std::move(outs));
+                }
+                if (description) {
+                    auto v = state.allocValue();
+                    v->mkString(readString(record));
+                    elem.setMeta("description", v);
+                }
+            }
+        } catch (EndOfFile &) {
+        }
+    }
+}
+
+
 static void opQuery(Globals & globals, Strings opFlags, Strings opArgs)
 {
     auto & store { *globals.state->store };
@@ -994,6 +1109,7 @@ static void opQuery(Globals & globals, Strings opFlags, Strings opArgs)
     bool printOutPath = false;
     bool printDescription = false;
     bool printMeta = false;
+    StringSet metaAttrs;
     bool compareVersions = false;
     bool xmlOutput = false;
     bool jsonOutput = false;
@@ -1012,6 +1128,10 @@ static void opQuery(Globals & globals, Strings opFlags, Strings opArgs)
         else if (arg == "--drv-path") printDrvPath = true;
         else if (arg == "--out-path") printOutPath = true;
         else if (arg == "--meta") printMeta = true;
+        else if (arg == "--meta-attr") {
+            printMeta = true;
+            metaAttrs.insert(needArg(i, opFlags, arg));
+        }
         else if (arg == "--installed") source = sInstalled;
         else if (arg == "--available" || arg == "-a") source = sAvailable;
         else if (arg == "--xml") xmlOutput = true;
@@ -1050,6 +1170,14 @@ static void opQuery(Globals & globals, Strings opFlags, Strings opArgs)
     for (auto & i : elems_) elems.push_back(i);
     sort(elems.begin(), elems.end(), cmpElemByName);
 
+    if (source == sAvailable)
+        prefetchColumns(*globals.state, elems,
+            printSystem || xmlOutput || jsonOutput,
+            printDrvPath,
+            printOutPath || printStatus || globals.prebuiltOnly,
+            printOutPath,
+            printDescription);
+
 
     /* We only need to know the installed paths when we are querying
        the status of the derivation. */
@@ -1079,7 +1207,7 @@ static void opQuery(Globals & globals, Strings opFlags, Strings opArgs)
 
     /* Print the desired columns, or XML output. */
     if (jsonOutput) {
-        queryJSON(globals, elems, printOutPath, printMeta);
+        queryJSON(globals, elems, printOutPath, printMeta, metaAttrs);
         cout << '\n';
         return;
     }
@@ -1216,11 +1344,9 @@ static void opQuery(Globals & globals, Strings opFlags, Strings opArgs)
                     xml.writeEmptyElement("output", attrs2);
                 }
                 if (printMeta) {
-                    StringSet metaNames = i.queryMetaNames();
-                    for (auto & j : metaNames) {
+                    for (auto & [j, v] : i.queryMetaAttrs(metaAttrs)) {
                         XMLAttrs attrs2;
                         attrs2["name"] = j;
-                        Value * v = i.queryMeta(j);
                         if (!v)
                             printError(
                                 "derivation '%s' has invalid meta attribute '%s'",
@@ -19,39 +19,16 @@ static inline std::string_view xmlQuote(std::string_view s)
 }
 
 
-static std::string symbolicName(std::string_view p)
+static std::string_view symbolicName(std::string_view p)
 {
-    return std::string(p.substr(0, p.find('-') + 1));
-}
-
-
-static std::string makeEdge(std::string_view src, std::string_view dst)
-{
-    return fmt("  <edge source=\"%1%\" target=\"%2%\"/>\n",
-        xmlQuote(src), xmlQuote(dst));
-}
-
-
-static std::string makeNode(const ValidPathInfo & info)
-{
-    return fmt(
-        "  <node id=\"%1%\">\n"
-        "    <data key=\"narSize\">%2%</data>\n"
-        "    <data key=\"name\">%3%</data>\n"
-        "    <data key=\"type\">%4%</data>\n"
-        "  </node>\n",
-        info.path.to_string(),
-        info.narSize,
-        symbolicName(std::string(info.path.name())),
-        (info.path.isDerivation() ? "derivation" : "output-path"));
+    return p.substr(0, p.find('-') + 1);
 }
 
 
 void printGraphML(ref<Store> store, StorePathSet && roots)
 {
-    StorePathSet workList(std::move(roots));
-    StorePathSet doneSet;
-    std::pair<StorePathSet::iterator, bool> ret;
+    StorePathSet closure;
+    store->computeFSClosure(roots, closure);
 
     cout << "<?xml version='1.0' encoding='utf-8'?>\n"
          << "<graphml xmlns='http://graphml.graphdrawing.org/xmlns'\n"
@@ -62,22 +39,18 @@ void printGraphML(ref<Store> store, StorePathSet && roots)
          << "<key id='type' for='node' attr.name='type' attr.type='string'/>"
          << "<graph id='G' edgedefault='directed'>\n";
 
-    while (!workList.empty()) {
-        auto path = std::move(workList.extract(workList.begin()).value());
-
-        ret = doneSet.insert(path);
-        if (ret.second == false) continue;
-
-        auto info = store->queryPathInfo(path);
-        cout << makeNode(*info);
+    for (auto & [path, info] : store->queryPathInfos(closure)) {
+        auto id = xmlQuote(path.to_string());
 
-        for (auto & p : info->references) {
-            if (p != path) {
-                workList.insert(p);
-                cout << makeEdge(path.to_string(), p.to_string());
-            }
-        }
+        cout << "  <node id=\"" << id << "\">\n"
+             << "    <data key=\"narSize\">" << info->narSize << "</data>\n"
+             << "    <data key=\"name\">" << xmlQuote(symbolicName(path.name())) << "</data>\n"
+             << "    <data key=\"type\">" << (path.isDerivation() ? "derivation" : "output-path") << "</data>\n"
+             << "  </node>\n";
 
+        for (auto & p : info->references)
+            if (p != path)
+                cout << "  <edge source=\"" << id << "\" target=\"" << xmlQuote(p.to_string()) << "\"/>\n";
     }
 
     cout << "</graph>\n";
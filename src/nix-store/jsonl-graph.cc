@@ -0,0 +1,44 @@
+#include "jsonl-graph.hh"
+#include "store-api.hh"
+
+#include <nlohmann/json.hpp>
+
+#include <iostream>
+
+
+using std::cout;
+
+namespace nix {
+
+
+/* Print one JSON object per line for each path in the closure, in
+   order. References are given as the (zero-based) line numbers of the
+   referenced paths, so the graph can be loaded in one pass without
+   looking up paths by name. */
+void printJSONLGraph(ref<Store> store, StorePathSet && roots)
+{
+    StorePathSet closure;
+    store->computeFSClosure(roots, closure);
+
+    auto infos = store->queryPathInfos(closure);
+
+    std::map<StorePath, size_t> ids;
+    for (auto & [path, info] : infos)
+        ids.emplace(path, ids.size());
+
+    for (auto & [path, info] : infos) {
+        auto references = nlohmann::json::array();
+        for (auto & p : info->references)
+            if (auto i = ids.find(p); i != ids.end())
+                references.push_back(i->second);
+
+        cout << nlohmann::json {
+            { "path", store->printStorePath(path) },
+            { "narSize", info->narSize },
+            { "references", std::move(references) },
+        }.dump() << '\n';
+    }
+}
+
+
+}
@@ -0,0 +1,10 @@
+#pragma once
+///@file
+
+#include "store-api.hh"
+
+namespace nix {
+
+void printJSONLGraph(ref<Store> store, StorePathSet && roots);
+
+}
@@ -13,8 +13,10 @@
 #include "shared.hh"
 #include "util.hh"
 #include "graphml.hh"
+#include "jsonl-graph.hh"
 #include "legacy.hh"
 #include "path-with-outputs.hh"
+#include "compression.hh"
 
 #include <iostream>
 #include <algorithm>
@@ -283,7 +285,7 @@ static void opQuery(Strings opFlags, Strings opArgs)
     enum QueryType
         { qOutputs, qRequisites, qReferences, qReferrers
         , qReferrersClosure, qDeriver, qValidDerivers, qBinding, qHash, qSize
-        , qTree, qGraph, qGraphML, qResolve, qRoots };
+        , qTree, qGraph, qGraphML, qGraphJSONL, qResolve, qRoots };
     std::optional<QueryType> query;
     bool useOutput = false;
     bool includeOutputs = false;
@@ -311,6 +313,7 @@ static void opQuery(Strings opFlags, Strings opArgs)
         else if (i == "--tree") query = qTree;
         else if (i == "--graph") query = qGraph;
         else if (i == "--graphml") query = qGraphML;
+        else if (i == "--graph-jsonl") query = qGraphJSONL;
         else if (i == "--resolve") query = qResolve;
         else if (i == "--roots") query = qRoots;
         else if (i == "--use-output" || i == "-u") useOutput = true;
@@ -438,6 +441,15 @@ static void opQuery(Strings opFlags, Strings opArgs)
             break;
         }
 
+        case qGraphJSONL: {
+            StorePathSet roots;
+            for (auto & i : opArgs)
+                for (auto & j : maybeUseOutputs(store->followLinksToStorePath(i), useOutput, forceRealise))
+                    roots.insert(j);
+            printJSONLGraph(ref<Store>(store), std::move(roots));
+            break;
+        }
+
         case qResolve: {
             for (auto & i : opArgs)
                 cout << fmt("%s\n", store->printStorePath(store->followLinksToStorePath(i)));
@@ -690,8 +702,23 @@ static void opRestore(Strings opFlags, Strings opArgs)
 
 static void opExport(Strings opFlags, Strings opArgs)
 {
-    for (auto & i : opFlags)
-        throw UsageError("unknown flag '%1%'", i);
+    unsigned int format = 1;
+    std::optional<std::string> compression;
+
+    for (auto i = opFlags.begin(); i != opFlags.end(); ++i)
+        if (*i == "--format") {
+            auto s = *(++i);
+            auto n = string2Int<unsigned int>(s);
+            if (!n || (*n != 1 && *n != 2))
+                throw UsageError("unsupported export format '%s'", s);
+            format = *n;
+        }
+        else if (*i == "--compression")
+            compression = *(++i);
+        else throw UsageError("unknown flag '%1%'", *i);
+
+    if (compression && format != 2)
+        throw UsageError("'--compression' requires '--format 2'");
 
     StorePathSet paths;
 
@@ -699,7 +726,10 @@ static void opExport(Strings opFlags, Strings opArgs)
         paths.insert(store->followLinksToStorePath(i));
 
     FdSink sink(STDOUT_FILENO);
-    store->exportPaths(paths, sink);
+    if (format == 2)
+        store->exportArchive(paths, sink, compression.value_or("none"));
+    else
+        store->exportPaths(paths, sink);
     sink.flush();
 }
 
@@ -874,8 +904,7 @@ static void opServe(Strings opFlags, Strings opArgs)
                 bool substitute = readInt(in);
                 auto paths = ServeProto::Serialise<StorePathSet>::read(*store, rconn);
                 if (lock && writeAllowed)
-                    for (auto & path : paths)
-                        store->addTempRoot(path);
+                    store->addTempRoots(paths);
 
                 if (substitute && writeAllowed) {
                     store->substitutePaths(paths);
@@ -887,22 +916,17 @@ static void opServe(Strings opFlags, Strings opArgs)
 
             case ServeProto::Command::QueryPathInfos: {
                 auto paths = ServeProto::Serialise<StorePathSet>::read(*store, rconn);
-                // !!! Maybe we want a queryPathInfos?
-                for (auto & i : paths) {
-                    try {
-                        auto info = store->queryPathInfo(i);
-                        out << store->printStorePath(info->path)
-                            << (info->deriver ? store->printStorePath(*info->deriver) : "");
-                        ServeProto::write(*store, wconn, info->references);
-                        // !!! Maybe we want compression?
-                        out << info->narSize // downloadSize
-                            << info->narSize;
-                        if (GET_PROTOCOL_MINOR(clientVersion) >= 4)
-                            out << info->narHash.to_string(HashFormat::Base32, true)
-                                << renderContentAddress(info->ca)
-                                << info->sigs;
-                    } catch (InvalidPath &) {
-                    }
+                for (auto & [_, info] : store->queryPathInfos(paths)) {
+                    out << store->printStorePath(info->path)
+                        << (info->deriver ? store->printStorePath(*info->deriver) : "");
+                    ServeProto::write(*store, wconn, info->references);
+                    // !!! Maybe we want compression?
+                    out << info->narSize // downloadSize
+                        << info->narSize;
+                    if (GET_PROTOCOL_MINOR(clientVersion) >= 4)
+                        out << info->narHash.to_string(HashFormat::Base32, true)
+                            << renderContentAddress(info->ca)
+                            << info->sigs;
                 }
                 out << "";
                 break;
@@ -912,6 +936,39 @@ static void opServe(Strings opFlags, Strings opArgs)
                 store->narFromPath(store->parseStorePath(readString(in)), out);
                 break;
 
+            case ServeProto::Command::DumpStorePaths: {
+                StorePaths paths;
+                for (auto & s : readStrings<Strings>(in))
+                    paths.push_back(store->parseStorePath(s));
+                auto compression = readString(in);
+                unsigned int level = readInt(in);
+                if (compression == "none") {
+                    for (auto & path : paths)
+                        store->narFromPath(path, out);
+                } else {
+                    std::exception_ptr ex;
+                    FramedSink framed(out, ex);
+                    auto compressor = makeCompressionSink(compression, framed, false, level ? (int) level : -1);
+                    for (auto & path : paths)
+                        store->narFromPath(path, *compressor);
+                    compressor->finish();
+                    framed.flush();
+                }
+                break;
+            }
+
+            case ServeProto::Command::AddMultipleToStore: {
+                if (!writeAllowed) throw Error("importing paths is not allowed");
+                auto compression = readString(in);
+                {
+                    FramedSource framed(in);
+                    auto source = makeDecompressionSource(compression, framed);
+                    store->addMultipleToStore(*source, NoRepair, NoCheckSigs);
+                }
+                out << 1; // indicate success
+                break;
+            }
+
             case ServeProto::Command::ImportPaths: {
                 if (!writeAllowed) throw Error("importing paths is not allowed");
                 store->importPaths(in, NoCheckSigs); // FIXME: should we skip sig checking?
@@ -1154,7 +1211,8 @@ static int main_nix_store(int argc, char * * argv)
                 noOutput = true;
             else if (*arg != "" && arg->at(0) == '-') {
                 opFlags.push_back(*arg);
-                if (*arg == "--max-freed" || *arg == "--max-links" || *arg == "--max-atime") /* !!! hack */
+                if (*arg == "--max-freed" || *arg == "--max-links" || *arg == "--max-atime"
+                    || *arg == "--format" || *arg == "--compression") /* !!! hack */
                     opFlags.push_back(getArg(*arg, arg, end));
             }
             else
@@ -35,6 +35,12 @@ static nlohmann::json builtPathsWithResultToJSON(const std::vector<BuiltPathWith
                     j["cpuUser"] = ((double) b.result->cpuUser->count()) / 1000000;
                 if (b.result->cpuSystem)
                     j["cpuSystem"] = ((double) b.result->cpuSystem->count()) / 1000000;
+                if (b.result->peakMemory)
+                    j["peakMemory"] = *b.result->peakMemory;
+                if (b.result->bytesRead)
+                    j["bytesRead"] = *b.result->bytesRead;
+                if (b.result->bytesWritten)
+                    j["bytesWritten"] = *b.result->bytesWritten;
             }
             res.push_back(j);
         }, b.path.raw());
@@ -13,10 +13,13 @@
 #include "finally.hh"
 #include "legacy.hh"
 #include "daemon.hh"
+#include "metrics.hh"
 
 #include <algorithm>
+#include <atomic>
 #include <climits>
 #include <cstring>
+#include <thread>
 
 #include <unistd.h>
 #include <signal.h>
@@ -30,6 +33,7 @@
 #include <pwd.h>
 #include <grp.h>
 #include <fcntl.h>
+#include <netdb.h>
 
 #if __APPLE__ || __FreeBSD__
 #include <sys/ucred.h>
@@ -91,6 +95,35 @@ AuthorizationSettings authorizationSettings;
 
 static GlobalConfig::Register rSettings(&authorizationSettings);
 
+struct DaemonSettings : Config {
+
+    Setting<unsigned int> daemonThreads{
+        this, 0, "daemon-threads",
+        R"(
+          The maximum number of client connections that the Nix daemon serves on threads of its own process, rather than forking a process for each connection.
+          The threads share one store, so they share its caches, such as the cache of path information and the binary cache information of substituters.
+
+          A connection stays on its thread as long as it only queries the store and its client's settings are the same as the daemon's.
+          When the client asks the daemon to build or add paths, or to apply settings of its own, the connection is handed off to a separate process as usual.
+          If all threads are busy, new connections get a process of their own right away.
+
+          The default, `0`, forks a process for every connection.
+        )"};
+
+    Setting<std::string> metricsAddress{
+        this, "", "metrics-address",
+        R"(
+          If set, the Nix daemon serves metrics about its operation in the [Prometheus text format](https://prometheus.io/docs/instrumenting/exposition_formats/) over HTTP on this address.
+          This is either the path of a Unix domain socket, or a host name or IP address and a port separated by a colon, such as `localhost:9879`.
+
+          The metrics include the number and duration of daemon operations by type, the number of connections, builds and substitutions, the number of bytes substituted and uploaded to binary caches, SQLite busy retries and the time spent waiting for locks.
+        )"};
+};
+
+static DaemonSettings daemonSettings;
+
+static GlobalConfig::Register rDaemonSettings(&daemonSettings);
+
 #ifndef __linux__
 #define SPLICE_F_MOVE 0
 static ssize_t splice(int fd_in, void *off_in, int fd_out, void *off_out, size_t len, unsigned int flags)
@@ -112,6 +145,83 @@ static ssize_t splice(int fd_in, void *off_in, int fd_out, void *off_out, size_t
 #endif
 
 
+/**
+ * Listen on a `metrics-address`.
+ */
+static AutoCloseFD listenForMetrics(const std::string & address)
+{
+    if (hasPrefix(address, "/")) {
+        createDirs(dirOf(address));
+        return createUnixDomainSocket(address, 0666);
+    }
+
+    auto colon = address.rfind(':');
+    if (colon == std::string::npos)
+        throw UsageError("'metrics-address' must be a socket path or of the form 'host:port'");
+    auto host = address.substr(0, colon);
+    auto port = address.substr(colon + 1);
+    if (hasPrefix(host, "[") && hasSuffix(host, "]"))
+        host = host.substr(1, host.size() - 2);
+
+    struct addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    struct addrinfo * res;
+    if (auto err = getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &res))
+        throw Error("resolving metrics address '%s': %s", address, gai_strerror(err));
+    Finally freeRes([&]() { freeaddrinfo(res); });
+
+    AutoCloseFD fd = socket(res->ai_family, res->ai_socktype | SOCK_CLOEXEC, res->ai_protocol);
+    if (!fd) throw SysError("creating metrics socket");
+    int one = 1;
+    setsockopt(fd.get(), SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd.get(), res->ai_addr, res->ai_addrlen) == -1)
+        throw SysError("binding metrics socket to '%s'", address);
+    if (listen(fd.get(), 5) == -1)
+        throw SysError("listening on metrics socket '%s'", address);
+
+    return fd;
+}
+
+/**
+ * Answer every HTTP request on `fd` with the metrics.
+ */
+static void serveMetrics(int fd)
+{
+    while (true) {
+        try {
+            AutoCloseFD remote = accept(fd, nullptr, nullptr);
+            if (!remote) {
+                if (errno == EINTR) continue;
+                throw SysError("accepting metrics connection");
+            }
+            closeOnExec(remote.get());
+
+            struct timeval timeout = { .tv_sec = 10, .tv_usec = 0 };
+            setsockopt(remote.get(), SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            setsockopt(remote.get(), SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+            /* Every request gets the metrics, so there is no need to
+               look at it. */
+            char buf[4096];
+            if (read(remote.get(), buf, sizeof(buf)) <= 0) continue;
+
+            auto body = renderMetrics();
+            writeFull(remote.get(),
+                fmt("HTTP/1.0 200 OK\r\n"
+                    "Content-Type: text/plain; version=0.0.4\r\n"
+                    "Content-Length: %d\r\n"
+                    "Connection: close\r\n"
+                    "\r\n", body.size())
+                + body, false);
+        } catch (Error & e) {
+            printError("error serving metrics: %s", e.msg());
+        }
+    }
+}
+
+
 static void sigChldHandler(int sigNo)
 {
     // Ensure we don't modify errno of whatever we've interrupted
@@ -239,6 +349,185 @@ static ref<Store> openUncachedStore()
     return openStore(settings.storeUri, params);
 }
 
+/**
+ * Send a file descriptor over a Unix domain socket, together with a
+ * single byte of data.
+ */
+static void sendFd(int socket, int fd)
+{
+    char data = 0;
+    struct iovec iov { .iov_base = &data, .iov_len = 1 };
+
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    auto cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    while (sendmsg(socket, &msg, 0) == -1)
+        if (errno != EINTR)
+            throw SysError("sending a file descriptor");
+}
+
+/**
+ * Receive a file descriptor sent by `sendFd()`.
+ *
+ * @return The file descriptor, or an invalid one if the other side
+ * closed the socket.
+ */
+static AutoCloseFD receiveFd(int socket)
+{
+    char data;
+    struct iovec iov { .iov_base = &data, .iov_len = 1 };
+
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    ssize_t n;
+    while ((n = recvmsg(socket, &msg, 0)) == -1)
+        if (errno != EINTR)
+            throw SysError("receiving a file descriptor");
+
+    if (n == 0) return {};
+
+    auto cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+        throw Error("did not receive a file descriptor");
+
+    int fd;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return fd;
+}
+
+/**
+ * A process that forks the processes serving the connections that
+ * the threads of a threaded daemon hand off. Forking a
+ * multi-threaded process isn't safe, so this process is started
+ * before the daemon starts any threads.
+ */
+struct HandOffServer
+{
+    Sync<AutoCloseFD> channel_;
+
+    HandOffServer(int fdSocket)
+    {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+            throw SysError("creating a socket pair");
+        AutoCloseFD ours = fds[0], theirs = fds[1];
+        closeOnExec(ours.get());
+        closeOnExec(theirs.get());
+
+        startProcess([&]() {
+            ours.close();
+            if (fdSocket != -1) close(fdSocket);
+
+            //  Get rid of children automatically.
+            setSigChldAction(true);
+
+            while (true) {
+                try {
+                    auto remote = receiveFd(theirs.get());
+                    if (!remote) break;
+
+                    unsigned char header[8];
+                    readFull(theirs.get(), (char *) header, sizeof(header));
+                    std::string message(readLittleEndian<uint64_t>(header), 0);
+                    readFull(theirs.get(), message.data(), message.size());
+
+                    StringSource source(message);
+                    auto trusted = readNum<bool>(source) ? Trusted : NotTrusted;
+                    std::optional<daemon::ConnectionHandOff> state;
+                    if (readNum<bool>(source)) {
+                        state = daemon::ConnectionHandOff { .clientVersion = readNum<unsigned int>(source) };
+                        if (readNum<bool>(source))
+                            state->clientSettings = readString(source);
+                        state->pending = readString(source);
+                    }
+
+                    ProcessOptions options;
+                    options.errorPrefix = "unexpected Nix daemon error: ";
+                    options.dieWithParent = false;
+                    options.runExitHandlers = true;
+                    options.allowVfork = false;
+                    startProcess([&]() {
+                        theirs.close();
+
+                        if (setsid() == -1)
+                            throw SysError("creating a new session");
+
+                        setSigChldAction(false);
+
+                        FdSource from(remote.get());
+                        FdSink to(remote.get());
+                        if (state)
+                            daemon::resumeConnection(openUncachedStore(), from, to, trusted, std::move(*state));
+                        else
+                            processConnection(openUncachedStore(), from, to, trusted, NotRecursive);
+
+                        exit(0);
+                    }, options);
+
+                } catch (Error & error) {
+                    auto ei = error.info();
+                    ei.msg = hintfmt("error handing off connection: %1%", ei.msg.str());
+                    logError(ei);
+                }
+            }
+
+            _exit(0);
+        });
+
+        *channel_.lock() = std::move(ours);
+    }
+
+    /**
+     * Have a new process serve the connection `fd`, either from the
+     * start or resuming from `state`.
+     */
+    void handOff(int fd, TrustedFlag trusted, std::optional<daemon::ConnectionHandOff> && state)
+    {
+        StringSink message;
+        message << trusted << state.has_value();
+        if (state) {
+            message << state->clientVersion << state->clientSettings.has_value();
+            if (state->clientSettings)
+                message << *state->clientSettings;
+            message << state->pending;
+        }
+
+        StringSink header;
+        header << message.s.size();
+
+        auto channel(channel_.lock());
+        sendFd(channel->get(), fd);
+        writeFull(channel->get(), header.s);
+        writeFull(channel->get(), message.s);
+    }
+};
+
 /**
  * Authenticate a potential client
  *
@@ -303,6 +592,36 @@ static void daemonLoop(std::optional<TrustedFlag> forceTrustClientOpt)
         fdSocket = createUnixDomainSocket(settings.nixDaemonSocketFile, 0666);
     }
 
+    /* The metrics must be shared with the processes forked below. */
+    if (daemonSettings.metricsAddress != "")
+        initSharedMetrics();
+
+    /* In threaded mode, the store and the process that takes over
+       connections from threads. */
+    struct Threaded
+    {
+        HandOffServer handOffServer;
+        ref<Store> store;
+        std::atomic<unsigned int> activeThreads{0};
+
+        Threaded(int fdSocket)
+            : handOffServer(fdSocket)
+            , store(openStore(settings.storeUri))
+        { }
+    };
+
+    std::shared_ptr<Threaded> threaded;
+    if (daemonSettings.daemonThreads) {
+        threaded = std::make_shared<Threaded>(fdSocket.get());
+        daemon::initThreadedConnections();
+    }
+
+    AutoCloseFD fdMetrics;
+    if (daemonSettings.metricsAddress != "") {
+        fdMetrics = listenForMetrics(daemonSettings.metricsAddress);
+        std::thread(serveMetrics, fdMetrics.get()).detach();
+    }
+
     //  Get rid of children automatically; don't let them become zombies.
     setSigChldAction(true);
 
@@ -341,6 +660,32 @@ static void daemonLoop(std::optional<TrustedFlag> forceTrustClientOpt)
                 peer.pidKnown ? std::to_string(peer.pid) : "<unknown>",
                 peer.uidKnown ? user : "<unknown>");
 
+            if (threaded) {
+                if (threaded->activeThreads++ < daemonSettings.daemonThreads) {
+                    std::thread([threaded, remote{std::move(remote)}, trusted]() {
+                        Finally decrement([&]() { threaded->activeThreads--; });
+                        try {
+                            FdSource from(remote.get());
+                            FdSink to(remote.get());
+                            daemon::processThreadedConnection(threaded->store, from, to, trusted,
+                                [&](daemon::ConnectionHandOff && state) {
+                                    threaded->handOffServer.handOff(remote.get(), trusted, std::move(state));
+                                });
+                        } catch (Error & error) {
+                            auto ei = error.info();
+                            ei.msg = hintfmt("error processing connection: %1%", ei.msg.str());
+                            logError(ei);
+                        } catch (std::exception & e) {
+                            printError("unexpected Nix daemon error: %s", e.what());
+                        }
+                    }).detach();
+                } else {
+                    threaded->activeThreads--;
+                    threaded->handOffServer.handOff(remote.get(), trusted, std::nullopt);
+                }
+                continue;
+            }
+
             //  Fork a child to handle the connection.
             ProcessOptions options;
             options.errorPrefix = "unexpected Nix daemon error: ";
@@ -349,6 +694,7 @@ static void daemonLoop(std::optional<TrustedFlag> forceTrustClientOpt)
             options.allowVfork = false;
             startProcess([&]() {
                 fdSocket = -1;
+                fdMetrics = -1;
 
                 //  Background the daemon.
                 if (setsid() == -1)
@@ -216,7 +216,7 @@ const static std::string getEnvSh =
    modified derivation with the same dependencies and nearly the same
    initial environment variables, that just writes the resulting
    environment to a file and exits. */
-static StorePath getDerivationEnvironment(ref<Store> store, ref<Store> evalStore, const StorePath & drvPath)
+static StorePath getDerivationEnvironmentUncached(ref<Store> store, ref<Store> evalStore, const StorePath & drvPath)
 {
     auto drv = evalStore->derivationFromPath(drvPath);
 
@@ -284,6 +284,44 @@ static StorePath getDerivationEnvironment(ref<Store> store, ref<Store> evalStore
     throw Error("get-env.sh failed to produce an environment");
 }
 
+static StorePath getDerivationEnvironment(ref<Store> store, ref<Store> evalStore, const StorePath & drvPath)
+{
+    /* Creating the modified derivation requires hashing it modulo
+       its inputs, which reads the entire closure of input
+       derivations. So remember the environment of each derivation,
+       for as long as it's still valid. */
+    auto cacheFile = getCacheDir() + "/nix/develop-env-v1/"
+        + hashString(htSHA256,
+            store->getUri() + '\0'
+            + store->printStorePath(drvPath) + '\0'
+            + getEnvSh + '\0'
+            + (experimentalFeatureSettings.isEnabled(Xp::CaDerivations) ? "ca" : ""))
+          .to_string(HashFormat::Base32, false);
+
+    if (pathExists(cacheFile)) {
+        try {
+            auto outPath = store->parseStorePath(trim(readFile(cacheFile)));
+            if (store->isValidPath(outPath) && lstat(store->toRealPath(outPath)).st_size) {
+                debug("using cached environment '%s'", store->printStorePath(outPath));
+                return outPath;
+            }
+        } catch (Error & e) {
+            debug("ignoring cached environment: %s", e.msg());
+        }
+    }
+
+    auto outPath = getDerivationEnvironmentUncached(store, evalStore, drvPath);
+
+    try {
+        createDirs(dirOf(cacheFile));
+        writeFile(cacheFile, store->printStorePath(outPath));
+    } catch (Error & e) {
+        debug("cannot cache environment: %s", e.msg());
+    }
+
+    return outPath;
+}
+
 struct Common : InstallableCommand, MixProfile
 {
     std::set<std::string> ignoreVars{
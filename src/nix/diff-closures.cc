@@ -4,43 +4,91 @@
 #include "common-args.hh"
 #include "names.hh"
 
-#include <regex>
+#include <algorithm>
 
 namespace nix {
 
-struct Info
+/**
+ * The closures of two store paths, computed in a single batched
+ * traversal.
+ */
+struct ClosurePair
 {
-    std::string outputName;
+    /**
+     * The union of both closures, sorted.
+     */
+    std::vector<StorePath> paths;
+
+    std::vector<uint64_t> narSizes;
+
+    /**
+     * For each path, bit 0 is set if it's in the closure of the
+     * first path and bit 1 if it's in the closure of the second.
+     */
+    std::vector<uint8_t> in;
 };
 
-// name -> version -> store paths
-typedef std::map<std::string, std::map<std::string, std::map<StorePath, Info>>> GroupedPaths;
-
-GroupedPaths getClosureInfo(ref<Store> store, const StorePath & toplevel)
+static ClosurePair getClosures(Store & store, const StorePath & before, const StorePath & after)
 {
     StorePathSet closure;
-    store->computeFSClosure({toplevel}, closure);
-
-    GroupedPaths groupedPaths;
-
-    for (auto & path : closure) {
-        /* Strip the output name. Unfortunately this is ambiguous (we
-           can't distinguish between output names like "bin" and
-           version suffixes like "unstable"). */
-        static std::regex regex("(.*)-([a-z]+|lib32|lib64)");
-        std::smatch match;
-        std::string name(path.name());
-        std::string outputName;
-        if (std::regex_match(name, match, regex)) {
-            name = match[1];
-            outputName = match[2];
+    store.computeFSClosure({before, after}, closure);
+
+    /* These are in the path info cache by now. */
+    auto infos = store.queryPathInfos(closure);
+
+    ClosurePair res;
+    res.paths.assign(closure.begin(), closure.end());
+    res.narSizes.resize(res.paths.size());
+    res.in.resize(res.paths.size(), 0);
+
+    auto indexOf = [&](const StorePath & path) -> size_t {
+        return std::lower_bound(res.paths.begin(), res.paths.end(), path) - res.paths.begin();
+    };
+
+    std::vector<std::vector<size_t>> references(res.paths.size());
+    for (size_t i = 0; i < res.paths.size(); ++i) {
+        auto & info = infos.at(res.paths[i]);
+        res.narSizes[i] = info->narSize;
+        for (auto & ref : info->references)
+            if (ref != res.paths[i])
+                references[i].push_back(indexOf(ref));
+    }
+
+    auto mark = [&](const StorePath & root, uint8_t bit) {
+        std::vector<size_t> todo{indexOf(root)};
+        while (!todo.empty()) {
+            auto i = todo.back();
+            todo.pop_back();
+            if (res.in[i] & bit) continue;
+            res.in[i] |= bit;
+            for (auto j : references[i])
+                todo.push_back(j);
         }
+    };
 
-        DrvName drvName(name);
-        groupedPaths[drvName.name][drvName.version].emplace(path, Info { .outputName = outputName });
-    }
+    mark(before, 1);
+    mark(after, 2);
 
-    return groupedPaths;
+    return res;
+}
+
+/**
+ * Parse the name and version of a store path, after stripping the
+ * output name. Unfortunately this is ambiguous (we can't distinguish
+ * between output names like "bin" and version suffixes like
+ * "unstable").
+ */
+static DrvName parseName(const StorePath & path)
+{
+    auto name = path.name();
+    auto dash = name.rfind('-');
+    if (dash != name.npos) {
+        auto suffix = name.substr(dash + 1);
+        if (suffix == "lib32" || suffix == "lib64"
+            || (!suffix.empty() && std::all_of(suffix.begin(), suffix.end(), [](char c) { return c >= 'a' && c <= 'z'; })))
+            name = name.substr(0, dash);
+    }
+    return DrvName(name);
 }
 
 std::string showVersions(const std::set<std::string> & versions)
@@ -58,38 +106,52 @@ void printClosureDiff(
     const StorePath & afterPath,
     std::string_view indent)
 {
-    auto beforeClosure = getClosureInfo(store, beforePath);
-    auto afterClosure = getClosureInfo(store, afterPath);
-
-    std::set<std::string> allNames;
-    for (auto & [name, _] : beforeClosure) allNames.insert(name);
-    for (auto & [name, _] : afterClosure) allNames.insert(name);
-
-    for (auto & name : allNames) {
-        auto & beforeVersions = beforeClosure[name];
-        auto & afterVersions = afterClosure[name];
-
-        auto totalSize = [&](const std::map<std::string, std::map<StorePath, Info>> & versions)
-        {
-            uint64_t sum = 0;
-            for (auto & [_, paths] : versions)
-                for (auto & [path, _] : paths)
-                    sum += store->queryPathInfo(path)->narSize;
-            return sum;
-        };
-
-        auto beforeSize = totalSize(beforeVersions);
-        auto afterSize = totalSize(afterVersions);
-        auto sizeDelta = (int64_t) afterSize - (int64_t) beforeSize;
+    auto closures = getClosures(*store, beforePath, afterPath);
+
+    struct Changes
+    {
+        uint64_t beforeSize = 0, afterSize = 0;
+        std::set<std::string> beforeVersions, afterVersions;
+    };
+
+    /* Paths that are in both closures don't change the size or the
+       versions of anything, so only the other paths are grouped by
+       name. */
+    std::map<std::string, Changes> changes;
+    for (size_t i = 0; i < closures.paths.size(); ++i) {
+        if (closures.in[i] == 3) continue;
+        auto drvName = parseName(closures.paths[i]);
+        auto & c = changes[drvName.name];
+        if (closures.in[i] & 1) {
+            c.beforeSize += closures.narSizes[i];
+            c.beforeVersions.insert(drvName.version);
+        } else {
+            c.afterSize += closures.narSizes[i];
+            c.afterVersions.insert(drvName.version);
+        }
+    }
+
+    /* But a version that is still present isn't added or removed. */
+    for (size_t i = 0; i < closures.paths.size(); ++i) {
+        if (closures.in[i] != 3) continue;
+        auto drvName = parseName(closures.paths[i]);
+        auto c = changes.find(drvName.name);
+        if (c == changes.end()) continue;
+        c->second.beforeVersions.insert(drvName.version);
+        c->second.afterVersions.insert(drvName.version);
+    }
+
+    for (auto & [name, c] : changes) {
+        auto sizeDelta = (int64_t) c.afterSize - (int64_t) c.beforeSize;
         auto showDelta = std::abs(sizeDelta) >= 8 * 1024;
 
-        std::set<std::string> removed, unchanged;
-        for (auto & [version, _] : beforeVersions)
-            if (!afterVersions.count(version)) removed.insert(version); else unchanged.insert(version);
+        std::set<std::string> removed;
+        for (auto & version : c.beforeVersions)
+            if (!c.afterVersions.count(version)) removed.insert(version);
 
         std::set<std::string> added;
-        for (auto & [version, _] : afterVersions)
-            if (!beforeVersions.count(version)) added.insert(version);
+        for (auto & version : c.afterVersions)
+            if (!c.beforeVersions.count(version)) added.insert(version);
 
         if (showDelta || !removed.empty() || !added.empty()) {
             std::vector<std::string> items;
@@ -0,0 +1,273 @@
+#include "command-installable-value.hh"
+#include "common-args.hh"
+#include "shared.hh"
+#include "store-api.hh"
+#include "remote-store.hh"
+#include "eval.hh"
+#include "eval-inline.hh"
+#include "get-drvs.hh"
+
+#include <nlohmann/json.hpp>
+
+#include <thread>
+
+#include <poll.h>
+#include <sys/resource.h>
+
+using namespace nix;
+
+struct CmdEvalJobs : InstallableValueCommand, MixReadOnlyOption
+{
+    size_t nrWorkers = std::max(1U, std::thread::hardware_concurrency());
+    size_t maxMemorySize = 4096;
+
+    CmdEvalJobs()
+    {
+        addFlag({
+            .longName = "workers",
+            .description = "Number of evaluator processes to use. If *n* is 0, evaluate in the `nix` process itself.",
+            .labels = {"n"},
+            .handler = {&nrWorkers},
+        });
+
+        addFlag({
+            .longName = "max-memory-size",
+            .description = "Restart an evaluator process after it has used more than *size* MiB of memory.",
+            .labels = {"size"},
+            .handler = {&maxMemorySize},
+        });
+    }
+
+    std::string description() override
+    {
+        return "evaluate the derivations in an attribute set in parallel";
+    }
+
+    std::string doc() override
+    {
+        return
+          #include "eval-jobs.md"
+          ;
+    }
+
+    Category category() override { return catSecondary; }
+
+    /**
+     * Evaluate the derivations in the top-level attribute `name` of
+     * `vRoot`. Returns a JSON object for each derivation, or an
+     * object describing the error.
+     */
+    std::vector<nlohmann::json> evalJob(EvalState & state, Bindings & autoArgs, Value & vRoot, const std::string & name)
+    {
+        std::vector<nlohmann::json> res;
+
+        try {
+            auto a = vRoot.attrs->get(state.symbols.create(name));
+            assert(a);
+
+            DrvInfos drvs;
+            getDerivations(state, *a->value, name, autoArgs, drvs, false);
+
+            for (auto & drv : drvs) {
+                nlohmann::json job;
+                job["attr"] = drv.attrPath;
+                job["name"] = drv.queryName();
+                job["system"] = drv.querySystem();
+                job["drvPath"] = state.store->printStorePath(drv.requireDrvPath());
+                auto & outputs = job["outputs"] = nlohmann::json::object();
+                for (auto & [outputName, outputPath] : drv.queryOutputs())
+                    outputs[outputName] = outputPath ? nlohmann::json(state.store->printStorePath(*outputPath)) : nullptr;
+                res.push_back(std::move(job));
+            }
+        } catch (Error & e) {
+            res.push_back({{"attr", name}, {"error", filterANSIEscapes(e.what(), true)}});
+        }
+
+        return res;
+    }
+
+    static uint64_t getMaxRSS()
+    {
+        struct rusage r;
+        if (getrusage(RUSAGE_SELF, &r) == -1)
+            throw SysError("getting resource usage");
+#if __APPLE__
+        return r.ru_maxrss;
+#else
+        return (uint64_t) r.ru_maxrss * 1024;
+#endif
+    }
+
+    /**
+     * The main loop of a worker process. It asks the parent for a job
+     * by writing `next`, and then either receives `do <attr>` or
+     * `exit`. When it has grown too big, it writes `restart` and
+     * exits, so that the parent forks a fresh worker.
+     */
+    void worker(EvalState & state, Bindings & autoArgs, Value & vRoot, int from, int to)
+    {
+        /* Don't share the parent's connections to the daemon. */
+        if (auto remoteStore = state.store.dynamic_pointer_cast<RemoteStore>())
+            remoteStore->forgetConnections();
+
+        while (true) {
+            writeLine(to, "next");
+
+            auto s = readLine(from);
+            if (s == "exit") break;
+            if (!hasPrefix(s, "do "))
+                throw Error("unexpected worker command '%s'", s);
+
+            for (auto & job : evalJob(state, autoArgs, vRoot, s.substr(3)))
+                writeLine(to, job.dump());
+
+            if (getMaxRSS() > (uint64_t) maxMemorySize * 1024 * 1024) {
+                writeLine(to, "restart");
+                break;
+            }
+        }
+    }
+
+    struct Worker
+    {
+        Pid pid;
+        AutoCloseFD to, from;
+        std::optional<std::string> job;
+    };
+
+    void run(ref<Store> store, ref<InstallableValue> installable) override
+    {
+        auto state = getEvalState();
+        auto & autoArgs = *getAutoArgs(*state);
+
+        auto [v, pos] = installable->toValue(*state);
+
+        auto vRoot = state->allocValue();
+        state->autoCallFunction(autoArgs, *v, *vRoot);
+        state->forceAttrs(*vRoot, pos, "while evaluating the attribute set of jobs");
+
+        std::vector<std::string> jobs;
+        for (auto & attr : vRoot->attrs->lexicographicOrder(state->symbols))
+            jobs.push_back(state->symbols[attr->name]);
+
+        bool failed = false;
+
+        auto printJob = [&](const std::string & line) {
+            if (nlohmann::json::parse(line).contains("error"))
+                failed = true;
+            logger->cout("%s", line);
+        };
+
+        /* Worker processes are forked from this process, so they
+           can't use open database connections or other per-process
+           resources. Only connections to the daemon can be replaced
+           by new ones. */
+        if (nrWorkers && !state->store.dynamic_pointer_cast<RemoteStore>()) {
+            warn("store '%s' can't be shared with worker processes, evaluating in this process", state->store->getUri());
+            nrWorkers = 0;
+        }
+
+        if (!nrWorkers) {
+            for (auto & name : jobs)
+                for (auto & job : evalJob(*state, autoArgs, *vRoot, name))
+                    printJob(job.dump());
+            if (failed) throw Exit(1);
+            return;
+        }
+
+        auto startWorker = [&](Worker & w) {
+            Pipe toWorker, fromWorker;
+            toWorker.create();
+            fromWorker.create();
+
+            w.pid = startProcess([&]() {
+                toWorker.writeSide.close();
+                fromWorker.readSide.close();
+                worker(*state, autoArgs, *vRoot, toWorker.readSide.get(), fromWorker.writeSide.get());
+                _exit(0);
+            }, {
+                .errorPrefix = "evaluator process error: ",
+            });
+
+            w.to = std::move(toWorker.writeSide);
+            w.from = std::move(fromWorker.readSide);
+            w.job.reset();
+        };
+
+        auto stopWorker = [&](Worker & w) {
+            w.to.close();
+            w.from.close();
+            w.pid.wait();
+        };
+
+        size_t nextJob = 0;
+
+        std::vector<Worker> workers(std::min(nrWorkers, jobs.size()));
+        for (auto & w : workers)
+            startWorker(w);
+
+        size_t active = workers.size();
+
+        while (active) {
+            std::vector<struct pollfd> fds;
+            for (auto & w : workers)
+                fds.push_back({ .fd = w.from ? w.from.get() : -1, .events = POLLIN });
+
+            if (poll(fds.data(), fds.size(), -1) == -1) {
+                if (errno == EINTR) continue;
+                throw SysError("waiting for evaluator processes");
+            }
+
+            checkInterrupt();
+
+            for (size_t n = 0; n < workers.size(); ++n) {
+                if (!fds[n].revents) continue;
+                auto & w = workers[n];
+
+                std::string line;
+                try {
+                    line = readLine(w.from.get());
+                } catch (EndOfFile &) {
+                    /* The worker died while evaluating a job, e.g.
+                       because it ran out of memory or stack. Report
+                       the job as failed and carry on with a new
+                       worker. */
+                    stopWorker(w);
+                    if (!w.job)
+                        throw Error("evaluator process exited unexpectedly");
+                    printJob(nlohmann::json{{"attr", *w.job}, {"error", "evaluator process exited unexpectedly"}}.dump());
+                    startWorker(w);
+                    continue;
+                }
+
+                if (line == "next") {
+                    w.job.reset();
+                    if (nextJob < jobs.size()) {
+                        w.job = jobs[nextJob++];
+                        writeLine(w.to.get(), "do " + *w.job);
+                    } else {
+                        writeLine(w.to.get(), "exit");
+                        stopWorker(w);
+                        active--;
+                    }
+                }
+
+                else if (line == "restart") {
+                    w.job.reset();
+                    stopWorker(w);
+                    if (nextJob < jobs.size())
+                        startWorker(w);
+                    else
+                        active--;
+                }
+
+                else
+                    printJob(line);
+            }
+        }
+
+        if (failed) throw Exit(1);
+    }
+};
+
+static auto rCmdEvalJobs = registerCommand<CmdEvalJobs>("eval-jobs");
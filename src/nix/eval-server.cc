@@ -0,0 +1,117 @@
+#include "command.hh"
+#include "installable-value.hh"
+#include "shared.hh"
+#include "store-api.hh"
+#include "eval.hh"
+#include "eval-inline.hh"
+#include "value-to-json.hh"
+
+#include <nlohmann/json.hpp>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+using namespace nix;
+
+struct CmdEvalServer : SourceExprCommand, MixReadOnlyOption
+{
+    Path socketPath;
+
+    CmdEvalServer()
+    {
+        addFlag({
+            .longName = "socket",
+            .description = "Listen for requests on the Unix domain socket *path*.",
+            .labels = {"path"},
+            .handler = {&socketPath},
+            .completer = completePath,
+        });
+    }
+
+    std::string description() override
+    {
+        return "evaluate installables on request, keeping the evaluator's caches warm";
+    }
+
+    std::string doc() override
+    {
+        return
+          #include "eval-server.md"
+          ;
+    }
+
+    Category category() override { return catSecondary; }
+
+    nlohmann::json handleRequest(ref<Store> store, EvalState & state, const std::string & line)
+    {
+        try {
+            auto request = nlohmann::json::parse(line);
+
+            if (state.resetFileCacheIfChanged())
+                printInfo("source files have changed, discarding cached evaluation results");
+
+            auto installable = InstallableValue::require(
+                parseInstallable(store, request.at("installable").get<std::string>()));
+
+            auto [v, pos] = installable->toValue(state);
+
+            if (request.contains("apply")) {
+                auto vApply = state.allocValue();
+                state.eval(state.parseExprFromString(request["apply"].get<std::string>(), state.rootPath(CanonPath::fromCwd())), *vApply);
+                auto vRes = state.allocValue();
+                state.callFunction(*vApply, *v, *vRes, noPos);
+                v = vRes;
+            }
+
+            NixStringContext context;
+            return {{"value", printValueAsJSON(state, true, *v, pos, context, false)}};
+        } catch (nlohmann::json::exception & e) {
+            return {{"error", fmt("invalid request: %s", e.what())}};
+        } catch (Error & e) {
+            return {{"error", filterANSIEscapes(e.what(), true)}};
+        }
+    }
+
+    void run(ref<Store> store) override
+    {
+        if (socketPath.empty())
+            throw UsageError("'--socket' is required");
+
+        auto state = getEvalState();
+        state->trackFileChanges = true;
+
+        createDirs(dirOf(socketPath));
+        AutoCloseFD fdSocket = createUnixDomainSocket(socketPath, 0600);
+
+        printInfo("listening on '%s'", socketPath);
+
+        while (true) {
+            struct sockaddr_un remoteAddr;
+            socklen_t remoteAddrLen = sizeof(remoteAddr);
+
+            AutoCloseFD remote = accept(fdSocket.get(),
+                (struct sockaddr *) &remoteAddr, &remoteAddrLen);
+            checkInterrupt();
+            if (!remote) {
+                if (errno == EINTR) continue;
+                throw SysError("accepting connection");
+            }
+
+            closeOnExec(remote.get());
+
+            /* Requests are handled one at a time, since the
+               evaluator is not thread-safe. */
+            try {
+                while (true) {
+                    auto line = readLine(remote.get());
+                    writeLine(remote.get(), handleRequest(store, *state, line).dump());
+                }
+            } catch (EndOfFile &) {
+            } catch (SysError & e) {
+                printError("error handling connection: %s", e.msg());
+            }
+        }
+    }
+};
+
+static auto rCmdEvalServer = registerCommand<CmdEvalServer>("eval-server");
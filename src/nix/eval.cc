@@ -116,7 +116,9 @@ struct CmdEval : MixJSON, InstallableValueCommand, MixReadOnlyOption
         }
 
         else if (json) {
-            logger->cout("%s", printValueAsJSON(*state, true, *v, pos, context, false));
+            std::ostringstream str;
+            printValueAsJSON(*state, true, *v, pos, str, context, false);
+            logger->cout("%s", str.str());
         }
 
         else {
@@ -15,6 +15,7 @@
 #include "registry.hh"
 #include "eval-cache.hh"
 #include "markdown.hh"
+#include "finally.hh"
 
 #include <nlohmann/json.hpp>
 #include <queue>
@@ -300,6 +301,7 @@ struct CmdFlakeInfo : CmdFlakeMetadata
 struct CmdFlakeCheck : FlakeCommand
 {
     bool build = true;
+    bool buildDuringEval = false;
     bool checkAllSystems = false;
 
     CmdFlakeCheck()
@@ -309,6 +311,11 @@ struct CmdFlakeCheck : FlakeCommand
             .description = "Do not build checks.",
             .handler = {&build, false}
         });
+        addFlag({
+            .longName = "build-during-eval",
+            .description = "Start building checks while the rest of the flake is still being evaluated.",
+            .handler = {&buildDuringEval, true}
+        });
         addFlag({
             .longName = "all-systems",
             .description = "Check the outputs for all systems.",
@@ -402,6 +409,56 @@ struct CmdFlakeCheck : FlakeCommand
 
         std::vector<DerivedPath> drvPaths;
 
+        /* With --build-during-eval, checks are handed to a thread
+           that builds them in batches while evaluation continues. */
+        struct BuildQueue
+        {
+            std::vector<DerivedPath> paths;
+            bool done = false;
+        };
+        Sync<BuildQueue> buildQueue_;
+        std::condition_variable buildQueueWakeup;
+        std::exception_ptr buildError;
+        std::thread builder;
+
+        if (build && buildDuringEval)
+            builder = std::thread([&]() {
+                while (true) {
+                    std::vector<DerivedPath> batch;
+                    {
+                        auto buildQueue(buildQueue_.lock());
+                        while (!buildQueue->done && buildQueue->paths.empty())
+                            buildQueue.wait(buildQueueWakeup);
+                        if (buildQueue->paths.empty()) return;
+                        std::swap(batch, buildQueue->paths);
+                    }
+                    if (buildError && !settings.keepGoing) continue;
+                    try {
+                        Activity act(*logger, lvlInfo, actUnknown, "running flake checks");
+                        store->buildPaths(batch);
+                    } catch (...) {
+                        if (!buildError) buildError = std::current_exception();
+                    }
+                }
+            });
+
+        auto stopBuilder = [&]() {
+            if (!builder.joinable()) return;
+            buildQueue_.lock()->done = true;
+            buildQueueWakeup.notify_one();
+            builder.join();
+        };
+
+        Finally cleanup([&]() { stopBuilder(); });
+
+        auto addCheck = [&](DerivedPath && path) {
+            if (builder.joinable()) {
+                buildQueue_.lock()->paths.push_back(std::move(path));
+                buildQueueWakeup.notify_one();
+            } else
+                drvPaths.push_back(std::move(path));
+        };
+
         auto checkApp = [&](const std::string & attrPath, Value & v, const PosIdx pos) {
             try {
                 #if 0
@@ -577,7 +634,7 @@ struct CmdFlakeCheck : FlakeCommand
                                             fmt("%s.%s.%s", name, attr_name, state->symbols[attr2.name]),
                                             *attr2.value, attr2.pos);
                                         if (drvPath && attr_name == settings.thisSystem.get()) {
-                                            drvPaths.push_back(DerivedPath::Built {
+                                            addCheck(DerivedPath::Built {
                                                 .drvPath = makeConstantStorePathRef(*drvPath),
                                                 .outputs = OutputsSpec::All { },
                                             });
@@ -757,6 +814,10 @@ struct CmdFlakeCheck : FlakeCommand
                 });
         }
 
+        stopBuilder();
+        if (buildError)
+            std::rethrow_exception(buildError);
+
         if (build && !drvPaths.empty()) {
             Activity act(*logger, lvlInfo, actUnknown, "running flake checks");
             store->buildPaths(drvPaths);
@@ -1342,7 +1403,16 @@ struct CmdFlakeShow : FlakeCommand, MixJSON
 
         auto cache = openEvalCache(*state, flake);
 
-        auto j = visit(*cache->getRoot(), {}, fmt(ANSI_BOLD "%s" ANSI_NORMAL, flake->flake.lockedRef), "");
+        auto root = cache->getRoot();
+
+        /* Load the cached outputs in bulk, down to the descriptions of
+           packages. `legacyPackages` is skipped since it can be huge
+           and is only shown partially. */
+        for (auto & attr : root->getAttrs())
+            if (state->symbols[attr] != "legacyPackages")
+                root->getAttr(attr)->prefetch(4);
+
+        auto j = visit(*root, {}, fmt(ANSI_BOLD "%s" ANSI_NORMAL, flake->flake.lockedRef), "");
         if (json)
             logger->cout("%s", j.dump());
     }
@@ -5,6 +5,7 @@
 #include "shared.hh"
 #include "references.hh"
 #include "archive.hh"
+#include "file-hash-cache.hh"
 
 using namespace nix;
 
@@ -77,6 +78,13 @@ struct CmdHashBase : Command
     {
         for (auto path : paths) {
 
+            if (!modulus) {
+                Hash h = hashPathCached(absPath(path), mode, ht);
+                if (truncate && h.hashSize > 20) h = compressHash(h, 20);
+                logger->cout(h.to_string(hashFormat, hashFormat == HashFormat::SRI));
+                continue;
+            }
+
             std::unique_ptr<AbstractHashSink> hashSink;
             if (modulus)
                 hashSink = std::make_unique<HashModuloSink>(ht, *modulus);
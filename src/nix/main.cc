@@ -13,6 +13,7 @@
 #include "finally.hh"
 #include "loggers.hh"
 #include "markdown.hh"
+#include "startup-profile.hh"
 #include "memory-input-accessor.hh"
 
 #include <sys/types.h>
@@ -63,6 +64,7 @@ struct NixArgs : virtual MultiCommand, virtual MixCommonArgs, virtual RootArgs
     bool refresh = false;
     bool helpRequested = false;
     bool showVersion = false;
+    bool startupProfile = false;
 
     NixArgs() : MultiCommand(RegisterCommand::getCommandsFor({})), MixCommonArgs("nix")
     {
@@ -96,6 +98,13 @@ struct NixArgs : virtual MultiCommand, virtual MixCommonArgs, virtual RootArgs
             .handler = {[&]() { showVersion = true; }},
         });
 
+        addFlag({
+            .longName = "startup-profile",
+            .description = "Show the time spent in each phase of startup (such as loading the configuration and opening the store) on standard error when Nix exits.",
+            .category = miscCategory,
+            .handler = {[&]() { startupProfile = true; }},
+        });
+
         addFlag({
             .longName = "offline",
             .aliases = {"no-net"}, // FIXME: remove
@@ -317,8 +326,17 @@ void mainWrapped(int argc, char * * argv)
         return;
     }
 
+    /* `nix --version` doesn't depend on the configuration, so don't
+       bother loading it. This is called a lot by shell prompts. */
+    if (argc == 2 && std::string_view(argv[1]) == "--version" && baseNameOf(argv[0]) == "nix")
+        printVersion("nix");
+
     initNix();
-    initGC();
+
+    {
+        StartupPhase phase("initialise garbage collector");
+        initGC();
+    }
 
     #if __linux__
     if (getuid() == 0) {
@@ -355,7 +373,10 @@ void mainWrapped(int argc, char * * argv)
         verbosity = lvlInfo;
     }
 
+    std::optional<StartupPhase> argsPhase;
+    argsPhase.emplace("register commands");
     NixArgs args;
+    argsPhase.reset();
 
     if (argc == 2 && std::string(argv[1]) == "__dump-cli") {
         logger->cout(args.dumpCli());
@@ -424,7 +445,14 @@ void mainWrapped(int argc, char * * argv)
         }
     });
 
+    Finally printStartupProfile([&]()
+    {
+        if (args.startupProfile)
+            printError("%s", chomp(showStartupProfile()));
+    });
+
     try {
+        StartupPhase phase("parse command line");
         args.parseCmdline(argvToStrings(argc, argv));
     } catch (UsageError &) {
         if (!args.helpRequested && !args.completions) throw;
@@ -483,6 +511,8 @@ void mainWrapped(int argc, char * * argv)
     if (args.command->second->forceImpureByDefault() && !evalSettings.pureEval.overridden) {
         evalSettings.pureEval = false;
     }
+
+    StartupPhase phase("run command");
     args.command->second->run();
 }
 
@@ -95,6 +95,10 @@ struct CmdPathInfo : StorePathsCommand, MixJSON
 
         else {
 
+            std::map<StorePath, std::pair<uint64_t, uint64_t>> closureSizes;
+            if (showClosureSize)
+                closureSizes = store->getClosureSizes(StorePathSet(storePaths.begin(), storePaths.end()));
+
             for (auto & storePath : storePaths) {
                 auto info = store->queryPathInfo(storePath);
                 auto storePathS = store->printStorePath(info->path);
@@ -108,7 +112,7 @@ struct CmdPathInfo : StorePathsCommand, MixJSON
                     printSize(info->narSize);
 
                 if (showClosureSize)
-                    printSize(store->getClosureSize(info->path).first);
+                    printSize(closureSizes.at(info->path).first);
 
                 if (showSigs) {
                     std::cout << '\t';
@@ -108,6 +108,12 @@ struct ProfileManifest
 {
     std::vector<ProfileElement> elements;
 
+    /**
+     * The profile this manifest was read from, which `build()` can
+     * extend instead of linking every package again.
+     */
+    std::optional<PreviousProfile> previous;
+
     ProfileManifest() { }
 
     ProfileManifest(EvalState & state, const Path & profile)
@@ -151,6 +157,11 @@ struct ProfileManifest
                 }
                 elements.emplace_back(std::move(element));
             }
+
+            previous = PreviousProfile {
+                .path = state.store->printStorePath(state.store->followLinksToStorePath(profile)),
+                .pkgs = packages(*state.store),
+            };
         }
 
         else if (pathExists(profile + "/manifest.nix")) {
@@ -193,22 +204,26 @@ struct ProfileManifest
         return json;
     }
 
+    Packages packages(const Store & store) const
+    {
+        Packages pkgs;
+        for (auto & element : elements)
+            if (element.active)
+                for (auto & path : element.storePaths)
+                    pkgs.emplace_back(store.printStorePath(path), true, element.priority);
+        return pkgs;
+    }
+
     StorePath build(ref<Store> store)
     {
         auto tempDir = createTempDir();
 
         StorePathSet references;
-
-        Packages pkgs;
-        for (auto & element : elements) {
-            for (auto & path : element.storePaths) {
-                if (element.active)
-                    pkgs.emplace_back(store->printStorePath(path), true, element.priority);
+        for (auto & element : elements)
+            for (auto & path : element.storePaths)
                 references.insert(path);
-            }
-        }
 
-        buildProfile(tempDir, std::move(pkgs));
+        buildProfile(tempDir, packages(*store), previous);
 
         writeFile(tempDir + "/manifest.json", toJSON(*store).dump());
 
@@ -91,6 +91,66 @@ struct CmdSearch : InstallableValueCommand, MixJSON
 
         uint64_t results = 0;
 
+        /* Print a package if it matches the search terms. */
+        auto showResult = [&](const std::string & attrPath2, const std::string & pname, const std::string & version, const std::string & description)
+        {
+            std::vector<std::smatch> attrPathMatches;
+            std::vector<std::smatch> descriptionMatches;
+            std::vector<std::smatch> nameMatches;
+            bool found = false;
+
+            for (auto & regex : excludeRegexes) {
+                if (
+                    std::regex_search(attrPath2, regex)
+                    || std::regex_search(pname, regex)
+                    || std::regex_search(description, regex))
+                    return;
+            }
+
+            for (auto & regex : regexes) {
+                found = false;
+                auto addAll = [&found](std::sregex_iterator it, std::vector<std::smatch> & vec) {
+                    const auto end = std::sregex_iterator();
+                    while (it != end) {
+                        vec.push_back(*it++);
+                        found = true;
+                    }
+                };
+
+                addAll(std::sregex_iterator(attrPath2.begin(), attrPath2.end(), regex), attrPathMatches);
+                addAll(std::sregex_iterator(pname.begin(), pname.end(), regex), nameMatches);
+                addAll(std::sregex_iterator(description.begin(), description.end(), regex), descriptionMatches);
+
+                if (!found)
+                    break;
+            }
+
+            if (found)
+            {
+                results++;
+                if (json) {
+                    (*jsonOut)[attrPath2] = {
+                        {"pname", pname},
+                        {"version", version},
+                        {"description", description},
+                    };
+                } else {
+                    auto name2 = hiliteMatches(pname, nameMatches, ANSI_GREEN, "\e[0;2m");
+                    if (results > 1) logger->cout("");
+                    logger->cout(
+                        "* %s%s",
+                        wrap("\e[0;1m", hiliteMatches(attrPath2, attrPathMatches, ANSI_GREEN, "\e[0;1m")),
+                        version != "" ? " (" + version + ")" : "");
+                    if (description != "")
+                        logger->cout(
+                            "  %s", hiliteMatches(description, descriptionMatches, ANSI_GREEN, ANSI_NORMAL));
+                }
+            }
+        };
+
+        /* The packages found by visit(), for the search index. */
+        std::vector<eval_cache::SearchEntry> entries;
+
         std::function<void(eval_cache::AttrCursor & cursor, const std::vector<Symbol> & attrPath, bool initialRecurse)> visit;
 
         visit = [&](eval_cache::AttrCursor & cursor, const std::vector<Symbol> & attrPath, bool initialRecurse)
@@ -119,58 +179,14 @@ struct CmdSearch : InstallableValueCommand, MixJSON
                     std::replace(description.begin(), description.end(), '\n', ' ');
                     auto attrPath2 = concatStringsSep(".", attrPathS);
 
-                    std::vector<std::smatch> attrPathMatches;
-                    std::vector<std::smatch> descriptionMatches;
-                    std::vector<std::smatch> nameMatches;
-                    bool found = false;
-
-                    for (auto & regex : excludeRegexes) {
-                        if (
-                            std::regex_search(attrPath2, regex)
-                            || std::regex_search(name.name, regex)
-                            || std::regex_search(description, regex))
-                            return;
-                    }
-
-                    for (auto & regex : regexes) {
-                        found = false;
-                        auto addAll = [&found](std::sregex_iterator it, std::vector<std::smatch> & vec) {
-                            const auto end = std::sregex_iterator();
-                            while (it != end) {
-                                vec.push_back(*it++);
-                                found = true;
-                            }
-                        };
-
-                        addAll(std::sregex_iterator(attrPath2.begin(), attrPath2.end(), regex), attrPathMatches);
-                        addAll(std::sregex_iterator(name.name.begin(), name.name.end(), regex), nameMatches);
-                        addAll(std::sregex_iterator(description.begin(), description.end(), regex), descriptionMatches);
-
-                        if (!found)
-                            break;
-                    }
+                    entries.push_back({
+                        .attrPath = attrPath2,
+                        .pname = name.name,
+                        .version = name.version,
+                        .description = description,
+                    });
 
-                    if (found)
-                    {
-                        results++;
-                        if (json) {
-                            (*jsonOut)[attrPath2] = {
-                                {"pname", name.name},
-                                {"version", name.version},
-                                {"description", description},
-                            };
-                        } else {
-                            auto name2 = hiliteMatches(name.name, nameMatches, ANSI_GREEN, "\e[0;2m");
-                            if (results > 1) logger->cout("");
-                            logger->cout(
-                                "* %s%s",
-                                wrap("\e[0;1m", hiliteMatches(attrPath2, attrPathMatches, ANSI_GREEN, "\e[0;1m")),
-                                name.version != "" ? " (" + name.version + ")" : "");
-                            if (description != "")
-                                logger->cout(
-                                    "  %s", hiliteMatches(description, descriptionMatches, ANSI_GREEN, ANSI_NORMAL));
-                        }
-                    }
+                    showResult(attrPath2, name.name, name.version, description);
                 }
 
                 else if (
@@ -194,8 +210,23 @@ struct CmdSearch : InstallableValueCommand, MixJSON
             }
         };
 
-        for (auto & cursor : installable->getCursors(*state))
+        for (auto & cursor : installable->getCursors(*state)) {
+            /* If an earlier search has recorded the packages below
+               this attribute, use those rather than walking the
+               attribute tree. */
+            if (auto index = cursor->getSearchIndex()) {
+                for (auto & entry : *index)
+                    showResult(entry.attrPath, entry.pname, entry.version, entry.description);
+                continue;
+            }
+
+            /* Load the cached packages and their names and
+               descriptions in bulk. */
+            cursor->prefetch(3);
+            entries.clear();
             visit(*cursor, cursor->getAttrPath(), true);
+            cursor->setSearchIndex(entries);
+        }
 
         if (json)
             logger->cout("%s", *jsonOut);
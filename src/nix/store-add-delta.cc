@@ -0,0 +1,59 @@
+#include "command.hh"
+#include "store-api.hh"
+#include "binary-cache-store.hh"
+
+using namespace nix;
+
+struct CmdStoreAddDelta : virtual CopyCommand, virtual StorePathsCommand
+{
+    std::string base;
+
+    CmdStoreAddDelta()
+    {
+        addFlag({
+            .longName = "base",
+            .description = "The store path to compute the deltas against.",
+            .labels = {"store-path"},
+            .handler = {&base},
+            .completer = completePath
+        });
+    }
+
+    std::string description() override
+    {
+        return "add binary deltas of store paths to a binary cache";
+    }
+
+    std::string doc() override
+    {
+        return
+          #include "store-add-delta.md"
+          ;
+    }
+
+    void run(ref<Store> srcStore, StorePaths && storePaths) override
+    {
+        if (base.empty())
+            throw UsageError("you must pass '--base'");
+
+        auto dstStore = getDstStore();
+
+        auto binaryCache = dstStore.dynamic_pointer_cast<BinaryCacheStore>();
+        if (!binaryCache)
+            throw UsageError("'%s' is not a binary cache", dstStore->getUri());
+
+        auto basePath = srcStore->followLinksToStorePath(base);
+
+        for (auto & path : storePaths) {
+            if (path == basePath) continue;
+            if (binaryCache->addNarDelta(path, basePath, *srcStore))
+                notice("added a delta of '%s' against '%s'",
+                    srcStore->printStorePath(path), srcStore->printStorePath(basePath));
+            else
+                notice("skipped '%s', since its delta against '%s' is not smaller than its NAR",
+                    srcStore->printStorePath(path), srcStore->printStorePath(basePath));
+        }
+    }
+};
+
+static auto rCmdStoreAddDelta = registerCommand2<CmdStoreAddDelta>({"store", "add-delta"});
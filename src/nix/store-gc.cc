@@ -4,12 +4,15 @@
 #include "store-api.hh"
 #include "store-cast.hh"
 #include "gc-store.hh"
+#include "profiles.hh"
+#include "cache.hh"
 
 using namespace nix;
 
 struct CmdStoreGC : StoreCommand, MixDryRun
 {
     GCOptions options;
+    std::optional<std::string> fetcherCacheMaxAge;
 
     CmdStoreGC()
     {
@@ -19,6 +22,17 @@ struct CmdStoreGC : StoreCommand, MixDryRun
             .labels = {"n"},
             .handler = {&options.maxFreed}
         });
+
+        addFlag({
+            .longName = "fetcher-cache-older-than",
+            .description =
+                "Before collecting garbage, remove the fetcher cache entries "
+                "older than *age*, so that the sources they refer to can be "
+                "deleted. *age* must be in the format *N*`d`, where *N* "
+                "denotes a number of days.",
+            .labels = {"age"},
+            .handler = {&fetcherCacheMaxAge},
+        });
     }
 
     std::string description() override
@@ -37,6 +51,16 @@ struct CmdStoreGC : StoreCommand, MixDryRun
     {
         auto & gcStore = require<GcStore>(*store);
 
+        if (fetcherCacheMaxAge) {
+            auto t = parseOlderThanTimeSpec(*fetcherCacheMaxAge);
+            if (dryRun)
+                notice("would remove fetcher cache entries older than %s", *fetcherCacheMaxAge);
+            else {
+                auto n = fetchers::getCache()->prune(t);
+                notice("removed %d fetcher cache entries", n);
+            }
+        }
+
         options.action = dryRun ? GCOptions::gcReturnDead : GCOptions::gcDeleteDead;
         GCResults results;
         PrintFreed freed(options.action == GCOptions::gcDeleteDead, results);
@@ -4,6 +4,8 @@
 #include "sync.hh"
 #include "thread-pool.hh"
 #include "references.hh"
+#include "local-fs-store.hh"
+#include "globals.hh"
 
 #include <atomic>
 
@@ -15,6 +17,7 @@ struct CmdVerify : StorePathsCommand
     bool noTrust = false;
     Strings substituterUris;
     size_t sigsNeeded = 0;
+    std::optional<Path> checkpointFile;
 
     CmdVerify()
     {
@@ -45,6 +48,14 @@ struct CmdVerify : StorePathsCommand
             .labels = {"n"},
             .handler = {&sigsNeeded}
         });
+
+        addFlag({
+            .longName = "checkpoint",
+            .description = "Record the paths that have been verified successfully in *file*, and skip the paths already recorded there.",
+            .labels = {"file"},
+            .handler = {&checkpointFile},
+            .completer = completePath
+        });
     }
 
     std::string description() override
@@ -79,17 +90,45 @@ struct CmdVerify : StorePathsCommand
             act.progress(done, storePaths.size(), active, failed);
         };
 
-        ThreadPool pool;
+        /* Skip the paths that have been verified by a previous,
+           interrupted run. */
+        std::set<std::string> verified;
+        AutoCloseFD checkpointFd;
+        std::mutex checkpointMutex;
+
+        if (checkpointFile) {
+            if (pathExists(*checkpointFile))
+                for (auto & line : tokenizeString<Strings>(readFile(*checkpointFile), "\n"))
+                    verified.insert(line);
+            checkpointFd = open(checkpointFile->c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+            if (!checkpointFd)
+                throw SysError("opening checkpoint file '%s'", *checkpointFile);
+        }
+
+        /* For local stores, process paths in the order in which they
+           are likely to be laid out on disk. */
+        if (auto localStore = store.dynamic_pointer_cast<LocalFSStore>(); localStore && !noContents)
+            storePaths = localStore->sortByInode(StorePathSet(storePaths.begin(), storePaths.end()));
+
+        ThreadPool pool(settings.verifyJobs);
 
         auto doPath = [&](const StorePath & storePath) {
             try {
                 checkInterrupt();
 
+                if (verified.count(store->printStorePath(storePath))) {
+                    done++;
+                    update();
+                    return;
+                }
+
                 MaintainCount<std::atomic<size_t>> mcActive(active);
                 update();
 
                 auto info = store->queryPathInfo(storePath);
 
+                bool ok = true;
+
                 // Note: info->path can be different from storePath
                 // for binary cache stores when using --all (since we
                 // can't enumerate names efficiently).
@@ -104,6 +143,7 @@ struct CmdVerify : StorePathsCommand
                     auto hash = hashSink.finish();
 
                     if (hash.first != info->narHash) {
+                        ok = false;
                         corrupted++;
                         act2.result(resCorruptedPath, store->printStorePath(info->path));
                         printError("path '%s' was modified! expected hash '%s', got '%s'",
@@ -155,6 +195,7 @@ struct CmdVerify : StorePathsCommand
                     }
 
                     if (!good) {
+                        ok = false;
                         untrusted++;
                         act2.result(resUntrustedPath, store->printStorePath(info->path));
                         printError("path '%s' is untrusted", store->printStorePath(info->path));
@@ -162,6 +203,11 @@ struct CmdVerify : StorePathsCommand
 
                 }
 
+                if (ok && checkpointFd) {
+                    std::lock_guard<std::mutex> lock(checkpointMutex);
+                    writeFull(checkpointFd.get(), store->printStorePath(storePath) + "\n");
+                }
+
                 done++;
 
             } catch (Error & e) {
@@ -177,6 +223,12 @@ struct CmdVerify : StorePathsCommand
 
         pool.process();
 
+        /* Start from scratch next time if everything was verified. */
+        if (checkpointFile && !corrupted && !untrusted && !failed) {
+            checkpointFd.close();
+            deletePath(*checkpointFile);
+        }
+
         throw Exit(
             (corrupted ? 1 : 0) |
             (untrusted ? 2 : 0) |
@@ -3,6 +3,8 @@
 #include "progress-bar.hh"
 #include "fs-accessor.hh"
 #include "shared.hh"
+#include "references.hh"
+#include "sqlite.hh"
 
 #include <queue>
 
@@ -27,6 +29,98 @@ static std::string filterPrintable(const std::string & s)
     return res;
 }
 
+/**
+ * An occurrence of a reference in a store path: the file or symlink
+ * that contains it, and the (printable) text around it.
+ */
+struct Hit
+{
+    std::string file;
+    bool symlink;
+    std::string text;
+    size_t pos;
+};
+
+/**
+ * The hits of every reference of a store path, by the hash part of
+ * the reference.
+ */
+typedef std::map<std::string, std::vector<Hit>> Hits;
+
+static const char * referenceIndexSchema = R"sql(
+
+create table if not exists Scanned (
+    narHash   text primary key not null,
+    timestamp integer not null
+);
+
+create table if not exists Hits (
+    narHash   text not null,
+    hash      text not null,
+    file      text not null,
+    symlink   integer not null,
+    text      text not null,
+    pos       integer not null,
+    foreign key (narHash) references Scanned(narHash) on delete cascade
+);
+
+create index if not exists IndexHits on Hits(narHash);
+
+)sql";
+
+/**
+ * A persistent index of where the references of a store path occur,
+ * keyed by the NAR hash of the path, so that `--precise` only has to
+ * read the contents of a path once.
+ */
+struct ReferenceIndex
+{
+    SQLite db;
+    SQLiteStmt queryScanned, queryHits, insertScanned, insertHit;
+
+    ReferenceIndex()
+    {
+        auto dbPath = getCacheDir() + "/nix/reference-index-v1.sqlite";
+        createDirs(dirOf(dbPath));
+
+        db = SQLite(dbPath);
+        db.isCache();
+        db.exec(referenceIndexSchema);
+
+        queryScanned.create(db, "select 1 from Scanned where narHash = ?");
+        queryHits.create(db, "select hash, file, symlink, text, pos from Hits where narHash = ? order by rowid");
+        insertScanned.create(db, "insert or replace into Scanned(narHash, timestamp) values (?, ?)");
+        insertHit.create(db, "insert into Hits(narHash, hash, file, symlink, text, pos) values (?, ?, ?, ?, ?, ?)");
+    }
+
+    std::optional<Hits> lookup(const Hash & narHash)
+    {
+        auto key = narHash.to_string(HashFormat::SRI, true);
+        if (!queryScanned.use()(key).next()) return std::nullopt;
+        Hits hits;
+        auto q(queryHits.use()(key));
+        while (q.next())
+            hits[q.getStr(0)].push_back(Hit {
+                .file = q.getStr(1),
+                .symlink = q.getInt(2) != 0,
+                .text = q.getStr(3),
+                .pos = (size_t) q.getInt(4),
+            });
+        return hits;
+    }
+
+    void add(const Hash & narHash, const Hits & hits)
+    {
+        auto key = narHash.to_string(HashFormat::SRI, true);
+        SQLiteTxn txn(db);
+        insertScanned.use()(key)(time(nullptr)).exec();
+        for (auto & [hash, hashHits] : hits)
+            for (auto & hit : hashHits)
+                insertHit.use()(key)(hash)(hit.file)(hit.symlink ? 1 : 0)(hit.text)(hit.pos).exec();
+        txn.commit();
+    }
+};
+
 struct CmdWhyDepends : SourceExprCommand, MixOperateOnOptions
 {
     std::string _package, _dependency;
@@ -166,6 +260,94 @@ struct CmdWhyDepends : SourceExprCommand, MixOperateOnOptions
             }
         }
 
+        std::optional<ReferenceIndex> index;
+        if (precise)
+            try {
+                index.emplace();
+            } catch (Error & e) {
+                debug("cannot open the reference index: %s", e.msg());
+            }
+
+        /* Find the files and symlinks in `node` that contain each of
+           its references, scanning every file only once for all of
+           them. */
+        auto getHits = [&](const Node & node) -> Hits
+        {
+            auto narHash = store->queryPathInfo(node.path)->narHash;
+
+            if (index)
+                if (auto hits = index->lookup(narHash))
+                    return *hits;
+
+            StringSet hashes;
+            for (auto & ref : node.refs)
+                hashes.insert(std::string(ref.hashPart()));
+
+            auto pathS = store->printStorePath(node.path);
+
+            Hits hits;
+
+            std::function<void(const Path &)> visitPath;
+
+            visitPath = [&](const Path & p) {
+                auto st = accessor->stat(p);
+
+                auto p2 = p == pathS ? "/" : std::string(p, pathS.size() + 1);
+
+                if (st.type == FSAccessor::Type::tDirectory) {
+                    auto names = accessor->readDirectory(p);
+                    for (auto & name : names)
+                        visitPath(p + "/" + name);
+                }
+
+                else if (st.type == FSAccessor::Type::tRegular) {
+                    auto contents = accessor->readFile(p);
+
+                    RefScanSink scanner { StringSet(hashes) };
+                    scanner(contents);
+
+                    for (auto & hash : scanner.getResult()) {
+                        auto pos = contents.find(hash);
+                        assert(pos != std::string::npos);
+                        size_t margin = 32;
+                        auto pos2 = pos >= margin ? pos - margin : 0;
+                        hits[hash].push_back(Hit {
+                            .file = p2,
+                            .symlink = false,
+                            .text = filterPrintable(std::string(contents, pos2, pos - pos2 + hash.size() + margin)),
+                            .pos = pos - pos2,
+                        });
+                    }
+                }
+
+                else if (st.type == FSAccessor::Type::tSymlink) {
+                    auto target = accessor->readLink(p);
+
+                    for (auto & hash : hashes) {
+                        auto pos = target.find(hash);
+                        if (pos != std::string::npos)
+                            hits[hash].push_back(Hit {
+                                .file = p2,
+                                .symlink = true,
+                                .text = target,
+                                .pos = pos,
+                            });
+                    }
+                }
+            };
+
+            visitPath(pathS);
+
+            if (index)
+                try {
+                    index->add(narHash, hits);
+                } catch (Error & e) {
+                    debug("cannot update the reference index: %s", e.msg());
+                }
+
+            return hits;
+        };
+
         /* Print the subgraph of nodes that have 'dependency' in their
            closure (i.e., that have a non-infinite distance to
            'dependency'). Print every edge on a path between `package`
@@ -196,81 +378,33 @@ struct CmdWhyDepends : SourceExprCommand, MixOperateOnOptions
             /* Sort the references by distance to `dependency` to
                ensure that the shortest path is printed first. */
             std::multimap<size_t, Node *> refs;
-            std::set<std::string> hashes;
 
             for (auto & ref : node.refs) {
                 if (ref == node.path && packagePath != dependencyPath) continue;
                 auto & node2 = graph.at(ref);
                 if (node2.dist == inf) continue;
                 refs.emplace(node2.dist, &node2);
-                hashes.insert(std::string(node2.path.hashPart()));
             }
 
             /* For each reference, find the files and symlinks that
                contain the reference. */
-            std::map<std::string, Strings> hits;
-
-            std::function<void(const Path &)> visitPath;
-
-            visitPath = [&](const Path & p) {
-                auto st = accessor->stat(p);
-
-                auto p2 = p == pathS ? "/" : std::string(p, pathS.size() + 1);
-
-                auto getColour = [&](const std::string & hash) {
-                    return hash == dependencyPathHash ? ANSI_GREEN : ANSI_BLUE;
-                };
-
-                if (st.type == FSAccessor::Type::tDirectory) {
-                    auto names = accessor->readDirectory(p);
-                    for (auto & name : names)
-                        visitPath(p + "/" + name);
-                }
-
-                else if (st.type == FSAccessor::Type::tRegular) {
-                    auto contents = accessor->readFile(p);
-
-                    for (auto & hash : hashes) {
-                        auto pos = contents.find(hash);
-                        if (pos != std::string::npos) {
-                            size_t margin = 32;
-                            auto pos2 = pos >= margin ? pos - margin : 0;
-                            hits[hash].emplace_back(fmt("%s: …%s…",
-                                    p2,
-                                    hilite(filterPrintable(
-                                            std::string(contents, pos2, pos - pos2 + hash.size() + margin)),
-                                        pos - pos2, StorePath::HashLen,
-                                        getColour(hash))));
-                        }
-                    }
-                }
-
-                else if (st.type == FSAccessor::Type::tSymlink) {
-                    auto target = accessor->readLink(p);
-
-                    for (auto & hash : hashes) {
-                        auto pos = target.find(hash);
-                        if (pos != std::string::npos)
-                            hits[hash].emplace_back(fmt("%s -> %s", p2,
-                                    hilite(target, pos, StorePath::HashLen, getColour(hash))));
-                    }
-                }
-            };
-
-            // FIXME: should use scanForReferences().
-
-            if (precise) visitPath(pathS);
+            Hits hits;
+            if (precise) hits = getHits(node);
 
             for (auto & ref : refs) {
                 std::string hash(ref.second->path.hashPart());
 
                 bool last = all ? ref == *refs.rbegin() : true;
 
+                auto colour = hash == dependencyPathHash ? ANSI_GREEN : ANSI_BLUE;
+
                 for (auto & hit : hits[hash]) {
-                    bool first = hit == *hits[hash].begin();
+                    bool first = &hit == &*hits[hash].begin();
                     logger->cout("%s%s%s", tailPad,
                               (first ? (last ? treeLast : treeConn) : (last ? treeNull : treeLine)),
-                              hit);
+                              hit.symlink
+                              ? fmt("%s -> %s", hit.file, hilite(hit.text, hit.pos, StorePath::HashLen, colour))
+                              : fmt("%s: …%s…", hit.file, hilite(hit.text, hit.pos, StorePath::HashLen, colour)));
                     if (!all) break;
                 }
 
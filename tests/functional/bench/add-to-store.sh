@@ -0,0 +1,12 @@
+source common.sh
+
+clearStore
+
+makeTrees > "$TEST_ROOT/trees.list"
+
+benchEach add-to-store-local nix-store --add < "$TEST_ROOT/trees.list"
+
+clearStore
+startDaemon
+
+benchEach add-to-store-daemon nix-store --add < "$TEST_ROOT/trees.list"
@@ -0,0 +1,77 @@
+source ../common.sh
+
+# Knobs for the size of the workload.
+: "${BENCH_PATHS:=200}"
+: "${BENCH_JOBS:=8}"
+
+# If set, every result is also appended to this file as a JSON object
+# per line.
+: "${BENCH_OUT:=}"
+
+# Print a result, and record it in $BENCH_OUT.
+_benchReport() {
+    local name=$1 ops=$2 wallNs=$3 p50Ns=$4 p99Ns=$5
+    awk -v name="$name" -v ops="$ops" -v wall="$wallNs" -v p50="$p50Ns" -v p99="$p99Ns" -v out="$BENCH_OUT" '
+        BEGIN {
+            rate = wall > 0 ? ops / (wall / 1e9) : 0
+            if (p50 != "")
+                printf "%s: %d ops in %.2f s, %.1f ops/s, p50 %.2f ms, p99 %.2f ms\n", name, ops, wall / 1e9, rate, p50 / 1e6, p99 / 1e6
+            else
+                printf "%s: %d ops in %.2f s, %.1f ops/s\n", name, ops, wall / 1e9, rate
+            if (out != "") {
+                printf "{\"name\":\"%s\",\"ops\":%d,\"seconds\":%.6f,\"opsPerSecond\":%.3f", name, ops, wall / 1e9, rate >> out
+                if (p50 != "")
+                    printf ",\"p50Ms\":%.3f,\"p99Ms\":%.3f", p50 / 1e6, p99 / 1e6 >> out
+                printf "}\n" >> out
+            }
+        }' >&2
+}
+
+# Run `"$@" ARG` for every ARG read from stdin, $BENCH_JOBS at a time,
+# and report the throughput and the latency percentiles as `name`.
+benchEach() {
+    local name=$1; shift
+    local latencies=$TEST_ROOT/bench-$name.latencies
+    rm -f "$latencies"
+    local start end
+    start=$(date +%s%N)
+    LATENCIES=$latencies xargs -P "$BENCH_JOBS" -I '{}' bash -c '
+        start=$(date +%s%N)
+        "$@" > /dev/null
+        echo $(( $(date +%s%N) - start )) >> "$LATENCIES"
+    ' _ "$@" '{}'
+    end=$(date +%s%N)
+    sort -n "$latencies" | awk '
+        { l[NR] = $1 }
+        function percentile(p,  i) { i = int(NR * p + 0.999999); return l[i < 1 ? 1 : i] }
+        END { print NR, percentile(0.5), percentile(0.99) }' | {
+        read -r ops p50 p99
+        _benchReport "$name" "$ops" "$((end - start))" "$p50" "$p99"
+    }
+}
+
+# Run `"$@"` once and report its throughput as `name`, counting `ops`
+# operations.
+benchOnce() {
+    local name=$1 ops=$2; shift 2
+    local start end
+    start=$(date +%s%N)
+    "$@" > /dev/null
+    end=$(date +%s%N)
+    _benchReport "$name" "$ops" "$((end - start))" "" ""
+}
+
+# Create $BENCH_PATHS small source trees under $TEST_ROOT/trees and
+# print their paths.
+makeTrees() {
+    local n
+    mkdir -p "$TEST_ROOT/trees"
+    for ((n = 0; n < BENCH_PATHS; n++)); do
+        local tree=$TEST_ROOT/trees/tree-$n
+        mkdir -p "$tree/sub"
+        echo "tree $n" > "$tree/README"
+        head -c 65536 /dev/urandom > "$tree/sub/data"
+        ln -sf README "$tree/link"
+        echo "$tree"
+    done
+}
@@ -0,0 +1,10 @@
+source common.sh
+
+clearStore
+
+makeTrees | xargs nix-store --add > "$TEST_ROOT/paths.list"
+
+otherStore=$TEST_ROOT/other-store
+rm -rf "$otherStore"
+
+benchOnce copy-local-to-local "$BENCH_PATHS" nix copy --to "$otherStore" $(cat "$TEST_ROOT/paths.list")
@@ -0,0 +1,7 @@
+source common.sh
+
+clearStore
+
+makeTrees | xargs nix-store --add > /dev/null
+
+benchOnce gc-delete "$BENCH_PATHS" nix-store --gc
@@ -0,0 +1,22 @@
+# Store throughput benchmarks. They use the functional test setup, but
+# are not part of `make installcheck`; run them with `make store-bench`.
+
+store-bench-tests := \
+  $(d)/add-to-store.sh \
+  $(d)/query-path-info.sh \
+  $(d)/copy.sh \
+  $(d)/gc.sh \
+  $(d)/substitute.sh
+
+define run-store-bench
+
+  .PHONY: $1.bench
+  $1.bench: $1 tests/functional/common/vars-and-functions.sh tests/functional/config.nix
+	@env BASH=$(bash) $(bash) mk/debug-test.sh $1 < /dev/null
+
+endef
+
+$(foreach test, $(store-bench-tests), $(eval $(call run-store-bench,$(test))))
+
+.PHONY: store-bench
+store-bench: $(foreach test, $(store-bench-tests), $(test).bench)
@@ -0,0 +1,13 @@
+source common.sh
+
+clearStore
+
+makeTrees | xargs nix-store --add > "$TEST_ROOT/paths.list"
+
+startDaemon
+
+# Each query is a separate client connection, $BENCH_JOBS at a time.
+benchEach query-path-info-daemon nix path-info < "$TEST_ROOT/paths.list"
+
+# One client querying all paths over a single connection.
+benchOnce query-path-info-daemon-batch "$BENCH_PATHS" nix path-info $(cat "$TEST_ROOT/paths.list")
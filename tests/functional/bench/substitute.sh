@@ -0,0 +1,14 @@
+source common.sh
+
+clearStore
+clearCache
+
+makeTrees | xargs nix-store --add > "$TEST_ROOT/paths.list"
+
+nix copy --to "file://$cacheDir" $(cat "$TEST_ROOT/paths.list")
+
+clearStore
+clearCacheCache
+
+benchOnce substitute-file-cache "$BENCH_PATHS" \
+    nix-store -r $(cat "$TEST_ROOT/paths.list") --substituters "file://$cacheDir" --no-require-sigs
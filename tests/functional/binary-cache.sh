@@ -14,6 +14,22 @@ outPath=$(nix-build dependencies.nix --no-out-link)
 
 nix copy --to file://$cacheDir $outPath
 
+# Test compressing and uploading with a single thread each.
+rm -rf $TEST_ROOT/pipeline-cache
+nix copy --to "file://$TEST_ROOT/pipeline-cache?compression-jobs=1&upload-jobs=1" $outPath
+diff <(nix path-info --store file://$cacheDir -r $outPath) <(nix path-info --store file://$TEST_ROOT/pipeline-cache -r $outPath)
+
+# Test chunked binary caches.
+chunkedCache=$TEST_ROOT/chunked-cache
+chunkCache=$TEST_ROOT/chunk-cache
+rm -rf $chunkedCache $chunkCache
+nix copy --to "file://$chunkedCache?write-nar-chunks=true" $outPath
+grep -q '^Chunks: ' $chunkedCache/$(hashpart $outPath).narinfo
+(! grep -q '^URL: ' $chunkedCache/$(hashpart $outPath).narinfo)
+[[ -n $(ls $chunkedCache/chunks) ]]
+[[ $(nix store cat --store "file://$chunkedCache?local-chunk-cache=$chunkCache" $outPath/foobar) = FOOBAR ]]
+[[ -n $(ls $chunkCache) ]]
+
 # Test copying build logs to the binary cache.
 expect 1 nix log --store file://$cacheDir $outPath 2>&1 | grep 'is not available'
 nix store copy-log --to file://$cacheDir $outPath
@@ -212,10 +228,22 @@ mkdir $narCache
 
 [[ $(nix store cat --store "file://$cacheDir?local-nar-cache=$narCache" $outPath/foobar) = FOOBAR ]]
 
+# A NAR cache that is too small for any NAR keeps nothing.
+smallNarCache=$TEST_ROOT/small-nar-cache
+rm -rf $smallNarCache
+mkdir $smallNarCache
+[[ $(nix store cat --store "file://$cacheDir?local-nar-cache=$smallNarCache&local-nar-cache-size=1" $outPath/foobar) = FOOBAR ]]
+[[ -z $(find "$smallNarCache" -name '*.nar') ]]
+
 rm -rfv "$cacheDir/nar"
 
 [[ $(nix store cat --store "file://$cacheDir?local-nar-cache=$narCache" $outPath/foobar) = FOOBAR ]]
 
+# Without a listing, the cached NAR is indexed again.
+rm -f "$narCache"/*.ls
+[[ $(nix store cat --store "file://$cacheDir?local-nar-cache=$narCache" $outPath/foobar) = FOOBAR ]]
+[[ -n $(ls "$narCache"/*.ls) ]]
+
 (! nix store cat --store file://$cacheDir $outPath/foobar)
 
 
@@ -236,6 +264,34 @@ diff -u \
     <(jq -S < $cacheDir/$(basename $outPath | cut -c1-32).ls) \
     <(echo '{"version":1,"root":{"type":"directory","entries":{"bar":{"type":"regular","size":4,"narOffset":232},"link":{"type":"symlink","target":"xyzzy"}}}}' | jq -S)
 
+# With an uncompressed NAR, only the parts of the NAR that are needed
+# are fetched. Check this by corrupting the end of the NAR, which would
+# make parsing the whole NAR fail.
+clearCache
+nix copy --to "file://$cacheDir?write-nar-listing=1&compression=none" $outPath
+narFile=$(echo $cacheDir/nar/*.nar)
+printf 'garbage!' | dd of=$narFile bs=1 seek=$(($(stat -c %s $narFile) - 8)) conv=notrunc
+[[ $(nix store cat --store file://$cacheDir $outPath/bar) = foo ]]
+
+# The same applies to NARs compressed with zstd-seekable, which can also
+# be decompressed as a whole.
+clearCache
+nix copy --to "file://$cacheDir?write-nar-listing=1&compression=zstd-seekable" $outPath
+grep -q 'Compression: zstd-seekable' $cacheDir/*.narinfo
+[[ $(nix store cat --store file://$cacheDir $outPath/bar) = foo ]]
+nix store ls --store file://$cacheDir -R $outPath | grep -q link
+nix store dump-path --store file://$cacheDir $outPath > $TEST_ROOT/seekable.nar
+[[ $(nix nar cat $TEST_ROOT/seekable.nar /bar) = foo ]]
+
+# Large NARs can be downloaded in parts over several connections.
+clearCache
+head -c 40000000 /dev/urandom > $TEST_ROOT/big
+bigPath=$(nix-store --add $TEST_ROOT/big)
+nix copy --to "file://$cacheDir?compression=none" $bigPath
+nix store dump-path --store "file://$cacheDir?download-connections=4&parallel-download-threshold=1" $bigPath > $TEST_ROOT/big.nar
+cmp $TEST_ROOT/big.nar <(nix-store --dump $bigPath)
+rm $TEST_ROOT/big $TEST_ROOT/big.nar
+
 
 # Test debug info index generation.
 clearCache
@@ -284,3 +340,26 @@ nix-store --delete $outPath $docPath
 # -vvv is the level that logs during the loop
 timeout 60 nix-build --no-out-link -E "$expr" --option substituters "file://$cacheDir" \
   --option trusted-binary-caches "file://$cacheDir"  --no-require-sigs
+
+# Test substituting a path using a binary delta against a previous version.
+clearStore
+clearCache
+head -c 1000000 /dev/urandom > $TEST_ROOT/delta-base
+cp $TEST_ROOT/delta-base $TEST_ROOT/delta-target
+echo changed >> $TEST_ROOT/delta-target
+basePath=$(nix store add-path --name delta-1.0 $TEST_ROOT/delta-base)
+targetPath=$(nix store add-path --name delta-1.1 $TEST_ROOT/delta-target)
+nix copy --to file://$cacheDir $basePath $targetPath
+
+nix store add-delta --to file://$cacheDir --base $basePath $targetPath
+grep -q "DeltaBase: $(basename $basePath)" $cacheDir/$(hashpart $targetPath).narinfo
+
+nix-store --delete $targetPath
+clearCacheCache
+nix-store -r $targetPath --substituters file://$cacheDir --no-require-sigs -vvvvv 2>&1 | grep -q 'reconstructing'
+cmp $targetPath $TEST_ROOT/delta-target
+
+# Without the base, the full NAR is fetched.
+nix-store --delete $targetPath $basePath
+nix-store -r $targetPath --substituters file://$cacheDir --no-require-sigs
+cmp $targetPath $TEST_ROOT/delta-target
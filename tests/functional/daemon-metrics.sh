@@ -0,0 +1,24 @@
+source common.sh
+
+clearStore
+
+port=$((20000 + RANDOM % 20000))
+
+export NIX_CONFIG="metrics-address = 127.0.0.1:$port"
+startDaemon
+unset NIX_CONFIG
+
+outPath=$(nix-build dependencies.nix --no-out-link)
+nix path-info $outPath
+
+exec 3<>/dev/tcp/127.0.0.1/$port
+printf 'GET /metrics HTTP/1.0\r\n\r\n' >&3
+cat <&3 > $TEST_ROOT/metrics
+exec 3<&-
+
+grep -q '^HTTP/1.0 200 OK' $TEST_ROOT/metrics
+grep -q '^nix_daemon_op_duration_seconds_count{op="BuildPaths.*"} [1-9]' $TEST_ROOT/metrics
+grep -q '^nix_daemon_connections_total [1-9]' $TEST_ROOT/metrics
+grep -q '^nix_builds_started_total [1-9]' $TEST_ROOT/metrics
+
+killDaemon
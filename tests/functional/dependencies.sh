@@ -18,6 +18,13 @@ fi
 # Test GraphML graph generation
 nix-store -q --graphml "$drvPath" > $TEST_ROOT/graphml
 
+# Test JSON Lines graph generation: one line per path in the closure,
+# referring to other lines by number.
+nix-store -q --graph-jsonl "$drvPath" > $TEST_ROOT/graph.jsonl
+[[ $(wc -l < $TEST_ROOT/graph.jsonl) = $(nix-store -qR "$drvPath" | wc -l) ]]
+[[ $(jq --arg p "$drvPath" 'select(.path == $p) | .references | length' < $TEST_ROOT/graph.jsonl) = $(nix-store -q --references "$drvPath" | wc -l) ]]
+jq -se 'length as $n | all(.references[]; . < $n)' < $TEST_ROOT/graph.jsonl
+
 outPath=$(nix-store -rvv "$drvPath") || fail "build failed"
 
 # Test Graphviz graph generation.
@@ -34,3 +34,21 @@ clearStore
 # Regression test: the derivers in exp_all2 are empty, which shouldn't
 # cause a failure.
 nix-store --import < $TEST_ROOT/exp_all2
+
+# The indexed format, with and without compression.
+nix-store --export --format 2 $(nix-store -qR $outPath) > $TEST_ROOT/exp_v2
+nix-store --export --format 2 --compression xz $(nix-store -qR $outPath) > $TEST_ROOT/exp_v2_xz
+
+for archive in exp_v2 exp_v2_xz; do
+    clearStore
+    nix-store --import < $TEST_ROOT/$archive
+    nix-store --verify-path $(nix-store -qR $outPath)
+done
+
+clearStore
+
+head -c 1000 $TEST_ROOT/exp_v2 > $TEST_ROOT/exp_v2_truncated
+if nix-store --import < $TEST_ROOT/exp_v2_truncated; then
+    echo "importing a truncated archive should fail"
+    exit 1
+fi
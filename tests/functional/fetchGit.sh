@@ -233,6 +233,13 @@ rev_tag1=$(git -C $repo rev-parse refs/tags/tag1)
 rev_tag2_nix=$(nix eval --impure --raw --expr "(builtins.fetchGit { url = \"file://$repo\"; ref = \"refs/tags/tag2\"; }).rev")
 rev_tag2=$(git -C $repo rev-parse refs/tags/tag2)
 [[ $rev_tag2_nix = $rev_tag2 ]]
+
+# A shallow fetch of a remote repository only fetches the requested
+# revision, into a separate shallow clone.
+path10=$(nix eval --impure --raw --expr "(builtins.fetchGit { url = \"file://$repo\"; rev = \"$rev4\"; shallow = true; }).outPath")
+[[ $path10 = $path7 ]]
+[[ $(git -C $TEST_HOME/.cache/nix/gitv3/*-shallow rev-parse --is-shallow-repository) = true ]]
+[[ $(nix eval --impure --expr "(builtins.fetchGit { url = \"file://$repo\"; rev = \"$rev4\"; shallow = true; }).revCount or 123") == 123 ]]
 unset _NIX_FORCE_HTTP
 
 # should fail if there is no repo
@@ -33,6 +33,14 @@ outPath=$(nix-build -vvvvv --expr 'import <nix/fetchurl.nix>' --argstr url file:
 
 cmp $outPath fetchurl.sh
 
+# A download with the wrong hash is rejected by the builder itself.
+clearStore
+
+badHash=$(nix hash file ./common.sh)
+
+(! nix-build --expr 'import <nix/fetchurl.nix>' --argstr url file://$(pwd)/fetchurl.sh --argstr hash $badHash --no-out-link 2> $TEST_ROOT/log)
+grepQuiet 'hash mismatch in file downloaded from' $TEST_ROOT/log
+
 # Test that we can substitute from a different store dir.
 clearStore
 
@@ -0,0 +1,37 @@
+source common.sh
+
+clearStore
+
+drvPath=$(nix-instantiate dependencies.nix)
+outPath=$(nix-store -rvv "$drvPath")
+
+# Set a GC root.
+rm -f "$NIX_STATE_DIR"/gcroots/foo
+ln -sf $outPath "$NIX_STATE_DIR"/gcroots/foo
+
+nix-collect-garbage --option gc-delete-jobs 4
+
+# Check that the root and its dependencies haven't been deleted.
+cat $outPath/foobar
+cat $outPath/reference-to-input-2/bar
+
+# Check that the derivation has been GC'd.
+if test -e $drvPath; then false; fi
+
+# Check that paths are deleted from the database as well.
+if nix-store -q --hash $drvPath; then false; fi
+
+rm "$NIX_STATE_DIR"/gcroots/foo
+
+# With a limit, only part of the garbage should be deleted.
+nix-store --gc --max-freed 1 --option gc-delete-jobs 4
+test -e $outPath/foobar || test -e $outPath/reference-to-input-2/bar
+
+nix-collect-garbage --option gc-delete-jobs 4
+
+# Check that the output has been GC'd.
+if test -e $outPath/foobar; then false; fi
+
+# Check that the store is empty, and that no trash was left behind.
+rmdir $NIX_STORE_DIR/.links
+rmdir $NIX_STORE_DIR
@@ -0,0 +1,33 @@
+with import ./config.nix;
+
+let
+
+  # Each of these waits for a while for the other one to start, and
+  # records whether it did, so we can tell whether they were built
+  # at the same time.
+  mkImported = name: other: mkDerivation {
+    name = "imported-${name}";
+    buildCommand = ''
+      touch ${shared}.${name}
+      for i in $(seq 1 100); do
+        if [ -e ${shared}.${other} ]; then
+          echo '"parallel"' > $out
+          exit 0
+        fi
+        sleep 0.1
+      done
+      echo '"serial"' > $out
+    '';
+  };
+
+  mkTop = name: other: mkDerivation {
+    name = "top-${name}";
+    buildCommand = "echo -n ${import (mkImported name other)} > $out";
+  };
+
+in
+
+{
+  a = mkTop "a" "b";
+  b = mkTop "b" "a";
+}
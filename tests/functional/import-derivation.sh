@@ -10,3 +10,15 @@ fi
 outPath=$(nix-build ./import-derivation.nix --no-out-link)
 
 [ "$(cat $outPath)" = FOO579 ]
+
+# The imports needed by several installables are built together
+# rather than one at a time.
+clearStore
+rm -f "$_NIX_TEST_SHARED".*
+
+outPaths=$(nix build -f ./import-derivation-batched.nix a b -j2 --no-link --print-out-paths)
+
+for outPath in $outPaths; do
+    [ "$(cat $outPath)" = parallel ]
+done
+[ "$(echo $outPaths | wc -w)" = 2 ]
@@ -0,0 +1,22 @@
+builtins.fromTOML ''
+  # This file is automatically @generated by Cargo.
+  # It is not intended for manual editing.
+  version = 3
+
+  [[package]]
+  name = "aho-corasick"
+  version = "1.0.2"
+  source = "registry+https://github.com/rust-lang/crates.io-index"
+  checksum = "43f6cb1bf222025340178f382c426f13757b2960e89779dfcb319c32542a5a41"
+  dependencies = [
+   "memchr",
+  ]
+
+  [[package]]
+  name = "memchr"
+  version = "2.5.0"
+
+  [metadata]
+  "checksum memchr 2.5.0" = "abc"
+  inline = { a.b = -1, c = [ true, false ] }
+''
@@ -0,0 +1,16 @@
+with builtins;
+
+let
+  xs = [ { k = 3; n = "a"; } { k = 1; n = "b"; } { k = 3.0; n = "c"; } { k = 2; n = "d"; } ];
+  names = map (x: x.n);
+  n = 100000;
+in
+[ (names (sort (a: b: a.k < b.k) xs))
+  (names (sort (a: b: a.k > b.k) xs))
+  (map (x: elemAt x 1) (sort (a: b: head a < head b) [ [ "b" 1 ] [ "a" 2 ] [ "b" 3 ] ]))
+  (sort lessThan [ 3 1.5 2 ])
+  (let __lessThan = a: b: lessThan b a; in sort (a: b: a < b) [ 1 3 2 ])
+  (sort (a: b: a.x < b.y) [ { x = 2; y = 1; } { x = 1; y = 2; } ])
+  (sort lessThan (genList (i: n - i) n) == genList (i: i + 1) n)
+  (map (x: x.s) (sort (a: b: a.s < b.s) (genList (i: { s = toString (n - i); }) n)) == sort lessThan (genList (i: toString (i + 1)) n))
+]
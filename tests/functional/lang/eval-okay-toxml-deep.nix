@@ -0,0 +1,4 @@
+# Deeply nested values are printed without recursing.
+let
+  deep = builtins.foldl' (x: _: [ x ]) 1 (builtins.genList (x: x) 2000);
+in builtins.stringLength (builtins.toXML deep)
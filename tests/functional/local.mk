@@ -18,6 +18,8 @@ nix_tests = \
   gc.sh \
   nix-collect-garbage-d.sh \
   remote-store.sh \
+  threaded-daemon.sh \
+  daemon-metrics.sh \
   legacy-ssh-store.sh \
   lang.sh \
   lang-test-infra.sh \
@@ -48,6 +50,7 @@ nix_tests = \
   signing.sh \
   hash.sh \
   gc-non-blocking.sh \
+  gc-parallel.sh \
   check.sh \
   nix-shell.sh \
   check-refs.sh \
@@ -78,6 +81,7 @@ nix_tests = \
   export.sh \
   config.sh \
   add.sh \
+  memory-store.sh \
   local-store.sh \
   filter-source.sh \
   misc.sh \
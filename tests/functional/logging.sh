@@ -24,3 +24,9 @@ outp="$(nix-build -E \
 test -d "$outp"
 
 nix log "$outp"
+
+# Test --trace-file.
+clearStore
+nix-build dependencies.nix --no-out-link --trace-file "$TEST_ROOT/trace.json"
+jq -e '.traceEvents | any(.cat == "eval" and (.name | startswith("parse ")))' "$TEST_ROOT/trace.json"
+jq -e '.traceEvents | any(.cat == "eval" and .name == "instantiate dependencies-top")' "$TEST_ROOT/trace.json"
@@ -0,0 +1,12 @@
+source common.sh
+
+# Instantiating derivations and copying sources into an in-memory store
+# gives the same paths as with a real store.
+drvPath=$(nix-instantiate dependencies.nix)
+[[ $(nix-instantiate --store memory:// dependencies.nix) = "$drvPath" ]]
+
+[[ $(nix eval --store memory:// --raw --impure --expr "\"\${./config.nix}\"") = $(nix-store --add ./config.nix) ]]
+
+# Nothing is written to the real store.
+[[ $(nix-instantiate --store memory:// --expr 'builtins.toFile "memory-store-test" "foo"') =~ memory-store-test ]]
+(! ls "$NIX_STORE_DIR" | grep memory-store-test)
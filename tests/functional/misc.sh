@@ -30,3 +30,12 @@ expectStderr 1 nix-instantiate --eval -E '[]' -A 'x' | grepQuiet "should be a se
 expectStderr 1 nix-instantiate --eval -E '{}' -A '1' | grepQuiet "should be a list"
 expectStderr 1 nix-instantiate --eval -E '{}' -A '.' | grepQuiet "empty attribute name"
 expectStderr 1 nix-instantiate --eval -E '[]' -A '1' | grepQuiet "out of range"
+
+# `nix --version` takes a shortcut, so check that it still works.
+nix --version | grep "$version"
+
+# Startup profiling.
+startupProfile=$(nix --startup-profile eval --expr 1 2>&1)
+echo "$startupProfile" | grepQuiet "load configuration"
+echo "$startupProfile" | grepQuiet "create evaluator"
+echo "$startupProfile" | grepQuiet "total"
@@ -54,3 +54,30 @@ if nix-store --dump $storePath >/dev/full ; then
     echo "dumping to /dev/full should fail"
     exit -1
 fi
+
+# Files too large for the content cache are copied by the kernel when
+# dumping to a file or a pipe. Check that the result is the same.
+mkdir -p "$TEST_ROOT/large"
+head -c 5000001 /dev/urandom > "$TEST_ROOT/large/data"
+echo foo > "$TEST_ROOT/large/small"
+largePath=$(nix-store --add "$TEST_ROOT/large")
+nix-store --dump $largePath > "$TEST_ROOT/large.nar"
+diff -u \
+    <(nix-hash --type sha256 --flat --base32 "$TEST_ROOT/large.nar") \
+    <(nix-store -q --hash $largePath | sed 's/^sha256://')
+nix-store --dump $largePath | cmp - "$TEST_ROOT/large.nar"
+nix nar cat "$TEST_ROOT/large.nar" /data | cmp - "$TEST_ROOT/large/data"
+
+# Unpacking with several threads gives the same result.
+mkdir -p "$TEST_ROOT/many/sub"
+for i in $(seq 1 300); do echo $i > "$TEST_ROOT/many/sub/$i"; done
+cp "$TEST_ROOT/large/data" "$TEST_ROOT/many/large"
+echo 'echo hi' > "$TEST_ROOT/many/exe"
+chmod +x "$TEST_ROOT/many/exe"
+ln -s sub/1 "$TEST_ROOT/many/link"
+manyPath=$(nix-store --add "$TEST_ROOT/many")
+nix-store --dump $manyPath > "$TEST_ROOT/many.nar"
+rm -rf "$TEST_ROOT/many-restored"
+nix-store --option restore-jobs 4 --restore "$TEST_ROOT/many-restored" < "$TEST_ROOT/many.nar"
+nix-store --dump "$TEST_ROOT/many-restored" | cmp - "$TEST_ROOT/many.nar"
+[[ -x "$TEST_ROOT/many-restored/exe" ]]
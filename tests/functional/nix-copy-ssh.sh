@@ -18,3 +18,17 @@ clearStore
 nix copy --no-check-sigs --from "ssh://localhost?store=$NIX_STORE_DIR&remote-store=$remoteRoot%3fstore=$NIX_STORE_DIR%26real=$remoteRoot$NIX_STORE_DIR" $outPath
 
 [ -f $outPath/foobar ]
+
+# The same with compression, which also makes the NARs go in a single stream.
+chmod -R u+w "$remoteRoot"
+rm -rf "$remoteRoot"
+
+nix copy --to "ssh://localhost?store=$NIX_STORE_DIR&nar-compression=zstd&remote-store=$remoteRoot%3fstore=$NIX_STORE_DIR%26real=$remoteRoot$NIX_STORE_DIR" $outPath
+
+[ -f $remoteRoot$outPath/foobar ]
+
+clearStore
+
+nix copy --no-check-sigs --from "ssh://localhost?store=$NIX_STORE_DIR&nar-compression=zstd&remote-store=$remoteRoot%3fstore=$NIX_STORE_DIR%26real=$remoteRoot$NIX_STORE_DIR" $outPath
+
+[ -f $outPath/foobar ]
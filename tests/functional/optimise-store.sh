@@ -36,6 +36,20 @@ if [ "$inode1" != "$inode3" ]; then
     exit 1
 fi
 
+# A second run should only process the new path, using the index
+# from the first run.
+[[ -e $NIX_STATE_DIR/db/optimise.sqlite ]]
+
+outPath4=$(echo 'with import ./config.nix; mkDerivation { name = "foo4"; builder = builtins.toFile "builder" "mkdir $out; echo hello > $out/foo"; }' | nix-build - --no-out-link)
+
+NIX_REMOTE="" nix-store --optimise
+
+inode4="$(stat --format=%i $outPath4/foo)"
+if [ "$inode1" != "$inode4" ]; then
+    echo "inodes do not match"
+    exit 1
+fi
+
 nix-store --gc
 
 if [ -n "$(ls $NIX_STORE_DIR/.links)" ]; then
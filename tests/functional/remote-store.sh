@@ -40,4 +40,35 @@ nix-store --dump-db > $TEST_ROOT/d1
 NIX_REMOTE= nix-store --dump-db > $TEST_ROOT/d2
 cmp $TEST_ROOT/d1 $TEST_ROOT/d2
 
+# Closures are computed with batched path info queries.
+outPath=$(nix-build dependencies.nix --no-out-link)
+diff <(nix path-info -r $outPath) <(NIX_REMOTE= nix path-info -r $outPath)
+
+# With a single pooled connection, concurrent queries go over a
+# multiplexed connection.
+rm -rf $TEST_ROOT/mux-cache
+nix copy --store 'daemon?max-connections=1' --to file://$TEST_ROOT/mux-cache $outPath
+diff <(nix path-info --store 'daemon?max-connections=1' -r $outPath) \
+     <(nix path-info --store 'daemon?max-connections=1&multiplex-queries=false' -r $outPath)
+
+# Connections can be opened ahead of time and beyond max-connections.
+rm -rf $TEST_ROOT/prewarm-cache
+nix copy --store 'daemon?max-connections=2&prewarm-connections=2&burst-connections=2&burst-delay=0&multiplex-queries=false' \
+    --to file://$TEST_ROOT/prewarm-cache $outPath
+
+# NARs can be compressed on the wire.
+cmp <(nix store dump-path --store 'daemon?nar-compression=zstd' $outPath) \
+    <(NIX_REMOTE= nix store dump-path $outPath)
+rm -rf $TEST_ROOT/nar-compression-store
+path=$(nix store add-file --store $TEST_ROOT/nar-compression-store ./config.nix)
+nix copy --from $TEST_ROOT/nar-compression-store --to 'daemon?nar-compression=zstd&nar-compression-level=3' $path
+nix store verify --no-trust $path
+
+# Valid paths can be queried by hash prefix.
+rm -rf $TEST_ROOT/compact-store
+echo $RANDOM > $TEST_ROOT/compact-file
+path2=$(nix store add-file --store $TEST_ROOT/compact-store $TEST_ROOT/compact-file)
+nix copy --from $TEST_ROOT/compact-store --to 'daemon?compact-path-queries=true' $path $path2
+nix store verify --no-trust $path2
+
 killDaemon
@@ -30,6 +30,14 @@ nix store verify -r $outPath --sigs-needed 2 --trusted-public-keys "$pk1 $pk2"
 
 nix store verify --all --sigs-needed 2 --trusted-public-keys "$pk1 $pk2"
 
+# Test resuming verification from a checkpoint.
+checkpoint=$TEST_ROOT/verify-checkpoint
+rm -f $checkpoint
+expect 2 nix store verify --all --sigs-needed 2 --trusted-public-keys $pk1 --checkpoint $checkpoint
+(! grep -q "$outPath" $checkpoint)
+nix store verify -r $outPath --checkpoint $checkpoint
+[[ ! -e $checkpoint ]]
+
 # Build something unsigned.
 outPath2=$(nix-build simple.nix --no-out-link)
 
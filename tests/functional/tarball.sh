@@ -29,6 +29,9 @@ test_tarball() {
     nix-build -o $TEST_ROOT/result -E "import (fetchTarball file://$tarball)"
     # Do not re-fetch paths already present
     nix-build  -o $TEST_ROOT/result -E "import (fetchTarball { url = file:///does-not-exist/must-remain-unused/$tarball; sha256 = \"$hash\"; })"
+    # Pinned tarballs are downloaded in the background until they are needed
+    nix-build  -o $TEST_ROOT/result -E "import (fetchTarball { name = \"pinned$ext\"; url = file://$tarball; sha256 = \"$hash\"; })"
+    expectStderr 102 nix-build  -o $TEST_ROOT/result -E "import (fetchTarball { name = \"mismatch$ext\"; url = file://$tarball; sha256 = \"sha256-xdKv2pq/IiwLSnBBJXW8hNowI4MrdZfW+SYqDQs7Tzc=\"; })" | grepQuiet 'hash mismatch in file downloaded'
 
     nix-build  -o $TEST_ROOT/result -E "import (fetchTree file://$tarball)"
     nix-build  -o $TEST_ROOT/result -E "import (fetchTree { type = \"tarball\"; url = file://$tarball; })"
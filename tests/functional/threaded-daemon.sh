@@ -0,0 +1,32 @@
+source common.sh
+
+clearStore
+
+export NIX_CONFIG="daemon-threads = 2"
+startDaemon
+unset NIX_CONFIG
+
+# Building hands the connection off to a separate process.
+outPath=$(nix-build dependencies.nix --no-out-link)
+
+# Queries are served by the threads.
+[[ $(nix path-info $outPath) = $outPath ]]
+nix-store -qR $outPath | grep input-2
+
+# A client with settings of its own gets a process of its own.
+nix-store -qR $outPath --option keep-failed true | grep input-2
+
+# So do clients beyond the number of threads.
+pids=()
+for i in {1..8}; do
+    nix path-info -r $outPath > $TEST_ROOT/threaded-$i &
+    pids+=($!)
+done
+for pid in "${pids[@]}"; do
+    wait $pid
+done
+for i in {1..8}; do
+    grep -q input-2 $TEST_ROOT/threaded-$i
+done
+
+killDaemon
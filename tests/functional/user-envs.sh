@@ -17,6 +17,12 @@ outPath10=$(nix-env -f ./user-envs.nix -qa --out-path --no-name '*' | grep foo-1
 drvPath10=$(nix-env -f ./user-envs.nix -qa --drv-path --no-name '*' | grep foo-1.0)
 [ -n "$outPath10" -a -n "$drvPath10" ]
 
+# Evaluating the columns in worker processes gives the same output.
+for flags in "--out-path --drv-path" "--system --description" "--xml --out-path" "--json --out-path"; do
+    diff <(nix-env -f ./user-envs.nix -qa $flags '*') \
+        <(nix-env -f ./user-envs.nix -qa $flags '*' --option query-workers 3)
+done
+
 # Query with json
 nix-env -f ./user-envs.nix -qa --json | jq -e '.[] | select(.name == "bar-0.1") | [
     .outputName == "out",
@@ -26,6 +32,10 @@ nix-env -f ./user-envs.nix -qa --json --out-path | jq -e '.[] | select(.name ==
     .outputName == "out",
     (.outputs.out | test("'$NIX_STORE_DIR'.*-0\\.1"))
 ] | all'
+nix-env -f ./user-envs.nix -qa --json --meta-attr description | jq -e '.[] | select(.name == "bar-0.1") | [
+    (.meta.description | test("silly")),
+    (.meta | has("platforms") | not)
+] | all'
 
 # Query descriptions.
 nix-env -f ./user-envs.nix -qa '*' --description | grepQuiet silly